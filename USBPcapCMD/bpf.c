@@ -0,0 +1,1059 @@
+/*
+ * Copyright (c) 2013 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include "bpf.h"
+
+#define MAX_NODES  256
+#define MAX_LABELS 2048
+#define MAX_BYTES  64
+
+/* Scratch memory word holding usb.capdata offset */
+#define MEM_CAPDATA_OFFSET 0
+
+/* Offsets within USBPcap header */
+#define OFFSET_HEADER_LEN    0
+#define OFFSET_TRANSFER      22
+#define OFFSET_CONTROL_STAGE 27
+
+enum field_requirement
+{
+    REQUIRES_NOTHING,
+    REQUIRES_CONTROL,      /* Field present only in control transfer records */
+    REQUIRES_SETUP,        /* Field present only in SETUP stage records */
+};
+
+struct filter_field
+{
+    const char *name;   /* Wireshark field name */
+    UINT32 offset;      /* Offset within record */
+    UINT32 size;        /* Little endian field size in bytes */
+    UINT32 mask;        /* Mask applied after load, 0 if none */
+    UINT32 shift;       /* Right shift applied after mask */
+    enum field_requirement requires;
+};
+
+static const struct filter_field fields[] =
+{
+    {"usb.usbpcap_header_len",         0, 2, 0x00, 0, REQUIRES_NOTHING},
+    {"usb.usbd_status",               10, 4, 0x00, 0, REQUIRES_NOTHING},
+    {"usb.function",                  14, 2, 0x00, 0, REQUIRES_NOTHING},
+    {"usb.irp_info",                  16, 1, 0x00, 0, REQUIRES_NOTHING},
+    {"usb.irp_info.direction",        16, 1, 0x01, 0, REQUIRES_NOTHING},
+    {"usb.bus_id",                    17, 2, 0x00, 0, REQUIRES_NOTHING},
+    {"usb.device_address",            19, 2, 0x00, 0, REQUIRES_NOTHING},
+    {"usb.endpoint_address",          21, 1, 0x00, 0, REQUIRES_NOTHING},
+    {"usb.endpoint_address.direction",21, 1, 0x80, 7, REQUIRES_NOTHING},
+    {"usb.endpoint_address.number",   21, 1, 0x0F, 0, REQUIRES_NOTHING},
+    {"usb.transfer_type",             22, 1, 0x00, 0, REQUIRES_NOTHING},
+    {"usb.data_len",                  23, 4, 0x00, 0, REQUIRES_NOTHING},
+    {"usb.control_stage",             27, 1, 0x00, 0, REQUIRES_CONTROL},
+    {"usb.bmRequestType",             28, 1, 0x00, 0, REQUIRES_SETUP},
+    {"usb.bmRequestType.direction",   28, 1, 0x80, 7, REQUIRES_SETUP},
+    {"usb.bmRequestType.type",        28, 1, 0x60, 5, REQUIRES_SETUP},
+    {"usb.bmRequestType.recipient",   28, 1, 0x1F, 0, REQUIRES_SETUP},
+    {"usb.setup.bRequest",            29, 1, 0x00, 0, REQUIRES_SETUP},
+    {"usb.setup.wValue",              30, 2, 0x00, 0, REQUIRES_SETUP},
+    {"usb.setup.wIndex",              32, 2, 0x00, 0, REQUIRES_SETUP},
+    {"usb.setup.wLength",             34, 2, 0x00, 0, REQUIRES_SETUP},
+};
+
+#define CAPDATA_FIELD_NAME "usb.capdata"
+
+enum token_type
+{
+    TOKEN_END,
+    TOKEN_FIELD,
+    TOKEN_NUMBER,
+    TOKEN_BYTES,
+    TOKEN_LPAREN,
+    TOKEN_RPAREN,
+    TOKEN_LBRACKET,
+    TOKEN_RBRACKET,
+    TOKEN_COLON,
+    TOKEN_AND,
+    TOKEN_OR,
+    TOKEN_NOT,
+    TOKEN_EQ,
+    TOKEN_NE,
+    TOKEN_GT,
+    TOKEN_GE,
+    TOKEN_LT,
+    TOKEN_LE,
+    TOKEN_BITAND,
+};
+
+struct token
+{
+    enum token_type type;
+    const char *start;      /* Token position within expression */
+    size_t length;          /* Token length in characters */
+    UINT32 number;          /* TOKEN_NUMBER value */
+    unsigned char bytes[MAX_BYTES]; /* TOKEN_BYTES value */
+    UINT32 bytes_len;
+};
+
+enum node_type
+{
+    NODE_OR,
+    NODE_AND,
+    NODE_NOT,
+    NODE_TEST,
+};
+
+struct expr_node
+{
+    enum node_type type;
+    int left;     /* Operand of NODE_NOT, NODE_AND and NODE_OR */
+    int right;    /* Second operand of NODE_AND and NODE_OR */
+
+    /* NODE_TEST */
+    const struct filter_field *field; /* NULL for usb.capdata */
+    enum token_type relation;         /* TOKEN_END if field presence test */
+    UINT32 value;
+    UINT32 slice_offset;              /* usb.capdata slice */
+    UINT32 slice_length;              /* 0 if usb.capdata is not sliced */
+    unsigned char bytes[MAX_BYTES];   /* usb.capdata slice value */
+};
+
+struct compiler
+{
+    const char *expression;
+    const char *pos;        /* Next character to tokenize */
+    int brackets;           /* Nonzero when inside [], no byte strings there */
+    struct token token;     /* Current token */
+    BOOLEAN error;
+
+    struct expr_node nodes[MAX_NODES];
+    int num_nodes;
+
+    USBPCAP_BPF_INSN insn[USBPCAP_BPF_MAX_INSTRUCTIONS];
+    int jt_label[USBPCAP_BPF_MAX_INSTRUCTIONS]; /* Jump targets until resolved */
+    int jf_label[USBPCAP_BPF_MAX_INSTRUCTIONS];
+    int num_insn;
+
+    int labels[MAX_LABELS]; /* Instruction index of each label */
+    int num_labels;
+};
+
+static void compile_error(struct compiler *c, const char *position,
+                          const char *format, ...)
+{
+    va_list args;
+
+    if (c->error)
+    {
+        /* Report only the first error */
+        return;
+    }
+    c->error = TRUE;
+
+    fprintf(stderr, "Invalid capture filter at position %d: ",
+            (int)(position - c->expression) + 1);
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    else if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    else if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static BOOLEAN is_field_char(char c)
+{
+    return (isalnum((unsigned char)c) || c == '_' || c == '.') ? TRUE : FALSE;
+}
+
+/* Tries to parse byte string (hh:hh:...) at current position.
+ * Returns FALSE if there is no byte string.
+ */
+static BOOLEAN scan_bytes(struct compiler *c, struct token *token)
+{
+    const char *p = c->pos;
+    UINT32 len = 0;
+
+    for (;;)
+    {
+        if (hex_value(p[0]) < 0 || hex_value(p[1]) < 0)
+        {
+            return FALSE;
+        }
+        if (len == MAX_BYTES)
+        {
+            compile_error(c, c->pos, "byte string longer than %d bytes",
+                          MAX_BYTES);
+            return FALSE;
+        }
+        token->bytes[len++] = (unsigned char)((hex_value(p[0]) << 4) |
+                                              hex_value(p[1]));
+        p += 2;
+        if (*p != ':')
+        {
+            break;
+        }
+        p++;
+    }
+
+    if (len < 2 || is_field_char(*p))
+    {
+        /* Single byte is a number, "12:34abc" is garbage */
+        return FALSE;
+    }
+
+    token->type = TOKEN_BYTES;
+    token->bytes_len = len;
+    c->pos = p;
+    return TRUE;
+}
+
+static void next_token(struct compiler *c)
+{
+    struct token *token = &c->token;
+    const char *p;
+
+    while (isspace((unsigned char)*c->pos))
+    {
+        c->pos++;
+    }
+
+    p = c->pos;
+    token->start = p;
+
+    switch (*p)
+    {
+        case '\0':
+            token->type = TOKEN_END;
+            break;
+        case '(':
+            token->type = TOKEN_LPAREN;
+            c->pos++;
+            break;
+        case ')':
+            token->type = TOKEN_RPAREN;
+            c->pos++;
+            break;
+        case '[':
+            token->type = TOKEN_LBRACKET;
+            c->pos++;
+            break;
+        case ']':
+            token->type = TOKEN_RBRACKET;
+            c->pos++;
+            break;
+        case ':':
+            token->type = TOKEN_COLON;
+            c->pos++;
+            break;
+        case '&':
+            if (p[1] == '&')
+            {
+                token->type = TOKEN_AND;
+                c->pos += 2;
+            }
+            else
+            {
+                token->type = TOKEN_BITAND;
+                c->pos++;
+            }
+            break;
+        case '|':
+            if (p[1] != '|')
+            {
+                compile_error(c, p, "expected ||");
+                token->type = TOKEN_END;
+                return;
+            }
+            token->type = TOKEN_OR;
+            c->pos += 2;
+            break;
+        case '!':
+            if (p[1] == '=')
+            {
+                token->type = TOKEN_NE;
+                c->pos += 2;
+            }
+            else
+            {
+                token->type = TOKEN_NOT;
+                c->pos++;
+            }
+            break;
+        case '=':
+            if (p[1] != '=')
+            {
+                compile_error(c, p, "expected ==");
+                token->type = TOKEN_END;
+                return;
+            }
+            token->type = TOKEN_EQ;
+            c->pos += 2;
+            break;
+        case '>':
+            token->type = (p[1] == '=') ? TOKEN_GE : TOKEN_GT;
+            c->pos += (p[1] == '=') ? 2 : 1;
+            break;
+        case '<':
+            token->type = (p[1] == '=') ? TOKEN_LE : TOKEN_LT;
+            c->pos += (p[1] == '=') ? 2 : 1;
+            break;
+        default:
+            if ((c->brackets == 0) && scan_bytes(c, token))
+            {
+                break;
+            }
+            else if (c->error)
+            {
+                token->type = TOKEN_END;
+                return;
+            }
+
+            if (isdigit((unsigned char)*p))
+            {
+                char *end;
+
+                token->type = TOKEN_NUMBER;
+                token->number = (UINT32)strtoul(p, &end, 0);
+                if (is_field_char(*end))
+                {
+                    compile_error(c, p, "invalid number");
+                    token->type = TOKEN_END;
+                    return;
+                }
+                c->pos = end;
+            }
+            else if (isalpha((unsigned char)*p))
+            {
+                static const struct
+                {
+                    const char *word;
+                    enum token_type type;
+                } keywords[] =
+                {
+                    {"and", TOKEN_AND}, {"or", TOKEN_OR}, {"not", TOKEN_NOT},
+                    {"eq", TOKEN_EQ}, {"ne", TOKEN_NE}, {"gt", TOKEN_GT},
+                    {"ge", TOKEN_GE}, {"lt", TOKEN_LT}, {"le", TOKEN_LE},
+                };
+                size_t len;
+                int i;
+
+                while (is_field_char(*c->pos))
+                {
+                    c->pos++;
+                }
+                len = c->pos - p;
+
+                token->type = TOKEN_FIELD;
+                for (i = 0; i < sizeof(keywords)/sizeof(keywords[0]); i++)
+                {
+                    if ((strlen(keywords[i].word) == len) &&
+                        (strncmp(keywords[i].word, p, len) == 0))
+                    {
+                        token->type = keywords[i].type;
+                        break;
+                    }
+                }
+            }
+            else
+            {
+                compile_error(c, p, "unexpected character '%c'", *p);
+                token->type = TOKEN_END;
+                return;
+            }
+            break;
+    }
+
+    token->length = c->pos - p;
+}
+
+static int new_node(struct compiler *c, enum node_type type)
+{
+    struct expr_node *node;
+
+    if (c->num_nodes == MAX_NODES)
+    {
+        compile_error(c, c->token.start, "expression too complex");
+        return -1;
+    }
+
+    node = &c->nodes[c->num_nodes];
+    memset(node, 0, sizeof(struct expr_node));
+    node->type = type;
+    node->left = -1;
+    node->right = -1;
+    node->relation = TOKEN_END;
+    return c->num_nodes++;
+}
+
+static BOOLEAN is_relation(enum token_type type)
+{
+    switch (type)
+    {
+        case TOKEN_EQ:
+        case TOKEN_NE:
+        case TOKEN_GT:
+        case TOKEN_GE:
+        case TOKEN_LT:
+        case TOKEN_LE:
+        case TOKEN_BITAND:
+            return TRUE;
+        default:
+            return FALSE;
+    }
+}
+
+static int parse_or(struct compiler *c);
+
+/* Parses usb.capdata[offset] or usb.capdata[offset:length] slice */
+static BOOLEAN parse_slice(struct compiler *c, struct expr_node *node)
+{
+    c->brackets++;
+    next_token(c);
+    if (c->token.type != TOKEN_NUMBER)
+    {
+        compile_error(c, c->token.start, "expected slice offset");
+        return FALSE;
+    }
+    node->slice_offset = c->token.number;
+    node->slice_length = 1;
+    next_token(c);
+
+    if (c->token.type == TOKEN_COLON)
+    {
+        next_token(c);
+        if (c->token.type != TOKEN_NUMBER)
+        {
+            compile_error(c, c->token.start, "expected slice length");
+            return FALSE;
+        }
+        node->slice_length = c->token.number;
+        next_token(c);
+    }
+
+    if (node->slice_length == 0 || node->slice_length > MAX_BYTES)
+    {
+        compile_error(c, c->token.start,
+                      "slice length must be between 1 and %d", MAX_BYTES);
+        return FALSE;
+    }
+    if (node->slice_offset > 0xFFFF)
+    {
+        compile_error(c, c->token.start, "slice offset too large");
+        return FALSE;
+    }
+
+    if (c->token.type != TOKEN_RBRACKET)
+    {
+        compile_error(c, c->token.start, "expected ]");
+        return FALSE;
+    }
+    c->brackets--;
+    next_token(c);
+    return TRUE;
+}
+
+static int parse_test(struct compiler *c)
+{
+    struct expr_node *node;
+    const char *name;
+    size_t name_len;
+    int index;
+    int i;
+
+    if (c->token.type != TOKEN_FIELD)
+    {
+        compile_error(c, c->token.start, "expected field name");
+        return -1;
+    }
+
+    index = new_node(c, NODE_TEST);
+    if (index < 0)
+    {
+        return -1;
+    }
+    node = &c->nodes[index];
+
+    name = c->token.start;
+    name_len = c->token.length;
+    if ((name_len == strlen(CAPDATA_FIELD_NAME)) &&
+        (strncmp(name, CAPDATA_FIELD_NAME, name_len) == 0))
+    {
+        node->field = NULL;
+    }
+    else
+    {
+        for (i = 0; i < sizeof(fields)/sizeof(fields[0]); i++)
+        {
+            if ((name_len == strlen(fields[i].name)) &&
+                (strncmp(name, fields[i].name, name_len) == 0))
+            {
+                node->field = &fields[i];
+                break;
+            }
+        }
+        if (node->field == NULL)
+        {
+            compile_error(c, name, "unknown field %.*s", (int)name_len, name);
+            return -1;
+        }
+    }
+    next_token(c);
+
+    if (c->token.type == TOKEN_LBRACKET)
+    {
+        if (node->field != NULL)
+        {
+            compile_error(c, c->token.start,
+                          "only " CAPDATA_FIELD_NAME " can be sliced");
+            return -1;
+        }
+        if (!parse_slice(c, node))
+        {
+            return -1;
+        }
+    }
+
+    if (!is_relation(c->token.type))
+    {
+        /* Field presence test */
+        return index;
+    }
+
+    node->relation = c->token.type;
+    next_token(c);
+
+    if (node->field != NULL)
+    {
+        if (c->token.type != TOKEN_NUMBER)
+        {
+            compile_error(c, c->token.start, "expected number");
+            return -1;
+        }
+        node->value = c->token.number;
+    }
+    else
+    {
+        if (node->slice_length == 0)
+        {
+            compile_error(c, c->token.start,
+                          CAPDATA_FIELD_NAME " must be sliced to be compared");
+            return -1;
+        }
+        if (node->relation != TOKEN_EQ && node->relation != TOKEN_NE)
+        {
+            compile_error(c, c->token.start,
+                          CAPDATA_FIELD_NAME " supports only == and !=");
+            return -1;
+        }
+
+        if ((c->token.type == TOKEN_NUMBER) && (node->slice_length == 1))
+        {
+            if (c->token.number > 0xFF)
+            {
+                compile_error(c, c->token.start, "value does not fit in byte");
+                return -1;
+            }
+            node->bytes[0] = (unsigned char)c->token.number;
+        }
+        else if ((c->token.type == TOKEN_BYTES) &&
+                 (c->token.bytes_len == node->slice_length))
+        {
+            memcpy(node->bytes, c->token.bytes, c->token.bytes_len);
+        }
+        else
+        {
+            compile_error(c, c->token.start,
+                          "expected %u bytes long byte string",
+                          node->slice_length);
+            return -1;
+        }
+    }
+    next_token(c);
+
+    return index;
+}
+
+static int parse_unary(struct compiler *c)
+{
+    int index;
+    int operand;
+
+    if (c->token.type == TOKEN_NOT)
+    {
+        next_token(c);
+        operand = parse_unary(c);
+        if (operand < 0)
+        {
+            return -1;
+        }
+        index = new_node(c, NODE_NOT);
+        if (index >= 0)
+        {
+            c->nodes[index].left = operand;
+        }
+        return index;
+    }
+    else if (c->token.type == TOKEN_LPAREN)
+    {
+        next_token(c);
+        index = parse_or(c);
+        if (index < 0)
+        {
+            return -1;
+        }
+        if (c->token.type != TOKEN_RPAREN)
+        {
+            compile_error(c, c->token.start, "expected )");
+            return -1;
+        }
+        next_token(c);
+        return index;
+    }
+
+    return parse_test(c);
+}
+
+static int parse_and(struct compiler *c)
+{
+    int left;
+    int right;
+    int index;
+
+    left = parse_unary(c);
+    while ((left >= 0) && (c->token.type == TOKEN_AND))
+    {
+        next_token(c);
+        right = parse_unary(c);
+        if (right < 0)
+        {
+            return -1;
+        }
+        index = new_node(c, NODE_AND);
+        if (index >= 0)
+        {
+            c->nodes[index].left = left;
+            c->nodes[index].right = right;
+        }
+        left = index;
+    }
+
+    return left;
+}
+
+static int parse_or(struct compiler *c)
+{
+    int left;
+    int right;
+    int index;
+
+    left = parse_and(c);
+    while ((left >= 0) && (c->token.type == TOKEN_OR))
+    {
+        next_token(c);
+        right = parse_and(c);
+        if (right < 0)
+        {
+            return -1;
+        }
+        index = new_node(c, NODE_OR);
+        if (index >= 0)
+        {
+            c->nodes[index].left = left;
+            c->nodes[index].right = right;
+        }
+        left = index;
+    }
+
+    return left;
+}
+
+static int new_label(struct compiler *c)
+{
+    if (c->num_labels == MAX_LABELS)
+    {
+        compile_error(c, c->expression, "expression too complex");
+        return 0;
+    }
+
+    c->labels[c->num_labels] = -1;
+    return c->num_labels++;
+}
+
+static void place_label(struct compiler *c, int label)
+{
+    c->labels[label] = c->num_insn;
+}
+
+/* Emits jump instruction. For BPF_JA the target is jt. */
+static void emit_jump(struct compiler *c, UINT16 code, UINT32 k,
+                      int jt, int jf)
+{
+    if (c->num_insn == USBPCAP_BPF_MAX_INSTRUCTIONS)
+    {
+        compile_error(c, c->expression, "expression too complex");
+        return;
+    }
+
+    c->insn[c->num_insn].code = code;
+    c->insn[c->num_insn].jt = 0;
+    c->insn[c->num_insn].jf = 0;
+    c->insn[c->num_insn].k = k;
+    c->jt_label[c->num_insn] = jt;
+    c->jf_label[c->num_insn] = jf;
+    c->num_insn++;
+}
+
+static void emit(struct compiler *c, UINT16 code, UINT32 k)
+{
+    emit_jump(c, code, k, -1, -1);
+}
+
+/* Loads little endian field value into A. Clobbers X. */
+static void gen_load_field(struct compiler *c, const struct filter_field *field)
+{
+    int i;
+
+    emit(c, BPF_LD | BPF_B | BPF_ABS, field->offset + field->size - 1);
+    for (i = (int)field->size - 2; i >= 0; i--)
+    {
+        emit(c, BPF_ALU | BPF_LSH | BPF_K, 8);
+        emit(c, BPF_MISC | BPF_TAX, 0);
+        emit(c, BPF_LD | BPF_B | BPF_ABS, field->offset + i);
+        emit(c, BPF_ALU | BPF_OR | BPF_X, 0);
+    }
+
+    if (field->mask != 0)
+    {
+        emit(c, BPF_ALU | BPF_AND | BPF_K, field->mask);
+    }
+    if (field->shift != 0)
+    {
+        emit(c, BPF_ALU | BPF_RSH | BPF_K, field->shift);
+    }
+}
+
+/* Jumps to jf if record does not contain the field */
+static void gen_requirement(struct compiler *c,
+                            enum field_requirement requires, int jf)
+{
+    int next;
+
+    if (requires == REQUIRES_CONTROL || requires == REQUIRES_SETUP)
+    {
+        next = new_label(c);
+        emit(c, BPF_LD | BPF_B | BPF_ABS, OFFSET_TRANSFER);
+        emit_jump(c, BPF_JMP | BPF_JEQ | BPF_K, USBPCAP_TRANSFER_CONTROL,
+                  next, jf);
+        place_label(c, next);
+    }
+
+    if (requires == REQUIRES_SETUP)
+    {
+        next = new_label(c);
+        emit(c, BPF_LD | BPF_B | BPF_ABS, OFFSET_CONTROL_STAGE);
+        emit_jump(c, BPF_JMP | BPF_JEQ | BPF_K, USBPCAP_CONTROL_STAGE_SETUP,
+                  next, jf);
+        place_label(c, next);
+    }
+}
+
+/* Loads offset of usb.capdata into X.
+ *
+ * Data starts right after USBPcap header except for control SETUP stage
+ * where it follows the 8 bytes of SETUP packet.
+ */
+static void gen_capdata_offset(struct compiler *c)
+{
+    static const struct filter_field header_len =
+        {"usb.usbpcap_header_len", OFFSET_HEADER_LEN, 2, 0, 0, REQUIRES_NOTHING};
+    int control = new_label(c);
+    int setup = new_label(c);
+    int done = new_label(c);
+
+    gen_load_field(c, &header_len);
+    emit(c, BPF_ST, MEM_CAPDATA_OFFSET);
+
+    emit(c, BPF_LD | BPF_B | BPF_ABS, OFFSET_TRANSFER);
+    emit_jump(c, BPF_JMP | BPF_JEQ | BPF_K, USBPCAP_TRANSFER_CONTROL,
+              control, done);
+
+    place_label(c, control);
+    emit(c, BPF_LD | BPF_B | BPF_ABS, OFFSET_CONTROL_STAGE);
+    emit_jump(c, BPF_JMP | BPF_JEQ | BPF_K, USBPCAP_CONTROL_STAGE_SETUP,
+              setup, done);
+
+    place_label(c, setup);
+    emit(c, BPF_LD | BPF_MEM, MEM_CAPDATA_OFFSET);
+    emit(c, BPF_ALU | BPF_ADD | BPF_K, 8);
+    emit(c, BPF_ST, MEM_CAPDATA_OFFSET);
+
+    place_label(c, done);
+    emit(c, BPF_LDX | BPF_W | BPF_MEM, MEM_CAPDATA_OFFSET);
+}
+
+static void gen_capdata_test(struct compiler *c, struct expr_node *node,
+                             int jt, int jf)
+{
+    UINT32 i;
+    int next;
+
+    gen_capdata_offset(c);
+
+    /* Check that there is enough data. Loads past the end of record would
+     * reject the whole program, so records too short for the slice do not
+     * match the test, also under ! and in the != case.
+     */
+    emit(c, BPF_LD | BPF_W | BPF_LEN, 0);
+    emit(c, BPF_ALU | BPF_SUB | BPF_X, 0);
+    if (node->relation == TOKEN_END)
+    {
+        emit_jump(c, BPF_JMP | BPF_JGE | BPF_K,
+                  node->slice_offset + ((node->slice_length == 0) ? 1 :
+                                        node->slice_length),
+                  jt, jf);
+        return;
+    }
+
+    next = new_label(c);
+    emit_jump(c, BPF_JMP | BPF_JGE | BPF_K,
+              node->slice_offset + node->slice_length, next, jf);
+    place_label(c, next);
+
+    if (node->relation == TOKEN_NE)
+    {
+        int tmp = jt;
+        jt = jf;
+        jf = tmp;
+    }
+
+    /* Loads are big endian so the bytes can be compared directly */
+    for (i = 0; i < node->slice_length; )
+    {
+        UINT32 left = node->slice_length - i;
+        UINT32 value;
+        UINT16 size;
+        UINT32 chunk;
+        UINT32 j;
+
+        if (left >= 4)
+        {
+            size = BPF_W;
+            chunk = 4;
+        }
+        else if (left >= 2)
+        {
+            size = BPF_H;
+            chunk = 2;
+        }
+        else
+        {
+            size = BPF_B;
+            chunk = 1;
+        }
+
+        value = 0;
+        for (j = 0; j < chunk; j++)
+        {
+            value = (value << 8) | node->bytes[i + j];
+        }
+
+        emit(c, BPF_LD | size | BPF_IND, node->slice_offset + i);
+        i += chunk;
+        if (i == node->slice_length)
+        {
+            emit_jump(c, BPF_JMP | BPF_JEQ | BPF_K, value, jt, jf);
+        }
+        else
+        {
+            next = new_label(c);
+            emit_jump(c, BPF_JMP | BPF_JEQ | BPF_K, value, next, jf);
+            place_label(c, next);
+        }
+    }
+}
+
+static void gen_test(struct compiler *c, struct expr_node *node,
+                     int jt, int jf)
+{
+    if (node->field == NULL)
+    {
+        gen_capdata_test(c, node, jt, jf);
+        return;
+    }
+
+    gen_requirement(c, node->field->requires, jf);
+
+    if (node->relation == TOKEN_END)
+    {
+        emit_jump(c, BPF_JMP | BPF_JA, 0, jt, -1);
+        return;
+    }
+
+    gen_load_field(c, node->field);
+
+    switch (node->relation)
+    {
+        case TOKEN_EQ:
+            emit_jump(c, BPF_JMP | BPF_JEQ | BPF_K, node->value, jt, jf);
+            break;
+        case TOKEN_NE:
+            emit_jump(c, BPF_JMP | BPF_JEQ | BPF_K, node->value, jf, jt);
+            break;
+        case TOKEN_GT:
+            emit_jump(c, BPF_JMP | BPF_JGT | BPF_K, node->value, jt, jf);
+            break;
+        case TOKEN_GE:
+            emit_jump(c, BPF_JMP | BPF_JGE | BPF_K, node->value, jt, jf);
+            break;
+        case TOKEN_LT:
+            emit_jump(c, BPF_JMP | BPF_JGE | BPF_K, node->value, jf, jt);
+            break;
+        case TOKEN_LE:
+            emit_jump(c, BPF_JMP | BPF_JGT | BPF_K, node->value, jf, jt);
+            break;
+        case TOKEN_BITAND:
+            emit_jump(c, BPF_JMP | BPF_JSET | BPF_K, node->value, jt, jf);
+            break;
+    }
+}
+
+/* Generates code that jumps to jt if node matches and to jf otherwise */
+static void gen(struct compiler *c, int index, int jt, int jf)
+{
+    struct expr_node *node = &c->nodes[index];
+    int next;
+
+    switch (node->type)
+    {
+        case NODE_OR:
+            next = new_label(c);
+            gen(c, node->left, jt, next);
+            place_label(c, next);
+            gen(c, node->right, jt, jf);
+            break;
+        case NODE_AND:
+            next = new_label(c);
+            gen(c, node->left, next, jf);
+            place_label(c, next);
+            gen(c, node->right, jt, jf);
+            break;
+        case NODE_NOT:
+            gen(c, node->left, jf, jt);
+            break;
+        case NODE_TEST:
+            gen_test(c, node, jt, jf);
+            break;
+    }
+}
+
+/* Converts jump labels into relative offsets */
+static BOOLEAN resolve_jumps(struct compiler *c)
+{
+    int i;
+
+    for (i = 0; i < c->num_insn; i++)
+    {
+        int jt;
+        int jf;
+
+        if (BPF_CLASS(c->insn[i].code) != BPF_JMP)
+        {
+            continue;
+        }
+
+        jt = c->labels[c->jt_label[i]] - (i + 1);
+        if (BPF_OP(c->insn[i].code) == BPF_JA)
+        {
+            c->insn[i].k = (UINT32)jt;
+            continue;
+        }
+
+        jf = c->labels[c->jf_label[i]] - (i + 1);
+        if ((jt > 0xFF) || (jf > 0xFF))
+        {
+            compile_error(c, c->expression, "expression too complex");
+            return FALSE;
+        }
+        c->insn[i].jt = (UCHAR)jt;
+        c->insn[i].jf = (UCHAR)jf;
+    }
+
+    return TRUE;
+}
+
+PUSBPCAP_BPF_PROGRAM bpf_compile_filter(const char *expression)
+{
+    struct compiler *c;
+    PUSBPCAP_BPF_PROGRAM program = NULL;
+    int root;
+    int accept;
+    int reject;
+
+    c = (struct compiler *)calloc(1, sizeof(struct compiler));
+    if (c == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory for filter compiler\n");
+        return NULL;
+    }
+
+    c->expression = expression;
+    c->pos = expression;
+    next_token(c);
+
+    root = parse_or(c);
+    if ((root >= 0) && (c->token.type != TOKEN_END))
+    {
+        compile_error(c, c->token.start, "unexpected %.*s",
+                      (int)c->token.length, c->token.start);
+    }
+
+    if (!c->error)
+    {
+        accept = new_label(c);
+        reject = new_label(c);
+        gen(c, root, accept, reject);
+        place_label(c, accept);
+        emit(c, BPF_RET | BPF_K, 0xFFFFFFFF);
+        place_label(c, reject);
+        emit(c, BPF_RET | BPF_K, 0);
+    }
+
+    if (!c->error && resolve_jumps(c))
+    {
+        program = (PUSBPCAP_BPF_PROGRAM)
+            malloc(USBPCAP_BPF_PROGRAM_SIZE(c->num_insn));
+        if (program != NULL)
+        {
+            program->numberOfInstructions = c->num_insn;
+            memcpy(program->insn, c->insn,
+                   c->num_insn * sizeof(USBPCAP_BPF_INSN));
+        }
+        else
+        {
+            fprintf(stderr, "Failed to allocate memory for filter program\n");
+        }
+    }
+
+    free(c);
+    return program;
+}
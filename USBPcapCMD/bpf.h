@@ -0,0 +1,24 @@
+/*
+ * Copyright (c) 2013 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef USBPCAP_CMD_BPF_H
+#define USBPCAP_CMD_BPF_H
+
+#include <wtypes.h>
+#include "USBPcap.h"
+
+/* Compiles capture filter expression into BPF program understood by driver.
+ *
+ * Expression uses Wireshark display filter field names, for example:
+ *   usb.transfer_type == 3 && usb.endpoint_address.direction == 1
+ *   usb.device_address == 2 && usb.capdata[0:4] == 55:53:42:43
+ *
+ * Returns program allocated with malloc() or NULL if expression is invalid.
+ * Error description is printed to stderr.
+ */
+PUSBPCAP_BPF_PROGRAM bpf_compile_filter(const char *expression);
+
+#endif /* USBPCAP_CMD_BPF_H */
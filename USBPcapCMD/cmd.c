@@ -20,6 +20,7 @@
 #include "roothubs.h"
 #include "version.h"
 #include "descriptors.h"
+#include "bpf.h"
 #include "USBPcap.h"
 
 #define INPUT_BUFFER_SIZE 1024
@@ -345,10 +346,19 @@ static BOOL generate_worker_command_line(struct thread_data *data,
 #define WORKER_CMD_LINE_FORMATTER_PIPE        L"-d %S -b %u -o %s"
 
 #define WORKER_CMD_LINE_FORMATTER_SNAPLEN     L" -s %u"
+#define WORKER_CMD_LINE_FORMATTER_SNAPLEN_POLICY L" --snaplen-policy %S"
+#define WORKER_CMD_LINE_FORMATTER_SAMPLE      L" --sample %u"
+#define WORKER_CMD_LINE_FORMATTER_DEVICE_RATE L" --device-rate %u:%u"
 #define WORKER_CMD_LINE_FORMATTER_DEVICES     L" --devices %S"
 #define WORKER_CMD_LINE_FORMATTER_CAPTURE_ALL L" --capture-from-all-devices"
 #define WORKER_CMD_LINE_FORMATTER_CAPTURE_NEW L" --capture-from-new-devices"
 #define WORKER_CMD_LINE_FORMATTER_INJECT_DESCRIPTORS L" --inject-descriptors"
+#define WORKER_CMD_LINE_FORMATTER_FILTER      L" --filter \"%S\""
+#define WORKER_CMD_LINE_FORMATTER_HEADER_ONLY L" --header-only"
+#define WORKER_CMD_LINE_FORMATTER_PAYLOAD_MATCH L" --payload-match %S"
+#define WORKER_CMD_LINE_FORMATTER_SUMMARY     L" --summary %u"
+#define WORKER_CMD_LINE_FORMATTER_SUMMARY_JSON L" --summary-format json"
+#define WORKER_CMD_LINE_FORMATTER_COMPACT     L" --compact"
 
     cmdLineLen = MultiByteToWideChar(CP_ACP, 0, data->device, -1, NULL, 0);
     cmdLineLen += (pipeName == NULL) ? strlen(data->filename) : wcslen(pipeName);
@@ -357,11 +367,26 @@ static BOOL generate_worker_command_line(struct thread_data *data,
     cmdLineLen += 1 /* NULL termination */;
     cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_SNAPLEN);
     cmdLineLen += 10 /* maximum snaplen in characters */;
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_SNAPLEN_POLICY);
+    cmdLineLen += (data->snaplen_policy_list == NULL) ? 0 : strlen(data->snaplen_policy_list);
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_SAMPLE);
+    cmdLineLen += 10 /* maximum sampling interval in characters */;
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_DEVICE_RATE);
+    cmdLineLen += 2 * 10 /* maximum rate and burst in characters */;
     cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_DEVICES);
     cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_CAPTURE_ALL);
     cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_CAPTURE_NEW);
     cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_INJECT_DESCRIPTORS);
     cmdLineLen += (data->address_list == NULL) ? 0 : strlen(data->address_list);
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_HEADER_ONLY);
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_PAYLOAD_MATCH);
+    cmdLineLen += (data->payload_match_list == NULL) ? 0 : strlen(data->payload_match_list);
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_SUMMARY);
+    cmdLineLen += 10 /* maximum summary interval in characters */;
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_SUMMARY_JSON);
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_COMPACT);
+    cmdLineLen += wcslen(WORKER_CMD_LINE_FORMATTER_FILTER);
+    cmdLineLen += (data->filter_expression == NULL) ? 0 : strlen(data->filter_expression);
 
     cmdLine = (PWSTR)malloc(cmdLineLen * sizeof(WCHAR));
 
@@ -400,6 +425,31 @@ static BOOL generate_worker_command_line(struct thread_data *data,
                              data->snaplen);
     }
 
+    if (data->snaplen_policy_list != NULL)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_SNAPLEN_POLICY,
+                             data->snaplen_policy_list);
+    }
+
+    if (data->sampling.samplingInterval > 1)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_SAMPLE,
+                             data->sampling.samplingInterval);
+    }
+
+    if (data->sampling.deviceByteRate != 0)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_DEVICE_RATE,
+                             data->sampling.deviceByteRate,
+                             data->sampling.deviceBurst);
+    }
+
     if (data->address_list != NULL)
     {
         nChars += swprintf_s(&cmdLine[nChars],
@@ -428,13 +478,67 @@ static BOOL generate_worker_command_line(struct thread_data *data,
                              cmdLineLen - nChars,
                              WORKER_CMD_LINE_FORMATTER_INJECT_DESCRIPTORS);
     }
+
+    if (data->header_only)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_HEADER_ONLY);
+    }
+
+    if (data->payload_match_list != NULL)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_PAYLOAD_MATCH,
+                             data->payload_match_list);
+    }
+
+    if (data->summary_interval != 0)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_SUMMARY,
+                             data->summary_interval);
+    }
+
+    if (data->summary_json)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_SUMMARY_JSON);
+    }
+
+    if (data->compact)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_COMPACT);
+    }
+
+    if (data->filter_expression != NULL)
+    {
+        nChars += swprintf_s(&cmdLine[nChars],
+                             cmdLineLen - nChars,
+                             WORKER_CMD_LINE_FORMATTER_FILTER,
+                             data->filter_expression);
+    }
 #undef WORKER_CMD_LINE_FORMATTER_PIPE
 #undef WORKER_CMD_LINE_FORMATTER
 
+#undef WORKER_CMD_LINE_FORMATTER_SUMMARY_JSON
+#undef WORKER_CMD_LINE_FORMATTER_COMPACT
+#undef WORKER_CMD_LINE_FORMATTER_SUMMARY
+#undef WORKER_CMD_LINE_FORMATTER_PAYLOAD_MATCH
+#undef WORKER_CMD_LINE_FORMATTER_HEADER_ONLY
+#undef WORKER_CMD_LINE_FORMATTER_FILTER
 #undef WORKER_CMD_LINE_FORMATTER_INJECT_DESCRIPTORS
 #undef WORKER_CMD_LINE_FORMATTER_CAPTURE_NEW
 #undef WORKER_CMD_LINE_FORMATTER_CAPTURE_ALL
 #undef WORKER_CMD_LINE_FORMATTER_DEVICES
+#undef WORKER_CMD_LINE_FORMATTER_DEVICE_RATE
+#undef WORKER_CMD_LINE_FORMATTER_SAMPLE
+#undef WORKER_CMD_LINE_FORMATTER_SNAPLEN_POLICY
 #undef WORKER_CMD_LINE_FORMATTER_SNAPLEN
 
     free(pipeName);
@@ -734,10 +838,49 @@ int cmd_interactive(struct thread_data *data)
     return 0;
 }
 
+/**
+ * Reads new list of devices to capture from standard input and applies it
+ * to running capture. Prompt goes to standard error as standard output
+ * may be the capture.
+ *
+ * \param[in] data Thread data structure
+ */
+static void change_devices(struct thread_data *data)
+{
+    char buffer[INPUT_BUFFER_SIZE];
+    int i;
+
+    fprintf(stderr, "Devices to capture (comma separated addresses or all): ");
+    if (fgets(buffer, INPUT_BUFFER_SIZE, stdin) == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < INPUT_BUFFER_SIZE; i++)
+    {
+        if ((buffer[i] == '\r') || (buffer[i] == '\n'))
+        {
+            buffer[i] = '\0';
+            break;
+        }
+    }
+
+    if ((buffer[0] == '\0') && (data->capture_new == FALSE))
+    {
+        fprintf(stderr, "Empty device list would stop the capture, filter not changed\n");
+        return;
+    }
+
+    if (update_address_filter(data, buffer))
+    {
+        fprintf(stderr, "Filter changed\n");
+    }
+}
+
 /**
  * Wait for exit signal.
  *
  * Wait for either 'q' on standard input, data->exit_event or worker process termination.
+ * 'd' on standard input changes the captured devices.
  *
  * \param[in] data Thread data structure
  * \param[in] process Worker process handle
@@ -802,6 +945,12 @@ static void wait_for_exit_signal(struct thread_data *data, HANDLE process)
                             /* There is 'q' on standard input. Quit. */
                             break;
                         }
+                        else if ((record.Event.KeyEvent.bKeyDown == TRUE) &&
+                                 (record.Event.KeyEvent.uChar.AsciiChar == 'd'))
+                        {
+                            /* Change captured devices without stopping capture. */
+                            change_devices(data);
+                        }
                     }
                 }
             }
@@ -847,6 +996,33 @@ static void start_capture(struct thread_data *data)
         return;
     }
 
+    if ((data->snaplen_policy_list != NULL) && (data->snaplen_policy == NULL))
+    {
+        data->snaplen_policy = USBPcapParseSnaplenPolicy(data->snaplen_policy_list);
+        if (data->snaplen_policy == NULL)
+        {
+            return;
+        }
+    }
+
+    if ((data->payload_match_list != NULL) && (data->payload_match == NULL))
+    {
+        data->payload_match = USBPcapParsePayloadMatch(data->payload_match_list);
+        if (data->payload_match == NULL)
+        {
+            return;
+        }
+    }
+
+    if ((data->filter_expression != NULL) && (data->filter_program == NULL))
+    {
+        data->filter_program = bpf_compile_filter(data->filter_expression);
+        if (data->filter_program == NULL)
+        {
+            return;
+        }
+    }
+
     data->exit_event = CreateEvent(NULL, /* Handle cannot be inherited */
                                    TRUE, /* Manual Reset */
                                    FALSE, /* Default to not signalled */
@@ -1176,6 +1352,27 @@ static int print_extcap_options(const char *device)
     printf("arg {number=4}{call=--inject-descriptors}"
            "{display=Inject already connected devices descriptors into capture data}"
            "{type=boolflag}{default=true}\n");
+    printf("arg {number=5}{call=--snaplen-policy}"
+           "{display=Payload length per transfer type}"
+           "{tooltip=Comma separated <transfer>[@<device>[.<endpoint>]]=<bytes> rules, first match applies, e.g. bulk@5.2=512,bulk=64}"
+           "{type=string}\n");
+    printf("arg {number=6}{call=--sample}"
+           "{display=Capture every Nth URB per endpoint}"
+           "{tooltip=Power of two sampling interval, 1 captures every URB}"
+           "{type=unsigned}{range=1,%d}{default=1}\n",
+           USBPCAP_SAMPLING_MAX_INTERVAL);
+    printf("arg {number=7}{call=--device-rate}"
+           "{display=Per device byte rate limit}"
+           "{tooltip=<bytes per second>[:<burst bytes>], empty for no limit}"
+           "{type=string}\n");
+    printf("arg {number=8}{call=--header-only}"
+           "{display=Capture packet headers only}"
+           "{tooltip=Do not capture transfer data, only timing, status and length}"
+           "{type=boolflag}{default=false}\n");
+    printf("arg {number=9}{call=--payload-match}"
+           "{display=Payload patterns}"
+           "{tooltip=Comma separated <transfer>:<hex bytes>[@<offset>[-<offset>]] patterns, e.g. bulk:55534243@0}"
+           "{type=string}\n");
     printf("arg {number=%d}{call=--devices}{display=Attached USB Devices}{tooltip=Select individual devices to capture from}{type=multicheck}\n",
            EXTCAP_ARGNUM_MULTICHECK);
 
@@ -1221,6 +1418,13 @@ int cmd_extcap(struct thread_data *data)
         ret = print_extcap_options(extcap_interface);
     }
 
+    /* --extcap-capture-filter without --capture is filter validation */
+    if ((data->filter_expression != NULL) && !do_extcap_capture)
+    {
+        data->filter_program = bpf_compile_filter(data->filter_expression);
+        return (data->filter_program != NULL) ? 0 : 1;
+    }
+
     /* --capture */
     if (do_extcap_capture)
     {
@@ -1335,6 +1539,18 @@ static void print_help(void)
            "    Output .pcap file name.\n"
            "  -s <len>, --snaplen <len>\n"
            "    Sets snapshot length.\n"
+           "  --snaplen-policy <rules>\n"
+           "    Limits captured payload per transfer type and endpoint.\n"
+           "    Rules are comma separated <transfer>[@<device>[.<endpoint>]]=<bytes>\n"
+           "    where transfer is isochronous, interrupt, control, bulk or all.\n"
+           "    First matching rule applies, put device and endpoint rules first.\n"
+           "    Example: --snaplen-policy bulk@5.2=512,bulk=64,isochronous=0\n"
+           "  --sample <N>\n"
+           "    Captures only every Nth URB (and its completion) on every endpoint.\n"
+           "    N must be power of two, maximum %d. Default 1 captures every URB.\n"
+           "  --device-rate <bytes>[:<burst>]\n"
+           "    Limits captured bytes per second for every device. URBs over the\n"
+           "    limit are not captured. Burst defaults to one second worth of bytes.\n"
            "  -b <len>, --bufferlen <len>\n"
            "    Sets internal capture buffer length. Valid range <4096,134217728>.\n"
            "  -A, --capture-from-all-devices\n"
@@ -1342,17 +1558,52 @@ static void print_help(void)
            "  --devices <list>\n"
            "    Captures data only from devices with addresses present in list.\n"
            "    List is comma separated list of values. Example --devices 1,2,3.\n"
+           "    Pressing d during elevated capture asks for new list (or all) and\n"
+           "    changes the captured devices without stopping the capture.\n"
            "  --inject-descriptors\n"
            "    Inject already connected devices descriptors into capture data.\n"
+           "  --header-only\n"
+           "    Captures only packet headers and control transfer Setup packets.\n"
+           "    Transfer data is never accessed, its length is still recorded.\n"
+           "  --payload-match <patterns>\n"
+           "    Captures only packets containing one of the patterns in payload.\n"
+           "    Patterns are comma separated <transfer>:<hex bytes>[@<offset>[-<offset>]]\n"
+           "    and apply only to given transfer type, other transfers are captured.\n"
+           "    Example: --payload-match bulk:55534243@0,bulk:55534253@0\n"
+           "  --summary <seconds>\n"
+           "    Writes per endpoint transfer counters instead of packets every\n"
+           "    <seconds>. Counters accumulate since the capture start.\n"
+           "  --summary-format <csv|json>\n"
+           "    Summary output format. CSV writes one line per endpoint, JSON writes\n"
+           "    one object per sample. Default is csv.\n"
+           "  --compact\n"
+           "    Replaces repeated interrupt records with single REPEAT record\n"
+           "    that keeps their position and time. usbpcap-compact -x restores\n"
+           "    the original capture. Output is behind by at most one second.\n"
+           "  --filter <expression>\n"
+           "    Captures only packets matching expression. Expression uses\n"
+           "    Wireshark usb.* field names, for example:\n"
+           "    --filter \"usb.transfer_type == 3 && usb.capdata[0:4] == 55:53:42:43\"\n"
+           "    Packets are filtered in kernel before being copied into capture buffer.\n"
            "  -I,  --init-non-standard-hwids\n"
            "    Initializes NonStandardHWIDs registry key used by USBPcapDriver.\n"
-           "    This registry key is needed for USB 3.0 capture.\n");
+           "    This registry key is needed for USB 3.0 capture.\n",
+           USBPCAP_SAMPLING_MAX_INTERVAL);
 }
 
 /* Commandline arguments without short option */
 #define ARG_DEVICES                    900
 #define ARG_CAPTURE_FROM_NEW_DEVICES   901
 #define ARG_INJECT_DESCRIPTORS         902
+#define ARG_FILTER                     903
+#define ARG_SNAPLEN_POLICY             904
+#define ARG_SAMPLE                     905
+#define ARG_DEVICE_RATE                906
+#define ARG_HEADER_ONLY                907
+#define ARG_PAYLOAD_MATCH              908
+#define ARG_SUMMARY                    909
+#define ARG_SUMMARY_FORMAT             910
+#define ARG_COMPACT                    911
 #define ARG_EXTCAP_VERSION            1000
 #define ARG_EXTCAP_INTERFACES         1001
 #define ARG_EXTCAP_INTERFACE          1002
@@ -1360,6 +1611,7 @@ static void print_help(void)
 #define ARG_EXTCAP_CONFIG             1004
 #define ARG_EXTCAP_CAPTURE            1005
 #define ARG_EXTCAP_FIFO               1006
+#define ARG_EXTCAP_CAPTURE_FILTER     1007
 
 #if _MSC_VER >= 1700
 int __cdecl usbpcapcmd_main(int argc, CHAR **argv)
@@ -1382,6 +1634,15 @@ int __cdecl main(int argc, CHAR **argv)
         {"capture-from-all-devices", no_argument, 0, 'A'},
         {"capture-from-new-devices", no_argument, 0, ARG_CAPTURE_FROM_NEW_DEVICES},
         {"inject-descriptors", no_argument, 0, ARG_INJECT_DESCRIPTORS},
+        {"filter", required_argument, 0, ARG_FILTER},
+        {"snaplen-policy", required_argument, 0, ARG_SNAPLEN_POLICY},
+        {"sample", required_argument, 0, ARG_SAMPLE},
+        {"device-rate", required_argument, 0, ARG_DEVICE_RATE},
+        {"header-only", no_argument, 0, ARG_HEADER_ONLY},
+        {"payload-match", required_argument, 0, ARG_PAYLOAD_MATCH},
+        {"summary", required_argument, 0, ARG_SUMMARY},
+        {"summary-format", required_argument, 0, ARG_SUMMARY_FORMAT},
+        {"compact", no_argument, 0, ARG_COMPACT},
         /* Extcap interface. Please note that there are no short
          * options for these and the numbers are just gopt keys.
          */
@@ -1392,6 +1653,7 @@ int __cdecl main(int argc, CHAR **argv)
         {"extcap-config", no_argument, &do_extcap_config, ARG_EXTCAP_CONFIG},
         {"capture", no_argument, &do_extcap_capture, ARG_EXTCAP_CAPTURE},
         {"fifo", required_argument, 0, ARG_EXTCAP_FIFO},
+        {"extcap-capture-filter", required_argument, 0, ARG_EXTCAP_CAPTURE_FILTER},
         {0, 0, 0, 0}
     };
     int option_index = 0;
@@ -1405,6 +1667,20 @@ int __cdecl main(int argc, CHAR **argv)
     data.capture_all = FALSE;
     data.capture_new = FALSE;
     data.inject_descriptors = FALSE;
+    data.snaplen_policy_list = NULL;
+    data.snaplen_policy = NULL;
+    data.sampling.samplingInterval = 1;
+    data.sampling.deviceByteRate = 0;
+    data.sampling.deviceBurst = 0;
+    data.header_only = FALSE;
+    data.payload_match_list = NULL;
+    data.payload_match = NULL;
+    data.summary_interval = 0;
+    data.summary_json = FALSE;
+    data.compact = FALSE;
+    data.compactor = NULL;
+    data.filter_expression = NULL;
+    data.filter_program = NULL;
     data.snaplen = DEFAULT_SNAPSHOT_LENGTH;
     data.bufferlen = DEFAULT_INTERNAL_KERNEL_BUFFER_SIZE;
     data.job_handle = INVALID_HANDLE_VALUE;
@@ -1468,6 +1744,90 @@ int __cdecl main(int argc, CHAR **argv)
             case ARG_INJECT_DESCRIPTORS:
                 data.inject_descriptors = TRUE;
                 break;
+            case ARG_HEADER_ONLY:
+                data.header_only = TRUE;
+                break;
+            case ARG_PAYLOAD_MATCH:
+                /* Wireshark passes empty string when option is not set */
+                data.payload_match_list = (optarg[0] != '\0') ? optarg : NULL;
+                break;
+            case ARG_SUMMARY:
+                data.summary_interval = atol(optarg);
+                if ((data.summary_interval == 0) ||
+                    (data.summary_interval > 86400))
+                {
+                    fprintf(stderr, "Invalid summary interval! "
+                                    "Must be in range <1,86400>.\n");
+                    return -1;
+                }
+                break;
+            case ARG_SUMMARY_FORMAT:
+                if (strcmp(optarg, "csv") == 0)
+                {
+                    data.summary_json = FALSE;
+                }
+                else if (strcmp(optarg, "json") == 0)
+                {
+                    data.summary_json = TRUE;
+                }
+                else
+                {
+                    fprintf(stderr, "Invalid summary format! Expected csv or json.\n");
+                    return -1;
+                }
+                break;
+            case ARG_COMPACT:
+                data.compact = TRUE;
+                break;
+            case ARG_SNAPLEN_POLICY:
+                /* Wireshark passes empty string when option is not set */
+                data.snaplen_policy_list = (optarg[0] != '\0') ? optarg : NULL;
+                break;
+            case ARG_SAMPLE:
+                data.sampling.samplingInterval = atol(optarg);
+                if ((data.sampling.samplingInterval == 0) ||
+                    (data.sampling.samplingInterval > USBPCAP_SAMPLING_MAX_INTERVAL) ||
+                    (data.sampling.samplingInterval & (data.sampling.samplingInterval - 1)))
+                {
+                    fprintf(stderr, "Invalid sampling interval! "
+                                    "Must be power of two in range <1,%d>.\n",
+                            USBPCAP_SAMPLING_MAX_INTERVAL);
+                    return -1;
+                }
+                break;
+            case ARG_DEVICE_RATE:
+            {
+                char *end;
+
+                /* Wireshark passes empty string when option is not set */
+                if (optarg[0] == '\0')
+                {
+                    data.sampling.deviceByteRate = 0;
+                    data.sampling.deviceBurst = 0;
+                    break;
+                }
+
+                data.sampling.deviceByteRate = strtoul(optarg, &end, 10);
+                data.sampling.deviceBurst = data.sampling.deviceByteRate;
+                if (*end == ':')
+                {
+                    data.sampling.deviceBurst = strtoul(end + 1, &end, 10);
+                }
+                if ((*end != '\0') ||
+                    (data.sampling.deviceByteRate == 0) ||
+                    (data.sampling.deviceBurst == 0))
+                {
+                    fprintf(stderr, "Invalid device rate! "
+                                    "Expected <bytes>[:<burst>].\n");
+                    return -1;
+                }
+                break;
+            }
+            case ARG_FILTER:
+            case ARG_EXTCAP_CAPTURE_FILTER:
+                /* Wireshark passes empty string when there is no filter */
+                data.filter_expression = (optarg[0] != '\0') ? optarg : NULL;
+                break;
             case ARG_EXTCAP_VERSION:
                 do_extcap_version = 1;
                 wireshark_version = optarg;
@@ -1551,6 +1911,18 @@ int __cdecl main(int argc, CHAR **argv)
     {
         CloseHandle(data.exit_event);
     }
+    if (data.snaplen_policy != NULL)
+    {
+        free(data.snaplen_policy);
+    }
+    if (data.payload_match != NULL)
+    {
+        free(data.payload_match);
+    }
+    if (data.filter_program != NULL)
+    {
+        free(data.filter_program);
+    }
 
     return ret;
 }
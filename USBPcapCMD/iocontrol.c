@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include "iocontrol.h"
 
 /*
@@ -123,3 +124,299 @@ BOOLEAN USBPcapInitAddressFilter(PUSBPCAP_ADDRESS_FILTER filter, PCHAR list, BOO
     memcpy(filter, &tmp, sizeof(USBPCAP_ADDRESS_FILTER));
     return TRUE;
 }
+
+/*
+ * Returns USBPCAP_FILTER_TRANSFER() bits for transfer type name of given
+ * length, 0 if name is not known.
+ */
+static UCHAR USBPcapParseTransferName(PCHAR name, size_t len)
+{
+    static const struct
+    {
+        const char *name;
+        UCHAR transfers;
+    } transfers[] =
+    {
+        {"isochronous", USBPCAP_FILTER_TRANSFER(USBPCAP_TRANSFER_ISOCHRONOUS)},
+        {"interrupt", USBPCAP_FILTER_TRANSFER(USBPCAP_TRANSFER_INTERRUPT)},
+        {"control", USBPCAP_FILTER_TRANSFER(USBPCAP_TRANSFER_CONTROL)},
+        {"bulk", USBPCAP_FILTER_TRANSFER(USBPCAP_TRANSFER_BULK)},
+        {"all", USBPCAP_FILTER_TRANSFER(USBPCAP_TRANSFER_ISOCHRONOUS) |
+                USBPCAP_FILTER_TRANSFER(USBPCAP_TRANSFER_INTERRUPT) |
+                USBPCAP_FILTER_TRANSFER(USBPCAP_TRANSFER_CONTROL) |
+                USBPCAP_FILTER_TRANSFER(USBPCAP_TRANSFER_BULK)},
+    };
+    int i;
+
+    for (i = 0; i < sizeof(transfers)/sizeof(transfers[0]); i++)
+    {
+        if ((strlen(transfers[i].name) == len) &&
+            (strncmp(transfers[i].name, name, len) == 0))
+        {
+            return transfers[i].transfers;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Parses comma separated list of snapshot length policy rules:
+ *   <transfer>[@<device>[.<endpoint>]]=<bytes>
+ * where transfer is one of isochronous, interrupt, control, bulk or all.
+ * First matching rule applies, so more specific rules go first.
+ * Example: bulk@5.2=512,bulk=64,isochronous=0
+ *
+ * Returns policy allocated with malloc() on success, NULL otherwise.
+ */
+PUSBPCAP_SNAPLEN_POLICY USBPcapParseSnaplenPolicy(PCHAR list)
+{
+    PUSBPCAP_SNAPLEN_POLICY policy;
+    UINT32 rules;
+    PCHAR p;
+
+    if (list == NULL)
+    {
+        return NULL;
+    }
+
+    /* Every comma starts new rule */
+    rules = 1;
+    for (p = list; *p; p++)
+    {
+        if (*p == ',')
+        {
+            rules++;
+        }
+    }
+
+    if (rules > USBPCAP_SNAPLEN_POLICY_MAX_RULES)
+    {
+        fprintf(stderr, "Too many snapshot length rules. Maximum is %d.\n",
+                USBPCAP_SNAPLEN_POLICY_MAX_RULES);
+        return NULL;
+    }
+
+    policy = (PUSBPCAP_SNAPLEN_POLICY)malloc(USBPCAP_SNAPLEN_POLICY_SIZE(rules));
+    if (policy == NULL)
+    {
+        fprintf(stderr, "Failed to allocate snapshot length policy.\n");
+        return NULL;
+    }
+    policy->numberOfRules = 0;
+
+    p = list;
+    while (policy->numberOfRules < rules)
+    {
+        PUSBPCAP_SNAPLEN_RULE rule = &policy->rule[policy->numberOfRules];
+        size_t len;
+
+        rule->match.device = USBPCAP_FILTER_ANY;
+        rule->match.endpoint = USBPCAP_FILTER_ANY;
+        rule->match.direction = USBPCAP_FILTER_DIRECTION_OUT |
+                                USBPCAP_FILTER_DIRECTION_IN;
+
+        len = strcspn(p, "@=,");
+        rule->match.transfers = USBPcapParseTransferName(p, len);
+        if (rule->match.transfers == 0)
+        {
+            fprintf(stderr, "Malformed snapshot length policy. Unknown transfer type: %.*s.\n",
+                    (int)len, p);
+            free(policy);
+            return NULL;
+        }
+        p += len;
+
+        if (*p == '@')
+        {
+            int number;
+
+            p++;
+            number = isdigit(*p) ? atoi(p) : -1;
+            if ((number < 0) || (number > 127))
+            {
+                fprintf(stderr, "Malformed snapshot length policy. Invalid device address.\n");
+                free(policy);
+                return NULL;
+            }
+            rule->match.device = (UCHAR)number;
+            while (isdigit(*p))
+            {
+                p++;
+            }
+
+            if (*p == '.')
+            {
+                p++;
+                number = isdigit(*p) ? atoi(p) : -1;
+                if ((number < 0) || (number > 15))
+                {
+                    fprintf(stderr, "Malformed snapshot length policy. Invalid endpoint number.\n");
+                    free(policy);
+                    return NULL;
+                }
+                rule->match.endpoint = (UCHAR)number;
+                while (isdigit(*p))
+                {
+                    p++;
+                }
+            }
+        }
+
+        if ((*p != '=') || !isdigit(p[1]))
+        {
+            fprintf(stderr, "Malformed snapshot length policy. Expected =<bytes>.\n");
+            free(policy);
+            return NULL;
+        }
+        p++;
+        rule->maxDataLength = (UINT32)strtoul(p, &p, 10);
+
+        if ((*p != ',') && (*p != '\0'))
+        {
+            fprintf(stderr, "Malformed snapshot length policy. Invalid character: %c.\n", *p);
+            free(policy);
+            return NULL;
+        }
+        if (*p == ',')
+        {
+            p++;
+        }
+
+        policy->numberOfRules++;
+    }
+
+    return policy;
+}
+
+/*
+ * Parses comma separated list of payload patterns:
+ *   <transfer>:<hex bytes>[@<offset>[-<offset>]]
+ * where transfer is one of isochronous, interrupt, control, bulk or all.
+ * Without offset the pattern can be anywhere in payload.
+ * Example: bulk:55534243@0 matches Mass Storage Command Block Wrappers.
+ *
+ * Returns match allocated with malloc() on success, NULL otherwise.
+ */
+PUSBPCAP_PAYLOAD_MATCH USBPcapParsePayloadMatch(PCHAR list)
+{
+    PUSBPCAP_PAYLOAD_MATCH match;
+    UINT32 patterns;
+    PCHAR p;
+
+    if (list == NULL)
+    {
+        return NULL;
+    }
+
+    /* Every comma starts new pattern */
+    patterns = 1;
+    for (p = list; *p; p++)
+    {
+        if (*p == ',')
+        {
+            patterns++;
+        }
+    }
+
+    if (patterns > USBPCAP_PAYLOAD_MATCH_MAX_PATTERNS)
+    {
+        fprintf(stderr, "Too many payload patterns. Maximum is %d.\n",
+                USBPCAP_PAYLOAD_MATCH_MAX_PATTERNS);
+        return NULL;
+    }
+
+    match = (PUSBPCAP_PAYLOAD_MATCH)malloc(USBPCAP_PAYLOAD_MATCH_SIZE(patterns));
+    if (match == NULL)
+    {
+        fprintf(stderr, "Failed to allocate payload match.\n");
+        return NULL;
+    }
+    memset(match, 0, USBPCAP_PAYLOAD_MATCH_SIZE(patterns));
+
+    p = list;
+    while (match->numberOfPatterns < patterns)
+    {
+        PUSBPCAP_PAYLOAD_PATTERN pattern = &match->pattern[match->numberOfPatterns];
+        size_t len;
+
+        len = strcspn(p, ":,");
+        pattern->transfers = USBPcapParseTransferName(p, len);
+        if ((pattern->transfers == 0) || (p[len] != ':'))
+        {
+            fprintf(stderr, "Malformed payload match. Expected <transfer>:<hex bytes>, got: %.*s.\n",
+                    (int)len, p);
+            free(match);
+            return NULL;
+        }
+        p += len + 1;
+
+        while (isxdigit(p[0]) && isxdigit(p[1]))
+        {
+            char hex[3] = {p[0], p[1], '\0'};
+
+            if (pattern->length == USBPCAP_PAYLOAD_PATTERN_MAX_LENGTH)
+            {
+                fprintf(stderr, "Malformed payload match. Pattern is longer than %d bytes.\n",
+                        USBPCAP_PAYLOAD_PATTERN_MAX_LENGTH);
+                free(match);
+                return NULL;
+            }
+            pattern->bytes[pattern->length++] = (UCHAR)strtoul(hex, NULL, 16);
+            p += 2;
+        }
+        if (pattern->length == 0)
+        {
+            fprintf(stderr, "Malformed payload match. Expected hex bytes.\n");
+            free(match);
+            return NULL;
+        }
+
+        pattern->minOffset = 0;
+        pattern->maxOffset = 0xFFFFFFFF;
+        if (*p == '@')
+        {
+            p++;
+            if (!isdigit(*p))
+            {
+                fprintf(stderr, "Malformed payload match. Invalid offset.\n");
+                free(match);
+                return NULL;
+            }
+            pattern->minOffset = (UINT32)strtoul(p, &p, 10);
+            pattern->maxOffset = pattern->minOffset;
+            if (*p == '-')
+            {
+                p++;
+                if (!isdigit(*p))
+                {
+                    fprintf(stderr, "Malformed payload match. Invalid offset.\n");
+                    free(match);
+                    return NULL;
+                }
+                pattern->maxOffset = (UINT32)strtoul(p, &p, 10);
+                if (pattern->maxOffset < pattern->minOffset)
+                {
+                    fprintf(stderr, "Malformed payload match. Invalid offset range.\n");
+                    free(match);
+                    return NULL;
+                }
+            }
+        }
+
+        if ((*p != ',') && (*p != '\0'))
+        {
+            fprintf(stderr, "Malformed payload match. Invalid character: %c.\n", *p);
+            free(match);
+            return NULL;
+        }
+        if (*p == ',')
+        {
+            p++;
+        }
+
+        match->numberOfPatterns++;
+    }
+
+    return match;
+}
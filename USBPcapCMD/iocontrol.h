@@ -14,5 +14,7 @@
 BOOLEAN USBPcapIsDeviceFiltered(PUSBPCAP_ADDRESS_FILTER filter, int address);
 BOOLEAN USBPcapSetDeviceFiltered(PUSBPCAP_ADDRESS_FILTER filter, int address);
 BOOLEAN USBPcapInitAddressFilter(PUSBPCAP_ADDRESS_FILTER filter, PCHAR list, BOOLEAN filterAll);
+PUSBPCAP_SNAPLEN_POLICY USBPcapParseSnaplenPolicy(PCHAR list);
+PUSBPCAP_PAYLOAD_MATCH USBPcapParsePayloadMatch(PCHAR list);
 
 #endif /* USBPCAP_CMD_IOCONTROL_H */
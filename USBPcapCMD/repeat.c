@@ -0,0 +1,1147 @@
+/*
+ * Copyright (c) 2013 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "repeat.h"
+
+#define RECORD_HEADER    sizeof(pcaprec_hdr_t)
+#define PACKET_HEADER    sizeof(USBPCAP_BUFFER_PACKET_HEADER)
+
+/* Offsets in USBPcap header */
+#define HEADER_STATUS    10
+#define HEADER_TRANSFER  22
+#define HEADER_LENGTH    23
+
+/* Streams are kept in open addressing table that is at most half full */
+#define MAX_STREAMS      1024
+#define STREAM_SLOTS     (2 * MAX_STREAMS)
+
+/* REPEAT record is not larger than default snapshot length */
+#define MAX_REPEAT       (RECORD_HEADER + 65535)
+
+/* Longest variable length integer */
+#define MAX_VARINT       10
+
+/* Records longer than this are considered corrupted */
+#define MAX_INCL_LEN     (256 * 1024 * 1024)
+
+#define OUTPUT_SIZE      (64 * 1024)
+
+/* pcap stream split into global header and records. Once passthrough is
+ * set, the rest of the stream is not parsed.
+ */
+struct reader
+{
+    UCHAR    header[sizeof(pcap_hdr_t)];
+    size_t   headerLength;
+    BOOLEAN  passthrough;
+    UINT64   resolution;    /* timestamp units per second */
+    UCHAR   *partial;       /* record split between feeds */
+    size_t   partialLength;
+    size_t   partialSize;
+};
+
+typedef BOOLEAN (*RECORD_HANDLER)(void *context, const UCHAR *record);
+typedef BOOLEAN (*RAW_HANDLER)(void *context, const void *data, size_t length);
+
+struct output
+{
+    REPEAT_WRITE  write;
+    void         *context;
+    UCHAR        *buffer;
+    size_t        length;
+};
+
+/* Records with equal irpId, bus, device, endpoint and info. Run is open
+ * while the stream has REPEAT slot waiting for repetitions of record.
+ */
+struct stream
+{
+    BOOLEAN  used;
+    BOOLEAN  open;
+    USHORT   bus;
+    USHORT   device;
+    UCHAR    endpoint;
+    UCHAR    info;
+    UINT64   irpId;
+    UINT64   slot;          /* sequence number of the REPEAT slot */
+    UINT64   first;         /* timestamp of the repeated record */
+    UINT64   timestamp;     /* of the last repetition */
+    INT64    interval;      /* between the last two records of the run */
+    UINT64   position;      /* record number of the last repetition */
+    UINT32   count;
+    UCHAR   *repeat;        /* REPEAT record being assembled */
+    size_t   repeatLength;
+    size_t   repeatSize;
+    size_t   length;        /* pcaprec_hdr_t and data of the record */
+    UCHAR    record[RECORD_HEADER + REPEAT_MAX_RECORD];
+};
+
+/* Place for REPEAT record in the queue */
+struct slot
+{
+    UINT64          offset;  /* queue offset the REPEAT record goes to */
+    struct stream  *stream;  /* NULL once the run is closed */
+    UCHAR          *repeat;  /* NULL if the record was not repeated */
+    size_t          length;
+};
+
+struct repeat_compactor
+{
+    struct reader   reader;
+    struct output   output;
+    UINT64          maxDelay;    /* in timestamp units */
+    UINT32          delaySeconds;
+    size_t          queueLimit;
+
+    struct stream  *streams;
+    UINT32          numberOfStreams;
+
+    /* Records are queued after the first open run, slots[slotFirst]. */
+    struct slot    *slots;
+    UINT64          slotBase;    /* sequence number of slots[0] */
+    size_t          slotFirst;
+    size_t          slotCount;
+    size_t          slotSize;
+
+    UCHAR          *queue;
+    UINT64          queueBase;   /* offset of queue[0] */
+    size_t          queueFirst;  /* bytes before are written */
+    size_t          queueLength;
+    size_t          queueSize;
+
+    struct repeat_stats stats;
+};
+
+/* Repetitions of record that are yet to be written */
+struct run
+{
+    UINT64   due;           /* record number of the next repetition */
+    UINT64   timestamp;
+    INT64    interval;
+    INT64    delta;         /* of the next repetition */
+    UINT32   remaining;
+    UCHAR   *payload;
+    size_t   cursor;
+    size_t   payloadLength;
+    size_t   length;
+    UCHAR    record[RECORD_HEADER + REPEAT_MAX_RECORD];
+};
+
+struct repeat_expander
+{
+    struct reader   reader;
+    struct output   output;
+    BOOLEAN         failed;
+    UINT64          position;    /* records written */
+
+    UCHAR          *pending;     /* payload of REPEAT record waiting for */
+    size_t          pendingLength; /* the repeated record */
+    size_t          pendingSize;
+    BOOLEAN         hasPending;
+
+    struct run    **heap;        /* ordered by due */
+    size_t          heapCount;
+    size_t          heapSize;
+
+    struct repeat_stats stats;
+};
+
+static BOOLEAN reserve(UCHAR **buffer, size_t *size, size_t length)
+{
+    UCHAR  *p;
+    size_t  newSize;
+
+    if (length <= *size)
+    {
+        return TRUE;
+    }
+    newSize = (*size < 256) ? 256 : *size;
+    while (newSize < length)
+    {
+        newSize *= 2;
+    }
+    p = (UCHAR *)realloc(*buffer, newSize);
+    if (p == NULL)
+    {
+        return FALSE;
+    }
+    *buffer = p;
+    *size = newSize;
+    return TRUE;
+}
+
+/* Doubles number of elements in array */
+static BOOLEAN grow(void **array, size_t *size, size_t elementSize)
+{
+    size_t  newSize = (*size == 0) ? 64 : 2 * *size;
+    void   *p = realloc(*array, newSize * elementSize);
+
+    if (p == NULL)
+    {
+        return FALSE;
+    }
+    *array = p;
+    *size = newSize;
+    return TRUE;
+}
+
+static UINT32 get_le32(const UCHAR *p)
+{
+    return (UINT32)p[0] | ((UINT32)p[1] << 8) |
+           ((UINT32)p[2] << 16) | ((UINT32)p[3] << 24);
+}
+
+static void put_le32(UCHAR *p, UINT32 value)
+{
+    p[0] = (UCHAR)value;
+    p[1] = (UCHAR)(value >> 8);
+    p[2] = (UCHAR)(value >> 16);
+    p[3] = (UCHAR)(value >> 24);
+}
+
+static UINT32 record_incl_len(const UCHAR *record)
+{
+    pcaprec_hdr_t hdr;
+
+    memcpy(&hdr, record, sizeof(hdr));
+    return hdr.incl_len;
+}
+
+static UINT64 record_timestamp(const struct reader *reader, const UCHAR *record)
+{
+    pcaprec_hdr_t hdr;
+
+    memcpy(&hdr, record, sizeof(hdr));
+    return (UINT64)hdr.ts_sec * reader->resolution + hdr.ts_usec;
+}
+
+static void record_set_timestamp(const struct reader *reader, UCHAR *record,
+                                 UINT64 timestamp)
+{
+    pcaprec_hdr_t hdr;
+
+    memcpy(&hdr, record, sizeof(hdr));
+    hdr.ts_sec = (UINT32)(timestamp / reader->resolution);
+    hdr.ts_usec = (UINT32)(timestamp % reader->resolution);
+    memcpy(record, &hdr, sizeof(hdr));
+}
+
+/* Returns TRUE if record has USBPcap header of given transfer type */
+static BOOLEAN record_is(const UCHAR *record, UCHAR transfer)
+{
+    const UCHAR *data = &record[RECORD_HEADER];
+
+    return ((record_incl_len(record) >= PACKET_HEADER) &&
+            ((data[0] | (data[1] << 8)) == PACKET_HEADER) &&
+            (data[HEADER_TRANSFER] == transfer)) ? TRUE : FALSE;
+}
+
+static void reader_init(struct reader *reader)
+{
+    memset(reader, 0, sizeof(*reader));
+}
+
+/* Parses data, calls handler for every complete record and raw for the
+ * global header and every byte after passthrough is set. Returns FALSE
+ * as soon as a handler does.
+ */
+static BOOLEAN reader_feed(struct reader *reader, const UCHAR *p, size_t length,
+                           RECORD_HANDLER handler, RAW_HANDLER raw,
+                           void *context)
+{
+    while (length > 0)
+    {
+        size_t need;
+        size_t n;
+
+        if (reader->headerLength < sizeof(pcap_hdr_t))
+        {
+            n = sizeof(pcap_hdr_t) - reader->headerLength;
+            n = (n < length) ? n : length;
+            memcpy(&reader->header[reader->headerLength], p, n);
+            reader->headerLength += n;
+            p += n;
+            length -= n;
+
+            if (reader->headerLength == sizeof(pcap_hdr_t))
+            {
+                pcap_hdr_t hdr;
+
+                memcpy(&hdr, reader->header, sizeof(hdr));
+                if (hdr.magic_number == 0xA1B2C3D4)
+                {
+                    reader->resolution = 1000000;
+                }
+                else if (hdr.magic_number == 0xA1B23C4D)
+                {
+                    reader->resolution = 1000000000;
+                }
+                reader->passthrough = ((reader->resolution == 0) ||
+                                       (hdr.network != DLT_USBPCAP)) ? TRUE : FALSE;
+                if (!raw(context, reader->header, sizeof(pcap_hdr_t)))
+                {
+                    return FALSE;
+                }
+            }
+            continue;
+        }
+
+        if (reader->passthrough)
+        {
+            return raw(context, p, length);
+        }
+
+        if (reader->partialLength == 0)
+        {
+            /* Records that are complete in data are handled in place */
+            while (length >= RECORD_HEADER)
+            {
+                UINT32 inclLen = record_incl_len(p);
+
+                if ((inclLen > MAX_INCL_LEN) || (length < RECORD_HEADER + inclLen))
+                {
+                    break;
+                }
+                if (!handler(context, p))
+                {
+                    return FALSE;
+                }
+                p += RECORD_HEADER + inclLen;
+                length -= RECORD_HEADER + inclLen;
+                if (reader->passthrough)
+                {
+                    break;
+                }
+            }
+            if ((length == 0) || reader->passthrough)
+            {
+                continue;
+            }
+        }
+
+        need = RECORD_HEADER;
+        if (reader->partialLength >= RECORD_HEADER)
+        {
+            need += record_incl_len(reader->partial);
+        }
+        if (!reserve(&reader->partial, &reader->partialSize, need))
+        {
+            reader->passthrough = TRUE;
+        }
+        else
+        {
+            n = need - reader->partialLength;
+            n = (n < length) ? n : length;
+            memcpy(&reader->partial[reader->partialLength], p, n);
+            reader->partialLength += n;
+            p += n;
+            length -= n;
+
+            if ((reader->partialLength == RECORD_HEADER) && (need == RECORD_HEADER))
+            {
+                UINT32 inclLen = record_incl_len(reader->partial);
+
+                if (inclLen > MAX_INCL_LEN)
+                {
+                    reader->passthrough = TRUE;
+                }
+                need += inclLen;
+            }
+            if ((!reader->passthrough) && (reader->partialLength == need))
+            {
+                reader->partialLength = 0;
+                if (!handler(context, reader->partial))
+                {
+                    return FALSE;
+                }
+            }
+        }
+
+        if (reader->passthrough && (reader->partialLength > 0))
+        {
+            n = reader->partialLength;
+            reader->partialLength = 0;
+            if (!raw(context, reader->partial, n))
+            {
+                return FALSE;
+            }
+        }
+    }
+    return TRUE;
+}
+
+static void output_flush(struct output *output)
+{
+    if (output->length > 0)
+    {
+        output->write(output->context, output->buffer, output->length);
+        output->length = 0;
+    }
+}
+
+static void output_write(struct output *output, const void *data, size_t length)
+{
+    if (length == 0)
+    {
+        return;
+    }
+    if (output->length + length > OUTPUT_SIZE)
+    {
+        output_flush(output);
+    }
+    if (length >= OUTPUT_SIZE)
+    {
+        output->write(output->context, data, length);
+        return;
+    }
+    memcpy(&output->buffer[output->length], data, length);
+    output->length += length;
+}
+
+static size_t put_varint(UCHAR *p, UINT64 value)
+{
+    size_t n = 0;
+
+    while (value >= 0x80)
+    {
+        p[n++] = (UCHAR)(value | 0x80);
+        value >>= 7;
+    }
+    p[n++] = (UCHAR)value;
+    return n;
+}
+
+static BOOLEAN get_varint(const UCHAR *p, size_t length, size_t *cursor,
+                          UINT64 *value)
+{
+    UINT64 result = 0;
+    int    shift;
+
+    for (shift = 0; (shift < 64) && (*cursor < length); shift += 7)
+    {
+        UCHAR b = p[(*cursor)++];
+
+        result |= (UINT64)(b & 0x7F) << shift;
+        if ((b & 0x80) == 0)
+        {
+            *value = result;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * Compactor
+ */
+
+static UINT32 stream_hash(UINT64 irpId, USHORT bus, USHORT device,
+                          UCHAR endpoint, UCHAR info)
+{
+    UINT64 h = irpId ^ ((UINT64)bus << 48) ^ ((UINT64)device << 32) ^
+               ((UINT64)endpoint << 8) ^ info;
+
+    h *= 0x9E3779B97F4A7C15ULL;
+    return (UINT32)(h >> 40) & (STREAM_SLOTS - 1);
+}
+
+/* Writes queued records up to the first open run */
+static void flush_queue(struct repeat_compactor *compactor)
+{
+    while (compactor->slotFirst < compactor->slotCount)
+    {
+        struct slot *slot = &compactor->slots[compactor->slotFirst];
+        size_t       end = (size_t)(slot->offset - compactor->queueBase);
+
+        if (end > compactor->queueFirst)
+        {
+            output_write(&compactor->output,
+                         &compactor->queue[compactor->queueFirst],
+                         end - compactor->queueFirst);
+            compactor->queueFirst = end;
+        }
+        if (slot->stream != NULL)
+        {
+            break;
+        }
+        if (slot->repeat != NULL)
+        {
+            output_write(&compactor->output, slot->repeat, slot->length);
+            free(slot->repeat);
+            slot->repeat = NULL;
+        }
+        compactor->slotFirst++;
+    }
+
+    if (compactor->slotFirst == compactor->slotCount)
+    {
+        output_write(&compactor->output,
+                     &compactor->queue[compactor->queueFirst],
+                     compactor->queueLength - compactor->queueFirst);
+        compactor->queueBase += compactor->queueLength;
+        compactor->queueFirst = 0;
+        compactor->queueLength = 0;
+        compactor->slotBase += compactor->slotCount;
+        compactor->slotFirst = 0;
+        compactor->slotCount = 0;
+        return;
+    }
+
+    /* Keep both queues from growing with the written part */
+    if (compactor->queueFirst > compactor->queueLength / 2)
+    {
+        memmove(compactor->queue, &compactor->queue[compactor->queueFirst],
+                compactor->queueLength - compactor->queueFirst);
+        compactor->queueBase += compactor->queueFirst;
+        compactor->queueLength -= compactor->queueFirst;
+        compactor->queueFirst = 0;
+    }
+    if (compactor->slotFirst > compactor->slotCount / 2)
+    {
+        memmove(compactor->slots, &compactor->slots[compactor->slotFirst],
+                (compactor->slotCount - compactor->slotFirst) * sizeof(struct slot));
+        compactor->slotBase += compactor->slotFirst;
+        compactor->slotCount -= compactor->slotFirst;
+        compactor->slotFirst = 0;
+    }
+}
+
+/* Fills REPEAT slot of the stream. Does not allocate memory. */
+static void close_run(struct repeat_compactor *compactor, struct stream *stream)
+{
+    struct slot *slot = &compactor->slots[stream->slot - compactor->slotBase];
+
+    if (stream->count > 0)
+    {
+        UCHAR         *p = stream->repeat;
+        UCHAR         *header = &p[RECORD_HEADER];
+        pcaprec_hdr_t  hdr;
+
+        memcpy(&hdr, stream->record, sizeof(hdr));
+        hdr.incl_len = (UINT32)(stream->repeatLength - RECORD_HEADER);
+        hdr.orig_len = hdr.incl_len;
+        memcpy(p, &hdr, sizeof(hdr));
+
+        memcpy(header, &stream->record[RECORD_HEADER], PACKET_HEADER);
+        memset(&header[HEADER_STATUS], 0, sizeof(USBD_STATUS) + sizeof(USHORT));
+        header[HEADER_TRANSFER] = USBPCAP_TRANSFER_REPEAT;
+        put_le32(&header[HEADER_LENGTH], hdr.incl_len - PACKET_HEADER);
+        put_le32(&header[PACKET_HEADER], stream->count);
+
+        slot->repeat = p;
+        slot->length = stream->repeatLength;
+        stream->repeat = NULL;
+        stream->repeatSize = 0;
+
+        compactor->stats.runs++;
+        compactor->stats.repeats += stream->count;
+    }
+    slot->stream = NULL;
+    stream->open = FALSE;
+}
+
+static void close_all_runs(struct repeat_compactor *compactor)
+{
+    size_t i;
+
+    for (i = compactor->slotFirst; i < compactor->slotCount; i++)
+    {
+        if (compactor->slots[i].stream != NULL)
+        {
+            close_run(compactor, compactor->slots[i].stream);
+        }
+    }
+    flush_queue(compactor);
+}
+
+/* Writes record or queues it behind open runs */
+static void emit(struct repeat_compactor *compactor, const UCHAR *data,
+                 size_t length)
+{
+    if (compactor->slotFirst < compactor->slotCount)
+    {
+        if (reserve(&compactor->queue, &compactor->queueSize,
+                    compactor->queueLength + length))
+        {
+            memcpy(&compactor->queue[compactor->queueLength], data, length);
+            compactor->queueLength += length;
+            return;
+        }
+        close_all_runs(compactor);
+    }
+    output_write(&compactor->output, data, length);
+}
+
+static struct stream *find_stream(struct repeat_compactor *compactor,
+                                  const UCHAR *header)
+{
+    UINT64  irpId;
+    USHORT  bus = (USHORT)(header[17] | (header[18] << 8));
+    USHORT  device = (USHORT)(header[19] | (header[20] << 8));
+    UCHAR   endpoint = header[21];
+    UCHAR   info = header[16];
+    UINT32  i;
+
+    irpId = (UINT64)get_le32(&header[2]) | ((UINT64)get_le32(&header[6]) << 32);
+
+    for (;;)
+    {
+        for (i = stream_hash(irpId, bus, device, endpoint, info);
+             compactor->streams[i].used;
+             i = (i + 1) & (STREAM_SLOTS - 1))
+        {
+            struct stream *stream = &compactor->streams[i];
+
+            if ((stream->irpId == irpId) && (stream->bus == bus) &&
+                (stream->device == device) && (stream->endpoint == endpoint) &&
+                (stream->info == info))
+            {
+                return stream;
+            }
+        }
+
+        if (compactor->numberOfStreams < MAX_STREAMS)
+        {
+            struct stream *stream = &compactor->streams[i];
+
+            stream->used = TRUE;
+            stream->irpId = irpId;
+            stream->bus = bus;
+            stream->device = device;
+            stream->endpoint = endpoint;
+            stream->info = info;
+            compactor->numberOfStreams++;
+            return stream;
+        }
+
+        /* IRPs come and go, start over with empty table */
+        close_all_runs(compactor);
+        for (i = 0; i < STREAM_SLOTS; i++)
+        {
+            free(compactor->streams[i].repeat);
+        }
+        memset(compactor->streams, 0, STREAM_SLOTS * sizeof(struct stream));
+        compactor->numberOfStreams = 0;
+    }
+}
+
+/* Makes record the repeated record of new run */
+static void start_run(struct repeat_compactor *compactor, struct stream *stream,
+                      const UCHAR *record, size_t length, UINT64 timestamp,
+                      UINT64 position)
+{
+    struct slot *slot;
+
+    if ((!reserve(&stream->repeat, &stream->repeatSize,
+                  RECORD_HEADER + PACKET_HEADER + sizeof(UINT32) + 2 * MAX_VARINT)) ||
+        ((compactor->slotCount == compactor->slotSize) &&
+         (!grow((void **)&compactor->slots, &compactor->slotSize,
+                sizeof(struct slot)))))
+    {
+        emit(compactor, record, length);
+        return;
+    }
+
+    slot = &compactor->slots[compactor->slotCount];
+    slot->offset = compactor->queueBase + compactor->queueLength;
+    slot->stream = stream;
+    slot->repeat = NULL;
+    slot->length = 0;
+    compactor->slotCount++;
+
+    memcpy(stream->record, record, length);
+    stream->length = length;
+    stream->open = TRUE;
+    stream->slot = compactor->slotBase + compactor->slotCount - 1;
+    stream->first = timestamp;
+    stream->timestamp = timestamp;
+    stream->interval = 0;
+    stream->position = position;
+    stream->count = 0;
+    stream->repeatLength = RECORD_HEADER + PACKET_HEADER + sizeof(UINT32);
+
+    emit(compactor, record, length);
+}
+
+static BOOLEAN add_repetition(struct stream *stream, UINT64 timestamp,
+                              UINT64 position)
+{
+    INT64  interval = (INT64)(timestamp - stream->timestamp);
+    INT64  delta = interval - stream->interval;
+    size_t need = stream->repeatLength + 2 * MAX_VARINT;
+
+    if ((need > MAX_REPEAT) || (stream->count == 0xFFFFFFFF) ||
+        (!reserve(&stream->repeat, &stream->repeatSize, need)))
+    {
+        return FALSE;
+    }
+
+    stream->repeatLength += put_varint(&stream->repeat[stream->repeatLength],
+                                       position - stream->position - 1);
+    stream->repeatLength += put_varint(&stream->repeat[stream->repeatLength],
+                                       ((UINT64)delta << 1) ^ (UINT64)(delta >> 63));
+    stream->interval = interval;
+    stream->timestamp = timestamp;
+    stream->position = position;
+    stream->count++;
+    return TRUE;
+}
+
+/* Closes the oldest runs while they hold output for too long */
+static void expire_runs(struct repeat_compactor *compactor, UINT64 now)
+{
+    while (compactor->slotFirst < compactor->slotCount)
+    {
+        struct stream *stream = compactor->slots[compactor->slotFirst].stream;
+
+        if (stream == NULL)
+        {
+            flush_queue(compactor);
+            continue;
+        }
+        if (((compactor->queueLength - compactor->queueFirst) <= compactor->queueLimit) &&
+            ((now <= stream->first) || (now - stream->first <= compactor->maxDelay)))
+        {
+            break;
+        }
+        close_run(compactor, stream);
+        flush_queue(compactor);
+    }
+}
+
+static BOOLEAN compactor_raw(void *context, const void *data, size_t length)
+{
+    struct repeat_compactor *compactor = (struct repeat_compactor *)context;
+
+    close_all_runs(compactor);
+    output_write(&compactor->output, data, length);
+    return TRUE;
+}
+
+static BOOLEAN compactor_record(void *context, const UCHAR *record)
+{
+    struct repeat_compactor *compactor = (struct repeat_compactor *)context;
+    const UCHAR             *header = &record[RECORD_HEADER];
+    size_t                   length = RECORD_HEADER + record_incl_len(record);
+    UINT64                   timestamp;
+    UINT64                   position;
+    struct stream           *stream;
+
+    if (compactor->maxDelay == 0)
+    {
+        compactor->maxDelay = compactor->delaySeconds * compactor->reader.resolution;
+    }
+
+    /* Positions in REPEAT records of already compacted capture would
+     * not match the records written, so such capture is not modified.
+     */
+    if (record_is(record, USBPCAP_TRANSFER_REPEAT))
+    {
+        compactor->stats.compacted = TRUE;
+        compactor->reader.passthrough = TRUE;
+        return compactor_raw(context, record, length);
+    }
+
+    timestamp = record_timestamp(&compactor->reader, record);
+    position = compactor->stats.records++;
+    expire_runs(compactor, timestamp);
+
+    if ((!record_is(record, USBPCAP_TRANSFER_INTERRUPT)) ||
+        (length > RECORD_HEADER + REPEAT_MAX_RECORD))
+    {
+        emit(compactor, record, length);
+        return TRUE;
+    }
+
+    stream = find_stream(compactor, header);
+    if (stream->open)
+    {
+        /* Everything but the timestamp must match */
+        if ((stream->length == length) &&
+            (memcmp(&stream->record[8], &record[8], length - 8) == 0) &&
+            add_repetition(stream, timestamp, position))
+        {
+            return TRUE;
+        }
+        close_run(compactor, stream);
+        flush_queue(compactor);
+    }
+    start_run(compactor, stream, record, length, timestamp, position);
+    return TRUE;
+}
+
+struct repeat_compactor *repeat_compactor_create(REPEAT_WRITE write,
+                                                 void *context,
+                                                 UINT32 maxDelay,
+                                                 size_t queueLength)
+{
+    struct repeat_compactor *compactor;
+
+    compactor = (struct repeat_compactor *)calloc(1, sizeof(*compactor));
+    if (compactor == NULL)
+    {
+        return NULL;
+    }
+    reader_init(&compactor->reader);
+    compactor->output.write = write;
+    compactor->output.context = context;
+    compactor->output.buffer = (UCHAR *)malloc(OUTPUT_SIZE);
+    compactor->streams = (struct stream *)calloc(STREAM_SLOTS, sizeof(struct stream));
+    compactor->delaySeconds = (maxDelay > 0) ? maxDelay : 1;
+    compactor->queueLimit = queueLength;
+    if ((compactor->output.buffer == NULL) || (compactor->streams == NULL))
+    {
+        repeat_compactor_free(compactor);
+        return NULL;
+    }
+    return compactor;
+}
+
+void repeat_compactor_feed(struct repeat_compactor *compactor,
+                           const void *data, size_t length)
+{
+    reader_feed(&compactor->reader, (const UCHAR *)data, length,
+                compactor_record, compactor_raw, compactor);
+    /* Capture may go idle, write out what is not held by a run */
+    output_flush(&compactor->output);
+}
+
+void repeat_compactor_finish(struct repeat_compactor *compactor)
+{
+    struct reader *reader = &compactor->reader;
+
+    close_all_runs(compactor);
+    if (reader->headerLength < sizeof(pcap_hdr_t))
+    {
+        output_write(&compactor->output, reader->header, reader->headerLength);
+        reader->headerLength = sizeof(pcap_hdr_t);
+        reader->passthrough = TRUE;
+    }
+    /* Truncated last record */
+    output_write(&compactor->output, reader->partial, reader->partialLength);
+    reader->partialLength = 0;
+    output_flush(&compactor->output);
+}
+
+void repeat_compactor_stats(const struct repeat_compactor *compactor,
+                            struct repeat_stats *stats)
+{
+    *stats = compactor->stats;
+}
+
+void repeat_compactor_free(struct repeat_compactor *compactor)
+{
+    size_t i;
+
+    if (compactor == NULL)
+    {
+        return;
+    }
+    if (compactor->streams != NULL)
+    {
+        for (i = 0; i < STREAM_SLOTS; i++)
+        {
+            free(compactor->streams[i].repeat);
+        }
+    }
+    for (i = compactor->slotFirst; i < compactor->slotCount; i++)
+    {
+        free(compactor->slots[i].repeat);
+    }
+    free(compactor->streams);
+    free(compactor->slots);
+    free(compactor->queue);
+    free(compactor->reader.partial);
+    free(compactor->output.buffer);
+    free(compactor);
+}
+
+/*
+ * Expander
+ */
+
+static void heap_down(struct run **heap, size_t count, size_t i)
+{
+    for (;;)
+    {
+        size_t      smallest = i;
+        size_t      left = 2 * i + 1;
+        size_t      right = left + 1;
+        struct run *tmp;
+
+        if ((left < count) && (heap[left]->due < heap[smallest]->due))
+        {
+            smallest = left;
+        }
+        if ((right < count) && (heap[right]->due < heap[smallest]->due))
+        {
+            smallest = right;
+        }
+        if (smallest == i)
+        {
+            return;
+        }
+        tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+static void heap_up(struct run **heap, size_t i)
+{
+    while (i > 0)
+    {
+        size_t      parent = (i - 1) / 2;
+        struct run *tmp;
+
+        if (heap[parent]->due <= heap[i]->due)
+        {
+            return;
+        }
+        tmp = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+/* Decodes position and time of the next repetition */
+static BOOLEAN next_repetition(struct repeat_expander *expander, struct run *run)
+{
+    UINT64 skip;
+    UINT64 delta;
+
+    if ((!get_varint(run->payload, run->payloadLength, &run->cursor, &skip)) ||
+        (!get_varint(run->payload, run->payloadLength, &run->cursor, &delta)))
+    {
+        return FALSE;
+    }
+    run->due = expander->position + skip;
+    run->delta = (INT64)(delta >> 1) ^ -(INT64)(delta & 1);
+    return TRUE;
+}
+
+static void free_run(struct run *run)
+{
+    free(run->payload);
+    free(run);
+}
+
+/* Writes repetitions that come before the next record in the file */
+static BOOLEAN write_due(struct repeat_expander *expander)
+{
+    while ((expander->heapCount > 0) &&
+           (expander->heap[0]->due <= expander->position))
+    {
+        struct run *run = expander->heap[0];
+
+        if (run->due < expander->position)
+        {
+            return FALSE;
+        }
+
+        run->interval += run->delta;
+        run->timestamp += (UINT64)run->interval;
+        record_set_timestamp(&expander->reader, run->record, run->timestamp);
+        output_write(&expander->output, run->record, run->length);
+        expander->position++;
+        expander->stats.records++;
+        expander->stats.repeats++;
+
+        if (--run->remaining > 0)
+        {
+            if (!next_repetition(expander, run))
+            {
+                return FALSE;
+            }
+        }
+        else
+        {
+            free_run(run);
+            expander->heap[0] = expander->heap[--expander->heapCount];
+        }
+        heap_down(expander->heap, expander->heapCount, 0);
+    }
+    return TRUE;
+}
+
+static BOOLEAN start_expansion(struct repeat_expander *expander,
+                               const UCHAR *record, size_t length)
+{
+    struct run *run;
+
+    if ((expander->pendingLength < sizeof(UINT32)) ||
+        (length > RECORD_HEADER + REPEAT_MAX_RECORD))
+    {
+        return FALSE;
+    }
+    if ((expander->heapCount == expander->heapSize) &&
+        (!grow((void **)&expander->heap, &expander->heapSize,
+               sizeof(struct run *))))
+    {
+        return FALSE;
+    }
+
+    run = (struct run *)malloc(sizeof(struct run));
+    if (run == NULL)
+    {
+        return FALSE;
+    }
+    memcpy(run->record, record, length);
+    run->length = length;
+    run->timestamp = record_timestamp(&expander->reader, record);
+    run->interval = 0;
+    run->remaining = get_le32(expander->pending);
+    run->payload = expander->pending;
+    run->payloadLength = expander->pendingLength;
+    run->cursor = sizeof(UINT32);
+    expander->pending = NULL;
+    expander->pendingSize = 0;
+    expander->stats.runs++;
+
+    if ((run->remaining == 0) || (!next_repetition(expander, run)))
+    {
+        free_run(run);
+        return FALSE;
+    }
+    expander->heap[expander->heapCount] = run;
+    heap_up(expander->heap, expander->heapCount);
+    expander->heapCount++;
+    return TRUE;
+}
+
+static BOOLEAN expander_raw(void *context, const void *data, size_t length)
+{
+    struct repeat_expander *expander = (struct repeat_expander *)context;
+
+    /* Corrupted data after the header cannot be inside a run */
+    if ((expander->heapCount > 0) || expander->hasPending)
+    {
+        return FALSE;
+    }
+    output_write(&expander->output, data, length);
+    return TRUE;
+}
+
+static BOOLEAN expander_record(void *context, const UCHAR *record)
+{
+    struct repeat_expander *expander = (struct repeat_expander *)context;
+    size_t                  length = RECORD_HEADER + record_incl_len(record);
+
+    if (record_is(record, USBPCAP_TRANSFER_REPEAT))
+    {
+        size_t payload = length - RECORD_HEADER - PACKET_HEADER;
+
+        if (expander->hasPending ||
+            (!reserve(&expander->pending, &expander->pendingSize, payload)))
+        {
+            return FALSE;
+        }
+        memcpy(expander->pending, &record[RECORD_HEADER + PACKET_HEADER], payload);
+        expander->pendingLength = payload;
+        expander->hasPending = TRUE;
+        return TRUE;
+    }
+
+    output_write(&expander->output, record, length);
+    expander->position++;
+    expander->stats.records++;
+
+    if (expander->hasPending)
+    {
+        expander->hasPending = FALSE;
+        if (!start_expansion(expander, record, length))
+        {
+            return FALSE;
+        }
+    }
+    return write_due(expander);
+}
+
+struct repeat_expander *repeat_expander_create(REPEAT_WRITE write,
+                                               void *context)
+{
+    struct repeat_expander *expander;
+
+    expander = (struct repeat_expander *)calloc(1, sizeof(*expander));
+    if (expander == NULL)
+    {
+        return NULL;
+    }
+    reader_init(&expander->reader);
+    expander->output.write = write;
+    expander->output.context = context;
+    expander->output.buffer = (UCHAR *)malloc(OUTPUT_SIZE);
+    if (expander->output.buffer == NULL)
+    {
+        repeat_expander_free(expander);
+        return NULL;
+    }
+    return expander;
+}
+
+BOOLEAN repeat_expander_feed(struct repeat_expander *expander,
+                             const void *data, size_t length)
+{
+    if (!expander->failed)
+    {
+        expander->failed = !reader_feed(&expander->reader, (const UCHAR *)data,
+                                        length, expander_record, expander_raw,
+                                        expander);
+        output_flush(&expander->output);
+    }
+    return !expander->failed;
+}
+
+BOOLEAN repeat_expander_finish(struct repeat_expander *expander)
+{
+    struct reader *reader = &expander->reader;
+
+    if (!expander->failed)
+    {
+        /* Truncated last record is written as it is, like compactor does */
+        if ((expander->heapCount > 0) || expander->hasPending)
+        {
+            expander->failed = TRUE;
+        }
+        if (reader->headerLength < sizeof(pcap_hdr_t))
+        {
+            output_write(&expander->output, reader->header, reader->headerLength);
+        }
+        output_write(&expander->output, reader->partial, reader->partialLength);
+        reader->partialLength = 0;
+        output_flush(&expander->output);
+    }
+    return !expander->failed;
+}
+
+void repeat_expander_stats(const struct repeat_expander *expander,
+                           struct repeat_stats *stats)
+{
+    *stats = expander->stats;
+}
+
+void repeat_expander_free(struct repeat_expander *expander)
+{
+    size_t i;
+
+    if (expander == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < expander->heapCount; i++)
+    {
+        free_run(expander->heap[i]);
+    }
+    free(expander->heap);
+    free(expander->pending);
+    free(expander->reader.partial);
+    free(expander->output.buffer);
+    free(expander);
+}
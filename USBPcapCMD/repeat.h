@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2013 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef USBPCAP_CMD_REPEAT_H
+#define USBPCAP_CMD_REPEAT_H
+
+#include <stddef.h>
+#include <wtypes.h>
+#include "USBPcap.h"
+
+/* Compaction of repeated interrupt records in DLT_USBPCAP capture.
+ *
+ * Interrupt endpoints are polled all the time and a device with nothing
+ * new to report completes the same URB with the same data over and over.
+ * Compactor keeps the first record of such run and replaces the rest with
+ * USBPCAP_TRANSFER_REPEAT record that holds only their position and time.
+ * Expander writes the original capture back, byte for byte.
+ *
+ * Both take pcap file data in pieces of any length, so they can sit
+ * between the driver and the output file as well as convert whole files.
+ * Output is passed to the write callback. Captures in other than host
+ * byte order or with other link type are passed through unmodified.
+ */
+
+/* Records with more data than this are never compacted */
+#define REPEAT_MAX_RECORD    1024
+
+/* Defaults for offline compaction */
+#define REPEAT_DEFAULT_DELAY 60
+#define REPEAT_DEFAULT_QUEUE (16 * 1024 * 1024)
+
+typedef void (*REPEAT_WRITE)(void *context, const void *data, size_t length);
+
+struct repeat_compactor;
+struct repeat_expander;
+
+struct repeat_stats
+{
+    UINT64 records;  /* records in the original capture */
+    UINT64 repeats;  /* records replaced by REPEAT records */
+    UINT64 runs;     /* REPEAT records */
+    BOOLEAN compacted; /* compactor input has REPEAT records, records
+                        * from the first one on are not modified */
+};
+
+/* Creates compactor. Run is closed at the latest when capture time
+ * reaches maxDelay seconds after its first record, or when more than
+ * queueLength bytes wait behind it. Output is delayed by at most that.
+ *
+ * Returns NULL if out of memory.
+ */
+struct repeat_compactor *repeat_compactor_create(REPEAT_WRITE write,
+                                                 void *context,
+                                                 UINT32 maxDelay,
+                                                 size_t queueLength);
+void repeat_compactor_feed(struct repeat_compactor *compactor,
+                           const void *data, size_t length);
+/* Closes all runs and writes everything that is left. */
+void repeat_compactor_finish(struct repeat_compactor *compactor);
+void repeat_compactor_stats(const struct repeat_compactor *compactor,
+                            struct repeat_stats *stats);
+void repeat_compactor_free(struct repeat_compactor *compactor);
+
+/* Returns NULL if out of memory. */
+struct repeat_expander *repeat_expander_create(REPEAT_WRITE write,
+                                               void *context);
+/* Returns FALSE if the data is not valid compacted capture. Nothing more
+ * is written after the first error.
+ */
+BOOLEAN repeat_expander_feed(struct repeat_expander *expander,
+                             const void *data, size_t length);
+/* Returns FALSE if the capture ended before all repetitions were written. */
+BOOLEAN repeat_expander_finish(struct repeat_expander *expander);
+void repeat_expander_stats(const struct repeat_expander *expander,
+                           struct repeat_stats *stats);
+void repeat_expander_free(struct repeat_expander *expander);
+
+#endif /* USBPCAP_CMD_REPEAT_H */
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2013 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+#include "summary.h"
+
+static const char *transfer_name(UCHAR transfer)
+{
+    switch (transfer)
+    {
+        case USBPCAP_TRANSFER_ISOCHRONOUS:
+            return "isochronous";
+        case USBPCAP_TRANSFER_INTERRUPT:
+            return "interrupt";
+        case USBPCAP_TRANSFER_CONTROL:
+            return "control";
+        case USBPCAP_TRANSFER_BULK:
+            return "bulk";
+        default:
+            return "unknown";
+    }
+}
+
+int summary_format_csv_header(char *buf, size_t len)
+{
+    int n;
+
+    n = _snprintf_s(buf, len, _TRUNCATE,
+                    "time,overflows,device,endpoint,transfer,"
+                    "transfers,bytes,errors,"
+                    "size_0,size_8,size_64,size_512,size_4096,"
+                    "size_32768,size_262144,size_larger\n");
+
+    return (n < 0) ? 0 : n;
+}
+
+int summary_format(const USBPCAP_SUMMARY *summary, UINT64 time,
+                   BOOLEAN json, char *buf, size_t len)
+{
+    size_t written = 0;
+    UINT32 i;
+    int j;
+    int n;
+
+#define APPEND(...) \
+    do { \
+        n = _snprintf_s(&buf[written], len - written, _TRUNCATE, __VA_ARGS__); \
+        if (n < 0) \
+        { \
+            return (int)written; \
+        } \
+        written += n; \
+    } while (0)
+
+    if (json)
+    {
+        APPEND("{\"time\":%I64u,\"overflows\":%u,\"endpoints\":[",
+               time, summary->overflows);
+    }
+
+    for (i = 0; i < summary->numberOfEndpoints; i++)
+    {
+        const USBPCAP_ENDPOINT_SUMMARY *ep = &summary->endpoint[i];
+
+        if (json)
+        {
+            APPEND("%s{\"device\":%u,\"endpoint\":%u,\"transfer\":\"%s\","
+                   "\"transfers\":%I64u,\"bytes\":%I64u,\"errors\":%I64u,"
+                   "\"sizes\":[",
+                   (i == 0) ? "" : ",",
+                   ep->device, ep->endpoint, transfer_name(ep->transfer),
+                   ep->transfers, ep->bytes, ep->errors);
+            for (j = 0; j < USBPCAP_SUMMARY_SIZE_BUCKETS; j++)
+            {
+                APPEND("%s%I64u", (j == 0) ? "" : ",", ep->sizes[j]);
+            }
+            APPEND("]}");
+        }
+        else
+        {
+            APPEND("%I64u,%u,%u,0x%02X,%s,%I64u,%I64u,%I64u",
+                   time, summary->overflows,
+                   ep->device, ep->endpoint, transfer_name(ep->transfer),
+                   ep->transfers, ep->bytes, ep->errors);
+            for (j = 0; j < USBPCAP_SUMMARY_SIZE_BUCKETS; j++)
+            {
+                APPEND(",%I64u", ep->sizes[j]);
+            }
+            APPEND("\n");
+        }
+    }
+
+    if (json)
+    {
+        APPEND("]}\n");
+    }
+
+#undef APPEND
+
+    return (int)written;
+}
@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2013 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef USBPCAP_CMD_SUMMARY_H
+#define USBPCAP_CMD_SUMMARY_H
+
+#include <wtypes.h>
+#include "USBPcap.h"
+
+/* Buffer length sufficient to hold any formatted summary sample */
+#define SUMMARY_TEXT_LENGTH  32768
+
+/* Formats CSV header line. Returns number of characters written. */
+int summary_format_csv_header(char *buf, size_t len);
+
+/* Formats summary taken at time (seconds since Unix epoch) as CSV lines,
+ * one line per endpoint, or as single JSON object line.
+ *
+ * Returns number of characters written.
+ */
+int summary_format(const USBPCAP_SUMMARY *summary, UINT64 time,
+                   BOOLEAN json, char *buf, size_t len);
+
+#endif /* USBPCAP_CMD_SUMMARY_H */
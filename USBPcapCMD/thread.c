@@ -7,11 +7,25 @@
 #include <devioctl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <wtypes.h>
 #include "USBPcap.h"
 #include "thread.h"
 #include "iocontrol.h"
 #include "descriptors.h"
+#include "summary.h"
+
+/* Compacted output is behind the capture by at most this many seconds
+ * of capture time or this many bytes.
+ */
+#define COMPACT_MAX_DELAY   1
+#define COMPACT_MAX_QUEUE   (1024 * 1024)
+
+struct compact_output
+{
+    struct thread_data *data;
+    LPOVERLAPPED write_overlapped;
+};
 
 HANDLE create_filter_read_handle(struct thread_data *data)
 {
@@ -75,6 +89,108 @@ HANDLE create_filter_read_handle(struct thread_data *data)
         goto finish;
     }
 
+    if (data->snaplen_policy != NULL)
+    {
+        if (!DeviceIoControl(filter_handle,
+                             IOCTL_USBPCAP_SET_SNAPLEN_POLICY,
+                             (char*)data->snaplen_policy,
+                             USBPCAP_SNAPLEN_POLICY_SIZE(data->snaplen_policy->numberOfRules),
+                             NULL,
+                             0,
+                             &bytes_ret,
+                             0))
+        {
+            fprintf(stderr, "DeviceIoControl failed with %d status (supplimentary code %d)\n",
+                    GetLastError(),
+                    bytes_ret);
+            goto finish;
+        }
+    }
+
+    if ((data->sampling.samplingInterval > 1) ||
+        (data->sampling.deviceByteRate != 0))
+    {
+        if (!DeviceIoControl(filter_handle,
+                             IOCTL_USBPCAP_SET_SAMPLING,
+                             (char*)&data->sampling,
+                             sizeof(USBPCAP_SAMPLING),
+                             NULL,
+                             0,
+                             &bytes_ret,
+                             0))
+        {
+            fprintf(stderr, "DeviceIoControl failed with %d status (supplimentary code %d)\n",
+                    GetLastError(),
+                    bytes_ret);
+            goto finish;
+        }
+    }
+
+    if (data->header_only || (data->summary_interval != 0))
+    {
+        USBPCAP_CAPTURE_MODE mode;
+
+        mode.flags = 0;
+        if (data->header_only)
+        {
+            mode.flags |= USBPCAP_CAPTURE_HEADER_ONLY;
+        }
+        if (data->summary_interval != 0)
+        {
+            mode.flags |= USBPCAP_CAPTURE_SUMMARY;
+        }
+        if (!DeviceIoControl(filter_handle,
+                             IOCTL_USBPCAP_SET_CAPTURE_MODE,
+                             (char*)&mode,
+                             sizeof(USBPCAP_CAPTURE_MODE),
+                             NULL,
+                             0,
+                             &bytes_ret,
+                             0))
+        {
+            fprintf(stderr, "DeviceIoControl failed with %d status (supplimentary code %d)\n",
+                    GetLastError(),
+                    bytes_ret);
+            goto finish;
+        }
+    }
+
+    if (data->payload_match != NULL)
+    {
+        if (!DeviceIoControl(filter_handle,
+                             IOCTL_USBPCAP_SET_PAYLOAD_MATCH,
+                             (char*)data->payload_match,
+                             USBPCAP_PAYLOAD_MATCH_SIZE(data->payload_match->numberOfPatterns),
+                             NULL,
+                             0,
+                             &bytes_ret,
+                             0))
+        {
+            fprintf(stderr, "DeviceIoControl failed with %d status (supplimentary code %d)\n",
+                    GetLastError(),
+                    bytes_ret);
+            goto finish;
+        }
+    }
+
+    if (data->filter_program != NULL)
+    {
+        if (!DeviceIoControl(filter_handle,
+                             IOCTL_USBPCAP_SET_BPF,
+                             (char*)data->filter_program,
+                             USBPCAP_BPF_PROGRAM_SIZE(data->filter_program->numberOfInstructions),
+                             NULL,
+                             0,
+                             &bytes_ret,
+                             0))
+        {
+            fprintf(stderr, "DeviceIoControl failed with %d status (supplimentary code %d)\n",
+                    GetLastError(),
+                    bytes_ret);
+            goto finish;
+        }
+    }
+
     if (!DeviceIoControl(filter_handle,
                          IOCTL_USBPCAP_START_FILTERING,
                          (char*)&data->filter,
@@ -107,6 +223,66 @@ finish:
     return INVALID_HANDLE_VALUE;
 }
 
+/*
+ * Changes devices captured by running capture. list is comma separated
+ * list of addresses, "all" selects every device. Capture from new devices
+ * stays as configured on start. Driver writes filter marker record when
+ * the new filter takes effect.
+ */
+BOOL update_address_filter(struct thread_data *data, char *list)
+{
+    USBPCAP_ADDRESS_FILTER filter;
+    OVERLAPPED overlapped;
+    DWORD bytes_ret;
+    BOOL all = (strcmp(list, "all") == 0);
+
+    if ((data->read_handle == INVALID_HANDLE_VALUE) ||
+        (GetFileType(data->read_handle) == FILE_TYPE_PIPE))
+    {
+        fprintf(stderr, "Filter can be changed only in elevated USBPcapCMD\n");
+        return FALSE;
+    }
+
+    if (FALSE == USBPcapInitAddressFilter(&filter, all ? NULL : list, all))
+    {
+        return FALSE;
+    }
+    if (data->capture_new)
+    {
+        USBPcapSetDeviceFiltered(&filter, 0);
+    }
+
+    /* Read handle is overlapped and has read pending */
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+    if (!DeviceIoControl(data->read_handle,
+                         IOCTL_USBPCAP_START_FILTERING,
+                         (char*)&filter,
+                         sizeof(USBPCAP_ADDRESS_FILTER),
+                         NULL,
+                         0,
+                         NULL,
+                         &overlapped) &&
+        (GetLastError() != ERROR_IO_PENDING))
+    {
+        fprintf(stderr, "DeviceIoControl failed with %d status\n", GetLastError());
+        CloseHandle(overlapped.hEvent);
+        return FALSE;
+    }
+
+    if (!GetOverlappedResult(data->read_handle, &overlapped, &bytes_ret, TRUE))
+    {
+        fprintf(stderr, "GetOverlappedResult() on filter update failed: %d\n", GetLastError());
+        CloseHandle(overlapped.hEvent);
+        return FALSE;
+    }
+    CloseHandle(overlapped.hEvent);
+
+    memcpy(&data->filter, &filter, sizeof(USBPCAP_ADDRESS_FILTER));
+    return TRUE;
+}
+
 static void write_data(struct thread_data* data, LPOVERLAPPED write_overlapped,
                        void *buffer, DWORD bytes)
 {
@@ -140,6 +316,27 @@ static void write_data(struct thread_data* data, LPOVERLAPPED write_overlapped,
     ResetEvent(write_overlapped->hEvent);
 }
 
+static void compact_write(void *context, const void *buffer, size_t bytes)
+{
+    struct compact_output *output = (struct compact_output *)context;
+
+    write_data(output->data, output->write_overlapped, (void *)buffer, (DWORD)bytes);
+}
+
+/* Writes pcap data either directly or through compactor */
+static void output_data(struct thread_data* data, LPOVERLAPPED write_overlapped,
+                        void *buffer, DWORD bytes)
+{
+    if (data->compactor != NULL)
+    {
+        repeat_compactor_feed(data->compactor, buffer, bytes);
+    }
+    else
+    {
+        write_data(data, write_overlapped, buffer, bytes);
+    }
+}
+
 static void process_data(struct thread_data* data, LPOVERLAPPED write_overlapped,
                          unsigned char *buffer, DWORD bytes)
 {
@@ -156,10 +353,10 @@ static void process_data(struct thread_data* data, LPOVERLAPPED write_overlapped
         if (data->descriptors.buf_written == sizeof(pcap_hdr_t))
         {
             pcap_hdr_t *hdr = (pcap_hdr_t *)data->descriptors.buf;
-            write_data(data, write_overlapped, data->descriptors.buf, sizeof(pcap_hdr_t));
+            output_data(data, write_overlapped, data->descriptors.buf, sizeof(pcap_hdr_t));
             if ((hdr->magic_number == 0xA1B2C3D4) && (hdr->network == DLT_USBPCAP) && (data->descriptors.descriptors_len > 0))
             {
-                write_data(data, write_overlapped, data->descriptors.descriptors, data->descriptors.descriptors_len);
+                output_data(data, write_overlapped, data->descriptors.descriptors, data->descriptors.descriptors_len);
             }
         }
         buffer += to_write;
@@ -171,7 +368,56 @@ static void process_data(struct thread_data* data, LPOVERLAPPED write_overlapped
             return;
         }
     }
-    write_data(data, write_overlapped, buffer, bytes);
+    output_data(data, write_overlapped, buffer, bytes);
+}
+
+/* Writes current endpoint summary to output. */
+static void write_summary(struct thread_data* data, LPOVERLAPPED write_overlapped,
+                          PUSBPCAP_SUMMARY summary, char *text)
+{
+    OVERLAPPED overlapped;
+    FILETIME now;
+    UINT64 time;
+    DWORD bytes_ret;
+    int len;
+
+    /* Read handle is overlapped and may have read pending */
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+    if (!DeviceIoControl(data->read_handle,
+                         IOCTL_USBPCAP_GET_SUMMARY,
+                         NULL,
+                         0,
+                         summary,
+                         USBPCAP_SUMMARY_SIZE(USBPCAP_SUMMARY_MAX_ENDPOINTS),
+                         NULL,
+                         &overlapped) &&
+        (GetLastError() != ERROR_IO_PENDING))
+    {
+        fprintf(stderr, "DeviceIoControl failed with %d status\n", GetLastError());
+        CloseHandle(overlapped.hEvent);
+        return;
+    }
+
+    if (!GetOverlappedResult(data->read_handle, &overlapped, &bytes_ret, TRUE))
+    {
+        fprintf(stderr, "GetOverlappedResult() on summary failed: %d\n", GetLastError());
+        CloseHandle(overlapped.hEvent);
+        return;
+    }
+    CloseHandle(overlapped.hEvent);
+
+    /* FILETIME counts 100 ns intervals since January 1, 1601 */
+    GetSystemTimeAsFileTime(&now);
+    time = ((UINT64)now.dwHighDateTime << 32) | now.dwLowDateTime;
+    time = (time - 116444736000000000ULL) / 10000000ULL;
+
+    len = summary_format(summary, time, data->summary_json, text, SUMMARY_TEXT_LENGTH);
+    if (len > 0)
+    {
+        write_data(data, write_overlapped, text, len);
+    }
 }
 
 DWORD WINAPI read_thread(LPVOID param)
@@ -186,8 +432,12 @@ DWORD WINAPI read_thread(LPVOID param)
     OVERLAPPED write_handle_read_overlapped; /* Used to detect broken pipe. */
     DWORD read;
     DWORD err;
-    HANDLE table[5];
+    HANDLE table[6];
     int table_count = 0;
+    HANDLE summary_timer = NULL;
+    PUSBPCAP_SUMMARY summary = NULL;
+    char *summary_text = NULL;
+    struct compact_output compact_output;
 
     memset(&table, 0, sizeof(table));
 
@@ -250,6 +500,57 @@ DWORD WINAPI read_thread(LPVOID param)
         table_count++;
     }
 
+    /* Summary is sampled where the filter handle is open. Process that
+     * reads from elevated worker pipe only forwards the text.
+     */
+    if ((data->summary_interval != 0) &&
+        (GetFileType(data->read_handle) != FILE_TYPE_PIPE))
+    {
+        LARGE_INTEGER due;
+
+        summary = malloc(USBPCAP_SUMMARY_SIZE(USBPCAP_SUMMARY_MAX_ENDPOINTS));
+        summary_text = malloc(SUMMARY_TEXT_LENGTH);
+        summary_timer = CreateWaitableTimer(NULL, FALSE /* Auto Reset */, NULL);
+        if ((summary == NULL) || (summary_text == NULL) || (summary_timer == NULL))
+        {
+            fprintf(stderr, "Failed to setup summary sampling\n");
+            data->process = FALSE;
+        }
+        else
+        {
+            /* Negative due time is relative, in 100 ns units */
+            due.QuadPart = -10000000LL * data->summary_interval;
+            SetWaitableTimer(summary_timer, &due, data->summary_interval * 1000,
+                             NULL, NULL, FALSE);
+            table[table_count] = summary_timer;
+            table_count++;
+
+            if (data->summary_json == FALSE)
+            {
+                int len = summary_format_csv_header(summary_text, SUMMARY_TEXT_LENGTH);
+                write_data(data, &write_overlapped, summary_text, len);
+            }
+        }
+    }
+
+    /* Like summary, compaction is done where the filter handle is open.
+     * Process that reads from elevated worker pipe gets compacted data.
+     */
+    if (data->compact && (data->summary_interval == 0) &&
+        (GetFileType(data->read_handle) != FILE_TYPE_PIPE))
+    {
+        compact_output.data = data;
+        compact_output.write_overlapped = &write_overlapped;
+        data->compactor = repeat_compactor_create(compact_write, &compact_output,
+                                                  COMPACT_MAX_DELAY,
+                                                  COMPACT_MAX_QUEUE);
+        if (data->compactor == NULL)
+        {
+            fprintf(stderr, "Failed to allocate compactor\n");
+            data->process = FALSE;
+        }
+    }
+
     if (GetFileType(data->read_handle) == FILE_TYPE_PIPE)
     {
         table[table_count] = connect_overlapped.hEvent;
@@ -285,7 +586,11 @@ DWORD WINAPI read_thread(LPVOID param)
             {
                 GetOverlappedResult(data->read_handle, &read_overlapped, &read, TRUE);
                 ResetEvent(read_overlapped.hEvent);
-                process_data(data, &write_overlapped, buffer, read);
+                /* There are no packets in summary mode, only pcap header */
+                if (summary_timer == NULL)
+                {
+                    process_data(data, &write_overlapped, buffer, read);
+                }
                 /* Start new read. */
                 ReadFile(data->read_handle, (PVOID)buffer, data->bufferlen, &read, &read_overlapped);
             }
@@ -310,6 +615,10 @@ DWORD WINAPI read_thread(LPVOID param)
                     ReadFile(data->write_handle, &dummy_buf, sizeof(dummy_buf), NULL, &write_handle_read_overlapped);
                 }
             }
+            else if (table[i] == summary_timer)
+            {
+                write_summary(data, &write_overlapped, summary, summary_text);
+            }
             else if (table[i] == data->exit_event)
             {
                 /* We should quit as exit_event is set. */
@@ -329,6 +638,14 @@ DWORD WINAPI read_thread(LPVOID param)
         }
     }
 
+    if (data->compactor != NULL)
+    {
+        /* Write runs that are still open */
+        repeat_compactor_finish(data->compactor);
+        repeat_compactor_free(data->compactor);
+        data->compactor = NULL;
+    }
+
     CancelIo(data->read_handle);
     CancelIo(data->write_handle);
     CloseHandle(read_overlapped.hEvent);
@@ -341,6 +658,18 @@ finish:
     {
         free(buffer);
     }
+    if (summary_timer != NULL)
+    {
+        CloseHandle(summary_timer);
+    }
+    if (summary != NULL)
+    {
+        free(summary);
+    }
+    if (summary_text != NULL)
+    {
+        free(summary_text);
+    }
 
     /* Notify main thread that we are done.
      * If we are exiting due to exit_event being set by another thread,
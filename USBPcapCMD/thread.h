@@ -9,6 +9,7 @@
 
 #include <windows.h>
 #include "USBPcap.h"
+#include "repeat.h"
 
 struct inject_descriptors
 {
@@ -31,7 +32,19 @@ struct thread_data
     USBPCAP_ADDRESS_FILTER filter; /* Addresses that should be filtered */
     BOOLEAN capture_all; /* TRUE if all devices should be captured despite address_list. */
     BOOLEAN capture_new; /* TRUE if we should automatically capture from new devices. */
+    char *filter_expression; /* Capture filter expression, NULL if not set. */
+    PUSBPCAP_BPF_PROGRAM filter_program; /* Compiled filter_expression. */
     UINT32 snaplen; /* Snapshot length */
+    char *snaplen_policy_list; /* Comma separated snapshot length policy rules. */
+    PUSBPCAP_SNAPLEN_POLICY snaplen_policy; /* Parsed snaplen_policy_list. */
+    USBPCAP_SAMPLING sampling; /* URB sampling interval and device byte rate limit. */
+    BOOLEAN header_only; /* TRUE if transfer buffers should not be captured. */
+    char *payload_match_list; /* Comma separated payload patterns. */
+    PUSBPCAP_PAYLOAD_MATCH payload_match; /* Parsed payload_match_list. */
+    UINT32 summary_interval; /* Seconds between endpoint summary samples, 0 to capture packets. */
+    BOOLEAN summary_json; /* TRUE if summary is written as JSON lines instead of CSV. */
+    BOOLEAN compact; /* TRUE if repeated interrupt records should be compacted. */
+    struct repeat_compactor *compactor; /* Compactor output is written to write_handle. */
     UINT32 bufferlen; /* Internal kernel-mode buffer size */
     volatile BOOL process; /* FALSE if thread should stop */
     HANDLE read_handle; /* Handle to read data from. */
@@ -45,6 +58,7 @@ struct thread_data
 };
 
 HANDLE create_filter_read_handle(struct thread_data *data);
+BOOL update_address_filter(struct thread_data *data, char *list);
 DWORD WINAPI read_thread(LPVOID param);
 
 #endif /* USBPCAP_CMD_THREAD_H */
@@ -0,0 +1,465 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include "USBPcapBPF.h"
+
+typedef struct
+{
+    PUCHAR                  header;
+    UINT32                  headerLen;
+    PUSBPCAP_PAYLOAD_ENTRY  payload;
+    UINT32                  length;
+} USBPCAP_BPF_PACKET, *PUSBPCAP_BPF_PACKET;
+
+BOOLEAN USBPcapBPFValidate(const USBPCAP_BPF_INSN *insn,
+                           UINT32 numberOfInstructions)
+{
+    UINT32 pc;
+
+    if ((numberOfInstructions == 0) ||
+        (numberOfInstructions > USBPCAP_BPF_MAX_INSTRUCTIONS))
+    {
+        return FALSE;
+    }
+
+    for (pc = 0; pc < numberOfInstructions; pc++)
+    {
+        const USBPCAP_BPF_INSN *p = &insn[pc];
+        /* Number of instructions after this one */
+        UINT32 left = numberOfInstructions - pc - 1;
+
+        switch (BPF_CLASS(p->code))
+        {
+            case BPF_LD:
+            case BPF_LDX:
+                switch (BPF_MODE(p->code))
+                {
+                    case BPF_IMM:
+                    case BPF_LEN:
+                        break;
+                    case BPF_ABS:
+                    case BPF_IND:
+                    case BPF_MSH:
+                        /* Out of packet loads are checked at runtime */
+                        break;
+                    case BPF_MEM:
+                        if (p->k >= USBPCAP_BPF_MEMWORDS)
+                        {
+                            return FALSE;
+                        }
+                        break;
+                    default:
+                        return FALSE;
+                }
+                if ((BPF_CLASS(p->code) == BPF_LDX) &&
+                    (p->code != (BPF_LDX | BPF_W | BPF_IMM)) &&
+                    (p->code != (BPF_LDX | BPF_W | BPF_MEM)) &&
+                    (p->code != (BPF_LDX | BPF_W | BPF_LEN)) &&
+                    (p->code != (BPF_LDX | BPF_B | BPF_MSH)))
+                {
+                    return FALSE;
+                }
+                if ((BPF_CLASS(p->code) == BPF_LD) &&
+                    (BPF_MODE(p->code) == BPF_MSH))
+                {
+                    return FALSE;
+                }
+                break;
+
+            case BPF_ST:
+            case BPF_STX:
+                if (p->k >= USBPCAP_BPF_MEMWORDS)
+                {
+                    return FALSE;
+                }
+                break;
+
+            case BPF_ALU:
+                switch (BPF_OP(p->code))
+                {
+                    case BPF_ADD:
+                    case BPF_SUB:
+                    case BPF_MUL:
+                    case BPF_OR:
+                    case BPF_AND:
+                    case BPF_XOR:
+                    case BPF_LSH:
+                    case BPF_RSH:
+                    case BPF_NEG:
+                        break;
+                    case BPF_DIV:
+                    case BPF_MOD:
+                        /* Check for constant division by 0 */
+                        if ((BPF_SRC(p->code) == BPF_K) && (p->k == 0))
+                        {
+                            return FALSE;
+                        }
+                        break;
+                    default:
+                        return FALSE;
+                }
+                break;
+
+            case BPF_JMP:
+                /* Backward jumps are impossible as offsets are unsigned.
+                 * Every program terminates.
+                 */
+                switch (BPF_OP(p->code))
+                {
+                    case BPF_JA:
+                        if (p->k >= left)
+                        {
+                            return FALSE;
+                        }
+                        break;
+                    case BPF_JEQ:
+                    case BPF_JGT:
+                    case BPF_JGE:
+                    case BPF_JSET:
+                        if ((p->jt >= left) || (p->jf >= left))
+                        {
+                            return FALSE;
+                        }
+                        break;
+                    default:
+                        return FALSE;
+                }
+                break;
+
+            case BPF_RET:
+                break;
+
+            case BPF_MISC:
+                if ((BPF_MISCOP(p->code) != BPF_TAX) &&
+                    (BPF_MISCOP(p->code) != BPF_TXA))
+                {
+                    return FALSE;
+                }
+                break;
+
+            default:
+                return FALSE;
+        }
+    }
+
+    return (BPF_CLASS(insn[numberOfInstructions - 1].code) == BPF_RET) ?
+        TRUE : FALSE;
+}
+
+/*
+ * Loads size bytes at offset as big endian value.
+ *
+ * Returns FALSE if the load is not within packet.
+ */
+static BOOLEAN USBPcapBPFLoad(PUSBPCAP_BPF_PACKET packet,
+                              UINT32 offset,
+                              UINT32 size,
+                              UINT32 *value)
+{
+    PUSBPCAP_PAYLOAD_ENTRY  entry;
+    UINT32                  entryOffset;
+    UINT32                  result;
+    UINT32                  i;
+
+    if ((offset >= packet->length) || (size > packet->length - offset))
+    {
+        return FALSE;
+    }
+
+    entry = packet->payload;
+    entryOffset = packet->headerLen;
+    result = 0;
+    for (i = 0; i < size; i++)
+    {
+        UINT32 pos = offset + i;
+        UCHAR  byte;
+
+        if (pos < packet->headerLen)
+        {
+            byte = packet->header[pos];
+        }
+        else
+        {
+            /* packet->length guarantees there is entry with this byte */
+            while (pos - entryOffset >= entry->size)
+            {
+                entryOffset += entry->size;
+                entry++;
+            }
+            byte = ((PUCHAR)entry->buffer)[pos - entryOffset];
+        }
+
+        result = (result << 8) | byte;
+    }
+
+    *value = result;
+    return TRUE;
+}
+
+UINT32 USBPcapBPFRun(const USBPCAP_BPF_INSN *insn,
+                     PVOID header,
+                     UINT32 headerLen,
+                     PUSBPCAP_PAYLOAD_ENTRY payload,
+                     UINT32 dataLength)
+{
+    USBPCAP_BPF_PACKET  packet;
+    UINT32              A = 0;
+    UINT32              X = 0;
+    UINT32              mem[USBPCAP_BPF_MEMWORDS] = {0};
+    UINT32              available;
+    UINT32              value;
+    int                 i;
+    const USBPCAP_BPF_INSN *p;
+
+    /* Program sees only the payload that is really present */
+    available = 0;
+    for (i = 0; (available < dataLength) && (payload[i].buffer != NULL); i++)
+    {
+        available += payload[i].size;
+    }
+
+    packet.header = (PUCHAR)header;
+    packet.headerLen = headerLen;
+    packet.payload = payload;
+    packet.length = headerLen + ((available < dataLength) ? available : dataLength);
+
+    for (p = insn; ; p++)
+    {
+        switch (p->code)
+        {
+            case BPF_RET | BPF_K:
+                return p->k;
+
+            case BPF_RET | BPF_A:
+                return A;
+
+            case BPF_LD | BPF_W | BPF_ABS:
+                if (!USBPcapBPFLoad(&packet, p->k, 4, &A))
+                {
+                    return 0;
+                }
+                break;
+
+            case BPF_LD | BPF_H | BPF_ABS:
+                if (!USBPcapBPFLoad(&packet, p->k, 2, &A))
+                {
+                    return 0;
+                }
+                break;
+
+            case BPF_LD | BPF_B | BPF_ABS:
+                if (!USBPcapBPFLoad(&packet, p->k, 1, &A))
+                {
+                    return 0;
+                }
+                break;
+
+            case BPF_LD | BPF_W | BPF_IND:
+                if ((p->k + X < p->k) ||
+                    !USBPcapBPFLoad(&packet, p->k + X, 4, &A))
+                {
+                    return 0;
+                }
+                break;
+
+            case BPF_LD | BPF_H | BPF_IND:
+                if ((p->k + X < p->k) ||
+                    !USBPcapBPFLoad(&packet, p->k + X, 2, &A))
+                {
+                    return 0;
+                }
+                break;
+
+            case BPF_LD | BPF_B | BPF_IND:
+                if ((p->k + X < p->k) ||
+                    !USBPcapBPFLoad(&packet, p->k + X, 1, &A))
+                {
+                    return 0;
+                }
+                break;
+
+            case BPF_LD | BPF_W | BPF_LEN:
+                A = packet.length;
+                break;
+
+            case BPF_LDX | BPF_W | BPF_LEN:
+                X = packet.length;
+                break;
+
+            case BPF_LDX | BPF_B | BPF_MSH:
+                if (!USBPcapBPFLoad(&packet, p->k, 1, &value))
+                {
+                    return 0;
+                }
+                X = (value & 0x0F) << 2;
+                break;
+
+            case BPF_LD | BPF_IMM:
+                A = p->k;
+                break;
+
+            case BPF_LDX | BPF_IMM:
+                X = p->k;
+                break;
+
+            case BPF_LD | BPF_MEM:
+                A = mem[p->k];
+                break;
+
+            case BPF_LDX | BPF_MEM:
+                X = mem[p->k];
+                break;
+
+            case BPF_ST:
+                mem[p->k] = A;
+                break;
+
+            case BPF_STX:
+                mem[p->k] = X;
+                break;
+
+            case BPF_JMP | BPF_JA:
+                p += p->k;
+                break;
+
+            case BPF_JMP | BPF_JGT | BPF_K:
+                p += (A > p->k) ? p->jt : p->jf;
+                break;
+
+            case BPF_JMP | BPF_JGE | BPF_K:
+                p += (A >= p->k) ? p->jt : p->jf;
+                break;
+
+            case BPF_JMP | BPF_JEQ | BPF_K:
+                p += (A == p->k) ? p->jt : p->jf;
+                break;
+
+            case BPF_JMP | BPF_JSET | BPF_K:
+                p += (A & p->k) ? p->jt : p->jf;
+                break;
+
+            case BPF_JMP | BPF_JGT | BPF_X:
+                p += (A > X) ? p->jt : p->jf;
+                break;
+
+            case BPF_JMP | BPF_JGE | BPF_X:
+                p += (A >= X) ? p->jt : p->jf;
+                break;
+
+            case BPF_JMP | BPF_JEQ | BPF_X:
+                p += (A == X) ? p->jt : p->jf;
+                break;
+
+            case BPF_JMP | BPF_JSET | BPF_X:
+                p += (A & X) ? p->jt : p->jf;
+                break;
+
+            case BPF_ALU | BPF_ADD | BPF_X:
+                A += X;
+                break;
+
+            case BPF_ALU | BPF_SUB | BPF_X:
+                A -= X;
+                break;
+
+            case BPF_ALU | BPF_MUL | BPF_X:
+                A *= X;
+                break;
+
+            case BPF_ALU | BPF_DIV | BPF_X:
+                if (X == 0)
+                {
+                    return 0;
+                }
+                A /= X;
+                break;
+
+            case BPF_ALU | BPF_MOD | BPF_X:
+                if (X == 0)
+                {
+                    return 0;
+                }
+                A %= X;
+                break;
+
+            case BPF_ALU | BPF_AND | BPF_X:
+                A &= X;
+                break;
+
+            case BPF_ALU | BPF_OR | BPF_X:
+                A |= X;
+                break;
+
+            case BPF_ALU | BPF_XOR | BPF_X:
+                A ^= X;
+                break;
+
+            case BPF_ALU | BPF_LSH | BPF_X:
+                A = (X < 32) ? (A << X) : 0;
+                break;
+
+            case BPF_ALU | BPF_RSH | BPF_X:
+                A = (X < 32) ? (A >> X) : 0;
+                break;
+
+            case BPF_ALU | BPF_ADD | BPF_K:
+                A += p->k;
+                break;
+
+            case BPF_ALU | BPF_SUB | BPF_K:
+                A -= p->k;
+                break;
+
+            case BPF_ALU | BPF_MUL | BPF_K:
+                A *= p->k;
+                break;
+
+            case BPF_ALU | BPF_DIV | BPF_K:
+                A /= p->k;
+                break;
+
+            case BPF_ALU | BPF_MOD | BPF_K:
+                A %= p->k;
+                break;
+
+            case BPF_ALU | BPF_AND | BPF_K:
+                A &= p->k;
+                break;
+
+            case BPF_ALU | BPF_OR | BPF_K:
+                A |= p->k;
+                break;
+
+            case BPF_ALU | BPF_XOR | BPF_K:
+                A ^= p->k;
+                break;
+
+            case BPF_ALU | BPF_LSH | BPF_K:
+                A = (p->k < 32) ? (A << p->k) : 0;
+                break;
+
+            case BPF_ALU | BPF_RSH | BPF_K:
+                A = (p->k < 32) ? (A >> p->k) : 0;
+                break;
+
+            case BPF_ALU | BPF_NEG:
+                A = (UINT32)(-(INT32)A);
+                break;
+
+            case BPF_MISC | BPF_TAX:
+                X = A;
+                break;
+
+            case BPF_MISC | BPF_TXA:
+                A = X;
+                break;
+
+            default:
+                /* USBPcapBPFValidate() rejects such programs */
+                return 0;
+        }
+    }
+}
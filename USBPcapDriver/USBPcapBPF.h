@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_BPF_H
+#define USBPCAP_BPF_H
+
+/* This module does not depend on any kernel functionality */
+#include "include/USBPcap.h"
+
+/* Array of payload entries is terminated with {0, NULL} element */
+typedef struct
+{
+    UINT32  size;
+    PVOID   buffer;
+} USBPCAP_PAYLOAD_ENTRY, *PUSBPCAP_PAYLOAD_ENTRY;
+
+/* Checks if program is safe to run with USBPcapBPFRun().
+ *
+ * Program must end with return instruction, all jumps must be forward
+ * and land inside the program, scratch memory indices must be valid and
+ * there must be no division by constant zero.
+ */
+BOOLEAN USBPcapBPFValidate(const USBPCAP_BPF_INSN *insn,
+                           UINT32 numberOfInstructions);
+
+/* Runs validated program over packet made of header followed by at most
+ * dataLength bytes of payload entries.
+ *
+ * Returns program return value, 0 means reject.
+ */
+UINT32 USBPcapBPFRun(const USBPCAP_BPF_INSN *insn,
+                     PVOID header,
+                     UINT32 headerLen,
+                     PUSBPCAP_PAYLOAD_ENTRY payload,
+                     UINT32 dataLength);
+
+#endif /* USBPCAP_BPF_H */
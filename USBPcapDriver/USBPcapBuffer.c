@@ -6,9 +6,12 @@
 
 #include "USBPcapMain.h"
 #include "USBPcapBuffer.h"
-#include "USBPcapHelperFunctions.h"
+#include "USBPcapCapture.h"
 
 #define USBPCAP_BUFFER_TAG  (ULONG)'ffuB'
+#define USBPCAP_BPF_TAG     (ULONG)'FPBU'
+#define USBPCAP_POLICY_TAG  (ULONG)'lpnS'
+#define USBPCAP_MATCH_TAG   (ULONG)'hctM'
 
 __inline static UINT32
 USBPcapGetBufferFree(PUSBPCAP_ROOTHUB_DATA pData)
@@ -332,6 +335,151 @@ NTSTATUS USBPcapSetSnaplenSize(PUSBPCAP_ROOTHUB_DATA pData,
     return status;
 }
 
+/*
+ * Replaces the BPF program run over every record. NULL program, or
+ * program without instructions, removes the filter.
+ */
+NTSTATUS USBPcapBufferSetBPF(PUSBPCAP_ROOTHUB_DATA pData,
+                             PUSBPCAP_BPF_PROGRAM program)
+{
+    PUSBPCAP_BPF_PROGRAM  copy = NULL;
+    PUSBPCAP_BPF_PROGRAM  old;
+    KIRQL                 irql;
+
+    if ((program != NULL) && (program->numberOfInstructions > 0))
+    {
+        SIZE_T size;
+
+        if (!USBPcapBPFValidate(program->insn, program->numberOfInstructions))
+        {
+            DkDbgStr("Invalid BPF program");
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        size = USBPCAP_BPF_PROGRAM_SIZE(program->numberOfInstructions);
+        copy = (PUSBPCAP_BPF_PROGRAM)ExAllocatePoolWithTag(NonPagedPool,
+                                                           size,
+                                                           USBPCAP_BPF_TAG);
+        if (copy == NULL)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        RtlCopyMemory(copy, program, size);
+    }
+
+    /* Program is used only with buffer lock held */
+    KeAcquireSpinLock(&pData->bufferLock, &irql);
+    old = pData->bpfProgram;
+    pData->bpfProgram = copy;
+    KeReleaseSpinLock(&pData->bufferLock, irql);
+
+    if (old != NULL)
+    {
+        ExFreePool((PVOID)old);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Replaces the payload match patterns. NULL match, or match without
+ * patterns, removes them.
+ */
+NTSTATUS USBPcapBufferSetPayloadMatch(PUSBPCAP_ROOTHUB_DATA pData,
+                                      PUSBPCAP_PAYLOAD_MATCH match)
+{
+    PUSBPCAP_PAYLOAD_MATCH  copy = NULL;
+    PUSBPCAP_PAYLOAD_MATCH  old;
+    KIRQL                   irql;
+
+    if ((match != NULL) && (match->numberOfPatterns > 0))
+    {
+        SIZE_T size;
+
+        if (!USBPcapMatchValidate(match))
+        {
+            DkDbgStr("Invalid payload match");
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        size = USBPCAP_PAYLOAD_MATCH_SIZE(match->numberOfPatterns);
+        copy = (PUSBPCAP_PAYLOAD_MATCH)ExAllocatePoolWithTag(NonPagedPool,
+                                                             size,
+                                                             USBPCAP_MATCH_TAG);
+        if (copy == NULL)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        RtlCopyMemory(copy, match, size);
+    }
+
+    /* Patterns are used only with buffer lock held */
+    KeAcquireSpinLock(&pData->bufferLock, &irql);
+    old = pData->payloadMatch;
+    pData->payloadMatch = copy;
+    KeReleaseSpinLock(&pData->bufferLock, irql);
+
+    if (old != NULL)
+    {
+        ExFreePool((PVOID)old);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Replaces the snapshot length policy. NULL policy, or policy without
+ * rules, removes it.
+ */
+NTSTATUS USBPcapBufferSetSnaplenPolicy(PUSBPCAP_ROOTHUB_DATA pData,
+                                       PUSBPCAP_SNAPLEN_POLICY policy)
+{
+    PUSBPCAP_SNAPLEN_POLICY  copy = NULL;
+    PUSBPCAP_SNAPLEN_POLICY  old;
+    KIRQL                    irql;
+
+    if ((policy != NULL) && (policy->numberOfRules > 0))
+    {
+        SIZE_T size;
+        UINT32 i;
+
+        for (i = 0; i < policy->numberOfRules; i++)
+        {
+            PUSBPCAP_ENDPOINT_FILTER_RULE rule = &policy->rule[i].match;
+
+            if (((rule->device > 127) && (rule->device != USBPCAP_FILTER_ANY)) ||
+                ((rule->endpoint > 15) && (rule->endpoint != USBPCAP_FILTER_ANY)))
+            {
+                DkDbgVal("Invalid snaplen policy rule", i);
+                return STATUS_INVALID_PARAMETER;
+            }
+        }
+
+        size = USBPCAP_SNAPLEN_POLICY_SIZE(policy->numberOfRules);
+        copy = (PUSBPCAP_SNAPLEN_POLICY)ExAllocatePoolWithTag(NonPagedPool,
+                                                              size,
+                                                              USBPCAP_POLICY_TAG);
+        if (copy == NULL)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        RtlCopyMemory(copy, policy, size);
+    }
+
+    /* Policy is used only with buffer lock held */
+    KeAcquireSpinLock(&pData->bufferLock, &irql);
+    old = pData->snaplenPolicy;
+    pData->snaplenPolicy = copy;
+    KeReleaseSpinLock(&pData->bufferLock, irql);
+
+    if (old != NULL)
+    {
+        ExFreePool((PVOID)old);
+    }
+
+    return STATUS_SUCCESS;
+}
+
 /*
  * If there is buffer allocated for given control device, frees all
  * memory allocated to it, otherwise does nothing.
@@ -511,16 +659,66 @@ static void USBPcapBufferCompletePendedReadIrp(PUSBPCAP_ROOTHUB_DATA pRootData)
     }
 }
 
+/*
+ * Returns the maximum number of payload bytes to capture according to
+ * snapshot length policy.
+ *
+ * Caller must hold bufferLock.
+ */
+static UINT32
+USBPcapGetMaxDataLength(PUSBPCAP_ROOTHUB_DATA pData,
+                        USHORT device,
+                        UCHAR endpoint,
+                        UCHAR transfer)
+{
+    PUSBPCAP_SNAPLEN_POLICY  policy = pData->snaplenPolicy;
+    UCHAR                    direction;
+    UINT32                   i;
+
+    if ((policy == NULL) || (transfer > USBPCAP_TRANSFER_BULK))
+    {
+        return MAXULONG;
+    }
+
+    direction = (endpoint & 0x80) ? USBPCAP_FILTER_DIRECTION_IN :
+                                    USBPCAP_FILTER_DIRECTION_OUT;
+
+    for (i = 0; i < policy->numberOfRules; i++)
+    {
+        PUSBPCAP_ENDPOINT_FILTER_RULE rule = &policy->rule[i].match;
+
+        if (((rule->device == USBPCAP_FILTER_ANY) ||
+             (rule->device == device)) &&
+            ((rule->endpoint == USBPCAP_FILTER_ANY) ||
+             (rule->endpoint == (endpoint & 0x0F))) &&
+            (rule->direction & direction) &&
+            (rule->transfers & USBPCAP_FILTER_TRANSFER(transfer)))
+        {
+            return policy->rule[i].maxDataLength;
+        }
+    }
+
+    return MAXULONG;
+}
+
+/*
+ * Caller must hold bufferLock.
+ */
 __inline static VOID
 USBPcapInitializePcapHeader(PUSBPCAP_ROOTHUB_DATA pData,
                             LARGE_INTEGER timestamp,
                             pcaprec_hdr_t *pcapHeader,
-                            UINT32 bytes)
+                            UINT32 headerLen,
+                            UINT32 dataLength,
+                            UINT32 maxDataLength)
 {
+    UINT32 bytes;
+
     pcapHeader->ts_sec = (UINT32)(timestamp.QuadPart/10000000-11644473600);
     pcapHeader->ts_usec = (UINT32)((timestamp.QuadPart%10000000)/10);
 
-    /* Obey the snaplen limit */
+    /* Obey the snaplen policy and limit */
+    bytes = headerLen + min(dataLength, maxDataLength);
     if (bytes > pData->snaplen)
     {
         pcapHeader->incl_len = pData->snaplen;
@@ -529,12 +727,128 @@ USBPcapInitializePcapHeader(PUSBPCAP_ROOTHUB_DATA pData,
     {
         pcapHeader->incl_len = bytes;
     }
-    pcapHeader->orig_len = bytes;
+    pcapHeader->orig_len = headerLen + dataLength;
+}
+
+/*
+ * Runs payload match over the captured part of payload and BPF program
+ * over the whole record. Filter markers are always accepted, they show
+ * where the capture filter changed.
+ *
+ * Returns NULL if the record is accepted, otherwise the statistics
+ * counter of the rejection.
+ *
+ * Caller must hold bufferLock.
+ */
+static volatile LONG *
+USBPcapBufferFilterRecord(PUSBPCAP_ROOTHUB_DATA pRootData,
+                          PUSBPCAP_BUFFER_PACKET_HEADER header,
+                          UINT32 headerLen,
+                          PUSBPCAP_PAYLOAD_ENTRY payload,
+                          UINT32 dataLength,
+                          UINT32 capturedLength)
+{
+    if (header->transfer == USBPCAP_TRANSFER_FILTER_MARKER)
+    {
+        return NULL;
+    }
+
+    if ((pRootData->payloadMatch != NULL) &&
+        (USBPcapMatchRun(pRootData->payloadMatch, header->transfer,
+                         payload, capturedLength) == FALSE))
+    {
+        return &pRootData->matchRejected;
+    }
+
+    if ((pRootData->bpfProgram != NULL) &&
+        (USBPcapBPFRun(pRootData->bpfProgram->insn,
+                       (PVOID)header, headerLen,
+                       payload, dataLength) == 0))
+    {
+        return &pRootData->bpfRejected;
+    }
+
+    return NULL;
+}
+
+/*
+ * Same as USBPcapBufferFilterRecord() but counts the rejection.
+ *
+ * Caller must hold bufferLock.
+ */
+static BOOLEAN
+USBPcapBufferAcceptRecord(PUSBPCAP_ROOTHUB_DATA pRootData,
+                          PUSBPCAP_BUFFER_PACKET_HEADER header,
+                          UINT32 headerLen,
+                          PUSBPCAP_PAYLOAD_ENTRY payload,
+                          UINT32 dataLength,
+                          UINT32 capturedLength)
+{
+    volatile LONG *rejected;
+
+    rejected = USBPcapBufferFilterRecord(pRootData, header, headerLen,
+                                         payload, dataLength,
+                                         capturedLength);
+    if (rejected != NULL)
+    {
+        InterlockedIncrement(rejected);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Writes pcap record header, USBPcap header and payload of already
+ * reserved record, pcapHeader->incl_len bytes in total.
+ *
+ * Caller must hold bufferLock.
+ */
+static VOID
+USBPcapBufferCopyRecord(PUSBPCAP_ROOTHUB_DATA pRootData,
+                        pcaprec_hdr_t *pcapHeader,
+                        PUSBPCAP_BUFFER_PACKET_HEADER header,
+                        PUSBPCAP_PAYLOAD_ENTRY payloadEntries)
+{
+    UINT32             bytes = pcapHeader->incl_len;
+    UINT32             tmp;
+    int                i;
+
+    /* Write Packet Header */
+    USBPcapBufferWriteUnsafe(pRootData,
+                             (PVOID) pcapHeader,
+                             (UINT32) sizeof(pcaprec_hdr_t));
+
+    /* Write USBPCAP_BUFFER_PACKET_HEADER */
+    tmp = min(bytes, (UINT32)header->headerLen);
+    if (tmp > 0)
+    {
+        USBPcapBufferWriteUnsafe(pRootData,
+                                 (PVOID) header,
+                                 tmp);
+    }
+    bytes -= tmp;
+
+    /* Write payload entries */
+    for (i = 0; (bytes > 0) && (payloadEntries[i].buffer); i++)
+    {
+        tmp = min(bytes, payloadEntries[i].size);
+        if (tmp > 0)
+        {
+            USBPcapBufferWriteUnsafe(pRootData,
+                                     payloadEntries[i].buffer,
+                                     tmp);
+        }
+        bytes -= tmp;
+    }
 }
 
 /* Caller must hold bufferLock
  *
  * payloadEntries is array of USBPCAP_PAYLOAD_ENTRY with the last element being {0, NULL}
+ *
+ * Returns STATUS_CANCELLED if the packet was rejected by payload match
+ * or BPF program.
  */
 static NTSTATUS
 USBPcapBufferStorePacket(PUSBPCAP_ROOTHUB_DATA pRootData,
@@ -544,13 +858,23 @@ USBPcapBufferStorePacket(PUSBPCAP_ROOTHUB_DATA pRootData,
 {
     UINT32             bytes;
     UINT32             bytesFree;
-    UINT32             tmp;
     pcaprec_hdr_t      pcapHeader;
     int                i;
 
-    bytes = header->headerLen + header->dataLength;
-
-    USBPcapInitializePcapHeader(pRootData, timestamp, &pcapHeader, bytes);
+    USBPcapInitializePcapHeader(pRootData, timestamp, &pcapHeader,
+                                header->headerLen, header->dataLength,
+                                USBPcapGetMaxDataLength(pRootData,
+                                                        header->device,
+                                                        header->endpoint,
+                                                        header->transfer));
+
+    if (!USBPcapBufferAcceptRecord(pRootData, header, header->headerLen,
+                                   payloadEntries, header->dataLength,
+                                   pcapHeader.incl_len -
+                                   min(pcapHeader.incl_len, (UINT32)header->headerLen)))
+    {
+        return STATUS_CANCELLED;
+    }
 
     /* pcapHeader.incl_len contains the number of bytes to write */
     bytes = pcapHeader.incl_len;
@@ -578,41 +902,340 @@ USBPcapBufferStorePacket(PUSBPCAP_ROOTHUB_DATA pRootData,
         (bytesFree < sizeof(pcaprec_hdr_t)) ||
         ((bytesFree - sizeof(pcaprec_hdr_t)) < bytes))
     {
+        if (pRootData->buffer != NULL)
+        {
+            InterlockedIncrement(&pRootData->bufferFull);
+        }
         DkDbgStr("No enough free space left.");
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    /* Write Packet Header */
+    USBPcapBufferCopyRecord(pRootData, &pcapHeader, header, payloadEntries);
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Copies data to given ring buffer offset.
+ *
+ * Caller must hold bufferLock and the space must already be reserved.
+ */
+__inline static void
+USBPcapBufferCopyToOffset(PUSBPCAP_ROOTHUB_DATA pData,
+                          UINT32 offset,
+                          PVOID data,
+                          UINT32 length)
+{
+    PCHAR buffer = (PCHAR)pData->buffer;
+    UINT32 tmp;
+
+    tmp = min(length, pData->bufferSize - offset);
+    RtlCopyMemory((PVOID)&buffer[offset], data, (SIZE_T)tmp);
+    if (tmp < length)
+    {
+        RtlCopyMemory(pData->buffer, (PVOID)&((PCHAR)data)[tmp],
+                      (SIZE_T)(length - tmp));
+    }
+}
+
+NTSTATUS USBPcapBufferBeginRecord(PUSBPCAP_ROOTHUB_DATA pRootData,
+                                  LARGE_INTEGER timestamp,
+                                  USHORT headerLen,
+                                  UINT32 dataLength,
+                                  USHORT device,
+                                  UCHAR endpoint,
+                                  UCHAR transfer,
+                                  UINT32 maxDataLength,
+                                  PUSBPCAP_BUFFER_RECORD record)
+{
+    pcaprec_hdr_t      pcapHeader;
+    UINT32             bytesFree;
+    PCHAR              buffer;
+
+    ASSERT(headerLen <= sizeof(record->bounce));
+
+    record->pRootData = pRootData;
+    record->headerLen = headerLen;
+    record->dataLength = dataLength;
+    record->numberOfPayloads = 0;
+    record->payload[0].size = 0;
+    record->payload[0].buffer = NULL;
+    KeAcquireSpinLock(&pRootData->bufferLock, &record->irql);
+
+    maxDataLength = min(maxDataLength,
+                        USBPcapGetMaxDataLength(pRootData, device,
+                                                endpoint, transfer));
+    USBPcapInitializePcapHeader(pRootData, timestamp, &pcapHeader,
+                                headerLen, dataLength, maxDataLength);
+
+    /* This is the only bounds check for the whole record */
+    bytesFree = USBPcapGetBufferFree(pRootData);
+    if ((pRootData->buffer == NULL) ||
+        (bytesFree < sizeof(pcaprec_hdr_t)) ||
+        ((bytesFree - sizeof(pcaprec_hdr_t)) < pcapHeader.incl_len))
+    {
+        if (pRootData->buffer != NULL)
+        {
+            InterlockedIncrement(&pRootData->bufferFull);
+        }
+        KeReleaseSpinLock(&pRootData->bufferLock, record->irql);
+        DkDbgStr("No enough free space left.");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    record->startOffset = pRootData->writeOffset;
     USBPcapBufferWriteUnsafe(pRootData,
                              (PVOID) &pcapHeader,
                              (UINT32) sizeof(pcaprec_hdr_t));
 
-    /* Write USBPCAP_BUFFER_PACKET_HEADER */
-    tmp = min(bytes, (UINT32)header->headerLen);
-    if (tmp > 0)
+    buffer = (PCHAR)pRootData->buffer;
+    record->headerOffset = pRootData->writeOffset;
+    record->headerBytes = min(pcapHeader.incl_len, (UINT32)headerLen);
+    record->dataBytes = pcapHeader.incl_len - record->headerBytes;
+
+    if ((record->headerBytes == headerLen) &&
+        (pRootData->bufferSize - pRootData->writeOffset >= headerLen))
     {
-        USBPcapBufferWriteUnsafe(pRootData,
-                                 (PVOID) header,
-                                 tmp);
+        /* Header is filled in place */
+        record->header = (PUSBPCAP_BUFFER_PACKET_HEADER)&buffer[pRootData->writeOffset];
+    }
+    else
+    {
+        /* Header wraps around or is truncated by snaplen */
+        record->header = (PUSBPCAP_BUFFER_PACKET_HEADER)&record->bounce;
     }
-    bytes -= tmp;
 
-    /* Write payload entries */
-    for (i = 0; (bytes > 0) && (payloadEntries[i].buffer); i++)
+    pRootData->writeOffset += record->headerBytes;
+    pRootData->writeOffset %= pRootData->bufferSize;
+
+    return STATUS_SUCCESS;
+}
+
+VOID USBPcapBufferRecordWriteData(PUSBPCAP_BUFFER_RECORD record,
+                                  PVOID data,
+                                  UINT32 length)
+{
+    int i;
+
+    if ((length == 0) || (data == NULL))
     {
-        tmp = min(bytes, payloadEntries[i].size);
-        if (tmp > 0)
+        return;
+    }
+
+    ASSERT(record->numberOfPayloads < USBPCAP_BUFFER_RECORD_MAX_PAYLOAD);
+
+    i = record->numberOfPayloads++;
+    record->payload[i].size = length;
+    record->payload[i].buffer = data;
+    record->payload[i + 1].size = 0;
+    record->payload[i + 1].buffer = NULL;
+}
+
+VOID USBPcapBufferEndRecord(PUSBPCAP_BUFFER_RECORD record)
+{
+    PUSBPCAP_ROOTHUB_DATA  pRootData = record->pRootData;
+    int                    i;
+
+    if (!USBPcapBufferAcceptRecord(pRootData, record->header,
+                                   record->headerLen, record->payload,
+                                   record->dataLength, record->dataBytes))
+    {
+        /* Give back the reserved space */
+        pRootData->writeOffset = record->startOffset;
+        KeReleaseSpinLock(&pRootData->bufferLock, record->irql);
+        return;
+    }
+
+    for (i = 0; (record->dataBytes > 0) && (record->payload[i].buffer); i++)
+    {
+        UINT32 tmp = min(record->dataBytes, record->payload[i].size);
+
+        USBPcapBufferWriteUnsafe(pRootData, record->payload[i].buffer, tmp);
+        record->dataBytes -= tmp;
+    }
+
+    if (record->header == (PUSBPCAP_BUFFER_PACKET_HEADER)&record->bounce)
+    {
+        if (record->headerBytes > 0)
         {
-            USBPcapBufferWriteUnsafe(pRootData,
-                                     payloadEntries[i].buffer,
-                                     tmp);
+            USBPcapBufferCopyToOffset(pRootData, record->headerOffset,
+                                      (PVOID)&record->bounce,
+                                      record->headerBytes);
         }
-        bytes -= tmp;
     }
 
+    /* Never leave uninitialized memory in the buffer if the caller did not
+     * provide all the payload it reserved space for.
+     */
+    if (record->dataBytes > 0)
+    {
+        static const UCHAR zeroes[64] = {0};
+
+        DkDbgVal("Record payload missing", record->dataBytes);
+        while (record->dataBytes > 0)
+        {
+            UINT32 tmp = min(record->dataBytes, sizeof(zeroes));
+
+            USBPcapBufferWriteUnsafe(pRootData, (PVOID)zeroes, tmp);
+            record->dataBytes -= tmp;
+        }
+    }
+
+    KeReleaseSpinLock(&pRootData->bufferLock, record->irql);
+
+    USBPcapBufferCompletePendedReadIrp(pRootData);
+}
+
+VOID USBPcapBufferBeginGroup(PUSBPCAP_ROOTHUB_DATA pRootData,
+                             PUSBPCAP_BUFFER_GROUP group)
+{
+    group->pRootData = pRootData;
+    group->status = STATUS_SUCCESS;
+    group->bytesReserved = 0;
+    group->accepted = FALSE;
+    group->rejected = NULL;
+    KeAcquireSpinLock(&pRootData->bufferLock, &group->irql);
+    group->startOffset = pRootData->writeOffset;
+}
+
+UINT32 USBPcapBufferGroupRecordSize(PUSBPCAP_BUFFER_GROUP group,
+                                    USHORT headerLen,
+                                    UINT32 dataLength,
+                                    USHORT device,
+                                    UCHAR endpoint,
+                                    UCHAR transfer,
+                                    UINT32 maxDataLength)
+{
+    pcaprec_hdr_t  pcapHeader;
+    LARGE_INTEGER  timestamp;
+
+    timestamp.QuadPart = 0;
+    maxDataLength = min(maxDataLength,
+                        USBPcapGetMaxDataLength(group->pRootData, device,
+                                                endpoint, transfer));
+    USBPcapInitializePcapHeader(group->pRootData, timestamp, &pcapHeader,
+                                headerLen, dataLength, maxDataLength);
+
+    return sizeof(pcaprec_hdr_t) + pcapHeader.incl_len;
+}
+
+NTSTATUS USBPcapBufferReserveGroup(PUSBPCAP_BUFFER_GROUP group,
+                                   UINT32 bytes)
+{
+    PUSBPCAP_ROOTHUB_DATA  pRootData = group->pRootData;
+
+    if ((pRootData->buffer == NULL) ||
+        (USBPcapGetBufferFree(pRootData) < bytes))
+    {
+        if (pRootData->buffer != NULL)
+        {
+            InterlockedIncrement(&pRootData->bufferFull);
+        }
+        DkDbgStr("No enough free space left.");
+        group->status = STATUS_INSUFFICIENT_RESOURCES;
+        return group->status;
+    }
+
+    group->bytesReserved = bytes;
     return STATUS_SUCCESS;
 }
 
+VOID USBPcapBufferGroupWriteRecord(PUSBPCAP_BUFFER_GROUP group,
+                                   LARGE_INTEGER timestamp,
+                                   PUSBPCAP_BUFFER_PACKET_HEADER header,
+                                   PUSBPCAP_PAYLOAD_ENTRY payload,
+                                   UINT32 maxDataLength)
+{
+    PUSBPCAP_ROOTHUB_DATA  pRootData = group->pRootData;
+    pcaprec_hdr_t          pcapHeader;
+    volatile LONG         *rejected;
+    UINT32                 bytes;
+    UINT32                 dataBytes;
+    UINT32                 bytesMissing;
+    int                    i;
+
+    if (!NT_SUCCESS(group->status))
+    {
+        return;
+    }
+
+    maxDataLength = min(maxDataLength,
+                        USBPcapGetMaxDataLength(pRootData, header->device,
+                                                header->endpoint,
+                                                header->transfer));
+    USBPcapInitializePcapHeader(pRootData, timestamp, &pcapHeader,
+                                header->headerLen, header->dataLength,
+                                maxDataLength);
+
+    bytes = sizeof(pcaprec_hdr_t) + pcapHeader.incl_len;
+    if (bytes > group->bytesReserved)
+    {
+        DkDbgVal("Group record exceeds reservation", bytes);
+        group->status = STATUS_INVALID_PARAMETER;
+        return;
+    }
+
+    dataBytes = pcapHeader.incl_len -
+                min(pcapHeader.incl_len, (UINT32)header->headerLen);
+    bytesMissing = dataBytes;
+    for (i = 0; (bytesMissing > 0) && (payload[i].buffer); i++)
+    {
+        bytesMissing -= min(payload[i].size, bytesMissing);
+    }
+    if (bytesMissing > 0)
+    {
+        DkDbgVal("Attempted to write invalid packet. Missing %d bytes of payload.",
+                 bytesMissing);
+        group->status = STATUS_INVALID_PARAMETER;
+        return;
+    }
+
+    rejected = USBPcapBufferFilterRecord(pRootData, header,
+                                         header->headerLen, payload,
+                                         header->dataLength, dataBytes);
+    if (rejected == NULL)
+    {
+        group->accepted = TRUE;
+    }
+    else if (group->rejected == NULL)
+    {
+        group->rejected = rejected;
+    }
+
+    USBPcapBufferCopyRecord(pRootData, &pcapHeader, header, payload);
+    group->bytesReserved -= bytes;
+}
+
+NTSTATUS USBPcapBufferEndGroup(PUSBPCAP_BUFFER_GROUP group)
+{
+    PUSBPCAP_ROOTHUB_DATA  pRootData = group->pRootData;
+    NTSTATUS               status = group->status;
+
+    if (NT_SUCCESS(status) && (group->accepted == FALSE))
+    {
+        if (group->rejected != NULL)
+        {
+            InterlockedIncrement(group->rejected);
+        }
+        status = STATUS_CANCELLED;
+    }
+
+    if (!NT_SUCCESS(status))
+    {
+        /* Give back everything written since the group began */
+        pRootData->writeOffset = group->startOffset;
+    }
+
+    KeReleaseSpinLock(&pRootData->bufferLock, group->irql);
+
+    if (NT_SUCCESS(status))
+    {
+        USBPcapBufferCompletePendedReadIrp(pRootData);
+    }
+
+    return status;
+}
+
 NTSTATUS USBPcapBufferWriteTimestampedPayload(PUSBPCAP_ROOTHUB_DATA pRootData,
                                               LARGE_INTEGER timestamp,
                                               PUSBPCAP_BUFFER_PACKET_HEADER header,
@@ -648,6 +1271,36 @@ NTSTATUS USBPcapBufferWriteTimestampedPacket(PUSBPCAP_ROOTHUB_DATA pRootData,
 {
     USBPCAP_PAYLOAD_ENTRY  payload[2];
 
+    if (header->headerLen <= sizeof(USBPCAP_BUFFER_CONTROL_HEADER))
+    {
+        USBPCAP_BUFFER_RECORD  record;
+        NTSTATUS               status;
+
+        if ((buffer == NULL) && (header->dataLength > 0))
+        {
+            DkDbgVal("Attempted to write packet without payload.",
+                     header->dataLength);
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        status = USBPcapBufferBeginRecord(pRootData, timestamp,
+                                          header->headerLen,
+                                          header->dataLength,
+                                          header->device,
+                                          header->endpoint,
+                                          header->transfer, MAXULONG,
+                                          &record);
+        if (NT_SUCCESS(status))
+        {
+            RtlCopyMemory((PVOID)record.header, (PVOID)header,
+                          (SIZE_T)header->headerLen);
+            USBPcapBufferRecordWriteData(&record, buffer,
+                                         header->dataLength);
+            USBPcapBufferEndRecord(&record);
+        }
+        return status;
+    }
+
     payload[0].size   = header->dataLength;
     payload[0].buffer = buffer;
     payload[1].size   = 0;
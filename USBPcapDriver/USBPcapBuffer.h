@@ -8,17 +8,69 @@
 #define USBPCAP_BUFFER_H
 
 #include "USBPcapMain.h"
+#include "USBPcapBPF.h"
+#include "USBPcapMatch.h"
 
+/*
+ * Record being written directly into the ring buffer.
+ *
+ * Between USBPcapBufferBeginRecord() and USBPcapBufferEndRecord() the
+ * buffer lock is held and header points to the space reserved for the
+ * USBPcap packet header. The header is placed directly in the ring when
+ * it fits there contiguously, otherwise it is assembled in bounce and
+ * copied to the reserved space when the record is finished.
+ *
+ * Payload is copied when the record is finished, only if the record
+ * was accepted by the BPF program.
+ */
+#define USBPCAP_BUFFER_RECORD_MAX_PAYLOAD  2
+
+typedef struct
+{
+    PUSBPCAP_ROOTHUB_DATA          pRootData;
+    KIRQL                          irql;
+    UINT32                         startOffset;
+    UINT32                         headerOffset;
+    USHORT                         headerLen;
+    UINT32                         headerBytes;
+    UINT32                         dataLength;
+    UINT32                         dataBytes;
+    PUSBPCAP_BUFFER_PACKET_HEADER  header;
+    USBPCAP_BUFFER_CONTROL_HEADER  bounce;
+    int                            numberOfPayloads;
+    USBPCAP_PAYLOAD_ENTRY          payload[USBPCAP_BUFFER_RECORD_MAX_PAYLOAD + 1];
+} USBPCAP_BUFFER_RECORD, *PUSBPCAP_BUFFER_RECORD;
+
+/*
+ * Records of single transfer written all or nothing.
+ *
+ * Between USBPcapBufferBeginGroup() and USBPcapBufferEndGroup() the
+ * buffer lock is held, so no other record gets in between. The group
+ * is kept only if every record fit in the reservation and at least one
+ * of them was accepted by the payload match and BPF program, otherwise
+ * the buffer is left as it was before USBPcapBufferBeginGroup().
+ */
 typedef struct
 {
-    UINT32  size;
-    PVOID   buffer;
-} USBPCAP_PAYLOAD_ENTRY, *PUSBPCAP_PAYLOAD_ENTRY;
+    PUSBPCAP_ROOTHUB_DATA  pRootData;
+    KIRQL                  irql;
+    NTSTATUS               status;
+    UINT32                 startOffset;
+    UINT32                 bytesReserved;
+    BOOLEAN                accepted;
+    volatile LONG         *rejected; /* counter of the first rejection */
+} USBPCAP_BUFFER_GROUP, *PUSBPCAP_BUFFER_GROUP;
 
 NTSTATUS USBPcapSetUpBuffer(PUSBPCAP_ROOTHUB_DATA pData,
                             UINT32 bytes);
 NTSTATUS USBPcapSetSnaplenSize(PUSBPCAP_ROOTHUB_DATA pData,
                                UINT32 bytes);
+NTSTATUS USBPcapBufferSetBPF(PUSBPCAP_ROOTHUB_DATA pData,
+                             PUSBPCAP_BPF_PROGRAM program);
+NTSTATUS USBPcapBufferSetPayloadMatch(PUSBPCAP_ROOTHUB_DATA pData,
+                                      PUSBPCAP_PAYLOAD_MATCH match);
+NTSTATUS USBPcapBufferSetSnaplenPolicy(PUSBPCAP_ROOTHUB_DATA pData,
+                                       PUSBPCAP_SNAPLEN_POLICY policy);
 
 VOID USBPcapBufferRemoveBuffer(PDEVICE_EXTENSION pDevExt);
 VOID USBPcapBufferInitializeBuffer(PDEVICE_EXTENSION pDevExt);
@@ -40,6 +92,68 @@ NTSTATUS USBPcapBufferWritePayload(PUSBPCAP_ROOTHUB_DATA pRootData,
                                    PUSBPCAP_BUFFER_PACKET_HEADER header,
                                    PUSBPCAP_PAYLOAD_ENTRY payload);
 
+/* Reserves space for whole record (pcap header, headerLen bytes of
+ * USBPcap header and dataLength bytes of payload, both limited by snaplen).
+ * Payload is further limited to maxDataLength bytes (MAXULONG for no
+ * limit) and by the snaplen policy rule matching device, endpoint and
+ * transfer, which must be the values later put in header. dataLength
+ * is reported as the original length in any case.
+ * headerLen must not exceed sizeof(USBPCAP_BUFFER_CONTROL_HEADER).
+ *
+ * On success the buffer lock is held until USBPcapBufferEndRecord().
+ */
+NTSTATUS USBPcapBufferBeginRecord(PUSBPCAP_ROOTHUB_DATA pRootData,
+                                  LARGE_INTEGER timestamp,
+                                  USHORT headerLen,
+                                  UINT32 dataLength,
+                                  USHORT device,
+                                  UCHAR endpoint,
+                                  UCHAR transfer,
+                                  UINT32 maxDataLength,
+                                  PUSBPCAP_BUFFER_RECORD record);
+/* Appends payload to record, data exceeding the reservation is dropped.
+ * At most USBPCAP_BUFFER_RECORD_MAX_PAYLOAD calls are allowed per record.
+ */
+VOID USBPcapBufferRecordWriteData(PUSBPCAP_BUFFER_RECORD record,
+                                  PVOID data,
+                                  UINT32 length);
+/* Runs the payload match and BPF program, finishes or discards the record and releases
+ * the buffer lock.
+ */
+VOID USBPcapBufferEndRecord(PUSBPCAP_BUFFER_RECORD record);
+
+/* Acquires the buffer lock for the group. */
+VOID USBPcapBufferBeginGroup(PUSBPCAP_ROOTHUB_DATA pRootData,
+                             PUSBPCAP_BUFFER_GROUP group);
+/* Returns the number of bytes record with given header and payload
+ * lengths takes in the buffer. Parameters have the same meaning as
+ * for USBPcapBufferBeginRecord().
+ */
+UINT32 USBPcapBufferGroupRecordSize(PUSBPCAP_BUFFER_GROUP group,
+                                    USHORT headerLen,
+                                    UINT32 dataLength,
+                                    USHORT device,
+                                    UCHAR endpoint,
+                                    UCHAR transfer,
+                                    UINT32 maxDataLength);
+/* Reserves bytes (sum of USBPcapBufferGroupRecordSize() of all records)
+ * for the group. Fails if the buffer does not have that much free space.
+ */
+NTSTATUS USBPcapBufferReserveGroup(PUSBPCAP_BUFFER_GROUP group,
+                                   UINT32 bytes);
+/* Writes record to the reservation. payload is {0, NULL} terminated and
+ * must hold the captured part of header->dataLength bytes.
+ */
+VOID USBPcapBufferGroupWriteRecord(PUSBPCAP_BUFFER_GROUP group,
+                                   LARGE_INTEGER timestamp,
+                                   PUSBPCAP_BUFFER_PACKET_HEADER header,
+                                   PUSBPCAP_PAYLOAD_ENTRY payload,
+                                   UINT32 maxDataLength);
+/* Keeps or discards the group and releases the buffer lock. Returns
+ * STATUS_SUCCESS if the group was kept.
+ */
+NTSTATUS USBPcapBufferEndGroup(PUSBPCAP_BUFFER_GROUP group);
+
 NTSTATUS USBPcapBufferWriteTimestampedPacket(PUSBPCAP_ROOTHUB_DATA pRootData,
                                              LARGE_INTEGER timestamp,
                                              PUSBPCAP_BUFFER_PACKET_HEADER header,
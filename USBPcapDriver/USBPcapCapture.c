@@ -0,0 +1,584 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include "USBPcapMain.h"
+#include "USBPcapCapture.h"
+#include "USBPcapBuffer.h"
+
+/*
+ * Determines range and index for given address.
+ *
+ * Returns TRUE on success (address is within <0; 127>), FALSE otherwise.
+ */
+static BOOLEAN USBPcapGetAddressRangeAndIndex(int address, UINT8 *range, UINT8 *index)
+{
+    if ((address < 0) || (address > 127))
+    {
+        DkDbgVal("Invalid address!", address);
+        return FALSE;
+    }
+
+    *range = address / 32;
+    *index = address % 32;
+    return TRUE;
+}
+
+BOOLEAN USBPcapIsDeviceFiltered(PUSBPCAP_ADDRESS_FILTER filter, int address)
+{
+    BOOLEAN filtered = FALSE;
+    UINT8 range;
+    UINT8 index;
+
+    ASSERT(filter != NULL);
+
+    if (filter->filterAll == TRUE)
+    {
+        /* Do not check individual bit if all devices are filtered. */
+        return TRUE;
+    }
+
+    if (USBPcapGetAddressRangeAndIndex(address, &range, &index) == FALSE)
+    {
+        /* Assume that invalid addresses are filtered. */
+        return TRUE;
+    }
+
+    if (filter->addresses[range] & (1 << index))
+    {
+        filtered = TRUE;
+    }
+
+    return filtered;
+}
+
+BOOLEAN USBPcapSetDeviceFiltered(PUSBPCAP_ADDRESS_FILTER filter, int address)
+{
+    UINT8 range;
+    UINT8 index;
+
+    ASSERT(filter != NULL);
+
+    if (USBPcapGetAddressRangeAndIndex(address, &range, &index) == FALSE)
+    {
+        return FALSE;
+    }
+
+    filter->addresses[range] |= (1 << index);
+    return TRUE;
+}
+
+/*
+ * Compiles endpoint filter rules into map.
+ *
+ * Caller must have validated that filter contains numberOfRules rules.
+ */
+static NTSTATUS USBPcapCompileEndpointFilter(PUSBPCAP_ENDPOINT_FILTER_MAP map,
+                                             PUSBPCAP_ENDPOINT_FILTER filter)
+{
+    UINT32 i;
+    int address;
+    int number;
+
+    ASSERT(map != NULL);
+    ASSERT(filter != NULL);
+
+    for (i = 0; i < filter->numberOfRules; i++)
+    {
+        PUSBPCAP_ENDPOINT_FILTER_RULE rule = &filter->rule[i];
+
+        if (((rule->device > 127) && (rule->device != USBPCAP_FILTER_ANY)) ||
+            ((rule->endpoint > 15) && (rule->endpoint != USBPCAP_FILTER_ANY)))
+        {
+            DkDbgVal("Invalid endpoint filter rule", i);
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    map->enabled = FALSE;
+    memset(map->addresses, 0, sizeof(map->addresses));
+    memset(map->transfers, 0, sizeof(map->transfers));
+
+    for (i = 0; i < filter->numberOfRules; i++)
+    {
+        PUSBPCAP_ENDPOINT_FILTER_RULE rule = &filter->rule[i];
+        UCHAR transfers;
+
+        transfers = rule->transfers &
+            (USBPCAP_FILTER_TRANSFER(USBPCAP_TRANSFER_ISOCHRONOUS) |
+             USBPCAP_FILTER_TRANSFER(USBPCAP_TRANSFER_INTERRUPT) |
+             USBPCAP_FILTER_TRANSFER(USBPCAP_TRANSFER_CONTROL) |
+             USBPCAP_FILTER_TRANSFER(USBPCAP_TRANSFER_BULK));
+        if ((transfers == 0) ||
+            !(rule->direction & (USBPCAP_FILTER_DIRECTION_OUT |
+                                 USBPCAP_FILTER_DIRECTION_IN)))
+        {
+            /* Rule cannot match anything */
+            continue;
+        }
+
+        for (address = 0; address < 128; address++)
+        {
+            if ((rule->device != USBPCAP_FILTER_ANY) &&
+                (rule->device != address))
+            {
+                continue;
+            }
+
+            map->addresses[address / 32] |= (1 << (address % 32));
+
+            for (number = 0; number < 16; number++)
+            {
+                if ((rule->endpoint != USBPCAP_FILTER_ANY) &&
+                    (rule->endpoint != number))
+                {
+                    continue;
+                }
+
+                if (rule->direction & USBPCAP_FILTER_DIRECTION_OUT)
+                {
+                    map->transfers[address][number] |= transfers;
+                }
+                if (rule->direction & USBPCAP_FILTER_DIRECTION_IN)
+                {
+                    map->transfers[address][number + 16] |= transfers;
+                }
+            }
+        }
+    }
+
+    map->enabled = (filter->numberOfRules > 0) ? TRUE : FALSE;
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Checks if transfer should be captured according to endpoint filter.
+ *
+ * endpoint 0xFF checks only if the device has any endpoint selected.
+ * Transfers other than isochronous, interrupt, control and bulk match
+ * every selected endpoint.
+ */
+BOOLEAN USBPcapIsEndpointFiltered(PUSBPCAP_ENDPOINT_FILTER_MAP map,
+                                  int address,
+                                  UCHAR endpoint,
+                                  UCHAR transfer)
+{
+    UCHAR transfers;
+
+    ASSERT(map != NULL);
+
+    if (map->enabled == FALSE)
+    {
+        return TRUE;
+    }
+
+    if ((address < 0) || (address > 127))
+    {
+        /* Assume that invalid addresses are filtered. */
+        return TRUE;
+    }
+
+    if (endpoint == 0xFF)
+    {
+        return (map->addresses[address / 32] & (1 << (address % 32))) ?
+            TRUE : FALSE;
+    }
+
+    transfers = map->transfers[address][(endpoint & 0x0F) |
+                                        ((endpoint & 0x80) ? 16 : 0)];
+    if (transfer <= USBPCAP_TRANSFER_BULK)
+    {
+        return (transfers & USBPCAP_FILTER_TRANSFER(transfer)) ? TRUE : FALSE;
+    }
+
+    return (transfers != 0) ? TRUE : FALSE;
+}
+
+/*
+ * Returns the snapshot to be modified by filter update. The snapshot is a
+ * copy of the current one. Update must be finished with
+ * USBPcapEndFilterUpdate().
+ */
+static PUSBPCAP_FILTER_SNAPSHOT
+USBPcapBeginFilterUpdate(PUSBPCAP_ROOTHUB_DATA pRootData, PKIRQL irql)
+{
+    PUSBPCAP_FILTER_SNAPSHOT next;
+    LONG                     version;
+
+    KeAcquireSpinLock(&pRootData->filterLock, irql);
+
+    /* Only writers modify filterVersion and they hold filterLock */
+    version = pRootData->filterVersion;
+    next = &pRootData->filterSnapshot[(version + 1) & 1];
+    RtlCopyMemory(next, &pRootData->filterSnapshot[version & 1],
+                  sizeof(USBPCAP_FILTER_SNAPSHOT));
+
+    return next;
+}
+
+/*
+ * Makes the snapshot returned by USBPcapBeginFilterUpdate() current if
+ * publish is TRUE and writes filter marker record.
+ *
+ * The marker is written before filterLock is released so markers of
+ * concurrent updates are in the capture in version order.
+ */
+static VOID
+USBPcapEndFilterUpdate(PUSBPCAP_ROOTHUB_DATA pRootData,
+                       BOOLEAN publish,
+                       KIRQL irql)
+{
+    USBPCAP_BUFFER_PACKET_HEADER  header;
+    USBPCAP_FILTER_MARKER         marker;
+    PUSBPCAP_FILTER_SNAPSHOT      snapshot;
+    LONG                          version;
+
+    if (publish == FALSE)
+    {
+        KeReleaseSpinLock(&pRootData->filterLock, irql);
+        return;
+    }
+
+    /* Interlocked operation orders snapshot writes before the version */
+    version = InterlockedIncrement(&pRootData->filterVersion);
+    snapshot = &pRootData->filterSnapshot[version & 1];
+
+    marker.version = (UINT32)version;
+    RtlCopyMemory(&marker.filter, &snapshot->filter,
+                  sizeof(USBPCAP_ADDRESS_FILTER));
+    marker.endpointFilter = snapshot->endpointFilter.enabled;
+
+    header.headerLen  = sizeof(USBPCAP_BUFFER_PACKET_HEADER);
+    header.irpId      = 0;
+    header.status     = USBD_STATUS_SUCCESS;
+    header.function   = 0;
+    header.info       = 0;
+    header.bus        = pRootData->busId;
+    header.device     = 0;
+    header.endpoint   = 0;
+    header.transfer   = USBPCAP_TRANSFER_FILTER_MARKER;
+    header.dataLength = sizeof(USBPCAP_FILTER_MARKER);
+
+    USBPcapBufferWritePacket(pRootData, &header, (PVOID)&marker);
+
+    KeReleaseSpinLock(&pRootData->filterLock, irql);
+}
+
+/*
+ * Returns TRUE if filter snapshot read at version was not modified.
+ *
+ * Every update, published or not, writes the snapshot that is not
+ * current. After a single publish that is the snapshot readers of the
+ * previous version may still be using, so any version change means
+ * retry.
+ */
+__inline static BOOLEAN
+USBPcapIsFilterSnapshotStable(PUSBPCAP_ROOTHUB_DATA pRootData, LONG version)
+{
+    LONG current = InterlockedCompareExchange(&pRootData->filterVersion, 0, 0);
+
+    return (current == version) ? TRUE : FALSE;
+}
+
+VOID USBPcapSetAddressFilter(PUSBPCAP_ROOTHUB_DATA pRootData,
+                             PUSBPCAP_ADDRESS_FILTER filter)
+{
+    PUSBPCAP_FILTER_SNAPSHOT snapshot;
+    KIRQL                    irql;
+
+    snapshot = USBPcapBeginFilterUpdate(pRootData, &irql);
+    RtlCopyMemory(&snapshot->filter, filter, sizeof(USBPCAP_ADDRESS_FILTER));
+    USBPcapEndFilterUpdate(pRootData, TRUE, irql);
+}
+
+/*
+ * Caller must have validated that filter contains numberOfRules rules.
+ */
+NTSTATUS USBPcapSetEndpointFilter(PUSBPCAP_ROOTHUB_DATA pRootData,
+                                  PUSBPCAP_ENDPOINT_FILTER filter)
+{
+    PUSBPCAP_FILTER_SNAPSHOT snapshot;
+    NTSTATUS                 status;
+    KIRQL                    irql;
+
+    snapshot = USBPcapBeginFilterUpdate(pRootData, &irql);
+    status = USBPcapCompileEndpointFilter(&snapshot->endpointFilter, filter);
+    USBPcapEndFilterUpdate(pRootData, NT_SUCCESS(status), irql);
+
+    return status;
+}
+
+VOID USBPcapClearFilter(PUSBPCAP_ROOTHUB_DATA pRootData)
+{
+    PUSBPCAP_FILTER_SNAPSHOT snapshot;
+    KIRQL                    irql;
+
+    snapshot = USBPcapBeginFilterUpdate(pRootData, &irql);
+    memset(&snapshot->filter, 0, sizeof(USBPCAP_ADDRESS_FILTER));
+    snapshot->endpointFilter.enabled = FALSE;
+    USBPcapEndFilterUpdate(pRootData, TRUE, irql);
+}
+
+/*
+ * Selects device with given address if capture from new devices is
+ * enabled.
+ */
+VOID USBPcapCaptureNewDevice(PUSBPCAP_ROOTHUB_DATA pRootData, int address)
+{
+    PUSBPCAP_FILTER_SNAPSHOT snapshot;
+    BOOLEAN                  publish;
+    KIRQL                    irql;
+
+    snapshot = USBPcapBeginFilterUpdate(pRootData, &irql);
+
+    publish = FALSE;
+    if ((USBPcapIsDeviceFiltered(&snapshot->filter, 0) == TRUE) &&
+        (USBPcapIsDeviceFiltered(&snapshot->filter, address) == FALSE))
+    {
+        publish = USBPcapSetDeviceFiltered(&snapshot->filter, address);
+    }
+
+    USBPcapEndFilterUpdate(pRootData, publish, irql);
+}
+
+/*
+ * Checks if device is selected by address filter and has at least one
+ * endpoint selected by endpoint filter in current filter snapshot.
+ */
+BOOLEAN USBPcapIsDeviceCaptured(PUSBPCAP_ROOTHUB_DATA pRootData, int address)
+{
+    PUSBPCAP_FILTER_SNAPSHOT snapshot;
+    BOOLEAN                  captured;
+    LONG                     version;
+
+    do
+    {
+        version = InterlockedCompareExchange(&pRootData->filterVersion, 0, 0);
+        snapshot = &pRootData->filterSnapshot[version & 1];
+
+        captured = (USBPcapIsDeviceFiltered(&snapshot->filter, address) &&
+                    USBPcapIsEndpointFiltered(&snapshot->endpointFilter,
+                                              address, 0xFF,
+                                              USBPCAP_TRANSFER_UNKNOWN)) ?
+                   TRUE : FALSE;
+    }
+    while (USBPcapIsFilterSnapshotStable(pRootData, version) == FALSE);
+
+    return captured;
+}
+
+/*
+ * Same as USBPcapIsEndpointFiltered() on current filter snapshot.
+ */
+BOOLEAN USBPcapIsEndpointCaptured(PUSBPCAP_ROOTHUB_DATA pRootData,
+                                  int address,
+                                  UCHAR endpoint,
+                                  UCHAR transfer)
+{
+    PUSBPCAP_FILTER_SNAPSHOT snapshot;
+    BOOLEAN                  captured;
+    LONG                     version;
+
+    do
+    {
+        version = InterlockedCompareExchange(&pRootData->filterVersion, 0, 0);
+        snapshot = &pRootData->filterSnapshot[version & 1];
+
+        captured = USBPcapIsEndpointFiltered(&snapshot->endpointFilter,
+                                             address, endpoint, transfer);
+    }
+    while (USBPcapIsFilterSnapshotStable(pRootData, version) == FALSE);
+
+    return captured;
+}
+
+/*
+ * Publishes sampling configuration. Readers of the previous snapshot
+ * retry, so the configuration and its info bits are never mixed.
+ */
+VOID USBPcapSetSampling(PUSBPCAP_ROOTHUB_DATA pRootData,
+                        const USBPCAP_SAMPLING *sampling)
+{
+    PUSBPCAP_SAMPLING_SNAPSHOT next;
+    KIRQL                      irql;
+
+    KeAcquireSpinLock(&pRootData->samplingLock, &irql);
+
+    /* Only writers modify samplingVersion and they hold samplingLock */
+    next = &pRootData->samplingSnapshot[(pRootData->samplingVersion + 1) & 1];
+    if (sampling != NULL)
+    {
+        next->sampling = *sampling;
+        next->info = USBPcapSamplingInfo(sampling);
+    }
+    else
+    {
+        next->sampling.samplingInterval = 1;
+        next->sampling.deviceByteRate = 0;
+        next->sampling.deviceBurst = 0;
+        next->info = 0;
+    }
+
+    /* Interlocked operation orders snapshot writes before the version */
+    InterlockedIncrement(&pRootData->samplingVersion);
+
+    KeReleaseSpinLock(&pRootData->samplingLock, irql);
+}
+
+/*
+ * Copies current sampling snapshot.
+ */
+VOID USBPcapGetSampling(PUSBPCAP_ROOTHUB_DATA pRootData,
+                        PUSBPCAP_SAMPLING_SNAPSHOT snapshot)
+{
+    LONG version;
+
+    do
+    {
+        version = InterlockedCompareExchange(&pRootData->samplingVersion, 0, 0);
+        RtlCopyMemory(snapshot, &pRootData->samplingSnapshot[version & 1],
+                      sizeof(USBPCAP_SAMPLING_SNAPSHOT));
+    }
+    while (InterlockedCompareExchange(&pRootData->samplingVersion, 0, 0) != version);
+}
+
+UCHAR USBPcapGetSamplingInfo(PUSBPCAP_ROOTHUB_DATA pRootData)
+{
+    LONG  version;
+    UCHAR info;
+
+    do
+    {
+        version = InterlockedCompareExchange(&pRootData->samplingVersion, 0, 0);
+        info = pRootData->samplingSnapshot[version & 1].info;
+    }
+    while (InterlockedCompareExchange(&pRootData->samplingVersion, 0, 0) != version);
+
+    return info;
+}
+
+/*
+ * Returns index of summary table to be used by current processor.
+ * Caller must run at DISPATCH_LEVEL.
+ */
+__inline static ULONG USBPcapGetSummaryTableIndex(VOID)
+{
+#if (_WIN32_WINNT >= 0x0601)
+    return KeGetCurrentProcessorNumberEx(NULL);
+#else
+    return (ULONG)KeGetCurrentProcessorNumber();
+#endif
+}
+
+/*
+ * Clears the endpoint summary, allocating the summary tables on first
+ * use. Must be called before USBPCAP_CAPTURE_SUMMARY is set.
+ */
+NTSTATUS USBPcapResetSummary(PUSBPCAP_ROOTHUB_DATA pRootData)
+{
+    PUSBPCAP_SUMMARY_TABLE tables;
+    ULONG                  count;
+
+    if (pRootData->summaryTables != NULL)
+    {
+        RtlZeroMemory(pRootData->summaryTables,
+                      pRootData->summaryTableCount *
+                      sizeof(USBPCAP_SUMMARY_TABLE));
+        return STATUS_SUCCESS;
+    }
+
+#if (_WIN32_WINNT >= 0x0601)
+    count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+#else
+    count = (ULONG)KeNumberProcessors;
+#endif
+
+    tables = (PUSBPCAP_SUMMARY_TABLE)
+        ExAllocatePoolWithTag(NonPagedPool,
+                              count * sizeof(USBPCAP_SUMMARY_TABLE),
+                              (ULONG)'mmuS');
+    if (tables == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(tables, count * sizeof(USBPCAP_SUMMARY_TABLE));
+    pRootData->summaryTableCount = count;
+    pRootData->summaryTables = tables;
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Accounts completed transfer in current processor summary table.
+ */
+VOID USBPcapSummaryUpdate(PUSBPCAP_ROOTHUB_DATA pRootData,
+                          UCHAR device,
+                          UCHAR endpoint,
+                          UCHAR transfer,
+                          UINT32 length,
+                          BOOLEAN error)
+{
+    KIRQL  irql;
+    ULONG  index;
+
+    if (pRootData->summaryTables == NULL)
+    {
+        return;
+    }
+
+    /* Stay on this processor while updating its table */
+    KeRaiseIrql(DISPATCH_LEVEL, &irql);
+
+    index = USBPcapGetSummaryTableIndex();
+    if (index < pRootData->summaryTableCount)
+    {
+        USBPcapSummaryAdd(&pRootData->summaryTables[index],
+                          device, endpoint, transfer, length, error);
+    }
+
+    KeLowerIrql(irql);
+}
+
+/*
+ * Merges summary tables of all processors into summary. summary must be
+ * able to hold USBPCAP_SUMMARY_MAX_ENDPOINTS endpoints.
+ */
+VOID USBPcapGetSummary(PUSBPCAP_ROOTHUB_DATA pRootData,
+                       PUSBPCAP_SUMMARY summary)
+{
+    ULONG i;
+
+    summary->numberOfEndpoints = 0;
+    summary->overflows = 0;
+
+    if (pRootData->summaryTables == NULL)
+    {
+        return;
+    }
+
+    for (i = 0; i < pRootData->summaryTableCount; i++)
+    {
+        USBPcapSummaryMerge(summary, &pRootData->summaryTables[i]);
+    }
+}
+
+LARGE_INTEGER USBPcapGetCurrentTimestamp(VOID)
+{
+    LARGE_INTEGER  timestamp;
+
+#if (NTDDI_VERSION <= NTDDI_WIN7)
+    /*
+     * Updated approximately every ten milliseconds.
+     *
+     * TODO: Get higer precision timestamp.
+     */
+    KeQuerySystemTime(&timestamp);
+#else
+    KeQuerySystemTimePrecise(&timestamp);
+#endif
+
+    return timestamp;
+}
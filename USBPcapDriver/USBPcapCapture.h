@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_CAPTURE_H
+#define USBPCAP_CAPTURE_H
+
+#include "USBPcapMain.h"
+
+BOOLEAN USBPcapIsDeviceFiltered(PUSBPCAP_ADDRESS_FILTER filter, int address);
+BOOLEAN USBPcapSetDeviceFiltered(PUSBPCAP_ADDRESS_FILTER filter, int address);
+
+BOOLEAN USBPcapIsEndpointFiltered(PUSBPCAP_ENDPOINT_FILTER_MAP map,
+                                  int address,
+                                  UCHAR endpoint,
+                                  UCHAR transfer);
+
+/* Filter updates. Every update publishes new filter snapshot and writes
+ * USBPCAP_TRANSFER_FILTER_MARKER record.
+ */
+VOID USBPcapSetAddressFilter(PUSBPCAP_ROOTHUB_DATA pRootData,
+                             PUSBPCAP_ADDRESS_FILTER filter);
+NTSTATUS USBPcapSetEndpointFilter(PUSBPCAP_ROOTHUB_DATA pRootData,
+                                  PUSBPCAP_ENDPOINT_FILTER filter);
+VOID USBPcapClearFilter(PUSBPCAP_ROOTHUB_DATA pRootData);
+VOID USBPcapCaptureNewDevice(PUSBPCAP_ROOTHUB_DATA pRootData, int address);
+
+/* Sampling configuration and its info bits are published together.
+ * NULL sampling captures every URB.
+ */
+VOID USBPcapSetSampling(PUSBPCAP_ROOTHUB_DATA pRootData,
+                        const USBPCAP_SAMPLING *sampling);
+VOID USBPcapGetSampling(PUSBPCAP_ROOTHUB_DATA pRootData,
+                        PUSBPCAP_SAMPLING_SNAPSHOT snapshot);
+UCHAR USBPcapGetSamplingInfo(PUSBPCAP_ROOTHUB_DATA pRootData);
+
+/* Per processor endpoint summary */
+NTSTATUS USBPcapResetSummary(PUSBPCAP_ROOTHUB_DATA pRootData);
+VOID USBPcapSummaryUpdate(PUSBPCAP_ROOTHUB_DATA pRootData,
+                          UCHAR device,
+                          UCHAR endpoint,
+                          UCHAR transfer,
+                          UINT32 length,
+                          BOOLEAN error);
+VOID USBPcapGetSummary(PUSBPCAP_ROOTHUB_DATA pRootData,
+                       PUSBPCAP_SUMMARY summary);
+
+/* Lock free checks against current filter snapshot */
+BOOLEAN USBPcapIsDeviceCaptured(PUSBPCAP_ROOTHUB_DATA pRootData, int address);
+BOOLEAN USBPcapIsEndpointCaptured(PUSBPCAP_ROOTHUB_DATA pRootData,
+                                  int address,
+                                  UCHAR endpoint,
+                                  UCHAR transfer);
+
+LARGE_INTEGER USBPcapGetCurrentTimestamp(VOID);
+
+#endif /* USBPCAP_CAPTURE_H */
@@ -5,7 +5,7 @@
  */
 
 #include "USBPcapMain.h"
-#include "include\USBPcap.h"
+#include "include/USBPcap.h"
 #include "USBPcapURB.h"
 #include "USBPcapRootHubControl.h"
 #include "USBPcapBuffer.h"
@@ -89,8 +89,7 @@ HandleUSBPcapControlIOCTL(PIRP pIrp, PIO_STACK_LOCATION pStack,
             }
 
             pAddressFilter = (PUSBPCAP_ADDRESS_FILTER)pIrp->AssociatedIrp.SystemBuffer;
-            memcpy(&pRootData->filter, pAddressFilter,
-                   sizeof(USBPCAP_ADDRESS_FILTER));
+            USBPcapSetAddressFilter(pRootData, pAddressFilter);
 
             DkDbgStr("IOCTL_USBPCAP_START_FILTERING");
             DkDbgVal("", pAddressFilter->addresses[0]);
@@ -103,10 +102,180 @@ HandleUSBPcapControlIOCTL(PIRP pIrp, PIO_STACK_LOCATION pStack,
 
         case IOCTL_USBPCAP_STOP_FILTERING:
             DkDbgStr("IOCTL_USBPCAP_STOP_FILTERING");
-            memset(&pRootData->filter, 0,
-                   sizeof(USBPCAP_ADDRESS_FILTER));
+            USBPcapClearFilter(pRootData);
+            USBPcapBufferSetBPF(pRootData, NULL);
+            USBPcapBufferSetSnaplenPolicy(pRootData, NULL);
+            USBPcapBufferSetPayloadMatch(pRootData, NULL);
+            USBPcapSetSampling(pRootData, NULL);
+            pRootData->captureFlags = 0;
             break;
 
+        case IOCTL_USBPCAP_SET_ENDPOINT_FILTER:
+        {
+            PUSBPCAP_ENDPOINT_FILTER pEndpointFilter;
+            ULONG                    length;
+
+            length = pStack->Parameters.DeviceIoControl.InputBufferLength;
+            if (length < USBPCAP_ENDPOINT_FILTER_SIZE(0))
+            {
+                ntStat = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            pEndpointFilter = (PUSBPCAP_ENDPOINT_FILTER)pIrp->AssociatedIrp.SystemBuffer;
+            DkDbgVal("IOCTL_USBPCAP_SET_ENDPOINT_FILTER",
+                     pEndpointFilter->numberOfRules);
+
+            if ((pEndpointFilter->numberOfRules > USBPCAP_ENDPOINT_FILTER_MAX_RULES) ||
+                (length != USBPCAP_ENDPOINT_FILTER_SIZE(pEndpointFilter->numberOfRules)))
+            {
+                ntStat = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            ntStat = USBPcapSetEndpointFilter(pRootData, pEndpointFilter);
+            break;
+        }
+
+        case IOCTL_USBPCAP_SET_BPF:
+        {
+            PUSBPCAP_BPF_PROGRAM pProgram;
+            ULONG                length;
+
+            length = pStack->Parameters.DeviceIoControl.InputBufferLength;
+            if (length < USBPCAP_BPF_PROGRAM_SIZE(0))
+            {
+                ntStat = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            pProgram = (PUSBPCAP_BPF_PROGRAM)pIrp->AssociatedIrp.SystemBuffer;
+            DkDbgVal("IOCTL_USBPCAP_SET_BPF", pProgram->numberOfInstructions);
+
+            if ((pProgram->numberOfInstructions > USBPCAP_BPF_MAX_INSTRUCTIONS) ||
+                (length != USBPCAP_BPF_PROGRAM_SIZE(pProgram->numberOfInstructions)))
+            {
+                ntStat = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            ntStat = USBPcapBufferSetBPF(pRootData, pProgram);
+            break;
+        }
+
+        case IOCTL_USBPCAP_SET_PAYLOAD_MATCH:
+        {
+            PUSBPCAP_PAYLOAD_MATCH  pMatch;
+            ULONG                   length;
+
+            length = pStack->Parameters.DeviceIoControl.InputBufferLength;
+            if (length < USBPCAP_PAYLOAD_MATCH_SIZE(0))
+            {
+                ntStat = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            pMatch = (PUSBPCAP_PAYLOAD_MATCH)pIrp->AssociatedIrp.SystemBuffer;
+            DkDbgVal("IOCTL_USBPCAP_SET_PAYLOAD_MATCH", pMatch->numberOfPatterns);
+
+            if ((pMatch->numberOfPatterns > USBPCAP_PAYLOAD_MATCH_MAX_PATTERNS) ||
+                (length != USBPCAP_PAYLOAD_MATCH_SIZE(pMatch->numberOfPatterns)))
+            {
+                ntStat = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            ntStat = USBPcapBufferSetPayloadMatch(pRootData, pMatch);
+            break;
+        }
+
+        case IOCTL_USBPCAP_SET_SNAPLEN_POLICY:
+        {
+            PUSBPCAP_SNAPLEN_POLICY pPolicy;
+            ULONG                   length;
+
+            length = pStack->Parameters.DeviceIoControl.InputBufferLength;
+            if (length < USBPCAP_SNAPLEN_POLICY_SIZE(0))
+            {
+                ntStat = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            pPolicy = (PUSBPCAP_SNAPLEN_POLICY)pIrp->AssociatedIrp.SystemBuffer;
+            DkDbgVal("IOCTL_USBPCAP_SET_SNAPLEN_POLICY", pPolicy->numberOfRules);
+
+            if ((pPolicy->numberOfRules > USBPCAP_SNAPLEN_POLICY_MAX_RULES) ||
+                (length != USBPCAP_SNAPLEN_POLICY_SIZE(pPolicy->numberOfRules)))
+            {
+                ntStat = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            ntStat = USBPcapBufferSetSnaplenPolicy(pRootData, pPolicy);
+            break;
+        }
+
+        case IOCTL_USBPCAP_SET_SAMPLING:
+        {
+            PUSBPCAP_SAMPLING  pSampling;
+
+            if (pStack->Parameters.DeviceIoControl.InputBufferLength !=
+                sizeof(USBPCAP_SAMPLING))
+            {
+                ntStat = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            pSampling = (PUSBPCAP_SAMPLING)pIrp->AssociatedIrp.SystemBuffer;
+            DkDbgVal("IOCTL_USBPCAP_SET_SAMPLING", pSampling->samplingInterval);
+            DkDbgVal("", pSampling->deviceByteRate);
+            DkDbgVal("", pSampling->deviceBurst);
+
+            if (!USBPcapSamplingValidate(pSampling))
+            {
+                ntStat = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            USBPcapSetSampling(pRootData, pSampling);
+            break;
+        }
+
+        case IOCTL_USBPCAP_SET_CAPTURE_MODE:
+        {
+            PUSBPCAP_CAPTURE_MODE  pMode;
+
+            if (pStack->Parameters.DeviceIoControl.InputBufferLength !=
+                sizeof(USBPCAP_CAPTURE_MODE))
+            {
+                ntStat = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            pMode = (PUSBPCAP_CAPTURE_MODE)pIrp->AssociatedIrp.SystemBuffer;
+            DkDbgVal("IOCTL_USBPCAP_SET_CAPTURE_MODE", pMode->flags);
+
+            if (pMode->flags & ~USBPCAP_CAPTURE_VALID_FLAGS)
+            {
+                ntStat = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            /* Start counting from zero when summary gets enabled */
+            if ((pMode->flags & USBPCAP_CAPTURE_SUMMARY) &&
+                !(pRootData->captureFlags & USBPCAP_CAPTURE_SUMMARY))
+            {
+                ntStat = USBPcapResetSummary(pRootData);
+                if (!NT_SUCCESS(ntStat))
+                {
+                    break;
+                }
+            }
+
+            pRootData->captureFlags = pMode->flags;
+            break;
+        }
+
         case IOCTL_USBPCAP_SET_SNAPLEN_SIZE:
         {
             PUSBPCAP_IOCTL_SIZE  pSnaplen;
@@ -125,6 +294,57 @@ HandleUSBPcapControlIOCTL(PIRP pIrp, PIO_STACK_LOCATION pStack,
             break;
         }
 
+        case IOCTL_USBPCAP_GET_STATISTICS:
+        {
+            PUSBPCAP_STATISTICS  pStatistics;
+
+            DkDbgStr("IOCTL_USBPCAP_GET_STATISTICS");
+
+            if (pStack->Parameters.DeviceIoControl.OutputBufferLength <
+                sizeof(USBPCAP_STATISTICS))
+            {
+                ntStat = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+
+            pStatistics = (PUSBPCAP_STATISTICS)pIrp->AssociatedIrp.SystemBuffer;
+            pStatistics->irpInfoEvicted =
+                (UINT32)InterlockedCompareExchange(&pRootData->irpInfoEvicted, 0, 0);
+            pStatistics->bpfRejected =
+                (UINT32)InterlockedCompareExchange(&pRootData->bpfRejected, 0, 0);
+            pStatistics->samplingSkipped =
+                (UINT32)InterlockedCompareExchange(&pRootData->samplingSkipped, 0, 0);
+            pStatistics->rateLimited =
+                (UINT32)InterlockedCompareExchange(&pRootData->rateLimited, 0, 0);
+            pStatistics->matchRejected =
+                (UINT32)InterlockedCompareExchange(&pRootData->matchRejected, 0, 0);
+            pStatistics->bufferFull =
+                (UINT32)InterlockedCompareExchange(&pRootData->bufferFull, 0, 0);
+
+            *outLength = sizeof(USBPCAP_STATISTICS);
+            break;
+        }
+
+        case IOCTL_USBPCAP_GET_SUMMARY:
+        {
+            PUSBPCAP_SUMMARY  pSummary;
+
+            DkDbgStr("IOCTL_USBPCAP_GET_SUMMARY");
+
+            if (pStack->Parameters.DeviceIoControl.OutputBufferLength <
+                USBPCAP_SUMMARY_SIZE(USBPCAP_SUMMARY_MAX_ENDPOINTS))
+            {
+                ntStat = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+
+            pSummary = (PUSBPCAP_SUMMARY)pIrp->AssociatedIrp.SystemBuffer;
+            USBPcapGetSummary(pRootData, pSummary);
+
+            *outLength = USBPCAP_SUMMARY_SIZE(pSummary->numberOfEndpoints);
+            break;
+        }
+
         default:
         {
             ULONG ctlCode = IoGetFunctionCodeFromCtlCode(pStack->Parameters.DeviceIoControl.IoControlCode);
@@ -262,6 +482,7 @@ NTSTATUS DkTgtInDevCtl(PDEVICE_EXTENSION pDevExt, PIO_STACK_LOCATION pStack, PIR
     NTSTATUS            ntStat = STATUS_SUCCESS;
     PURB                pUrb = NULL;
     ULONG               ctlCode = 0;
+    BOOLEAN             capture = TRUE;
 
     ntStat = IoAcquireRemoveLock(&pDevExt->removeLock, (PVOID) pIrp);
     if (!NT_SUCCESS(ntStat))
@@ -283,16 +504,17 @@ NTSTATUS DkTgtInDevCtl(PDEVICE_EXTENSION pDevExt, PIO_STACK_LOCATION pStack, PIR
         pUrb = (PURB) pStack->Parameters.Others.Argument1;
         if (pUrb != NULL)
         {
-            USBPcapAnalyzeURB(pIrp, pUrb, FALSE,
-                              pDevExt->context.usb.pDeviceData);
+            capture = USBPcapAnalyzeURB(pIrp, pUrb, FALSE, TRUE,
+                                        pDevExt->context.usb.pDeviceData);
         }
 
         // Forward this request to bus driver or next lower object
-        // with completion routine
+        // with completion routine. Completion context tells if the
+        // submission was sampled out.
         IoCopyCurrentIrpStackLocationToNext(pIrp);
         IoSetCompletionRoutine(pIrp,
             (PIO_COMPLETION_ROUTINE) DkTgtInDevCtlCompletion,
-            NULL, TRUE, TRUE, TRUE);
+            capture ? NULL : USBPCAP_URB_SAMPLED_OUT, TRUE, TRUE, TRUE);
 
         ntStat = IoCallDriver(pDevExt->pNextDevObj, pIrp);
     }
@@ -329,6 +551,7 @@ NTSTATUS DkTgtInDevCtlCompletion(PDEVICE_OBJECT pDevObj, PIRP pIrp, PVOID pCtx)
     if (pUrb != NULL)
     {
         USBPcapAnalyzeURB(pIrp, pUrb, TRUE,
+                          (pCtx == USBPCAP_URB_SAMPLED_OUT) ? FALSE : TRUE,
                           pDevExt->context.usb.pDeviceData);
     }
 
@@ -43,6 +43,22 @@ static void USBPcapFreeDeviceData(IN PDEVICE_EXTENSION pDevExt)
                 {
                     ExFreePool((PVOID)pDeviceData->pRootData->buffer);
                 }
+                if (pDeviceData->pRootData->bpfProgram != NULL)
+                {
+                    ExFreePool((PVOID)pDeviceData->pRootData->bpfProgram);
+                }
+                if (pDeviceData->pRootData->snaplenPolicy != NULL)
+                {
+                    ExFreePool((PVOID)pDeviceData->pRootData->snaplenPolicy);
+                }
+                if (pDeviceData->pRootData->payloadMatch != NULL)
+                {
+                    ExFreePool((PVOID)pDeviceData->pRootData->payloadMatch);
+                }
+                if (pDeviceData->pRootData->summaryTables != NULL)
+                {
+                    ExFreePool((PVOID)pDeviceData->pRootData->summaryTables);
+                }
                 ExFreePool((PVOID)pDeviceData->pRootData);
                 pDeviceData->pRootData = NULL;
             }
@@ -143,9 +159,16 @@ static NTSTATUS USBPcapAllocateDeviceData(IN PDEVICE_EXTENSION pDevExt,
                 /* Initialize default snaplen size */
                 pDeviceData->pRootData->snaplen = USBPCAP_DEFAULT_SNAP_LEN;
 
+                /* No snaplen policy, BPF program nor payload match */
+                pDeviceData->pRootData->snaplenPolicy = NULL;
+                pDeviceData->pRootData->bpfProgram = NULL;
+                pDeviceData->pRootData->payloadMatch = NULL;
+
                 /* Setup initial filtering state to FALSE */
-                memset(&pDeviceData->pRootData->filter, 0,
-                       sizeof(USBPCAP_ADDRESS_FILTER));
+                KeInitializeSpinLock(&pDeviceData->pRootData->filterLock);
+                pDeviceData->pRootData->filterVersion = 0;
+                memset(pDeviceData->pRootData->filterSnapshot, 0,
+                       sizeof(pDeviceData->pRootData->filterSnapshot));
 
                 /*
                  * Set the reference count
@@ -154,6 +177,23 @@ static NTSTATUS USBPcapAllocateDeviceData(IN PDEVICE_EXTENSION pDevExt,
                  * roothub filter object gets destroyed.
                  */
                 pDeviceData->pRootData->refCount = 1L;
+
+                /* Capture every URB */
+                KeInitializeSpinLock(&pDeviceData->pRootData->samplingLock);
+                pDeviceData->pRootData->samplingVersion = 0;
+                memset(pDeviceData->pRootData->samplingSnapshot, 0,
+                       sizeof(pDeviceData->pRootData->samplingSnapshot));
+                pDeviceData->pRootData->samplingSnapshot[0].sampling.samplingInterval = 1;
+                pDeviceData->pRootData->captureFlags = 0;
+                pDeviceData->pRootData->summaryTables = NULL;
+                pDeviceData->pRootData->summaryTableCount = 0;
+
+                pDeviceData->pRootData->irpInfoEvicted = 0L;
+                pDeviceData->pRootData->bpfRejected = 0L;
+                pDeviceData->pRootData->samplingSkipped = 0L;
+                pDeviceData->pRootData->rateLimited = 0L;
+                pDeviceData->pRootData->matchRejected = 0L;
+                pDeviceData->pRootData->bufferFull = 0L;
             }
             else
             {
@@ -165,6 +205,11 @@ static NTSTATUS USBPcapAllocateDeviceData(IN PDEVICE_EXTENSION pDevExt,
         pDeviceData->endpointTable = USBPcapInitializeEndpointTable(NULL);
         pDeviceData->URBIrpTable = USBPcapInitializeURBIRPInfoTable(NULL);
 
+        memset((PVOID)pDeviceData->sampleSequence, 0,
+               sizeof(pDeviceData->sampleSequence));
+        KeInitializeSpinLock(&pDeviceData->bucketLock);
+        memset(&pDeviceData->bucket, 0, sizeof(USBPCAP_TOKEN_BUCKET));
+
         pDeviceData->descriptor = NULL;
     }
     else
@@ -6,6 +6,7 @@
 
 #include "USBPcapMain.h"
 #include "USBPcapBuffer.h"
+#include "USBPcapCapture.h"
 
 ////////////////////////////////////////////////////////////////////////////
 // Create, close and clean up handlers
@@ -78,7 +79,12 @@ NTSTATUS DkCreateClose(PDEVICE_OBJECT pDevObj, PIRP pIrp)
                     /* Stop filtering */
                     rootExt = (PDEVICE_EXTENSION)pDevExt->context.control.pRootHubObject->DeviceExtension;
                     pRootData = (PUSBPCAP_ROOTHUB_DATA)rootExt->context.usb.pDeviceData->pRootData;
-                    memset(&pRootData->filter, 0, sizeof(USBPCAP_ADDRESS_FILTER));
+                    USBPcapClearFilter(pRootData);
+                    USBPcapBufferSetBPF(pRootData, NULL);
+                    USBPcapBufferSetSnaplenPolicy(pRootData, NULL);
+                    USBPcapBufferSetPayloadMatch(pRootData, NULL);
+                    USBPcapSetSampling(pRootData, NULL);
+                    pRootData->captureFlags = 0;
                     /* Free the buffer allocated for this device. */
                     USBPcapBufferRemoveBuffer(pDevExt);
                 }
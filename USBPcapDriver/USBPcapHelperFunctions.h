@@ -8,6 +8,7 @@
 #define USBPCAP_HELPER_FUNCTIONS_H
 
 #include "USBPcapMain.h"
+#include "USBPcapCapture.h"
 
 NTSTATUS USBPcapGetTargetDevicePdo(IN PDEVICE_OBJECT DeviceObject,
                                    OUT PDEVICE_OBJECT *pdo);
@@ -27,12 +28,6 @@ BOOLEAN USBPcapIsDeviceRootHub(PDEVICE_OBJECT device);
 
 PWSTR USBPcapGetHubInterfaces(PDEVICE_OBJECT hub);
 
-
-BOOLEAN USBPcapIsDeviceFiltered(PUSBPCAP_ADDRESS_FILTER filter, int address);
-BOOLEAN USBPcapSetDeviceFiltered(PUSBPCAP_ADDRESS_FILTER filter, int address);
-
-LARGE_INTEGER USBPcapGetCurrentTimestamp(VOID);
-
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text (PAGE, USBPcapGetTargetDevicePdo)
 #pragma alloc_text (PAGE, USBPcapGetNumberOfPorts)
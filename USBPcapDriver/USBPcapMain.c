@@ -5,6 +5,7 @@
  */
 
 #include "USBPcapMain.h"
+#include "USBPcapURB.h"
 
 /* Control device ID, used when creating roothub control devices
  *
@@ -48,6 +49,13 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT pDrvObj, PUNICODE_STRING pUsRegPath)
 
     pDrvObj->MajorFunction[IRP_MJ_POWER]                    = DkPower;
 
+    USBPcapInitializeURBDispatch();
+    if (!NT_SUCCESS(USBPcapInitializeIsochScratch()))
+    {
+        /* Isochronous transfers allocate temporary scratch space */
+        DkDbgStr("Failed to allocate isochronous scratch space");
+    }
+
     g_controlId = (ULONG)0;
 
     return STATUS_SUCCESS;
@@ -56,6 +64,8 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT pDrvObj, PUNICODE_STRING pUsRegPath)
 VOID DkUnload(PDRIVER_OBJECT pDrvObj)
 {
     DkDbgStr("2");
+
+    USBPcapFreeIsochScratch();
 }
 
 VOID DkCompleteRequest(PIRP pIrp, NTSTATUS resStat, UINT_PTR uiInfo)
@@ -31,10 +31,46 @@
 #define DKPORT_MTAG         (ULONG)'dk3A' // To tag memory allocation if any
 
 #include "USBPcapQueue.h"
-#include "include\USBPcap.h"
+#include "include/USBPcap.h"
+#include "USBPcapSampling.h"
+#include "USBPcapSummary.h"
 
 #define USBPCAP_DEFAULT_SNAP_LEN  65535
 
+/* Endpoint filter compiled from USBPCAP_ENDPOINT_FILTER rules */
+typedef struct _USBPCAP_ENDPOINT_FILTER_MAP
+{
+    BOOLEAN                enabled;
+
+    /* Devices with at least one selected endpoint. Same layout as
+     * USBPCAP_ADDRESS_FILTER addresses.
+     */
+    UINT32                 addresses[4];
+
+    /* USBPCAP_FILTER_TRANSFER() bits indexed by device address and
+     * endpoint index (endpoint number, plus 16 for IN endpoints).
+     */
+    UCHAR                  transfers[128][32];
+} USBPCAP_ENDPOINT_FILTER_MAP, *PUSBPCAP_ENDPOINT_FILTER_MAP;
+
+typedef struct _USBPCAP_FILTER_SNAPSHOT
+{
+    /* Address filter. See include\USBPcap.h for more information. */
+    USBPCAP_ADDRESS_FILTER      filter;
+
+    /* Endpoint filter. Applies only to devices selected by filter. */
+    USBPCAP_ENDPOINT_FILTER_MAP endpointFilter;
+} USBPCAP_FILTER_SNAPSHOT, *PUSBPCAP_FILTER_SNAPSHOT;
+
+typedef struct _USBPCAP_SAMPLING_SNAPSHOT
+{
+    /* URB sampling and device rate limit */
+    USBPCAP_SAMPLING            sampling;
+
+    /* Info byte bits for records captured with this configuration */
+    UCHAR                       info;
+} USBPCAP_SAMPLING_SNAPSHOT, *PUSBPCAP_SAMPLING_SNAPSHOT;
+
 typedef struct _USBPCAP_ROOTHUB_DATA
 {
     /* Circular-Buffer related variables */
@@ -47,12 +83,55 @@ typedef struct _USBPCAP_ROOTHUB_DATA
     /* Snapshot length */
     UINT32                 snaplen;
 
-    /* Address filter. See include\USBPcap.h for more information. */
-    USBPCAP_ADDRESS_FILTER filter;
+    /* Per endpoint payload limits. Protected by bufferLock. */
+    PUSBPCAP_SNAPLEN_POLICY snaplenPolicy;
+
+    /* BPF program run over every record. Protected by bufferLock. */
+    PUSBPCAP_BPF_PROGRAM   bpfProgram;
+
+    /* Payload patterns searched in every record. Protected by bufferLock. */
+    PUSBPCAP_PAYLOAD_MATCH payloadMatch;
+
+    /* Capture filter snapshots. filterSnapshot[filterVersion & 1] is the
+     * current one, the other one is modified by the next update. Readers
+     * do not lock, they retry if filterVersion changed while they were
+     * reading. Writers are serialized by filterLock.
+     * See USBPcapBeginFilterUpdate().
+     */
+    KSPIN_LOCK             filterLock;
+    volatile LONG          filterVersion;
+    USBPCAP_FILTER_SNAPSHOT filterSnapshot[2];
+
+    /* Sampling snapshots, published the same way as filter snapshots.
+     * samplingSnapshot[samplingVersion & 1] is the current one. Writers
+     * are serialized by samplingLock. See USBPcapSetSampling().
+     */
+    KSPIN_LOCK             samplingLock;
+    volatile LONG          samplingVersion;
+    USBPCAP_SAMPLING_SNAPSHOT samplingSnapshot[2];
+
+    /* USBPCAP_CAPTURE_* flags */
+    UINT32                 captureFlags;
+
+    /* Per processor endpoint summary tables. Allocated when
+     * USBPCAP_CAPTURE_SUMMARY is set for the first time and kept until
+     * the Root Hub filter is removed. Table is updated only by its
+     * processor at DISPATCH_LEVEL.
+     */
+    PUSBPCAP_SUMMARY_TABLE summaryTables;
+    ULONG                  summaryTableCount;
 
     /* Reference count. To be used only with InterlockedXXX calls. */
     volatile LONG          refCount;
 
+    /* Statistics counters. To be used only with InterlockedXXX calls. */
+    volatile LONG          irpInfoEvicted;
+    volatile LONG          bpfRejected;
+    volatile LONG          samplingSkipped;
+    volatile LONG          rateLimited;
+    volatile LONG          matchRejected;
+    volatile LONG          bufferFull;
+
     USHORT                 busId; /* bus number */
     PDEVICE_OBJECT         controlDevice;
 } USBPCAP_ROOTHUB_DATA, *PUSBPCAP_ROOTHUB_DATA;
@@ -79,6 +158,14 @@ typedef struct _DEVICE_DATA
     PRTL_GENERIC_TABLE     endpointTable;
     PRTL_GENERIC_TABLE     URBIrpTable;
 
+    /* Number of URBs submitted to every endpoint (endpoint number, plus
+     * 16 for IN endpoints). To be used only with InterlockedXXX calls.
+     */
+    volatile LONG          sampleSequence[32];
+
+    KSPIN_LOCK             bucketLock;
+    USBPCAP_TOKEN_BUCKET   bucket; /* Protected by bucketLock */
+
     PUSBPCAP_ROOTHUB_DATA  pRootData;
 
     /* Active configuration descriptor */
@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include "USBPcapMatch.h"
+
+/* SSE2 is always present on x64 and, unlike on x86, kernel code can use
+ * it there without saving the floating point state.
+ */
+#if defined(_M_AMD64) || defined(__x86_64__)
+#define USBPCAP_MATCH_SSE2
+#include <emmintrin.h>
+#endif
+
+BOOLEAN USBPcapMatchValidate(const USBPCAP_PAYLOAD_MATCH *match)
+{
+    UINT32 i;
+
+    if (match->numberOfPatterns > USBPCAP_PAYLOAD_MATCH_MAX_PATTERNS)
+    {
+        return FALSE;
+    }
+
+    for (i = 0; i < match->numberOfPatterns; i++)
+    {
+        const USBPCAP_PAYLOAD_PATTERN *pattern = &match->pattern[i];
+
+        if ((pattern->length == 0) ||
+            (pattern->length > USBPCAP_PAYLOAD_PATTERN_MAX_LENGTH) ||
+            (pattern->reserved != 0) ||
+            (pattern->minOffset > pattern->maxOffset))
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/*
+ * Returns index of the first c in buffer, length if there is none.
+ */
+static UINT32 USBPcapMatchFindByte(const UCHAR *buffer,
+                                   UINT32 length,
+                                   UCHAR c)
+{
+    UINT32 i = 0;
+
+#ifdef USBPCAP_MATCH_SSE2
+    __m128i needle = _mm_set1_epi8((char)c);
+
+    for (; length - i >= 16; i += 16)
+    {
+        __m128i data = _mm_loadu_si128((const __m128i*)&buffer[i]);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(data, needle));
+
+        if (mask != 0)
+        {
+            while ((mask & 1) == 0)
+            {
+                mask >>= 1;
+                i++;
+            }
+            return i;
+        }
+    }
+#endif
+
+    for (; i < length; i++)
+    {
+        if (buffer[i] == c)
+        {
+            return i;
+        }
+    }
+
+    return length;
+}
+
+/*
+ * Compares pattern with payload starting at offset in entry. The first
+ * pattern byte is known to match. Pattern may span multiple entries,
+ * caller makes sure that the payload is long enough.
+ */
+static BOOLEAN USBPcapMatchAt(PUSBPCAP_PAYLOAD_ENTRY entry,
+                              UINT32 offset,
+                              const USBPCAP_PAYLOAD_PATTERN *pattern)
+{
+    UCHAR i;
+
+    for (i = 1; i < pattern->length; i++)
+    {
+        offset++;
+        while (offset >= entry->size)
+        {
+            offset -= entry->size;
+            entry++;
+            if (entry->buffer == NULL)
+            {
+                return FALSE;
+            }
+        }
+
+        if (((PUCHAR)entry->buffer)[offset] != pattern->bytes[i])
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static BOOLEAN USBPcapMatchPattern(const USBPCAP_PAYLOAD_PATTERN *pattern,
+                                   PUSBPCAP_PAYLOAD_ENTRY payload,
+                                   UINT32 length)
+{
+    UINT32 last;
+    UINT32 base;
+    int    i;
+
+    if ((length < pattern->length) ||
+        (pattern->minOffset > length - pattern->length))
+    {
+        return FALSE;
+    }
+
+    /* Last offset the pattern can start at */
+    last = min(pattern->maxOffset, length - pattern->length);
+
+    base = 0;
+    for (i = 0; (payload[i].buffer != NULL) && (base <= last); i++)
+    {
+        const UCHAR *buffer = (const UCHAR *)payload[i].buffer;
+        UINT32       size = payload[i].size;
+        UINT32       start;
+        UINT32       end;
+
+        /* Skip entries ending before minOffset */
+        if (base + size > pattern->minOffset)
+        {
+            start = (pattern->minOffset > base) ? pattern->minOffset - base : 0;
+            end = min(size, last - base + 1);
+
+            while (start < end)
+            {
+                start += USBPcapMatchFindByte(&buffer[start], end - start,
+                                              pattern->bytes[0]);
+                if (start >= end)
+                {
+                    break;
+                }
+                if (USBPcapMatchAt(&payload[i], start, pattern))
+                {
+                    return TRUE;
+                }
+                start++;
+            }
+        }
+
+        base += size;
+    }
+
+    return FALSE;
+}
+
+BOOLEAN USBPcapMatchRun(const USBPCAP_PAYLOAD_MATCH *match,
+                        UCHAR transfer,
+                        PUSBPCAP_PAYLOAD_ENTRY payload,
+                        UINT32 dataLength)
+{
+    BOOLEAN applies = FALSE;
+    UINT32  length;
+    UINT32  i;
+
+    if (transfer > USBPCAP_TRANSFER_BULK)
+    {
+        /* IRP information and unknown URBs carry no transfer data */
+        return TRUE;
+    }
+
+    length = 0;
+    for (i = 0; payload[i].buffer != NULL; i++)
+    {
+        length += payload[i].size;
+    }
+    length = min(length, dataLength);
+
+    for (i = 0; i < match->numberOfPatterns; i++)
+    {
+        const USBPCAP_PAYLOAD_PATTERN *pattern = &match->pattern[i];
+
+        if (pattern->transfers & USBPCAP_FILTER_TRANSFER(transfer))
+        {
+            applies = TRUE;
+            if (USBPcapMatchPattern(pattern, payload, length))
+            {
+                return TRUE;
+            }
+        }
+    }
+
+    return (applies == TRUE) ? FALSE : TRUE;
+}
@@ -0,0 +1,29 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_MATCH_H
+#define USBPCAP_MATCH_H
+
+/* This module does not depend on any kernel functionality */
+#include "include/USBPcap.h"
+#include "USBPcapBPF.h"
+
+/* Checks if patterns are valid. Patterns must have valid length, zero
+ * reserved field and minOffset not greater than maxOffset.
+ */
+BOOLEAN USBPcapMatchValidate(const USBPCAP_PAYLOAD_MATCH *match);
+
+/* Searches at most dataLength bytes of payload entries for the patterns
+ * that apply to transfer.
+ *
+ * Returns TRUE if record should be captured.
+ */
+BOOLEAN USBPcapMatchRun(const USBPCAP_PAYLOAD_MATCH *match,
+                        UCHAR transfer,
+                        PUSBPCAP_PAYLOAD_ENTRY payload,
+                        UINT32 dataLength);
+
+#endif /* USBPCAP_MATCH_H */
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include "USBPcapSampling.h"
+
+/* Number of 100 ns units in one second */
+#define USBPCAP_TICKS_PER_SECOND  10000000ULL
+
+/* Refill is capped to avoid overflow, it fills the bucket anyway */
+#define USBPCAP_MAX_REFILL_TICKS  (100 * USBPCAP_TICKS_PER_SECOND)
+
+BOOLEAN USBPcapSamplingValidate(const USBPCAP_SAMPLING *sampling)
+{
+    UINT32 interval = sampling->samplingInterval;
+
+    /* Interval must be power of two so it can be stored in info byte */
+    if ((interval == 0) ||
+        (interval > USBPCAP_SAMPLING_MAX_INTERVAL) ||
+        ((interval & (interval - 1)) != 0))
+    {
+        return FALSE;
+    }
+
+    if ((sampling->deviceByteRate != 0) && (sampling->deviceBurst == 0))
+    {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+UCHAR USBPcapSamplingInfo(const USBPCAP_SAMPLING *sampling)
+{
+    UCHAR exponent = 0;
+
+    while ((1UL << exponent) < sampling->samplingInterval)
+    {
+        exponent++;
+    }
+
+    return (UCHAR)(exponent << USBPCAP_INFO_SAMPLING_SHIFT);
+}
+
+BOOLEAN USBPcapSampleTake(const USBPCAP_SAMPLING *sampling,
+                          UINT32 sequence)
+{
+    /* First URB on every endpoint is captured */
+    return (((sequence - 1) & (sampling->samplingInterval - 1)) == 0) ?
+        TRUE : FALSE;
+}
+
+BOOLEAN USBPcapTokenBucketTake(PUSBPCAP_TOKEN_BUCKET bucket,
+                               const USBPCAP_SAMPLING *sampling,
+                               UINT64 now,
+                               UINT32 bytes)
+{
+    UINT64 capacity;
+    UINT64 needed;
+    UINT64 elapsed;
+
+    if (sampling->deviceByteRate == 0)
+    {
+        return TRUE;
+    }
+
+    capacity = (UINT64)sampling->deviceBurst * USBPCAP_TICKS_PER_SECOND;
+
+    if (bucket->lastTime == 0)
+    {
+        bucket->credit = capacity;
+    }
+    else if (now > bucket->lastTime)
+    {
+        elapsed = now - bucket->lastTime;
+        if (elapsed > USBPCAP_MAX_REFILL_TICKS)
+        {
+            elapsed = USBPCAP_MAX_REFILL_TICKS;
+        }
+        bucket->credit += elapsed * sampling->deviceByteRate;
+    }
+    if (bucket->credit > capacity)
+    {
+        bucket->credit = capacity;
+    }
+    bucket->lastTime = now;
+
+    needed = (UINT64)bytes * USBPCAP_TICKS_PER_SECOND;
+    if (bucket->credit < needed)
+    {
+        return FALSE;
+    }
+
+    bucket->credit -= needed;
+    return TRUE;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_SAMPLING_H
+#define USBPCAP_SAMPLING_H
+
+/* This module does not depend on any kernel functionality */
+#include "include/USBPcap.h"
+
+/* Token bucket limiting the average byte rate. Zero initialized bucket
+ * is full on first use. Caller is responsible for synchronization.
+ */
+typedef struct
+{
+    UINT64  credit;     /* Available bytes multiplied by 10^7 */
+    UINT64  lastTime;   /* Time of last refill in 100 ns units */
+} USBPCAP_TOKEN_BUCKET, *PUSBPCAP_TOKEN_BUCKET;
+
+/* Checks if sampling configuration is valid */
+BOOLEAN USBPcapSamplingValidate(const USBPCAP_SAMPLING *sampling);
+
+/* Returns info byte sampling bits for given configuration */
+UCHAR USBPcapSamplingInfo(const USBPCAP_SAMPLING *sampling);
+
+/* Returns TRUE if URB with given 1-based sequence number on an endpoint
+ * should be captured.
+ */
+BOOLEAN USBPcapSampleTake(const USBPCAP_SAMPLING *sampling,
+                          UINT32 sequence);
+
+/* Refills the bucket up to now (100 ns units) and consumes bytes.
+ *
+ * Returns FALSE, without consuming anything, if there are not enough
+ * bytes in the bucket.
+ */
+BOOLEAN USBPcapTokenBucketTake(PUSBPCAP_TOKEN_BUCKET bucket,
+                               const USBPCAP_SAMPLING *sampling,
+                               UINT64 now,
+                               UINT32 bytes);
+
+#endif /* USBPCAP_SAMPLING_H */
@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include "USBPcapSummary.h"
+
+/* Key is never 0 so 0 can mark free slot */
+#define USBPCAP_SUMMARY_KEY(device, endpoint, transfer) \
+    (0x01000000UL | ((UINT32)(transfer) << 16) | \
+     ((UINT32)(device) << 8) | (UINT32)(endpoint))
+
+#define USBPCAP_SUMMARY_KEY_DEVICE(key)    ((UCHAR)((key) >> 8))
+#define USBPCAP_SUMMARY_KEY_ENDPOINT(key)  ((UCHAR)(key))
+#define USBPCAP_SUMMARY_KEY_TRANSFER(key)  ((UCHAR)((key) >> 16))
+
+UCHAR USBPcapSummarySizeBucket(UINT32 length)
+{
+    UCHAR   bucket;
+    UINT32  limit;
+
+    if (length == 0)
+    {
+        return 0;
+    }
+
+    for (bucket = 1, limit = 8;
+         bucket < USBPCAP_SUMMARY_SIZE_BUCKETS - 1;
+         bucket++, limit <<= 3)
+    {
+        if (length <= limit)
+        {
+            break;
+        }
+    }
+
+    return bucket;
+}
+
+/*
+ * Returns slot index for key, inserting it if needed. Returns
+ * USBPCAP_SUMMARY_MAX_ENDPOINTS if table is full.
+ */
+static UINT32 USBPcapSummaryLookup(PUSBPCAP_SUMMARY_TABLE table,
+                                   UINT32 key)
+{
+    UINT32 slot;
+    UINT32 i;
+
+    /* Fibonacci hashing, USBPCAP_SUMMARY_MAX_ENDPOINTS is power of two */
+    slot = (UINT32)(key * 2654435769UL) >> 26;
+
+    for (i = 0; i < USBPCAP_SUMMARY_MAX_ENDPOINTS; i++)
+    {
+        UINT32 current = table->keys[slot];
+
+        if (current == key)
+        {
+            return slot;
+        }
+        if (current == 0)
+        {
+            /* Counters are zero, readers decode endpoint from the key */
+            table->keys[slot] = key;
+            return slot;
+        }
+
+        slot = (slot + 1) & (USBPCAP_SUMMARY_MAX_ENDPOINTS - 1);
+    }
+
+    return USBPCAP_SUMMARY_MAX_ENDPOINTS;
+}
+
+VOID USBPcapSummaryAdd(PUSBPCAP_SUMMARY_TABLE table,
+                       UCHAR device,
+                       UCHAR endpoint,
+                       UCHAR transfer,
+                       UINT32 length,
+                       BOOLEAN error)
+{
+    PUSBPCAP_ENDPOINT_SUMMARY  entry;
+    UINT32                     slot;
+
+    /* Interlocked operations order the updates between the increments */
+    InterlockedIncrement(&table->sequence);
+
+    slot = USBPcapSummaryLookup(table,
+                                USBPCAP_SUMMARY_KEY(device, endpoint, transfer));
+    if (slot == USBPCAP_SUMMARY_MAX_ENDPOINTS)
+    {
+        table->overflows++;
+    }
+    else
+    {
+        entry = &table->endpoint[slot];
+        entry->transfers++;
+        entry->bytes += length;
+        if (error)
+        {
+            entry->errors++;
+        }
+        entry->sizes[USBPcapSummarySizeBucket(length)]++;
+    }
+
+    InterlockedIncrement(&table->sequence);
+}
+
+/*
+ * Copies key and counters of slot that were not being updated.
+ */
+static VOID USBPcapSummaryRead(const USBPCAP_SUMMARY_TABLE *table,
+                               UINT32 slot,
+                               UINT32 *key,
+                               PUSBPCAP_ENDPOINT_SUMMARY entry)
+{
+    volatile LONG *sequence = (volatile LONG *)&table->sequence;
+    LONG           start;
+
+    do
+    {
+        start = InterlockedCompareExchange(sequence, 0, 0);
+        *key = table->keys[slot];
+        memcpy(entry, &table->endpoint[slot],
+               sizeof(USBPCAP_ENDPOINT_SUMMARY));
+    }
+    while ((start & 1) ||
+           (InterlockedCompareExchange(sequence, 0, 0) != start));
+}
+
+VOID USBPcapSummaryMerge(PUSBPCAP_SUMMARY summary,
+                         const USBPCAP_SUMMARY_TABLE *table)
+{
+    UINT32 slot;
+    UINT32 i;
+    UINT32 j;
+
+    summary->overflows += table->overflows;
+
+    for (slot = 0; slot < USBPCAP_SUMMARY_MAX_ENDPOINTS; slot++)
+    {
+        USBPCAP_ENDPOINT_SUMMARY   source;
+        PUSBPCAP_ENDPOINT_SUMMARY  target;
+        UINT32                     key;
+
+        USBPcapSummaryRead(table, slot, &key, &source);
+        if (key == 0)
+        {
+            continue;
+        }
+
+        target = NULL;
+        for (i = 0; i < summary->numberOfEndpoints; i++)
+        {
+            if ((summary->endpoint[i].device == USBPCAP_SUMMARY_KEY_DEVICE(key)) &&
+                (summary->endpoint[i].endpoint == USBPCAP_SUMMARY_KEY_ENDPOINT(key)) &&
+                (summary->endpoint[i].transfer == USBPCAP_SUMMARY_KEY_TRANSFER(key)))
+            {
+                target = &summary->endpoint[i];
+                break;
+            }
+        }
+
+        if (target == NULL)
+        {
+            if (summary->numberOfEndpoints == USBPCAP_SUMMARY_MAX_ENDPOINTS)
+            {
+                /* Endpoints seen on different processors do not fit */
+                summary->overflows += (UINT32)source.transfers;
+                continue;
+            }
+
+            target = &summary->endpoint[summary->numberOfEndpoints];
+            summary->numberOfEndpoints++;
+
+            memset(target, 0, sizeof(USBPCAP_ENDPOINT_SUMMARY));
+            target->device = USBPCAP_SUMMARY_KEY_DEVICE(key);
+            target->endpoint = USBPCAP_SUMMARY_KEY_ENDPOINT(key);
+            target->transfer = USBPCAP_SUMMARY_KEY_TRANSFER(key);
+        }
+
+        target->transfers += source.transfers;
+        target->bytes += source.bytes;
+        target->errors += source.errors;
+        for (j = 0; j < USBPCAP_SUMMARY_SIZE_BUCKETS; j++)
+        {
+            target->sizes[j] += source.sizes[j];
+        }
+    }
+}
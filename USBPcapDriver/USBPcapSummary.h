@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_SUMMARY_H
+#define USBPCAP_SUMMARY_H
+
+/* This module does not depend on any kernel functionality */
+#include "include/USBPcap.h"
+
+/* Endpoint summary table updated by single writer. There is one table
+ * per processor so the writers do not have to synchronize. Zero
+ * initialized table is empty.
+ */
+typedef struct _USBPCAP_SUMMARY_TABLE
+{
+    /* Odd while the writer updates the table. Readers retry the entry
+     * they read if it changed, 64-bit counters are not written
+     * atomically on 32-bit processors.
+     */
+    volatile LONG             sequence;
+
+    /* Endpoint keys, 0 if slot is free. Key is never removed once set. */
+    UINT32                    keys[USBPCAP_SUMMARY_MAX_ENDPOINTS];
+    UINT32                    overflows;
+    USBPCAP_ENDPOINT_SUMMARY  endpoint[USBPCAP_SUMMARY_MAX_ENDPOINTS];
+} USBPCAP_SUMMARY_TABLE, *PUSBPCAP_SUMMARY_TABLE;
+
+/* Returns USBPCAP_ENDPOINT_SUMMARY sizes bucket for length */
+UCHAR USBPcapSummarySizeBucket(UINT32 length);
+
+/* Accounts completed transfer. Must not be called concurrently on the
+ * same table.
+ */
+VOID USBPcapSummaryAdd(PUSBPCAP_SUMMARY_TABLE table,
+                       UCHAR device,
+                       UCHAR endpoint,
+                       UCHAR transfer,
+                       UINT32 length,
+                       BOOLEAN error);
+
+/* Adds table counters to summary. summary must be able to hold
+ * USBPCAP_SUMMARY_MAX_ENDPOINTS endpoints and have numberOfEndpoints and
+ * overflows initialized.
+ *
+ * Table can be updated while being merged. Every endpoint is merged
+ * with the counters it had before or after an update, never with
+ * partially written ones.
+ */
+VOID USBPcapSummaryMerge(PUSBPCAP_SUMMARY summary,
+                         const USBPCAP_SUMMARY_TABLE *table);
+
+#endif /* USBPCAP_SUMMARY_H */
@@ -86,7 +86,7 @@ PUSBPCAP_ENDPOINT_INFO USBPcapGetEndpointInfo(IN PRTL_GENERIC_TABLE table,
     return &pInfo->info;
 }
 
-RTL_GENERIC_FREE_ROUTINE USBPcapFreeRoutine;
+static RTL_GENERIC_FREE_ROUTINE USBPcapFreeRoutine;
 static VOID
 USBPcapFreeRoutine(IN PRTL_GENERIC_TABLE table,
                    IN PVOID buffer)
@@ -94,7 +94,7 @@ USBPcapFreeRoutine(IN PRTL_GENERIC_TABLE table,
     ExFreePool(buffer);
 }
 
-RTL_GENERIC_ALLOCATE_ROUTINE USBPcapAllocateRoutine;
+static RTL_GENERIC_ALLOCATE_ROUTINE USBPcapAllocateRoutine;
 static PVOID
 USBPcapAllocateRoutine(IN PRTL_GENERIC_TABLE table,
                        IN CLONG size)
@@ -104,7 +104,7 @@ USBPcapAllocateRoutine(IN PRTL_GENERIC_TABLE table,
                                  USBPCAP_TABLE_TAG);
 }
 
-RTL_GENERIC_COMPARE_ROUTINE USBPcapCompareEndpointInfo;
+static RTL_GENERIC_COMPARE_ROUTINE USBPcapCompareEndpointInfo;
 static RTL_GENERIC_COMPARE_RESULTS
 USBPcapCompareEndpointInfo(IN PRTL_GENERIC_TABLE table,
                            IN PVOID first,
@@ -212,9 +212,23 @@ typedef struct _USBPCAP_INTERNAL_URB_IRP_INFO
 {
     RTL_SPLAY_LINKS        links;
     LIST_ENTRY             entry;
+    /* Table generation at the time the entry was inserted */
+    ULONG                  generation;
     USBPCAP_URB_IRP_INFO   info;
 } USBPCAP_INTERNAL_URB_IRP_INFO, *PUSBPCAP_INTERNAL_URB_IRP_INFO;
 
+/*
+ * URB IRP table bookkeeping. Allocated together with the RTL_GENERIC_TABLE
+ * and accessible via table->TableContext.
+ *
+ * Caller must hold tablesSpinLock when accessing it.
+ */
+typedef struct _USBPCAP_URB_IRP_TABLE_CONTEXT
+{
+    ULONG                  generation;
+    ULONG                  insertions;
+} USBPCAP_URB_IRP_TABLE_CONTEXT, *PUSBPCAP_URB_IRP_TABLE_CONTEXT;
+
 VOID USBPcapRemoveURBIRPInfo(IN PRTL_GENERIC_TABLE table,
                              IN PIRP irp)
 {
@@ -231,12 +245,77 @@ VOID USBPcapRemoveURBIRPInfo(IN PRTL_GENERIC_TABLE table,
     }
 }
 
-VOID USBPcapAddURBIRPInfo(IN PRTL_GENERIC_TABLE table,
-                          IN PUSBPCAP_URB_IRP_INFO irpinfo)
+/*
+ * Removes the oldest entries from URB IRP table.
+ *
+ * Generic table keeps the elements in insertion order, so element 0 is
+ * always the oldest one. Entries are removed while they are older than
+ * USBPCAP_URB_IRP_MAX_AGE generations or while the table holds more than
+ * maxEntries elements.
+ *
+ * Returns number of evicted entries.
+ */
+static ULONG USBPcapAgeURBIRPInfoTable(IN PRTL_GENERIC_TABLE table,
+                                       IN ULONG maxEntries)
+{
+    PUSBPCAP_URB_IRP_TABLE_CONTEXT  context;
+    PUSBPCAP_INTERNAL_URB_IRP_INFO  pInfo;
+    ULONG                           evicted = 0;
+
+    context = (PUSBPCAP_URB_IRP_TABLE_CONTEXT)table->TableContext;
+
+    while (NULL != (pInfo = RtlGetElementGenericTable(table, 0)))
+    {
+        if ((RtlNumberGenericTableElements(table) <= maxEntries) &&
+            ((context->generation - pInfo->generation) <= USBPCAP_URB_IRP_MAX_AGE))
+        {
+            /* All remaining entries are newer than this one */
+            break;
+        }
+
+        DkDbgVal("Evicting stale irp from table", pInfo->info.irp);
+        RtlDeleteElementGenericTable(table, pInfo);
+        evicted++;
+    }
+
+    return evicted;
+}
+
+/*
+ * Adds the URB IRP info to the table.
+ *
+ * The table never grows beyond USBPCAP_URB_IRP_TABLE_MAX_ENTRIES entries.
+ * Every USBPCAP_URB_IRP_GENERATION_LENGTH insertions the table generation
+ * advances and the entries that did not return from PDO for too long
+ * are evicted.
+ *
+ * Returns number of evicted entries.
+ */
+ULONG USBPcapAddURBIRPInfo(IN PRTL_GENERIC_TABLE table,
+                           IN PUSBPCAP_URB_IRP_INFO irpinfo)
 {
     USBPCAP_INTERNAL_URB_IRP_INFO   info;
+    PUSBPCAP_URB_IRP_TABLE_CONTEXT  context;
     BOOLEAN                         new;
+    ULONG                           evicted = 0;
+
+    context = (PUSBPCAP_URB_IRP_TABLE_CONTEXT)table->TableContext;
+
+    context->insertions++;
+    if (context->insertions == USBPCAP_URB_IRP_GENERATION_LENGTH)
+    {
+        context->insertions = 0;
+        context->generation++;
+        evicted += USBPcapAgeURBIRPInfoTable(table,
+                                             USBPCAP_URB_IRP_TABLE_MAX_ENTRIES - 1);
+    }
+    else if (RtlNumberGenericTableElements(table) >= USBPCAP_URB_IRP_TABLE_MAX_ENTRIES)
+    {
+        evicted += USBPcapAgeURBIRPInfoTable(table,
+                                             USBPCAP_URB_IRP_TABLE_MAX_ENTRIES - 1);
+    }
 
+    info.generation = context->generation;
     info.info = *irpinfo;
 
     RtlInsertElementGenericTable(table,
@@ -248,6 +327,8 @@ VOID USBPcapAddURBIRPInfo(IN PRTL_GENERIC_TABLE table,
     {
         DkDbgVal("Element already exists in table", irpinfo->irp);
     }
+
+    return evicted;
 }
 
 static PUSBPCAP_URB_IRP_INFO
@@ -285,7 +366,7 @@ VOID USBPcapFreeURBIRPInfoTable(IN PRTL_GENERIC_TABLE table)
     ExFreePool(table);
 }
 
-RTL_GENERIC_COMPARE_ROUTINE USBPcapCompareURBIRPInfo;
+static RTL_GENERIC_COMPARE_ROUTINE USBPcapCompareURBIRPInfo;
 static RTL_GENERIC_COMPARE_RESULTS
 USBPcapCompareURBIRPInfo(IN PRTL_GENERIC_TABLE table,
                          IN PVOID first,
@@ -308,15 +389,28 @@ USBPcapCompareURBIRPInfo(IN PRTL_GENERIC_TABLE table,
     }
 }
 
+/*
+ * Initializes URB IRP info table.
+ * Returns NULL if there are no sufficient resources availble.
+ *
+ * The table context is used internally for aging bookkeeping, hence
+ * the context argument is ignored.
+ *
+ * Returned table must be freed using USBPcapFreeURBIRPInfoTable()
+ */
 PRTL_GENERIC_TABLE USBPcapInitializeURBIRPInfoTable(IN PVOID context)
 {
     PRTL_GENERIC_TABLE table;
 
+    PUSBPCAP_URB_IRP_TABLE_CONTEXT tableContext;
+
     DkDbgStr("Initialize URB irp table");
 
+    /* Table bookkeeping is stored right after the table structure */
     table = (PRTL_GENERIC_TABLE)
                 ExAllocatePoolWithTag(NonPagedPool,
-                                      sizeof(RTL_GENERIC_TABLE),
+                                      sizeof(RTL_GENERIC_TABLE) +
+                                      sizeof(USBPCAP_URB_IRP_TABLE_CONTEXT),
                                       USBPCAP_TABLE_TAG);
 
     if (table == NULL)
@@ -325,11 +419,15 @@ PRTL_GENERIC_TABLE USBPcapInitializeURBIRPInfoTable(IN PVOID context)
         return table;
     }
 
+    tableContext = (PUSBPCAP_URB_IRP_TABLE_CONTEXT)(table + 1);
+    tableContext->generation = 0;
+    tableContext->insertions = 0;
+
     RtlInitializeGenericTable(table,
                               USBPcapCompareURBIRPInfo,
                               USBPcapAllocateRoutine,
                               USBPcapFreeRoutine,
-                              context);
+                              tableContext);
 
     return table;
 }
@@ -48,10 +48,23 @@ typedef struct _USBPCAP_URB_IRP_INFO
     USHORT        device;    /* device address */
 } USBPCAP_URB_IRP_INFO, *PUSBPCAP_URB_IRP_INFO;
 
+/* Maximum number of entries kept in URB IRP table. When the table is full
+ * the oldest entry gets evicted to make space for the new one.
+ */
+#define USBPCAP_URB_IRP_TABLE_MAX_ENTRIES  1024
+
+/* Number of insertions after which the URB IRP table generation advances */
+#define USBPCAP_URB_IRP_GENERATION_LENGTH  256
+
+/* Entries older than this many generations are considered stale and are
+ * evicted by the aging sweep performed whenever the generation advances.
+ */
+#define USBPCAP_URB_IRP_MAX_AGE            4
+
 VOID USBPcapRemoveURBIRPInfo(IN PRTL_GENERIC_TABLE table,
                              IN PIRP irp);
-VOID USBPcapAddURBIRPInfo(IN PRTL_GENERIC_TABLE table,
-                          IN PUSBPCAP_URB_IRP_INFO irpinfo);
+ULONG USBPcapAddURBIRPInfo(IN PRTL_GENERIC_TABLE table,
+                           IN PUSBPCAP_URB_IRP_INFO irpinfo);
 
 VOID USBPcapFreeURBIRPInfoTable(IN PRTL_GENERIC_TABLE table);
 PRTL_GENERIC_TABLE USBPcapInitializeURBIRPInfoTable(IN PVOID context);
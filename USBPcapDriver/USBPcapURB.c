@@ -8,7 +8,7 @@
 #include "USBPcapURB.h"
 #include "USBPcapTables.h"
 #include "USBPcapBuffer.h"
-#include "USBPcapHelperFunctions.h"
+#include "USBPcapCapture.h"
 
 #include <stddef.h> /* Required for offsetof macro */
 
@@ -167,19 +167,69 @@ USBPcapParseInterfaceInformation(PUSBPCAP_DEVICE_DATA pDeviceData,
     }
 }
 
+/*
+ * Fills the fields common to all records.
+ *
+ * Device is set to the address of device the URB was sent to. Endpoint,
+ * transfer type and data length are left for the caller to fill.
+ */
 __inline static VOID
-USBPcapAnalyzeControlTransfer(struct _URB_CONTROL_TRANSFER* transfer,
+USBPcapInitializePacketHeader(PUSBPCAP_BUFFER_PACKET_HEADER packetHeader,
+                              USHORT headerLen,
                               struct _URB_HEADER* header,
                               PUSBPCAP_DEVICE_DATA pDeviceData,
                               PIRP pIrp,
                               BOOLEAN post)
 {
-    BOOLEAN                        transferFromDevice;
-    USBPCAP_BUFFER_CONTROL_HEADER  packetHeader;
-    PVOID                          dataBuffer;
-    UINT32                         dataBufferLength;
+    packetHeader->headerLen = headerLen;
+    packetHeader->irpId     = (UINT64) pIrp;
+    packetHeader->status    = header->Status;
+    packetHeader->function  = header->Function;
+    packetHeader->info      = USBPcapGetSamplingInfo(pDeviceData->pRootData);
+    if (post == TRUE)
+    {
+        packetHeader->info |= USBPCAP_INFO_PDO_TO_FDO;
+    }
+
+    packetHeader->bus       = pDeviceData->pRootData->busId;
+    packetHeader->device    = pDeviceData->deviceAddress;
+}
+
+/*
+ * Control transfer as seen by the control record builder.
+ *
+ * All control-like URBs (descriptor, status, vendor and class requests,
+ * select configuration and interface) are described using this structure
+ * rather than being rewrapped into _URB_CONTROL_TRANSFER.
+ */
+typedef struct _USBPCAP_CONTROL_REQUEST
+{
+    USBD_PIPE_HANDLE  pipeHandle;
+    ULONG             transferFlags;
+    ULONG             transferBufferLength;
+    PVOID             transferBuffer;
+    PMDL              transferBufferMDL;
+    UCHAR             setupPacket[8];
+} USBPCAP_CONTROL_REQUEST, *PUSBPCAP_CONTROL_REQUEST;
 
-    if (transfer->TransferFlags & USBD_TRANSFER_DIRECTION_IN)
+__inline static VOID
+USBPcapAnalyzeControlTransfer(PUSBPCAP_CONTROL_REQUEST request,
+                              struct _URB_HEADER* header,
+                              PUSBPCAP_DEVICE_DATA pDeviceData,
+                              PIRP pIrp,
+                              BOOLEAN post)
+{
+    BOOLEAN                         transferFromDevice;
+    UCHAR                           endpoint;
+    USBPCAP_BUFFER_RECORD           record;
+    PUSBPCAP_BUFFER_CONTROL_HEADER  packetHeader;
+    PVOID                           dataBuffer;
+    UINT32                          dataBufferLength;
+    UINT32                          dataLength;
+    UINT32                          maxDataLength;
+    LARGE_INTEGER                   timestamp;
+
+    if (request->transferFlags & USBD_TRANSFER_DIRECTION_IN)
     {
         /* From device to host */
         transferFromDevice = TRUE;
@@ -190,22 +240,9 @@ USBPcapAnalyzeControlTransfer(struct _URB_CONTROL_TRANSFER* transfer,
         transferFromDevice = FALSE;
     }
 
-    packetHeader.header.headerLen = sizeof(USBPCAP_BUFFER_CONTROL_HEADER);
-    packetHeader.header.irpId     = (UINT64) pIrp;
-    packetHeader.header.status    = header->Status;
-    packetHeader.header.function  = header->Function;
-    packetHeader.header.info      = 0;
-    if (post == TRUE)
-    {
-        packetHeader.header.info |= USBPCAP_INFO_PDO_TO_FDO;
-    }
-
-    packetHeader.header.bus      = pDeviceData->pRootData->busId;
-    packetHeader.header.device   = pDeviceData->deviceAddress;
-
-    packetHeader.header.endpoint = 0;
-    if ((transfer->TransferFlags & USBD_DEFAULT_PIPE_TRANSFER) ||
-        (transfer->PipeHandle == NULL))
+    endpoint = 0;
+    if ((request->transferFlags & USBD_DEFAULT_PIPE_TRANSFER) ||
+        (request->pipeHandle == NULL))
     {
         /* Transfer to default control endpoint 0 */
     }
@@ -215,1074 +252,1738 @@ USBPcapAnalyzeControlTransfer(struct _URB_CONTROL_TRANSFER* transfer,
         BOOLEAN                                 epFound;
 
         epFound = USBPcapRetrieveEndpointInfo(pDeviceData,
-                                              transfer->PipeHandle,
+                                              request->pipeHandle,
                                               &info);
         if (epFound == TRUE)
         {
-            packetHeader.header.endpoint = info.endpointAddress;
+            endpoint = info.endpointAddress;
         }
     }
 
     if (transferFromDevice)
     {
-        packetHeader.header.endpoint |= 0x80;
+        endpoint |= 0x80;
     }
 
-    packetHeader.header.transfer = USBPCAP_TRANSFER_CONTROL;
+    if (USBPcapIsEndpointCaptured(pDeviceData->pRootData,
+                                  (int)pDeviceData->deviceAddress,
+                                  endpoint,
+                                  USBPCAP_TRANSFER_CONTROL) == FALSE)
+    {
+        return;
+    }
 
-    if (transfer->TransferBufferLength != 0)
+    dataBuffer = NULL;
+    dataBufferLength = 0;
+    maxDataLength = MAXULONG;
+    if (pDeviceData->pRootData->captureFlags & USBPCAP_CAPTURE_HEADER_ONLY)
+    {
+        /* Never map the transfer buffer, keep only the Setup packet */
+        dataBufferLength = (UINT32)request->transferBufferLength;
+        maxDataLength = (post == FALSE) ? 8 : 0;
+    }
+    else if (request->transferBufferLength != 0)
     {
         dataBuffer =
-            USBPcapURBGetBufferPointer(transfer->TransferBufferLength,
-                                       transfer->TransferBuffer,
-                                       transfer->TransferBufferMDL);
-        dataBufferLength = (UINT32)transfer->TransferBufferLength;
+            USBPcapURBGetBufferPointer(request->transferBufferLength,
+                                       request->transferBuffer,
+                                       request->transferBufferMDL);
+        if (dataBuffer != NULL)
+        {
+            dataBufferLength = (UINT32)request->transferBufferLength;
+        }
     }
-    else
+
+    /* Setup stage is logged only when on its way from FDO to PDO and
+     * Complete stage when on its way from PDO to FDO. Data goes with
+     * Setup for OUT and with Complete for IN transfers.
+     */
+    dataLength = (post == FALSE) ? 8 : 0;
+    if (transferFromDevice == post)
+    {
+        dataLength += dataBufferLength;
+    }
+
+    /* Header is filled directly in the space reserved in the buffer */
+    timestamp = USBPcapGetCurrentTimestamp();
+    if (!NT_SUCCESS(USBPcapBufferBeginRecord(pDeviceData->pRootData,
+                                             timestamp,
+                                             sizeof(USBPCAP_BUFFER_CONTROL_HEADER),
+                                             dataLength,
+                                             pDeviceData->deviceAddress,
+                                             endpoint,
+                                             USBPCAP_TRANSFER_CONTROL,
+                                             maxDataLength,
+                                             &record)))
     {
-        dataBuffer = NULL;
-        dataBufferLength = 0;
+        return;
     }
 
-    /* Add Setup stage to log only when on its way from FDO to PDO. */
+    packetHeader = (PUSBPCAP_BUFFER_CONTROL_HEADER)record.header;
+    USBPcapInitializePacketHeader(&packetHeader->header,
+                                  sizeof(USBPCAP_BUFFER_CONTROL_HEADER),
+                                  header, pDeviceData, pIrp, post);
+    packetHeader->header.endpoint   = endpoint;
+    packetHeader->header.transfer   = USBPCAP_TRANSFER_CONTROL;
+    packetHeader->header.dataLength = dataLength;
+
     if (post == FALSE)
     {
-        USBPCAP_PAYLOAD_ENTRY  payload[3];
+        packetHeader->stage = USBPCAP_CONTROL_STAGE_SETUP;
+        USBPcapBufferRecordWriteData(&record,
+                                     (PVOID)&request->setupPacket[0], 8);
+    }
+    else
+    {
+        packetHeader->stage = USBPCAP_CONTROL_STAGE_COMPLETE;
+    }
+
+    if (transferFromDevice == post)
+    {
+        USBPcapBufferRecordWriteData(&record, dataBuffer, dataBufferLength);
+    }
+
+    USBPcapBufferEndRecord(&record);
+}
+
+/*
+ * Scratch space needed to build the isochronous transfer record.
+ * Sized for the maximum number of packets USBPcap handles.
+ */
+typedef struct _USBPCAP_ISOCH_SCRATCH
+{
+    USBPCAP_PAYLOAD_ENTRY  payload[USBPCAP_ISOCH_MAX_PACKETS + 1];
+    UCHAR                  header[USBPCAP_ISOCH_MAX_HEADER_LEN];
+} USBPCAP_ISOCH_SCRATCH, *PUSBPCAP_ISOCH_SCRATCH;
+
+/* Scratch space of every processor indexed by processor number,
+ * allocated by USBPcapInitializeIsochScratch() when the driver is loaded.
+ * Only if that failed isochronous transfers fall back to temporary pool
+ * allocation.
+ */
+static PUSBPCAP_ISOCH_SCRATCH *g_isochScratch;
+static ULONG                   g_isochScratchCount;
+
+#define USBPCAP_ISOCH_SCRATCH_TAG  (ULONG)'rcSI'
+
+/*
+ * Allocates scratch space for all processors that can be present in the
+ * system, so isochronous transfers never allocate from pool.
+ *
+ * Must be called before any URB is analyzed. Does nothing if the scratch
+ * space is already allocated.
+ */
+NTSTATUS USBPcapInitializeIsochScratch(VOID)
+{
+    PUSBPCAP_ISOCH_SCRATCH *slots;
+    ULONG                   count;
+    ULONG                   i;
+
+    if (g_isochScratch != NULL)
+    {
+        return STATUS_SUCCESS;
+    }
+
+#if (_WIN32_WINNT >= 0x0601)
+    count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+#else
+    count = (ULONG)KeNumberProcessors;
+#endif
 
-        packetHeader.header.dataLength = 8;
-        packetHeader.stage = USBPCAP_CONTROL_STAGE_SETUP;
+    slots = (PUSBPCAP_ISOCH_SCRATCH *)
+        ExAllocatePoolWithTag(NonPagedPool,
+                              count * sizeof(PUSBPCAP_ISOCH_SCRATCH),
+                              USBPCAP_ISOCH_SCRATCH_TAG);
+    if (slots == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
-        payload[0].size   = 8;
-        payload[0].buffer = (PVOID)&transfer->SetupPacket[0];
-        payload[1].size   = 0;
-        payload[1].buffer = NULL;
-        payload[2].size   = 0;
-        payload[2].buffer = NULL;
+    RtlZeroMemory(slots, count * sizeof(PUSBPCAP_ISOCH_SCRATCH));
+    g_isochScratchCount = count;
+    g_isochScratch = slots;
 
-        if (!transferFromDevice)
+    for (i = 0; i < count; i++)
+    {
+        slots[i] = ExAllocatePoolWithTag(NonPagedPool,
+                                         sizeof(USBPCAP_ISOCH_SCRATCH),
+                                         USBPCAP_ISOCH_SCRATCH_TAG);
+        if (slots[i] == NULL)
         {
-            packetHeader.header.dataLength += dataBufferLength;
-            payload[1].size = dataBufferLength;
-            payload[1].buffer = dataBuffer;
+            USBPcapFreeIsochScratch();
+            return STATUS_INSUFFICIENT_RESOURCES;
         }
-
-        USBPcapBufferWritePayload(pDeviceData->pRootData,
-                                 (PUSBPCAP_BUFFER_PACKET_HEADER)&packetHeader,
-                                 payload);
     }
 
-    /* Add Complete stage to log when on its way from PDO to FDO */
-    if (post == TRUE)
+    return STATUS_SUCCESS;
+}
+
+/*
+ * Returns scratch space of the current processor.
+ *
+ * Must be called at DISPATCH_LEVEL and the returned pointer must not be
+ * used after IRQL is lowered.
+ *
+ * Returns NULL if the scratch space could not be allocated when the
+ * driver was loaded.
+ */
+static PUSBPCAP_ISOCH_SCRATCH USBPcapGetIsochScratch(VOID)
+{
+    ULONG processor;
+
+    ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+#if (_WIN32_WINNT >= 0x0601)
+    processor = KeGetCurrentProcessorNumberEx(NULL);
+#else
+    processor = (ULONG)KeGetCurrentProcessorNumber();
+#endif
+
+    if ((g_isochScratch == NULL) || (processor >= g_isochScratchCount))
     {
-        USBPCAP_PAYLOAD_ENTRY  payload[2];
+        return NULL;
+    }
+
+    /* Only current processor uses its own scratch space. Because we are
+     * at DISPATCH_LEVEL there is no need for further synchronization.
+     */
+    return g_isochScratch[processor];
+}
 
-        packetHeader.header.dataLength = 0;
-        packetHeader.stage = USBPCAP_CONTROL_STAGE_COMPLETE;
+/*
+ * Frees all per-processor isochronous scratch spaces and the slots.
+ * Called when driver unloads.
+ */
+VOID USBPcapFreeIsochScratch(VOID)
+{
+    ULONG i;
 
-        payload[0].size   = 0;
-        payload[0].buffer = NULL;
-        payload[1].size   = 0;
-        payload[1].buffer = NULL;
+    if (g_isochScratch == NULL)
+    {
+        return;
+    }
 
-        if (transferFromDevice)
+    for (i = 0; i < g_isochScratchCount; i++)
+    {
+        if (g_isochScratch[i] != NULL)
         {
-            packetHeader.header.dataLength += dataBufferLength;
-            payload[0].size = dataBufferLength;
-            payload[0].buffer = dataBuffer;
+            ExFreePool((PVOID)g_isochScratch[i]);
         }
-
-        USBPcapBufferWritePayload(pDeviceData->pRootData,
-                                 (PUSBPCAP_BUFFER_PACKET_HEADER)&packetHeader,
-                                 payload);
     }
+
+    ExFreePool((PVOID)g_isochScratch);
+    g_isochScratch = NULL;
+    g_isochScratchCount = 0;
 }
 
 /*
- * Analyzes the URB
+ * Gets the payload of isochronous record holding count packets starting
+ * at first. Compacted IN data is the data of these packets. OUT data is
+ * the transfer buffer from the first packet offset up to the first packet
+ * offset of the next record; the first record starts at the beginning of
+ * transfer buffer and the last one ends at its end. Packet offsets in OUT
+ * records are relative to *chunkStart.
  *
- * post is FALSE when the request is being on its way to the bus driver
- * post is TRUE when the request returns from the bus driver
+ * Returns FALSE if packet offsets do not allow such split.
  */
-VOID USBPcapAnalyzeURB(PIRP pIrp, PURB pUrb, BOOLEAN post,
-                       PUSBPCAP_DEVICE_DATA pDeviceData)
+static BOOLEAN
+USBPcapGetIsochChunk(struct _URB_ISOCH_TRANSFER* transfer,
+                     ULONG first,
+                     ULONG count,
+                     BOOLEAN compact,
+                     PULONG chunkStart,
+                     PULONG dataLength)
 {
-    struct _URB_HEADER     *header;
-    USBPCAP_URB_IRP_INFO    unknownURBSubmitInfo;
-    BOOLEAN                 hasUnknownURBSubmitInfo;
-
-    ASSERT(pUrb != NULL);
-    ASSERT(pDeviceData != NULL);
-    ASSERT(pDeviceData->pRootData != NULL);
+    ULONG  chunkEnd;
+    ULONG  i;
 
-    header = (struct _URB_HEADER*)pUrb;
+    if (compact == TRUE)
+    {
+        /* Sum of all packet lengths was checked against transfer buffer */
+        *chunkStart = 0;
+        *dataLength = 0;
+        for (i = 0; i < count; i++)
+        {
+            *dataLength += transfer->IsoPacket[first + i].Length;
+        }
+        return TRUE;
+    }
 
-    /* Check if the IRP on its way from FDO to PDO had unknown URB function */
-    if (post)
+    *chunkStart = (first == 0) ? 0 : transfer->IsoPacket[first].Offset;
+    if (first + count < transfer->NumberOfPackets)
     {
-        hasUnknownURBSubmitInfo =
-            USBPcapObtainURBIRPInfo(pDeviceData, pIrp, &unknownURBSubmitInfo);
+        chunkEnd = transfer->IsoPacket[first + count].Offset;
     }
     else
     {
-        hasUnknownURBSubmitInfo = FALSE;
+        chunkEnd = transfer->TransferBufferLength;
     }
 
-    /* Following URBs are always analyzed */
-    switch (header->Function)
+    if ((chunkEnd < *chunkStart) ||
+        (chunkEnd > transfer->TransferBufferLength))
     {
-        case URB_FUNCTION_SELECT_CONFIGURATION:
+        return FALSE;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (transfer->IsoPacket[first + i].Offset < *chunkStart)
         {
-            struct _URB_SELECT_CONFIGURATION *pSelectConfiguration;
-            USHORT interfaces_len;
+            return FALSE;
+        }
+    }
 
-            if (post == FALSE)
-            {
-                /* Pass the request to host controller,
-                 * we are interested only in select configuration
-                 * after the fields are set by host controller driver */
-                break;
-            }
+    *dataLength = chunkEnd - *chunkStart;
+    return TRUE;
+}
 
-            DkDbgStr("URB_FUNCTION_SELECT_CONFIGURATION");
-            pSelectConfiguration = (struct _URB_SELECT_CONFIGURATION*)pUrb;
+/*
+ * Logs the isochronous transfer.
+ *
+ * Transfers with more than USBPCAP_ISOCH_MAX_PACKETS packets are logged as
+ * consecutive records sharing the same irpId. Every record except the last
+ * one has USBPCAP_INFO_CONTINUED set in the info field. The records are
+ * written as single group, so either all of them get to the buffer one
+ * after another or none does.
+ *
+ * Must be called at DISPATCH_LEVEL as the records are built inside
+ * per-processor scratch space.
+ */
+static VOID
+USBPcapAnalyzeIsochTransfer(struct _URB_ISOCH_TRANSFER* transfer,
+                            struct _URB_HEADER* header,
+                            PUSBPCAP_DEVICE_DATA pDeviceData,
+                            PIRP pIrp,
+                            BOOLEAN post)
+{
+    USBPCAP_ENDPOINT_INFO         info;
+    BOOLEAN                       epFound;
+    PUSBPCAP_ISOCH_SCRATCH        scratch;
+    BOOLEAN                       temporaryScratch;
+    PUSBPCAP_BUFFER_ISOCH_HEADER  packetHeader;
+    USBPCAP_BUFFER_GROUP          group;
+    LARGE_INTEGER                 timestamp;
+    UCHAR                         samplingInfo;
+    PUCHAR                        transferBuffer;
+    BOOLEAN                       compact;
+    BOOLEAN                       captureOut;
+    BOOLEAN                       hasData;
+    UINT32                        maxDataLength;
+    ULONG                         chunkStart;
+    ULONG                         dataLength;
+    UINT32                        groupBytes;
+    ULONG                         first;
+    ULONG                         count;
+    ULONG                         i;
+
+    DkDbgVal("", transfer->PipeHandle);
+    DkDbgVal("", transfer->TransferFlags);
+    DkDbgVal("", transfer->NumberOfPackets);
+
+    epFound = USBPcapRetrieveEndpointInfo(pDeviceData,
+                                          transfer->PipeHandle,
+                                          &info);
+    if (epFound == FALSE)
+    {
+        info.deviceAddress = pDeviceData->deviceAddress;
+        info.endpointAddress = 0xFF;
+    }
 
-            /* Check if there is interface information in the URB */
-            if (pUrb->UrbHeader.Length > offsetof(struct _URB_SELECT_CONFIGURATION, Interface))
-            {
-                /* Calculate interfaces length */
-                interfaces_len = pUrb->UrbHeader.Length;
-                interfaces_len -= offsetof(struct _URB_SELECT_CONFIGURATION, Interface);
+    if (USBPcapIsEndpointCaptured(pDeviceData->pRootData,
+                                  (int)info.deviceAddress,
+                                  info.endpointAddress,
+                                  USBPCAP_TRANSFER_ISOCHRONOUS) == FALSE)
+    {
+        return;
+    }
 
-                KdPrint(("Header Len: %d Interfaces_len: %d\n",
-                        pUrb->UrbHeader.Length, interfaces_len));
+    /* For inbound isoch transfers (post), transfer->TransferBufferLength reflects the actual
+     * number of bytes received. Rather than copying the entire transfer buffer (which may have
+     * empty gaps), we will compact the data, copying only the packets that contain data.
+     */
+    compact = FALSE;
+    captureOut = FALSE;
+    hasData = FALSE;
+    maxDataLength = MAXULONG;
+    transferBuffer = NULL;
+    if (transfer->TransferBufferLength != 0)
+    {
+        if (((transfer->TransferFlags & USBD_TRANSFER_DIRECTION_IN) == USBD_TRANSFER_DIRECTION_IN) && (post == TRUE))
+        {
+            ULONG  compactedLength;
 
-                USBPcapParseInterfaceInformation(pDeviceData,
-                                                 &pSelectConfiguration->Interface,
-                                                 interfaces_len);
-            }
+            compactedLength = 0;
 
-            /* Store the configuration information for later use */
-            if (pDeviceData->descriptor != NULL)
+            /* Compute the compacted transfer length by summing up the individual packet lengths */
+            for (i = 0; i < transfer->NumberOfPackets; i++)
             {
-                ExFreePool((PVOID)pDeviceData->descriptor);
+                compactedLength += transfer->IsoPacket[i].Length;
             }
 
-            if (pSelectConfiguration->ConfigurationDescriptor != NULL)
-            {
-                SIZE_T descSize = pSelectConfiguration->ConfigurationDescriptor->wTotalLength;
-
-                pDeviceData->descriptor =
-                    ExAllocatePoolWithTag(NonPagedPool,
-                                          descSize,
-                                          (ULONG)'CSED');
-
-                RtlCopyMemory(pDeviceData->descriptor,
-                              pSelectConfiguration->ConfigurationDescriptor,
-                              (SIZE_T)descSize);
-            }
-            else
+            if (compactedLength > transfer->TransferBufferLength)
             {
-                pDeviceData->descriptor = NULL;
+                /* This is a safety check -- the numbers don't add up (this should never happen) */
+                DkDbgStr("Sum of Isochronous transfer packet lengths exceeds transfer buffer length");
+                return;
             }
 
-            break;
+            compact = TRUE;
+        }
+        else if (((transfer->TransferFlags & USBD_TRANSFER_DIRECTION_IN) == USBD_TRANSFER_DIRECTION_OUT) && (post == FALSE))
+        {
+            captureOut = TRUE;
+        }
+        else
+        {
+            /* Do not capture transfer buffer now */
         }
 
-        case URB_FUNCTION_SELECT_INTERFACE:
+        if ((compact == FALSE) && (captureOut == FALSE))
         {
-            struct _URB_SELECT_INTERFACE *pSelectInterface;
-            USHORT interfaces_len;
+            /* No data in this record */
+        }
+        else if (pDeviceData->pRootData->captureFlags & USBPCAP_CAPTURE_HEADER_ONLY)
+        {
+            /* Never map the transfer buffer, records keep the data length */
+            hasData = TRUE;
+            maxDataLength = 0;
+        }
+        else
+        {
+            transferBuffer =
+                USBPcapURBGetBufferPointer(transfer->TransferBufferLength,
+                                           transfer->TransferBuffer,
+                                           transfer->TransferBufferMDL);
+            hasData = (transferBuffer != NULL) ? TRUE : FALSE;
+        }
+    }
 
-            if (post == FALSE)
+    /* Check every record boundary before anything is written */
+    if ((hasData == TRUE) && (captureOut == TRUE))
+    {
+        first = 0;
+        do
+        {
+            count = min(transfer->NumberOfPackets - first, USBPCAP_ISOCH_MAX_PACKETS);
+            if (USBPcapGetIsochChunk(transfer, first, count, FALSE,
+                                     &chunkStart, &dataLength) == FALSE)
             {
-                /* Pass the request to host controller,
-                 * we are interested only in select interface
-                 * after the fields are set by host controller driver */
-                break;
+                DkDbgStr("Isochronous packet offsets do not fit transfer buffer");
+                return;
             }
+            first += count;
+        }
+        while (first < transfer->NumberOfPackets);
+    }
 
-            DkDbgStr("URB_FUNCTION_SELECT_INTERFACE");
-            pSelectInterface = (struct _URB_SELECT_INTERFACE*)pUrb;
+    scratch = USBPcapGetIsochScratch();
+    temporaryScratch = FALSE;
+    if (scratch == NULL)
+    {
+        scratch = ExAllocatePoolWithTag(NonPagedPool,
+                                        sizeof(USBPCAP_ISOCH_SCRATCH),
+                                        USBPCAP_ISOCH_SCRATCH_TAG);
+        if (scratch == NULL)
+        {
+            DkDbgStr("Insufficient resources for isochronous transfer");
+            return;
+        }
+        temporaryScratch = TRUE;
+    }
 
-            /* Check if there is interface information in the URB */
-            if (pUrb->UrbHeader.Length > offsetof(struct _URB_SELECT_INTERFACE, Interface))
-            {
-                /* Calculate interfaces length */
-                interfaces_len = pUrb->UrbHeader.Length;
-                interfaces_len -= offsetof(struct _URB_SELECT_INTERFACE, Interface);
+    packetHeader = (PUSBPCAP_BUFFER_ISOCH_HEADER)scratch->header;
 
-                KdPrint(("Header Len: %d Interfaces_len: %d\n",
-                        pUrb->UrbHeader.Length, interfaces_len));
+    /* headerLen and info are set separately for every record */
+    USBPcapInitializePacketHeader(&packetHeader->header, 0,
+                                  header, pDeviceData, pIrp, post);
 
-                USBPcapParseInterfaceInformation(pDeviceData,
-                                                 &pSelectInterface->Interface,
-                                                 interfaces_len);
-            }
-            break;
-        }
+    packetHeader->header.device = info.deviceAddress;
+    packetHeader->header.endpoint = info.endpointAddress;
+    packetHeader->header.transfer = USBPCAP_TRANSFER_ISOCHRONOUS;
 
-        default:
-            break;
-    }
+    packetHeader->startFrame      = transfer->StartFrame;
+    packetHeader->errorCount      = transfer->ErrorCount;
 
-    if (USBPcapIsDeviceFiltered(&pDeviceData->pRootData->filter,
-                                (int)pDeviceData->deviceAddress) == FALSE)
+    /* All records of the transfer have the same timestamp and info bits */
+    timestamp = USBPcapGetCurrentTimestamp();
+    samplingInfo = USBPcapGetSamplingInfo(pDeviceData->pRootData);
+    USBPcapBufferBeginGroup(pDeviceData->pRootData, &group);
+
+    /* Reserve space for all records, one per USBPCAP_ISOCH_MAX_PACKETS
+     * packets. Transfer without any packets is logged as single record.
+     */
+    groupBytes = 0;
+    first = 0;
+    do
     {
-        /* Do not log URBs from devices which are not being filtered */
-        return;
+        UINT32  recordBytes;
+
+        count = min(transfer->NumberOfPackets - first, USBPCAP_ISOCH_MAX_PACKETS);
+        dataLength = 0;
+        if (hasData == TRUE)
+        {
+            USBPcapGetIsochChunk(transfer, first, count, compact,
+                                 &chunkStart, &dataLength);
+        }
+
+        recordBytes = USBPcapBufferGroupRecordSize(&group,
+            (USHORT)(sizeof(USBPCAP_BUFFER_ISOCH_HEADER) -
+                     sizeof(USBPCAP_BUFFER_ISO_PACKET) +
+                     sizeof(USBPCAP_BUFFER_ISO_PACKET) * count),
+            dataLength, info.deviceAddress, info.endpointAddress,
+            USBPCAP_TRANSFER_ISOCHRONOUS, maxDataLength);
+        groupBytes = (recordBytes > MAXULONG - groupBytes) ?
+                     MAXULONG : groupBytes + recordBytes;
+
+        first += count;
     }
+    while (first < transfer->NumberOfPackets);
 
-    if (hasUnknownURBSubmitInfo)
+    if (NT_SUCCESS(USBPcapBufferReserveGroup(&group, groupBytes)))
     {
-        /* Simply log the unknown URB.
-         *
-         * Originally this was used to detect if URB returns from PDO as URB_FUNCTION_CONTROL_TRANSFER
-         * When this was the case, the unknownURBSubmitInfo was used together with the pUrb to fake
-         * the Setup stage packet. Unfortunately it is unreliable as there are specific Windows and
-         * USB Root Hub combinations for which the URB can return with URB_FUNCTION_CONTROL_TRANSFER
-         * but the SetupPacket inside pUrb does not contain valid data!
-         */
-        USBPCAP_BUFFER_PACKET_HEADER  packetHeader;
+        first = 0;
+        do
+        {
+            PUSBPCAP_PAYLOAD_ENTRY  payload = scratch->payload;
 
-        DkDbgVal("Logging unknown URB from URB IRP table", unknownURBSubmitInfo.function);
+            count = min(transfer->NumberOfPackets - first, USBPCAP_ISOCH_MAX_PACKETS);
 
-        packetHeader.headerLen  = sizeof(USBPCAP_BUFFER_PACKET_HEADER);
-        packetHeader.irpId      = (UINT64) pIrp;
-        packetHeader.status     = unknownURBSubmitInfo.status;
-        packetHeader.function   = unknownURBSubmitInfo.function;
-        packetHeader.info       = unknownURBSubmitInfo.info;
-        packetHeader.bus        = unknownURBSubmitInfo.bus;
-        packetHeader.device     = unknownURBSubmitInfo.device;
-        packetHeader.endpoint   = 0;
-        packetHeader.transfer   = USBPCAP_TRANSFER_UNKNOWN;
-        packetHeader.dataLength = 0;
-
-        USBPcapBufferWriteTimestampedPacket(pDeviceData->pRootData,
-                                            unknownURBSubmitInfo.timestamp,
-                                            &packetHeader, NULL);
-    }
-
-    switch (header->Function)
-    {
-        case URB_FUNCTION_SELECT_CONFIGURATION:
-        {
-            struct _URB_SELECT_CONFIGURATION *pSelectConfiguration;
-            struct _URB_CONTROL_TRANSFER     wrapTransfer;
+            /* headerLen will fit on 16 bits for every allowed value of count */
+            packetHeader->header.headerLen =
+                (USHORT)(sizeof(USBPCAP_BUFFER_ISOCH_HEADER) -
+                         sizeof(USBPCAP_BUFFER_ISO_PACKET) +
+                         sizeof(USBPCAP_BUFFER_ISO_PACKET) * count);
 
-            pSelectConfiguration = (struct _URB_SELECT_CONFIGURATION*)pUrb;
-
-            wrapTransfer.PipeHandle = NULL; /* Default pipe handle */
-            wrapTransfer.TransferFlags = USBD_TRANSFER_DIRECTION_OUT;
-            wrapTransfer.TransferBufferLength = 0;
-            wrapTransfer.TransferBuffer = NULL;
-            wrapTransfer.TransferBufferMDL = NULL;
-            wrapTransfer.SetupPacket[0] = 0x00; /* Host to Device, Standard */
-            wrapTransfer.SetupPacket[1] = 0x09; /* SET_CONFIGURATION */
-            if (pSelectConfiguration->ConfigurationDescriptor == NULL)
+            packetHeader->header.info = samplingInfo;
+            if (post == TRUE)
             {
-                wrapTransfer.SetupPacket[2] = 0;
+                packetHeader->header.info |= USBPCAP_INFO_PDO_TO_FDO;
             }
-            else
+            if (first + count < transfer->NumberOfPackets)
             {
-                wrapTransfer.SetupPacket[2] = pSelectConfiguration->ConfigurationDescriptor->bConfigurationValue;
+                packetHeader->header.info |= USBPCAP_INFO_CONTINUED;
             }
-            wrapTransfer.SetupPacket[3] = 0;
-            wrapTransfer.SetupPacket[4] = 0;
-            wrapTransfer.SetupPacket[5] = 0;
-            wrapTransfer.SetupPacket[6] = 0;
-            wrapTransfer.SetupPacket[7] = 0;
-
-            USBPcapAnalyzeControlTransfer(&wrapTransfer, header,
-                                          pDeviceData, pIrp, post);
-            break;
-        }
-
-        case URB_FUNCTION_SELECT_INTERFACE:
-        {
-            struct _URB_SELECT_INTERFACE *pSelectInterface;
-            struct _URB_CONTROL_TRANSFER wrapTransfer;
-            PUSBD_INTERFACE_INFORMATION  intInfo;
-            PUSB_INTERFACE_DESCRIPTOR    intDescriptor;
 
-            pSelectInterface = (struct _URB_SELECT_INTERFACE*)pUrb;
+            packetHeader->numberOfPackets = count;
 
-            if (pDeviceData->descriptor == NULL)
+            /* Copy the packet headers untouched */
+            for (i = 0; i < count; i++)
             {
-                /* Won't log this URB */
-                DkDbgStr("No configuration descriptor");
-                break;
+                packetHeader->packet[i].offset = transfer->IsoPacket[first + i].Offset;
+                packetHeader->packet[i].length = transfer->IsoPacket[first + i].Length;
+                packetHeader->packet[i].status = transfer->IsoPacket[first + i].Status;
             }
 
-            /* Obtain the USB_INTERFACE_DESCRIPTOR */
-            intInfo = &pSelectInterface->Interface;
+            /* Default to no data, will be changed later if data is to be attached to packet */
+            packetHeader->header.dataLength = 0;
+            payload[0].size = 0;
+            payload[0].buffer = NULL;
+
+            if ((hasData == TRUE) && (compact == TRUE))
+            {
+                ULONG  compactedOffset;
+
+                /* Loop through all the isoch packets in the transfer buffer
+                 * Store offset and length in payload entries array in a way
+                 * that there won't be gaps in the resulting packet.
+                 */
+                compactedOffset = 0;
+                for (i = 0; i < count; i++)
+                {
+                    /* Adjust the offsets */
+                    packetHeader->packet[i].offset = compactedOffset;
 
-            intDescriptor =
-                USBD_ParseConfigurationDescriptorEx(pDeviceData->descriptor,
-                                                    pDeviceData->descriptor,
-                                                    intInfo->InterfaceNumber,
-                                                    intInfo->AlternateSetting,
-                                                    -1,  /* Class */
-                                                    -1,  /* SubClass */
-                                                    -1); /* Protocol */
+                    if (transferBuffer != NULL)
+                    {
+                        payload[i].size = transfer->IsoPacket[first + i].Length;
+                        payload[i].buffer = &transferBuffer[transfer->IsoPacket[first + i].Offset];
+                        payload[i + 1].size = 0;
+                        payload[i + 1].buffer = NULL;
+                    }
+                    compactedOffset += transfer->IsoPacket[first + i].Length;
+                }
 
-            if (intDescriptor == NULL)
+                /* Compact the data to minimize the capture size */
+                packetHeader->header.dataLength = (UINT32)compactedOffset;
+            }
+            else if ((hasData == TRUE) && (captureOut == TRUE))
             {
-                /* Interface descriptor not found */
-                DkDbgStr("Failed to get interface descriptor");
-                break;
+                /* Boundaries were checked above */
+                USBPcapGetIsochChunk(transfer, first, count, FALSE,
+                                     &chunkStart, &dataLength);
+
+                /* Make the offsets relative to this record data */
+                for (i = 0; i < count; i++)
+                {
+                    packetHeader->packet[i].offset -= chunkStart;
+                }
+
+                if (transferBuffer != NULL)
+                {
+                    payload[0].size = dataLength;
+                    payload[0].buffer = &transferBuffer[chunkStart];
+                    payload[1].size = 0;
+                    payload[1].buffer = NULL;
+                }
+                packetHeader->header.dataLength = dataLength;
             }
 
-            wrapTransfer.PipeHandle = NULL; /* Default pipe handle */
-            wrapTransfer.TransferFlags = USBD_TRANSFER_DIRECTION_OUT;
-            wrapTransfer.TransferBufferLength = 0;
-            wrapTransfer.TransferBuffer = NULL;
-            wrapTransfer.TransferBufferMDL = NULL;
-            wrapTransfer.SetupPacket[0] = 0x00; /* Host to Device, Standard */
-            wrapTransfer.SetupPacket[1] = 0x0B; /* SET_INTERFACE */
-
-            wrapTransfer.SetupPacket[2] = intDescriptor->bAlternateSetting;
-            wrapTransfer.SetupPacket[3] = 0;
-            wrapTransfer.SetupPacket[4] = intDescriptor->bInterfaceNumber;
-            wrapTransfer.SetupPacket[5] = 0;
-            wrapTransfer.SetupPacket[6] = 0;
-            wrapTransfer.SetupPacket[7] = 0;
-
-            USBPcapAnalyzeControlTransfer(&wrapTransfer, header,
-                                          pDeviceData, pIrp, post);
-            break;
+            USBPcapBufferGroupWriteRecord(&group, timestamp,
+                                          (PUSBPCAP_BUFFER_PACKET_HEADER)packetHeader,
+                                          payload, maxDataLength);
+
+            first += count;
         }
+        while (first < transfer->NumberOfPackets);
+    }
 
-        case URB_FUNCTION_CONTROL_TRANSFER:
-        {
-            struct _URB_CONTROL_TRANSFER* transfer;
+    USBPcapBufferEndGroup(&group);
 
-            transfer = (struct _URB_CONTROL_TRANSFER*)pUrb;
+    if (temporaryScratch == TRUE)
+    {
+        ExFreePool((PVOID)scratch);
+    }
+}
 
-            DkDbgStr("URB_FUNCTION_CONTROL_TRANSFER");
-            USBPcapAnalyzeControlTransfer(transfer, header,
-                                          pDeviceData, pIrp, post);
+/*
+ * URB record builders
+ *
+ * Every builder is called with URB that is known to be of the function
+ * the builder was registered for in USBPcapInitializeURBDispatch().
+ */
+typedef VOID (*PUSBPCAP_URB_HANDLER)(PIRP pIrp,
+                                     PURB pUrb,
+                                     BOOLEAN post,
+                                     PUSBPCAP_DEVICE_DATA pDeviceData);
 
-            DkDbgVal("", transfer->PipeHandle);
-            USBPcapPrintChars("Setup Packet", &transfer->SetupPacket[0], 8);
-            if (transfer->TransferBuffer != NULL)
-            {
-                USBPcapPrintChars("Transfer Buffer",
-                                 transfer->TransferBuffer,
-                                 transfer->TransferBufferLength);
-            }
-            break;
-        }
+/* URB functions are small consecutive numbers, see usb.h */
+#define USBPCAP_URB_FUNCTION_TABLE_SIZE  0x40
+
+static PUSBPCAP_URB_HANDLER g_urbHandlers[USBPCAP_URB_FUNCTION_TABLE_SIZE];
+
+static VOID USBPcapAnalyzeSelectConfiguration(PIRP pIrp, PURB pUrb, BOOLEAN post,
+                                              PUSBPCAP_DEVICE_DATA pDeviceData)
+{
+    struct _URB_SELECT_CONFIGURATION *pSelectConfiguration;
+    USBPCAP_CONTROL_REQUEST           request;
+
+    pSelectConfiguration = (struct _URB_SELECT_CONFIGURATION*)pUrb;
+
+    request.pipeHandle = NULL; /* Default pipe handle */
+    request.transferFlags = USBD_TRANSFER_DIRECTION_OUT;
+    request.transferBufferLength = 0;
+    request.transferBuffer = NULL;
+    request.transferBufferMDL = NULL;
+    request.setupPacket[0] = 0x00; /* Host to Device, Standard */
+    request.setupPacket[1] = 0x09; /* SET_CONFIGURATION */
+    if (pSelectConfiguration->ConfigurationDescriptor == NULL)
+    {
+        request.setupPacket[2] = 0;
+    }
+    else
+    {
+        request.setupPacket[2] = pSelectConfiguration->ConfigurationDescriptor->bConfigurationValue;
+    }
+    request.setupPacket[3] = 0;
+    request.setupPacket[4] = 0;
+    request.setupPacket[5] = 0;
+    request.setupPacket[6] = 0;
+    request.setupPacket[7] = 0;
+
+    USBPcapAnalyzeControlTransfer(&request, &pUrb->UrbHeader,
+                                  pDeviceData, pIrp, post);
+}
+
+static VOID USBPcapAnalyzeSelectInterface(PIRP pIrp, PURB pUrb, BOOLEAN post,
+                                          PUSBPCAP_DEVICE_DATA pDeviceData)
+{
+    struct _URB_SELECT_INTERFACE *pSelectInterface;
+    USBPCAP_CONTROL_REQUEST       request;
+    PUSBD_INTERFACE_INFORMATION   intInfo;
+    PUSB_INTERFACE_DESCRIPTOR     intDescriptor;
+
+    pSelectInterface = (struct _URB_SELECT_INTERFACE*)pUrb;
+
+    if (pDeviceData->descriptor == NULL)
+    {
+        /* Won't log this URB */
+        DkDbgStr("No configuration descriptor");
+        return;
+    }
+
+    /* Obtain the USB_INTERFACE_DESCRIPTOR */
+    intInfo = &pSelectInterface->Interface;
+
+    intDescriptor =
+        USBD_ParseConfigurationDescriptorEx(pDeviceData->descriptor,
+                                            pDeviceData->descriptor,
+                                            intInfo->InterfaceNumber,
+                                            intInfo->AlternateSetting,
+                                            -1,  /* Class */
+                                            -1,  /* SubClass */
+                                            -1); /* Protocol */
+
+    if (intDescriptor == NULL)
+    {
+        /* Interface descriptor not found */
+        DkDbgStr("Failed to get interface descriptor");
+        return;
+    }
+
+    request.pipeHandle = NULL; /* Default pipe handle */
+    request.transferFlags = USBD_TRANSFER_DIRECTION_OUT;
+    request.transferBufferLength = 0;
+    request.transferBuffer = NULL;
+    request.transferBufferMDL = NULL;
+    request.setupPacket[0] = 0x00; /* Host to Device, Standard */
+    request.setupPacket[1] = 0x0B; /* SET_INTERFACE */
+
+    request.setupPacket[2] = intDescriptor->bAlternateSetting;
+    request.setupPacket[3] = 0;
+    request.setupPacket[4] = intDescriptor->bInterfaceNumber;
+    request.setupPacket[5] = 0;
+    request.setupPacket[6] = 0;
+    request.setupPacket[7] = 0;
+
+    USBPcapAnalyzeControlTransfer(&request, &pUrb->UrbHeader,
+                                  pDeviceData, pIrp, post);
+}
+
+static VOID USBPcapAnalyzeControl(PIRP pIrp, PURB pUrb, BOOLEAN post,
+                                  PUSBPCAP_DEVICE_DATA pDeviceData)
+{
+    struct _URB_CONTROL_TRANSFER* transfer;
+    USBPCAP_CONTROL_REQUEST       request;
+
+    transfer = (struct _URB_CONTROL_TRANSFER*)pUrb;
+
+    DkDbgStr("URB_FUNCTION_CONTROL_TRANSFER");
+
+    request.pipeHandle = transfer->PipeHandle;
+    request.transferFlags = transfer->TransferFlags;
+    request.transferBufferLength = transfer->TransferBufferLength;
+    request.transferBuffer = transfer->TransferBuffer;
+    request.transferBufferMDL = transfer->TransferBufferMDL;
+    RtlCopyMemory(&request.setupPacket[0],
+                  &transfer->SetupPacket[0],
+                  8 /* Setup packet is always 8 bytes */);
+
+    USBPcapAnalyzeControlTransfer(&request, &pUrb->UrbHeader,
+                                  pDeviceData, pIrp, post);
+
+    DkDbgVal("", transfer->PipeHandle);
+    USBPcapPrintChars("Setup Packet", &transfer->SetupPacket[0], 8);
+    if (transfer->TransferBuffer != NULL)
+    {
+        USBPcapPrintChars("Transfer Buffer",
+                         transfer->TransferBuffer,
+                         transfer->TransferBufferLength);
+    }
+}
 
 #if (_WIN32_WINNT >= 0x0600)
-        case URB_FUNCTION_CONTROL_TRANSFER_EX:
-        {
-            struct _URB_CONTROL_TRANSFER     wrapTransfer;
-            struct _URB_CONTROL_TRANSFER_EX* transfer;
+static VOID USBPcapAnalyzeControlEx(PIRP pIrp, PURB pUrb, BOOLEAN post,
+                                    PUSBPCAP_DEVICE_DATA pDeviceData)
+{
+    struct _URB_CONTROL_TRANSFER_EX* transfer;
+    USBPCAP_CONTROL_REQUEST          request;
 
-            transfer = (struct _URB_CONTROL_TRANSFER_EX*)pUrb;
+    transfer = (struct _URB_CONTROL_TRANSFER_EX*)pUrb;
 
-            DkDbgStr("URB_FUNCTION_CONTROL_TRANSFER_EX");
+    DkDbgStr("URB_FUNCTION_CONTROL_TRANSFER_EX");
 
-            /* Copy the required data to wrapTransfer */
-            wrapTransfer.PipeHandle = transfer->PipeHandle;
-            wrapTransfer.TransferFlags = transfer->TransferFlags;
-            wrapTransfer.TransferBufferLength = transfer->TransferBufferLength;
-            wrapTransfer.TransferBuffer = transfer->TransferBuffer;
-            wrapTransfer.TransferBufferMDL = transfer->TransferBufferMDL;
-            RtlCopyMemory(&wrapTransfer.SetupPacket[0],
-                          &transfer->SetupPacket[0],
-                          8 /* Setup packet is always 8 bytes */);
+    request.pipeHandle = transfer->PipeHandle;
+    request.transferFlags = transfer->TransferFlags;
+    request.transferBufferLength = transfer->TransferBufferLength;
+    request.transferBuffer = transfer->TransferBuffer;
+    request.transferBufferMDL = transfer->TransferBufferMDL;
+    RtlCopyMemory(&request.setupPacket[0],
+                  &transfer->SetupPacket[0],
+                  8 /* Setup packet is always 8 bytes */);
 
-            USBPcapAnalyzeControlTransfer(&wrapTransfer, header,
-                                          pDeviceData, pIrp, post);
+    USBPcapAnalyzeControlTransfer(&request, &pUrb->UrbHeader,
+                                  pDeviceData, pIrp, post);
 
-            DkDbgVal("", transfer->PipeHandle);
-            USBPcapPrintChars("Setup Packet", &transfer->SetupPacket[0], 8);
-            if (transfer->TransferBuffer != NULL)
-            {
-                USBPcapPrintChars("Transfer Buffer",
-                                  transfer->TransferBuffer,
-                                  transfer->TransferBufferLength);
-            }
-            break;
-        }
+    DkDbgVal("", transfer->PipeHandle);
+    USBPcapPrintChars("Setup Packet", &transfer->SetupPacket[0], 8);
+    if (transfer->TransferBuffer != NULL)
+    {
+        USBPcapPrintChars("Transfer Buffer",
+                          transfer->TransferBuffer,
+                          transfer->TransferBufferLength);
+    }
+}
 #endif
 
+static VOID USBPcapAnalyzeDescriptorRequest(PIRP pIrp, PURB pUrb, BOOLEAN post,
+                                            PUSBPCAP_DEVICE_DATA pDeviceData)
+{
+    struct _URB_CONTROL_DESCRIPTOR_REQUEST*  descRequest;
+    USBPCAP_CONTROL_REQUEST                  request;
+    USHORT                                   function;
+
+    descRequest = (struct _URB_CONTROL_DESCRIPTOR_REQUEST*)pUrb;
+    function = pUrb->UrbHeader.Function;
+
+    DkDbgVal("URB_FUNCTION_XXX_DESCRIPTOR", function);
+
+    request.pipeHandle = NULL; /* Default pipe handle */
+    switch (function)
+    {
         case URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE:
+            request.transferFlags = USBD_TRANSFER_DIRECTION_IN;
+            /* D7: Data from Device to Host (1)
+             * D6-D5: Standard (0)
+             * D4-D0: Device (0)
+             */
+            request.setupPacket[0] = 0x80;
+            /* 0x06 - GET_DESCRIPTOR */
+            request.setupPacket[1] = 0x06;
+            break;
         case URB_FUNCTION_GET_DESCRIPTOR_FROM_ENDPOINT:
+            request.transferFlags = USBD_TRANSFER_DIRECTION_IN;
+            /* D7: Data from Device to Host (1)
+             * D6-D5: Standard (0)
+             * D4-D0: Endpoint (2)
+             */
+            request.setupPacket[0] = 0x82;
+            /* 0x06 - GET_DESCRIPTOR */
+            request.setupPacket[1] = 0x06;
+            break;
         case URB_FUNCTION_GET_DESCRIPTOR_FROM_INTERFACE:
+            request.transferFlags = USBD_TRANSFER_DIRECTION_IN;
+            /* D7: Data from Device to Host (1)
+             * D6-D5: Standard (0)
+             * D4-D0: Interface (1)
+             */
+            request.setupPacket[0] = 0x81;
+            /* 0x06 - GET_DESCRIPTOR */
+            request.setupPacket[1] = 0x06;
+            break;
         case URB_FUNCTION_SET_DESCRIPTOR_TO_DEVICE:
+            request.transferFlags = USBD_TRANSFER_DIRECTION_OUT;
+            /* D7: Data from Host to Device (0)
+             * D6-D5: Standard (0)
+             * D4-D0: Device (0)
+             */
+            request.setupPacket[0] = 0x00;
+            /* 0x07 - SET_DESCRIPTOR */
+            request.setupPacket[1] = 0x07;
+            break;
         case URB_FUNCTION_SET_DESCRIPTOR_TO_ENDPOINT:
+            request.transferFlags = USBD_TRANSFER_DIRECTION_OUT;
+            /* D7: Data from Host to Device (0)
+             * D6-D5: Standard (0)
+             * D4-D0: Endpoint (2)
+             */
+            request.setupPacket[0] = 0x02;
+            /* 0x07 - SET_DESCRIPTOR */
+            request.setupPacket[1] = 0x07;
+            break;
         case URB_FUNCTION_SET_DESCRIPTOR_TO_INTERFACE:
-        {
-            struct _URB_CONTROL_TRANSFER             wrapTransfer;
-            struct _URB_CONTROL_DESCRIPTOR_REQUEST*  request;
+            request.transferFlags = USBD_TRANSFER_DIRECTION_OUT;
+            /* D7: Data from Host to Device (0)
+             * D6-D5: Standard (0)
+             * D4-D0: Interface (1)
+             */
+            request.setupPacket[0] = 0x01;
+            /* 0x07 - SET_DESCRIPTOR */
+            request.setupPacket[1] = 0x07;
+            break;
+        default:
+            DkDbgVal("Invalid function", function);
+            return;
+    }
+    request.setupPacket[2] = descRequest->Index;
+    request.setupPacket[3] = descRequest->DescriptorType;
+    request.setupPacket[4] = (descRequest->LanguageId & 0x00FF);
+    request.setupPacket[5] = (descRequest->LanguageId & 0xFF00) >> 8;
+    request.setupPacket[6] = (descRequest->TransferBufferLength & 0x00FF);
+    request.setupPacket[7] = (descRequest->TransferBufferLength & 0xFF00) >> 8;
+
+    request.transferBufferLength = descRequest->TransferBufferLength;
+    request.transferBuffer = descRequest->TransferBuffer;
+    request.transferBufferMDL = descRequest->TransferBufferMDL;
+
+    USBPcapAnalyzeControlTransfer(&request, &pUrb->UrbHeader,
+                                  pDeviceData, pIrp, post);
+}
 
-            request = (struct _URB_CONTROL_DESCRIPTOR_REQUEST*)pUrb;
+static VOID USBPcapAnalyzeGetStatus(PIRP pIrp, PURB pUrb, BOOLEAN post,
+                                    PUSBPCAP_DEVICE_DATA pDeviceData)
+{
+    struct _URB_CONTROL_GET_STATUS_REQUEST*  statusRequest;
+    USBPCAP_CONTROL_REQUEST                  request;
+    USHORT                                   function;
 
-            DkDbgVal("URB_FUNCTION_XXX_DESCRIPTOR", header->Function);
+    statusRequest = (struct _URB_CONTROL_GET_STATUS_REQUEST*)pUrb;
+    function = pUrb->UrbHeader.Function;
 
-            /* Set up wrapTransfer */
-            wrapTransfer.PipeHandle = NULL; /* Default pipe handle */
-            if (header->Function == URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE)
-            {
-                wrapTransfer.TransferFlags = USBD_TRANSFER_DIRECTION_IN;
-                /* D7: Data from Device to Host (1)
-                 * D6-D5: Standard (0)
-                 * D4-D0: Device (0)
-                 */
-                wrapTransfer.SetupPacket[0] = 0x80;
-                /* 0x06 - GET_DESCRIPTOR */
-                wrapTransfer.SetupPacket[1] = 0x06;
-            }
-            else if (header->Function == URB_FUNCTION_GET_DESCRIPTOR_FROM_ENDPOINT)
-            {
-                wrapTransfer.TransferFlags = USBD_TRANSFER_DIRECTION_IN;
-                /* D7: Data from Device to Host (1)
-                 * D6-D5: Standard (0)
-                 * D4-D0: Endpoint (2)
-                 */
-                wrapTransfer.SetupPacket[0] = 0x82;
-                /* 0x06 - GET_DESCRIPTOR */
-                wrapTransfer.SetupPacket[1] = 0x06;
-            }
-            else if (header->Function == URB_FUNCTION_GET_DESCRIPTOR_FROM_INTERFACE)
-            {
-                wrapTransfer.TransferFlags = USBD_TRANSFER_DIRECTION_IN;
-                /* D7: Data from Device to Host (1)
-                 * D6-D5: Standard (0)
-                 * D4-D0: Interface (1)
-                 */
-                wrapTransfer.SetupPacket[0] = 0x81;
-                /* 0x06 - GET_DESCRIPTOR */
-                wrapTransfer.SetupPacket[1] = 0x06;
-            }
-            else if (header->Function == URB_FUNCTION_SET_DESCRIPTOR_TO_DEVICE)
-            {
-                wrapTransfer.TransferFlags = USBD_TRANSFER_DIRECTION_OUT;
-                /* D7: Data from Host to Device (0)
-                 * D6-D5: Standard (0)
-                 * D4-D0: Device (0)
-                 */
-                wrapTransfer.SetupPacket[0] = 0x00;
-                /* 0x07 - SET_DESCRIPTOR */
-                wrapTransfer.SetupPacket[1] = 0x07;
-            }
-            else if (header->Function == URB_FUNCTION_SET_DESCRIPTOR_TO_ENDPOINT)
-            {
-                wrapTransfer.TransferFlags = USBD_TRANSFER_DIRECTION_OUT;
-                /* D7: Data from Host to Device (0)
-                 * D6-D5: Standard (0)
-                 * D4-D0: Endpoint (2)
-                 */
-                wrapTransfer.SetupPacket[0] = 0x02;
-                /* 0x07 - SET_DESCRIPTOR */
-                wrapTransfer.SetupPacket[1] = 0x07;
-            }
-            else if (header->Function == URB_FUNCTION_SET_DESCRIPTOR_TO_INTERFACE)
-            {
-                wrapTransfer.TransferFlags = USBD_TRANSFER_DIRECTION_OUT;
-                /* D7: Data from Host to Device (0)
-                 * D6-D5: Standard (0)
-                 * D4-D0: Interface (1)
-                 */
-                wrapTransfer.SetupPacket[0] = 0x01;
-                /* 0x07 - SET_DESCRIPTOR */
-                wrapTransfer.SetupPacket[1] = 0x07;
-            }
-            else
-            {
-                DkDbgVal("Invalid function", header->Function);
-                break;
-            }
-            wrapTransfer.SetupPacket[2] = request->Index;
-            wrapTransfer.SetupPacket[3] = request->DescriptorType;
-            wrapTransfer.SetupPacket[4] = (request->LanguageId & 0x00FF);
-            wrapTransfer.SetupPacket[5] = (request->LanguageId & 0xFF00) >> 8;
-            wrapTransfer.SetupPacket[6] = (request->TransferBufferLength & 0x00FF);
-            wrapTransfer.SetupPacket[7] = (request->TransferBufferLength & 0xFF00) >> 8;
-
-            wrapTransfer.TransferBufferLength = request->TransferBufferLength;
-            wrapTransfer.TransferBuffer = request->TransferBuffer;
-            wrapTransfer.TransferBufferMDL = request->TransferBufferMDL;
-
-            USBPcapAnalyzeControlTransfer(&wrapTransfer, header,
-                                          pDeviceData, pIrp, post);
-            break;
-        }
+    DkDbgVal("URB_FUNCTION_GET_STATUS_FROM_XXX", function);
 
+    request.pipeHandle = NULL; /* Default pipe handle */
+    request.transferFlags = USBD_TRANSFER_DIRECTION_IN;
+
+    switch (function)
+    {
         case URB_FUNCTION_GET_STATUS_FROM_DEVICE:
+            /* D7: Data from Device to Host (1)
+             * D6-D5: Standard (0)
+             * D4-D0: Device (0)
+             */
+            request.setupPacket[0] = 0x80;
+            break;
         case URB_FUNCTION_GET_STATUS_FROM_INTERFACE:
+            /* D7: Data from Device to Host (1)
+             * D6-D5: Standard (0)
+             * D4-D0: Interface (1)
+             */
+            request.setupPacket[0] = 0x81;
+            break;
         case URB_FUNCTION_GET_STATUS_FROM_ENDPOINT:
+            /* D7: Data from Device to Host (1)
+             * D6-D5: Standard (0)
+             * D4-D0: Endpoint (2)
+             */
+            request.setupPacket[0] = 0x82;
+            break;
         case URB_FUNCTION_GET_STATUS_FROM_OTHER:
-        {
-            struct _URB_CONTROL_TRANSFER             wrapTransfer;
-            struct _URB_CONTROL_GET_STATUS_REQUEST*  request;
+            /* D7: Data from Device to Host (1)
+             * D6-D5: Standard (0)
+             * D4-D0: Other (3)
+             */
+            request.setupPacket[0] = 0x83;
+            break;
+        default:
+            DkDbgVal("Invalid function", function);
+            return;
+    }
 
-            request = (struct _URB_CONTROL_GET_STATUS_REQUEST*)pUrb;
+    /* 0x00 - GET_STATUS */
+    request.setupPacket[1] = 0x00;
+    /* wValue is Zero */
+    request.setupPacket[2] = 0;
+    request.setupPacket[3] = 0;
+    /* wIndex */
+    request.setupPacket[4] = (statusRequest->Index & 0x00FF);
+    request.setupPacket[5] = (statusRequest->Index & 0xFF00) >> 8;
+    /* wLength must be 2 */
+    request.setupPacket[6] = (statusRequest->TransferBufferLength & 0x00FF);
+    request.setupPacket[7] = (statusRequest->TransferBufferLength & 0xFF00) >> 8;
+
+    request.transferBufferLength = statusRequest->TransferBufferLength;
+    request.transferBuffer = statusRequest->TransferBuffer;
+    request.transferBufferMDL = statusRequest->TransferBufferMDL;
+
+    USBPcapAnalyzeControlTransfer(&request, &pUrb->UrbHeader,
+                                  pDeviceData, pIrp, post);
+}
 
-            DkDbgVal("URB_FUNCTION_GET_STATUS_FROM_XXX", header->Function);
+static VOID USBPcapAnalyzeVendorOrClass(PIRP pIrp, PURB pUrb, BOOLEAN post,
+                                        PUSBPCAP_DEVICE_DATA pDeviceData)
+{
+    struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST*  vcRequest;
+    USBPCAP_CONTROL_REQUEST                       request;
+    USHORT                                        function;
 
-            /* Set up wrapTransfer */
-            wrapTransfer.PipeHandle = NULL; /* Default pipe handle */
-            wrapTransfer.TransferFlags = USBD_TRANSFER_DIRECTION_IN;
+    vcRequest = (struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST*)pUrb;
+    function = pUrb->UrbHeader.Function;
 
-            if (header->Function == URB_FUNCTION_GET_STATUS_FROM_DEVICE)
-            {
-                /* D7: Data from Device to Host (1)
-                 * D6-D5: Standard (0)
-                 * D4-D0: Device (0)
-                 */
-                wrapTransfer.SetupPacket[0] = 0x80;
-            }
-            else if (header->Function == URB_FUNCTION_GET_STATUS_FROM_INTERFACE)
-            {
-                /* D7: Data from Device to Host (1)
-                 * D6-D5: Standard (0)
-                 * D4-D0: Interface (1)
-                 */
-                wrapTransfer.SetupPacket[0] = 0x81;
-            }
-            else if (header->Function == URB_FUNCTION_GET_STATUS_FROM_ENDPOINT)
-            {
-                /* D7: Data from Device to Host (1)
-                 * D6-D5: Standard (0)
-                 * D4-D0: Endpoint (2)
-                 */
-                wrapTransfer.SetupPacket[0] = 0x82;
-            }
-            else if (header->Function == URB_FUNCTION_GET_STATUS_FROM_OTHER)
-            {
-                /* D7: Data from Device to Host (1)
-                 * D6-D5: Standard (0)
-                 * D4-D0: Other (3)
-                 */
-                wrapTransfer.SetupPacket[0] = 0x83;
-            }
-            else
-            {
-                DkDbgVal("Invalid function", header->Function);
-                break;
-            }
+    DkDbgVal("URB_FUNCTION_VENDOR_XXX/URB_FUNCTION_CLASS_XXX", function);
 
-            /* 0x00 - GET_STATUS */
-            wrapTransfer.SetupPacket[1] = 0x00;
-            /* wValue is Zero */
-            wrapTransfer.SetupPacket[2] = 0;
-            wrapTransfer.SetupPacket[3] = 0;
-            /* wIndex */
-            wrapTransfer.SetupPacket[4] = (request->Index & 0x00FF);
-            wrapTransfer.SetupPacket[5] = (request->Index & 0xFF00) >> 8;
-            /* wLength must be 2 */
-            wrapTransfer.SetupPacket[6] = (request->TransferBufferLength & 0x00FF);
-            wrapTransfer.SetupPacket[7] = (request->TransferBufferLength & 0xFF00) >> 8;
-
-            wrapTransfer.TransferBufferLength = request->TransferBufferLength;
-            wrapTransfer.TransferBuffer = request->TransferBuffer;
-            wrapTransfer.TransferBufferMDL = request->TransferBufferMDL;
-
-            USBPcapAnalyzeControlTransfer(&wrapTransfer, header,
-                                          pDeviceData, pIrp, post);
-            break;
-        }
+    request.pipeHandle = NULL; /* Default pipe handle */
+    request.transferFlags = vcRequest->TransferFlags;
+    request.transferBufferLength = vcRequest->TransferBufferLength;
+    request.transferBuffer = vcRequest->TransferBuffer;
+    request.transferBufferMDL = vcRequest->TransferBufferMDL;
 
+    /* Set up D6-D0 of Request Type based on Function
+     * D7 (Data Stage direction) will be set later
+     */
+    switch (function)
+    {
         case URB_FUNCTION_VENDOR_DEVICE:
+            /* D4-D0: Device (0)
+             * D6-D5: Vendor (2)
+             */
+            request.setupPacket[0] = 0x40;
+            break;
         case URB_FUNCTION_VENDOR_INTERFACE:
+            /* D4-D0: Interface (1)
+             * D6-D5: Vendor (2)
+             */
+            request.setupPacket[0] = 0x41;
+            break;
         case URB_FUNCTION_VENDOR_ENDPOINT:
+            /* D4-D0: Endpoint (2)
+             * D6-D5: Vendor (2)
+             */
+            request.setupPacket[0] = 0x42;
+            break;
         case URB_FUNCTION_VENDOR_OTHER:
+            /* D4-D0: Other (3)
+             * D6-D5: Vendor (2)
+             */
+            request.setupPacket[0] = 0x43;
+            break;
         case URB_FUNCTION_CLASS_DEVICE:
+            /* D4-D0: Device (0)
+             * D6-D5: Class (1)
+             */
+            request.setupPacket[0] = 0x20;
+            break;
         case URB_FUNCTION_CLASS_INTERFACE:
+            /* D4-D0: Interface (1)
+             * D6-D5: Class (1)
+             */
+            request.setupPacket[0] = 0x21;
+            break;
         case URB_FUNCTION_CLASS_ENDPOINT:
+            /* D4-D0: Endpoint (2)
+             * D6-D5: Class (1)
+             */
+            request.setupPacket[0] = 0x22;
+            break;
         case URB_FUNCTION_CLASS_OTHER:
-        {
-            struct _URB_CONTROL_TRANSFER                  wrapTransfer;
-            struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST*  request;
+            /* D4-D0: Other (3)
+             * D6-D5: Class (1)
+             */
+            request.setupPacket[0] = 0x23;
+            break;
+        default:
+            DkDbgVal("Invalid function", function);
+            return;
+    }
 
-            request = (struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST*)pUrb;
+    if (vcRequest->TransferFlags & USBD_TRANSFER_DIRECTION_IN)
+    {
+        /* Set D7: Request data from device */
+        request.setupPacket[0] |= 0x80;
+    }
 
-            DkDbgVal("URB_FUNCTION_VENDOR_XXX/URB_FUNCTION_CLASS_XXX",
-                     header->Function);
+    request.setupPacket[1] = vcRequest->Request;
+    request.setupPacket[2] = (vcRequest->Value & 0x00FF);
+    request.setupPacket[3] = (vcRequest->Value & 0xFF00) >> 8;
+    request.setupPacket[4] = (vcRequest->Index & 0x00FF);
+    request.setupPacket[5] = (vcRequest->Index & 0xFF00) >> 8;
+    request.setupPacket[6] = (vcRequest->TransferBufferLength & 0x00FF);
+    request.setupPacket[7] = (vcRequest->TransferBufferLength & 0xFF00) >> 8;
 
-            wrapTransfer.PipeHandle = NULL; /* Default pipe handle */
-            wrapTransfer.TransferFlags = request->TransferFlags;
-            wrapTransfer.TransferBufferLength = request->TransferBufferLength;
-            wrapTransfer.TransferBuffer = request->TransferBuffer;
-            wrapTransfer.TransferBufferMDL = request->TransferBufferMDL;
+    USBPcapAnalyzeControlTransfer(&request, &pUrb->UrbHeader,
+                                  pDeviceData, pIrp, post);
+}
 
-            /* Set up D6-D0 of Request Type based on Function
-             * D7 (Data Stage direction) will be set later
-             */
-            switch (header->Function)
-            {
-                case URB_FUNCTION_VENDOR_DEVICE:
-                    /* D4-D0: Device (0)
-                     * D6-D5: Vendor (2)
-                     */
-                    wrapTransfer.SetupPacket[0] = 0x40;
-                    break;
-                case URB_FUNCTION_VENDOR_INTERFACE:
-                    /* D4-D0: Interface (1)
-                     * D6-D5: Vendor (2)
-                     */
-                    wrapTransfer.SetupPacket[0] = 0x41;
-                    break;
-                case URB_FUNCTION_VENDOR_ENDPOINT:
-                    /* D4-D0: Endpoint (2)
-                     * D6-D5: Vendor (2)
-                     */
-                    wrapTransfer.SetupPacket[0] = 0x42;
-                    break;
-                case URB_FUNCTION_VENDOR_OTHER:
-                    /* D4-D0: Other (3)
-                     * D6-D5: Vendor (2)
-                     */
-                    wrapTransfer.SetupPacket[0] = 0x43;
-                    break;
-                case URB_FUNCTION_CLASS_DEVICE:
-                    /* D4-D0: Device (0)
-                     * D6-D5: Class (1)
-                     */
-                    wrapTransfer.SetupPacket[0] = 0x20;
-                    break;
-                case URB_FUNCTION_CLASS_INTERFACE:
-                    /* D4-D0: Interface (1)
-                     * D6-D5: Class (1)
-                     */
-                    wrapTransfer.SetupPacket[0] = 0x21;
-                    break;
-                case URB_FUNCTION_CLASS_ENDPOINT:
-                    /* D4-D0: Endpoint (2)
-                     * D6-D5: Class (1)
-                     */
-                    wrapTransfer.SetupPacket[0] = 0x22;
-                    break;
-                case URB_FUNCTION_CLASS_OTHER:
-                    /* D4-D0: Other (3)
-                     * D6-D5: Class (1)
-                     */
-                    wrapTransfer.SetupPacket[0] = 0x23;
-                    break;
-                default:
-                    DkDbgVal("Invalid function", header->Function);
-                    break;
-            }
+static VOID USBPcapAnalyzeBulkOrInterrupt(PIRP pIrp, PURB pUrb, BOOLEAN post,
+                                          PUSBPCAP_DEVICE_DATA pDeviceData)
+{
+    struct _URB_BULK_OR_INTERRUPT_TRANSFER  *transfer;
+    USBPCAP_ENDPOINT_INFO                   info;
+    BOOLEAN                                 epFound;
+    USBPCAP_BUFFER_RECORD                   record;
+    PUSBPCAP_BUFFER_PACKET_HEADER           packetHeader;
+    PVOID                                   transferBuffer;
+    UINT32                                  dataLength;
+    UINT32                                  maxDataLength;
+    USHORT                                  device;
+    UCHAR                                   endpoint;
+    UCHAR                                   transferType;
+
+    transfer = (struct _URB_BULK_OR_INTERRUPT_TRANSFER*)pUrb;
+
+    DkDbgStr("URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER");
+    DkDbgVal("", transfer->PipeHandle);
+    epFound = USBPcapRetrieveEndpointInfo(pDeviceData,
+                                          transfer->PipeHandle,
+                                          &info);
+    if (epFound == TRUE)
+    {
+        device = info.deviceAddress;
+        endpoint = info.endpointAddress;
 
-            if (request->TransferFlags & USBD_TRANSFER_DIRECTION_IN)
-            {
-                /* Set D7: Request data from device */
-                wrapTransfer.SetupPacket[0] |= 0x80;
-            }
+        switch (info.type)
+        {
+            case UsbdPipeTypeInterrupt:
+                transferType = USBPCAP_TRANSFER_INTERRUPT;
+                break;
+            default:
+                DkDbgVal("Invalid pipe type. Assuming bulk.",
+                         info.type);
+                /* Fall through */
+            case UsbdPipeTypeBulk:
+                transferType = USBPCAP_TRANSFER_BULK;
+                break;
+        }
+    }
+    else
+    {
+        device = pDeviceData->deviceAddress;
+        endpoint = 0xFF;
+        transferType = USBPCAP_TRANSFER_BULK;
+    }
 
-            wrapTransfer.SetupPacket[1] = request->Request;
-            wrapTransfer.SetupPacket[2] = (request->Value & 0x00FF);
-            wrapTransfer.SetupPacket[3] = (request->Value & 0xFF00) >> 8;
-            wrapTransfer.SetupPacket[4] = (request->Index & 0x00FF);
-            wrapTransfer.SetupPacket[5] = (request->Index & 0xFF00) >> 8;
-            wrapTransfer.SetupPacket[6] = (request->TransferBufferLength & 0x00FF);
-            wrapTransfer.SetupPacket[7] = (request->TransferBufferLength & 0xFF00) >> 8;
+    if (USBPcapIsEndpointCaptured(pDeviceData->pRootData,
+                                  (int)device, endpoint,
+                                  transferType) == FALSE)
+    {
+        return;
+    }
 
-            USBPcapAnalyzeControlTransfer(&wrapTransfer, header,
-                                          pDeviceData, pIrp, post);
-            break;
+    /* For IN endpoints, add data to log only when post = TRUE,
+     * For OUT endpoints, add data to log only when post = FALSE
+     */
+    dataLength = 0;
+    maxDataLength = MAXULONG;
+    transferBuffer = NULL;
+    if (((endpoint & 0x80) && (post == TRUE)) ||
+        (!(endpoint & 0x80) && (post == FALSE)))
+    {
+        if (pDeviceData->pRootData->captureFlags & USBPCAP_CAPTURE_HEADER_ONLY)
+        {
+            /* Never map the transfer buffer */
+            dataLength = (UINT32)transfer->TransferBufferLength;
+            maxDataLength = 0;
         }
-
-        case URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER:
+        else
         {
-            struct _URB_BULK_OR_INTERRUPT_TRANSFER  *transfer;
-            USBPCAP_ENDPOINT_INFO                   info;
-            BOOLEAN                                 epFound;
-            USBPCAP_BUFFER_PACKET_HEADER            packetHeader;
-            PVOID                                   transferBuffer;
-
-            packetHeader.headerLen = sizeof(USBPCAP_BUFFER_PACKET_HEADER);
-            packetHeader.irpId     = (UINT64) pIrp;
-            packetHeader.status    = header->Status;
-            packetHeader.function  = header->Function;
-            packetHeader.info      = 0;
-            if (post == TRUE)
+            transferBuffer =
+                USBPcapURBGetBufferPointer(transfer->TransferBufferLength,
+                                           transfer->TransferBuffer,
+                                           transfer->TransferBufferMDL);
+            if (transferBuffer != NULL)
             {
-                packetHeader.info |= USBPCAP_INFO_PDO_TO_FDO;
+                dataLength = (UINT32)transfer->TransferBufferLength;
             }
+        }
+    }
 
-            packetHeader.bus      = pDeviceData->pRootData->busId;
+    /* Header is filled directly in the space reserved in the buffer */
+    if (NT_SUCCESS(USBPcapBufferBeginRecord(pDeviceData->pRootData,
+                                            USBPcapGetCurrentTimestamp(),
+                                            sizeof(USBPCAP_BUFFER_PACKET_HEADER),
+                                            dataLength,
+                                            device,
+                                            endpoint,
+                                            transferType,
+                                            maxDataLength,
+                                            &record)))
+    {
+        packetHeader = record.header;
+        USBPcapInitializePacketHeader(packetHeader,
+                                      sizeof(USBPCAP_BUFFER_PACKET_HEADER),
+                                      &pUrb->UrbHeader, pDeviceData, pIrp, post);
+        packetHeader->device     = device;
+        packetHeader->endpoint   = endpoint;
+        packetHeader->transfer   = transferType;
+        packetHeader->dataLength = dataLength;
+
+        USBPcapBufferRecordWriteData(&record, transferBuffer, dataLength);
+        USBPcapBufferEndRecord(&record);
+    }
 
-            transfer = (struct _URB_BULK_OR_INTERRUPT_TRANSFER*)pUrb;
+    DkDbgVal("", transfer->TransferFlags);
+    DkDbgVal("", transfer->TransferBufferLength);
+    DkDbgVal("", transfer->TransferBuffer);
+    DkDbgVal("", transfer->TransferBufferMDL);
+    if (transfer->TransferBuffer != NULL)
+    {
+        USBPcapPrintChars("Transfer Buffer",
+                          transfer->TransferBuffer,
+                          transfer->TransferBufferLength);
+    }
+}
 
-            DkDbgStr("URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER");
-            DkDbgVal("", transfer->PipeHandle);
-            epFound = USBPcapRetrieveEndpointInfo(pDeviceData,
-                                                  transfer->PipeHandle,
-                                                  &info);
-            if (epFound == TRUE)
-            {
-                packetHeader.device = info.deviceAddress;
-                packetHeader.endpoint = info.endpointAddress;
+static VOID USBPcapAnalyzeIsoch(PIRP pIrp, PURB pUrb, BOOLEAN post,
+                                PUSBPCAP_DEVICE_DATA pDeviceData)
+{
+    KIRQL  irql;
 
-                switch (info.type)
-                {
-                    case UsbdPipeTypeInterrupt:
-                        packetHeader.transfer = USBPCAP_TRANSFER_INTERRUPT;
-                        break;
-                    default:
-                        DkDbgVal("Invalid pipe type. Assuming bulk.",
-                                 info.type);
-                        /* Fall through */
-                    case UsbdPipeTypeBulk:
-                        packetHeader.transfer = USBPCAP_TRANSFER_BULK;
-                        break;
-                }
-            }
-            else
-            {
-                packetHeader.device = pDeviceData->deviceAddress;
-                packetHeader.endpoint = 0xFF;
-                packetHeader.transfer = USBPCAP_TRANSFER_BULK;
-            }
+    DkDbgStr("URB_FUNCTION_ISOCH_TRANSFER");
 
-            /* For IN endpoints, add data to log only when post = TRUE,
-             * For OUT endpoints, add data to log only when post = FALSE
-             */
-            if (((packetHeader.endpoint & 0x80) && (post == TRUE)) ||
-                (!(packetHeader.endpoint & 0x80) && (post == FALSE)))
-            {
-                packetHeader.dataLength = (UINT32)transfer->TransferBufferLength;
+    /* Per-processor scratch space can be used only when the thread
+     * cannot be preempted.
+     */
+    KeRaiseIrql(DISPATCH_LEVEL, &irql);
+    USBPcapAnalyzeIsochTransfer((struct _URB_ISOCH_TRANSFER*)pUrb,
+                                &pUrb->UrbHeader, pDeviceData, pIrp, post);
+    KeLowerIrql(irql);
+}
 
-                transferBuffer =
-                    USBPcapURBGetBufferPointer(transfer->TransferBufferLength,
-                                               transfer->TransferBuffer,
-                                               transfer->TransferBufferMDL);
+static VOID USBPcapAnalyzePipeRequest(PIRP pIrp, PURB pUrb, BOOLEAN post,
+                                      PUSBPCAP_DEVICE_DATA pDeviceData)
+{
+    struct _URB_PIPE_REQUEST      *request;
+    USBPCAP_BUFFER_PACKET_HEADER   packetHeader;
+    USBPCAP_ENDPOINT_INFO          info;
+    BOOLEAN                        epFound;
+
+    USBPcapInitializePacketHeader(&packetHeader,
+                                  sizeof(USBPCAP_BUFFER_PACKET_HEADER),
+                                  &pUrb->UrbHeader, pDeviceData, pIrp, post);
+    packetHeader.transfer   = USBPCAP_TRANSFER_IRP_INFO;
+    packetHeader.dataLength = 0;
+
+    request = (struct _URB_PIPE_REQUEST*)pUrb;
+
+    DkDbgVal("URB PIPE REQUEST", request->PipeHandle);
+    epFound = USBPcapRetrieveEndpointInfo(pDeviceData,
+                                          request->PipeHandle,
+                                          &info);
+    if (epFound == TRUE)
+    {
+        packetHeader.device = info.deviceAddress;
+        packetHeader.endpoint = info.endpointAddress;
+    }
+    else
+    {
+        packetHeader.endpoint = 0xFF;
+        packetHeader.transfer = USBPCAP_TRANSFER_UNKNOWN;
+    }
+
+    if (USBPcapIsEndpointCaptured(pDeviceData->pRootData,
+                                  (int)packetHeader.device,
+                                  packetHeader.endpoint,
+                                  packetHeader.transfer) == FALSE)
+    {
+        return;
+    }
+
+    USBPcapBufferWritePacket(pDeviceData->pRootData,
+                             &packetHeader,
+                             NULL);
+}
+
+static VOID USBPcapAnalyzeFrameNumber(PIRP pIrp, PURB pUrb, BOOLEAN post,
+                                      PUSBPCAP_DEVICE_DATA pDeviceData)
+{
+    struct _URB_GET_CURRENT_FRAME_NUMBER  *request;
+    USBPCAP_BUFFER_PACKET_HEADER           packetHeader;
+    UINT32                                 frameNum;
+
+    request = (struct _URB_GET_CURRENT_FRAME_NUMBER*)pUrb;
+
+    USBPcapInitializePacketHeader(&packetHeader,
+                                  sizeof(USBPCAP_BUFFER_PACKET_HEADER),
+                                  &pUrb->UrbHeader, pDeviceData, pIrp, post);
+    packetHeader.endpoint   = 0x80;
+    packetHeader.transfer   = USBPCAP_TRANSFER_IRP_INFO;
+    packetHeader.dataLength = 0;
+
+    if (post == TRUE)
+    {
+        frameNum = request->FrameNumber;
+        packetHeader.dataLength = sizeof(frameNum);
+    }
+
+    USBPcapBufferWritePacket(pDeviceData->pRootData,
+                             &packetHeader,
+                             &frameNum);
+}
+
+static VOID USBPcapAnalyzeUnknown(PIRP pIrp, PURB pUrb, BOOLEAN post,
+                                  PUSBPCAP_DEVICE_DATA pDeviceData)
+{
+    struct _URB_HEADER  *header;
+
+    header = &pUrb->UrbHeader;
+
+    if (post == FALSE)
+    {
+        KIRQL irql;
+        USBPCAP_URB_IRP_INFO info;
+        ULONG evicted;
+
+        /* Record unknown URB function to table.
+         * Some of the unknown URB change to control transfer on its way back
+         * from the PDO to FDO.
+         */
+        DkDbgVal("Recording unknown URB type in URB IRP table", header->Function);
+
+        info.irp = pIrp;
+        info.timestamp = USBPcapGetCurrentTimestamp();
+        info.status = header->Status;
+        info.function = header->Function;
+        info.info = 0;
+        info.bus = pDeviceData->pRootData->busId;
+        info.device = pDeviceData->deviceAddress;
+
+        KeAcquireSpinLock(&pDeviceData->tablesSpinLock, &irql);
+        evicted = USBPcapAddURBIRPInfo(pDeviceData->URBIrpTable, &info);
+        KeReleaseSpinLock(&pDeviceData->tablesSpinLock, irql);
+
+        if (evicted != 0)
+        {
+            InterlockedExchangeAdd(&pDeviceData->pRootData->irpInfoEvicted,
+                                   (LONG)evicted);
+        }
+    }
+    else /* if (post == TRUE) */
+    {
+        USBPCAP_BUFFER_PACKET_HEADER  packetHeader;
+
+        DkDbgVal("Unknown URB type", header->Function);
+
+        USBPcapInitializePacketHeader(&packetHeader,
+                                      sizeof(USBPCAP_BUFFER_PACKET_HEADER),
+                                      header, pDeviceData, pIrp, post);
+        packetHeader.endpoint   = 0;
+        packetHeader.transfer   = USBPCAP_TRANSFER_UNKNOWN;
+        packetHeader.dataLength = 0;
+
+        USBPcapBufferWritePacket(pDeviceData->pRootData, &packetHeader, NULL);
+    }
+}
+
+/*
+ * Fills the URB function dispatch table.
+ *
+ * Must be called before any URB is analyzed.
+ */
+VOID USBPcapInitializeURBDispatch(VOID)
+{
+    ULONG i;
+
+    for (i = 0; i < USBPCAP_URB_FUNCTION_TABLE_SIZE; i++)
+    {
+        g_urbHandlers[i] = USBPcapAnalyzeUnknown;
+    }
+
+    g_urbHandlers[URB_FUNCTION_SELECT_CONFIGURATION] = USBPcapAnalyzeSelectConfiguration;
+    g_urbHandlers[URB_FUNCTION_SELECT_INTERFACE]     = USBPcapAnalyzeSelectInterface;
+
+    g_urbHandlers[URB_FUNCTION_CONTROL_TRANSFER]     = USBPcapAnalyzeControl;
+#if (_WIN32_WINNT >= 0x0600)
+    g_urbHandlers[URB_FUNCTION_CONTROL_TRANSFER_EX]  = USBPcapAnalyzeControlEx;
+#endif
+
+    g_urbHandlers[URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE] =
+        g_urbHandlers[URB_FUNCTION_GET_DESCRIPTOR_FROM_ENDPOINT] =
+        g_urbHandlers[URB_FUNCTION_GET_DESCRIPTOR_FROM_INTERFACE] =
+        g_urbHandlers[URB_FUNCTION_SET_DESCRIPTOR_TO_DEVICE] =
+        g_urbHandlers[URB_FUNCTION_SET_DESCRIPTOR_TO_ENDPOINT] =
+        g_urbHandlers[URB_FUNCTION_SET_DESCRIPTOR_TO_INTERFACE] = USBPcapAnalyzeDescriptorRequest;
+
+    g_urbHandlers[URB_FUNCTION_GET_STATUS_FROM_DEVICE] =
+        g_urbHandlers[URB_FUNCTION_GET_STATUS_FROM_INTERFACE] =
+        g_urbHandlers[URB_FUNCTION_GET_STATUS_FROM_ENDPOINT] =
+        g_urbHandlers[URB_FUNCTION_GET_STATUS_FROM_OTHER] = USBPcapAnalyzeGetStatus;
+
+    g_urbHandlers[URB_FUNCTION_VENDOR_DEVICE] =
+        g_urbHandlers[URB_FUNCTION_VENDOR_INTERFACE] =
+        g_urbHandlers[URB_FUNCTION_VENDOR_ENDPOINT] =
+        g_urbHandlers[URB_FUNCTION_VENDOR_OTHER] =
+        g_urbHandlers[URB_FUNCTION_CLASS_DEVICE] =
+        g_urbHandlers[URB_FUNCTION_CLASS_INTERFACE] =
+        g_urbHandlers[URB_FUNCTION_CLASS_ENDPOINT] =
+        g_urbHandlers[URB_FUNCTION_CLASS_OTHER] = USBPcapAnalyzeVendorOrClass;
+
+    g_urbHandlers[URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER] = USBPcapAnalyzeBulkOrInterrupt;
+    g_urbHandlers[URB_FUNCTION_ISOCH_TRANSFER]             = USBPcapAnalyzeIsoch;
+
+    g_urbHandlers[URB_FUNCTION_SYNC_RESET_PIPE_AND_CLEAR_STALL] =
+        g_urbHandlers[URB_FUNCTION_SYNC_RESET_PIPE] =
+        g_urbHandlers[URB_FUNCTION_SYNC_CLEAR_STALL] =
+        g_urbHandlers[URB_FUNCTION_ABORT_PIPE] = USBPcapAnalyzePipeRequest;
+#if (_WIN32_WINNT >= 0x0602)
+    g_urbHandlers[URB_FUNCTION_CLOSE_STATIC_STREAMS] = USBPcapAnalyzePipeRequest;
+#endif
+
+    g_urbHandlers[URB_FUNCTION_GET_CURRENT_FRAME_NUMBER] = USBPcapAnalyzeFrameNumber;
+}
+
+/*
+ * Retrieves endpoint address, transfer type and transfer buffer length of
+ * URB. Requests that do not target particular pipe are reported as
+ * control transfers to endpoint 0.
+ *
+ * Returns FALSE if URB does not carry transfer buffer.
+ */
+static BOOLEAN USBPcapGetURBTransfer(PURB pUrb,
+                                     PUSBPCAP_DEVICE_DATA pDeviceData,
+                                     PUCHAR endpoint,
+                                     PUCHAR transferType,
+                                     PULONG length)
+{
+    USBD_PIPE_HANDLE       pipeHandle = NULL;
+    ULONG                  transferFlags = 0;
+    BOOLEAN                hasBuffer = TRUE;
+
+    *endpoint = 0;
+    *transferType = USBPCAP_TRANSFER_CONTROL;
+    *length = 0;
+
+    switch (pUrb->UrbHeader.Function)
+    {
+        case URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER:
+            pipeHandle = pUrb->UrbBulkOrInterruptTransfer.PipeHandle;
+            *length = pUrb->UrbBulkOrInterruptTransfer.TransferBufferLength;
+            *transferType = USBPCAP_TRANSFER_BULK;
+            break;
+
+        case URB_FUNCTION_ISOCH_TRANSFER:
+            pipeHandle = pUrb->UrbIsochronousTransfer.PipeHandle;
+            *length = pUrb->UrbIsochronousTransfer.TransferBufferLength;
+            *transferType = USBPCAP_TRANSFER_ISOCHRONOUS;
+            break;
+
+        case URB_FUNCTION_CONTROL_TRANSFER:
+#if (_WIN32_WINNT >= 0x0600)
+        case URB_FUNCTION_CONTROL_TRANSFER_EX:
+#endif
+            /* _URB_CONTROL_TRANSFER_EX shares the layout up to buffer length */
+            transferFlags = pUrb->UrbControlTransfer.TransferFlags;
+            if (!(transferFlags & USBD_DEFAULT_PIPE_TRANSFER))
+            {
+                pipeHandle = pUrb->UrbControlTransfer.PipeHandle;
             }
-            else
+            *length = pUrb->UrbControlTransfer.TransferBufferLength;
+            if (transferFlags & USBD_TRANSFER_DIRECTION_IN)
             {
-                packetHeader.dataLength = 0;
-                transferBuffer = NULL;
+                *endpoint = 0x80;
             }
+            break;
 
-            USBPcapBufferWritePacket(pDeviceData->pRootData,
-                                     &packetHeader,
-                                     transferBuffer);
-
-            DkDbgVal("", transfer->TransferFlags);
-            DkDbgVal("", transfer->TransferBufferLength);
-            DkDbgVal("", transfer->TransferBuffer);
-            DkDbgVal("", transfer->TransferBufferMDL);
-            if (transfer->TransferBuffer != NULL)
+        case URB_FUNCTION_VENDOR_DEVICE:
+        case URB_FUNCTION_VENDOR_INTERFACE:
+        case URB_FUNCTION_VENDOR_ENDPOINT:
+        case URB_FUNCTION_VENDOR_OTHER:
+        case URB_FUNCTION_CLASS_DEVICE:
+        case URB_FUNCTION_CLASS_INTERFACE:
+        case URB_FUNCTION_CLASS_ENDPOINT:
+        case URB_FUNCTION_CLASS_OTHER:
+            transferFlags = pUrb->UrbControlVendorClassRequest.TransferFlags;
+            *length = pUrb->UrbControlVendorClassRequest.TransferBufferLength;
+            if (transferFlags & USBD_TRANSFER_DIRECTION_IN)
             {
-                USBPcapPrintChars("Transfer Buffer",
-                                  transfer->TransferBuffer,
-                                  transfer->TransferBufferLength);
+                *endpoint = 0x80;
             }
             break;
-        }
 
-        case URB_FUNCTION_ISOCH_TRANSFER:
+        case URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE:
+        case URB_FUNCTION_GET_DESCRIPTOR_FROM_ENDPOINT:
+        case URB_FUNCTION_GET_DESCRIPTOR_FROM_INTERFACE:
+            *endpoint = 0x80;
+            /* Fall through */
+        case URB_FUNCTION_SET_DESCRIPTOR_TO_DEVICE:
+        case URB_FUNCTION_SET_DESCRIPTOR_TO_ENDPOINT:
+        case URB_FUNCTION_SET_DESCRIPTOR_TO_INTERFACE:
+            *length = pUrb->UrbControlDescriptorRequest.TransferBufferLength;
+            break;
+
+        case URB_FUNCTION_GET_STATUS_FROM_DEVICE:
+        case URB_FUNCTION_GET_STATUS_FROM_INTERFACE:
+        case URB_FUNCTION_GET_STATUS_FROM_ENDPOINT:
+        case URB_FUNCTION_GET_STATUS_FROM_OTHER:
+            *endpoint = 0x80;
+            *length = pUrb->UrbControlGetStatusRequest.TransferBufferLength;
+            break;
+
+        default:
+            hasBuffer = FALSE;
+            break;
+    }
+
+    if (pipeHandle != NULL)
+    {
+        USBPCAP_ENDPOINT_INFO  info;
+
+        if (USBPcapRetrieveEndpointInfo(pDeviceData, pipeHandle, &info))
         {
-            struct _URB_ISOCH_TRANSFER    *transfer;
-            USBPCAP_ENDPOINT_INFO         info;
-            BOOLEAN                       epFound;
-            PUSBPCAP_BUFFER_ISOCH_HEADER  packetHeader;
-            PUSBPCAP_PAYLOAD_ENTRY        compactedPayloadEntries;
-            PVOID                         captureBuffer;
-            USHORT                        headerLen;
-            ULONG                         i;
-
-            transfer = (struct _URB_ISOCH_TRANSFER*)pUrb;
-
-            DkDbgStr("URB_FUNCTION_ISOCH_TRANSFER");
-            DkDbgVal("", transfer->PipeHandle);
-            DkDbgVal("", transfer->TransferFlags);
-            DkDbgVal("", transfer->NumberOfPackets);
-
-            /* Handle transfers up to maximum of 1024 packets */
-            if (transfer->NumberOfPackets > 1024)
+            *endpoint |= info.endpointAddress;
+            if (info.type == UsbdPipeTypeInterrupt)
             {
-                DkDbgVal("Too many packets for isochronous transfer",
-                         transfer->NumberOfPackets);
-                break;
+                *transferType = USBPCAP_TRANSFER_INTERRUPT;
             }
+        }
+    }
 
-            /* headerLen will fit on 16 bits for every allowed value of
-             * NumberOfPackets */
-            headerLen = (USHORT)sizeof(USBPCAP_BUFFER_ISOCH_HEADER) +
-                        (USHORT)(sizeof(USBPCAP_BUFFER_ISO_PACKET) *
-                                 (transfer->NumberOfPackets - 1));
+    return hasBuffer;
+}
 
-            packetHeader = ExAllocatePoolWithTag(NonPagedPool,
-                                                 (SIZE_T)headerLen,
-                                                 ' RDH');
+/*
+ * Decides if URB submitted to device should be captured according to the
+ * sampling interval and the device byte rate limit.
+ */
+static BOOLEAN USBPcapSampleURB(PURB pUrb,
+                                PUSBPCAP_DEVICE_DATA pDeviceData)
+{
+    PUSBPCAP_ROOTHUB_DATA      pRootData = pDeviceData->pRootData;
+    USBPCAP_SAMPLING_SNAPSHOT  snapshot;
+    ULONG                      length;
+    UCHAR                      endpoint;
+    UCHAR                      transferType;
+    LONG                       sequence;
+    KIRQL                      irql;
+    BOOLEAN                    capture;
+
+    USBPcapGetSampling(pRootData, &snapshot);
+    if ((snapshot.sampling.samplingInterval <= 1) &&
+        (snapshot.sampling.deviceByteRate == 0))
+    {
+        return TRUE;
+    }
 
-            if (packetHeader == NULL)
-            {
-                DkDbgStr("Insufficient resources for isochronous transfer");
-                break;
-            }
+    /* Requests without transfer buffer account only the headers */
+    USBPcapGetURBTransfer(pUrb, pDeviceData, &endpoint, &transferType, &length);
 
-            packetHeader->header.headerLen = headerLen;
-            packetHeader->header.irpId     = (UINT64) pIrp;
-            packetHeader->header.status    = header->Status;
-            packetHeader->header.function  = header->Function;
-            packetHeader->header.info      = 0;
-            if (post == TRUE)
-            {
-                packetHeader->header.info |= USBPCAP_INFO_PDO_TO_FDO;
-            }
+    sequence = InterlockedIncrement(
+        &pDeviceData->sampleSequence[(endpoint & 0x0F) |
+                                     ((endpoint & 0x80) ? 16 : 0)]);
+    if (!USBPcapSampleTake(&snapshot.sampling, (UINT32)sequence))
+    {
+        InterlockedIncrement(&pRootData->samplingSkipped);
+        return FALSE;
+    }
 
-            packetHeader->header.bus       = pDeviceData->pRootData->busId;
+    /* Account both submission and completion records */
+    KeAcquireSpinLock(&pDeviceData->bucketLock, &irql);
+    capture = USBPcapTokenBucketTake(&pDeviceData->bucket,
+                                     &snapshot.sampling,
+                                     KeQueryInterruptTime(),
+                                     (UINT32)length +
+                                     2 * sizeof(USBPCAP_BUFFER_PACKET_HEADER));
+    KeReleaseSpinLock(&pDeviceData->bucketLock, irql);
 
-            epFound = USBPcapRetrieveEndpointInfo(pDeviceData,
-                                                  transfer->PipeHandle,
-                                                  &info);
-            if (epFound == TRUE)
-            {
-                packetHeader->header.device = info.deviceAddress;
-                packetHeader->header.endpoint = info.endpointAddress;
-            }
-            else
-            {
-                packetHeader->header.device = pDeviceData->deviceAddress;
-                packetHeader->header.endpoint = 0xFF;
-            }
-            packetHeader->header.transfer = USBPCAP_TRANSFER_ISOCHRONOUS;
+    if (capture == FALSE)
+    {
+        InterlockedIncrement(&pRootData->rateLimited);
+    }
 
-            /* Default to no data, will be changed later if data is to be attached to packet */
-            packetHeader->header.dataLength = 0;
-            compactedPayloadEntries = NULL;
-            captureBuffer = NULL;
+    return capture;
+}
 
-            /* Copy the packet headers untouched */
-            for (i = 0; i < transfer->NumberOfPackets; i++)
-            {
-                packetHeader->packet[i].offset = transfer->IsoPacket[i].Offset;
-                packetHeader->packet[i].length = transfer->IsoPacket[i].Length;
-                packetHeader->packet[i].status = transfer->IsoPacket[i].Status;
-            }
+/*
+ * Accounts completed URB in endpoint summary.
+ */
+static VOID USBPcapSummarizeURB(PURB pUrb,
+                                PUSBPCAP_DEVICE_DATA pDeviceData)
+{
+    ULONG    length;
+    UCHAR    endpoint;
+    UCHAR    transferType;
 
-            /* For inbound isoch transfers (post), transfer->TransferBufferLength reflects the actual
-             * number of bytes received. Rather than copying the entire transfer buffer (which may have
-             * empty gaps), we will compact the data, copying only the packets that contain data.
-             */
-            if (transfer->TransferBufferLength != 0)
-            {
-                PUCHAR transferBuffer =
-                        USBPcapURBGetBufferPointer(transfer->TransferBufferLength,
-                                                   transfer->TransferBuffer,
-                                                   transfer->TransferBufferMDL);
+    if (USBPcapGetURBTransfer(pUrb, pDeviceData,
+                              &endpoint, &transferType, &length) == FALSE)
+    {
+        return;
+    }
 
-                if (((transfer->TransferFlags & USBD_TRANSFER_DIRECTION_IN) == USBD_TRANSFER_DIRECTION_IN) && (post == TRUE))
-                {
-                    ULONG  compactedOffset;
-                    ULONG  compactedLength;
+    if (USBPcapIsEndpointCaptured(pDeviceData->pRootData,
+                                  (int)pDeviceData->deviceAddress,
+                                  endpoint, transferType) == FALSE)
+    {
+        return;
+    }
 
-                    compactedLength = 0;
+    if (transferType == USBPCAP_TRANSFER_CONTROL)
+    {
+        /* Control endpoints are bidirectional */
+        endpoint &= 0x0F;
+    }
 
-                    /* Compute the compacted transfer length by summing up the individual packet lengths */
-                    for (i = 0; i < transfer->NumberOfPackets; i++)
-                    {
-                        compactedLength += transfer->IsoPacket[i].Length;
-                    }
+    USBPcapSummaryUpdate(pDeviceData->pRootData,
+                         (UCHAR)pDeviceData->deviceAddress,
+                         endpoint, transferType, (UINT32)length,
+                         USBD_SUCCESS(pUrb->UrbHeader.Status) ? FALSE : TRUE);
+}
 
-                    if (compactedLength > transfer->TransferBufferLength)
-                    {
-                        /* This is a safety check -- the numbers don't add up (this should never happen) */
-                        DkDbgStr("Sum of Isochronous transfer packet lengths exceeds transfer buffer length");
-                        ExFreePool((PVOID)packetHeader);
-                        break;
-                    }
+/*
+ * Analyzes URB on its way to the PDO (post is FALSE) and back (post is
+ * TRUE).
+ *
+ * Returns FALSE if URB submission was not captured due to sampling. The
+ * value returned for submission must be passed as capture for the URB
+ * completion. Submission ignores capture.
+ */
+BOOLEAN USBPcapAnalyzeURB(PIRP pIrp, PURB pUrb, BOOLEAN post,
+                          BOOLEAN capture,
+                          PUSBPCAP_DEVICE_DATA pDeviceData)
+{
+    struct _URB_HEADER     *header;
+    USBPCAP_URB_IRP_INFO    unknownURBSubmitInfo;
+    BOOLEAN                 hasUnknownURBSubmitInfo;
 
-                    /* Compact the data to minimize the capture size */
-                    packetHeader->header.dataLength = (UINT32)compactedLength;
+    ASSERT(pUrb != NULL);
+    ASSERT(pDeviceData != NULL);
+    ASSERT(pDeviceData->pRootData != NULL);
 
-                    /* Allocate array of payload entries that will point to original data */
-                    compactedPayloadEntries = ExAllocatePoolWithTag(NonPagedPool,
-                        (SIZE_T)(transfer->NumberOfPackets + 1) * sizeof(USBPCAP_PAYLOAD_ENTRY),
-                        'COSI');
-                    if (compactedPayloadEntries == NULL)
-                    {
-                        DkDbgStr("Insufficient resources for isochronous transfer");
-                        ExFreePool((PVOID)packetHeader);
-                        break;
-                    }
+    header = (struct _URB_HEADER*)pUrb;
 
-                    /* Loop through all the isoch packets in the transfer buffer
-                     * Store offset and length in payload entries array in a way
-                     * that there won't be gaps in the resulting packet.
-                     */
-                    compactedOffset = 0;
-                    for (i = 0; i < transfer->NumberOfPackets; i++)
-                    {
-                        /* Adjust the offsets */
-                        packetHeader->packet[i].offset = compactedOffset;
-                        packetHeader->packet[i].length = transfer->IsoPacket[i].Length;
-                        packetHeader->packet[i].status = transfer->IsoPacket[i].Status;
-
-                        compactedPayloadEntries[i].size = transfer->IsoPacket[i].Length;
-                        compactedPayloadEntries[i].buffer = &transferBuffer[transfer->IsoPacket[i].Offset];
-                        compactedOffset += transfer->IsoPacket[i].Length;
-                    }
-                    compactedPayloadEntries[i].size = 0;
-                    compactedPayloadEntries[i].buffer = NULL;
-                }
-                else if (((transfer->TransferFlags & USBD_TRANSFER_DIRECTION_IN) == USBD_TRANSFER_DIRECTION_OUT) && (post == FALSE))
-                {
-                    captureBuffer = transferBuffer;
-                    packetHeader->header.dataLength = transfer->TransferBufferLength;
-                }
-                else
-                {
-                    /* Do not capture transfer buffer now */
-                }
-            }
+    /* Check if the IRP on its way from FDO to PDO had unknown URB function */
+    if (post)
+    {
+        hasUnknownURBSubmitInfo =
+            USBPcapObtainURBIRPInfo(pDeviceData, pIrp, &unknownURBSubmitInfo);
+    }
+    else
+    {
+        hasUnknownURBSubmitInfo = FALSE;
+    }
 
-            packetHeader->startFrame      = transfer->StartFrame;
-            packetHeader->numberOfPackets = transfer->NumberOfPackets;
-            packetHeader->errorCount      = transfer->ErrorCount;
+    /* Following URBs are always analyzed */
+    switch (header->Function)
+    {
+        case URB_FUNCTION_SELECT_CONFIGURATION:
+        {
+            struct _URB_SELECT_CONFIGURATION *pSelectConfiguration;
+            USHORT interfaces_len;
 
-            if (compactedPayloadEntries)
-            {
-                USBPcapBufferWritePayload(pDeviceData->pRootData,
-                                          (PUSBPCAP_BUFFER_PACKET_HEADER)packetHeader,
-                                          compactedPayloadEntries);
-                ExFreePool((PVOID)compactedPayloadEntries);
-            }
-            else
+            if (post == FALSE)
             {
-                USBPcapBufferWritePacket(pDeviceData->pRootData,
-                                         (PUSBPCAP_BUFFER_PACKET_HEADER)packetHeader,
-                                         captureBuffer);
+                /* Pass the request to host controller,
+                 * we are interested only in select configuration
+                 * after the fields are set by host controller driver */
+                break;
             }
 
-            ExFreePool((PVOID)packetHeader);
-            break;
-        }
+            DkDbgStr("URB_FUNCTION_SELECT_CONFIGURATION");
+            pSelectConfiguration = (struct _URB_SELECT_CONFIGURATION*)pUrb;
 
-        case URB_FUNCTION_SYNC_RESET_PIPE_AND_CLEAR_STALL:
-        case URB_FUNCTION_SYNC_RESET_PIPE:
-        case URB_FUNCTION_SYNC_CLEAR_STALL:
-        case URB_FUNCTION_ABORT_PIPE:
-#if (_WIN32_WINNT >= 0x0602)
-        case URB_FUNCTION_CLOSE_STATIC_STREAMS:
-#endif
-        {
-            struct _URB_PIPE_REQUEST      *request;
-            USBPCAP_BUFFER_PACKET_HEADER   packetHeader;
-            USBPCAP_ENDPOINT_INFO          info;
-            BOOLEAN                        epFound;
-
-            packetHeader.headerLen  = sizeof(USBPCAP_BUFFER_PACKET_HEADER);
-            packetHeader.irpId      = (UINT64) pIrp;
-            packetHeader.status     = header->Status;
-            packetHeader.function   = header->Function;
-            packetHeader.info       = 0;
-            if (post == TRUE)
+            /* Check if there is interface information in the URB */
+            if (pUrb->UrbHeader.Length > offsetof(struct _URB_SELECT_CONFIGURATION, Interface))
             {
-                packetHeader.info |= USBPCAP_INFO_PDO_TO_FDO;
+                /* Calculate interfaces length */
+                interfaces_len = pUrb->UrbHeader.Length;
+                interfaces_len -= offsetof(struct _URB_SELECT_CONFIGURATION, Interface);
+
+                KdPrint(("Header Len: %d Interfaces_len: %d\n",
+                        pUrb->UrbHeader.Length, interfaces_len));
+
+                USBPcapParseInterfaceInformation(pDeviceData,
+                                                 &pSelectConfiguration->Interface,
+                                                 interfaces_len);
             }
-            packetHeader.bus        = pDeviceData->pRootData->busId;
-            packetHeader.transfer   = USBPCAP_TRANSFER_IRP_INFO;
-            packetHeader.dataLength = 0;
 
-            request = (struct _URB_PIPE_REQUEST*)pUrb;
+            /* Store the configuration information for later use */
+            if (pDeviceData->descriptor != NULL)
+            {
+                ExFreePool((PVOID)pDeviceData->descriptor);
+            }
 
-            DkDbgVal("URB PIPE REQUEST", request->PipeHandle);
-            epFound = USBPcapRetrieveEndpointInfo(pDeviceData,
-                                                  request->PipeHandle,
-                                                  &info);
-            if (epFound == TRUE)
+            if (pSelectConfiguration->ConfigurationDescriptor != NULL)
             {
-                packetHeader.device = info.deviceAddress;
-                packetHeader.endpoint = info.endpointAddress;
+                SIZE_T descSize = pSelectConfiguration->ConfigurationDescriptor->wTotalLength;
+
+                pDeviceData->descriptor =
+                    ExAllocatePoolWithTag(NonPagedPool,
+                                          descSize,
+                                          (ULONG)'CSED');
+
+                RtlCopyMemory(pDeviceData->descriptor,
+                              pSelectConfiguration->ConfigurationDescriptor,
+                              (SIZE_T)descSize);
             }
             else
             {
-                packetHeader.device = pDeviceData->deviceAddress;
-                packetHeader.endpoint = 0xFF;
-                packetHeader.transfer = USBPCAP_TRANSFER_UNKNOWN;
+                pDeviceData->descriptor = NULL;
             }
 
-
-            USBPcapBufferWritePacket(pDeviceData->pRootData,
-                                     &packetHeader,
-                                     NULL);
             break;
         }
 
-        case URB_FUNCTION_GET_CURRENT_FRAME_NUMBER:
+        case URB_FUNCTION_SELECT_INTERFACE:
         {
-            struct _URB_GET_CURRENT_FRAME_NUMBER  *request;
-            USBPCAP_BUFFER_PACKET_HEADER           packetHeader;
-            UINT32                                 frameNum;
-
-            request = (struct _URB_GET_CURRENT_FRAME_NUMBER*)pUrb;
-
-            packetHeader.headerLen  = sizeof(USBPCAP_BUFFER_PACKET_HEADER);
-            packetHeader.irpId      = (UINT64) pIrp;
-            packetHeader.status     = header->Status;
-            packetHeader.function   = header->Function;
-            packetHeader.info       = 0;
-            packetHeader.bus        = pDeviceData->pRootData->busId;
-            packetHeader.device     = pDeviceData->deviceAddress;
-            packetHeader.endpoint   = 0x80;
-            packetHeader.transfer   = USBPCAP_TRANSFER_IRP_INFO;
-            packetHeader.dataLength = 0;
+            struct _URB_SELECT_INTERFACE *pSelectInterface;
+            USHORT interfaces_len;
 
-            if (post == TRUE)
+            if (post == FALSE)
             {
-                packetHeader.info |= USBPCAP_INFO_PDO_TO_FDO;
-                frameNum = request->FrameNumber;
-                packetHeader.dataLength = sizeof(frameNum);
+                /* Pass the request to host controller,
+                 * we are interested only in select interface
+                 * after the fields are set by host controller driver */
+                break;
             }
 
-            USBPcapBufferWritePacket(pDeviceData->pRootData,
-                                     &packetHeader,
-                                     &frameNum);
+            DkDbgStr("URB_FUNCTION_SELECT_INTERFACE");
+            pSelectInterface = (struct _URB_SELECT_INTERFACE*)pUrb;
+
+            /* Check if there is interface information in the URB */
+            if (pUrb->UrbHeader.Length > offsetof(struct _URB_SELECT_INTERFACE, Interface))
+            {
+                /* Calculate interfaces length */
+                interfaces_len = pUrb->UrbHeader.Length;
+                interfaces_len -= offsetof(struct _URB_SELECT_INTERFACE, Interface);
+
+                KdPrint(("Header Len: %d Interfaces_len: %d\n",
+                        pUrb->UrbHeader.Length, interfaces_len));
+
+                USBPcapParseInterfaceInformation(pDeviceData,
+                                                 &pSelectInterface->Interface,
+                                                 interfaces_len);
+            }
             break;
         }
 
         default:
+            break;
+    }
+
+    if (USBPcapIsDeviceCaptured(pDeviceData->pRootData,
+                                (int)pDeviceData->deviceAddress) == FALSE)
+    {
+        /* Do not log URBs from devices which are not being filtered */
+        return TRUE;
+    }
+
+    if (pDeviceData->pRootData->captureFlags & USBPCAP_CAPTURE_SUMMARY)
+    {
+        /* Nothing is captured, completed transfers are only counted */
+        if (post == TRUE)
         {
-            if (post == FALSE)
-            {
-                KIRQL irql;
-                USBPCAP_URB_IRP_INFO info;
+            USBPcapSummarizeURB(pUrb, pDeviceData);
+        }
+        return TRUE;
+    }
 
-                /* Record unknown URB function to table.
-                 * Some of the unknown URB change to control transfer on its way back
-                 * from the PDO to FDO.
-                 */
-                DkDbgVal("Recording unknown URB type in URB IRP table", header->Function);
-
-                info.irp = pIrp;
-                info.timestamp = USBPcapGetCurrentTimestamp();
-                info.status = header->Status;
-                info.function = header->Function;
-                info.info = 0;
-                info.bus = pDeviceData->pRootData->busId;
-                info.device = pDeviceData->deviceAddress;
-
-                KeAcquireSpinLock(&pDeviceData->tablesSpinLock, &irql);
-                USBPcapAddURBIRPInfo(pDeviceData->URBIrpTable, &info);
-                KeReleaseSpinLock(&pDeviceData->tablesSpinLock, irql);
-            }
-            else /* if (post == TRUE) */
-            {
-                USBPCAP_BUFFER_PACKET_HEADER  packetHeader;
+    /* Decide before any payload is touched. Completion follows the
+     * decision made for the submission.
+     */
+    if (post == FALSE)
+    {
+        capture = USBPcapSampleURB(pUrb, pDeviceData);
+    }
+    if (capture == FALSE)
+    {
+        return FALSE;
+    }
 
-                DkDbgVal("Unknown URB type", header->Function);
+    if (hasUnknownURBSubmitInfo)
+    {
+        /* Simply log the unknown URB.
+         *
+         * Originally this was used to detect if URB returns from PDO as URB_FUNCTION_CONTROL_TRANSFER
+         * When this was the case, the unknownURBSubmitInfo was used together with the pUrb to fake
+         * the Setup stage packet. Unfortunately it is unreliable as there are specific Windows and
+         * USB Root Hub combinations for which the URB can return with URB_FUNCTION_CONTROL_TRANSFER
+         * but the SetupPacket inside pUrb does not contain valid data!
+         */
+        USBPCAP_BUFFER_PACKET_HEADER  packetHeader;
 
-                packetHeader.headerLen  = sizeof(USBPCAP_BUFFER_PACKET_HEADER);
-                packetHeader.irpId      = (UINT64) pIrp;
-                packetHeader.status     = header->Status;
-                packetHeader.function   = header->Function;
-                packetHeader.info       = USBPCAP_INFO_PDO_TO_FDO;
+        DkDbgVal("Logging unknown URB from URB IRP table", unknownURBSubmitInfo.function);
 
-                packetHeader.bus        = pDeviceData->pRootData->busId;
-                packetHeader.device     = pDeviceData->deviceAddress;
-                packetHeader.endpoint   = 0;
-                packetHeader.transfer   = USBPCAP_TRANSFER_UNKNOWN;
-                packetHeader.dataLength = 0;
+        packetHeader.headerLen  = sizeof(USBPCAP_BUFFER_PACKET_HEADER);
+        packetHeader.irpId      = (UINT64) pIrp;
+        packetHeader.status     = unknownURBSubmitInfo.status;
+        packetHeader.function   = unknownURBSubmitInfo.function;
+        packetHeader.info       = unknownURBSubmitInfo.info;
+        packetHeader.bus        = unknownURBSubmitInfo.bus;
+        packetHeader.device     = unknownURBSubmitInfo.device;
+        packetHeader.endpoint   = 0;
+        packetHeader.transfer   = USBPCAP_TRANSFER_UNKNOWN;
+        packetHeader.dataLength = 0;
 
-                USBPcapBufferWritePacket(pDeviceData->pRootData, &packetHeader, NULL);
-            }
-        }
+        USBPcapBufferWriteTimestampedPacket(pDeviceData->pRootData,
+                                            unknownURBSubmitInfo.timestamp,
+                                            &packetHeader, NULL);
+    }
+
+    if (header->Function < USBPCAP_URB_FUNCTION_TABLE_SIZE)
+    {
+        g_urbHandlers[header->Function](pIrp, pUrb, post, pDeviceData);
     }
+    else
+    {
+        USBPcapAnalyzeUnknown(pIrp, pUrb, post, pDeviceData);
+    }
+
+    return TRUE;
 }
@@ -9,7 +9,24 @@
 
 #include "USBPcapMain.h"
 
-VOID USBPcapAnalyzeURB(PIRP pIrp, PURB pUrb, BOOLEAN post,
-                       PUSBPCAP_DEVICE_DATA pDeviceData);
+/* Maximum number of isochronous packets logged in single record */
+#define USBPCAP_ISOCH_MAX_PACKETS     1024
+
+/* Isochronous header length for USBPCAP_ISOCH_MAX_PACKETS packets */
+#define USBPCAP_ISOCH_MAX_HEADER_LEN \
+    (sizeof(USBPCAP_BUFFER_ISOCH_HEADER) + \
+     sizeof(USBPCAP_BUFFER_ISO_PACKET) * (USBPCAP_ISOCH_MAX_PACKETS - 1))
+
+VOID USBPcapInitializeURBDispatch(VOID);
+
+/* Completion routine context for URBs not captured on submission */
+#define USBPCAP_URB_SAMPLED_OUT  ((PVOID)1)
+
+BOOLEAN USBPcapAnalyzeURB(PIRP pIrp, PURB pUrb, BOOLEAN post,
+                          BOOLEAN capture,
+                          PUSBPCAP_DEVICE_DATA pDeviceData);
+
+NTSTATUS USBPcapInitializeIsochScratch(VOID);
+VOID USBPcapFreeIsochScratch(VOID);
 
 #endif /* USBPCAP_URB_H */
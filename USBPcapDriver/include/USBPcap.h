@@ -20,7 +20,11 @@ typedef struct
 
 #pragma pack(push)
 #pragma pack(1)
-/* USBPCAP_ADDRESS_FILTER is parameter structure to IOCTL_USBPCAP_START_FILTERING. */
+/* USBPCAP_ADDRESS_FILTER is parameter structure to IOCTL_USBPCAP_START_FILTERING.
+ *
+ * IOCTL_USBPCAP_START_FILTERING can be issued again while capture is
+ * running to change the selected devices without losing buffered data.
+ */
 typedef struct _USBPCAP_ADDRESS_FILTER
 {
     /* Individual device filter bit array. USB standard assigns device
@@ -41,6 +45,374 @@ typedef struct _USBPCAP_ADDRESS_FILTER
 } USBPCAP_ADDRESS_FILTER, *PUSBPCAP_ADDRESS_FILTER;
 #pragma pack(pop)
 
+/* Special value of USBPCAP_ENDPOINT_FILTER_RULE device and endpoint */
+#define USBPCAP_FILTER_ANY             0xFF
+
+/* USBPCAP_ENDPOINT_FILTER_RULE direction bits */
+#define USBPCAP_FILTER_DIRECTION_OUT   (1 << 0)
+#define USBPCAP_FILTER_DIRECTION_IN    (1 << 1)
+
+/* USBPCAP_ENDPOINT_FILTER_RULE transfers bit for USBPCAP_TRANSFER_xxx
+ * (isochronous, interrupt, control and bulk)
+ */
+#define USBPCAP_FILTER_TRANSFER(type)  (1 << (type))
+
+#pragma pack(push)
+#pragma pack(1)
+typedef struct _USBPCAP_ENDPOINT_FILTER_RULE
+{
+    UCHAR  device;    /* device address (1-127) or USBPCAP_FILTER_ANY */
+    UCHAR  endpoint;  /* endpoint number (0-15) or USBPCAP_FILTER_ANY */
+    UCHAR  direction; /* USBPCAP_FILTER_DIRECTION_xxx bits */
+    UCHAR  transfers; /* USBPCAP_FILTER_TRANSFER() bits */
+} USBPCAP_ENDPOINT_FILTER_RULE, *PUSBPCAP_ENDPOINT_FILTER_RULE;
+
+/* USBPCAP_ENDPOINT_FILTER is parameter structure to
+ * IOCTL_USBPCAP_SET_ENDPOINT_FILTER.
+ *
+ * The endpoint filter further restricts the devices selected with
+ * IOCTL_USBPCAP_START_FILTERING. Only the transfers matching at least
+ * one rule are captured. Requests that do not target particular endpoint
+ * are captured if any rule matches the device.
+ *
+ * numberOfRules set to 0 removes the endpoint filter.
+ */
+typedef struct _USBPCAP_ENDPOINT_FILTER
+{
+    UINT32                        numberOfRules;
+    USBPCAP_ENDPOINT_FILTER_RULE  rule[1];
+} USBPCAP_ENDPOINT_FILTER, *PUSBPCAP_ENDPOINT_FILTER;
+#pragma pack(pop)
+
+/* Size of USBPCAP_ENDPOINT_FILTER with given number of rules */
+#define USBPCAP_ENDPOINT_FILTER_SIZE(rules) \
+    (FIELD_OFFSET(USBPCAP_ENDPOINT_FILTER, rule) + \
+     (rules) * sizeof(USBPCAP_ENDPOINT_FILTER_RULE))
+
+/* Every (device, endpoint) pair can be described with single rule */
+#define USBPCAP_ENDPOINT_FILTER_MAX_RULES  (128 * 32)
+
+/* Classic BPF instruction encoding */
+#ifndef BPF_CLASS
+#define BPF_CLASS(code) ((code) & 0x07)
+#define     BPF_LD      0x00
+#define     BPF_LDX     0x01
+#define     BPF_ST      0x02
+#define     BPF_STX     0x03
+#define     BPF_ALU     0x04
+#define     BPF_JMP     0x05
+#define     BPF_RET     0x06
+#define     BPF_MISC    0x07
+
+#define BPF_SIZE(code)  ((code) & 0x18)
+#define     BPF_W       0x00
+#define     BPF_H       0x08
+#define     BPF_B       0x10
+#define BPF_MODE(code)  ((code) & 0xe0)
+#define     BPF_IMM     0x00
+#define     BPF_ABS     0x20
+#define     BPF_IND     0x40
+#define     BPF_MEM     0x60
+#define     BPF_LEN     0x80
+#define     BPF_MSH     0xa0
+
+#define BPF_OP(code)    ((code) & 0xf0)
+#define     BPF_ADD     0x00
+#define     BPF_SUB     0x10
+#define     BPF_MUL     0x20
+#define     BPF_DIV     0x30
+#define     BPF_OR      0x40
+#define     BPF_AND     0x50
+#define     BPF_LSH     0x60
+#define     BPF_RSH     0x70
+#define     BPF_NEG     0x80
+#define     BPF_MOD     0x90
+#define     BPF_XOR     0xa0
+
+#define     BPF_JA      0x00
+#define     BPF_JEQ     0x10
+#define     BPF_JGT     0x20
+#define     BPF_JGE     0x30
+#define     BPF_JSET    0x40
+#define BPF_SRC(code)   ((code) & 0x08)
+#define     BPF_K       0x00
+#define     BPF_X       0x08
+
+#define BPF_RVAL(code)  ((code) & 0x18)
+#define     BPF_A       0x10
+
+#define BPF_MISCOP(code) ((code) & 0xf8)
+#define     BPF_TAX     0x00
+#define     BPF_TXA     0x80
+#endif
+
+/* Number of scratch memory words available to BPF program */
+#define USBPCAP_BPF_MEMWORDS          16
+
+/* Maximum number of instructions in BPF program */
+#define USBPCAP_BPF_MAX_INSTRUCTIONS  4096
+
+#pragma pack(push)
+#pragma pack(1)
+typedef struct _USBPCAP_BPF_INSN
+{
+    UINT16  code;
+    UCHAR   jt;
+    UCHAR   jf;
+    UINT32  k;
+} USBPCAP_BPF_INSN, *PUSBPCAP_BPF_INSN;
+
+/* USBPCAP_BPF_PROGRAM is parameter structure to IOCTL_USBPCAP_SET_BPF.
+ *
+ * The program is run over every record before it is written to the
+ * capture buffer. Packet seen by the program starts with the USBPcap
+ * header (USBPCAP_BUFFER_PACKET_HEADER or the transfer specific header)
+ * and is followed by the payload. Multi-byte loads are big endian as
+ * in any classic BPF implementation, while USBPcap header fields are
+ * little endian. Loads beyond the packet end reject the record.
+ *
+ * Record is captured if the program returns nonzero value.
+ *
+ * numberOfInstructions set to 0 removes the program.
+ */
+typedef struct _USBPCAP_BPF_PROGRAM
+{
+    UINT32            numberOfInstructions;
+    USBPCAP_BPF_INSN  insn[1];
+} USBPCAP_BPF_PROGRAM, *PUSBPCAP_BPF_PROGRAM;
+#pragma pack(pop)
+
+/* Size of USBPCAP_BPF_PROGRAM with given number of instructions */
+#define USBPCAP_BPF_PROGRAM_SIZE(instructions) \
+    (FIELD_OFFSET(USBPCAP_BPF_PROGRAM, insn) + \
+     (instructions) * sizeof(USBPCAP_BPF_INSN))
+
+#pragma pack(push)
+#pragma pack(1)
+typedef struct _USBPCAP_SNAPLEN_RULE
+{
+    /* Records matched by this rule. Same meaning as in endpoint filter. */
+    USBPCAP_ENDPOINT_FILTER_RULE  match;
+
+    /* Maximum number of payload bytes captured. The USBPcap header is
+     * always captured, 0 captures only the header.
+     */
+    UINT32                        maxDataLength;
+} USBPCAP_SNAPLEN_RULE, *PUSBPCAP_SNAPLEN_RULE;
+
+/* USBPCAP_SNAPLEN_POLICY is parameter structure to
+ * IOCTL_USBPCAP_SET_SNAPLEN_POLICY.
+ *
+ * The first rule matching the record limits its payload. Records not
+ * matching any rule are limited only by snapshot length, which also
+ * remains the upper limit for records matching the rules.
+ *
+ * numberOfRules set to 0 removes the policy.
+ */
+typedef struct _USBPCAP_SNAPLEN_POLICY
+{
+    UINT32                numberOfRules;
+    USBPCAP_SNAPLEN_RULE  rule[1];
+} USBPCAP_SNAPLEN_POLICY, *PUSBPCAP_SNAPLEN_POLICY;
+#pragma pack(pop)
+
+/* Size of USBPCAP_SNAPLEN_POLICY with given number of rules */
+#define USBPCAP_SNAPLEN_POLICY_SIZE(rules) \
+    (FIELD_OFFSET(USBPCAP_SNAPLEN_POLICY, rule) + \
+     (rules) * sizeof(USBPCAP_SNAPLEN_RULE))
+
+/* Rules are evaluated for every record, keep the list short */
+#define USBPCAP_SNAPLEN_POLICY_MAX_RULES  64
+
+#pragma pack(push)
+#pragma pack(1)
+/* USBPCAP_SAMPLING is parameter structure to IOCTL_USBPCAP_SET_SAMPLING.
+ *
+ * Both limits are applied when URB is submitted and the decision holds
+ * for the URB completion, so request and response are always captured
+ * together.
+ */
+typedef struct _USBPCAP_SAMPLING
+{
+    /* Capture 1 in samplingInterval URBs on every endpoint. Must be power
+     * of two, 1 captures every URB. Records captured with interval
+     * greater than 1 carry the interval in info byte.
+     */
+    UINT32 samplingInterval;
+
+    /* Average number of bytes per second captured from every device,
+     * 0 for no limit. URB is accounted with its whole transfer buffer.
+     */
+    UINT32 deviceByteRate;
+
+    /* Number of bytes that can be captured at once. URBs larger than
+     * this are never captured when deviceByteRate is set.
+     */
+    UINT32 deviceBurst;
+} USBPCAP_SAMPLING, *PUSBPCAP_SAMPLING;
+#pragma pack(pop)
+
+#define USBPCAP_SAMPLING_MAX_INTERVAL  32768
+
+#pragma pack(push)
+#pragma pack(1)
+/* USBPCAP_CAPTURE_MODE is parameter structure to
+ * IOCTL_USBPCAP_SET_CAPTURE_MODE.
+ */
+typedef struct _USBPCAP_CAPTURE_MODE
+{
+    UINT32 flags; /* USBPCAP_CAPTURE_* flags */
+} USBPCAP_CAPTURE_MODE, *PUSBPCAP_CAPTURE_MODE;
+#pragma pack(pop)
+
+/* Capture only the packet headers. Transfer buffers are never accessed,
+ * dataLength and orig_len still reflect the transfer buffer length.
+ * Control transfer Setup packet is captured as it is part of the URB.
+ * Isochronous packet lengths are available in the packet descriptors.
+ */
+#define USBPCAP_CAPTURE_HEADER_ONLY  0x00000001
+
+/* Do not capture any records, only count completed transfers in per
+ * endpoint summary. See IOCTL_USBPCAP_GET_SUMMARY. Summary is reset when
+ * this flag gets set.
+ */
+#define USBPCAP_CAPTURE_SUMMARY      0x00000002
+
+#define USBPCAP_CAPTURE_VALID_FLAGS  (USBPCAP_CAPTURE_HEADER_ONLY | \
+                                      USBPCAP_CAPTURE_SUMMARY)
+
+#define USBPCAP_PAYLOAD_PATTERN_MAX_LENGTH  16
+
+#pragma pack(push)
+#pragma pack(1)
+typedef struct _USBPCAP_PAYLOAD_PATTERN
+{
+    /* USBPCAP_FILTER_TRANSFER() bits of records the pattern applies to */
+    UCHAR   transfers;
+
+    /* Number of bytes in pattern, 1 to USBPCAP_PAYLOAD_PATTERN_MAX_LENGTH */
+    UCHAR   length;
+
+    USHORT  reserved; /* Must be 0 */
+
+    /* Range of payload offsets the pattern may start at, inclusive */
+    UINT32  minOffset;
+    UINT32  maxOffset;
+
+    UCHAR   bytes[USBPCAP_PAYLOAD_PATTERN_MAX_LENGTH];
+} USBPCAP_PAYLOAD_PATTERN, *PUSBPCAP_PAYLOAD_PATTERN;
+
+/* USBPCAP_PAYLOAD_MATCH is parameter structure to
+ * IOCTL_USBPCAP_SET_PAYLOAD_MATCH.
+ *
+ * Record is captured if any pattern that applies to its transfer type is
+ * found in its payload, or if no pattern applies to its transfer type.
+ * Payload offsets are counted from the first byte after the USBPcap
+ * header, so control Setup stage payload starts with the Setup packet.
+ * Only the payload that is captured is searched.
+ *
+ * numberOfPatterns set to 0 removes the patterns.
+ */
+typedef struct _USBPCAP_PAYLOAD_MATCH
+{
+    UINT32                   numberOfPatterns;
+    USBPCAP_PAYLOAD_PATTERN  pattern[1];
+} USBPCAP_PAYLOAD_MATCH, *PUSBPCAP_PAYLOAD_MATCH;
+#pragma pack(pop)
+
+/* Size of USBPCAP_PAYLOAD_MATCH with given number of patterns */
+#define USBPCAP_PAYLOAD_MATCH_SIZE(patterns) \
+    (FIELD_OFFSET(USBPCAP_PAYLOAD_MATCH, pattern) + \
+     (patterns) * sizeof(USBPCAP_PAYLOAD_PATTERN))
+
+/* Every pattern is searched in every record, keep the list short */
+#define USBPCAP_PAYLOAD_MATCH_MAX_PATTERNS  16
+
+#pragma pack(push)
+#pragma pack(1)
+/* USBPCAP_STATISTICS is output structure of IOCTL_USBPCAP_GET_STATISTICS.
+ * All counters are reset when the Root Hub filter is created.
+ */
+typedef struct _USBPCAP_STATISTICS
+{
+    /* Number of URB IRP table entries that were evicted before the IRP
+     * returned from the PDO. Nonzero value means that some unknown URBs
+     * were logged only on their way to the host controller.
+     */
+    UINT32 irpInfoEvicted;
+
+    /* Number of records rejected by the BPF program */
+    UINT32 bpfRejected;
+
+    /* Number of URBs skipped due to sampling */
+    UINT32 samplingSkipped;
+
+    /* Number of URBs skipped due to device byte rate limit */
+    UINT32 rateLimited;
+
+    /* Number of records rejected by the payload match */
+    UINT32 matchRejected;
+
+    /* Number of records dropped because the buffer was full */
+    UINT32 bufferFull;
+} USBPCAP_STATISTICS, *PUSBPCAP_STATISTICS;
+#pragma pack(pop)
+
+/* Number of USBPCAP_ENDPOINT_SUMMARY sizes buckets. Bucket 0 counts
+ * transfers without data, bucket n counts transfers of up to 8^n bytes
+ * (that did not fit in bucket n-1) and the last bucket counts all larger
+ * transfers.
+ */
+#define USBPCAP_SUMMARY_SIZE_BUCKETS  8
+
+#pragma pack(push)
+#pragma pack(1)
+typedef struct _USBPCAP_ENDPOINT_SUMMARY
+{
+    UCHAR   device;   /* device address */
+    UCHAR   endpoint; /* endpoint address, control endpoints without
+                       * direction bit as they are bidirectional */
+    UCHAR   transfer; /* USBPCAP_TRANSFER_xxx */
+    UCHAR   reserved;
+
+    UINT64  transfers; /* Number of completed URBs */
+    UINT64  bytes;     /* Number of transferred bytes */
+    UINT64  errors;    /* Number of URBs completed with error status */
+
+    /* Number of completed URBs by transferred bytes */
+    UINT64  sizes[USBPCAP_SUMMARY_SIZE_BUCKETS];
+} USBPCAP_ENDPOINT_SUMMARY, *PUSBPCAP_ENDPOINT_SUMMARY;
+
+/* USBPCAP_SUMMARY is output structure of IOCTL_USBPCAP_GET_SUMMARY.
+ *
+ * Counters accumulate since USBPCAP_CAPTURE_SUMMARY was set. Only URBs
+ * carrying transfer buffer (control, bulk, interrupt and isochronous
+ * transfers) from devices selected by the capture filter are counted.
+ */
+typedef struct _USBPCAP_SUMMARY
+{
+    /* Number of valid entries in endpoint */
+    UINT32                    numberOfEndpoints;
+
+    /* Number of URBs that were not counted because there were already
+     * USBPCAP_SUMMARY_MAX_ENDPOINTS endpoints in summary.
+     */
+    UINT32                    overflows;
+
+    USBPCAP_ENDPOINT_SUMMARY  endpoint[1];
+} USBPCAP_SUMMARY, *PUSBPCAP_SUMMARY;
+#pragma pack(pop)
+
+/* Size of USBPCAP_SUMMARY with given number of endpoints */
+#define USBPCAP_SUMMARY_SIZE(endpoints) \
+    (FIELD_OFFSET(USBPCAP_SUMMARY, endpoint) + \
+     (endpoints) * sizeof(USBPCAP_ENDPOINT_SUMMARY))
+
+/* IOCTL_USBPCAP_GET_SUMMARY output buffer must be able to hold this many
+ * endpoints.
+ */
+#define USBPCAP_SUMMARY_MAX_ENDPOINTS  64
+
 #define IOCTL_USBPCAP_SETUP_BUFFER \
     CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, FILE_READ_ACCESS)
 
@@ -56,6 +428,30 @@ typedef struct _USBPCAP_ADDRESS_FILTER
 #define IOCTL_USBPCAP_SET_SNAPLEN_SIZE \
     CTL_CODE(FILE_DEVICE_UNKNOWN, 0x804, METHOD_BUFFERED, FILE_READ_ACCESS)
 
+#define IOCTL_USBPCAP_GET_STATISTICS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x805, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define IOCTL_USBPCAP_SET_ENDPOINT_FILTER \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x806, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+#define IOCTL_USBPCAP_SET_BPF \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x807, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+#define IOCTL_USBPCAP_SET_SNAPLEN_POLICY \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x808, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+#define IOCTL_USBPCAP_SET_SAMPLING \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x809, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+#define IOCTL_USBPCAP_SET_CAPTURE_MODE \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80A, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+#define IOCTL_USBPCAP_SET_PAYLOAD_MATCH \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80B, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+#define IOCTL_USBPCAP_GET_SUMMARY \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80C, METHOD_BUFFERED, FILE_READ_ACCESS)
+
 /* USB packets, beginning with a USBPcap header */
 #define DLT_USBPCAP         249
 
@@ -86,14 +482,54 @@ typedef struct pcaprec_hdr_s {
 #define USBPCAP_TRANSFER_INTERRUPT   1
 #define USBPCAP_TRANSFER_CONTROL     2
 #define USBPCAP_TRANSFER_BULK        3
+#define USBPCAP_TRANSFER_REPEAT      0xFC
+#define USBPCAP_TRANSFER_FILTER_MARKER 0xFD
 #define USBPCAP_TRANSFER_IRP_INFO    0xFE
 #define USBPCAP_TRANSFER_UNKNOWN     0xFF
 
+#pragma pack(push, 1)
+/* Payload of USBPCAP_TRANSFER_FILTER_MARKER record. The record is written
+ * whenever the device or endpoint filter changes. Records following the
+ * marker were captured with the new filter. Markers are written in
+ * version order and are not dropped by BPF program or payload match.
+ */
+typedef struct
+{
+    UINT32                  version;        /* Incremented on every change */
+    USBPCAP_ADDRESS_FILTER  filter;         /* Selected devices */
+    BOOLEAN                 endpointFilter; /* TRUE if endpoint filter is set */
+} USBPCAP_FILTER_MARKER, *PUSBPCAP_FILTER_MARKER;
+#pragma pack(pop)
+
+/* USBPCAP_TRANSFER_REPEAT record is never written by the driver. Capture
+ * compactor (USBPcapCMD --compact, usbpcap-compact) writes it in front of
+ * a record to stand for repetitions of that record which are left out.
+ * Repetition has all bytes except the timestamp equal to the record:
+ * incl_len, orig_len, USBPcap header and data.
+ *
+ * Header has headerLen, irpId, info, bus, device and endpoint of the
+ * repeated record, status and function are 0. The record timestamp is
+ * the one of the repeated record. Payload is UINT32 count followed by
+ * count pairs of variable length integers, one pair per repetition:
+ *   skip  - number of records in the original capture between previous
+ *           repetition (or the repeated record) and this repetition
+ *   delta - change of time between repetitions, zigzag encoded, in units
+ *           of the file timestamp resolution. Time between the repeated
+ *           record and the first repetition is the first delta.
+ * Variable length integer has 7 bits per byte, least significant first.
+ * Bit 7 is set in every byte but the last one.
+ */
+
 /* info byte fields:
  * bit 0 (LSB) - when 1: PDO -> FDO
- * bits 1-7: Reserved
+ * bit 1 - when 1: next record continues this transfer
+ * bits 2-5 - sampling interval is 2 to the power of this value
+ * bits 6-7: Reserved
  */
 #define USBPCAP_INFO_PDO_TO_FDO  (1 << 0)
+#define USBPCAP_INFO_CONTINUED   (1 << 1)
+#define USBPCAP_INFO_SAMPLING_SHIFT  2
+#define USBPCAP_INFO_SAMPLING_MASK   (0x0F << USBPCAP_INFO_SAMPLING_SHIFT)
 
 #pragma pack(push, 1)
 typedef struct
@@ -150,6 +586,12 @@ typedef struct
  *
  *   packet[x].length is not used for isochronous OUT transfers.
  *
+ *   Transfers with more than 1024 packets are recorded as consecutive
+ *   packets with the same irpId. Every packet except the last one has
+ *   USBPCAP_INFO_CONTINUED set. Each packet carries up to 1024 packet
+ *   descriptors, packet[x].offset is relative to that packet data.
+ *   startFrame and errorCount are copied from the whole transfer.
+ *
  * Buffer data is attached to:
  *   * for isochronous OUT transactions (write to device)
  *       Requests (USBPCAP_INFO_PDO_TO_FDO is not set)
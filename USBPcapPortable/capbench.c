@@ -0,0 +1,1061 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Capture path microbenchmarks. Results are written as CSV, one line per
+ * benchmark, and can be compared against earlier results to catch
+ * regressions.
+ */
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "workload.h"
+#include "USBPcapBuffer.h"
+#include "USBPcapCapture.h"
+#include "USBPcapTables.h"
+
+#define NSEC_PER_SEC      1000000000ULL
+#define BENCH_BUFFER_LEN  (8*1024*1024)
+#define READ_LENGTH       65536
+#define MAX_RESULTS       64
+
+typedef struct _BENCHMARK BENCHMARK;
+
+/* Runs iterations operations. Sets elapsed time of the measured part
+ * and number of bytes processed. Returns 0 on success.
+ */
+typedef int (*BENCHMARK_ROUTINE)(const BENCHMARK *bench, UINT64 iterations,
+                                 UINT64 *ns, UINT64 *bytes);
+
+struct _BENCHMARK
+{
+    const char        *name;
+    BENCHMARK_ROUTINE  routine;
+    UINT32             param;
+};
+
+typedef struct _RESULT
+{
+    char    name[64];
+    UINT64  iterations;
+    double  nsPerOp;
+    double  mbPerSec;
+} RESULT;
+
+static PORTABLE_CAPTURE  g_capture;
+static UCHAR             g_payload[65536];
+static UCHAR             g_readBuffer[READ_LENGTH];
+
+static UINT64 clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (UINT64)ts.tv_sec * NSEC_PER_SEC + (UINT64)ts.tv_nsec;
+}
+
+/* Empties the ring without reading it */
+static void bench_discard(void)
+{
+    g_capture.root.readOffset = g_capture.root.writeOffset;
+}
+
+static void bench_reset(void)
+{
+    bench_discard();
+    g_capture.root.captureFlags = 0;
+}
+
+/* USBPcapBufferStorePacket() through USBPcapBufferWriteTimestampedPacket()
+ * with param bytes of payload.
+ */
+static int bench_store(const BENCHMARK *bench, UINT64 iterations,
+                       UINT64 *ns, UINT64 *bytes)
+{
+    USBPCAP_BUFFER_PACKET_HEADER  header;
+    LARGE_INTEGER                 timestamp;
+    UINT32                        record;
+    UINT32                        stored = 0;
+    UINT64                        start;
+    UINT64                        i;
+
+    memset(&header, 0, sizeof(header));
+    header.headerLen = sizeof(header);
+    header.function = URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER;
+    header.info = USBPCAP_INFO_PDO_TO_FDO;
+    header.bus = 1;
+    header.device = 1;
+    header.endpoint = 0x81;
+    header.transfer = USBPCAP_TRANSFER_BULK;
+    header.dataLength = bench->param;
+    timestamp.QuadPart = 0;
+
+    record = sizeof(pcaprec_hdr_t) + sizeof(header) + bench->param;
+
+    bench_reset();
+    start = clock_ns();
+    for (i = 0; i < iterations; i++)
+    {
+        header.irpId = i;
+        if (stored + record > BENCH_BUFFER_LEN)
+        {
+            bench_discard();
+            stored = 0;
+        }
+        if (!NT_SUCCESS(USBPcapBufferWriteTimestampedPacket(&g_capture.root,
+                                                            timestamp,
+                                                            &header,
+                                                            g_payload)))
+        {
+            return -1;
+        }
+        stored += record;
+    }
+    *ns = clock_ns() - start;
+    *bytes = iterations * record;
+
+    return 0;
+}
+
+/* Record of single transfer written directly into the ring as the URB
+ * builders do it. Transfer type is in the upper byte of param, payload
+ * bytes in the rest. Control records carry the setup packet before the
+ * payload.
+ */
+#define RECORD_PARAM(transfer, length)  (((transfer) << 24) | (length))
+
+static int bench_record(const BENCHMARK *bench, UINT64 iterations,
+                        UINT64 *ns, UINT64 *bytes)
+{
+    USBPCAP_BUFFER_RECORD  record;
+    LARGE_INTEGER          timestamp;
+    UCHAR                  transfer = (UCHAR)(bench->param >> 24);
+    UINT32                 length = bench->param & 0xFFFFFF;
+    USHORT                 headerLen;
+    UINT32                 dataLength;
+    UINT32                 size;
+    UINT32                 stored = 0;
+    UINT64                 start;
+    UINT64                 i;
+
+    headerLen = (transfer == USBPCAP_TRANSFER_CONTROL) ?
+                sizeof(USBPCAP_BUFFER_CONTROL_HEADER) :
+                sizeof(USBPCAP_BUFFER_PACKET_HEADER);
+    dataLength = (transfer == USBPCAP_TRANSFER_CONTROL) ? 8 + length : length;
+    size = sizeof(pcaprec_hdr_t) + headerLen + dataLength;
+    timestamp.QuadPart = 0;
+
+    bench_reset();
+    start = clock_ns();
+    for (i = 0; i < iterations; i++)
+    {
+        PUSBPCAP_BUFFER_PACKET_HEADER header;
+
+        if (stored + size > BENCH_BUFFER_LEN)
+        {
+            bench_discard();
+            stored = 0;
+        }
+        if (!NT_SUCCESS(USBPcapBufferBeginRecord(&g_capture.root, timestamp,
+                                                 headerLen, dataLength, 1,
+                                                 0x81, transfer, MAXULONG,
+                                                 &record)))
+        {
+            return -1;
+        }
+
+        header = record.header;
+        header->headerLen = headerLen;
+        header->irpId = i;
+        header->status = USBD_STATUS_SUCCESS;
+        header->function = (transfer == USBPCAP_TRANSFER_CONTROL) ?
+                           URB_FUNCTION_CONTROL_TRANSFER :
+                           URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER;
+        header->info = USBPCAP_INFO_PDO_TO_FDO;
+        header->bus = 1;
+        header->device = 1;
+        header->endpoint = 0x81;
+        header->transfer = transfer;
+        header->dataLength = dataLength;
+
+        if (transfer == USBPCAP_TRANSFER_CONTROL)
+        {
+            ((PUSBPCAP_BUFFER_CONTROL_HEADER)header)->stage =
+                USBPCAP_CONTROL_STAGE_SETUP;
+            USBPcapBufferRecordWriteData(&record, g_payload, 8);
+        }
+        USBPcapBufferRecordWriteData(&record, g_payload, length);
+        USBPcapBufferEndRecord(&record);
+        stored += size;
+    }
+    *ns = clock_ns() - start;
+    *bytes = iterations * size;
+
+    return 0;
+}
+
+/* USBPcapBufferRead() through the read IRP, param bytes of the read are
+ * before the end of the ring and the rest at its beginning.
+ */
+static int bench_read(const BENCHMARK *bench, UINT64 iterations,
+                      UINT64 *ns, UINT64 *bytes)
+{
+    PUSBPCAP_ROOTHUB_DATA  root = &g_capture.root;
+    UINT64                 start;
+    UINT64                 i;
+
+    bench_reset();
+    start = clock_ns();
+    for (i = 0; i < iterations; i++)
+    {
+        root->readOffset = (root->bufferSize - bench->param) % root->bufferSize;
+        root->writeOffset = READ_LENGTH - bench->param;
+        if (capture_read(&g_capture, g_readBuffer, READ_LENGTH) != READ_LENGTH)
+        {
+            return -1;
+        }
+    }
+    *ns = clock_ns() - start;
+    *bytes = iterations * READ_LENGTH;
+
+    bench_discard();
+    return 0;
+}
+
+/* USBPcapRetrieveEndpointInfo() on device with param endpoints */
+static int bench_endpoint(const BENCHMARK *bench, UINT64 iterations,
+                          UINT64 *ns, UINT64 *bytes)
+{
+    PUSBPCAP_DEVICE_DATA   device;
+    USBD_PIPE_INFORMATION  pipe;
+    USBPCAP_ENDPOINT_INFO  info;
+    UCHAR                  handles[32];
+    UINT32                 count = bench->param;
+    UINT32                 found = 0;
+    UINT64                 start;
+    UINT64                 i;
+
+    device = capture_add_device(&g_capture, 1);
+    if (device == NULL)
+    {
+        return -1;
+    }
+
+    memset(&pipe, 0, sizeof(pipe));
+    for (i = 0; i < count; i++)
+    {
+        pipe.EndpointAddress = (UCHAR)((i / 2 + 1) | ((i & 1) ? 0x80 : 0));
+        pipe.PipeType = UsbdPipeTypeBulk;
+        pipe.PipeHandle = &handles[i];
+        USBPcapAddEndpointInfo(device->endpointTable, &pipe, 1);
+    }
+
+    start = clock_ns();
+    for (i = 0; i < iterations; i++)
+    {
+        /* Stride through the handles so the splay tree keeps changing */
+        if (USBPcapRetrieveEndpointInfo(device, &handles[(i * 7) % count],
+                                        &info))
+        {
+            found++;
+        }
+    }
+    *ns = clock_ns() - start;
+    *bytes = 0;
+
+    capture_remove_device(device);
+    return (found == iterations) ? 0 : -1;
+}
+
+/* Endpoint filter on fully populated bus: 127 devices with 32 endpoints
+ * each and separate rule for every endpoint. With param 0 the rules are
+ * compiled with USBPcapSetEndpointFilter(), otherwise every operation is
+ * USBPcapIsEndpointCaptured() for another endpoint and transfer type.
+ */
+#define FILTER_DEVICES    127
+#define FILTER_ENDPOINTS  32
+#define FILTER_RULES      (FILTER_DEVICES * FILTER_ENDPOINTS)
+
+static int bench_filter(const BENCHMARK *bench, UINT64 iterations,
+                        UINT64 *ns, UINT64 *bytes)
+{
+    static UCHAR              buffer[USBPCAP_ENDPOINT_FILTER_SIZE(FILTER_RULES)];
+    PUSBPCAP_ENDPOINT_FILTER  filter = (PUSBPCAP_ENDPOINT_FILTER)buffer;
+    UINT64                    expected = 0;
+    UINT64                    captured = 0;
+    UINT64                    start;
+    UINT64                    i;
+
+    /* Every endpoint selects one transfer type, lookups ask for each
+     * of the four in turn.
+     */
+    filter->numberOfRules = FILTER_RULES;
+    for (i = 0; i < FILTER_RULES; i++)
+    {
+        PUSBPCAP_ENDPOINT_FILTER_RULE rule = &filter->rule[i];
+
+        rule->device = (UCHAR)(i / FILTER_ENDPOINTS + 1);
+        rule->endpoint = (UCHAR)(i % 16);
+        rule->direction = ((i % FILTER_ENDPOINTS) < 16) ?
+                          USBPCAP_FILTER_DIRECTION_OUT :
+                          USBPCAP_FILTER_DIRECTION_IN;
+        rule->transfers = (UCHAR)USBPCAP_FILTER_TRANSFER(i % 4);
+    }
+
+    if (bench->param == 0)
+    {
+        start = clock_ns();
+        for (i = 0; i < iterations; i++)
+        {
+            if (!NT_SUCCESS(USBPcapSetEndpointFilter(&g_capture.root, filter)))
+            {
+                return -1;
+            }
+        }
+        *ns = clock_ns() - start;
+    }
+    else
+    {
+        if (!NT_SUCCESS(USBPcapSetEndpointFilter(&g_capture.root, filter)))
+        {
+            return -1;
+        }
+
+        start = clock_ns();
+        for (i = 0; i < iterations; i++)
+        {
+            UINT32 rule = (UINT32)((i * 7) % FILTER_RULES);
+            UCHAR  endpoint = (UCHAR)((rule % 16) |
+                                      (((rule % FILTER_ENDPOINTS) < 16) ? 0 : 0x80));
+
+            if (USBPcapIsEndpointCaptured(&g_capture.root,
+                                          rule / FILTER_ENDPOINTS + 1,
+                                          endpoint, (UCHAR)(i % 4)))
+            {
+                captured++;
+            }
+        }
+        *ns = clock_ns() - start;
+
+        for (i = 0; i < iterations; i++)
+        {
+            expected += ((i % 4) == ((i * 7) % FILTER_RULES % 4)) ? 1 : 0;
+        }
+    }
+    *bytes = 0;
+
+    filter->numberOfRules = 0;
+    USBPcapSetEndpointFilter(&g_capture.root, filter);
+    bench_reset();
+
+    return (captured == expected) ? 0 : -1;
+}
+
+/* USBPcapMatchRun() over bulk payload of param bytes with the number of
+ * patterns in the upper byte of param. None of the patterns is found:
+ * each differs from the payload only in its last byte, so the whole
+ * payload is searched for every pattern and the first byte is found
+ * every 256 bytes.
+ */
+#define MATCH_PARAM(patterns, length)  (((patterns) << 24) | (length))
+
+static int bench_match(const BENCHMARK *bench, UINT64 iterations,
+                       UINT64 *ns, UINT64 *bytes)
+{
+    static UCHAR           buffer[USBPCAP_PAYLOAD_MATCH_SIZE(USBPCAP_PAYLOAD_MATCH_MAX_PATTERNS)];
+    PUSBPCAP_PAYLOAD_MATCH match = (PUSBPCAP_PAYLOAD_MATCH)buffer;
+    USBPCAP_PAYLOAD_ENTRY  payload[2];
+    UINT32                 length = bench->param & 0xFFFFFF;
+    UINT32                 found = 0;
+    UINT64                 start;
+    UINT64                 i;
+    UINT32                 j;
+
+    memset(buffer, 0, sizeof(buffer));
+    match->numberOfPatterns = bench->param >> 24;
+    for (i = 0; i < match->numberOfPatterns; i++)
+    {
+        PUSBPCAP_PAYLOAD_PATTERN pattern = &match->pattern[i];
+
+        pattern->transfers = USBPCAP_FILTER_TRANSFER(USBPCAP_TRANSFER_BULK);
+        pattern->length = USBPCAP_PAYLOAD_PATTERN_MAX_LENGTH;
+        pattern->minOffset = 0;
+        pattern->maxOffset = MAXULONG;
+        for (j = 0; j < pattern->length; j++)
+        {
+            pattern->bytes[j] = g_payload[i * 3 + j];
+        }
+        pattern->bytes[pattern->length - 1] ^= 0xFF;
+    }
+    if (!USBPcapMatchValidate(match))
+    {
+        return -1;
+    }
+
+    payload[0].size = length;
+    payload[0].buffer = g_payload;
+    payload[1].size = 0;
+    payload[1].buffer = NULL;
+
+    start = clock_ns();
+    for (i = 0; i < iterations; i++)
+    {
+        if (USBPcapMatchRun(match, USBPCAP_TRANSFER_BULK, payload, length))
+        {
+            found++;
+        }
+    }
+    *ns = clock_ns() - start;
+    *bytes = iterations * length;
+
+    return (found == 0) ? 0 : -1;
+}
+
+/* Endpoint summary update of completed transfer spread over the number
+ * of endpoints in lower byte of param. SUMMARY_UPDATE goes through
+ * USBPcapSummaryUpdate() with processor table selection, otherwise
+ * USBPcapSummaryAdd() updates single table.
+ */
+#define SUMMARY_UPDATE  0x100
+
+static int bench_summary(const BENCHMARK *bench, UINT64 iterations,
+                         UINT64 *ns, UINT64 *bytes)
+{
+    PUSBPCAP_SUMMARY_TABLE  table;
+    UINT32                  endpoints = bench->param & 0xFF;
+    UINT64                  start;
+    UINT64                  i;
+
+    table = calloc(1, sizeof(USBPCAP_SUMMARY_TABLE));
+    if ((table == NULL) ||
+        !NT_SUCCESS(USBPcapResetSummary(&g_capture.root)))
+    {
+        free(table);
+        return -1;
+    }
+
+    start = clock_ns();
+    for (i = 0; i < iterations; i++)
+    {
+        UINT32 endpoint = (UINT32)(i % endpoints);
+        UINT32 length = (UINT32)(i & 0xFFF);
+
+        if (bench->param & SUMMARY_UPDATE)
+        {
+            USBPcapSummaryUpdate(&g_capture.root, (UCHAR)(endpoint / 8 + 1),
+                                 (UCHAR)(0x81 + endpoint % 8),
+                                 USBPCAP_TRANSFER_BULK, length, FALSE);
+        }
+        else
+        {
+            USBPcapSummaryAdd(table, (UCHAR)(endpoint / 8 + 1),
+                              (UCHAR)(0x81 + endpoint % 8),
+                              USBPCAP_TRANSFER_BULK, length, FALSE);
+        }
+    }
+    *ns = clock_ns() - start;
+    *bytes = 0;
+
+    i = table->overflows;
+    free(table);
+    return (i == 0) ? 0 : -1;
+}
+
+/* USBPcapGetSummary() equivalent: merge of param processor tables, each
+ * with USBPCAP_SUMMARY_MAX_ENDPOINTS endpoints (the same ones in every
+ * table).
+ */
+static int bench_merge(const BENCHMARK *bench, UINT64 iterations,
+                       UINT64 *ns, UINT64 *bytes)
+{
+    PUSBPCAP_SUMMARY_TABLE  tables;
+    PUSBPCAP_SUMMARY        summary;
+    UINT64                  start;
+    UINT64                  i;
+    UINT32                  j;
+    int                     status = 0;
+
+    tables = calloc(bench->param, sizeof(USBPCAP_SUMMARY_TABLE));
+    summary = calloc(1, USBPCAP_SUMMARY_SIZE(USBPCAP_SUMMARY_MAX_ENDPOINTS));
+    if ((tables == NULL) || (summary == NULL))
+    {
+        free(tables);
+        free(summary);
+        return -1;
+    }
+
+    for (j = 0; j < bench->param; j++)
+    {
+        for (i = 0; i < 4 * USBPCAP_SUMMARY_MAX_ENDPOINTS; i++)
+        {
+            USBPcapSummaryAdd(&tables[j], (UCHAR)(i % 8 + 1),
+                              (UCHAR)(0x81 + (i / 8) % 8),
+                              USBPCAP_TRANSFER_BULK, (UINT32)i, FALSE);
+        }
+    }
+
+    start = clock_ns();
+    for (i = 0; i < iterations; i++)
+    {
+        summary->numberOfEndpoints = 0;
+        summary->overflows = 0;
+        for (j = 0; j < bench->param; j++)
+        {
+            USBPcapSummaryMerge(summary, &tables[j]);
+        }
+    }
+    *ns = clock_ns() - start;
+    *bytes = 0;
+
+    if ((iterations > 0) &&
+        ((summary->numberOfEndpoints != USBPCAP_SUMMARY_MAX_ENDPOINTS) ||
+         (summary->overflows != 0) ||
+         (summary->endpoint[0].transfers != 4 * bench->param)))
+    {
+        status = -1;
+    }
+
+    free(tables);
+    free(summary);
+    return status;
+}
+
+/* Isochronous URB submission and completion with param packets. With
+ * header only capture this is mostly the isochronous header building,
+ * split into several records above USBPCAP_ISOCH_MAX_PACKETS packets.
+ */
+static int bench_isoch(const BENCHMARK *bench, UINT64 iterations,
+                       UINT64 *ns, UINT64 *bytes)
+{
+    PUSBPCAP_DEVICE_DATA  device;
+    WORKLOAD_DEVICE       workload;
+    WORKLOAD_PROFILE      profile;
+    UINT64                start;
+    UINT64                i;
+
+    device = capture_add_device(&g_capture, 1);
+    profile.type = WORKLOAD_UAC;
+    profile.rate = 0;
+    profile.size = 192;
+    profile.count = bench->param;
+    if ((device == NULL) || (workload_init(&workload, &profile, device, 1) != 0))
+    {
+        return -1;
+    }
+
+    bench_reset();
+    g_capture.root.captureFlags = USBPCAP_CAPTURE_HEADER_ONLY;
+    start = clock_ns();
+    for (i = 0; i < iterations; i++)
+    {
+        /* Records of 16 URBs with 4096 packets take below 2 MiB */
+        if ((i & 15) == 0)
+        {
+            bench_discard();
+        }
+        workload_run(&workload);
+    }
+    *ns = clock_ns() - start;
+    *bytes = 0;
+
+    workload_free(&workload);
+    capture_remove_device(device);
+    bench_reset();
+
+    return 0;
+}
+
+/* Complete URB path for the workload class in param */
+static int bench_urb(const BENCHMARK *bench, UINT64 iterations,
+                     UINT64 *ns, UINT64 *bytes)
+{
+    PUSBPCAP_DEVICE_DATA  device;
+    WORKLOAD_DEVICE       workload;
+    WORKLOAD_PROFILE      profile;
+    UINT64                start;
+    UINT64                i;
+
+    device = capture_add_device(&g_capture, 1);
+    if ((device == NULL) ||
+        (workload_parse(workload_class_name((WORKLOAD_CLASS)bench->param),
+                        &profile) != 0) ||
+        (workload_init(&workload, &profile, device, 1) != 0))
+    {
+        return -1;
+    }
+
+    bench_reset();
+    start = clock_ns();
+    for (i = 0; i < iterations; i++)
+    {
+        if (g_capture.root.writeOffset > BENCH_BUFFER_LEN / 2)
+        {
+            g_capture.root.readOffset = g_capture.root.writeOffset = 0;
+        }
+        workload_run(&workload);
+    }
+    *ns = clock_ns() - start;
+    *bytes = workload.bytes;
+
+    workload_free(&workload);
+    capture_remove_device(device);
+    bench_reset();
+
+    return 0;
+}
+
+/* USBPcapAnalyzeURB() cost per URB (submission and completion) of
+ * stream mixing all urbload device classes. With param 0 no device is
+ * selected by the address filter, so only the dispatch and filter check
+ * are measured.
+ */
+static int bench_analyze(const BENCHMARK *bench, UINT64 iterations,
+                         UINT64 *ns, UINT64 *bytes)
+{
+    PUSBPCAP_DEVICE_DATA    devices[WORKLOAD_CLASSES];
+    WORKLOAD_DEVICE         workloads[WORKLOAD_CLASSES];
+    WORKLOAD_PROFILE        profile;
+    USBPCAP_ADDRESS_FILTER  filter;
+    UINT64                  urbs = 0;
+    UINT64                  start;
+    int                     captured;
+    int                     type;
+    int                     status = 0;
+
+    for (type = 0; type < WORKLOAD_CLASSES; type++)
+    {
+        devices[type] = capture_add_device(&g_capture, (USHORT)(type + 1));
+        if ((devices[type] == NULL) ||
+            (workload_parse(workload_class_name((WORKLOAD_CLASS)type),
+                            &profile) != 0) ||
+            (workload_init(&workloads[type], &profile, devices[type],
+                           type + 1) != 0))
+        {
+            return -1;
+        }
+    }
+
+    memset(&filter, 0, sizeof(filter));
+    filter.filterAll = (bench->param != 0) ? TRUE : FALSE;
+    USBPcapSetAddressFilter(&g_capture.root, &filter);
+
+    bench_reset();
+    start = clock_ns();
+    while (urbs < iterations)
+    {
+        for (type = 0; type < WORKLOAD_CLASSES; type++)
+        {
+            if (g_capture.root.writeOffset > BENCH_BUFFER_LEN / 2)
+            {
+                g_capture.root.readOffset = g_capture.root.writeOffset = 0;
+            }
+            urbs -= workloads[type].urbs;
+            workload_run(&workloads[type]);
+            urbs += workloads[type].urbs;
+        }
+    }
+    /* Scale to the requested number of URBs */
+    *ns = (clock_ns() - start) * iterations / urbs;
+    *bytes = 0;
+
+    /* Records are there only if the devices were selected */
+    captured = (g_capture.root.writeOffset != g_capture.root.readOffset);
+    if (captured != (bench->param != 0))
+    {
+        status = -1;
+    }
+
+    for (type = 0; type < WORKLOAD_CLASSES; type++)
+    {
+        workload_free(&workloads[type]);
+        capture_remove_device(devices[type]);
+    }
+    filter.filterAll = TRUE;
+    USBPcapSetAddressFilter(&g_capture.root, &filter);
+    bench_reset();
+
+    return status;
+}
+
+/* USBPcapCMD process_data() equivalent: read IRPs of 64 KiB and write
+ * them to output. Every operation reads param bytes of captured
+ * 512 byte bulk transfers.
+ */
+static int bench_consumer(const BENCHMARK *bench, UINT64 iterations,
+                          UINT64 *ns, UINT64 *bytes)
+{
+    USBPCAP_BUFFER_PACKET_HEADER  header;
+    LARGE_INTEGER                 timestamp;
+    UINT64                        elapsed = 0;
+    UINT64                        i;
+    int                           output;
+
+    output = open("/dev/null", O_WRONLY);
+    if (output < 0)
+    {
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.headerLen = sizeof(header);
+    header.function = URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER;
+    header.info = USBPCAP_INFO_PDO_TO_FDO;
+    header.bus = 1;
+    header.device = 1;
+    header.endpoint = 0x81;
+    header.transfer = USBPCAP_TRANSFER_BULK;
+    header.dataLength = 512;
+    timestamp.QuadPart = 0;
+
+    bench_reset();
+    for (i = 0; i < iterations; i++)
+    {
+        UINT32 filled = 0;
+        UINT32 read = 0;
+        UINT64 start;
+
+        while (filled < bench->param)
+        {
+            USBPcapBufferWriteTimestampedPacket(&g_capture.root, timestamp,
+                                                &header, g_payload);
+            filled += sizeof(pcaprec_hdr_t) + sizeof(header) + 512;
+        }
+
+        start = clock_ns();
+        while (read < filled)
+        {
+            UINT32 length = capture_read(&g_capture, g_readBuffer,
+                                         READ_LENGTH);
+
+            if ((length == 0) || (write(output, g_readBuffer, length) < 0))
+            {
+                close(output);
+                return -1;
+            }
+            read += length;
+        }
+        elapsed += clock_ns() - start;
+    }
+    *ns = elapsed;
+    *bytes = iterations * bench->param;
+
+    close(output);
+    return 0;
+}
+
+static const BENCHMARK g_benchmarks[] =
+{
+    {"store/0",          bench_store,    0},
+    {"store/64",         bench_store,    64},
+    {"store/512",        bench_store,    512},
+    {"store/4096",       bench_store,    4096},
+    {"store/65536",      bench_store,    65536},
+    {"record/control/0",     bench_record,
+     RECORD_PARAM(USBPCAP_TRANSFER_CONTROL, 0)},
+    {"record/control/64",    bench_record,
+     RECORD_PARAM(USBPCAP_TRANSFER_CONTROL, 64)},
+    {"record/interrupt/8",   bench_record,
+     RECORD_PARAM(USBPCAP_TRANSFER_INTERRUPT, 8)},
+    {"record/interrupt/64",  bench_record,
+     RECORD_PARAM(USBPCAP_TRANSFER_INTERRUPT, 64)},
+    {"record/bulk/512",      bench_record,
+     RECORD_PARAM(USBPCAP_TRANSFER_BULK, 512)},
+    {"record/bulk/4096",     bench_record,
+     RECORD_PARAM(USBPCAP_TRANSFER_BULK, 4096)},
+    {"record/bulk/65536",    bench_record,
+     RECORD_PARAM(USBPCAP_TRANSFER_BULK, 65536)},
+    {"read/contiguous",  bench_read,     0},
+    {"read/wrap",        bench_read,     READ_LENGTH / 2},
+    {"endpoint/2",       bench_endpoint, 2},
+    {"endpoint/8",       bench_endpoint, 8},
+    {"endpoint/32",      bench_endpoint, 32},
+    {"filter/compile",   bench_filter,   0},
+    {"filter/lookup",    bench_filter,   1},
+    {"match/64/1",       bench_match,    MATCH_PARAM(1, 64)},
+    {"match/512/1",      bench_match,    MATCH_PARAM(1, 512)},
+    {"match/4096/1",     bench_match,    MATCH_PARAM(1, 4096)},
+    {"match/65536/1",    bench_match,    MATCH_PARAM(1, 65536)},
+    {"match/512/4",      bench_match,    MATCH_PARAM(4, 512)},
+    {"match/4096/4",     bench_match,    MATCH_PARAM(4, 4096)},
+    {"match/512/16",     bench_match,    MATCH_PARAM(16, 512)},
+    {"match/4096/16",    bench_match,    MATCH_PARAM(16, 4096)},
+    {"match/65536/16",   bench_match,    MATCH_PARAM(16, 65536)},
+    {"summary/add/8",    bench_summary,  8},
+    {"summary/add/64",   bench_summary,  64},
+    {"summary/update/8", bench_summary,  SUMMARY_UPDATE | 8},
+    {"summary/merge/1",  bench_merge,    1},
+    {"summary/merge/16", bench_merge,    16},
+    {"summary/merge/64", bench_merge,    64},
+    {"isoch/8",          bench_isoch,    8},
+    {"isoch/64",         bench_isoch,    64},
+    {"isoch/1024",       bench_isoch,    1024},
+    {"isoch/1025",       bench_isoch,    1025},
+    {"isoch/4096",       bench_isoch,    4096},
+    {"urb/hid",          bench_urb,      WORKLOAD_HID},
+    {"urb/cdc",          bench_urb,      WORKLOAD_CDC},
+    {"urb/bot",          bench_urb,      WORKLOAD_BOT},
+    {"urb/control",      bench_urb,      WORKLOAD_CONTROL},
+    {"analyze/mixed",    bench_analyze,  1},
+    {"analyze/filtered", bench_analyze,  0},
+    {"consumer/1048576", bench_consumer, 1048576},
+};
+
+#define NUMBER_OF_BENCHMARKS  (sizeof(g_benchmarks) / sizeof(g_benchmarks[0]))
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+/* Calibrates iteration count so single run takes about runTime ns and
+ * reports median of repeat runs.
+ */
+static int run_benchmark(const BENCHMARK *bench, UINT64 runTime,
+                         int repeat, RESULT *result)
+{
+    double  nsPerOp[16];
+    double  mbPerSec[16];
+    UINT64  iterations = 1;
+    UINT64  ns;
+    UINT64  bytes;
+    int     i;
+
+    for (;;)
+    {
+        if (bench->routine(bench, iterations, &ns, &bytes) != 0)
+        {
+            return -1;
+        }
+        if (ns >= runTime / 10)
+        {
+            break;
+        }
+        iterations *= 2;
+    }
+    iterations = (ns == 0) ? iterations :
+                 max(1, (UINT64)((double)iterations * runTime / ns));
+
+    for (i = 0; i < repeat; i++)
+    {
+        if (bench->routine(bench, iterations, &ns, &bytes) != 0)
+        {
+            return -1;
+        }
+        nsPerOp[i] = (double)ns / iterations;
+        mbPerSec[i] = (ns == 0) ? 0.0 :
+                      (double)bytes * NSEC_PER_SEC / ns / (1024 * 1024);
+    }
+    qsort(nsPerOp, repeat, sizeof(double), compare_double);
+    qsort(mbPerSec, repeat, sizeof(double), compare_double);
+
+    snprintf(result->name, sizeof(result->name), "%s", bench->name);
+    result->iterations = iterations;
+    result->nsPerOp = nsPerOp[repeat / 2];
+    result->mbPerSec = mbPerSec[repeat / 2];
+
+    return 0;
+}
+
+/* Reads results written earlier. Returns number of results or -1. */
+static int read_results(const char *filename, RESULT *results, int maximum)
+{
+    FILE  *file;
+    char   line[256];
+    int    count = 0;
+
+    file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    while ((count < maximum) && (fgets(line, sizeof(line), file) != NULL))
+    {
+        RESULT            *result = &results[count];
+        unsigned long long iterations;
+
+        if (sscanf(line, "%63[^,],%llu,%lf,%lf", result->name, &iterations,
+                   &result->nsPerOp, &result->mbPerSec) == 4)
+        {
+            result->iterations = iterations;
+            count++;
+        }
+    }
+
+    fclose(file);
+    return count;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "\n"
+            "Options:\n"
+            "  -f, --filter <text>      run benchmarks with text in name\n"
+            "  -t, --time <ms>          single run time (default: 200)\n"
+            "  -n, --repeat <n>         runs per benchmark, median is\n"
+            "                           reported (default: 5, max 16)\n"
+            "  -b, --baseline <file>    compare with earlier results\n"
+            "  -T, --threshold <pct>    slowdown considered regression\n"
+            "                           (default: 10)\n"
+            "  -l, --list               list benchmarks\n"
+            "\n"
+            "Results are written to standard output as CSV:\n"
+            "name,iterations,ns_per_op,mib_per_s\n"
+            "Comparison is written to standard error. Exit status is 2 if\n"
+            "any benchmark regressed.\n",
+            name);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] =
+    {
+        {"filter",    required_argument, NULL, 'f'},
+        {"time",      required_argument, NULL, 't'},
+        {"repeat",    required_argument, NULL, 'n'},
+        {"baseline",  required_argument, NULL, 'b'},
+        {"threshold", required_argument, NULL, 'T'},
+        {"list",      no_argument,       NULL, 'l'},
+        {"help",      no_argument,       NULL, 'h'},
+        {NULL,        0,                 NULL, 0}
+    };
+    RESULT       results[MAX_RESULTS];
+    RESULT       baseline[MAX_RESULTS];
+    const char  *filter = NULL;
+    const char  *baselineFile = NULL;
+    UINT64       runTime = 200 * 1000000ULL;
+    double       threshold = 10.0;
+    int          repeat = 5;
+    int          numberOfResults = 0;
+    int          numberOfBaseline = 0;
+    int          regressions = 0;
+    int          opt;
+    int          i;
+    int          j;
+
+    while ((opt = getopt_long(argc, argv, "f:t:n:b:T:lh", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'f':
+                filter = optarg;
+                break;
+            case 't':
+                runTime = strtoull(optarg, NULL, 0) * 1000000ULL;
+                break;
+            case 'n':
+                repeat = atoi(optarg);
+                break;
+            case 'b':
+                baselineFile = optarg;
+                break;
+            case 'T':
+                threshold = atof(optarg);
+                break;
+            case 'l':
+                for (i = 0; i < (int)NUMBER_OF_BENCHMARKS; i++)
+                {
+                    printf("%s\n", g_benchmarks[i].name);
+                }
+                return 0;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    if ((repeat < 1) || (repeat > 16) || (runTime == 0))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (baselineFile != NULL)
+    {
+        numberOfBaseline = read_results(baselineFile, baseline, MAX_RESULTS);
+        if (numberOfBaseline < 0)
+        {
+            fprintf(stderr, "Failed to read %s\n", baselineFile);
+            return 1;
+        }
+    }
+
+    if (capture_open(&g_capture, BENCH_BUFFER_LEN, 1) != 0)
+    {
+        fprintf(stderr, "Failed to set up buffer\n");
+        return 1;
+    }
+    for (i = 0; i < (int)sizeof(g_payload); i++)
+    {
+        g_payload[i] = (UCHAR)(i * 7);
+    }
+
+    printf("name,iterations,ns_per_op,mib_per_s\n");
+    for (i = 0; i < (int)NUMBER_OF_BENCHMARKS; i++)
+    {
+        RESULT *result = &results[numberOfResults];
+
+        if ((filter != NULL) && (strstr(g_benchmarks[i].name, filter) == NULL))
+        {
+            continue;
+        }
+
+        if (run_benchmark(&g_benchmarks[i], runTime, repeat, result) != 0)
+        {
+            fprintf(stderr, "%s failed\n", g_benchmarks[i].name);
+            capture_close(&g_capture);
+            return 1;
+        }
+
+        printf("%s,%llu,%.2f,%.2f\n", result->name,
+               (unsigned long long)result->iterations,
+               result->nsPerOp, result->mbPerSec);
+        fflush(stdout);
+        numberOfResults++;
+    }
+
+    capture_close(&g_capture);
+
+    for (i = 0; i < numberOfResults; i++)
+    {
+        for (j = 0; j < numberOfBaseline; j++)
+        {
+            double change;
+
+            if (strcmp(results[i].name, baseline[j].name) != 0)
+            {
+                continue;
+            }
+
+            change = (baseline[j].nsPerOp == 0.0) ? 0.0 :
+                     100.0 * (results[i].nsPerOp - baseline[j].nsPerOp) /
+                     baseline[j].nsPerOp;
+            fprintf(stderr, "%-20s %12.2f %12.2f %+7.1f%%%s\n",
+                    results[i].name, baseline[j].nsPerOp,
+                    results[i].nsPerOp, change,
+                    (change > threshold) ? "  REGRESSION" : "");
+            if (change > threshold)
+            {
+                regressions++;
+            }
+            break;
+        }
+    }
+
+    return (regressions > 0) ? 2 : 0;
+}
@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include <sched.h>
+#include <stdlib.h>
+
+#include "capture.h"
+#include "USBPcapBuffer.h"
+#include "USBPcapCapture.h"
+#include "USBPcapTables.h"
+#include "USBPcapURB.h"
+
+static NTSTATUS capture_read_completion(PDEVICE_OBJECT device, PIRP irp,
+                                        PVOID context)
+{
+    PPORTABLE_CAPTURE capture = (PPORTABLE_CAPTURE)context;
+
+    UNREFERENCED_PARAMETER(device);
+    UNREFERENCED_PARAMETER(irp);
+
+    InterlockedExchange(&capture->readCompleted, 1);
+    return STATUS_SUCCESS;
+}
+
+int capture_open(PPORTABLE_CAPTURE capture, UINT32 bufferSize, USHORT bus)
+{
+    PUSBPCAP_ROOTHUB_DATA  root = &capture->root;
+    USBPCAP_ADDRESS_FILTER filter;
+
+    memset(capture, 0, sizeof(PORTABLE_CAPTURE));
+
+    KeInitializeSpinLock(&root->bufferLock);
+    KeInitializeSpinLock(&root->filterLock);
+    KeInitializeSpinLock(&root->samplingLock);
+    root->snaplen = USBPCAP_DEFAULT_SNAP_LEN;
+    root->refCount = 1L;
+    root->samplingSnapshot[0].sampling.samplingInterval = 1;
+    root->busId = bus;
+    root->controlDevice = &capture->controlObject;
+
+    capture->rootHubData.pRootData = root;
+    capture->rootHubData.isHub = TRUE;
+    capture->rootHubExt.deviceMagic = USBPCAP_MAGIC_ROOTHUB;
+    capture->rootHubExt.pThisDevObj = &capture->rootHubObject;
+    capture->rootHubExt.context.usb.pDeviceData = &capture->rootHubData;
+    capture->rootHubObject.DeviceExtension = &capture->rootHubExt;
+
+    capture->controlExt.deviceMagic = USBPCAP_MAGIC_CONTROL;
+    capture->controlExt.pThisDevObj = &capture->controlObject;
+    capture->controlExt.context.control.id = bus;
+    capture->controlExt.context.control.pRootHubObject = &capture->rootHubObject;
+    capture->controlExt.context.control.pCaptureObject = &capture->file;
+    InitializeListHead(&capture->controlExt.context.control.lePendIrp);
+    KeInitializeSpinLock(&capture->controlExt.context.control.csqSpinLock);
+    IoCsqInitialize(&capture->controlExt.context.control.ioCsq,
+                    DkCsqInsertIrp, DkCsqRemoveIrp, DkCsqPeekNextIrp,
+                    DkCsqAcquireLock, DkCsqReleaseLock,
+                    DkCsqCompleteCanceledIrp);
+    capture->controlObject.DeviceExtension = &capture->controlExt;
+
+    USBPcapInitializeURBDispatch();
+    USBPcapInitializeIsochScratch();
+
+    capture->readIrp = IoAllocateIrp(1, FALSE);
+    if (capture->readIrp == NULL)
+    {
+        return -1;
+    }
+
+    if (!NT_SUCCESS(USBPcapSetUpBuffer(root, bufferSize)))
+    {
+        IoFreeIrp(capture->readIrp);
+        return -1;
+    }
+
+    memset(&filter, 0, sizeof(filter));
+    filter.filterAll = TRUE;
+    USBPcapSetAddressFilter(root, &filter);
+
+    return 0;
+}
+
+void capture_close(PPORTABLE_CAPTURE capture)
+{
+    USBPcapBufferRemoveBuffer(&capture->controlExt);
+    IoFreeIrp(capture->readIrp);
+    capture->readIrp = NULL;
+}
+
+PUSBPCAP_DEVICE_DATA capture_add_device(PPORTABLE_CAPTURE capture,
+                                        USHORT address)
+{
+    PUSBPCAP_DEVICE_DATA device;
+
+    device = (PUSBPCAP_DEVICE_DATA)calloc(1, sizeof(USBPCAP_DEVICE_DATA));
+    if (device == NULL)
+    {
+        return NULL;
+    }
+
+    device->pRootData = &capture->root;
+    device->properData = TRUE;
+    device->deviceAddress = address;
+    device->parentPort = address;
+    KeInitializeSpinLock(&device->tablesSpinLock);
+    KeInitializeSpinLock(&device->bucketLock);
+    device->endpointTable = USBPcapInitializeEndpointTable(NULL);
+    device->URBIrpTable = USBPcapInitializeURBIRPInfoTable(NULL);
+    if ((device->endpointTable == NULL) || (device->URBIrpTable == NULL))
+    {
+        capture_remove_device(device);
+        return NULL;
+    }
+
+    USBPcapCaptureNewDevice(&capture->root, address);
+
+    return device;
+}
+
+void capture_remove_device(PUSBPCAP_DEVICE_DATA device)
+{
+    if (device->endpointTable != NULL)
+    {
+        USBPcapFreeEndpointTable(device->endpointTable);
+    }
+    if (device->URBIrpTable != NULL)
+    {
+        USBPcapFreeURBIRPInfoTable(device->URBIrpTable);
+    }
+    if (device->descriptor != NULL)
+    {
+        ExFreePool(device->descriptor);
+    }
+    free(device);
+}
+
+UINT32 capture_read(PPORTABLE_CAPTURE capture, PVOID buffer, UINT32 length)
+{
+    PIRP                irp = capture->readIrp;
+    PIO_STACK_LOCATION  stack;
+    MDL                 mdl;
+    UINT32              bytes;
+    NTSTATUS            status;
+
+    memset(&mdl, 0, sizeof(mdl));
+    mdl.MappedSystemVa = buffer;
+    mdl.ByteCount = length;
+
+    irp->MdlAddress = &mdl;
+    irp->IoStatus.Status = STATUS_PENDING;
+    irp->IoStatus.Information = 0;
+    irp->PendingReturned = FALSE;
+    stack = IoGetCurrentIrpStackLocation(irp);
+    stack->MajorFunction = IRP_MJ_READ;
+    stack->Parameters.Read.Length = length;
+    stack->FileObject = &capture->file;
+    IoSetCompletionRoutine(irp, capture_read_completion, capture,
+                           TRUE, TRUE, TRUE);
+    capture->readCompleted = 0;
+
+    status = USBPcapBufferHandleReadIrp(irp, &capture->controlExt, &bytes);
+    if (status != STATUS_PENDING)
+    {
+        return NT_SUCCESS(status) ? bytes : 0;
+    }
+
+    /* Take the IRP back unless writer is already completing it */
+    if (IoCsqRemoveNextIrp(&capture->controlExt.context.control.ioCsq,
+                           &capture->file) == irp)
+    {
+        return 0;
+    }
+
+    while (InterlockedCompareExchange(&capture->readCompleted, 0, 0) == 0)
+    {
+        sched_yield();
+    }
+
+    return NT_SUCCESS(irp->IoStatus.Status) ?
+           (UINT32)irp->IoStatus.Information : 0;
+}
+
+void capture_get_statistics(PPORTABLE_CAPTURE capture,
+                            PUSBPCAP_STATISTICS statistics)
+{
+    PUSBPCAP_ROOTHUB_DATA root = &capture->root;
+
+    statistics->irpInfoEvicted =
+        (UINT32)InterlockedCompareExchange(&root->irpInfoEvicted, 0, 0);
+    statistics->bpfRejected =
+        (UINT32)InterlockedCompareExchange(&root->bpfRejected, 0, 0);
+    statistics->samplingSkipped =
+        (UINT32)InterlockedCompareExchange(&root->samplingSkipped, 0, 0);
+    statistics->rateLimited =
+        (UINT32)InterlockedCompareExchange(&root->rateLimited, 0, 0);
+    statistics->matchRejected =
+        (UINT32)InterlockedCompareExchange(&root->matchRejected, 0, 0);
+    statistics->bufferFull =
+        (UINT32)InterlockedCompareExchange(&root->bufferFull, 0, 0);
+}
+
+void record_counter_update(PRECORD_COUNTER counter,
+                           const UCHAR *data, UINT32 length)
+{
+    if (!counter->started)
+    {
+        counter->started = TRUE;
+        counter->skip = sizeof(pcap_hdr_t);
+    }
+
+    while (length > 0)
+    {
+        UINT32 tmp;
+
+        if (counter->skip > 0)
+        {
+            tmp = min(counter->skip, length);
+            counter->skip -= tmp;
+            data += tmp;
+            length -= tmp;
+            continue;
+        }
+
+        tmp = min((UINT32)sizeof(pcaprec_hdr_t) - counter->have, length);
+        memcpy(&counter->header[counter->have], data, tmp);
+        counter->have += tmp;
+        data += tmp;
+        length -= tmp;
+
+        if (counter->have == sizeof(pcaprec_hdr_t))
+        {
+            pcaprec_hdr_t *header = (pcaprec_hdr_t *)counter->header;
+
+            counter->records++;
+            counter->skip = header->incl_len;
+            counter->have = 0;
+        }
+    }
+}
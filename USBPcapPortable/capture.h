@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_PORTABLE_CAPTURE_H
+#define USBPCAP_PORTABLE_CAPTURE_H
+
+#include "USBPcapMain.h"
+
+/* Root Hub filter with control device, set up the same way as
+ * USBPcapFilterManager.c does it.
+ */
+typedef struct _PORTABLE_CAPTURE
+{
+    USBPCAP_ROOTHUB_DATA  root;
+    USBPCAP_DEVICE_DATA   rootHubData;
+    DEVICE_OBJECT         rootHubObject;
+    DEVICE_EXTENSION      rootHubExt;
+    DEVICE_OBJECT         controlObject;
+    DEVICE_EXTENSION      controlExt;
+    FILE_OBJECT           file;
+
+    /* Read IRP. Only one thread can read at a time. */
+    PIRP                  readIrp;
+    volatile LONG         readCompleted;
+} PORTABLE_CAPTURE, *PPORTABLE_CAPTURE;
+
+/* Creates the filter with bufferSize bytes buffer capturing all devices.
+ * Returns 0 on success.
+ */
+int capture_open(PPORTABLE_CAPTURE capture, UINT32 bufferSize, USHORT bus);
+void capture_close(PPORTABLE_CAPTURE capture);
+
+/* Returns device data for device with given address, as if the device
+ * was attached below the Root Hub.
+ */
+PUSBPCAP_DEVICE_DATA capture_add_device(PPORTABLE_CAPTURE capture,
+                                        USHORT address);
+void capture_remove_device(PUSBPCAP_DEVICE_DATA device);
+
+/* Reads captured data the same way as ReadFile() on control device.
+ * Returns number of bytes read, 0 if there was no data.
+ */
+UINT32 capture_read(PPORTABLE_CAPTURE capture, PVOID buffer, UINT32 length);
+
+/* Same values as returned by IOCTL_USBPCAP_GET_STATISTICS */
+void capture_get_statistics(PPORTABLE_CAPTURE capture,
+                            PUSBPCAP_STATISTICS statistics);
+
+/* Counts pcap records in captured byte stream that can be split at any
+ * position. Zero initialized counter expects pcap global header first.
+ */
+typedef struct _RECORD_COUNTER
+{
+    UINT64  records;
+    UINT32  skip;       /* bytes left in current record or global header */
+    UINT32  have;       /* bytes of record header collected */
+    BOOLEAN started;
+    UCHAR   header[16]; /* pcaprec_hdr_t */
+} RECORD_COUNTER, *PRECORD_COUNTER;
+
+void record_counter_update(PRECORD_COUNTER counter,
+                           const UCHAR *data, UINT32 length);
+
+#endif /* USBPCAP_PORTABLE_CAPTURE_H */
@@ -0,0 +1,1306 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * usbpcap-column - exports DLT_USBPCAP captures to chunked columnar
+ * files and runs aggregate queries over many of them in parallel.
+ *
+ * Column file layout (host byte order):
+ *   COLUMN_HEADER
+ *   chunk data                    for every chunk, columns one after
+ *                                 another, each 8 byte aligned
+ *   COLUMN_CHUNK  chunks[numberOfChunks]
+ *
+ * Every chunk holds up to chunkRecords records. Fixed width columns are
+ * the record timestamp and lengths and the USBPcap packet header fields.
+ * The payload column is blob of everything after the base USBPcap header
+ * (extra header of control and isochronous records, then data) with
+ * payload offsets column of count + 1 entries, so the records can be
+ * rebuilt exactly. Records without valid USBPcap header have headerLen
+ * 0 and whole record in the payload column.
+ *
+ * COLUMN_CHUNK keeps min/max of the filtered columns, so queries skip
+ * chunks that cannot match without touching their columns.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pcapscan.h"
+
+#define COLUMN_MAGIC          "USBPCCOL"
+#define COLUMN_VERSION        1
+#define COLUMN_SUFFIX         ".ucol"
+#define DEFAULT_CHUNK_RECORDS 65536
+/* Chunk is closed early when its payload grows over this */
+#define CHUNK_PAYLOAD_LIMIT   (64 * 1024 * 1024)
+#define MAX_THREADS           64
+#define MAX_PREFIX            64
+
+#define NSEC_PER_SEC          1000000000ULL
+
+typedef enum _COLUMN
+{
+    COLUMN_TIMESTAMP,       /* UINT64, ns since Unix epoch */
+    COLUMN_IRP_ID,          /* UINT64 */
+    COLUMN_PAYLOAD_OFFSET,  /* UINT64, count + 1 entries */
+    COLUMN_STATUS,          /* INT32 */
+    COLUMN_ORIG_LENGTH,     /* UINT32 */
+    COLUMN_DATA_LENGTH,     /* UINT32 */
+    COLUMN_HEADER_LENGTH,   /* USHORT */
+    COLUMN_FUNCTION,        /* USHORT */
+    COLUMN_BUS,             /* USHORT */
+    COLUMN_DEVICE,          /* USHORT */
+    COLUMN_INFO,            /* UCHAR */
+    COLUMN_ENDPOINT,        /* UCHAR */
+    COLUMN_TRANSFER,        /* UCHAR */
+    COLUMN_PAYLOAD,         /* payloadSize bytes */
+    NUMBER_OF_COLUMNS
+} COLUMN;
+
+static const UINT32 column_width[NUMBER_OF_COLUMNS] =
+{
+    8, 8, 8, 4, 4, 4, 2, 2, 2, 2, 1, 1, 1, 1
+};
+
+typedef struct _COLUMN_HEADER
+{
+    char    magic[8];
+    UINT32  version;
+    UINT32  chunkRecords;
+    UINT64  numberOfRecords;
+    UINT64  numberOfChunks;
+    UINT64  chunksOffset;
+    UINT64  captureSize;
+    UINT32  snaplen;
+    UINT32  nanoseconds;      /* capture had nanosecond resolution */
+} COLUMN_HEADER;
+
+typedef struct _COLUMN_CHUNK
+{
+    UINT64  offset;           /* chunk data offset in file */
+    UINT64  columns[NUMBER_OF_COLUMNS];  /* relative to chunk offset */
+    UINT64  payloadSize;
+    UINT32  count;
+    UINT32  errors;           /* records with USBD error status */
+    UINT64  minTimestamp;
+    UINT64  maxTimestamp;
+    UINT64  minIrpId;
+    UINT64  maxIrpId;
+    UINT32  minDataLength;
+    UINT32  maxDataLength;
+    USHORT  minBus;
+    USHORT  maxBus;
+    USHORT  minDevice;
+    USHORT  maxDevice;
+    UCHAR   minEndpoint;
+    UCHAR   maxEndpoint;
+    UCHAR   minTransfer;
+    UCHAR   maxTransfer;
+} COLUMN_CHUNK;
+
+/* Columns of chunk being exported or queried */
+typedef struct _CHUNK_DATA
+{
+    UINT64        *timestamp;
+    UINT64        *irpId;
+    UINT64        *payloadOffset;
+    INT32         *status;
+    UINT32        *origLen;
+    UINT32        *dataLength;
+    USHORT        *headerLen;
+    USHORT        *function;
+    USHORT        *bus;
+    USHORT        *device;
+    UCHAR         *info;
+    UCHAR         *endpoint;
+    UCHAR         *transfer;
+    UCHAR         *payload;
+} CHUNK_DATA;
+
+typedef enum _GROUP
+{
+    GROUP_NONE,
+    GROUP_FILE,
+    GROUP_DEVICE,
+    GROUP_ENDPOINT,
+    GROUP_TRANSFER,
+    GROUP_STATUS,
+    GROUP_FUNCTION
+} GROUP;
+
+typedef struct _QUERY
+{
+    SCAN_FILTER  filter;       /* from and to relative to first record */
+    UCHAR        prefix[MAX_PREFIX];
+    UINT32       prefixLength; /* 0 if payload is not filtered */
+    GROUP        group;
+    BOOLEAN      verbose;
+} QUERY;
+
+typedef struct _AGGREGATE
+{
+    UINT64   key;
+    UINT64   records;
+    UINT64   bytes;            /* sum of dataLength */
+    UINT64   errors;
+    UINT64   first;
+    UINT64   last;
+} AGGREGATE;
+
+typedef struct _AGGREGATE_TABLE
+{
+    AGGREGATE  *slots;
+    BOOLEAN    *used;
+    UINT64      mask;
+    UINT64      count;
+} AGGREGATE_TABLE;
+
+typedef struct _WORKER
+{
+    pthread_t         thread;
+    const QUERY      *query;
+    char * const     *files;
+    int               numberOfFiles;
+    volatile int     *next;        /* next file to process */
+    AGGREGATE_TABLE   table;
+    UINT64            chunks;
+    UINT64            skipped;
+    int               failed;
+} WORKER;
+
+static void column_name(char *name, size_t length, const char *capture)
+{
+    snprintf(name, length, "%s%s", capture, COLUMN_SUFFIX);
+}
+
+static void *checked_malloc(size_t size)
+{
+    void *p = malloc(size);
+
+    if (p == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+/* Points data at the columns of chunk */
+static void chunk_columns(CHUNK_DATA *data, UCHAR *base, const UINT64 *columns)
+{
+    data->timestamp = (UINT64 *)(base + columns[COLUMN_TIMESTAMP]);
+    data->irpId = (UINT64 *)(base + columns[COLUMN_IRP_ID]);
+    data->payloadOffset = (UINT64 *)(base + columns[COLUMN_PAYLOAD_OFFSET]);
+    data->status = (INT32 *)(base + columns[COLUMN_STATUS]);
+    data->origLen = (UINT32 *)(base + columns[COLUMN_ORIG_LENGTH]);
+    data->dataLength = (UINT32 *)(base + columns[COLUMN_DATA_LENGTH]);
+    data->headerLen = (USHORT *)(base + columns[COLUMN_HEADER_LENGTH]);
+    data->function = (USHORT *)(base + columns[COLUMN_FUNCTION]);
+    data->bus = (USHORT *)(base + columns[COLUMN_BUS]);
+    data->device = (USHORT *)(base + columns[COLUMN_DEVICE]);
+    data->info = (UCHAR *)(base + columns[COLUMN_INFO]);
+    data->endpoint = (UCHAR *)(base + columns[COLUMN_ENDPOINT]);
+    data->transfer = (UCHAR *)(base + columns[COLUMN_TRANSFER]);
+    data->payload = (UCHAR *)(base + columns[COLUMN_PAYLOAD]);
+}
+
+/* Column offsets of chunk with count records, returns chunk data size */
+static UINT64 chunk_layout(UINT64 *columns, UINT32 count, UINT64 payloadSize)
+{
+    UINT64 offset = 0;
+    int    c;
+
+    for (c = 0; c < NUMBER_OF_COLUMNS; c++)
+    {
+        UINT64 entries = count;
+
+        if (c == COLUMN_PAYLOAD_OFFSET)
+        {
+            entries++;
+        }
+        else if (c == COLUMN_PAYLOAD)
+        {
+            entries = payloadSize;
+        }
+        columns[c] = offset;
+        offset = (offset + entries * column_width[c] + 7) & ~7ULL;
+    }
+    return offset;
+}
+
+static void chunk_stats(COLUMN_CHUNK *chunk, const CHUNK_DATA *data)
+{
+    UINT32 i;
+
+    chunk->errors = 0;
+    chunk->minTimestamp = chunk->minIrpId = ~0ULL;
+    chunk->maxTimestamp = chunk->maxIrpId = 0;
+    chunk->minDataLength = 0xFFFFFFFF;
+    chunk->maxDataLength = 0;
+    chunk->minBus = chunk->minDevice = 0xFFFF;
+    chunk->maxBus = chunk->maxDevice = 0;
+    chunk->minEndpoint = chunk->minTransfer = 0xFF;
+    chunk->maxEndpoint = chunk->maxTransfer = 0;
+
+    for (i = 0; i < chunk->count; i++)
+    {
+        chunk->errors += USBD_ERROR(data->status[i]) ? 1 : 0;
+        chunk->minTimestamp = min(chunk->minTimestamp, data->timestamp[i]);
+        chunk->maxTimestamp = max(chunk->maxTimestamp, data->timestamp[i]);
+        chunk->minIrpId = min(chunk->minIrpId, data->irpId[i]);
+        chunk->maxIrpId = max(chunk->maxIrpId, data->irpId[i]);
+        chunk->minDataLength = min(chunk->minDataLength, data->dataLength[i]);
+        chunk->maxDataLength = max(chunk->maxDataLength, data->dataLength[i]);
+        chunk->minBus = min(chunk->minBus, data->bus[i]);
+        chunk->maxBus = max(chunk->maxBus, data->bus[i]);
+        chunk->minDevice = min(chunk->minDevice, data->device[i]);
+        chunk->maxDevice = max(chunk->maxDevice, data->device[i]);
+        chunk->minEndpoint = min(chunk->minEndpoint, data->endpoint[i]);
+        chunk->maxEndpoint = max(chunk->maxEndpoint, data->endpoint[i]);
+        chunk->minTransfer = min(chunk->minTransfer, data->transfer[i]);
+        chunk->maxTransfer = max(chunk->maxTransfer, data->transfer[i]);
+    }
+}
+
+/* Export state, chunk columns are assembled in buffer */
+typedef struct _EXPORTER
+{
+    FILE          *file;
+    UINT64         position;
+    UINT32         chunkRecords;
+    UCHAR         *buffer;
+    UINT64         bufferSize;
+    UINT64         columns[NUMBER_OF_COLUMNS];  /* in buffer, for chunkRecords */
+    CHUNK_DATA     data;
+    UCHAR         *payload;     /* grows up to about CHUNK_PAYLOAD_LIMIT */
+    UINT64         payloadSize;
+    UINT64         payloadCapacity;
+    UINT32         count;
+    COLUMN_CHUNK  *chunks;
+    UINT64         numberOfChunks;
+    UINT64         chunksCapacity;
+    UINT64         numberOfRecords;
+} EXPORTER;
+
+static void exporter_pad(EXPORTER *exporter, UINT64 offset)
+{
+    static const UCHAR zero[8];
+
+    if (offset > exporter->position)
+    {
+        fwrite(zero, 1, (size_t)(offset - exporter->position), exporter->file);
+        exporter->position = offset;
+    }
+}
+
+static void exporter_write(EXPORTER *exporter, const void *data, UINT64 length)
+{
+    fwrite(data, 1, (size_t)length, exporter->file);
+    exporter->position += length;
+}
+
+static void exporter_flush(EXPORTER *exporter)
+{
+    COLUMN_CHUNK *chunk;
+    UINT64        start;
+    int           c;
+
+    if (exporter->count == 0)
+    {
+        return;
+    }
+
+    if (exporter->numberOfChunks == exporter->chunksCapacity)
+    {
+        exporter->chunksCapacity = max(exporter->chunksCapacity * 2, 64ULL);
+        exporter->chunks = (COLUMN_CHUNK *)realloc(exporter->chunks,
+                           (size_t)exporter->chunksCapacity * sizeof(COLUMN_CHUNK));
+        if (exporter->chunks == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    chunk = &exporter->chunks[exporter->numberOfChunks++];
+    memset(chunk, 0, sizeof(COLUMN_CHUNK));
+
+    start = (exporter->position + 7) & ~7ULL;
+    exporter_pad(exporter, start);
+    chunk->offset = start;
+    chunk->count = exporter->count;
+    chunk->payloadSize = exporter->payloadSize;
+    chunk_layout(chunk->columns, exporter->count, exporter->payloadSize);
+    chunk_stats(chunk, &exporter->data);
+
+    for (c = 0; c < NUMBER_OF_COLUMNS; c++)
+    {
+        const UCHAR *source;
+        UINT64       length;
+
+        if (c == COLUMN_PAYLOAD)
+        {
+            source = exporter->payload;
+            length = exporter->payloadSize;
+        }
+        else
+        {
+            source = exporter->buffer + exporter->columns[c];
+            length = (UINT64)(exporter->count + ((c == COLUMN_PAYLOAD_OFFSET) ? 1 : 0)) *
+                     column_width[c];
+        }
+        exporter_pad(exporter, start + chunk->columns[c]);
+        exporter_write(exporter, source, length);
+    }
+
+    exporter->numberOfRecords += exporter->count;
+    exporter->count = 0;
+    exporter->payloadSize = 0;
+}
+
+static void exporter_payload(EXPORTER *exporter, const UCHAR *data, UINT64 length)
+{
+    if (exporter->payloadSize + length > exporter->payloadCapacity)
+    {
+        exporter->payloadCapacity = max(exporter->payloadCapacity * 2,
+                                        exporter->payloadSize + length);
+        exporter->payload = (UCHAR *)realloc(exporter->payload,
+                                             (size_t)exporter->payloadCapacity);
+        if (exporter->payload == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(&exporter->payload[exporter->payloadSize], data, (size_t)length);
+    exporter->payloadSize += length;
+}
+
+/* Batch always fits, chunkRecords is multiple of SCAN_BATCH_RECORDS */
+static void exporter_batch(EXPORTER *exporter, const PCAP_FILE *file,
+                           const SCAN_BATCH *batch)
+{
+    CHUNK_DATA  *data = &exporter->data;
+    const UINT32 n = exporter->count;
+    const UINT32 count = batch->count;
+    UINT32       i;
+
+    memcpy(&data->timestamp[n], batch->timestamp, count * sizeof(UINT64));
+    memcpy(&data->irpId[n], batch->irpId, count * sizeof(UINT64));
+    memcpy(&data->status[n], batch->status, count * sizeof(INT32));
+    memcpy(&data->origLen[n], batch->origLen, count * sizeof(UINT32));
+    memcpy(&data->dataLength[n], batch->dataLength, count * sizeof(UINT32));
+    memcpy(&data->headerLen[n], batch->headerLen, count * sizeof(USHORT));
+    memcpy(&data->function[n], batch->function, count * sizeof(USHORT));
+    memcpy(&data->bus[n], batch->bus, count * sizeof(USHORT));
+    memcpy(&data->device[n], batch->device, count * sizeof(USHORT));
+    memcpy(&data->info[n], batch->info, count);
+    memcpy(&data->endpoint[n], batch->endpoint, count);
+    memcpy(&data->transfer[n], batch->transfer, count);
+
+    for (i = 0; i < count; i++)
+    {
+        const UCHAR *record = &file->data[batch->offset[i] + sizeof(pcaprec_hdr_t)];
+        UINT32       skip = (batch->headerLen[i] != 0) ?
+                            sizeof(USBPCAP_BUFFER_PACKET_HEADER) : 0;
+
+        data->payloadOffset[n + i] = exporter->payloadSize;
+        exporter_payload(exporter, record + skip, batch->inclLen[i] - skip);
+    }
+    data->payloadOffset[n + count] = exporter->payloadSize;
+    exporter->count += count;
+
+    if ((exporter->count == exporter->chunkRecords) ||
+        (exporter->payloadSize >= CHUNK_PAYLOAD_LIMIT))
+    {
+        exporter_flush(exporter);
+    }
+}
+
+static int column_export(const char *captureName, const char *columnName,
+                         UINT32 chunkRecords)
+{
+    PCAP_FILE      file;
+    SCANNER        scanner;
+    SCAN_BATCH    *batch;
+    EXPORTER       exporter;
+    COLUMN_HEADER  header;
+    char           error[256];
+    char           tmpName[4096 + sizeof(".tmp")];
+    int            ret = 0;
+
+    if (pcap_open(&file, captureName, error, sizeof(error)) != 0)
+    {
+        fprintf(stderr, "%s\n", error);
+        return -1;
+    }
+    if (file.network != DLT_USBPCAP)
+    {
+        fprintf(stderr, "%s: link type %u is not DLT_USBPCAP\n",
+                captureName, file.network);
+        pcap_close(&file);
+        return -1;
+    }
+
+    snprintf(tmpName, sizeof(tmpName), "%s.tmp", columnName);
+    memset(&exporter, 0, sizeof(exporter));
+    exporter.file = fopen(tmpName, "wb");
+    if (exporter.file == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", tmpName, strerror(errno));
+        pcap_close(&file);
+        return -1;
+    }
+
+    exporter.chunkRecords = chunkRecords;
+    exporter.bufferSize = chunk_layout(exporter.columns, chunkRecords, 0);
+    exporter.buffer = (UCHAR *)checked_malloc((size_t)exporter.bufferSize);
+    chunk_columns(&exporter.data, exporter.buffer, exporter.columns);
+    batch = (SCAN_BATCH *)checked_malloc(sizeof(SCAN_BATCH));
+
+    /* Header is written again when the directory is known */
+    memset(&header, 0, sizeof(header));
+    exporter_write(&exporter, &header, sizeof(header));
+
+    scan_init(&scanner, &file, PCAP_FIRST_RECORD, file.size);
+    while (scan_next(&scanner, batch) > 0)
+    {
+        exporter_batch(&exporter, &file, batch);
+    }
+    exporter_flush(&exporter);
+    if (scanner.corrupted)
+    {
+        fprintf(stderr, "%s: invalid record at offset %llu, "
+                "records after it are not exported\n", captureName,
+                (unsigned long long)scanner.offset);
+        ret = -1;
+    }
+
+    exporter_pad(&exporter, (exporter.position + 7) & ~7ULL);
+    header.version = COLUMN_VERSION;
+    header.chunkRecords = chunkRecords;
+    header.numberOfRecords = exporter.numberOfRecords;
+    header.numberOfChunks = exporter.numberOfChunks;
+    header.chunksOffset = exporter.position;
+    header.captureSize = file.size;
+    header.snaplen = file.snaplen;
+    header.nanoseconds = file.nanoseconds;
+    exporter_write(&exporter, exporter.chunks,
+                   exporter.numberOfChunks * sizeof(COLUMN_CHUNK));
+    /* Magic goes last */
+    memcpy(header.magic, COLUMN_MAGIC, sizeof(header.magic));
+
+    if ((fseek(exporter.file, 0, SEEK_SET) != 0) ||
+        (fwrite(&header, 1, sizeof(header), exporter.file) != sizeof(header)) ||
+        (fclose(exporter.file) != 0) ||
+        (rename(tmpName, columnName) != 0))
+    {
+        fprintf(stderr, "%s: %s\n", columnName, strerror(errno));
+        unlink(tmpName);
+        ret = -1;
+    }
+    else
+    {
+        fprintf(stderr, "%s: %llu records, %llu chunks\n", columnName,
+                (unsigned long long)exporter.numberOfRecords,
+                (unsigned long long)exporter.numberOfChunks);
+    }
+
+    free(batch);
+    free(exporter.buffer);
+    free(exporter.payload);
+    free(exporter.chunks);
+    pcap_close(&file);
+    return ret;
+}
+
+static BOOLEAN aggregate_init(AGGREGATE_TABLE *table, UINT64 capacity)
+{
+    table->slots = (AGGREGATE *)calloc((size_t)capacity, sizeof(AGGREGATE));
+    table->used = (BOOLEAN *)calloc((size_t)capacity, sizeof(BOOLEAN));
+    table->mask = capacity - 1;
+    table->count = 0;
+    return ((table->slots != NULL) && (table->used != NULL)) ? TRUE : FALSE;
+}
+
+static void aggregate_free(AGGREGATE_TABLE *table)
+{
+    free(table->slots);
+    free(table->used);
+}
+
+static AGGREGATE *aggregate_get(AGGREGATE_TABLE *table, UINT64 key)
+{
+    UINT64 slot = ((key * 0x9E3779B97F4A7C15ULL) >> 20) & table->mask;
+
+    while (table->used[slot])
+    {
+        if (table->slots[slot].key == key)
+        {
+            return &table->slots[slot];
+        }
+        slot = (slot + 1) & table->mask;
+    }
+
+    if (table->count >= (table->mask + 1) / 2)
+    {
+        AGGREGATE_TABLE larger;
+        UINT64          i;
+
+        if (!aggregate_init(&larger, (table->mask + 1) * 2))
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        for (i = 0; i <= table->mask; i++)
+        {
+            if (table->used[i])
+            {
+                *aggregate_get(&larger, table->slots[i].key) = table->slots[i];
+            }
+        }
+        aggregate_free(table);
+        *table = larger;
+        return aggregate_get(table, key);
+    }
+
+    table->used[slot] = TRUE;
+    table->count++;
+    memset(&table->slots[slot], 0, sizeof(AGGREGATE));
+    table->slots[slot].key = key;
+    table->slots[slot].first = ~0ULL;
+    return &table->slots[slot];
+}
+
+static void aggregate_merge(AGGREGATE *to, const AGGREGATE *from)
+{
+    to->records += from->records;
+    to->bytes += from->bytes;
+    to->errors += from->errors;
+    to->first = min(to->first, from->first);
+    to->last = max(to->last, from->last);
+}
+
+static BOOLEAN chunk_may_match(const COLUMN_CHUNK *chunk, const SCAN_FILTER *filter)
+{
+    if ((filter->bus >= 0) &&
+        ((filter->bus < chunk->minBus) || (filter->bus > chunk->maxBus)))
+    {
+        return FALSE;
+    }
+    if ((filter->device >= 0) &&
+        ((filter->device < chunk->minDevice) || (filter->device > chunk->maxDevice)))
+    {
+        return FALSE;
+    }
+    if ((filter->endpoint >= 0) &&
+        ((filter->endpoint < chunk->minEndpoint) ||
+         (filter->endpoint > chunk->maxEndpoint)))
+    {
+        return FALSE;
+    }
+    if ((filter->transfer >= 0) &&
+        ((filter->transfer < chunk->minTransfer) ||
+         (filter->transfer > chunk->maxTransfer)))
+    {
+        return FALSE;
+    }
+    if (filter->errors && (chunk->errors == 0))
+    {
+        return FALSE;
+    }
+    if (filter->hasIrp &&
+        ((filter->irpId < chunk->minIrpId) || (filter->irpId > chunk->maxIrpId)))
+    {
+        return FALSE;
+    }
+    if ((filter->from > chunk->maxTimestamp) || (filter->to < chunk->minTimestamp))
+    {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static UINT64 group_key(GROUP group, const CHUNK_DATA *data, UINT32 i,
+                        int fileIndex)
+{
+    switch (group)
+    {
+        case GROUP_FILE:
+            return (UINT64)fileIndex;
+        case GROUP_DEVICE:
+            return ((UINT64)data->bus[i] << 16) | data->device[i];
+        case GROUP_ENDPOINT:
+            return ((UINT64)data->bus[i] << 24) | ((UINT64)data->device[i] << 8) |
+                   data->endpoint[i];
+        case GROUP_TRANSFER:
+            return data->transfer[i];
+        case GROUP_STATUS:
+            return (UINT32)data->status[i];
+        case GROUP_FUNCTION:
+            return data->function[i];
+        default:
+            return 0;
+    }
+}
+
+/* Copies columns used by the filter to batch, so the predicates of the
+ * column scanner can be used.
+ */
+static void batch_load(SCAN_BATCH *batch, const CHUNK_DATA *data, UINT32 first,
+                       UINT32 count, const SCAN_FILTER *filter)
+{
+    batch->count = count;
+    if (filter->transfer >= 0)
+    {
+        memcpy(batch->transfer, &data->transfer[first], count);
+    }
+    if (filter->endpoint >= 0)
+    {
+        memcpy(batch->endpoint, &data->endpoint[first], count);
+    }
+    if (filter->device >= 0)
+    {
+        memcpy(batch->device, &data->device[first], count * sizeof(USHORT));
+    }
+    if (filter->bus >= 0)
+    {
+        memcpy(batch->bus, &data->bus[first], count * sizeof(USHORT));
+    }
+    if (filter->errors)
+    {
+        memcpy(batch->status, &data->status[first], count * sizeof(INT32));
+    }
+    if (filter->hasIrp)
+    {
+        memcpy(batch->irpId, &data->irpId[first], count * sizeof(UINT64));
+    }
+    if ((filter->from != 0) || (filter->to != ~0ULL))
+    {
+        memcpy(batch->timestamp, &data->timestamp[first], count * sizeof(UINT64));
+    }
+}
+
+static BOOLEAN payload_matches(const QUERY *query, const CHUNK_DATA *data,
+                               UINT32 i)
+{
+    UINT64 start = data->payloadOffset[i];
+    UINT64 length = data->payloadOffset[i + 1] - start;
+
+    if (data->headerLen[i] == 0)
+    {
+        return FALSE;
+    }
+    /* Data follows the extra header */
+    start += data->headerLen[i] - sizeof(USBPCAP_BUFFER_PACKET_HEADER);
+    length -= min(length, (UINT64)(data->headerLen[i] -
+                                   sizeof(USBPCAP_BUFFER_PACKET_HEADER)));
+    return ((length >= query->prefixLength) &&
+            (memcmp(&data->payload[start], query->prefix, query->prefixLength) == 0)) ?
+           TRUE : FALSE;
+}
+
+/* Returns pointer to mapped column file, NULL if it is not valid */
+static const COLUMN_HEADER *column_map(const char *name, size_t *size)
+{
+    const COLUMN_HEADER *header;
+    const COLUMN_CHUNK  *chunks;
+    struct stat          st;
+    void                *map;
+    UINT64               i;
+    int                  fd;
+
+    fd = open(name, O_RDONLY);
+    if ((fd < 0) || (fstat(fd, &st) != 0) ||
+        ((UINT64)st.st_size < sizeof(COLUMN_HEADER)))
+    {
+        fprintf(stderr, "%s: %s\n", name,
+                (fd < 0) ? strerror(errno) : "not a valid column file");
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+    *size = (size_t)st.st_size;
+    map = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+
+    header = (const COLUMN_HEADER *)map;
+    if ((memcmp(header->magic, COLUMN_MAGIC, sizeof(header->magic)) != 0) ||
+        (header->version != COLUMN_VERSION) ||
+        (header->chunksOffset > *size) ||
+        (header->numberOfChunks > (*size - header->chunksOffset) / sizeof(COLUMN_CHUNK)))
+    {
+        fprintf(stderr, "%s: not a valid column file\n", name);
+        munmap(map, *size);
+        return NULL;
+    }
+
+    chunks = (const COLUMN_CHUNK *)((const UCHAR *)map + header->chunksOffset);
+    for (i = 0; i < header->numberOfChunks; i++)
+    {
+        UINT64 columns[NUMBER_OF_COLUMNS];
+        UINT64 length = chunk_layout(columns, chunks[i].count, chunks[i].payloadSize);
+
+        if ((chunks[i].offset > header->chunksOffset) ||
+            (length > header->chunksOffset - chunks[i].offset) ||
+            (memcmp(columns, chunks[i].columns, sizeof(columns)) != 0))
+        {
+            fprintf(stderr, "%s: chunk %llu is not valid\n", name,
+                    (unsigned long long)i);
+            munmap(map, *size);
+            return NULL;
+        }
+    }
+    return header;
+}
+
+static int query_file(WORKER *worker, const char *name, int fileIndex,
+                      SCAN_BATCH *batch)
+{
+    const QUERY         *query = worker->query;
+    const COLUMN_HEADER *header;
+    const COLUMN_CHUNK  *chunks;
+    SCAN_FILTER          filter = query->filter;
+    UINT64               mask[SCAN_BATCH_RECORDS / 64];
+    UINT64               first;
+    UINT64               i;
+    size_t               size;
+
+    header = column_map(name, &size);
+    if (header == NULL)
+    {
+        return -1;
+    }
+    chunks = (const COLUMN_CHUNK *)((const UCHAR *)header + header->chunksOffset);
+
+    /* Time range is relative to the first record of every file */
+    first = (header->numberOfChunks > 0) ? chunks[0].minTimestamp : 0;
+    for (i = 0; i < header->numberOfChunks; i++)
+    {
+        first = min(first, chunks[i].minTimestamp);
+    }
+    filter.from = (filter.from == 0) ? 0 : first + filter.from;
+    filter.to = (filter.to == ~0ULL) ? ~0ULL : first + filter.to;
+
+    for (i = 0; i < header->numberOfChunks; i++)
+    {
+        CHUNK_DATA data;
+        UINT32     start;
+
+        worker->chunks++;
+        if (!chunk_may_match(&chunks[i], &filter))
+        {
+            worker->skipped++;
+            continue;
+        }
+        chunk_columns(&data, (UCHAR *)header + chunks[i].offset, chunks[i].columns);
+
+        for (start = 0; start < chunks[i].count; start += SCAN_BATCH_RECORDS)
+        {
+            UINT32 count = min(chunks[i].count - start, (UINT32)SCAN_BATCH_RECORDS);
+            UINT32 word;
+
+            batch_load(batch, &data, start, count, &filter);
+            if (scan_filter(batch, &filter, mask) == 0)
+            {
+                continue;
+            }
+            for (word = 0; word < SCAN_BATCH_RECORDS / 64; word++)
+            {
+                UINT64 bits = mask[word];
+
+                while (bits != 0)
+                {
+                    UINT32     j = start + word * 64 + (UINT32)__builtin_ctzll(bits);
+                    AGGREGATE *aggregate;
+
+                    bits &= bits - 1;
+                    if ((query->prefixLength != 0) &&
+                        !payload_matches(query, &data, j))
+                    {
+                        continue;
+                    }
+
+                    aggregate = aggregate_get(&worker->table,
+                                              group_key(query->group, &data, j,
+                                                        fileIndex));
+                    aggregate->records++;
+                    aggregate->bytes += data.dataLength[j];
+                    aggregate->errors += USBD_ERROR(data.status[j]) ? 1 : 0;
+                    aggregate->first = min(aggregate->first, data.timestamp[j]);
+                    aggregate->last = max(aggregate->last, data.timestamp[j]);
+                }
+            }
+        }
+    }
+
+    munmap((void *)header, size);
+    return 0;
+}
+
+static void *query_thread(void *arg)
+{
+    WORKER     *worker = (WORKER *)arg;
+    SCAN_BATCH *batch = (SCAN_BATCH *)checked_malloc(sizeof(SCAN_BATCH));
+    int         index;
+
+    while ((index = __sync_fetch_and_add(worker->next, 1)) < worker->numberOfFiles)
+    {
+        if (query_file(worker, worker->files[index], index, batch) != 0)
+        {
+            worker->failed++;
+        }
+    }
+
+    free(batch);
+    return NULL;
+}
+
+static const char *transfer_names[] =
+{
+    "isochronous", "interrupt", "control", "bulk"
+};
+
+static int parse_transfer(const char *name)
+{
+    int transfer;
+
+    for (transfer = 0; transfer < 4; transfer++)
+    {
+        if (strcmp(transfer_names[transfer], name) == 0)
+        {
+            return transfer;
+        }
+    }
+    if (strcmp(name, "marker") == 0)
+    {
+        return USBPCAP_TRANSFER_FILTER_MARKER;
+    }
+    if (strcmp(name, "irp-info") == 0)
+    {
+        return USBPCAP_TRANSFER_IRP_INFO;
+    }
+    if (strcmp(name, "unknown") == 0)
+    {
+        return USBPCAP_TRANSFER_UNKNOWN;
+    }
+    return -1;
+}
+
+static const char *transfer_name(UCHAR transfer)
+{
+    switch (transfer)
+    {
+        case USBPCAP_TRANSFER_FILTER_MARKER:
+            return "marker";
+        case USBPCAP_TRANSFER_IRP_INFO:
+            return "irp-info";
+        case USBPCAP_TRANSFER_UNKNOWN:
+            return "unknown";
+        default:
+            return (transfer < 4) ? transfer_names[transfer] : "unknown";
+    }
+}
+
+static int parse_group(const char *name)
+{
+    static const char *groups[] =
+    {
+        "none", "file", "device", "endpoint", "transfer", "status", "function"
+    };
+    int group;
+
+    for (group = 0; group < (int)(sizeof(groups) / sizeof(groups[0])); group++)
+    {
+        if (strcmp(groups[group], name) == 0)
+        {
+            return group;
+        }
+    }
+    return -1;
+}
+
+static BOOLEAN parse_prefix(QUERY *query, const char *hex)
+{
+    size_t length = strlen(hex);
+    size_t i;
+
+    if ((length % 2 != 0) || (length / 2 > MAX_PREFIX) || (length == 0))
+    {
+        return FALSE;
+    }
+    for (i = 0; i < length / 2; i++)
+    {
+        unsigned value;
+
+        if (sscanf(&hex[i * 2], "%2x", &value) != 1)
+        {
+            return FALSE;
+        }
+        query->prefix[i] = (UCHAR)value;
+    }
+    query->prefixLength = (UINT32)(length / 2);
+    return TRUE;
+}
+
+static int compare_key(const void *a, const void *b)
+{
+    UINT64 x = ((const AGGREGATE *)a)->key;
+    UINT64 y = ((const AGGREGATE *)b)->key;
+
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+static void print_key(GROUP group, UINT64 key, char * const *files)
+{
+    switch (group)
+    {
+        case GROUP_FILE:
+            printf("%-40s", files[key]);
+            break;
+        case GROUP_DEVICE:
+            printf("%u:%-10u", (unsigned)(key >> 16), (unsigned)(key & 0xFFFF));
+            break;
+        case GROUP_ENDPOINT:
+            printf("%u:%u:0x%02X     ", (unsigned)(key >> 24),
+                   (unsigned)((key >> 8) & 0xFFFF), (unsigned)(key & 0xFF));
+            break;
+        case GROUP_TRANSFER:
+            printf("%-12s", transfer_name((UCHAR)key));
+            break;
+        case GROUP_STATUS:
+            printf("0x%08X  ", (unsigned)key);
+            break;
+        case GROUP_FUNCTION:
+            printf("0x%04X      ", (unsigned)key);
+            break;
+        default:
+            printf("%-12s", "total");
+            break;
+    }
+}
+
+static int column_query(const QUERY *query, char * const *files,
+                        int numberOfFiles, int threads)
+{
+    WORKER          *workers;
+    AGGREGATE_TABLE  total;
+    AGGREGATE       *sorted;
+    UINT64           chunks = 0;
+    UINT64           skipped = 0;
+    UINT64           count = 0;
+    UINT64           i;
+    volatile int     next = 0;
+    int              failed = 0;
+    int              k;
+
+    threads = min(threads, numberOfFiles);
+    workers = (WORKER *)calloc(threads, sizeof(WORKER));
+    if ((workers == NULL) || !aggregate_init(&total, 64))
+    {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+
+    for (k = 0; k < threads; k++)
+    {
+        workers[k].query = query;
+        workers[k].files = files;
+        workers[k].numberOfFiles = numberOfFiles;
+        workers[k].next = &next;
+        if (!aggregate_init(&workers[k].table, 64))
+        {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        pthread_create(&workers[k].thread, NULL, query_thread, &workers[k]);
+    }
+
+    for (k = 0; k < threads; k++)
+    {
+        pthread_join(workers[k].thread, NULL);
+        for (i = 0; i <= workers[k].table.mask; i++)
+        {
+            if (workers[k].table.used[i])
+            {
+                aggregate_merge(aggregate_get(&total, workers[k].table.slots[i].key),
+                                &workers[k].table.slots[i]);
+            }
+        }
+        chunks += workers[k].chunks;
+        skipped += workers[k].skipped;
+        failed += workers[k].failed;
+        aggregate_free(&workers[k].table);
+    }
+
+    sorted = (AGGREGATE *)checked_malloc((size_t)max(total.count, 1ULL) *
+                                         sizeof(AGGREGATE));
+    for (i = 0; i <= total.mask; i++)
+    {
+        if (total.used[i])
+        {
+            sorted[count++] = total.slots[i];
+        }
+    }
+    qsort(sorted, (size_t)count, sizeof(AGGREGATE), compare_key);
+
+    if (query->group == GROUP_FILE)
+    {
+        printf("%-40s", "file");
+    }
+    else
+    {
+        printf("%-12s", "group");
+    }
+    printf(" %12s %16s %10s %20s %20s\n", "records", "bytes", "errors",
+           "first", "last");
+    for (i = 0; i < count; i++)
+    {
+        print_key(query->group, sorted[i].key, files);
+        printf(" %12llu %16llu %10llu %20.6f %20.6f\n",
+               (unsigned long long)sorted[i].records,
+               (unsigned long long)sorted[i].bytes,
+               (unsigned long long)sorted[i].errors,
+               (double)sorted[i].first / NSEC_PER_SEC,
+               (double)sorted[i].last / NSEC_PER_SEC);
+    }
+    if (query->verbose)
+    {
+        fprintf(stderr, "%d files, %llu chunks, %llu skipped by statistics\n",
+                numberOfFiles, (unsigned long long)chunks,
+                (unsigned long long)skipped);
+    }
+
+    free(sorted);
+    aggregate_free(&total);
+    free(workers);
+    return (failed != 0) ? -1 : 0;
+}
+
+typedef struct _EXPORT_JOB
+{
+    pthread_t       thread;
+    char * const   *files;
+    int             numberOfFiles;
+    volatile int   *next;
+    UINT32          chunkRecords;
+    int             failed;
+} EXPORT_JOB;
+
+static void *export_thread(void *arg)
+{
+    EXPORT_JOB *job = (EXPORT_JOB *)arg;
+    char        name[4096];
+    int         index;
+
+    while ((index = __sync_fetch_and_add(job->next, 1)) < job->numberOfFiles)
+    {
+        column_name(name, sizeof(name), job->files[index]);
+        if (column_export(job->files[index], name, job->chunkRecords) != 0)
+        {
+            job->failed++;
+        }
+    }
+    return NULL;
+}
+
+static UINT64 parse_seconds(const char *text)
+{
+    return (UINT64)(strtod(text, NULL) * NSEC_PER_SEC + 0.5);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s export [-j threads] [-r records] <capture.pcap>...\n"
+            "       %s query [options] <capture.pcap%s>...\n"
+            "\n"
+            "Export writes capture.pcap%s next to every capture, -r sets\n"
+            "records per chunk (default %u).\n"
+            "\n"
+            "Query options:\n"
+            "  -j, --threads <n>       files queried in parallel\n"
+            "  -g, --group <by>        none, file, device, endpoint, transfer,\n"
+            "                          status or function\n"
+            "      --bus <n>           root hub number\n"
+            "  -d, --device <n>        device address\n"
+            "  -e, --endpoint <n>      endpoint address with direction bit\n"
+            "  -t, --transfer <type>   isochronous, interrupt, control, bulk,\n"
+            "                          marker, irp-info or unknown\n"
+            "  -E, --errors            records with USBD error status\n"
+            "  -I, --irp <id>          records of single IRP\n"
+            "  -f, --from <s>          seconds since the first record of file\n"
+            "  -T, --to <s>            seconds since the first record of file\n"
+            "  -p, --payload <hex>     data starts with these bytes\n"
+            "  -v, --verbose           print number of skipped chunks\n",
+            name, name, COLUMN_SUFFIX, COLUMN_SUFFIX, DEFAULT_CHUNK_RECORDS);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] =
+    {
+        {"threads",  required_argument, NULL, 'j'},
+        {"records",  required_argument, NULL, 'r'},
+        {"group",    required_argument, NULL, 'g'},
+        {"bus",      required_argument, NULL, 'b'},
+        {"device",   required_argument, NULL, 'd'},
+        {"endpoint", required_argument, NULL, 'e'},
+        {"transfer", required_argument, NULL, 't'},
+        {"errors",   no_argument,       NULL, 'E'},
+        {"irp",      required_argument, NULL, 'I'},
+        {"from",     required_argument, NULL, 'f'},
+        {"to",       required_argument, NULL, 'T'},
+        {"payload",  required_argument, NULL, 'p'},
+        {"verbose",  no_argument,       NULL, 'v'},
+        {"help",     no_argument,       NULL, 'h'},
+        {NULL,       0,                 NULL, 0}
+    };
+    QUERY        query;
+    const char  *command;
+    UINT32       chunkRecords = DEFAULT_CHUNK_RECORDS;
+    long         threads;
+    int          group;
+    int          opt;
+
+    if (argc < 2)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    command = argv[1];
+
+    memset(&query, 0, sizeof(query));
+    scan_filter_init(&query.filter);
+    query.group = GROUP_NONE;
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    optind = 2;
+    while ((opt = getopt_long(argc, argv, "j:r:g:d:e:t:EI:f:T:p:vh",
+                              options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'j':
+                threads = strtol(optarg, NULL, 0);
+                break;
+            case 'r':
+                chunkRecords = (UINT32)strtoul(optarg, NULL, 0);
+                break;
+            case 'g':
+                group = parse_group(optarg);
+                if (group < 0)
+                {
+                    fprintf(stderr, "Unknown group %s\n", optarg);
+                    return 1;
+                }
+                query.group = (GROUP)group;
+                break;
+            case 'b':
+                query.filter.bus = (int)strtol(optarg, NULL, 0);
+                break;
+            case 'd':
+                query.filter.device = (int)strtol(optarg, NULL, 0);
+                break;
+            case 'e':
+                query.filter.endpoint = (int)strtol(optarg, NULL, 0) & 0xFF;
+                break;
+            case 't':
+                query.filter.transfer = parse_transfer(optarg);
+                if (query.filter.transfer < 0)
+                {
+                    fprintf(stderr, "Unknown transfer type %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'E':
+                query.filter.errors = TRUE;
+                break;
+            case 'I':
+                query.filter.hasIrp = TRUE;
+                query.filter.irpId = strtoull(optarg, NULL, 0);
+                break;
+            case 'f':
+                query.filter.from = parse_seconds(optarg);
+                break;
+            case 'T':
+                query.filter.to = parse_seconds(optarg);
+                break;
+            case 'p':
+                if (!parse_prefix(&query, optarg))
+                {
+                    fprintf(stderr, "Invalid payload %s, use up to %u hex bytes\n",
+                            optarg, MAX_PREFIX);
+                    return 1;
+                }
+                break;
+            case 'v':
+                query.verbose = TRUE;
+                break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    if (optind == argc)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    threads = min(max(threads, 1L), (long)MAX_THREADS);
+
+    if (strcmp(command, "export") == 0)
+    {
+        EXPORT_JOB   jobs[MAX_THREADS];
+        volatile int next = 0;
+        int          failed = 0;
+        int          k;
+
+        /* Whole batches of the scanner go to single chunk */
+        chunkRecords = (max(chunkRecords, (UINT32)SCAN_BATCH_RECORDS) +
+                        SCAN_BATCH_RECORDS - 1) / SCAN_BATCH_RECORDS * SCAN_BATCH_RECORDS;
+        threads = min(threads, (long)(argc - optind));
+        for (k = 0; k < threads; k++)
+        {
+            memset(&jobs[k], 0, sizeof(EXPORT_JOB));
+            jobs[k].files = &argv[optind];
+            jobs[k].numberOfFiles = argc - optind;
+            jobs[k].next = &next;
+            jobs[k].chunkRecords = chunkRecords;
+            pthread_create(&jobs[k].thread, NULL, export_thread, &jobs[k]);
+        }
+        for (k = 0; k < threads; k++)
+        {
+            pthread_join(jobs[k].thread, NULL);
+            failed += jobs[k].failed;
+        }
+        return (failed != 0) ? 1 : 0;
+    }
+    if (strcmp(command, "query") == 0)
+    {
+        return (column_query(&query, &argv[optind], argc - optind,
+                             (int)threads) != 0) ? 1 : 0;
+    }
+
+    usage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * usbpcap-compact - replaces repeated interrupt records of DLT_USBPCAP
+ * capture with USBPCAP_TRANSFER_REPEAT records and expands them back.
+ *
+ * Both directions use the compactor of USBPcapCMD (USBPcapCMD/repeat.c),
+ * so file compacted by USBPcapCMD --compact and by this tool are the same.
+ * Input is memory mapped and fed to it in one piece.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pcapfile.h"
+#include "../USBPcapCMD/repeat.h"
+
+#define WRITER_BUFFER_SIZE  (1024 * 1024)
+
+typedef struct _OUTPUT
+{
+    PCAP_WRITER  writer;
+    UINT64       bytes;
+} OUTPUT;
+
+static void write_output(void *context, const void *data, size_t length)
+{
+    OUTPUT *output = (OUTPUT *)context;
+
+    pcap_writer_write(&output->writer, data, length);
+    output->bytes += length;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <input.pcap> <output.pcap>\n"
+            "  -x, --expand           expand compacted capture\n"
+            "  -d, --delay <seconds>  close runs longer than this (default %u)\n"
+            "  -q, --queue <MiB>      close runs when more records wait behind\n"
+            "                         them (default %u)\n"
+            "  -v, --verbose          print number of records and sizes\n"
+            "\n"
+            "Repeated interrupt records are replaced with REPEAT records that\n"
+            "keep their position and time. Expanded capture is identical to\n"
+            "the original.\n",
+            name, REPEAT_DEFAULT_DELAY, REPEAT_DEFAULT_QUEUE / (1024 * 1024));
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] =
+    {
+        {"expand",  no_argument,       NULL, 'x'},
+        {"delay",   required_argument, NULL, 'd'},
+        {"queue",   required_argument, NULL, 'q'},
+        {"verbose", no_argument,       NULL, 'v'},
+        {"help",    no_argument,       NULL, 'h'},
+        {NULL,      0,                 NULL, 0}
+    };
+    PCAP_FILE           in;
+    OUTPUT              out;
+    struct repeat_stats stats;
+    BOOLEAN             expand = FALSE;
+    BOOLEAN             verbose = FALSE;
+    UINT32              delay = REPEAT_DEFAULT_DELAY;
+    size_t              queue = REPEAT_DEFAULT_QUEUE;
+    char                error[256];
+    int                 result = 0;
+    int                 opt;
+
+    while ((opt = getopt_long(argc, argv, "xd:q:vh", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'x':
+                expand = TRUE;
+                break;
+            case 'd':
+                delay = (UINT32)strtoul(optarg, NULL, 0);
+                break;
+            case 'q':
+                queue = strtoul(optarg, NULL, 0) * 1024 * 1024;
+                break;
+            case 'v':
+                verbose = TRUE;
+                break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    if (optind != argc - 2)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (pcap_open(&in, argv[optind], error, sizeof(error)) != 0)
+    {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+    }
+    if ((in.network != DLT_USBPCAP) || in.swapped)
+    {
+        fprintf(stderr, "%s: only DLT_USBPCAP captures in host byte order "
+                "are supported\n", argv[optind]);
+        pcap_close(&in);
+        return 1;
+    }
+
+    out.bytes = 0;
+    if (pcap_writer_open(&out.writer, argv[optind + 1], WRITER_BUFFER_SIZE,
+                         error, sizeof(error)) != 0)
+    {
+        fprintf(stderr, "%s\n", error);
+        pcap_close(&in);
+        return 1;
+    }
+
+    if (expand)
+    {
+        struct repeat_expander *expander;
+
+        expander = repeat_expander_create(write_output, &out);
+        if (expander == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        if ((!repeat_expander_feed(expander, in.data, (size_t)in.size)) ||
+            (!repeat_expander_finish(expander)))
+        {
+            fprintf(stderr, "%s: invalid or truncated compacted capture, "
+                    "output is incomplete\n", argv[optind]);
+            result = 1;
+        }
+        repeat_expander_stats(expander, &stats);
+        repeat_expander_free(expander);
+    }
+    else
+    {
+        struct repeat_compactor *compactor;
+
+        compactor = repeat_compactor_create(write_output, &out, delay, queue);
+        if (compactor == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        repeat_compactor_feed(compactor, in.data, (size_t)in.size);
+        repeat_compactor_finish(compactor);
+        repeat_compactor_stats(compactor, &stats);
+        repeat_compactor_free(compactor);
+        if (stats.compacted)
+        {
+            fprintf(stderr, "%s: capture is already compacted, records "
+                    "from the first REPEAT record on are copied\n",
+                    argv[optind]);
+        }
+    }
+
+    if (pcap_writer_close(&out.writer) != 0)
+    {
+        fprintf(stderr, "%s: write failed\n", argv[optind + 1]);
+        result = 1;
+    }
+    if (verbose)
+    {
+        fprintf(stderr, "%llu records, %llu repetitions in %llu REPEAT "
+                "records, %llu -> %llu bytes (%.1fx)\n",
+                (unsigned long long)stats.records,
+                (unsigned long long)stats.repeats,
+                (unsigned long long)stats.runs,
+                (unsigned long long)in.size,
+                (unsigned long long)out.bytes,
+                (out.bytes > 0) ? (double)in.size / out.bytes : 0.0);
+    }
+
+    pcap_close(&in);
+    return result;
+}
@@ -0,0 +1,623 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * usbpcap-convert - converts DLT_USBPCAP capture to Linux usbmon
+ * DLT_USB_LINUX_MMAPPED capture and back. Direction is selected by the
+ * link type of the input file. Timestamp resolution of the input is kept.
+ *
+ * Input is memory mapped and output goes through single buffer, nothing
+ * is allocated per record.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pcapfile.h"
+
+#define DLT_USB_LINUX_MMAPPED   220
+
+/* struct usbmon_packet, 64 bytes in capture byte order */
+#define USBMON_HEADER_LENGTH    64
+#define USBMON_ID               0
+#define USBMON_TYPE             8   /* 'S'ubmit, 'C'omplete, 'E'rror */
+#define USBMON_XFER_TYPE        9   /* same values as USBPCAP_TRANSFER_xxx */
+#define USBMON_EPNUM            10
+#define USBMON_DEVNUM           11
+#define USBMON_BUSNUM           12
+#define USBMON_FLAG_SETUP       14  /* 0 if setup is present */
+#define USBMON_FLAG_DATA        15  /* 0 if data is present */
+#define USBMON_TS_SEC           16
+#define USBMON_TS_USEC          24
+#define USBMON_STATUS           28
+#define USBMON_LENGTH           32
+#define USBMON_LEN_CAP          36
+#define USBMON_SETUP            40  /* setup packet, or error_count */
+#define USBMON_ISO_NUMDESC      44  /* and numdesc of isochronous URB */
+#define USBMON_INTERVAL         48
+#define USBMON_START_FRAME      52
+#define USBMON_XFER_FLAGS       56
+#define USBMON_NDESC            60
+
+/* struct mon_bin_isodesc following the header */
+#define USBMON_ISODESC_LENGTH   16
+#define USBMON_ISODESC_STATUS   0
+#define USBMON_ISODESC_OFFSET   4
+#define USBMON_ISODESC_LEN      8
+
+/* USBPCAP_BUFFER_ISOCH_HEADER without packet descriptors */
+#define ISOCH_HEADER_LENGTH     (sizeof(USBPCAP_BUFFER_ISOCH_HEADER) - \
+                                 sizeof(USBPCAP_BUFFER_ISO_PACKET))
+
+#define SETUP_LENGTH            8
+
+/* Output snaplen, same as libpcap maximum */
+#define CONVERT_SNAPLEN         262144
+
+#define WRITER_BUFFER_SIZE      (1024 * 1024)
+
+/* Linux errno values used by usbmon */
+#define LINUX_ENOENT            2
+#define LINUX_EXDEV             18
+#define LINUX_ENODEV            19
+#define LINUX_EPIPE             32
+#define LINUX_ENOSR             63
+#define LINUX_ETIME             62
+#define LINUX_ECOMM             70
+#define LINUX_EPROTO            71
+#define LINUX_EOVERFLOW         75
+#define LINUX_EILSEQ            84
+#define LINUX_ECONNRESET        104
+#define LINUX_ESHUTDOWN         108
+#define LINUX_EINPROGRESS       115
+#define LINUX_EREMOTEIO         121
+
+typedef struct _STATUS_MAP
+{
+    USBD_STATUS  usbd;
+    int          error;  /* negative errno */
+} STATUS_MAP;
+
+/* First match is used in both directions */
+static const STATUS_MAP status_map[] =
+{
+    {USBD_STATUS_SUCCESS,                0},
+    {USBD_STATUS_PENDING,                -LINUX_EINPROGRESS},
+    {USBD_STATUS_CRC,                    -LINUX_EILSEQ},
+    {USBD_STATUS_BTSTUFF,                -LINUX_EPROTO},
+    {USBD_STATUS_STALL_PID,              -LINUX_EPIPE},
+    {USBD_STATUS_DEV_NOT_RESPONDING,     -LINUX_ETIME},
+    {USBD_STATUS_DATA_OVERRUN,           -LINUX_EOVERFLOW},
+    {USBD_STATUS_DATA_UNDERRUN,          -LINUX_EREMOTEIO},
+    {USBD_STATUS_BUFFER_OVERRUN,         -LINUX_ECOMM},
+    {USBD_STATUS_BUFFER_UNDERRUN,        -LINUX_ENOSR},
+    {USBD_STATUS_CANCELED,               -LINUX_ENOENT},
+    {USBD_STATUS_DEVICE_GONE,            -LINUX_ENODEV},
+    {USBD_STATUS_ISO_NOT_ACCESSED_BY_HW, -LINUX_EXDEV},
+    {USBD_STATUS_DATA_TOGGLE_MISMATCH,   -LINUX_EILSEQ},
+    {USBD_STATUS_ENDPOINT_HALTED,        -LINUX_EPIPE},
+    {USBD_STATUS_CANCELED,               -LINUX_ECONNRESET},
+    {USBD_STATUS_DEVICE_GONE,            -LINUX_ESHUTDOWN},
+    {USBD_STATUS_XACT_ERROR,             -LINUX_EPROTO},
+};
+
+typedef struct _CONVERT_STATS
+{
+    UINT64  records;
+    UINT64  written;
+    UINT64  merged;    /* legacy control stage records merged */
+    UINT64  skipped;   /* no equivalent in output format */
+} CONVERT_STATS;
+
+static int usbd_to_errno(USBD_STATUS status)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(status_map) / sizeof(status_map[0]); i++)
+    {
+        if (status_map[i].usbd == status)
+        {
+            return status_map[i].error;
+        }
+    }
+    if (USBD_PENDING(status))
+    {
+        return -LINUX_EINPROGRESS;
+    }
+    return USBD_ERROR(status) ? -LINUX_EPROTO : 0;
+}
+
+static USBD_STATUS errno_to_usbd(int error)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(status_map) / sizeof(status_map[0]); i++)
+    {
+        if (status_map[i].error == error)
+        {
+            return status_map[i].usbd;
+        }
+    }
+    return USBD_STATUS_XACT_ERROR;
+}
+
+/* usbmon headers are written in host byte order */
+static void put_host16(UCHAR *p, UINT16 value)
+{
+    memcpy(p, &value, sizeof(value));
+}
+
+static void put_host32(UCHAR *p, UINT32 value)
+{
+    memcpy(p, &value, sizeof(value));
+}
+
+static void put_host64(UCHAR *p, UINT64 value)
+{
+    memcpy(p, &value, sizeof(value));
+}
+
+/* USBPcap headers are always little endian */
+static void put_le16(UCHAR *p, UINT16 value)
+{
+    p[0] = (UCHAR)value;
+    p[1] = (UCHAR)(value >> 8);
+}
+
+static void put_le32(UCHAR *p, UINT32 value)
+{
+    put_le16(p, (UINT16)value);
+    put_le16(&p[2], (UINT16)(value >> 16));
+}
+
+static void put_le64(UCHAR *p, UINT64 value)
+{
+    put_le32(p, (UINT32)value);
+    put_le32(&p[4], (UINT32)(value >> 32));
+}
+
+/* usbmon headers are in capture byte order */
+static UINT16 get_file16(const PCAP_FILE *file, const UCHAR *p)
+{
+    UINT16 value;
+
+    memcpy(&value, p, sizeof(value));
+    return file->swapped ? (UINT16)((value >> 8) | (value << 8)) : value;
+}
+
+static UINT32 get_file32(const PCAP_FILE *file, const UCHAR *p)
+{
+    UINT32 value;
+
+    memcpy(&value, p, sizeof(value));
+    return file->swapped ? __builtin_bswap32(value) : value;
+}
+
+static UINT64 get_file64(const PCAP_FILE *file, const UCHAR *p)
+{
+    UINT64 value;
+
+    memcpy(&value, p, sizeof(value));
+    return file->swapped ? __builtin_bswap64(value) : value;
+}
+
+/* Returns control stage of the record, or -1 if it is not control */
+static int control_stage(const PCAP_RECORD *record,
+                         const USBPCAP_BUFFER_PACKET_HEADER *header)
+{
+    if ((header->transfer != USBPCAP_TRANSFER_CONTROL) ||
+        (header->headerLen < sizeof(USBPCAP_BUFFER_CONTROL_HEADER)))
+    {
+        return -1;
+    }
+    return record->data[sizeof(USBPCAP_BUFFER_PACKET_HEADER)];
+}
+
+/* USBPcap versions before 1.5.0.0 recorded DATA stage of control
+ * transfer as separate record following SETUP (DATA OUT) or preceding
+ * STATUS (DATA IN). Returns TRUE and the next record if it has the same
+ * irpId and the given stage.
+ */
+static BOOLEAN legacy_stage(const PCAP_FILE *file, const PCAP_RECORD *record,
+                            UINT64 irpId, int stage, PPCAP_RECORD next,
+                            PUSBPCAP_BUFFER_PACKET_HEADER nextHeader)
+{
+    UINT64 offset = record->offset + sizeof(pcaprec_hdr_t) + record->inclLen;
+
+    return ((pcap_read_record(file, offset, next) == 1) &&
+            pcap_get_usbpcap_header(next, nextHeader) &&
+            (nextHeader->irpId == irpId) &&
+            (control_stage(next, nextHeader) == stage)) ? TRUE : FALSE;
+}
+
+static void usbpcap_to_usbmon(const PCAP_FILE *in, PPCAP_WRITER out,
+                              CONVERT_STATS *stats)
+{
+    PCAP_RECORD                   record;
+    USBPCAP_BUFFER_PACKET_HEADER  header;
+    UINT64                        offset = PCAP_FIRST_RECORD;
+
+    pcap_writer_header(out, in->nanoseconds, CONVERT_SNAPLEN, DLT_USB_LINUX_MMAPPED);
+
+    while (pcap_read_record(in, offset, &record) == 1)
+    {
+        PCAP_RECORD                   next;
+        USBPCAP_BUFFER_PACKET_HEADER  nextHeader;
+        const UCHAR                  *setup = NULL;
+        const UCHAR                  *data;
+        const UCHAR                  *packets = NULL;
+        UCHAR                        *p;
+        UINT32                        captured;
+        UINT32                        length;
+        UINT32                        numberOfPackets = 0;
+        UINT32                        ndesc = 0;
+        UINT32                        i;
+        USBD_STATUS                   status;
+        BOOLEAN                       submit;
+        BOOLEAN                       directionIn;
+        int                           stage;
+
+        stats->records++;
+        offset += sizeof(pcaprec_hdr_t) + record.inclLen;
+
+        if (!pcap_get_usbpcap_header(&record, &header) ||
+            (header.transfer > USBPCAP_TRANSFER_BULK))
+        {
+            stats->skipped++;
+            continue;
+        }
+
+        submit = (header.info & USBPCAP_INFO_PDO_TO_FDO) ? FALSE : TRUE;
+        directionIn = (header.endpoint & 0x80) ? TRUE : FALSE;
+        status = header.status;
+        data = &record.data[header.headerLen];
+        captured = record.inclLen - header.headerLen;
+        length = max(header.dataLength, captured);
+
+        stage = control_stage(&record, &header);
+        if (stage == USBPCAP_CONTROL_STAGE_SETUP)
+        {
+            if (captured < SETUP_LENGTH)
+            {
+                stats->skipped++;
+                continue;
+            }
+            setup = data;
+            data += SETUP_LENGTH;
+            captured -= SETUP_LENGTH;
+            length -= SETUP_LENGTH;
+            directionIn = (setup[0] & 0x80) ? TRUE : FALSE;
+
+            if (legacy_stage(in, &record, header.irpId,
+                             USBPCAP_CONTROL_STAGE_DATA, &next, &nextHeader) &&
+                !(nextHeader.info & USBPCAP_INFO_PDO_TO_FDO))
+            {
+                data = &next.data[nextHeader.headerLen];
+                captured = next.inclLen - nextHeader.headerLen;
+                length = max(nextHeader.dataLength, captured);
+                offset += sizeof(pcaprec_hdr_t) + next.inclLen;
+                stats->records++;
+                stats->merged++;
+            }
+            if (directionIn)
+            {
+                /* usbmon records requested length of IN transfers */
+                length = PCAP_LE16(&setup[6]);
+            }
+        }
+        else if (stage == USBPCAP_CONTROL_STAGE_DATA)
+        {
+            if (submit ||
+                !legacy_stage(in, &record, header.irpId,
+                              USBPCAP_CONTROL_STAGE_STATUS, &next, &nextHeader))
+            {
+                stats->skipped++;
+                continue;
+            }
+            status = nextHeader.status;
+            offset += sizeof(pcaprec_hdr_t) + next.inclLen;
+            stats->records++;
+            stats->merged++;
+            directionIn = TRUE;
+        }
+        else if (stage >= 0)
+        {
+            /* COMPLETE or STATUS */
+            directionIn = directionIn || (captured > 0);
+        }
+        else if (header.transfer == USBPCAP_TRANSFER_ISOCHRONOUS)
+        {
+            if (header.headerLen < ISOCH_HEADER_LENGTH)
+            {
+                stats->skipped++;
+                continue;
+            }
+            numberOfPackets = PCAP_LE32(&record.data[31]);
+            ndesc = min(numberOfPackets,
+                        (header.headerLen - (UINT32)ISOCH_HEADER_LENGTH) /
+                        (UINT32)sizeof(USBPCAP_BUFFER_ISO_PACKET));
+            packets = &record.data[ISOCH_HEADER_LENGTH];
+        }
+
+        /* Data goes to device in submit and from device in completion */
+        if (submit == directionIn)
+        {
+            if (!(submit && directionIn && (setup != NULL)))
+            {
+                length = 0;
+            }
+            captured = 0;
+        }
+
+        pcap_writer_record(out, record.timestamp,
+                            USBMON_HEADER_LENGTH + ndesc * USBMON_ISODESC_LENGTH + captured,
+                            USBMON_HEADER_LENGTH + ndesc * USBMON_ISODESC_LENGTH + length);
+
+        p = pcap_writer_reserve(out, USBMON_HEADER_LENGTH);
+        memset(p, 0, USBMON_HEADER_LENGTH);
+        put_host64(&p[USBMON_ID], header.irpId);
+        p[USBMON_TYPE] = submit ? 'S' : 'C';
+        p[USBMON_XFER_TYPE] = header.transfer;
+        p[USBMON_EPNUM] = (UCHAR)((header.endpoint & 0x7F) | (directionIn ? 0x80 : 0));
+        p[USBMON_DEVNUM] = (UCHAR)header.device;
+        put_host16(&p[USBMON_BUSNUM], header.bus);
+        p[USBMON_FLAG_SETUP] = (setup != NULL) ? 0 : '-';
+        p[USBMON_FLAG_DATA] = (captured > 0) ? 0 : ((submit == directionIn) ? (directionIn ? '<' : '>') : 0);
+        put_host64(&p[USBMON_TS_SEC], record.timestamp / 1000000000ULL);
+        put_host32(&p[USBMON_TS_USEC], (UINT32)(record.timestamp % 1000000000ULL / 1000));
+        put_host32(&p[USBMON_STATUS], (UINT32)usbd_to_errno(status));
+        put_host32(&p[USBMON_LENGTH], length);
+        put_host32(&p[USBMON_LEN_CAP], captured);
+        if (setup != NULL)
+        {
+            memcpy(&p[USBMON_SETUP], setup, SETUP_LENGTH);
+        }
+        else if (packets != NULL)
+        {
+            put_host32(&p[USBMON_SETUP], PCAP_LE32(&record.data[35]));
+            put_host32(&p[USBMON_ISO_NUMDESC], numberOfPackets);
+            put_host32(&p[USBMON_START_FRAME], PCAP_LE32(&record.data[27]));
+        }
+        put_host32(&p[USBMON_NDESC], ndesc);
+
+        for (i = 0; i < ndesc; i++)
+        {
+            const UCHAR *packet = &packets[i * sizeof(USBPCAP_BUFFER_ISO_PACKET)];
+
+            p = pcap_writer_reserve(out, USBMON_ISODESC_LENGTH);
+            put_host32(&p[USBMON_ISODESC_STATUS],
+                       (UINT32)usbd_to_errno((USBD_STATUS)PCAP_LE32(&packet[8])));
+            put_host32(&p[USBMON_ISODESC_OFFSET], PCAP_LE32(&packet[0]));
+            put_host32(&p[USBMON_ISODESC_LEN], PCAP_LE32(&packet[4]));
+            put_host32(&p[12], 0);
+        }
+
+        pcap_writer_write(out, data, captured);
+        stats->written++;
+    }
+}
+
+static void usbmon_to_usbpcap(const PCAP_FILE *in, PPCAP_WRITER out,
+                              CONVERT_STATS *stats)
+{
+    PCAP_RECORD record;
+    UINT64      offset = PCAP_FIRST_RECORD;
+
+    pcap_writer_header(out, in->nanoseconds, CONVERT_SNAPLEN, DLT_USBPCAP);
+
+    while (pcap_read_record(in, offset, &record) == 1)
+    {
+        const UCHAR *p = record.data;
+        const UCHAR *data;
+        UCHAR       *h;
+        UCHAR        type;
+        UCHAR        transfer;
+        UINT32       ndesc;
+        UINT32       captured;
+        UINT32       dataLength;
+        UINT32       headerLen;
+        UINT32       prefix = 0;   /* setup packet */
+        UINT32       i;
+        USHORT       function;
+
+        stats->records++;
+        offset += sizeof(pcaprec_hdr_t) + record.inclLen;
+
+        if (record.inclLen < USBMON_HEADER_LENGTH)
+        {
+            stats->skipped++;
+            continue;
+        }
+        type = p[USBMON_TYPE];
+        transfer = p[USBMON_XFER_TYPE];
+        ndesc = get_file32(in, &p[USBMON_NDESC]);
+        if ((transfer > USBPCAP_TRANSFER_BULK) ||
+            ((type != 'S') && (type != 'C') && (type != 'E')) ||
+            (ndesc > (record.inclLen - USBMON_HEADER_LENGTH) / USBMON_ISODESC_LENGTH) ||
+            ((transfer != USBPCAP_TRANSFER_ISOCHRONOUS) && (ndesc != 0)))
+        {
+            stats->skipped++;
+            continue;
+        }
+
+        data = &p[USBMON_HEADER_LENGTH + ndesc * USBMON_ISODESC_LENGTH];
+        captured = min(get_file32(in, &p[USBMON_LEN_CAP]),
+                       record.inclLen - USBMON_HEADER_LENGTH -
+                       ndesc * USBMON_ISODESC_LENGTH);
+        dataLength = (p[USBMON_FLAG_DATA] == 0) ?
+                     max(get_file32(in, &p[USBMON_LENGTH]), captured) : 0;
+        captured = min(captured, dataLength);
+
+        switch (transfer)
+        {
+            case USBPCAP_TRANSFER_ISOCHRONOUS:
+                headerLen = ISOCH_HEADER_LENGTH +
+                            ndesc * sizeof(USBPCAP_BUFFER_ISO_PACKET);
+                function = URB_FUNCTION_ISOCH_TRANSFER;
+                break;
+            case USBPCAP_TRANSFER_CONTROL:
+                headerLen = sizeof(USBPCAP_BUFFER_CONTROL_HEADER);
+                function = URB_FUNCTION_CONTROL_TRANSFER;
+                if (type == 'S')
+                {
+                    prefix = SETUP_LENGTH;
+                }
+                break;
+            default:
+                headerLen = sizeof(USBPCAP_BUFFER_PACKET_HEADER);
+                function = URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER;
+                break;
+        }
+        if (headerLen > 0xFFFF)
+        {
+            stats->skipped++;
+            continue;
+        }
+
+        pcap_writer_record(out, record.timestamp,
+                            headerLen + prefix + captured,
+                            headerLen + prefix + dataLength);
+
+        h = pcap_writer_reserve(out, headerLen + prefix);
+        put_le16(&h[0], (UINT16)headerLen);
+        put_le64(&h[2], get_file64(in, &p[USBMON_ID]));
+        put_le32(&h[10], (UINT32)errno_to_usbd((int)get_file32(in, &p[USBMON_STATUS])));
+        put_le16(&h[14], function);
+        h[16] = (type == 'S') ? 0 : USBPCAP_INFO_PDO_TO_FDO;
+        put_le16(&h[17], get_file16(in, &p[USBMON_BUSNUM]));
+        put_le16(&h[19], p[USBMON_DEVNUM]);
+        h[21] = p[USBMON_EPNUM];
+        h[22] = transfer;
+        put_le32(&h[23], prefix + dataLength);
+
+        if (transfer == USBPCAP_TRANSFER_CONTROL)
+        {
+            h[27] = (type == 'S') ? USBPCAP_CONTROL_STAGE_SETUP :
+                                    USBPCAP_CONTROL_STAGE_COMPLETE;
+            if (prefix > 0)
+            {
+                memcpy(&h[28], &p[USBMON_SETUP], SETUP_LENGTH);
+            }
+        }
+        else if (transfer == USBPCAP_TRANSFER_ISOCHRONOUS)
+        {
+            put_le32(&h[27], get_file32(in, &p[USBMON_START_FRAME]));
+            put_le32(&h[31], ndesc);
+            put_le32(&h[35], get_file32(in, &p[USBMON_SETUP]));
+            for (i = 0; i < ndesc; i++)
+            {
+                const UCHAR *desc = &p[USBMON_HEADER_LENGTH + i * USBMON_ISODESC_LENGTH];
+                UCHAR       *packet = &h[ISOCH_HEADER_LENGTH +
+                                         i * sizeof(USBPCAP_BUFFER_ISO_PACKET)];
+
+                put_le32(&packet[0], get_file32(in, &desc[USBMON_ISODESC_OFFSET]));
+                put_le32(&packet[4], get_file32(in, &desc[USBMON_ISODESC_LEN]));
+                put_le32(&packet[8], (UINT32)errno_to_usbd(
+                             (int)get_file32(in, &desc[USBMON_ISODESC_STATUS])));
+            }
+        }
+
+        pcap_writer_write(out, data, captured);
+        stats->written++;
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-v] <input.pcap> <output.pcap>\n"
+            "\n"
+            "Converts DLT_USBPCAP capture to DLT_USB_LINUX_MMAPPED (usbmon)\n"
+            "and usbmon capture to DLT_USBPCAP, depending on input link type.\n"
+            "  -v, --verbose   print number of converted records\n",
+            name);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] =
+    {
+        {"verbose", no_argument, NULL, 'v'},
+        {"help",    no_argument, NULL, 'h'},
+        {NULL,      0,           NULL, 0}
+    };
+    PCAP_FILE      in;
+    PCAP_WRITER    out;
+    CONVERT_STATS  stats;
+    BOOLEAN        verbose = FALSE;
+    char           error[256];
+    int            result;
+    int            opt;
+
+    while ((opt = getopt_long(argc, argv, "vh", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'v':
+                verbose = TRUE;
+                break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    if (optind != argc - 2)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (pcap_open(&in, argv[optind], error, sizeof(error)) != 0)
+    {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+    }
+    if ((in.network != DLT_USBPCAP) && (in.network != DLT_USB_LINUX_MMAPPED))
+    {
+        fprintf(stderr, "%s: link type %u is neither DLT_USBPCAP nor "
+                "DLT_USB_LINUX_MMAPPED\n", argv[optind], in.network);
+        pcap_close(&in);
+        return 1;
+    }
+
+    memset(&stats, 0, sizeof(stats));
+    if (pcap_writer_open(&out, argv[optind + 1], WRITER_BUFFER_SIZE,
+                         error, sizeof(error)) != 0)
+    {
+        fprintf(stderr, "%s\n", error);
+        pcap_close(&in);
+        return 1;
+    }
+
+    if (in.network == DLT_USBPCAP)
+    {
+        usbpcap_to_usbmon(&in, &out, &stats);
+    }
+    else
+    {
+        usbmon_to_usbpcap(&in, &out, &stats);
+    }
+
+    result = pcap_writer_close(&out);
+    if (result != 0)
+    {
+        fprintf(stderr, "%s: write failed\n", argv[optind + 1]);
+    }
+    if (verbose)
+    {
+        fprintf(stderr, "%llu records read, %llu written, %llu legacy control "
+                "stages merged, %llu without equivalent skipped\n",
+                (unsigned long long)stats.records,
+                (unsigned long long)stats.written,
+                (unsigned long long)stats.merged,
+                (unsigned long long)stats.skipped);
+    }
+
+    pcap_close(&in);
+    return (result == 0) ? 0 : 1;
+}
@@ -0,0 +1,644 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * User mode replacement for the subset of the WDK headers used by
+ * USBPcapDriver sources that do not talk to the PnP manager. See README.
+ */
+
+#ifndef USBPCAP_PORTABLE_NTDDK_H
+#define USBPCAP_PORTABLE_NTDDK_H
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NTDDI_WIN7  0x06010000
+#define NTDDI_WIN8  0x06020000
+
+#ifndef NTDDI_VERSION
+#define NTDDI_VERSION  NTDDI_WIN8
+#endif
+
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT  0x0602
+#endif
+
+#ifndef DBG
+#define DBG 0
+#endif
+
+////////////////////////////////////////////////////////////
+// Annotations and compiler specifics
+//
+#define IN
+#define OUT
+#define OPTIONAL
+#define __in
+#define __out
+#define __in_opt
+#define __out_opt
+#define __inout
+#define _In_
+#define _Out_
+#define _Inout_
+#define _In_opt_
+#define _Use_decl_annotations_
+#define _IRQL_requires_max_(x)
+#define __drv_dispatchType(x)
+#define __drv_dispatchType_other
+#define __drv_raisesIRQL(x)
+#define __drv_requiresIRQL(x)
+#define __drv_maxIRQL(x)
+#define __drv_setsIRQL(x)
+#define __drv_savesIRQL
+#define __drv_restoresIRQL
+#define __drv_savesIRQLGlobal(kind, param)
+#define __drv_restoresIRQLGlobal(kind, param)
+#define __drv_out_deref(x)
+#define __drv_in(x)
+
+#define FORCEINLINE       static __inline __attribute__((always_inline))
+#define DECLSPEC_ALIGN(x) __attribute__((aligned(x)))
+
+#define UNREFERENCED_PARAMETER(p)  ((void)(p))
+#define C_ASSERT(e)                typedef char __C_ASSERT__[(e) ? 1 : -1]
+
+#if DBG
+#define ASSERT(e)   assert(e)
+#define KdPrint(x)  DbgPrint x
+#else
+#define ASSERT(e)   ((void)0)
+#define KdPrint(x)  ((void)0)
+#endif
+
+////////////////////////////////////////////////////////////
+// Basic types. LLP64 sizes are kept on LP64 hosts.
+//
+#define VOID void
+typedef void               *PVOID;
+typedef char               CHAR, *PCHAR, CCHAR;
+typedef unsigned char      UCHAR, *PUCHAR, BOOLEAN, *PBOOLEAN, BYTE, UINT8;
+typedef int16_t            SHORT, INT16;
+typedef uint16_t           USHORT, *PUSHORT, UINT16, WCHAR, *PWCHAR, *PWSTR;
+typedef const uint16_t     *PCWSTR;
+typedef int32_t            LONG, *PLONG, INT32, INT, NTSTATUS;
+typedef uint32_t           ULONG, *PULONG, UINT32, *PUINT32, CLONG, DWORD;
+typedef int64_t            LONG64, LONGLONG, INT64;
+typedef uint64_t           ULONG64, *PULONG64, ULONGLONG, UINT64, *PUINT64;
+typedef intptr_t           LONG_PTR;
+typedef uintptr_t          ULONG_PTR, UINT_PTR, SIZE_T, *PSIZE_T;
+typedef ULONG_PTR          KAFFINITY;
+typedef PVOID              HANDLE;
+
+typedef union _LARGE_INTEGER
+{
+    struct
+    {
+        ULONG LowPart;
+        LONG  HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+#define TRUE  1
+#define FALSE 0
+
+#ifndef NULL
+#define NULL ((void *)0)
+#endif
+
+#define MAXUCHAR   0xFF
+#define MAXUSHORT  0xFFFF
+#define MAXULONG   0xFFFFFFFFUL
+#define MAXLONG    0x7FFFFFFFL
+
+#ifndef min
+#define min(a, b)  (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b)  (((a) > (b)) ? (a) : (b))
+#endif
+
+#define FIELD_OFFSET(type, field)  ((LONG)offsetof(type, field))
+#define CONTAINING_RECORD(address, type, field) \
+    ((type *)((PCHAR)(address) - offsetof(type, field)))
+
+#define RtlCopyMemory(d, s, l)    memcpy((d), (s), (l))
+#define RtlMoveMemory(d, s, l)    memmove((d), (s), (l))
+#define RtlFillMemory(d, l, f)    memset((d), (f), (l))
+#define RtlZeroMemory(d, l)       memset((d), 0, (l))
+#define RtlEqualMemory(a, b, l)   (memcmp((a), (b), (l)) == 0)
+
+typedef struct _UNICODE_STRING
+{
+    USHORT Length;
+    USHORT MaximumLength;
+    PWSTR  Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+
+////////////////////////////////////////////////////////////
+// Status codes
+//
+#define NT_SUCCESS(status)  (((NTSTATUS)(status)) >= 0)
+
+#define STATUS_SUCCESS                 ((NTSTATUS)0x00000000L)
+#define STATUS_PENDING                 ((NTSTATUS)0x00000103L)
+#define STATUS_BUFFER_OVERFLOW         ((NTSTATUS)0x80000005L)
+#define STATUS_UNSUCCESSFUL            ((NTSTATUS)0xC0000001L)
+#define STATUS_NOT_IMPLEMENTED         ((NTSTATUS)0xC0000002L)
+#define STATUS_INVALID_PARAMETER       ((NTSTATUS)0xC000000DL)
+#define STATUS_INVALID_DEVICE_REQUEST  ((NTSTATUS)0xC0000010L)
+#define STATUS_ACCESS_DENIED           ((NTSTATUS)0xC0000022L)
+#define STATUS_BUFFER_TOO_SMALL        ((NTSTATUS)0xC0000023L)
+#define STATUS_INSUFFICIENT_RESOURCES  ((NTSTATUS)0xC000009AL)
+#define STATUS_NOT_SUPPORTED           ((NTSTATUS)0xC00000BBL)
+#define STATUS_CANCELLED               ((NTSTATUS)0xC0000120L)
+#define STATUS_NOT_FOUND               ((NTSTATUS)0xC0000225L)
+
+////////////////////////////////////////////////////////////
+// Doubly linked lists
+//
+typedef struct _LIST_ENTRY
+{
+    struct _LIST_ENTRY *Flink;
+    struct _LIST_ENTRY *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+FORCEINLINE VOID InitializeListHead(PLIST_ENTRY ListHead)
+{
+    ListHead->Flink = ListHead->Blink = ListHead;
+}
+
+FORCEINLINE BOOLEAN IsListEmpty(const LIST_ENTRY *ListHead)
+{
+    return (BOOLEAN)(ListHead->Flink == ListHead);
+}
+
+FORCEINLINE BOOLEAN RemoveEntryList(PLIST_ENTRY Entry)
+{
+    PLIST_ENTRY Flink = Entry->Flink;
+    PLIST_ENTRY Blink = Entry->Blink;
+
+    Blink->Flink = Flink;
+    Flink->Blink = Blink;
+    return (BOOLEAN)(Flink == Blink);
+}
+
+FORCEINLINE PLIST_ENTRY RemoveHeadList(PLIST_ENTRY ListHead)
+{
+    PLIST_ENTRY Entry = ListHead->Flink;
+
+    RemoveEntryList(Entry);
+    return Entry;
+}
+
+FORCEINLINE VOID InsertTailList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
+{
+    PLIST_ENTRY Blink = ListHead->Blink;
+
+    Entry->Flink = ListHead;
+    Entry->Blink = Blink;
+    Blink->Flink = Entry;
+    ListHead->Blink = Entry;
+}
+
+FORCEINLINE VOID InsertHeadList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
+{
+    PLIST_ENTRY Flink = ListHead->Flink;
+
+    Entry->Flink = Flink;
+    Entry->Blink = ListHead;
+    Flink->Blink = Entry;
+    ListHead->Flink = Entry;
+}
+
+////////////////////////////////////////////////////////////
+// Interlocked operations. Full barriers, same as on x86 Windows.
+//
+FORCEINLINE LONG InterlockedIncrement(LONG volatile *Addend)
+{
+    return __atomic_add_fetch(Addend, 1, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE LONG InterlockedDecrement(LONG volatile *Addend)
+{
+    return __atomic_sub_fetch(Addend, 1, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE LONG InterlockedExchange(LONG volatile *Target, LONG Value)
+{
+    return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE LONG InterlockedExchangeAdd(LONG volatile *Addend, LONG Value)
+{
+    return __atomic_fetch_add(Addend, Value, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE LONG InterlockedCompareExchange(LONG volatile *Destination,
+                                            LONG Exchange,
+                                            LONG Comperand)
+{
+    __atomic_compare_exchange_n(Destination, &Comperand, Exchange, FALSE,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comperand;
+}
+
+FORCEINLINE LONG64 InterlockedIncrement64(LONG64 volatile *Addend)
+{
+    return __atomic_add_fetch(Addend, 1, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE LONG64 InterlockedExchangeAdd64(LONG64 volatile *Addend,
+                                            LONG64 Value)
+{
+    return __atomic_fetch_add(Addend, Value, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE PVOID InterlockedExchangePointer(PVOID volatile *Target,
+                                             PVOID Value)
+{
+    return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE PVOID InterlockedCompareExchangePointer(PVOID volatile *Destination,
+                                                    PVOID Exchange,
+                                                    PVOID Comperand)
+{
+    __atomic_compare_exchange_n(Destination, &Comperand, Exchange, FALSE,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comperand;
+}
+
+////////////////////////////////////////////////////////////
+// IRQL and spin locks. IRQL is tracked per thread only, raising it
+// does not disable preemption or migration.
+//
+typedef UCHAR KIRQL, *PKIRQL;
+
+#define PASSIVE_LEVEL   0
+#define APC_LEVEL       1
+#define DISPATCH_LEVEL  2
+
+typedef ULONG_PTR KSPIN_LOCK, *PKSPIN_LOCK;
+
+KIRQL KeGetCurrentIrql(VOID);
+VOID KeRaiseIrql(KIRQL NewIrql, PKIRQL OldIrql);
+VOID KeLowerIrql(KIRQL NewIrql);
+
+VOID KeInitializeSpinLock(PKSPIN_LOCK SpinLock);
+VOID KeAcquireSpinLock(PKSPIN_LOCK SpinLock, PKIRQL OldIrql);
+VOID KeReleaseSpinLock(PKSPIN_LOCK SpinLock, KIRQL NewIrql);
+VOID KeAcquireSpinLockAtDpcLevel(PKSPIN_LOCK SpinLock);
+VOID KeReleaseSpinLockFromDpcLevel(PKSPIN_LOCK SpinLock);
+
+////////////////////////////////////////////////////////////
+// Processors and time
+//
+#define ALL_PROCESSOR_GROUPS  0xFFFF
+
+typedef struct _PROCESSOR_NUMBER
+{
+    USHORT Group;
+    UCHAR  Number;
+    UCHAR  Reserved;
+} PROCESSOR_NUMBER, *PPROCESSOR_NUMBER;
+
+extern CCHAR KeNumberProcessors;
+
+ULONG KeGetCurrentProcessorNumber(VOID);
+ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER ProcNumber);
+ULONG KeQueryMaximumProcessorCountEx(USHORT GroupNumber);
+
+/* 100 ns units since January 1, 1601 */
+VOID KeQuerySystemTime(PLARGE_INTEGER CurrentTime);
+VOID KeQuerySystemTimePrecise(PLARGE_INTEGER CurrentTime);
+
+/* 100 ns units since arbitrary point in time */
+ULONGLONG KeQueryInterruptTime(VOID);
+
+////////////////////////////////////////////////////////////
+// Pool
+//
+typedef enum _POOL_TYPE
+{
+    NonPagedPool,
+    PagedPool,
+    NonPagedPoolNx = 512
+} POOL_TYPE;
+
+PVOID ExAllocatePoolWithTag(POOL_TYPE PoolType, SIZE_T NumberOfBytes,
+                            ULONG Tag);
+VOID ExFreePool(PVOID P);
+VOID ExFreePoolWithTag(PVOID P, ULONG Tag);
+
+////////////////////////////////////////////////////////////
+// Generic tables. Splay tree with insertion ordered list, same as the
+// kernel implementation.
+//
+typedef struct _RTL_SPLAY_LINKS
+{
+    struct _RTL_SPLAY_LINKS *Parent;
+    struct _RTL_SPLAY_LINKS *LeftChild;
+    struct _RTL_SPLAY_LINKS *RightChild;
+} RTL_SPLAY_LINKS, *PRTL_SPLAY_LINKS;
+
+typedef enum _RTL_GENERIC_COMPARE_RESULTS
+{
+    GenericLessThan,
+    GenericGreaterThan,
+    GenericEqual
+} RTL_GENERIC_COMPARE_RESULTS;
+
+struct _RTL_GENERIC_TABLE;
+
+typedef RTL_GENERIC_COMPARE_RESULTS
+RTL_GENERIC_COMPARE_ROUTINE(struct _RTL_GENERIC_TABLE *Table,
+                            PVOID FirstStruct,
+                            PVOID SecondStruct);
+typedef RTL_GENERIC_COMPARE_ROUTINE *PRTL_GENERIC_COMPARE_ROUTINE;
+
+typedef PVOID
+RTL_GENERIC_ALLOCATE_ROUTINE(struct _RTL_GENERIC_TABLE *Table,
+                             CLONG ByteSize);
+typedef RTL_GENERIC_ALLOCATE_ROUTINE *PRTL_GENERIC_ALLOCATE_ROUTINE;
+
+typedef VOID
+RTL_GENERIC_FREE_ROUTINE(struct _RTL_GENERIC_TABLE *Table,
+                         PVOID Buffer);
+typedef RTL_GENERIC_FREE_ROUTINE *PRTL_GENERIC_FREE_ROUTINE;
+
+typedef struct _RTL_GENERIC_TABLE
+{
+    PRTL_SPLAY_LINKS              TableRoot;
+    LIST_ENTRY                    InsertOrderList;
+    PLIST_ENTRY                   OrderedPointer;
+    ULONG                         WhichOrderedElement;
+    ULONG                         NumberGenericTableElements;
+    PRTL_GENERIC_COMPARE_ROUTINE  CompareRoutine;
+    PRTL_GENERIC_ALLOCATE_ROUTINE AllocateRoutine;
+    PRTL_GENERIC_FREE_ROUTINE     FreeRoutine;
+    PVOID                         TableContext;
+} RTL_GENERIC_TABLE, *PRTL_GENERIC_TABLE;
+
+VOID RtlInitializeGenericTable(PRTL_GENERIC_TABLE Table,
+                               PRTL_GENERIC_COMPARE_ROUTINE CompareRoutine,
+                               PRTL_GENERIC_ALLOCATE_ROUTINE AllocateRoutine,
+                               PRTL_GENERIC_FREE_ROUTINE FreeRoutine,
+                               PVOID TableContext);
+PVOID RtlInsertElementGenericTable(PRTL_GENERIC_TABLE Table,
+                                   PVOID Buffer,
+                                   CLONG BufferSize,
+                                   PBOOLEAN NewElement);
+BOOLEAN RtlDeleteElementGenericTable(PRTL_GENERIC_TABLE Table,
+                                     PVOID Buffer);
+PVOID RtlLookupElementGenericTable(PRTL_GENERIC_TABLE Table,
+                                   PVOID Buffer);
+PVOID RtlGetElementGenericTable(PRTL_GENERIC_TABLE Table, ULONG I);
+ULONG RtlNumberGenericTableElements(PRTL_GENERIC_TABLE Table);
+BOOLEAN RtlIsGenericTableEmpty(PRTL_GENERIC_TABLE Table);
+PVOID RtlEnumerateGenericTableWithoutSplaying(PRTL_GENERIC_TABLE Table,
+                                              PVOID *RestartKey);
+
+////////////////////////////////////////////////////////////
+// Memory descriptor lists. MDL always describes locked, mapped buffer.
+//
+typedef enum _MM_PAGE_PRIORITY
+{
+    LowPagePriority,
+    NormalPagePriority = 16,
+    HighPagePriority = 32
+} MM_PAGE_PRIORITY;
+
+typedef struct _MDL
+{
+    struct _MDL *Next;
+    PVOID        MappedSystemVa;
+    ULONG        ByteCount;
+} MDL, *PMDL;
+
+#define MmGetMdlByteCount(Mdl)                       ((Mdl)->ByteCount)
+#define MmGetMdlVirtualAddress(Mdl)                  ((Mdl)->MappedSystemVa)
+#define MmGetSystemAddressForMdlSafe(Mdl, Priority)  ((Mdl)->MappedSystemVa)
+#define MmBuildMdlForNonPagedPool(Mdl)               ((void)(Mdl))
+
+////////////////////////////////////////////////////////////
+// Device objects and IRPs. Every IRP has single stack location.
+//
+#define IRP_MJ_CREATE                   0x00
+#define IRP_MJ_CLOSE                    0x02
+#define IRP_MJ_READ                     0x03
+#define IRP_MJ_WRITE                    0x04
+#define IRP_MJ_DEVICE_CONTROL           0x0E
+#define IRP_MJ_INTERNAL_DEVICE_CONTROL  0x0F
+#define IRP_MJ_CLEANUP                  0x12
+#define IRP_MJ_POWER                    0x16
+#define IRP_MJ_PNP                      0x1B
+
+#define IO_NO_INCREMENT  0
+
+#define CTL_CODE(DeviceType, Function, Method, Access) \
+    (((DeviceType) << 16) | ((Access) << 14) | ((Function) << 2) | (Method))
+
+#define FILE_DEVICE_UNKNOWN  0x00000022
+#define FILE_DEVICE_USB      FILE_DEVICE_UNKNOWN
+#define METHOD_BUFFERED      0
+#define METHOD_IN_DIRECT     1
+#define METHOD_OUT_DIRECT    2
+#define METHOD_NEITHER       3
+#define FILE_ANY_ACCESS      0
+#define FILE_READ_ACCESS     0x0001
+#define FILE_WRITE_ACCESS    0x0002
+
+typedef struct _DRIVER_OBJECT
+{
+    PVOID DriverExtension;
+} DRIVER_OBJECT, *PDRIVER_OBJECT;
+
+typedef struct _DEVICE_OBJECT
+{
+    PDRIVER_OBJECT DriverObject;
+    PVOID          DeviceExtension;
+    ULONG          Flags;
+} DEVICE_OBJECT, *PDEVICE_OBJECT;
+
+typedef struct _FILE_OBJECT
+{
+    PDEVICE_OBJECT DeviceObject;
+    PVOID          FsContext;
+} FILE_OBJECT, *PFILE_OBJECT;
+
+typedef struct _IO_STATUS_BLOCK
+{
+    NTSTATUS  Status;
+    ULONG_PTR Information;
+} IO_STATUS_BLOCK, *PIO_STATUS_BLOCK;
+
+typedef struct _IRP IRP, *PIRP;
+
+typedef NTSTATUS
+IO_COMPLETION_ROUTINE(PDEVICE_OBJECT DeviceObject, PIRP Irp, PVOID Context);
+typedef IO_COMPLETION_ROUTINE *PIO_COMPLETION_ROUTINE;
+
+typedef NTSTATUS DRIVER_DISPATCH(PDEVICE_OBJECT DeviceObject, PIRP Irp);
+typedef NTSTATUS DRIVER_INITIALIZE(PDRIVER_OBJECT DriverObject,
+                                   PUNICODE_STRING RegistryPath);
+typedef VOID DRIVER_UNLOAD(PDRIVER_OBJECT DriverObject);
+typedef NTSTATUS DRIVER_ADD_DEVICE(PDRIVER_OBJECT DriverObject,
+                                   PDEVICE_OBJECT PhysicalDeviceObject);
+
+typedef struct _IO_STACK_LOCATION
+{
+    UCHAR MajorFunction;
+    UCHAR MinorFunction;
+    UCHAR Flags;
+    UCHAR Control;
+    union
+    {
+        struct
+        {
+            ULONG         Length;
+            ULONG         Key;
+            LARGE_INTEGER ByteOffset;
+        } Read;
+        struct
+        {
+            ULONG         OutputBufferLength;
+            ULONG         InputBufferLength;
+            ULONG         IoControlCode;
+            PVOID         Type3InputBuffer;
+        } DeviceIoControl;
+        struct
+        {
+            PVOID Argument1;
+            PVOID Argument2;
+            PVOID Argument3;
+            PVOID Argument4;
+        } Others;
+    } Parameters;
+    PDEVICE_OBJECT         DeviceObject;
+    PFILE_OBJECT           FileObject;
+    PIO_COMPLETION_ROUTINE CompletionRoutine;
+    PVOID                  Context;
+} IO_STACK_LOCATION, *PIO_STACK_LOCATION;
+
+struct _IRP
+{
+    PMDL            MdlAddress;
+    union
+    {
+        PVOID SystemBuffer;
+    } AssociatedIrp;
+    IO_STATUS_BLOCK IoStatus;
+    BOOLEAN         PendingReturned;
+    BOOLEAN         Cancel;
+    PVOID           UserBuffer;
+    union
+    {
+        struct
+        {
+            LIST_ENTRY          ListEntry;
+            PIO_STACK_LOCATION  CurrentStackLocation;
+        } Overlay;
+    } Tail;
+    IO_STACK_LOCATION Stack;
+};
+
+FORCEINLINE PIO_STACK_LOCATION IoGetCurrentIrpStackLocation(PIRP Irp)
+{
+    return Irp->Tail.Overlay.CurrentStackLocation;
+}
+
+FORCEINLINE VOID IoMarkIrpPending(PIRP Irp)
+{
+    Irp->PendingReturned = TRUE;
+}
+
+/* Completion routine is called by IoCompleteRequest() */
+FORCEINLINE VOID IoSetCompletionRoutine(PIRP Irp,
+                                        PIO_COMPLETION_ROUTINE CompletionRoutine,
+                                        PVOID Context,
+                                        BOOLEAN InvokeOnSuccess,
+                                        BOOLEAN InvokeOnError,
+                                        BOOLEAN InvokeOnCancel)
+{
+    UNREFERENCED_PARAMETER(InvokeOnSuccess);
+    UNREFERENCED_PARAMETER(InvokeOnError);
+    UNREFERENCED_PARAMETER(InvokeOnCancel);
+
+    Irp->Tail.Overlay.CurrentStackLocation->CompletionRoutine = CompletionRoutine;
+    Irp->Tail.Overlay.CurrentStackLocation->Context = Context;
+}
+
+PIRP IoAllocateIrp(CCHAR StackSize, BOOLEAN ChargeQuota);
+VOID IoFreeIrp(PIRP Irp);
+VOID IoCompleteRequest(PIRP Irp, CCHAR PriorityBoost);
+
+PMDL IoAllocateMdl(PVOID VirtualAddress, ULONG Length,
+                   BOOLEAN SecondaryBuffer, BOOLEAN ChargeQuota, PIRP Irp);
+VOID IoFreeMdl(PMDL Mdl);
+
+typedef struct _IO_REMOVE_LOCK
+{
+    LONG IoCount;
+} IO_REMOVE_LOCK, *PIO_REMOVE_LOCK;
+
+////////////////////////////////////////////////////////////
+// Cancel-safe IRP queue. Cancel routines are not supported, queued IRPs
+// are only removed with IoCsqRemoveNextIrp().
+//
+struct _IO_CSQ;
+
+typedef VOID IO_CSQ_INSERT_IRP(struct _IO_CSQ *Csq, PIRP Irp);
+typedef VOID IO_CSQ_REMOVE_IRP(struct _IO_CSQ *Csq, PIRP Irp);
+typedef PIRP IO_CSQ_PEEK_NEXT_IRP(struct _IO_CSQ *Csq, PIRP Irp,
+                                  PVOID PeekContext);
+typedef VOID IO_CSQ_ACQUIRE_LOCK(struct _IO_CSQ *Csq, PKIRQL Irql);
+typedef VOID IO_CSQ_RELEASE_LOCK(struct _IO_CSQ *Csq, KIRQL Irql);
+typedef VOID IO_CSQ_COMPLETE_CANCELED_IRP(struct _IO_CSQ *Csq, PIRP Irp);
+
+typedef struct _IO_CSQ
+{
+    IO_CSQ_INSERT_IRP            *CsqInsertIrp;
+    IO_CSQ_REMOVE_IRP            *CsqRemoveIrp;
+    IO_CSQ_PEEK_NEXT_IRP         *CsqPeekNextIrp;
+    IO_CSQ_ACQUIRE_LOCK          *CsqAcquireLock;
+    IO_CSQ_RELEASE_LOCK          *CsqReleaseLock;
+    IO_CSQ_COMPLETE_CANCELED_IRP *CsqCompleteCanceledIrp;
+} IO_CSQ, *PIO_CSQ;
+
+typedef struct _IO_CSQ_IRP_CONTEXT
+{
+    PIRP    Irp;
+    PIO_CSQ Csq;
+} IO_CSQ_IRP_CONTEXT, *PIO_CSQ_IRP_CONTEXT;
+
+NTSTATUS IoCsqInitialize(PIO_CSQ Csq,
+                         IO_CSQ_INSERT_IRP *CsqInsertIrp,
+                         IO_CSQ_REMOVE_IRP *CsqRemoveIrp,
+                         IO_CSQ_PEEK_NEXT_IRP *CsqPeekNextIrp,
+                         IO_CSQ_ACQUIRE_LOCK *CsqAcquireLock,
+                         IO_CSQ_RELEASE_LOCK *CsqReleaseLock,
+                         IO_CSQ_COMPLETE_CANCELED_IRP *CsqCompleteCanceledIrp);
+VOID IoCsqInsertIrp(PIO_CSQ Csq, PIRP Irp, PIO_CSQ_IRP_CONTEXT Context);
+PIRP IoCsqRemoveNextIrp(PIO_CSQ Csq, PVOID PeekContext);
+
+////////////////////////////////////////////////////////////
+// Debugging
+//
+ULONG DbgPrint(const char *Format, ...);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* USBPCAP_PORTABLE_NTDDK_H */
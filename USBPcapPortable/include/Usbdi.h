@@ -0,0 +1,12 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_PORTABLE_USBDI_H
+#define USBPCAP_PORTABLE_USBDI_H
+
+#include "usb.h"
+
+#endif /* USBPCAP_PORTABLE_USBDI_H */
@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_PORTABLE_USBDLIB_H
+#define USBPCAP_PORTABLE_USBDLIB_H
+
+#include "usb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Parameters set to -1 match any value */
+PUSB_INTERFACE_DESCRIPTOR
+USBD_ParseConfigurationDescriptorEx(PUSB_CONFIGURATION_DESCRIPTOR ConfigurationDescriptor,
+                                    PVOID StartPosition,
+                                    LONG InterfaceNumber,
+                                    LONG AlternateSetting,
+                                    LONG InterfaceClass,
+                                    LONG InterfaceSubClass,
+                                    LONG InterfaceProtocol);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* USBPCAP_PORTABLE_USBDLIB_H */
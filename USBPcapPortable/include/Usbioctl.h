@@ -0,0 +1,21 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_PORTABLE_USBIOCTL_H
+#define USBPCAP_PORTABLE_USBIOCTL_H
+
+#include "usb.h"
+
+#define FILE_DEVICE_USB_INTERNAL  FILE_DEVICE_USB
+
+#define IOCTL_INTERNAL_USB_SUBMIT_URB \
+    CTL_CODE(FILE_DEVICE_USB, 0, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define IOCTL_INTERNAL_USB_GET_PORT_STATUS \
+    CTL_CODE(FILE_DEVICE_USB, 4, METHOD_NEITHER, FILE_ANY_ACCESS)
+#define IOCTL_INTERNAL_USB_RESET_PORT \
+    CTL_CODE(FILE_DEVICE_USB, 1, METHOD_NEITHER, FILE_ANY_ACCESS)
+
+#endif /* USBPCAP_PORTABLE_USBIOCTL_H */
@@ -0,0 +1,15 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_PORTABLE_WTYPES_H
+#define USBPCAP_PORTABLE_WTYPES_H
+
+/* USBPcapCMD sources that do not call Win32 API include only wtypes.h,
+ * the basic types are the same as in kernel headers.
+ */
+#include "Ntddk.h"
+
+#endif /* USBPCAP_PORTABLE_WTYPES_H */
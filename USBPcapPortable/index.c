@@ -0,0 +1,947 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * usbpcap-index - builds sidecar index of DLT_USBPCAP capture and answers
+ * queries by device, endpoint, transfer type, status, time and irpId
+ * without scanning the capture.
+ *
+ * Index file layout (host byte order):
+ *   INDEX_HEADER
+ *   INDEX_ENTRY  entries[numberOfEntries]  in capture order
+ *   INDEX_BLOCK  blocks[numberOfBlocks]    one per INDEX_BLOCK_RECORDS entries
+ *   INDEX_IRP    irps[numberOfEntries]     sorted by irpId, then entry
+ *
+ * Blocks hold timestamp range and device, endpoint and transfer type
+ * bitmaps of their entries, so queries skip blocks that cannot match.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pcapscan.h"
+
+#define INDEX_MAGIC          "USBPCIDX"
+#define INDEX_VERSION        1
+#define INDEX_BLOCK_RECORDS  4096
+#define INDEX_SUFFIX         ".idx"
+#define MAX_THREADS          64
+
+#define NSEC_PER_SEC         1000000000ULL
+
+typedef struct _INDEX_HEADER
+{
+    char    magic[8];
+    UINT32  version;
+    UINT32  blockRecords;
+    UINT64  captureSize;
+    INT64   captureModified;  /* ns since Unix epoch */
+    UINT64  numberOfEntries;
+    UINT64  numberOfBlocks;
+    UINT64  entriesOffset;
+    UINT64  blocksOffset;
+    UINT64  irpsOffset;
+} INDEX_HEADER;
+
+typedef struct _INDEX_ENTRY
+{
+    UINT64  offset;     /* record header offset in capture */
+    UINT64  timestamp;  /* ns since Unix epoch */
+    UINT64  irpId;
+    INT32   status;
+    UINT32  length;     /* captured record length */
+    USHORT  bus;
+    USHORT  device;
+    USHORT  function;
+    UCHAR   endpoint;
+    UCHAR   transfer;
+    UCHAR   info;
+    UCHAR   reserved[7];
+} INDEX_ENTRY;
+
+/* INDEX_BLOCK flags, bits 0 to 3 are USBPCAP_TRANSFER_xxx */
+#define BLOCK_TRANSFER_OTHER  (1 << 4)
+#define BLOCK_ERROR           (1 << 5)
+
+typedef struct _INDEX_BLOCK
+{
+    UINT64  minTimestamp;
+    UINT64  maxTimestamp;
+    UINT32  devices[4];   /* bit per device address 0 to 127 */
+    UINT32  endpoints;    /* bit (endpoint & 0x0F) + 16 for IN */
+    UINT32  flags;
+} INDEX_BLOCK;
+
+typedef struct _INDEX_IRP
+{
+    UINT64  irpId;
+    UINT64  entry;
+} INDEX_IRP;
+
+/* Capture part processed by single thread */
+typedef struct _CHUNK
+{
+    pthread_t          thread;
+    const PCAP_FILE   *file;
+    UINT64             nominalStart;
+    UINT64             nominalEnd;   /* records starting before belong here */
+    UINT64             start;        /* first record */
+    UINT64             end;          /* offset after the last record */
+    UINT64             count;
+    BOOLEAN            corrupted;    /* stopped at invalid record */
+
+    /* Filled in second pass */
+    UINT64             firstEntry;
+    INDEX_ENTRY       *entries;
+    INDEX_IRP         *irps;
+} CHUNK;
+
+static int compare_irp(const void *a, const void *b)
+{
+    const INDEX_IRP *x = (const INDEX_IRP *)a;
+    const INDEX_IRP *y = (const INDEX_IRP *)b;
+
+    if (x->irpId != y->irpId)
+    {
+        return (x->irpId < y->irpId) ? -1 : 1;
+    }
+    return (x->entry < y->entry) ? -1 : ((x->entry > y->entry) ? 1 : 0);
+}
+
+/* Counts records from chunk->start that start before nominalEnd */
+static void chunk_count(CHUNK *chunk)
+{
+    PCAP_RECORD record;
+    UINT64      offset = chunk->start;
+    int         result = 1;
+
+    chunk->count = 0;
+    chunk->corrupted = FALSE;
+    while ((offset < chunk->nominalEnd) &&
+           ((result = pcap_read_record(chunk->file, offset, &record)) == 1))
+    {
+        chunk->count++;
+        offset += sizeof(pcaprec_hdr_t) + record.inclLen;
+    }
+    chunk->end = offset;
+    if (result < 0)
+    {
+        chunk->corrupted = TRUE;
+    }
+}
+
+static void *count_thread(void *arg)
+{
+    CHUNK *chunk = (CHUNK *)arg;
+
+    if (chunk->nominalStart == PCAP_FIRST_RECORD)
+    {
+        chunk->start = PCAP_FIRST_RECORD;
+    }
+    else
+    {
+        chunk->start = pcap_find_record(chunk->file, chunk->nominalStart);
+    }
+    chunk_count(chunk);
+
+    return NULL;
+}
+
+static void *fill_thread(void *arg)
+{
+    CHUNK       *chunk = (CHUNK *)arg;
+    SCANNER      scanner;
+    SCAN_BATCH  *batch;
+    UINT64       n = 0;
+    UINT32       i;
+
+    batch = (SCAN_BATCH *)malloc(sizeof(SCAN_BATCH));
+    if (batch == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    scan_init(&scanner, chunk->file, chunk->start, chunk->end);
+    while (scan_next(&scanner, batch) > 0)
+    {
+        for (i = 0; i < batch->count; i++, n++)
+        {
+            INDEX_ENTRY *entry = &chunk->entries[n];
+
+            memset(entry, 0, sizeof(INDEX_ENTRY));
+            entry->offset = batch->offset[i];
+            entry->timestamp = batch->timestamp[i];
+            entry->irpId = batch->irpId[i];
+            entry->status = batch->status[i];
+            entry->length = batch->inclLen[i];
+            entry->bus = batch->bus[i];
+            entry->device = batch->device[i];
+            entry->function = batch->function[i];
+            entry->endpoint = batch->endpoint[i];
+            entry->transfer = batch->transfer[i];
+            entry->info = batch->info[i];
+
+            chunk->irps[n].irpId = entry->irpId;
+            chunk->irps[n].entry = chunk->firstEntry + n;
+        }
+    }
+    free(batch);
+
+    qsort(chunk->irps, (size_t)chunk->count, sizeof(INDEX_IRP), compare_irp);
+
+    return NULL;
+}
+
+static void block_add(INDEX_BLOCK *block, const INDEX_ENTRY *entry)
+{
+    if (entry->timestamp < block->minTimestamp)
+    {
+        block->minTimestamp = entry->timestamp;
+    }
+    if (entry->timestamp > block->maxTimestamp)
+    {
+        block->maxTimestamp = entry->timestamp;
+    }
+    if (entry->device < 128)
+    {
+        block->devices[entry->device / 32] |= 1U << (entry->device % 32);
+    }
+    block->endpoints |= 1U << ((entry->endpoint & 0x0F) +
+                               ((entry->endpoint & 0x80) ? 16 : 0));
+    if (entry->transfer <= USBPCAP_TRANSFER_BULK)
+    {
+        block->flags |= 1U << entry->transfer;
+    }
+    else
+    {
+        block->flags |= BLOCK_TRANSFER_OTHER;
+    }
+    if (USBD_ERROR(entry->status))
+    {
+        block->flags |= BLOCK_ERROR;
+    }
+}
+
+static void index_name(char *name, size_t length, const char *capture)
+{
+    snprintf(name, length, "%s%s", capture, INDEX_SUFFIX);
+}
+
+static int index_build(const char *captureName, const char *indexName,
+                       int threads)
+{
+    PCAP_FILE     file;
+    CHUNK        *chunks;
+    INDEX_HEADER *header;
+    INDEX_ENTRY  *entries;
+    INDEX_BLOCK  *blocks;
+    INDEX_IRP    *irps;
+    INDEX_IRP    *merged;
+    struct stat   st;
+    char          error[256];
+    char          tmpName[4096 + sizeof(".tmp")];
+    UINT64        numberOfEntries = 0;
+    UINT64        numberOfBlocks;
+    UINT64        size;
+    UINT64        dataSize;
+    UINT64        i;
+    void         *map;
+    int           numberOfChunks;
+    int           fd;
+    int           k;
+
+    if (pcap_open(&file, captureName, error, sizeof(error)) != 0)
+    {
+        fprintf(stderr, "%s\n", error);
+        return -1;
+    }
+    if (file.network != DLT_USBPCAP)
+    {
+        fprintf(stderr, "%s: link type %u is not DLT_USBPCAP\n",
+                captureName, file.network);
+        pcap_close(&file);
+        return -1;
+    }
+    if (stat(captureName, &st) != 0)
+    {
+        fprintf(stderr, "%s: %s\n", captureName, strerror(errno));
+        pcap_close(&file);
+        return -1;
+    }
+
+    /* Chunks smaller than 1 MiB are not worth a thread */
+    dataSize = file.size - PCAP_FIRST_RECORD;
+    numberOfChunks = (int)min((UINT64)threads, dataSize / (1024 * 1024) + 1);
+
+    chunks = (CHUNK *)calloc(numberOfChunks, sizeof(CHUNK));
+    if (chunks == NULL)
+    {
+        pcap_close(&file);
+        return -1;
+    }
+
+    /* First pass: find record boundaries and count records */
+    for (k = 0; k < numberOfChunks; k++)
+    {
+        chunks[k].file = &file;
+        chunks[k].nominalStart = PCAP_FIRST_RECORD + dataSize * k / numberOfChunks;
+        chunks[k].nominalEnd = PCAP_FIRST_RECORD + dataSize * (k + 1) / numberOfChunks;
+        pthread_create(&chunks[k].thread, NULL, count_thread, &chunks[k]);
+    }
+    for (k = 0; k < numberOfChunks; k++)
+    {
+        pthread_join(chunks[k].thread, NULL);
+    }
+
+    /* Chunk boundaries found by resync must match where the previous
+     * chunk ended, otherwise count the chunk again from the right place.
+     */
+    for (k = 0; k < numberOfChunks; k++)
+    {
+        if ((k > 0) && chunks[k - 1].corrupted)
+        {
+            chunks[k].start = chunks[k - 1].end;
+            chunks[k].end = chunks[k].start;
+            chunks[k].count = 0;
+            chunks[k].corrupted = TRUE;
+            continue;
+        }
+        if ((k > 0) && (chunks[k].start != chunks[k - 1].end))
+        {
+            chunks[k].start = chunks[k - 1].end;
+            chunk_count(&chunks[k]);
+        }
+        chunks[k].firstEntry = numberOfEntries;
+        numberOfEntries += chunks[k].count;
+    }
+    if (chunks[numberOfChunks - 1].corrupted)
+    {
+        UINT64 offset = chunks[numberOfChunks - 1].end;
+
+        for (k = 0; k < numberOfChunks; k++)
+        {
+            if (chunks[k].corrupted)
+            {
+                offset = chunks[k].end;
+                break;
+            }
+        }
+        fprintf(stderr, "%s: invalid record at offset %llu, "
+                "index covers records before it\n",
+                captureName, (unsigned long long)offset);
+    }
+
+    numberOfBlocks = (numberOfEntries + INDEX_BLOCK_RECORDS - 1) /
+                     INDEX_BLOCK_RECORDS;
+    size = sizeof(INDEX_HEADER) +
+           numberOfEntries * sizeof(INDEX_ENTRY) +
+           numberOfBlocks * sizeof(INDEX_BLOCK) +
+           numberOfEntries * sizeof(INDEX_IRP);
+
+    /* Write under temporary name so index is either complete or absent */
+    snprintf(tmpName, sizeof(tmpName), "%s.tmp", indexName);
+    fd = open(tmpName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if ((fd < 0) || (ftruncate(fd, (off_t)size) != 0))
+    {
+        fprintf(stderr, "%s: %s\n", tmpName, strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        free(chunks);
+        pcap_close(&file);
+        return -1;
+    }
+    map = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "%s: %s\n", tmpName, strerror(errno));
+        unlink(tmpName);
+        free(chunks);
+        pcap_close(&file);
+        return -1;
+    }
+
+    header = (INDEX_HEADER *)map;
+    entries = (INDEX_ENTRY *)&header[1];
+    blocks = (INDEX_BLOCK *)&entries[numberOfEntries];
+    irps = (INDEX_IRP *)&blocks[numberOfBlocks];
+
+    /* Second pass: fill entries and sort irpId runs */
+    for (k = 0; k < numberOfChunks; k++)
+    {
+        chunks[k].entries = &entries[chunks[k].firstEntry];
+        chunks[k].irps = &irps[chunks[k].firstEntry];
+        pthread_create(&chunks[k].thread, NULL, fill_thread, &chunks[k]);
+    }
+    for (k = 0; k < numberOfChunks; k++)
+    {
+        pthread_join(chunks[k].thread, NULL);
+    }
+
+    for (i = 0; i < numberOfBlocks; i++)
+    {
+        UINT64 first = i * INDEX_BLOCK_RECORDS;
+        UINT64 last = min(first + INDEX_BLOCK_RECORDS, numberOfEntries);
+        UINT64 j;
+
+        memset(&blocks[i], 0, sizeof(INDEX_BLOCK));
+        blocks[i].minTimestamp = ~0ULL;
+        for (j = first; j < last; j++)
+        {
+            block_add(&blocks[i], &entries[j]);
+        }
+    }
+
+    /* Merge sorted irpId runs of the chunks */
+    merged = (INDEX_IRP *)malloc((size_t)max(numberOfEntries, 1) *
+                                 sizeof(INDEX_IRP));
+    if (merged == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        munmap(map, (size_t)size);
+        unlink(tmpName);
+        free(chunks);
+        pcap_close(&file);
+        return -1;
+    }
+    {
+        UINT64 position[MAX_THREADS];
+
+        for (k = 0; k < numberOfChunks; k++)
+        {
+            position[k] = 0;
+        }
+        for (i = 0; i < numberOfEntries; i++)
+        {
+            int best = -1;
+
+            for (k = 0; k < numberOfChunks; k++)
+            {
+                if ((position[k] < chunks[k].count) &&
+                    ((best < 0) ||
+                     (compare_irp(&chunks[k].irps[position[k]],
+                                  &chunks[best].irps[position[best]]) < 0)))
+                {
+                    best = k;
+                }
+            }
+            merged[i] = chunks[best].irps[position[best]++];
+        }
+    }
+    memcpy(irps, merged, (size_t)numberOfEntries * sizeof(INDEX_IRP));
+    free(merged);
+
+    memset(header, 0, sizeof(INDEX_HEADER));
+    header->version = INDEX_VERSION;
+    header->blockRecords = INDEX_BLOCK_RECORDS;
+    header->captureSize = file.size;
+    header->captureModified = (INT64)st.st_mtim.tv_sec * (INT64)NSEC_PER_SEC +
+                              st.st_mtim.tv_nsec;
+    header->numberOfEntries = numberOfEntries;
+    header->numberOfBlocks = numberOfBlocks;
+    header->entriesOffset = (UINT64)((UCHAR *)entries - (UCHAR *)map);
+    header->blocksOffset = (UINT64)((UCHAR *)blocks - (UCHAR *)map);
+    header->irpsOffset = (UINT64)((UCHAR *)irps - (UCHAR *)map);
+    /* Magic goes last */
+    memcpy(header->magic, INDEX_MAGIC, sizeof(header->magic));
+
+    if ((msync(map, (size_t)size, MS_SYNC) != 0) ||
+        (rename(tmpName, indexName) != 0))
+    {
+        fprintf(stderr, "%s: %s\n", indexName, strerror(errno));
+        munmap(map, (size_t)size);
+        unlink(tmpName);
+        free(chunks);
+        pcap_close(&file);
+        return -1;
+    }
+
+    fprintf(stderr, "%s: %llu records, %llu blocks, %d threads\n", indexName,
+            (unsigned long long)numberOfEntries,
+            (unsigned long long)numberOfBlocks, numberOfChunks);
+
+    munmap(map, (size_t)size);
+    free(chunks);
+    pcap_close(&file);
+    return 0;
+}
+
+typedef struct _QUERY
+{
+    int      bus;       /* -1 for any */
+    int      device;
+    int      endpoint;
+    int      transfer;
+    BOOLEAN  errors;
+    BOOLEAN  hasIrp;
+    UINT64   irpId;
+    UINT64   from;      /* ns relative to first record */
+    UINT64   to;
+    UINT64   limit;     /* 0 for no limit */
+    BOOLEAN  count;
+    FILE    *output;    /* pcap file for matching records */
+} QUERY;
+
+static const char *transfer_name(UCHAR transfer)
+{
+    switch (transfer)
+    {
+        case USBPCAP_TRANSFER_ISOCHRONOUS:
+            return "isochronous";
+        case USBPCAP_TRANSFER_INTERRUPT:
+            return "interrupt";
+        case USBPCAP_TRANSFER_CONTROL:
+            return "control";
+        case USBPCAP_TRANSFER_BULK:
+            return "bulk";
+        case USBPCAP_TRANSFER_FILTER_MARKER:
+            return "marker";
+        case USBPCAP_TRANSFER_IRP_INFO:
+            return "irp-info";
+        default:
+            return "unknown";
+    }
+}
+
+static int parse_transfer(const char *name)
+{
+    int transfer;
+
+    for (transfer = 0; transfer < 256; transfer++)
+    {
+        if (strcmp(transfer_name((UCHAR)transfer), name) == 0)
+        {
+            return transfer;
+        }
+    }
+    return -1;
+}
+
+static BOOLEAN block_may_match(const INDEX_BLOCK *block, const QUERY *query,
+                               UINT64 from, UINT64 to)
+{
+    if ((block->maxTimestamp < from) || (block->minTimestamp > to))
+    {
+        return FALSE;
+    }
+    if ((query->device >= 0) &&
+        ((query->device >= 128) ||
+         !(block->devices[query->device / 32] & (1U << (query->device % 32)))))
+    {
+        return FALSE;
+    }
+    if ((query->endpoint >= 0) &&
+        !(block->endpoints & (1U << ((query->endpoint & 0x0F) +
+                                     ((query->endpoint & 0x80) ? 16 : 0)))))
+    {
+        return FALSE;
+    }
+    if (query->transfer >= 0)
+    {
+        UINT32 bit = (query->transfer <= USBPCAP_TRANSFER_BULK) ?
+                     (1U << query->transfer) : BLOCK_TRANSFER_OTHER;
+
+        if (!(block->flags & bit))
+        {
+            return FALSE;
+        }
+    }
+    if (query->errors && !(block->flags & BLOCK_ERROR))
+    {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static BOOLEAN entry_matches(const INDEX_ENTRY *entry, const QUERY *query,
+                             UINT64 from, UINT64 to)
+{
+    return ((entry->timestamp >= from) && (entry->timestamp <= to) &&
+            ((query->bus < 0) || (entry->bus == query->bus)) &&
+            ((query->device < 0) || (entry->device == query->device)) &&
+            ((query->endpoint < 0) || (entry->endpoint == query->endpoint)) &&
+            ((query->transfer < 0) || (entry->transfer == query->transfer)) &&
+            (!query->errors || USBD_ERROR(entry->status)) &&
+            (!query->hasIrp || (entry->irpId == query->irpId))) ? TRUE : FALSE;
+}
+
+/* Prints or extracts matching entry. Returns FALSE when limit is reached. */
+static BOOLEAN report_entry(const PCAP_FILE *file, const INDEX_ENTRY *entry,
+                            UINT64 first, const QUERY *query, UINT64 *matches)
+{
+    (*matches)++;
+
+    if (query->output != NULL)
+    {
+        fwrite(&file->data[entry->offset], 1,
+               sizeof(pcaprec_hdr_t) + entry->length, query->output);
+    }
+    else if (!query->count)
+    {
+        UINT64 time = entry->timestamp - first;
+
+        printf("%llu %llu.%09llu %u %u 0x%02X %s %s 0x%04X 0x%08X 0x%016llX %u\n",
+               (unsigned long long)entry->offset,
+               (unsigned long long)(time / NSEC_PER_SEC),
+               (unsigned long long)(time % NSEC_PER_SEC),
+               entry->bus, entry->device, entry->endpoint,
+               transfer_name(entry->transfer),
+               (entry->info & USBPCAP_INFO_PDO_TO_FDO) ? "complete" : "submit",
+               entry->function, (UINT32)entry->status,
+               (unsigned long long)entry->irpId, entry->length);
+    }
+
+    return ((query->limit == 0) || (*matches < query->limit)) ? TRUE : FALSE;
+}
+
+static int index_query(const char *captureName, const char *indexName,
+                       const QUERY *query)
+{
+    PCAP_FILE           file;
+    const INDEX_HEADER *header;
+    const INDEX_ENTRY  *entries;
+    const INDEX_BLOCK  *blocks;
+    const INDEX_IRP    *irps;
+    struct stat         st;
+    char                error[256];
+    UINT64              first;
+    UINT64              from;
+    UINT64              to;
+    UINT64              matches = 0;
+    UINT64              i;
+    void               *map;
+    size_t              size;
+    int                 fd;
+
+    if (pcap_open(&file, captureName, error, sizeof(error)) != 0)
+    {
+        fprintf(stderr, "%s\n", error);
+        return -1;
+    }
+
+    fd = open(indexName, O_RDONLY);
+    if ((fd < 0) || (fstat(fd, &st) != 0) ||
+        ((UINT64)st.st_size < sizeof(INDEX_HEADER)))
+    {
+        fprintf(stderr, "%s: no index, run build first\n", indexName);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        pcap_close(&file);
+        return -1;
+    }
+    size = (size_t)st.st_size;
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "%s: %s\n", indexName, strerror(errno));
+        pcap_close(&file);
+        return -1;
+    }
+
+    header = (const INDEX_HEADER *)map;
+    if ((memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0) ||
+        (header->version != INDEX_VERSION) ||
+        (header->irpsOffset + header->numberOfEntries * sizeof(INDEX_IRP) > size))
+    {
+        fprintf(stderr, "%s: not a valid index\n", indexName);
+        munmap(map, size);
+        pcap_close(&file);
+        return -1;
+    }
+    if ((stat(captureName, &st) != 0) ||
+        (header->captureSize != file.size) ||
+        (header->captureModified != (INT64)st.st_mtim.tv_sec *
+                                    (INT64)NSEC_PER_SEC + st.st_mtim.tv_nsec))
+    {
+        fprintf(stderr, "%s: index is out of date, run build again\n",
+                indexName);
+        munmap(map, size);
+        pcap_close(&file);
+        return -1;
+    }
+
+    entries = (const INDEX_ENTRY *)((const UCHAR *)map + header->entriesOffset);
+    blocks = (const INDEX_BLOCK *)((const UCHAR *)map + header->blocksOffset);
+    irps = (const INDEX_IRP *)((const UCHAR *)map + header->irpsOffset);
+
+    first = (header->numberOfEntries > 0) ? entries[0].timestamp : 0;
+    from = first + query->from;
+    to = (query->to == ~0ULL) ? ~0ULL : first + query->to;
+
+    if (query->output != NULL)
+    {
+        fwrite(file.data, 1, sizeof(pcap_hdr_t), query->output);
+    }
+
+    if (query->hasIrp)
+    {
+        /* Binary search for the first entry with irpId */
+        UINT64 low = 0;
+        UINT64 high = header->numberOfEntries;
+
+        while (low < high)
+        {
+            UINT64 middle = low + (high - low) / 2;
+
+            if (irps[middle].irpId < query->irpId)
+            {
+                low = middle + 1;
+            }
+            else
+            {
+                high = middle;
+            }
+        }
+
+        for (i = low;
+             (i < header->numberOfEntries) && (irps[i].irpId == query->irpId);
+             i++)
+        {
+            const INDEX_ENTRY *entry = &entries[irps[i].entry];
+
+            if (entry_matches(entry, query, from, to) &&
+                !report_entry(&file, entry, first, query, &matches))
+            {
+                break;
+            }
+        }
+    }
+    else
+    {
+        UINT64 b;
+
+        for (b = 0; b < header->numberOfBlocks; b++)
+        {
+            UINT64 last;
+
+            if (!block_may_match(&blocks[b], query, from, to))
+            {
+                continue;
+            }
+
+            last = min((b + 1) * header->blockRecords, header->numberOfEntries);
+            for (i = b * header->blockRecords; i < last; i++)
+            {
+                if (entry_matches(&entries[i], query, from, to) &&
+                    !report_entry(&file, &entries[i], first, query, &matches))
+                {
+                    b = header->numberOfBlocks;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (query->count)
+    {
+        printf("%llu\n", (unsigned long long)matches);
+    }
+
+    munmap(map, size);
+    pcap_close(&file);
+    return 0;
+}
+
+/* Parses seconds with optional fraction to ns */
+static UINT64 parse_seconds(const char *text)
+{
+    return (UINT64)(strtod(text, NULL) * NSEC_PER_SEC + 0.5);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s build [-j threads] [-i index] <capture.pcap>\n"
+            "       %s query [options] <capture.pcap>\n"
+            "\n"
+            "Index is stored next to the capture with %s suffix unless\n"
+            "-i is given.\n"
+            "\n"
+            "Query options:\n"
+            "  -i, --index <file>      index file\n"
+            "      --bus <n>           root hub number\n"
+            "  -d, --device <n>        device address\n"
+            "  -e, --endpoint <n>      endpoint address with direction bit,\n"
+            "                          for example 0x81\n"
+            "  -t, --transfer <type>   isochronous, interrupt, control, bulk,\n"
+            "                          marker, irp-info or unknown\n"
+            "  -E, --errors            records with USBD error status\n"
+            "  -I, --irp <id>          records of single IRP\n"
+            "  -f, --from <s>          seconds since the first record\n"
+            "  -T, --to <s>            seconds since the first record\n"
+            "  -n, --limit <n>         stop after n records\n"
+            "  -c, --count             print number of matching records only\n"
+            "  -w, --write <file>      write matching records to pcap file\n"
+            "\n"
+            "Matching records are printed one per line: offset, time, bus,\n"
+            "device, endpoint, transfer, submit/complete, function, status,\n"
+            "irpId and captured length.\n",
+            name, name, INDEX_SUFFIX);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] =
+    {
+        {"threads",  required_argument, NULL, 'j'},
+        {"index",    required_argument, NULL, 'i'},
+        {"bus",      required_argument, NULL, 'b'},
+        {"device",   required_argument, NULL, 'd'},
+        {"endpoint", required_argument, NULL, 'e'},
+        {"transfer", required_argument, NULL, 't'},
+        {"errors",   no_argument,       NULL, 'E'},
+        {"irp",      required_argument, NULL, 'I'},
+        {"from",     required_argument, NULL, 'f'},
+        {"to",       required_argument, NULL, 'T'},
+        {"limit",    required_argument, NULL, 'n'},
+        {"count",    no_argument,       NULL, 'c'},
+        {"write",    required_argument, NULL, 'w'},
+        {"help",     no_argument,       NULL, 'h'},
+        {NULL,       0,                 NULL, 0}
+    };
+    QUERY        query;
+    const char  *command;
+    const char  *indexArg = NULL;
+    const char  *outputName = NULL;
+    char         indexName[4096];
+    long         threads;
+    int          result;
+    int          opt;
+
+    if (argc < 2)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    command = argv[1];
+
+    memset(&query, 0, sizeof(query));
+    query.bus = -1;
+    query.device = -1;
+    query.endpoint = -1;
+    query.transfer = -1;
+    query.to = ~0ULL;
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    optind = 2;
+    while ((opt = getopt_long(argc, argv, "j:i:d:e:t:EI:f:T:n:cw:h",
+                              options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'j':
+                threads = strtol(optarg, NULL, 0);
+                break;
+            case 'i':
+                indexArg = optarg;
+                break;
+            case 'b':
+                query.bus = (int)strtol(optarg, NULL, 0);
+                break;
+            case 'd':
+                query.device = (int)strtol(optarg, NULL, 0);
+                break;
+            case 'e':
+                query.endpoint = (int)strtol(optarg, NULL, 0) & 0xFF;
+                break;
+            case 't':
+                query.transfer = parse_transfer(optarg);
+                if (query.transfer < 0)
+                {
+                    fprintf(stderr, "Unknown transfer type %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'E':
+                query.errors = TRUE;
+                break;
+            case 'I':
+                query.hasIrp = TRUE;
+                query.irpId = strtoull(optarg, NULL, 0);
+                break;
+            case 'f':
+                query.from = parse_seconds(optarg);
+                break;
+            case 'T':
+                query.to = parse_seconds(optarg);
+                break;
+            case 'n':
+                query.limit = strtoull(optarg, NULL, 0);
+                break;
+            case 'c':
+                query.count = TRUE;
+                break;
+            case 'w':
+                outputName = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if (indexArg == NULL)
+    {
+        index_name(indexName, sizeof(indexName), argv[optind]);
+    }
+    else
+    {
+        snprintf(indexName, sizeof(indexName), "%s", indexArg);
+    }
+
+    if (strcmp(command, "build") == 0)
+    {
+        if ((threads < 1) || (threads > MAX_THREADS))
+        {
+            threads = (threads < 1) ? 1 : MAX_THREADS;
+        }
+        result = index_build(argv[optind], indexName, (int)threads);
+    }
+    else if (strcmp(command, "query") == 0)
+    {
+        if (outputName != NULL)
+        {
+            query.output = fopen(outputName, "wb");
+            if (query.output == NULL)
+            {
+                fprintf(stderr, "%s: %s\n", outputName, strerror(errno));
+                return 1;
+            }
+        }
+        result = index_query(argv[optind], indexName, &query);
+        if ((query.output != NULL) && (fclose(query.output) != 0))
+        {
+            fprintf(stderr, "%s: %s\n", outputName, strerror(errno));
+            result = -1;
+        }
+    }
+    else
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    return (result == 0) ? 0 : 1;
+}
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "isoch.h"
+
+/* Isochronous header without any packet */
+#define ISOCH_FIXED_LEN  offsetof(USBPCAP_BUFFER_ISOCH_HEADER, packet)
+
+void isoch_reassembler_init(PISOCH_REASSEMBLER reassembler)
+{
+    memset(reassembler, 0, sizeof(ISOCH_REASSEMBLER));
+}
+
+void isoch_reassembler_free(PISOCH_REASSEMBLER reassembler)
+{
+    free(reassembler->packet);
+    free(reassembler->data);
+    memset(reassembler, 0, sizeof(ISOCH_REASSEMBLER));
+}
+
+/* Grows *array to hold at least count elements of size bytes */
+static int isoch_grow(void **array, UINT32 *alloc, UINT64 count, size_t size)
+{
+    UINT64 grown;
+    void  *tmp;
+
+    if (count <= *alloc)
+    {
+        return 0;
+    }
+    if (count > 0xFFFFFFFFULL)
+    {
+        return -1;
+    }
+
+    grown = (UINT64)*alloc * 2;
+    if (grown < count)
+    {
+        grown = count;
+    }
+    if (grown > 0xFFFFFFFFULL)
+    {
+        grown = 0xFFFFFFFFULL;
+    }
+
+    tmp = realloc(*array, (size_t)grown * size);
+    if (tmp == NULL)
+    {
+        return -1;
+    }
+    *array = tmp;
+    *alloc = (UINT32)grown;
+    return 0;
+}
+
+static BOOLEAN isoch_continues(const USBPCAP_BUFFER_ISOCH_HEADER *pending,
+                               const USBPCAP_BUFFER_ISOCH_HEADER *next)
+{
+    return ((pending->header.irpId == next->header.irpId) &&
+            (pending->header.bus == next->header.bus) &&
+            (pending->header.device == next->header.device) &&
+            (pending->header.endpoint == next->header.endpoint) &&
+            ((pending->header.info & USBPCAP_INFO_PDO_TO_FDO) ==
+             (next->header.info & USBPCAP_INFO_PDO_TO_FDO)) &&
+            (pending->startFrame == next->startFrame)) ? TRUE : FALSE;
+}
+
+int isoch_reassembler_add(PISOCH_REASSEMBLER reassembler,
+                          const UCHAR *record, UINT32 length)
+{
+    USBPCAP_BUFFER_ISOCH_HEADER  header;
+    UINT32                       base;
+    UINT32                       captured;
+    UINT32                       i;
+
+    if (length < ISOCH_FIXED_LEN)
+    {
+        return ISOCH_ERROR;
+    }
+    memcpy(&header, record, ISOCH_FIXED_LEN);
+    if ((header.header.transfer != USBPCAP_TRANSFER_ISOCHRONOUS) ||
+        (header.header.headerLen > length) ||
+        (header.header.headerLen != ISOCH_FIXED_LEN +
+         (UINT64)header.numberOfPackets * sizeof(USBPCAP_BUFFER_ISO_PACKET)))
+    {
+        return ISOCH_ERROR;
+    }
+
+    if (reassembler->pending && !isoch_continues(&reassembler->header, &header))
+    {
+        reassembler->dropped++;
+        reassembler->pending = FALSE;
+    }
+
+    if (!reassembler->pending)
+    {
+        reassembler->header = header;
+        reassembler->header.numberOfPackets = 0;
+        reassembler->header.header.dataLength = 0;
+        reassembler->records = 0;
+        reassembler->truncated = FALSE;
+        reassembler->pending = TRUE;
+    }
+
+    base = reassembler->header.header.dataLength;
+    if ((header.header.dataLength > 0xFFFFFFFFU - base) ||
+        (isoch_grow((void **)&reassembler->packet, &reassembler->packetAlloc,
+                    (UINT64)reassembler->header.numberOfPackets +
+                    header.numberOfPackets,
+                    sizeof(USBPCAP_BUFFER_ISO_PACKET)) != 0) ||
+        (isoch_grow((void **)&reassembler->data, &reassembler->dataAlloc,
+                    (UINT64)base + header.header.dataLength, 1) != 0))
+    {
+        reassembler->pending = FALSE;
+        return ISOCH_ERROR;
+    }
+
+    /* Offsets in every record are relative to that record data */
+    memcpy(&reassembler->packet[reassembler->header.numberOfPackets],
+           &record[ISOCH_FIXED_LEN],
+           header.numberOfPackets * sizeof(USBPCAP_BUFFER_ISO_PACKET));
+    for (i = 0; i < header.numberOfPackets; i++)
+    {
+        reassembler->packet[reassembler->header.numberOfPackets + i].offset += base;
+    }
+
+    captured = length - header.header.headerLen;
+    if (captured > header.header.dataLength)
+    {
+        captured = header.header.dataLength;
+    }
+    memcpy(&reassembler->data[base], &record[header.header.headerLen], captured);
+    if (captured < header.header.dataLength)
+    {
+        memset(&reassembler->data[base + captured], 0,
+               header.header.dataLength - captured);
+        reassembler->truncated = TRUE;
+    }
+
+    reassembler->header.numberOfPackets += header.numberOfPackets;
+    reassembler->header.header.dataLength += header.header.dataLength;
+    reassembler->header.header.info = header.header.info;
+    reassembler->header.header.status = header.header.status;
+    reassembler->header.errorCount = header.errorCount;
+    reassembler->records++;
+
+    if (header.header.info & USBPCAP_INFO_CONTINUED)
+    {
+        return ISOCH_MORE;
+    }
+
+    reassembler->pending = FALSE;
+    return ISOCH_COMPLETE;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef USBPCAP_PORTABLE_ISOCH_H
+#define USBPCAP_PORTABLE_ISOCH_H
+
+#include "include/USBPcap.h"
+
+/* Isochronous transfer with more than 1024 packets is captured as
+ * consecutive records with the same irpId, every one but the last with
+ * USBPCAP_INFO_CONTINUED set. The reassembler joins them back into the
+ * transfer the URB described.
+ *
+ * Packet offsets of the reassembled transfer are relative to data. For
+ * OUT submissions data is the whole transfer buffer and the offsets are
+ * the URB offsets, for IN completions data is the compacted data of all
+ * packets.
+ */
+typedef struct _ISOCH_REASSEMBLER
+{
+    /* Header of the last record with CONTINUED cleared, numberOfPackets
+     * and dataLength of the whole transfer. packet[] is not used.
+     */
+    USBPCAP_BUFFER_ISOCH_HEADER  header;
+    PUSBPCAP_BUFFER_ISO_PACKET   packet;
+    UCHAR                       *data;       /* header.dataLength bytes */
+    UINT32                       records;    /* records of the transfer */
+    BOOLEAN                      truncated;  /* data was not all captured,
+                                                missing bytes are zero */
+
+    /* Records of transfers that were not finished before a record of
+     * other transfer came.
+     */
+    UINT64                       dropped;
+
+    BOOLEAN                      pending;
+    UINT32                       packetAlloc;
+    UINT32                       dataAlloc;
+} ISOCH_REASSEMBLER, *PISOCH_REASSEMBLER;
+
+#define ISOCH_ERROR     (-1)
+#define ISOCH_MORE      0
+#define ISOCH_COMPLETE  1
+
+void isoch_reassembler_init(PISOCH_REASSEMBLER reassembler);
+void isoch_reassembler_free(PISOCH_REASSEMBLER reassembler);
+
+/* Adds isochronous record, length bytes of USBPcap header and captured
+ * data in host byte order. Returns ISOCH_COMPLETE when the record
+ * finished the transfer, ISOCH_MORE if more records are expected and
+ * ISOCH_ERROR if the record is not valid isochronous record or memory
+ * could not be allocated. Record that does not continue the pending
+ * transfer starts new one.
+ */
+int isoch_reassembler_add(PISOCH_REASSEMBLER reassembler,
+                          const UCHAR *record, UINT32 length);
+
+#endif /* USBPCAP_PORTABLE_ISOCH_H */
@@ -0,0 +1,416 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Ntddk.h"
+#include "Usbdlib.h"
+
+/* Difference between January 1, 1601 and January 1, 1970 in 100 ns */
+#define KMSHIM_EPOCH_DIFFERENCE  116444736000000000LL
+
+static __thread KIRQL currentIrql = PASSIVE_LEVEL;
+
+/*
+ * Code at DISPATCH_LEVEL is neither preempted nor migrated to another
+ * processor, per processor data of the driver relies on it. Raising to
+ * DISPATCH_LEVEL pins the thread to the CPU it runs on and takes the
+ * dispatch lock of that CPU, so other threads on the same CPU wait until
+ * it lowers IRQL. Lowering below DISPATCH_LEVEL releases the lock and
+ * restores the affinity the thread had.
+ */
+static __thread int       pinnedCpu = -1;
+static __thread BOOLEAN   affinityChanged = FALSE;
+static __thread cpu_set_t savedAffinity;
+
+static pthread_mutex_t   *dispatchLocks;
+static int                dispatchLockCount;
+
+CCHAR KeNumberProcessors = 1;
+
+static __attribute__((constructor)) void KmShimInitialize(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_CONF);
+    int  i;
+
+    if (count > 0)
+    {
+        KeNumberProcessors = (CCHAR)min(count, 64);
+    }
+
+    dispatchLockCount = (count > 0) ? (int)count : 1;
+    dispatchLocks = (pthread_mutex_t *)malloc(dispatchLockCount *
+                                              sizeof(pthread_mutex_t));
+    if (dispatchLocks == NULL)
+    {
+        abort();
+    }
+    for (i = 0; i < dispatchLockCount; i++)
+    {
+        pthread_mutex_init(&dispatchLocks[i], NULL);
+    }
+}
+
+KIRQL KeGetCurrentIrql(VOID)
+{
+    return currentIrql;
+}
+
+static VOID KmShimPinThread(VOID)
+{
+    cpu_set_t pinned;
+    int       cpu = sched_getcpu();
+
+    if ((cpu < 0) || (cpu >= dispatchLockCount))
+    {
+        cpu = 0;
+    }
+
+    pthread_mutex_lock(&dispatchLocks[cpu]);
+
+    if ((sched_getaffinity(0, sizeof(savedAffinity), &savedAffinity) == 0) &&
+        (CPU_COUNT(&savedAffinity) > 1))
+    {
+        CPU_ZERO(&pinned);
+        CPU_SET(cpu, &pinned);
+        /* If the thread migrated meanwhile, this moves it back to cpu */
+        affinityChanged = (sched_setaffinity(0, sizeof(pinned), &pinned) == 0);
+    }
+
+    /*
+     * Thread that can not be pinned still owns the CPU number, which is
+     * what the per processor data is indexed with.
+     */
+    pinnedCpu = cpu;
+}
+
+static VOID KmShimUnpinThread(VOID)
+{
+    if (affinityChanged)
+    {
+        sched_setaffinity(0, sizeof(savedAffinity), &savedAffinity);
+        affinityChanged = FALSE;
+    }
+    pthread_mutex_unlock(&dispatchLocks[pinnedCpu]);
+    pinnedCpu = -1;
+}
+
+VOID KeRaiseIrql(KIRQL NewIrql, PKIRQL OldIrql)
+{
+    ASSERT(NewIrql >= currentIrql);
+    *OldIrql = currentIrql;
+    if ((currentIrql < DISPATCH_LEVEL) && (NewIrql >= DISPATCH_LEVEL))
+    {
+        KmShimPinThread();
+    }
+    currentIrql = NewIrql;
+}
+
+VOID KeLowerIrql(KIRQL NewIrql)
+{
+    ASSERT(NewIrql <= currentIrql);
+    if ((currentIrql >= DISPATCH_LEVEL) && (NewIrql < DISPATCH_LEVEL))
+    {
+        KmShimUnpinThread();
+    }
+    currentIrql = NewIrql;
+}
+
+VOID KeInitializeSpinLock(PKSPIN_LOCK SpinLock)
+{
+    __atomic_store_n(SpinLock, 0, __ATOMIC_RELEASE);
+}
+
+VOID KeAcquireSpinLockAtDpcLevel(PKSPIN_LOCK SpinLock)
+{
+    while (__atomic_exchange_n(SpinLock, 1, __ATOMIC_ACQUIRE) != 0)
+    {
+        while (__atomic_load_n(SpinLock, __ATOMIC_RELAXED) != 0)
+        {
+#if defined(__i386__) || defined(__x86_64__)
+            __builtin_ia32_pause();
+#else
+            sched_yield();
+#endif
+        }
+    }
+}
+
+VOID KeReleaseSpinLockFromDpcLevel(PKSPIN_LOCK SpinLock)
+{
+    __atomic_store_n(SpinLock, 0, __ATOMIC_RELEASE);
+}
+
+VOID KeAcquireSpinLock(PKSPIN_LOCK SpinLock, PKIRQL OldIrql)
+{
+    KeRaiseIrql(DISPATCH_LEVEL, OldIrql);
+    KeAcquireSpinLockAtDpcLevel(SpinLock);
+}
+
+VOID KeReleaseSpinLock(PKSPIN_LOCK SpinLock, KIRQL NewIrql)
+{
+    KeReleaseSpinLockFromDpcLevel(SpinLock);
+    KeLowerIrql(NewIrql);
+}
+
+ULONG KeGetCurrentProcessorNumber(VOID)
+{
+    int cpu = (pinnedCpu >= 0) ? pinnedCpu : sched_getcpu();
+
+    return (cpu < 0) ? 0 : (ULONG)cpu;
+}
+
+ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER ProcNumber)
+{
+    ULONG number = KeGetCurrentProcessorNumber();
+
+    if (ProcNumber != NULL)
+    {
+        ProcNumber->Group = (USHORT)(number / 64);
+        ProcNumber->Number = (UCHAR)(number % 64);
+        ProcNumber->Reserved = 0;
+    }
+
+    return number;
+}
+
+ULONG KeQueryMaximumProcessorCountEx(USHORT GroupNumber)
+{
+    long count = sysconf(_SC_NPROCESSORS_CONF);
+
+    UNREFERENCED_PARAMETER(GroupNumber);
+    return (count > 0) ? (ULONG)count : 1;
+}
+
+static LONGLONG KmShimQueryClock(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (LONGLONG)ts.tv_sec * 10000000LL + ts.tv_nsec / 100;
+}
+
+VOID KeQuerySystemTime(PLARGE_INTEGER CurrentTime)
+{
+    CurrentTime->QuadPart = KmShimQueryClock(CLOCK_REALTIME_COARSE) +
+                            KMSHIM_EPOCH_DIFFERENCE;
+}
+
+VOID KeQuerySystemTimePrecise(PLARGE_INTEGER CurrentTime)
+{
+    CurrentTime->QuadPart = KmShimQueryClock(CLOCK_REALTIME) +
+                            KMSHIM_EPOCH_DIFFERENCE;
+}
+
+ULONGLONG KeQueryInterruptTime(VOID)
+{
+    return (ULONGLONG)KmShimQueryClock(CLOCK_MONOTONIC);
+}
+
+PVOID ExAllocatePoolWithTag(POOL_TYPE PoolType, SIZE_T NumberOfBytes,
+                            ULONG Tag)
+{
+    UNREFERENCED_PARAMETER(PoolType);
+    UNREFERENCED_PARAMETER(Tag);
+    return malloc(NumberOfBytes);
+}
+
+VOID ExFreePool(PVOID P)
+{
+    free(P);
+}
+
+VOID ExFreePoolWithTag(PVOID P, ULONG Tag)
+{
+    UNREFERENCED_PARAMETER(Tag);
+    free(P);
+}
+
+PIRP IoAllocateIrp(CCHAR StackSize, BOOLEAN ChargeQuota)
+{
+    PIRP irp;
+
+    UNREFERENCED_PARAMETER(ChargeQuota);
+
+    if (StackSize > 1)
+    {
+        /* Only the last driver in the stack is emulated */
+        return NULL;
+    }
+
+    irp = (PIRP)calloc(1, sizeof(IRP));
+    if (irp != NULL)
+    {
+        irp->IoStatus.Status = STATUS_PENDING;
+        irp->Tail.Overlay.CurrentStackLocation = &irp->Stack;
+    }
+
+    return irp;
+}
+
+VOID IoFreeIrp(PIRP Irp)
+{
+    free(Irp);
+}
+
+VOID IoCompleteRequest(PIRP Irp, CCHAR PriorityBoost)
+{
+    PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(Irp);
+
+    UNREFERENCED_PARAMETER(PriorityBoost);
+
+    if (stack->CompletionRoutine != NULL)
+    {
+        stack->CompletionRoutine(stack->DeviceObject, Irp, stack->Context);
+    }
+}
+
+PMDL IoAllocateMdl(PVOID VirtualAddress, ULONG Length,
+                   BOOLEAN SecondaryBuffer, BOOLEAN ChargeQuota, PIRP Irp)
+{
+    PMDL mdl;
+
+    UNREFERENCED_PARAMETER(SecondaryBuffer);
+    UNREFERENCED_PARAMETER(ChargeQuota);
+
+    mdl = (PMDL)calloc(1, sizeof(MDL));
+    if (mdl == NULL)
+    {
+        return NULL;
+    }
+
+    mdl->MappedSystemVa = VirtualAddress;
+    mdl->ByteCount = Length;
+
+    if (Irp != NULL)
+    {
+        Irp->MdlAddress = mdl;
+    }
+
+    return mdl;
+}
+
+VOID IoFreeMdl(PMDL Mdl)
+{
+    free(Mdl);
+}
+
+NTSTATUS IoCsqInitialize(PIO_CSQ Csq,
+                         IO_CSQ_INSERT_IRP *CsqInsertIrp,
+                         IO_CSQ_REMOVE_IRP *CsqRemoveIrp,
+                         IO_CSQ_PEEK_NEXT_IRP *CsqPeekNextIrp,
+                         IO_CSQ_ACQUIRE_LOCK *CsqAcquireLock,
+                         IO_CSQ_RELEASE_LOCK *CsqReleaseLock,
+                         IO_CSQ_COMPLETE_CANCELED_IRP *CsqCompleteCanceledIrp)
+{
+    Csq->CsqInsertIrp = CsqInsertIrp;
+    Csq->CsqRemoveIrp = CsqRemoveIrp;
+    Csq->CsqPeekNextIrp = CsqPeekNextIrp;
+    Csq->CsqAcquireLock = CsqAcquireLock;
+    Csq->CsqReleaseLock = CsqReleaseLock;
+    Csq->CsqCompleteCanceledIrp = CsqCompleteCanceledIrp;
+
+    return STATUS_SUCCESS;
+}
+
+VOID IoCsqInsertIrp(PIO_CSQ Csq, PIRP Irp, PIO_CSQ_IRP_CONTEXT Context)
+{
+    KIRQL irql;
+
+    if (Context != NULL)
+    {
+        Context->Irp = Irp;
+        Context->Csq = Csq;
+    }
+
+    Csq->CsqAcquireLock(Csq, &irql);
+    IoMarkIrpPending(Irp);
+    Csq->CsqInsertIrp(Csq, Irp);
+    Csq->CsqReleaseLock(Csq, irql);
+}
+
+PIRP IoCsqRemoveNextIrp(PIO_CSQ Csq, PVOID PeekContext)
+{
+    KIRQL irql;
+    PIRP  irp;
+
+    Csq->CsqAcquireLock(Csq, &irql);
+    irp = Csq->CsqPeekNextIrp(Csq, NULL, PeekContext);
+    if (irp != NULL)
+    {
+        Csq->CsqRemoveIrp(Csq, irp);
+    }
+    Csq->CsqReleaseLock(Csq, irql);
+
+    return irp;
+}
+
+ULONG DbgPrint(const char *Format, ...)
+{
+    va_list args;
+
+    va_start(args, Format);
+    vfprintf(stderr, Format, args);
+    va_end(args);
+
+    return STATUS_SUCCESS;
+}
+
+PUSB_INTERFACE_DESCRIPTOR
+USBD_ParseConfigurationDescriptorEx(PUSB_CONFIGURATION_DESCRIPTOR ConfigurationDescriptor,
+                                    PVOID StartPosition,
+                                    LONG InterfaceNumber,
+                                    LONG AlternateSetting,
+                                    LONG InterfaceClass,
+                                    LONG InterfaceSubClass,
+                                    LONG InterfaceProtocol)
+{
+    PUCHAR start = (PUCHAR)StartPosition;
+    PUCHAR end = (PUCHAR)ConfigurationDescriptor +
+                 ConfigurationDescriptor->wTotalLength;
+
+    while (start + sizeof(USB_COMMON_DESCRIPTOR) <= end)
+    {
+        PUSB_COMMON_DESCRIPTOR common = (PUSB_COMMON_DESCRIPTOR)start;
+
+        if ((common->bLength < sizeof(USB_COMMON_DESCRIPTOR)) ||
+            (start + common->bLength > end))
+        {
+            break;
+        }
+
+        if ((common->bDescriptorType == USB_INTERFACE_DESCRIPTOR_TYPE) &&
+            (common->bLength >= sizeof(USB_INTERFACE_DESCRIPTOR)))
+        {
+            PUSB_INTERFACE_DESCRIPTOR desc = (PUSB_INTERFACE_DESCRIPTOR)start;
+
+            if (((InterfaceNumber == -1) ||
+                 (desc->bInterfaceNumber == InterfaceNumber)) &&
+                ((AlternateSetting == -1) ||
+                 (desc->bAlternateSetting == AlternateSetting)) &&
+                ((InterfaceClass == -1) ||
+                 (desc->bInterfaceClass == InterfaceClass)) &&
+                ((InterfaceSubClass == -1) ||
+                 (desc->bInterfaceSubClass == InterfaceSubClass)) &&
+                ((InterfaceProtocol == -1) ||
+                 (desc->bInterfaceProtocol == InterfaceProtocol)))
+            {
+                return desc;
+            }
+        }
+
+        start += common->bLength;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,951 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * usbpcap-latency - pairs submit and complete records of DLT_USBPCAP
+ * capture by irpId and reports per endpoint latency percentiles,
+ * throughput, error rate and IRPs that never completed.
+ *
+ * Capture is split in chunks processed in parallel. Every chunk pairs
+ * records in its own bounded table of pending submits. Completions
+ * whose submit is not in the chunk are kept and paired afterwards with
+ * submits still pending at the end of the chunks before, so the result
+ * does not depend on the number of threads. Memory use depends on the
+ * table size and number of endpoints only, not on the capture size.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pcapfile.h"
+
+#define MAX_THREADS          64
+#define MAX_ENDPOINTS        1024
+#define ENDPOINT_SLOTS       (2 * MAX_ENDPOINTS)
+#define DEFAULT_TABLE_BITS   18
+#define DEFAULT_LIST         10
+
+/* Log-linear latency histogram with 32 buckets per power of two,
+ * bucket width is at most 1/32 of its value.
+ */
+#define LATENCY_SUB_BITS     5
+#define LATENCY_SUB          (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS      ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB)
+
+/* Endpoint key used for records that do not fit in endpoint table */
+#define ENDPOINT_OTHER       (~0ULL)
+
+#define NSEC_PER_SEC         1000000000ULL
+
+typedef struct _ENDPOINT_STATS
+{
+    UINT64   key;
+    UINT64   records;
+    UINT64   submits;
+    UINT64   completions;
+    UINT64   errors;          /* completions with USBD error status */
+    UINT64   paired;
+    UINT64   unmatched;       /* completions without submit */
+    UINT64   neverCompleted;  /* submits without completion */
+    UINT64   overflow;        /* submits not tracked, pending table full */
+    UINT64   bytes;
+    UINT64   firstTimestamp;
+    UINT64   lastTimestamp;
+    UINT64   latencySum;
+    UINT64   latencyMax;
+    UINT64  *histogram;
+} ENDPOINT_STATS;
+
+typedef struct _ENDPOINT_TABLE
+{
+    ENDPOINT_STATS  entries[MAX_ENDPOINTS];
+    UINT32          count;
+    INT16           slots[ENDPOINT_SLOTS];  /* entry index + 1, 0 if empty */
+} ENDPOINT_TABLE;
+
+/* Submit waiting for completion. Also used for completions waiting for
+ * submit from previous chunk, offset is then offset of the completion.
+ */
+typedef struct _PENDING
+{
+    UINT64  irpId;
+    UINT64  timestamp;
+    UINT64  offset;   /* 0 if slot is empty */
+    UINT64  key;
+} PENDING;
+
+typedef struct _PENDING_TABLE
+{
+    PENDING  *slots;
+    UINT64    mask;
+    UINT64    count;
+    UINT64    limit;
+} PENDING_TABLE;
+
+/* Never completed submits with the lowest offsets, sorted by offset */
+typedef struct _NEVER_LIST
+{
+    PENDING  *entries;
+    UINT32    count;
+    UINT32    capacity;
+} NEVER_LIST;
+
+typedef struct _CHUNK
+{
+    pthread_t          thread;
+    const PCAP_FILE   *file;
+    int                index;
+    UINT64             nominalStart;
+    UINT64             nominalEnd;  /* records starting before belong here */
+    UINT64             start;
+    UINT64             end;
+    UINT64             records;
+    BOOLEAN            corrupted;
+
+    PENDING_TABLE      pending;
+    PENDING           *orphans;     /* completions without submit */
+    UINT64             numberOfOrphans;
+    ENDPOINT_TABLE    *endpoints;
+    NEVER_LIST         never;
+} CHUNK;
+
+typedef struct _OPTIONS
+{
+    int      threads;
+    UINT32   tableBits;
+    UINT32   list;
+    BOOLEAN  csv;
+} OPTIONS;
+
+static unsigned latency_bucket(UINT64 latency)
+{
+    unsigned exponent;
+
+    if (latency < LATENCY_SUB)
+    {
+        return (unsigned)latency;
+    }
+
+    exponent = 63 - __builtin_clzll(latency);
+    return (exponent - LATENCY_SUB_BITS + 1) * LATENCY_SUB +
+           (unsigned)((latency >> (exponent - LATENCY_SUB_BITS)) &
+                      (LATENCY_SUB - 1));
+}
+
+/* Returns value in the middle of the bucket */
+static UINT64 latency_bucket_value(unsigned bucket)
+{
+    unsigned exponent;
+    UINT64   low;
+
+    if (bucket < LATENCY_SUB)
+    {
+        return bucket;
+    }
+
+    exponent = bucket / LATENCY_SUB + LATENCY_SUB_BITS - 1;
+    low = (UINT64)(LATENCY_SUB + bucket % LATENCY_SUB) <<
+          (exponent - LATENCY_SUB_BITS);
+    return low + ((1ULL << (exponent - LATENCY_SUB_BITS)) >> 1);
+}
+
+static UINT64 endpoint_key(const USBPCAP_BUFFER_PACKET_HEADER *header)
+{
+    return ((UINT64)header->bus << 32) | ((UINT64)header->device << 16) |
+           ((UINT64)header->endpoint << 8) | header->transfer;
+}
+
+static ENDPOINT_STATS *endpoint_get(ENDPOINT_TABLE *table, UINT64 key)
+{
+    UINT32          slot = (UINT32)((key * 0x9E3779B97F4A7C15ULL) >> 53) &
+                           (ENDPOINT_SLOTS - 1);
+    ENDPOINT_STATS *stats;
+
+    while (table->slots[slot] != 0)
+    {
+        stats = &table->entries[table->slots[slot] - 1];
+        if (stats->key == key)
+        {
+            return stats;
+        }
+        slot = (slot + 1) & (ENDPOINT_SLOTS - 1);
+    }
+
+    if ((table->count >= MAX_ENDPOINTS - 1) && (key != ENDPOINT_OTHER))
+    {
+        /* Last entry is reserved for all remaining endpoints */
+        return endpoint_get(table, ENDPOINT_OTHER);
+    }
+
+    stats = &table->entries[table->count];
+    memset(stats, 0, sizeof(ENDPOINT_STATS));
+    stats->key = key;
+    stats->firstTimestamp = ~0ULL;
+    stats->histogram = (UINT64 *)calloc(LATENCY_BUCKETS, sizeof(UINT64));
+    if (stats->histogram == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    table->slots[slot] = (INT16)(++table->count);
+
+    return stats;
+}
+
+static void endpoint_free(ENDPOINT_TABLE *table)
+{
+    UINT32 i;
+
+    for (i = 0; i < table->count; i++)
+    {
+        free(table->entries[i].histogram);
+    }
+    free(table);
+}
+
+static void latency_add(ENDPOINT_STATS *stats, UINT64 submit, UINT64 complete)
+{
+    UINT64 latency = (complete > submit) ? complete - submit : 0;
+
+    stats->paired++;
+    stats->latencySum += latency;
+    stats->latencyMax = max(stats->latencyMax, latency);
+    stats->histogram[latency_bucket(latency)]++;
+}
+
+static BOOLEAN pending_init(PENDING_TABLE *table, UINT32 bits)
+{
+    table->slots = (PENDING *)calloc((size_t)1 << bits, sizeof(PENDING));
+    table->mask = (1ULL << bits) - 1;
+    table->count = 0;
+    /* Keep the probe sequences short */
+    table->limit = (table->mask + 1) / 8 * 7;
+    return (table->slots != NULL) ? TRUE : FALSE;
+}
+
+static UINT64 pending_slot(const PENDING_TABLE *table, UINT64 irpId)
+{
+    return ((irpId * 0x9E3779B97F4A7C15ULL) >> 20) & table->mask;
+}
+
+static PENDING *pending_find(PENDING_TABLE *table, UINT64 irpId)
+{
+    UINT64 slot = pending_slot(table, irpId);
+
+    while (table->slots[slot].offset != 0)
+    {
+        if (table->slots[slot].irpId == irpId)
+        {
+            return &table->slots[slot];
+        }
+        slot = (slot + 1) & table->mask;
+    }
+    return NULL;
+}
+
+/* Inserts entry not present in the table. Returns FALSE if full. */
+static BOOLEAN pending_insert(PENDING_TABLE *table, const PENDING *entry)
+{
+    UINT64 slot;
+
+    if (table->count >= table->limit)
+    {
+        return FALSE;
+    }
+
+    slot = pending_slot(table, entry->irpId);
+    while (table->slots[slot].offset != 0)
+    {
+        slot = (slot + 1) & table->mask;
+    }
+    table->slots[slot] = *entry;
+    table->count++;
+    return TRUE;
+}
+
+static void pending_remove(PENDING_TABLE *table, PENDING *entry)
+{
+    UINT64 hole = (UINT64)(entry - table->slots);
+    UINT64 slot = hole;
+
+    /* Move back entries of the probe sequence so no lookup ends early */
+    for (;;)
+    {
+        UINT64 home;
+
+        slot = (slot + 1) & table->mask;
+        if (table->slots[slot].offset == 0)
+        {
+            break;
+        }
+
+        home = pending_slot(table, table->slots[slot].irpId);
+        if (((slot - home) & table->mask) >= ((slot - hole) & table->mask))
+        {
+            table->slots[hole] = table->slots[slot];
+            hole = slot;
+        }
+    }
+    table->slots[hole].offset = 0;
+    table->count--;
+}
+
+static void never_add(NEVER_LIST *list, const PENDING *entry)
+{
+    UINT32 i;
+
+    if (list->count == list->capacity)
+    {
+        if ((list->count == 0) ||
+            (list->entries[list->count - 1].offset < entry->offset))
+        {
+            return;
+        }
+        list->count--;
+    }
+
+    for (i = list->count; (i > 0) && (list->entries[i - 1].offset > entry->offset); i--)
+    {
+        list->entries[i] = list->entries[i - 1];
+    }
+    list->entries[i] = *entry;
+    list->count++;
+}
+
+static void never_completed(ENDPOINT_TABLE *endpoints, NEVER_LIST *list,
+                            const PENDING *entry)
+{
+    endpoint_get(endpoints, entry->key)->neverCompleted++;
+    never_add(list, entry);
+}
+
+static void chunk_record(CHUNK *chunk, const PCAP_RECORD *record)
+{
+    USBPCAP_BUFFER_PACKET_HEADER  header;
+    ENDPOINT_STATS               *stats;
+    PENDING                      *pending;
+    PENDING                       entry;
+
+    if (!pcap_get_usbpcap_header(record, &header) ||
+        (header.transfer == USBPCAP_TRANSFER_FILTER_MARKER))
+    {
+        return;
+    }
+
+    entry.irpId = header.irpId;
+    entry.timestamp = record->timestamp;
+    entry.offset = record->offset;
+    entry.key = endpoint_key(&header);
+
+    stats = endpoint_get(chunk->endpoints, entry.key);
+    stats->records++;
+    stats->bytes += header.dataLength;
+    stats->firstTimestamp = min(stats->firstTimestamp, record->timestamp);
+    stats->lastTimestamp = max(stats->lastTimestamp, record->timestamp);
+
+    /* Only the last record of split isochronous transfer and SETUP and
+     * COMPLETE (or STATUS in old captures) control stages take part in
+     * pairing.
+     */
+    if ((header.info & USBPCAP_INFO_CONTINUED) ||
+        ((header.transfer == USBPCAP_TRANSFER_CONTROL) &&
+         (header.headerLen >= sizeof(USBPCAP_BUFFER_CONTROL_HEADER)) &&
+         (record->data[sizeof(USBPCAP_BUFFER_PACKET_HEADER)] ==
+          USBPCAP_CONTROL_STAGE_DATA)))
+    {
+        return;
+    }
+
+    pending = pending_find(&chunk->pending, header.irpId);
+    if (!(header.info & USBPCAP_INFO_PDO_TO_FDO))
+    {
+        stats->submits++;
+        if (pending != NULL)
+        {
+            /* IRP submitted again, previous completion was not seen */
+            never_completed(chunk->endpoints, &chunk->never, pending);
+            *pending = entry;
+        }
+        else if (!pending_insert(&chunk->pending, &entry))
+        {
+            stats->overflow++;
+        }
+        return;
+    }
+
+    stats->completions++;
+    if (USBD_ERROR(header.status))
+    {
+        stats->errors++;
+    }
+
+    if (pending != NULL)
+    {
+        latency_add(endpoint_get(chunk->endpoints, pending->key),
+                    pending->timestamp, record->timestamp);
+        pending_remove(&chunk->pending, pending);
+    }
+    else if ((chunk->index > 0) &&
+             (chunk->numberOfOrphans < chunk->pending.limit))
+    {
+        chunk->orphans[chunk->numberOfOrphans++] = entry;
+    }
+    else
+    {
+        stats->unmatched++;
+    }
+}
+
+static BOOLEAN chunk_reset(CHUNK *chunk, const OPTIONS *options)
+{
+    if (chunk->endpoints != NULL)
+    {
+        endpoint_free(chunk->endpoints);
+    }
+    free(chunk->pending.slots);
+    free(chunk->orphans);
+    free(chunk->never.entries);
+
+    chunk->records = 0;
+    chunk->corrupted = FALSE;
+    chunk->numberOfOrphans = 0;
+    chunk->endpoints = (ENDPOINT_TABLE *)calloc(1, sizeof(ENDPOINT_TABLE));
+    chunk->never.count = 0;
+    chunk->never.capacity = options->list;
+    chunk->never.entries = (PENDING *)calloc(options->list + 1, sizeof(PENDING));
+    chunk->orphans = NULL;
+    if (!pending_init(&chunk->pending, options->tableBits) ||
+        (chunk->endpoints == NULL) || (chunk->never.entries == NULL))
+    {
+        return FALSE;
+    }
+    if (chunk->index > 0)
+    {
+        chunk->orphans = (PENDING *)malloc((size_t)chunk->pending.limit *
+                                           sizeof(PENDING));
+        if (chunk->orphans == NULL)
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* Processes records from chunk->start that start before nominalEnd */
+static void chunk_process(CHUNK *chunk)
+{
+    PCAP_RECORD record;
+    UINT64      offset = chunk->start;
+    int         result = 1;
+
+    while ((offset < chunk->nominalEnd) &&
+           ((result = pcap_read_record(chunk->file, offset, &record)) == 1))
+    {
+        chunk_record(chunk, &record);
+        chunk->records++;
+        offset += sizeof(pcaprec_hdr_t) + record.inclLen;
+    }
+    chunk->end = offset;
+    if (result < 0)
+    {
+        chunk->corrupted = TRUE;
+    }
+}
+
+static void *chunk_thread(void *arg)
+{
+    CHUNK *chunk = (CHUNK *)arg;
+
+    if (chunk->index == 0)
+    {
+        chunk->start = PCAP_FIRST_RECORD;
+    }
+    else
+    {
+        chunk->start = pcap_find_record(chunk->file, chunk->nominalStart);
+    }
+    chunk_process(chunk);
+
+    return NULL;
+}
+
+static void endpoint_merge(ENDPOINT_TABLE *table, const ENDPOINT_STATS *from)
+{
+    ENDPOINT_STATS *to = endpoint_get(table, from->key);
+    unsigned        i;
+
+    to->records += from->records;
+    to->submits += from->submits;
+    to->completions += from->completions;
+    to->errors += from->errors;
+    to->paired += from->paired;
+    to->unmatched += from->unmatched;
+    to->neverCompleted += from->neverCompleted;
+    to->overflow += from->overflow;
+    to->bytes += from->bytes;
+    to->firstTimestamp = min(to->firstTimestamp, from->firstTimestamp);
+    to->lastTimestamp = max(to->lastTimestamp, from->lastTimestamp);
+    to->latencySum += from->latencySum;
+    to->latencyMax = max(to->latencyMax, from->latencyMax);
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        to->histogram[i] += from->histogram[i];
+    }
+}
+
+static UINT64 latency_percentile(const ENDPOINT_STATS *stats, double percent)
+{
+    UINT64   rank = (UINT64)(stats->paired * percent / 100.0 + 0.5);
+    UINT64   seen = 0;
+    unsigned i;
+
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += stats->histogram[i];
+        if (seen >= rank)
+        {
+            return min(latency_bucket_value(i), stats->latencyMax);
+        }
+    }
+    return stats->latencyMax;
+}
+
+static const char *transfer_name(UCHAR transfer)
+{
+    switch (transfer)
+    {
+        case USBPCAP_TRANSFER_ISOCHRONOUS:
+            return "isochronous";
+        case USBPCAP_TRANSFER_INTERRUPT:
+            return "interrupt";
+        case USBPCAP_TRANSFER_CONTROL:
+            return "control";
+        case USBPCAP_TRANSFER_BULK:
+            return "bulk";
+        case USBPCAP_TRANSFER_IRP_INFO:
+            return "irp-info";
+        default:
+            return "unknown";
+    }
+}
+
+static int compare_endpoint(const void *a, const void *b)
+{
+    UINT64 x = ((const ENDPOINT_STATS *)a)->key;
+    UINT64 y = ((const ENDPOINT_STATS *)b)->key;
+
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+static void print_report(ENDPOINT_TABLE *endpoints, const NEVER_LIST *never,
+                         const OPTIONS *options, UINT64 first)
+{
+    static const double percentiles[] = {50.0, 90.0, 99.0, 99.9};
+    ENDPOINT_STATS      total;
+    UINT32              i;
+    unsigned            p;
+
+    /* Sorting moves entries, the slot index is not used afterwards */
+    qsort(endpoints->entries, endpoints->count, sizeof(ENDPOINT_STATS),
+          compare_endpoint);
+
+    if (options->csv)
+    {
+        printf("bus,device,endpoint,transfer,submits,completions,errors,"
+               "never_completed,unmatched,overflow,paired,mean_us,p50_us,"
+               "p90_us,p99_us,p999_us,max_us,bytes,bytes_per_s\n");
+    }
+    else
+    {
+        printf("%-3s %-3s %-4s %-11s %9s %9s %7s %6s %6s %9s %9s %9s %9s %9s %11s\n",
+               "bus", "dev", "ep", "transfer", "submits", "completes",
+               "err%", "never", "unmtch", "p50 us", "p90 us", "p99 us",
+               "p99.9 us", "max us", "KiB/s");
+    }
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < endpoints->count; i++)
+    {
+        const ENDPOINT_STATS *stats = &endpoints->entries[i];
+        UINT64                duration = stats->lastTimestamp - stats->firstTimestamp;
+        double                rate = (duration > 0) ?
+                                     stats->bytes * (double)NSEC_PER_SEC / duration : 0.0;
+        double                errorRate = (stats->completions > 0) ?
+                                          100.0 * stats->errors / stats->completions : 0.0;
+
+        total.submits += stats->submits;
+        total.completions += stats->completions;
+        total.errors += stats->errors;
+        total.paired += stats->paired;
+        total.unmatched += stats->unmatched;
+        total.neverCompleted += stats->neverCompleted;
+        total.overflow += stats->overflow;
+
+        if (options->csv)
+        {
+            if (stats->key == ENDPOINT_OTHER)
+            {
+                printf(",,,other");
+            }
+            else
+            {
+                printf("%u,%u,0x%02X,%s", (unsigned)(stats->key >> 32),
+                       (unsigned)((stats->key >> 16) & 0xFFFF),
+                       (unsigned)((stats->key >> 8) & 0xFF),
+                       transfer_name((UCHAR)stats->key));
+            }
+            printf(",%llu,%llu,%llu,%llu,%llu,%llu,%llu,%.3f",
+                   (unsigned long long)stats->submits,
+                   (unsigned long long)stats->completions,
+                   (unsigned long long)stats->errors,
+                   (unsigned long long)stats->neverCompleted,
+                   (unsigned long long)stats->unmatched,
+                   (unsigned long long)stats->overflow,
+                   (unsigned long long)stats->paired,
+                   (stats->paired > 0) ?
+                   stats->latencySum / 1000.0 / stats->paired : 0.0);
+            for (p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); p++)
+            {
+                printf(",%.3f", (stats->paired > 0) ?
+                       latency_percentile(stats, percentiles[p]) / 1000.0 : 0.0);
+            }
+            printf(",%.3f,%llu,%.0f\n", stats->latencyMax / 1000.0,
+                   (unsigned long long)stats->bytes, rate);
+            continue;
+        }
+
+        if (stats->key == ENDPOINT_OTHER)
+        {
+            printf("%-24s", "other");
+        }
+        else
+        {
+            printf("%-3u %-3u 0x%02X %-11s", (unsigned)(stats->key >> 32),
+                   (unsigned)((stats->key >> 16) & 0xFFFF),
+                   (unsigned)((stats->key >> 8) & 0xFF),
+                   transfer_name((UCHAR)stats->key));
+        }
+        printf(" %9llu %9llu %7.3f %6llu %6llu",
+               (unsigned long long)stats->submits,
+               (unsigned long long)stats->completions, errorRate,
+               (unsigned long long)stats->neverCompleted,
+               (unsigned long long)stats->unmatched);
+        if (stats->paired > 0)
+        {
+            for (p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); p++)
+            {
+                printf(" %9.1f", latency_percentile(stats, percentiles[p]) / 1000.0);
+            }
+            printf(" %9.1f", stats->latencyMax / 1000.0);
+        }
+        else
+        {
+            printf(" %9s %9s %9s %9s %9s", "-", "-", "-", "-", "-");
+        }
+        printf(" %11.1f\n", rate / 1024.0);
+    }
+
+    if (options->csv)
+    {
+        return;
+    }
+
+    printf("\n%llu transfers paired, %llu submits never completed, "
+           "%llu completions without submit\n",
+           (unsigned long long)total.paired,
+           (unsigned long long)total.neverCompleted,
+           (unsigned long long)total.unmatched);
+    if (total.overflow > 0)
+    {
+        printf("%llu submits not tracked, increase --table\n",
+               (unsigned long long)total.overflow);
+    }
+
+    if (never->count > 0)
+    {
+        printf("\nNever completed (first %u by offset):\n", never->count);
+        printf("%12s %16s %-3s %-3s %-4s %-11s %18s\n", "offset", "time s",
+               "bus", "dev", "ep", "transfer", "irpId");
+        for (i = 0; i < never->count; i++)
+        {
+            const PENDING *entry = &never->entries[i];
+            UINT64         time = entry->timestamp - first;
+
+            printf("%12llu %6llu.%09llu %-3u %-3u 0x%02X %-11s 0x%016llX\n",
+                   (unsigned long long)entry->offset,
+                   (unsigned long long)(time / NSEC_PER_SEC),
+                   (unsigned long long)(time % NSEC_PER_SEC),
+                   (unsigned)(entry->key >> 32),
+                   (unsigned)((entry->key >> 16) & 0xFFFF),
+                   (unsigned)((entry->key >> 8) & 0xFF),
+                   transfer_name((UCHAR)entry->key),
+                   (unsigned long long)entry->irpId);
+        }
+    }
+}
+
+static int analyze(const char *captureName, const OPTIONS *options)
+{
+    PCAP_FILE        file;
+    PCAP_RECORD      record;
+    CHUNK           *chunks;
+    ENDPOINT_TABLE  *endpoints;
+    PENDING_TABLE   *carry;
+    NEVER_LIST       never;
+    char             error[256];
+    UINT64           dataSize;
+    UINT64           records = 0;
+    UINT64           first = 0;
+    UINT64           i;
+    int              numberOfChunks;
+    int              corrupted = -1;
+    int              k;
+
+    if (pcap_open(&file, captureName, error, sizeof(error)) != 0)
+    {
+        fprintf(stderr, "%s\n", error);
+        return -1;
+    }
+    if (file.network != DLT_USBPCAP)
+    {
+        fprintf(stderr, "%s: link type %u is not DLT_USBPCAP\n",
+                captureName, file.network);
+        pcap_close(&file);
+        return -1;
+    }
+    if (pcap_read_record(&file, PCAP_FIRST_RECORD, &record) == 1)
+    {
+        first = record.timestamp;
+    }
+
+    /* Chunks smaller than 1 MiB are not worth a thread */
+    dataSize = file.size - PCAP_FIRST_RECORD;
+    numberOfChunks = (int)min((UINT64)options->threads,
+                              dataSize / (1024 * 1024) + 1);
+
+    chunks = (CHUNK *)calloc(numberOfChunks, sizeof(CHUNK));
+    endpoints = (ENDPOINT_TABLE *)calloc(1, sizeof(ENDPOINT_TABLE));
+    never.entries = (PENDING *)calloc(options->list + 1, sizeof(PENDING));
+    never.count = 0;
+    never.capacity = options->list;
+    if ((chunks == NULL) || (endpoints == NULL) || (never.entries == NULL))
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    for (k = 0; k < numberOfChunks; k++)
+    {
+        chunks[k].file = &file;
+        chunks[k].index = k;
+        chunks[k].nominalStart = PCAP_FIRST_RECORD + dataSize * k / numberOfChunks;
+        chunks[k].nominalEnd = PCAP_FIRST_RECORD + dataSize * (k + 1) / numberOfChunks;
+        if (!chunk_reset(&chunks[k], options))
+        {
+            fprintf(stderr, "Out of memory, decrease --table or --threads\n");
+            exit(1);
+        }
+        pthread_create(&chunks[k].thread, NULL, chunk_thread, &chunks[k]);
+    }
+    for (k = 0; k < numberOfChunks; k++)
+    {
+        pthread_join(chunks[k].thread, NULL);
+    }
+
+    /* Submits still pending at the end of chunk 0 to k - 1 */
+    carry = &chunks[0].pending;
+
+    for (k = 0; k < numberOfChunks; k++)
+    {
+        CHUNK *chunk = &chunks[k];
+
+        if (corrupted >= 0)
+        {
+            break;
+        }
+        if ((k > 0) && (chunk->start != chunks[k - 1].end))
+        {
+            /* Resync found wrong boundary, process again from where the
+             * previous chunk ended.
+             */
+            chunk->start = chunks[k - 1].end;
+            chunk_reset(chunk, options);
+            chunk_process(chunk);
+        }
+        if (chunk->corrupted)
+        {
+            corrupted = k;
+        }
+
+        records += chunk->records;
+        for (i = 0; i < chunk->endpoints->count; i++)
+        {
+            endpoint_merge(endpoints, &chunk->endpoints->entries[i]);
+        }
+        for (i = 0; i < chunk->never.count; i++)
+        {
+            never_add(&never, &chunk->never.entries[i]);
+        }
+        if (k == 0)
+        {
+            continue;
+        }
+
+        for (i = 0; i < chunk->numberOfOrphans; i++)
+        {
+            const PENDING *orphan = &chunk->orphans[i];
+            PENDING       *pending = pending_find(carry, orphan->irpId);
+
+            if (pending != NULL)
+            {
+                latency_add(endpoint_get(endpoints, pending->key),
+                            pending->timestamp, orphan->timestamp);
+                pending_remove(carry, pending);
+            }
+            else
+            {
+                endpoint_get(endpoints, orphan->key)->unmatched++;
+            }
+        }
+
+        for (i = 0; i <= chunk->pending.mask; i++)
+        {
+            const PENDING *entry = &chunk->pending.slots[i];
+            PENDING       *pending;
+
+            if (entry->offset == 0)
+            {
+                continue;
+            }
+            pending = pending_find(carry, entry->irpId);
+            if (pending != NULL)
+            {
+                never_completed(endpoints, &never, pending);
+                *pending = *entry;
+            }
+            else if (!pending_insert(carry, entry))
+            {
+                endpoint_get(endpoints, entry->key)->overflow++;
+            }
+        }
+    }
+
+    for (i = 0; i <= carry->mask; i++)
+    {
+        if (carry->slots[i].offset != 0)
+        {
+            never_completed(endpoints, &never, &carry->slots[i]);
+        }
+    }
+
+    if (corrupted >= 0)
+    {
+        fprintf(stderr, "%s: invalid record at offset %llu, "
+                "records after it are not analyzed\n", captureName,
+                (unsigned long long)chunks[corrupted].end);
+    }
+
+    if (!options->csv)
+    {
+        printf("%s: %llu records, %d threads\n\n", captureName,
+               (unsigned long long)records, numberOfChunks);
+    }
+    print_report(endpoints, &never, options, first);
+
+    for (k = 0; k < numberOfChunks; k++)
+    {
+        endpoint_free(chunks[k].endpoints);
+        free(chunks[k].pending.slots);
+        free(chunks[k].orphans);
+        free(chunks[k].never.entries);
+    }
+    free(chunks);
+    endpoint_free(endpoints);
+    free(never.entries);
+    pcap_close(&file);
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <capture.pcap>\n"
+            "  -j, --threads <n>   worker threads, default: all cores\n"
+            "  -t, --table <n>     pending IRPs tracked per thread, rounded\n"
+            "                      up to power of two (default %u)\n"
+            "  -l, --list <n>      never completed IRPs to list (default %u)\n"
+            "  -c, --csv           print per endpoint CSV only\n",
+            name, 1U << DEFAULT_TABLE_BITS, DEFAULT_LIST);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option longOptions[] =
+    {
+        {"threads", required_argument, NULL, 'j'},
+        {"table",   required_argument, NULL, 't'},
+        {"list",    required_argument, NULL, 'l'},
+        {"csv",     no_argument,       NULL, 'c'},
+        {"help",    no_argument,       NULL, 'h'},
+        {NULL,      0,                 NULL, 0}
+    };
+    OPTIONS            options;
+    unsigned long long table;
+    long               threads;
+    int                opt;
+
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+    options.tableBits = DEFAULT_TABLE_BITS;
+    options.list = DEFAULT_LIST;
+    options.csv = FALSE;
+
+    while ((opt = getopt_long(argc, argv, "j:t:l:ch", longOptions, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'j':
+                threads = strtol(optarg, NULL, 0);
+                break;
+            case 't':
+                table = strtoull(optarg, NULL, 0);
+                for (options.tableBits = 4;
+                     (options.tableBits < 32) &&
+                     ((1ULL << options.tableBits) / 8 * 7 < table);
+                     options.tableBits++)
+                {
+                }
+                break;
+            case 'l':
+                options.list = (UINT32)strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                options.csv = TRUE;
+                break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    options.threads = (int)min(max(threads, 1L), (long)MAX_THREADS);
+
+    return (analyze(argv[optind], &options) == 0) ? 0 : 1;
+}
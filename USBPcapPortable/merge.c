@@ -0,0 +1,296 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * usbpcap-merge - merges pcap captures (for example from different root
+ * hubs or hosts) into single capture ordered by timestamp.
+ *
+ * Every input is mapped and read sequentially, the next record of each
+ * input is kept in binary heap keyed by timestamp. Records with equal
+ * timestamps are written in the order of inputs on the command line, so
+ * the output does not depend on anything but the inputs. Memory use is
+ * the heap and the write buffer, regardless of capture sizes.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pcapfile.h"
+
+#define DLT_USB_LINUX          189
+#define DLT_USB_LINUX_MMAPPED  220
+
+#define DEFAULT_BUFFER_SIZE    (1024 * 1024)
+
+typedef struct _INPUT
+{
+    const char  *name;
+    PCAP_FILE    file;
+    PCAP_RECORD  record;  /* next record to write */
+    UINT64       records;
+} INPUT;
+
+static BOOLEAN input_before(const INPUT *inputs, UINT32 a, UINT32 b)
+{
+    if (inputs[a].record.timestamp != inputs[b].record.timestamp)
+    {
+        return (inputs[a].record.timestamp < inputs[b].record.timestamp) ?
+               TRUE : FALSE;
+    }
+    return (a < b) ? TRUE : FALSE;
+}
+
+static void heap_down(UINT32 *heap, UINT32 count, const INPUT *inputs,
+                      UINT32 i)
+{
+    for (;;)
+    {
+        UINT32 smallest = i;
+        UINT32 left = 2 * i + 1;
+        UINT32 right = left + 1;
+        UINT32 tmp;
+
+        if ((left < count) && input_before(inputs, heap[left], heap[smallest]))
+        {
+            smallest = left;
+        }
+        if ((right < count) && input_before(inputs, heap[right], heap[smallest]))
+        {
+            smallest = right;
+        }
+        if (smallest == i)
+        {
+            return;
+        }
+        tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+/* Reads record following the current one. Returns FALSE at the end of
+ * input or when the input is corrupted.
+ */
+static BOOLEAN input_next(INPUT *input, UINT64 offset)
+{
+    int ret = pcap_read_record(&input->file, offset, &input->record);
+
+    if (ret < 0)
+    {
+        fprintf(stderr, "%s: invalid record at offset %llu, "
+                "records after it are not merged\n", input->name,
+                (unsigned long long)offset);
+    }
+    return (ret == 1) ? TRUE : FALSE;
+}
+
+static void write_record(PPCAP_WRITER writer, const PCAP_RECORD *record,
+                         UINT32 network, BOOLEAN renumber, USHORT bus)
+{
+    pcap_writer_record(writer, record->timestamp, record->inclLen,
+                       record->origLen);
+
+    if (renumber && (network == DLT_USBPCAP) &&
+        (record->inclLen >= sizeof(USBPCAP_BUFFER_PACKET_HEADER)) &&
+        (PCAP_LE16(&record->data[0]) >= sizeof(USBPCAP_BUFFER_PACKET_HEADER)))
+    {
+        const size_t length = sizeof(USBPCAP_BUFFER_PACKET_HEADER);
+        UCHAR       *p = pcap_writer_reserve(writer, length);
+
+        memcpy(p, record->data, length);
+        p[17] = (UCHAR)bus;
+        p[18] = (UCHAR)(bus >> 8);
+        pcap_writer_write(writer, &record->data[length],
+                          record->inclLen - length);
+    }
+    else
+    {
+        pcap_writer_write(writer, record->data, record->inclLen);
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] -o <output.pcap> <input.pcap>...\n"
+            "  -o, --output <file>     merged capture\n"
+            "  -r, --renumber-bus      set USBPcap bus of every record to\n"
+            "                          the input position (1, 2, ...)\n"
+            "  -B, --buffer <KiB>      write buffer (default %u)\n"
+            "  -v, --verbose           print number of records per input\n"
+            "\n"
+            "All inputs must have the same link type. Output has nanosecond\n"
+            "resolution if any input has it.\n",
+            name, DEFAULT_BUFFER_SIZE / 1024);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] =
+    {
+        {"output",       required_argument, NULL, 'o'},
+        {"renumber-bus", no_argument,       NULL, 'r'},
+        {"buffer",       required_argument, NULL, 'B'},
+        {"verbose",      no_argument,       NULL, 'v'},
+        {"help",         no_argument,       NULL, 'h'},
+        {NULL,           0,                 NULL, 0}
+    };
+    INPUT       *inputs;
+    UINT32      *heap;
+    UINT32       numberOfInputs;
+    UINT32       count = 0;
+    PCAP_WRITER  writer;
+    const char  *outputName = NULL;
+    char         error[256];
+    size_t       bufferSize = DEFAULT_BUFFER_SIZE;
+    BOOLEAN      renumber = FALSE;
+    BOOLEAN      verbose = FALSE;
+    BOOLEAN      nanoseconds = FALSE;
+    UINT32       snaplen = 0;
+    UINT32       i;
+    int          ret = 0;
+    int          opt;
+
+    while ((opt = getopt_long(argc, argv, "o:rB:vh", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'o':
+                outputName = optarg;
+                break;
+            case 'r':
+                renumber = TRUE;
+                break;
+            case 'B':
+                bufferSize = strtoul(optarg, NULL, 0) * 1024;
+                break;
+            case 'v':
+                verbose = TRUE;
+                break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    if ((outputName == NULL) || (optind == argc))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if (renumber && (argc - optind > 0xFFFF))
+    {
+        fprintf(stderr, "Too many inputs to renumber buses\n");
+        return 1;
+    }
+    bufferSize = max(bufferSize, (size_t)(64 * 1024));
+
+    numberOfInputs = (UINT32)(argc - optind);
+    inputs = (INPUT *)calloc(numberOfInputs, sizeof(INPUT));
+    heap = (UINT32 *)calloc(numberOfInputs, sizeof(UINT32));
+    if ((inputs == NULL) || (heap == NULL))
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    for (i = 0; i < numberOfInputs; i++)
+    {
+        INPUT *input = &inputs[i];
+
+        input->name = argv[optind + i];
+        if (pcap_open(&input->file, input->name, error, sizeof(error)) != 0)
+        {
+            fprintf(stderr, "%s\n", error);
+            return 1;
+        }
+        if (input->file.network != inputs[0].file.network)
+        {
+            fprintf(stderr, "%s: link type %u differs from %s link type %u\n",
+                    input->name, input->file.network, inputs[0].name,
+                    inputs[0].file.network);
+            return 1;
+        }
+        /* Record headers are rewritten in host order, but Linux usbmon
+         * headers stay in the byte order of the capturing host.
+         */
+        if (((input->file.network == DLT_USB_LINUX) ||
+             (input->file.network == DLT_USB_LINUX_MMAPPED)) &&
+            input->file.swapped)
+        {
+            fprintf(stderr, "%s: usbmon capture from host with different "
+                    "byte order is not supported\n", input->name);
+            return 1;
+        }
+
+        nanoseconds = nanoseconds || input->file.nanoseconds;
+        snaplen = max(snaplen, input->file.snaplen);
+        if (input_next(input, PCAP_FIRST_RECORD))
+        {
+            heap[count++] = i;
+        }
+        else if (input->file.size > PCAP_FIRST_RECORD)
+        {
+            ret = 1;
+        }
+    }
+
+    if (pcap_writer_open(&writer, outputName, bufferSize,
+                         error, sizeof(error)) != 0)
+    {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+    }
+    pcap_writer_header(&writer, nanoseconds, snaplen, inputs[0].file.network);
+
+    for (i = count / 2; i-- > 0;)
+    {
+        heap_down(heap, count, inputs, i);
+    }
+
+    while (count > 0)
+    {
+        INPUT  *input = &inputs[heap[0]];
+        UINT64  next = input->record.offset + sizeof(pcaprec_hdr_t) +
+                       input->record.inclLen;
+
+        write_record(&writer, &input->record, input->file.network,
+                     renumber, (USHORT)(heap[0] + 1));
+        input->records++;
+
+        if (!input_next(input, next))
+        {
+            if (next < input->file.size)
+            {
+                ret = 1;
+            }
+            heap[0] = heap[--count];
+        }
+        heap_down(heap, count, inputs, 0);
+    }
+
+    if (pcap_writer_close(&writer) != 0)
+    {
+        fprintf(stderr, "%s: write failed\n", outputName);
+        ret = 1;
+    }
+
+    for (i = 0; i < numberOfInputs; i++)
+    {
+        if (verbose)
+        {
+            fprintf(stderr, "%s: %llu records\n", inputs[i].name,
+                    (unsigned long long)inputs[i].records);
+        }
+        pcap_close(&inputs[i].file);
+    }
+    free(heap);
+    free(inputs);
+    return ret;
+}
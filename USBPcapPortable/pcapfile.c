@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pcapfile.h"
+
+#define PCAP_MAGIC           0xA1B2C3D4
+#define PCAP_MAGIC_NSEC      0xA1B23C4D
+
+/* Consecutive records that must be valid to accept record boundary */
+#define RESYNC_RECORDS       8
+
+/* Maximum time between consecutive records when resyncing */
+#define RESYNC_MAX_GAP       (24*3600*1000000000ULL)
+
+static UINT32 pcap_swap32(UINT32 value)
+{
+    return ((value & 0x000000FF) << 24) | ((value & 0x0000FF00) << 8) |
+           ((value & 0x00FF0000) >> 8) | ((value & 0xFF000000) >> 24);
+}
+
+static UINT32 pcap_get32(const PCAP_FILE *file, const UCHAR *p)
+{
+    UINT32 value;
+
+    memcpy(&value, p, sizeof(value));
+    return file->swapped ? pcap_swap32(value) : value;
+}
+
+int pcap_open(PPCAP_FILE file, const char *filename,
+              char *error, size_t errorLength)
+{
+    struct stat  st;
+    pcap_hdr_t   header;
+    void        *data;
+    int          fd;
+
+    memset(file, 0, sizeof(PCAP_FILE));
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        snprintf(error, errorLength, "%s: %s", filename, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) != 0)
+    {
+        snprintf(error, errorLength, "%s: %s", filename, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if ((UINT64)st.st_size < sizeof(pcap_hdr_t))
+    {
+        snprintf(error, errorLength, "%s: file too short", filename);
+        close(fd);
+        return -1;
+    }
+
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        snprintf(error, errorLength, "%s: %s", filename, strerror(errno));
+        return -1;
+    }
+
+    file->data = (const UCHAR *)data;
+    file->size = (UINT64)st.st_size;
+
+    memcpy(&header, file->data, sizeof(header));
+    if ((header.magic_number == PCAP_MAGIC) ||
+        (header.magic_number == PCAP_MAGIC_NSEC))
+    {
+        file->swapped = FALSE;
+    }
+    else if ((header.magic_number == pcap_swap32(PCAP_MAGIC)) ||
+             (header.magic_number == pcap_swap32(PCAP_MAGIC_NSEC)))
+    {
+        file->swapped = TRUE;
+    }
+    else
+    {
+        snprintf(error, errorLength, "%s: not a pcap file", filename);
+        pcap_close(file);
+        return -1;
+    }
+
+    file->nanoseconds =
+        (pcap_get32(file, file->data) == PCAP_MAGIC_NSEC) ? TRUE : FALSE;
+    file->snaplen = pcap_get32(file, &file->data[16]);
+    file->network = pcap_get32(file, &file->data[20]);
+
+    return 0;
+}
+
+void pcap_close(PPCAP_FILE file)
+{
+    if (file->data != NULL)
+    {
+        munmap((void *)file->data, (size_t)file->size);
+        file->data = NULL;
+    }
+}
+
+int pcap_read_record(const PCAP_FILE *file, UINT64 offset,
+                     PPCAP_RECORD record)
+{
+    const UCHAR *p;
+    UINT32       seconds;
+    UINT32       fraction;
+
+    if (offset == file->size)
+    {
+        return 0;
+    }
+    if ((offset > file->size) ||
+        (file->size - offset < sizeof(pcaprec_hdr_t)))
+    {
+        return -1;
+    }
+
+    p = &file->data[offset];
+    seconds = pcap_get32(file, &p[0]);
+    fraction = pcap_get32(file, &p[4]);
+    record->inclLen = pcap_get32(file, &p[8]);
+    record->origLen = pcap_get32(file, &p[12]);
+
+    if ((fraction >= (file->nanoseconds ? 1000000000U : 1000000U)) ||
+        (record->inclLen > record->origLen) ||
+        (record->inclLen > PCAP_MAX_RECORD) ||
+        (file->size - offset - sizeof(pcaprec_hdr_t) < record->inclLen))
+    {
+        return -1;
+    }
+
+    record->offset = offset;
+    record->timestamp = (UINT64)seconds * 1000000000ULL +
+                        (file->nanoseconds ? fraction : fraction * 1000ULL);
+    record->data = &p[sizeof(pcaprec_hdr_t)];
+
+    return 1;
+}
+
+BOOLEAN pcap_get_usbpcap_header(const PCAP_RECORD *record,
+                                PUSBPCAP_BUFFER_PACKET_HEADER header)
+{
+    const UCHAR *p = record->data;
+
+    if (record->inclLen < sizeof(USBPCAP_BUFFER_PACKET_HEADER))
+    {
+        return FALSE;
+    }
+
+    header->headerLen = PCAP_LE16(&p[0]);
+    if ((header->headerLen < sizeof(USBPCAP_BUFFER_PACKET_HEADER)) ||
+        (header->headerLen > record->inclLen))
+    {
+        return FALSE;
+    }
+
+    header->irpId = PCAP_LE64(&p[2]);
+    header->status = (USBD_STATUS)PCAP_LE32(&p[10]);
+    header->function = PCAP_LE16(&p[14]);
+    header->info = p[16];
+    header->bus = PCAP_LE16(&p[17]);
+    header->device = PCAP_LE16(&p[19]);
+    header->endpoint = p[21];
+    header->transfer = p[22];
+    header->dataLength = PCAP_LE32(&p[23]);
+
+    return TRUE;
+}
+
+/* Checks record beyond what pcap_read_record() does */
+static BOOLEAN pcap_record_plausible(const PCAP_FILE *file,
+                                     const PCAP_RECORD *record)
+{
+    USBPCAP_BUFFER_PACKET_HEADER header;
+
+    if ((file->snaplen != 0) && (record->inclLen > file->snaplen))
+    {
+        return FALSE;
+    }
+
+    if (file->network == DLT_USBPCAP)
+    {
+        if (!pcap_get_usbpcap_header(record, &header) ||
+            ((header.transfer > USBPCAP_TRANSFER_BULK) &&
+             (header.transfer != USBPCAP_TRANSFER_FILTER_MARKER) &&
+             (header.transfer != USBPCAP_TRANSFER_IRP_INFO) &&
+             (header.transfer != USBPCAP_TRANSFER_UNKNOWN)) ||
+            (record->origLen != header.headerLen + header.dataLength))
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+UINT64 pcap_find_record(const PCAP_FILE *file, UINT64 offset)
+{
+    if (offset < PCAP_FIRST_RECORD)
+    {
+        offset = PCAP_FIRST_RECORD;
+    }
+
+    for (; offset < file->size; offset++)
+    {
+        PCAP_RECORD record;
+        UINT64      next = offset;
+        UINT64      previous = 0;
+        int         i;
+
+        for (i = 0; i < RESYNC_RECORDS; i++)
+        {
+            int result = pcap_read_record(file, next, &record);
+
+            if (result == 0)
+            {
+                /* Valid records up to the end of file */
+                return offset;
+            }
+            if ((result < 0) || !pcap_record_plausible(file, &record) ||
+                ((i > 0) &&
+                 ((record.timestamp > previous + RESYNC_MAX_GAP) ||
+                  (record.timestamp + RESYNC_MAX_GAP < previous))))
+            {
+                break;
+            }
+
+            previous = record.timestamp;
+            next += sizeof(pcaprec_hdr_t) + record.inclLen;
+        }
+
+        if (i == RESYNC_RECORDS)
+        {
+            return offset;
+        }
+    }
+
+    return file->size;
+}
+
+int pcap_writer_open(PPCAP_WRITER writer, const char *filename,
+                     size_t bufferSize, char *error, size_t errorLength)
+{
+    memset(writer, 0, sizeof(PCAP_WRITER));
+
+    writer->buffer = (UCHAR *)malloc(bufferSize);
+    if (writer->buffer == NULL)
+    {
+        snprintf(error, errorLength, "%s: out of memory", filename);
+        return -1;
+    }
+    writer->size = bufferSize;
+
+    writer->file = fopen(filename, "wb");
+    if (writer->file == NULL)
+    {
+        snprintf(error, errorLength, "%s: %s", filename, strerror(errno));
+        free(writer->buffer);
+        writer->buffer = NULL;
+        return -1;
+    }
+    /* Writer does its own buffering */
+    setvbuf(writer->file, NULL, _IONBF, 0);
+
+    return 0;
+}
+
+int pcap_writer_close(PPCAP_WRITER writer)
+{
+    pcap_writer_flush(writer);
+    if (fclose(writer->file) != 0)
+    {
+        writer->failed = TRUE;
+    }
+    writer->file = NULL;
+    free(writer->buffer);
+    writer->buffer = NULL;
+
+    return writer->failed ? -1 : 0;
+}
+
+void pcap_writer_flush(PPCAP_WRITER writer)
+{
+    if ((writer->used > 0) &&
+        (fwrite(writer->buffer, 1, writer->used, writer->file) != writer->used))
+    {
+        writer->failed = TRUE;
+    }
+    writer->used = 0;
+}
+
+UCHAR *pcap_writer_reserve(PPCAP_WRITER writer, size_t length)
+{
+    UCHAR *p;
+
+    if (writer->used + length > writer->size)
+    {
+        pcap_writer_flush(writer);
+    }
+    p = &writer->buffer[writer->used];
+    writer->used += length;
+    return p;
+}
+
+void pcap_writer_write(PPCAP_WRITER writer, const void *data, size_t length)
+{
+    if (length > writer->size / 2)
+    {
+        pcap_writer_flush(writer);
+        if (fwrite(data, 1, length, writer->file) != length)
+        {
+            writer->failed = TRUE;
+        }
+        return;
+    }
+    memcpy(pcap_writer_reserve(writer, length), data, length);
+}
+
+void pcap_writer_header(PPCAP_WRITER writer, BOOLEAN nanoseconds,
+                        UINT32 snaplen, UINT32 network)
+{
+    pcap_hdr_t header;
+
+    header.magic_number = nanoseconds ? PCAP_MAGIC_NSEC : PCAP_MAGIC;
+    header.version_major = 2;
+    header.version_minor = 4;
+    header.thiszone = 0;
+    header.sigfigs = 0;
+    header.snaplen = snaplen;
+    header.network = network;
+
+    writer->nanoseconds = nanoseconds;
+    memcpy(pcap_writer_reserve(writer, sizeof(header)), &header, sizeof(header));
+}
+
+void pcap_writer_record(PPCAP_WRITER writer, UINT64 timestamp,
+                        UINT32 inclLen, UINT32 origLen)
+{
+    pcaprec_hdr_t header;
+
+    header.ts_sec = (UINT32)(timestamp / 1000000000ULL);
+    header.ts_usec = (UINT32)(timestamp % 1000000000ULL /
+                              (writer->nanoseconds ? 1 : 1000));
+    header.incl_len = inclLen;
+    header.orig_len = max(origLen, inclLen);
+
+    memcpy(pcap_writer_reserve(writer, sizeof(header)), &header, sizeof(header));
+}
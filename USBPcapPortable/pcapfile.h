@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef USBPCAP_PORTABLE_PCAPFILE_H
+#define USBPCAP_PORTABLE_PCAPFILE_H
+
+#include <stdio.h>
+
+#include "include/USBPcap.h"
+
+/* pcap file mapped to memory. Both byte orders and both microsecond and
+ * nanosecond timestamp resolution are supported. pcapng is not.
+ */
+typedef struct _PCAP_FILE
+{
+    const UCHAR *data;
+    UINT64       size;
+    BOOLEAN      swapped;     /* file byte order differs from host */
+    BOOLEAN      nanoseconds; /* ts_usec field holds nanoseconds */
+    UINT32       snaplen;
+    UINT32       network;
+} PCAP_FILE, *PPCAP_FILE;
+
+typedef struct _PCAP_RECORD
+{
+    UINT64       offset;    /* file offset of the record header */
+    UINT64       timestamp; /* nanoseconds since Unix epoch */
+    UINT32       inclLen;
+    UINT32       origLen;
+    const UCHAR *data;      /* inclLen bytes */
+} PCAP_RECORD, *PPCAP_RECORD;
+
+/* Offset of the first record */
+#define PCAP_FIRST_RECORD  sizeof(pcap_hdr_t)
+
+/* Records longer than this are considered corrupted regardless of
+ * snaplen in the file header.
+ */
+#define PCAP_MAX_RECORD    (256*1024*1024)
+
+/* Maps file and validates the global header. Returns 0 on success,
+ * otherwise -1 with message in error.
+ */
+int pcap_open(PPCAP_FILE file, const char *filename,
+              char *error, size_t errorLength);
+void pcap_close(PPCAP_FILE file);
+
+/* Parses record at offset. Returns 1 if record was parsed, 0 at end of
+ * file and -1 if data at offset does not look like a valid record or the
+ * record is truncated.
+ */
+int pcap_read_record(const PCAP_FILE *file, UINT64 offset,
+                     PPCAP_RECORD record);
+
+/* Returns offset of the first record at or after offset that starts a
+ * run of valid records (or the valid records that end the file). Used to
+ * split file in chunks processed in parallel. As record boundary cannot
+ * be recognized with certainty, the caller must check that the chunk
+ * before ends exactly where the next chunk starts.
+ *
+ * Returns file size if no record was found.
+ */
+UINT64 pcap_find_record(const PCAP_FILE *file, UINT64 offset);
+
+/* Reads USBPcap packet header from DLT_USBPCAP record. Returns FALSE if
+ * the record is too short or headerLen is not valid.
+ */
+BOOLEAN pcap_get_usbpcap_header(const PCAP_RECORD *record,
+                                PUSBPCAP_BUFFER_PACKET_HEADER header);
+
+/* Buffered pcap file writer. Records are assembled in the buffer, so
+ * writing needs no allocation per record. File and record headers are
+ * written in host byte order.
+ */
+typedef struct _PCAP_WRITER
+{
+    FILE        *file;
+    UCHAR       *buffer;
+    size_t       size;
+    size_t       used;
+    BOOLEAN      nanoseconds;
+    BOOLEAN      failed;      /* some write failed */
+} PCAP_WRITER, *PPCAP_WRITER;
+
+/* Creates file with buffer of bufferSize bytes. Returns 0 on success,
+ * otherwise -1 with message in error.
+ */
+int pcap_writer_open(PPCAP_WRITER writer, const char *filename,
+                     size_t bufferSize, char *error, size_t errorLength);
+
+/* Flushes the buffer and closes the file. Returns -1 if any write
+ * failed.
+ */
+int pcap_writer_close(PPCAP_WRITER writer);
+
+void pcap_writer_header(PPCAP_WRITER writer, BOOLEAN nanoseconds,
+                        UINT32 snaplen, UINT32 network);
+void pcap_writer_record(PPCAP_WRITER writer, UINT64 timestamp,
+                        UINT32 inclLen, UINT32 origLen);
+
+/* Returns pointer to length bytes in the buffer, length must not exceed
+ * the buffer size.
+ */
+UCHAR *pcap_writer_reserve(PPCAP_WRITER writer, size_t length);
+void pcap_writer_write(PPCAP_WRITER writer, const void *data, size_t length);
+void pcap_writer_flush(PPCAP_WRITER writer);
+
+/* Little endian field access for USBPcap headers in records */
+#define PCAP_LE16(p)  ((UINT16)((p)[0] | ((p)[1] << 8)))
+#define PCAP_LE32(p)  ((UINT32)((p)[0] | ((p)[1] << 8) | \
+                                ((UINT32)(p)[2] << 16) | ((UINT32)(p)[3] << 24)))
+#define PCAP_LE64(p)  ((UINT64)PCAP_LE32(p) | ((UINT64)PCAP_LE32((p) + 4) << 32))
+
+#endif /* USBPCAP_PORTABLE_PCAPFILE_H */
@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "pcapscan.h"
+
+#define MASK_WORDS  (SCAN_BATCH_RECORDS / 64)
+
+void scan_init(PSCANNER scanner, const PCAP_FILE *file,
+               UINT64 offset, UINT64 end)
+{
+    scanner->file = file;
+    scanner->offset = offset;
+    scanner->end = min(end, file->size);
+    scanner->corrupted = FALSE;
+}
+
+UINT32 scan_next(PSCANNER scanner, PSCAN_BATCH batch)
+{
+    PCAP_RECORD record;
+    UINT32      i;
+
+    /* Walking the records is inherently sequential, only the header
+     * fields are spread to the columns here.
+     */
+    for (i = 0; (i < SCAN_BATCH_RECORDS) && (scanner->offset < scanner->end); i++)
+    {
+        const UCHAR *p;
+        USHORT       headerLen = 0;
+
+        if (pcap_read_record(scanner->file, scanner->offset, &record) != 1)
+        {
+            scanner->corrupted = TRUE;
+            break;
+        }
+
+        batch->offset[i] = record.offset;
+        batch->timestamp[i] = record.timestamp;
+        batch->inclLen[i] = record.inclLen;
+        batch->origLen[i] = record.origLen;
+
+        p = record.data;
+        if (record.inclLen >= sizeof(USBPCAP_BUFFER_PACKET_HEADER))
+        {
+            headerLen = PCAP_LE16(&p[0]);
+        }
+        if ((headerLen >= sizeof(USBPCAP_BUFFER_PACKET_HEADER)) &&
+            (headerLen <= record.inclLen))
+        {
+            batch->headerLen[i] = headerLen;
+            batch->irpId[i] = PCAP_LE64(&p[2]);
+            batch->status[i] = (INT32)PCAP_LE32(&p[10]);
+            batch->function[i] = PCAP_LE16(&p[14]);
+            batch->info[i] = p[16];
+            batch->bus[i] = PCAP_LE16(&p[17]);
+            batch->device[i] = PCAP_LE16(&p[19]);
+            batch->endpoint[i] = p[21];
+            batch->transfer[i] = p[22];
+            batch->dataLength[i] = PCAP_LE32(&p[23]);
+        }
+        else
+        {
+            batch->headerLen[i] = 0;
+            batch->irpId[i] = 0;
+            batch->status[i] = 0;
+            batch->function[i] = 0;
+            batch->info[i] = 0;
+            batch->bus[i] = 0;
+            batch->device[i] = 0;
+            batch->endpoint[i] = 0;
+            batch->transfer[i] = USBPCAP_TRANSFER_UNKNOWN;
+            batch->dataLength[i] = 0;
+        }
+
+        scanner->offset += sizeof(pcaprec_hdr_t) + record.inclLen;
+    }
+
+    batch->count = i;
+    return i;
+}
+
+void scan_filter_init(PSCAN_FILTER filter)
+{
+    memset(filter, 0, sizeof(SCAN_FILTER));
+    filter->bus = -1;
+    filter->device = -1;
+    filter->endpoint = -1;
+    filter->transfer = -1;
+    filter->from = 0;
+    filter->to = ~0ULL;
+}
+
+/* Column predicates clear mask bits of records that do not match. The
+ * columns are always SCAN_BATCH_RECORDS long, lanes past batch->count
+ * are cleared by the caller.
+ */
+
+static void mask_u8_equal(const UCHAR *column, UCHAR value, UINT64 *mask)
+{
+    UINT32 i;
+
+#if defined(__SSE2__)
+    const __m128i match = _mm_set1_epi8((char)value);
+
+    for (i = 0; i < SCAN_BATCH_RECORDS; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)&column[i]);
+        UINT64  bits = (UINT32)_mm_movemask_epi8(_mm_cmpeq_epi8(v, match));
+
+        mask[i / 64] &= ~((~bits & 0xFFFF) << (i % 64));
+    }
+#else
+    for (i = 0; i < SCAN_BATCH_RECORDS; i++)
+    {
+        if (column[i] != value)
+        {
+            mask[i / 64] &= ~(1ULL << (i % 64));
+        }
+    }
+#endif
+}
+
+static void mask_u16_equal(const USHORT *column, USHORT value, UINT64 *mask)
+{
+    UINT32 i;
+
+#if defined(__SSE2__)
+    const __m128i match = _mm_set1_epi16((short)value);
+
+    for (i = 0; i < SCAN_BATCH_RECORDS; i += 16)
+    {
+        __m128i low = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)&column[i]), match);
+        __m128i high = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)&column[i + 8]), match);
+        UINT64  bits = (UINT32)_mm_movemask_epi8(_mm_packs_epi16(low, high));
+
+        mask[i / 64] &= ~((~bits & 0xFFFF) << (i % 64));
+    }
+#else
+    for (i = 0; i < SCAN_BATCH_RECORDS; i++)
+    {
+        if (column[i] != value)
+        {
+            mask[i / 64] &= ~(1ULL << (i % 64));
+        }
+    }
+#endif
+}
+
+/* USBD_STATUS is error when the two most significant bits are 11 or 10,
+ * which is the sign bit.
+ */
+static void mask_negative(const INT32 *column, UINT64 *mask)
+{
+    UINT32 i;
+
+#if defined(__SSE2__)
+    for (i = 0; i < SCAN_BATCH_RECORDS; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)&column[i]);
+        __m128i b = _mm_loadu_si128((const __m128i *)&column[i + 4]);
+        __m128i c = _mm_loadu_si128((const __m128i *)&column[i + 8]);
+        __m128i d = _mm_loadu_si128((const __m128i *)&column[i + 12]);
+        /* Saturating packs keep the sign */
+        __m128i packed = _mm_packs_epi16(_mm_packs_epi32(a, b),
+                                         _mm_packs_epi32(c, d));
+        UINT64  bits = (UINT32)_mm_movemask_epi8(packed);
+
+        mask[i / 64] &= ~((~bits & 0xFFFF) << (i % 64));
+    }
+#else
+    for (i = 0; i < SCAN_BATCH_RECORDS; i++)
+    {
+        if (column[i] >= 0)
+        {
+            mask[i / 64] &= ~(1ULL << (i % 64));
+        }
+    }
+#endif
+}
+
+/* 64-bit comparisons need SSE4.2, plain loops are left to the compiler */
+static void mask_u64_range(const UINT64 *column, UINT64 from, UINT64 to,
+                           UINT64 *mask)
+{
+    UINT32 word;
+    UINT32 i;
+
+    for (word = 0; word < MASK_WORDS; word++)
+    {
+        UINT64 bits = 0;
+
+        for (i = 0; i < 64; i++)
+        {
+            UINT64 value = column[word * 64 + i];
+
+            bits |= (UINT64)((value >= from) & (value <= to)) << i;
+        }
+        mask[word] &= bits;
+    }
+}
+
+UINT32 scan_filter(const SCAN_BATCH *batch, const SCAN_FILTER *filter,
+                   UINT64 mask[SCAN_BATCH_RECORDS / 64])
+{
+    UINT32 matches = 0;
+    UINT32 word;
+
+    for (word = 0; word < MASK_WORDS; word++)
+    {
+        if (batch->count >= (word + 1) * 64)
+        {
+            mask[word] = ~0ULL;
+        }
+        else if (batch->count > word * 64)
+        {
+            mask[word] = (1ULL << (batch->count - word * 64)) - 1;
+        }
+        else
+        {
+            mask[word] = 0;
+        }
+    }
+
+    if (filter->transfer >= 0)
+    {
+        mask_u8_equal(batch->transfer, (UCHAR)filter->transfer, mask);
+    }
+    if (filter->endpoint >= 0)
+    {
+        mask_u8_equal(batch->endpoint, (UCHAR)filter->endpoint, mask);
+    }
+    if (filter->device >= 0)
+    {
+        mask_u16_equal(batch->device, (USHORT)filter->device, mask);
+    }
+    if (filter->bus >= 0)
+    {
+        mask_u16_equal(batch->bus, (USHORT)filter->bus, mask);
+    }
+    if (filter->errors)
+    {
+        mask_negative(batch->status, mask);
+    }
+    if (filter->hasIrp)
+    {
+        mask_u64_range(batch->irpId, filter->irpId, filter->irpId, mask);
+    }
+    if ((filter->from != 0) || (filter->to != ~0ULL))
+    {
+        mask_u64_range(batch->timestamp, filter->from, filter->to, mask);
+    }
+
+    for (word = 0; word < MASK_WORDS; word++)
+    {
+        matches += (UINT32)__builtin_popcountll(mask[word]);
+    }
+    return matches;
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef USBPCAP_PORTABLE_PCAPSCAN_H
+#define USBPCAP_PORTABLE_PCAPSCAN_H
+
+#include "pcapfile.h"
+
+/* Records parsed per scan_next() call, multiple of 64 */
+#define SCAN_BATCH_RECORDS  256
+
+/* Record headers of DLT_USBPCAP capture stored as structure of arrays,
+ * so filter predicates run over whole columns. Records without valid
+ * USBPcap header have all USBPcap fields zero and transfer set to
+ * USBPCAP_TRANSFER_UNKNOWN.
+ */
+typedef struct _SCAN_BATCH
+{
+    UINT32   count;
+    UINT64   offset[SCAN_BATCH_RECORDS];     /* record header offset */
+    UINT64   timestamp[SCAN_BATCH_RECORDS];  /* ns since Unix epoch */
+    UINT64   irpId[SCAN_BATCH_RECORDS];
+    INT32    status[SCAN_BATCH_RECORDS];
+    UINT32   inclLen[SCAN_BATCH_RECORDS];
+    UINT32   origLen[SCAN_BATCH_RECORDS];
+    UINT32   dataLength[SCAN_BATCH_RECORDS];
+    USHORT   headerLen[SCAN_BATCH_RECORDS];
+    USHORT   function[SCAN_BATCH_RECORDS];
+    USHORT   bus[SCAN_BATCH_RECORDS];
+    USHORT   device[SCAN_BATCH_RECORDS];
+    UCHAR    info[SCAN_BATCH_RECORDS];
+    UCHAR    endpoint[SCAN_BATCH_RECORDS];
+    UCHAR    transfer[SCAN_BATCH_RECORDS];
+} SCAN_BATCH, *PSCAN_BATCH;
+
+typedef struct _SCANNER
+{
+    const PCAP_FILE *file;
+    UINT64           offset;  /* next record */
+    UINT64           end;     /* records starting at or after are not read */
+    BOOLEAN          corrupted;
+} SCANNER, *PSCANNER;
+
+/* Predicates are combined with AND. Negative value (or FALSE) disables
+ * the predicate.
+ */
+typedef struct _SCAN_FILTER
+{
+    int      bus;
+    int      device;
+    int      endpoint;  /* with direction bit */
+    int      transfer;
+    BOOLEAN  errors;    /* USBD_ERROR(status) */
+    BOOLEAN  hasIrp;
+    UINT64   irpId;
+    UINT64   from;      /* timestamp range, inclusive */
+    UINT64   to;
+} SCAN_FILTER, *PSCAN_FILTER;
+
+/* Scans records starting at offset (must be record boundary) up to end,
+ * use file size to scan until the end of file.
+ */
+void scan_init(PSCANNER scanner, const PCAP_FILE *file,
+               UINT64 offset, UINT64 end);
+
+/* Parses next batch of records. Returns number of records parsed, 0 at
+ * the end. When invalid record is found, scanner->corrupted is set and
+ * scanning stops at scanner->offset.
+ */
+UINT32 scan_next(PSCANNER scanner, PSCAN_BATCH batch);
+
+/* Filter that matches everything */
+void scan_filter_init(PSCAN_FILTER filter);
+
+/* Evaluates filter over the batch. Bit i of mask is set if record i
+ * matches. Returns number of matching records.
+ */
+UINT32 scan_filter(const SCAN_BATCH *batch, const SCAN_FILTER *filter,
+                   UINT64 mask[SCAN_BATCH_RECORDS / 64]);
+
+#endif /* USBPCAP_PORTABLE_PCAPSCAN_H */
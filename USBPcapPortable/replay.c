@@ -0,0 +1,439 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * usbpcap-replay - feeds records of existing USBPcap capture through the
+ * driver ring buffer with original, scaled or no timing while consumer
+ * of configurable speed reads them, and reports the smallest buffer
+ * length that would have avoided drops.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+#include "pcapfile.h"
+#include "USBPcapBuffer.h"
+
+#define NSEC_PER_SEC        1000000000ULL
+#define DEFAULT_BUFFER_LEN  (1024*1024)
+
+/* Driver limits, see USBPcapSetUpBuffer() */
+#define MIN_BUFFER_LEN      4096
+#define MAX_BUFFER_LEN      134217728
+
+/* Records due within this time are written without sleeping */
+#define SLEEP_THRESHOLD     50000
+
+/* 100 ns intervals between January 1, 1601 and January 1, 1970 */
+#define FILETIME_UNIX_EPOCH 116444736000000000ULL
+
+typedef struct _CONSUMER
+{
+    pthread_t  thread;
+    UINT32     readLength;
+    UINT64     rate;     /* bytes per second, 0 no limit */
+    FILE      *output;   /* NULL to discard */
+    UINT64     bytes;
+    UINT64     records;
+    BOOLEAN    failed;
+} CONSUMER;
+
+static PORTABLE_CAPTURE g_capture;
+static volatile LONG    g_stopConsumer;
+
+static UINT64 clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (UINT64)ts.tv_sec * NSEC_PER_SEC + (UINT64)ts.tv_nsec;
+}
+
+static void sleep_until(UINT64 ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)(ns / NSEC_PER_SEC);
+    ts.tv_nsec = (long)(ns % NSEC_PER_SEC);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+    }
+}
+
+static void *consumer_thread(void *arg)
+{
+    CONSUMER       *consumer = (CONSUMER *)arg;
+    RECORD_COUNTER  counter;
+    UCHAR          *buffer;
+    UINT64          start = clock_ns();
+
+    memset(&counter, 0, sizeof(counter));
+    buffer = (UCHAR *)malloc(consumer->readLength);
+    if (buffer == NULL)
+    {
+        consumer->failed = TRUE;
+        return NULL;
+    }
+
+    for (;;)
+    {
+        UINT32 bytes = capture_read(&g_capture, buffer, consumer->readLength);
+
+        if (bytes == 0)
+        {
+            if (InterlockedCompareExchange(&g_stopConsumer, 0, 0) != 0)
+            {
+                break;
+            }
+            sleep_until(clock_ns() + 100000);
+            continue;
+        }
+
+        if ((consumer->output != NULL) &&
+            (fwrite(buffer, 1, bytes, consumer->output) != bytes))
+        {
+            consumer->failed = TRUE;
+            consumer->output = NULL;
+        }
+
+        record_counter_update(&counter, buffer, bytes);
+        consumer->bytes += bytes;
+
+        if (consumer->rate != 0)
+        {
+            sleep_until(start + consumer->bytes * NSEC_PER_SEC / consumer->rate);
+        }
+    }
+
+    consumer->records = counter.records;
+    free(buffer);
+    return NULL;
+}
+
+static UINT32 get_buffer_allocated(PUSBPCAP_ROOTHUB_DATA root)
+{
+    KIRQL  irql;
+    UINT32 allocated;
+
+    KeAcquireSpinLock(&root->bufferLock, &irql);
+    allocated = (root->writeOffset + root->bufferSize - root->readOffset) %
+                root->bufferSize;
+    KeReleaseSpinLock(&root->bufferLock, irql);
+
+    return allocated;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <capture.pcap>\n"
+            "\n"
+            "Options:\n"
+            "  -b, --bufferlen <n>   driver buffer length (default: %d)\n"
+            "  -s, --speed <x>       replay speed, 1 keeps original timing,\n"
+            "                        2 replays twice as fast (default: 1)\n"
+            "  -a, --asap            replay as fast as possible\n"
+            "  -r, --read-rate <n>   consumer bytes per second (default: no limit)\n"
+            "  -l, --read-length <n> consumer read length (default: bufferlen)\n"
+            "  -o, --output <file>   write replayed capture to file\n"
+            "\n"
+            "Minimum buffer length is calculated for consumer continuously\n"
+            "reading at read-rate, consumer reading in large chunks may need\n"
+            "less. Without read-rate it is the peak buffer usage seen during\n"
+            "replay, valid only if there were no drops.\n",
+            name, DEFAULT_BUFFER_LEN);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] =
+    {
+        {"bufferlen",   required_argument, NULL, 'b'},
+        {"speed",       required_argument, NULL, 's'},
+        {"asap",        no_argument,       NULL, 'a'},
+        {"read-rate",   required_argument, NULL, 'r'},
+        {"read-length", required_argument, NULL, 'l'},
+        {"output",      required_argument, NULL, 'o'},
+        {"help",        no_argument,       NULL, 'h'},
+        {NULL,          0,                 NULL, 0}
+    };
+    PCAP_FILE           file;
+    PCAP_RECORD         record;
+    CONSUMER            consumer;
+    USBPCAP_STATISTICS  statistics;
+    char                error[256];
+    const char         *outputName = NULL;
+    UINT32              bufferLength = DEFAULT_BUFFER_LEN;
+    double              speed = 1.0;
+    UINT64              offset;
+    UINT64              firstTimestamp = 0;
+    UINT64              lastTimestamp = 0;
+    UINT64              start;
+    UINT64              elapsed;
+    UINT64              previous;
+    UINT64              records = 0;
+    UINT64              bytes = 0;
+    UINT64              stored = 0;
+    UINT64              invalid = 0;
+    UINT64              peak = 0;
+    double              queue;
+    double              queuePeak;
+    double              seconds;
+    int                 result;
+    int                 opt;
+
+    memset(&consumer, 0, sizeof(consumer));
+
+    while ((opt = getopt_long(argc, argv, "b:s:ar:l:o:h", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'b':
+                bufferLength = (UINT32)strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                speed = atof(optarg);
+                break;
+            case 'a':
+                speed = 0.0;
+                break;
+            case 'r':
+                consumer.rate = strtoull(optarg, NULL, 0);
+                break;
+            case 'l':
+                consumer.readLength = (UINT32)strtoul(optarg, NULL, 0);
+                break;
+            case 'o':
+                outputName = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    if ((optind != argc - 1) || (speed < 0.0))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if (consumer.readLength == 0)
+    {
+        /* USBPcapCMD reads with buffer of bufferlen bytes */
+        consumer.readLength = bufferLength;
+    }
+
+    if (pcap_open(&file, argv[optind], error, sizeof(error)) != 0)
+    {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+    }
+    if (file.network != DLT_USBPCAP)
+    {
+        fprintf(stderr, "%s: link type %u is not DLT_USBPCAP\n",
+                argv[optind], file.network);
+        pcap_close(&file);
+        return 1;
+    }
+
+    if (outputName != NULL)
+    {
+        consumer.output = fopen(outputName, "wb");
+        if (consumer.output == NULL)
+        {
+            fprintf(stderr, "%s: %s\n", outputName, strerror(errno));
+            pcap_close(&file);
+            return 1;
+        }
+    }
+
+    if (capture_open(&g_capture, bufferLength, 1) != 0)
+    {
+        fprintf(stderr, "Failed to set up %u bytes buffer\n", bufferLength);
+        pcap_close(&file);
+        return 1;
+    }
+
+    /* Drop the filter change marker written when capture_open() set the
+     * filter, the trace has its own markers. Keep the global header.
+     */
+    g_capture.root.writeOffset = sizeof(pcap_hdr_t);
+
+    if (pthread_create(&consumer.thread, NULL, consumer_thread, &consumer) != 0)
+    {
+        fprintf(stderr, "Failed to start consumer thread\n");
+        return 1;
+    }
+
+    /* Global header is in the buffer before the first record */
+    queue = sizeof(pcap_hdr_t);
+    queuePeak = queue;
+    start = clock_ns();
+    previous = start;
+
+    for (offset = PCAP_FIRST_RECORD;
+         (result = pcap_read_record(&file, offset, &record)) == 1;
+         offset += sizeof(pcaprec_hdr_t) + record.inclLen)
+    {
+        PUSBPCAP_BUFFER_PACKET_HEADER  packet;
+        LARGE_INTEGER                  timestamp;
+        USHORT                         headerLen;
+        UINT32                         size;
+        UINT64                         now;
+
+        if (records == 0)
+        {
+            firstTimestamp = record.timestamp;
+        }
+        records++;
+
+        headerLen = (record.inclLen >= 2) ? PCAP_LE16(record.data) : 0;
+        if ((headerLen < sizeof(USBPCAP_BUFFER_PACKET_HEADER)) ||
+            (headerLen > record.inclLen))
+        {
+            invalid++;
+            continue;
+        }
+        lastTimestamp = record.timestamp;
+
+        if ((speed > 0.0) && (record.timestamp > firstTimestamp))
+        {
+            UINT64 due = start + (UINT64)((record.timestamp - firstTimestamp) /
+                                          speed);
+
+            now = clock_ns();
+            if (due > now + SLEEP_THRESHOLD)
+            {
+                sleep_until(due);
+            }
+        }
+
+        /* Header keeps the original data length, snaplen limits the
+         * record to exactly the captured part.
+         */
+        packet = (PUSBPCAP_BUFFER_PACKET_HEADER)record.data;
+        g_capture.root.snaplen = record.inclLen;
+
+        timestamp.QuadPart = (LONGLONG)(record.timestamp / 100 +
+                                        FILETIME_UNIX_EPOCH);
+
+        now = clock_ns();
+        if (NT_SUCCESS(USBPcapBufferWriteTimestampedPacket(&g_capture.root,
+                                                           timestamp,
+                                                           packet,
+                                                           (PVOID)&record.data[headerLen])))
+        {
+            UINT32 allocated = get_buffer_allocated(&g_capture.root);
+
+            stored++;
+            peak = max(peak, allocated);
+        }
+
+        /* Buffer usage with consumer reading exactly at read-rate and
+         * buffer large enough to never drop.
+         */
+        size = sizeof(pcaprec_hdr_t) + record.inclLen;
+        bytes += size;
+        if (consumer.rate != 0)
+        {
+            queue -= (double)(now - previous) * consumer.rate / NSEC_PER_SEC;
+            if (queue < 0.0)
+            {
+                queue = 0.0;
+            }
+            queue += size;
+            if (queue > queuePeak)
+            {
+                queuePeak = queue;
+            }
+        }
+        previous = now;
+    }
+    elapsed = clock_ns() - start;
+
+    InterlockedExchange(&g_stopConsumer, 1);
+    pthread_join(consumer.thread, NULL);
+    capture_get_statistics(&g_capture, &statistics);
+    capture_close(&g_capture);
+    pcap_close(&file);
+    if (consumer.output != NULL)
+    {
+        fclose(consumer.output);
+    }
+
+    if (result < 0)
+    {
+        fprintf(stderr, "Corrupted record at offset %llu, replay stopped\n",
+                (unsigned long long)offset);
+    }
+    if (consumer.failed)
+    {
+        fprintf(stderr, "Consumer failed, output is not complete\n");
+    }
+
+    seconds = (double)elapsed / NSEC_PER_SEC;
+    printf("records         %llu (%llu invalid skipped)\n",
+           (unsigned long long)records, (unsigned long long)invalid);
+    printf("trace duration  %.3f s\n",
+           (double)(lastTimestamp - firstTimestamp) / NSEC_PER_SEC);
+    if (speed > 0.0)
+    {
+        printf("replay          %.3f s at %gx speed\n", seconds, speed);
+    }
+    else
+    {
+        printf("replay          %.3f s as fast as possible\n", seconds);
+    }
+    printf("offered         %llu bytes (%.0f records/s, %.2f MiB/s)\n",
+           (unsigned long long)bytes, (records - invalid) / seconds,
+           bytes / seconds / (1024 * 1024));
+    printf("read            %llu records, %llu bytes\n",
+           (unsigned long long)consumer.records,
+           (unsigned long long)consumer.bytes);
+    printf("dropped         %u records (%.2f%%)\n", statistics.bufferFull,
+           (records == invalid) ? 0.0 :
+           100.0 * statistics.bufferFull / (records - invalid));
+    printf("peak usage      %llu of %u bytes\n",
+           (unsigned long long)peak, bufferLength);
+
+    if (consumer.rate != 0)
+    {
+        /* Writer needs one byte more than it stores, see USBPcapGetBufferFree() */
+        UINT64 minimum = max((UINT64)queuePeak + 1, MIN_BUFFER_LEN);
+
+        if (minimum > MAX_BUFFER_LEN)
+        {
+            printf("min bufferlen   none, consumer at %llu bytes/s needs "
+                   "%llu bytes, driver maximum is %u\n",
+                   (unsigned long long)consumer.rate,
+                   (unsigned long long)minimum, MAX_BUFFER_LEN);
+        }
+        else
+        {
+            printf("min bufferlen   %llu bytes for consumer at %llu bytes/s\n",
+                   (unsigned long long)minimum,
+                   (unsigned long long)consumer.rate);
+        }
+    }
+    else if (statistics.bufferFull == 0)
+    {
+        printf("min bufferlen   %llu bytes for this consumer\n",
+               (unsigned long long)max(peak + 1, MIN_BUFFER_LEN));
+    }
+    else
+    {
+        printf("min bufferlen   unknown, more than %u bytes for this consumer "
+               "(use --read-rate or larger --bufferlen)\n", bufferLength);
+    }
+
+    return (result < 0) ? 1 : 0;
+}
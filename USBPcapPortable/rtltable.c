@@ -0,0 +1,392 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * RTL_GENERIC_TABLE implementation. Elements are kept in splay tree and
+ * in insertion ordered list. Every element is allocated with the table
+ * allocate routine together with its header, same as in the kernel, so
+ * the allocation pattern of driver tables is preserved.
+ */
+
+#include "Ntddk.h"
+
+typedef struct _TABLE_ENTRY_HEADER
+{
+    RTL_SPLAY_LINKS SplayLinks;
+    LIST_ENTRY      ListEntry;
+    LONGLONG        UserData;
+} TABLE_ENTRY_HEADER, *PTABLE_ENTRY_HEADER;
+
+#define TABLE_ENTRY_USER_DATA(links) \
+    ((PVOID)&((PTABLE_ENTRY_HEADER)(links))->UserData)
+
+/* Root points to itself */
+#define RtlIsRoot(links)  ((links)->Parent == (links))
+
+static VOID RtlRotate(PRTL_SPLAY_LINKS x)
+{
+    PRTL_SPLAY_LINKS p = x->Parent;
+    PRTL_SPLAY_LINKS g = p->Parent;
+    BOOLEAN          pIsRoot = RtlIsRoot(p);
+
+    if (p->LeftChild == x)
+    {
+        p->LeftChild = x->RightChild;
+        if (p->LeftChild != NULL)
+        {
+            p->LeftChild->Parent = p;
+        }
+        x->RightChild = p;
+    }
+    else
+    {
+        p->RightChild = x->LeftChild;
+        if (p->RightChild != NULL)
+        {
+            p->RightChild->Parent = p;
+        }
+        x->LeftChild = p;
+    }
+    p->Parent = x;
+
+    if (pIsRoot)
+    {
+        x->Parent = x;
+    }
+    else
+    {
+        x->Parent = g;
+        if (g->LeftChild == p)
+        {
+            g->LeftChild = x;
+        }
+        else
+        {
+            g->RightChild = x;
+        }
+    }
+}
+
+/* Moves links to the root of its tree. Returns the new root. */
+static PRTL_SPLAY_LINKS RtlSplay(PRTL_SPLAY_LINKS x)
+{
+    while (!RtlIsRoot(x))
+    {
+        PRTL_SPLAY_LINKS p = x->Parent;
+
+        if (!RtlIsRoot(p))
+        {
+            PRTL_SPLAY_LINKS g = p->Parent;
+
+            if ((g->LeftChild == p) == (p->LeftChild == x))
+            {
+                /* Zig-zig */
+                RtlRotate(p);
+            }
+            else
+            {
+                /* Zig-zag */
+                RtlRotate(x);
+            }
+        }
+        RtlRotate(x);
+    }
+
+    return x;
+}
+
+/*
+ * Finds node matching buffer. If there is no such node, returns the node
+ * new element would be attached to and the comparison result against it.
+ */
+static PRTL_SPLAY_LINKS RtlFindNode(PRTL_GENERIC_TABLE Table,
+                                    PVOID Buffer,
+                                    RTL_GENERIC_COMPARE_RESULTS *Result)
+{
+    PRTL_SPLAY_LINKS node = Table->TableRoot;
+
+    while (node != NULL)
+    {
+        PRTL_SPLAY_LINKS next;
+
+        *Result = Table->CompareRoutine(Table, Buffer,
+                                        TABLE_ENTRY_USER_DATA(node));
+        if (*Result == GenericLessThan)
+        {
+            next = node->LeftChild;
+        }
+        else if (*Result == GenericGreaterThan)
+        {
+            next = node->RightChild;
+        }
+        else
+        {
+            return node;
+        }
+
+        if (next == NULL)
+        {
+            return node;
+        }
+        node = next;
+    }
+
+    return NULL;
+}
+
+VOID RtlInitializeGenericTable(PRTL_GENERIC_TABLE Table,
+                               PRTL_GENERIC_COMPARE_ROUTINE CompareRoutine,
+                               PRTL_GENERIC_ALLOCATE_ROUTINE AllocateRoutine,
+                               PRTL_GENERIC_FREE_ROUTINE FreeRoutine,
+                               PVOID TableContext)
+{
+    Table->TableRoot = NULL;
+    InitializeListHead(&Table->InsertOrderList);
+    Table->OrderedPointer = &Table->InsertOrderList;
+    Table->WhichOrderedElement = 0;
+    Table->NumberGenericTableElements = 0;
+    Table->CompareRoutine = CompareRoutine;
+    Table->AllocateRoutine = AllocateRoutine;
+    Table->FreeRoutine = FreeRoutine;
+    Table->TableContext = TableContext;
+}
+
+PVOID RtlInsertElementGenericTable(PRTL_GENERIC_TABLE Table,
+                                   PVOID Buffer,
+                                   CLONG BufferSize,
+                                   PBOOLEAN NewElement)
+{
+    RTL_GENERIC_COMPARE_RESULTS result = GenericEqual;
+    PRTL_SPLAY_LINKS            parent;
+    PTABLE_ENTRY_HEADER         entry;
+
+    parent = RtlFindNode(Table, Buffer, &result);
+    if ((parent != NULL) && (result == GenericEqual))
+    {
+        Table->TableRoot = RtlSplay(parent);
+        if (NewElement != NULL)
+        {
+            *NewElement = FALSE;
+        }
+        return TABLE_ENTRY_USER_DATA(parent);
+    }
+
+    entry = (PTABLE_ENTRY_HEADER)
+        Table->AllocateRoutine(Table,
+                               FIELD_OFFSET(TABLE_ENTRY_HEADER, UserData) +
+                               BufferSize);
+    if (entry == NULL)
+    {
+        if (NewElement != NULL)
+        {
+            *NewElement = FALSE;
+        }
+        return NULL;
+    }
+
+    entry->SplayLinks.LeftChild = NULL;
+    entry->SplayLinks.RightChild = NULL;
+    if (parent == NULL)
+    {
+        entry->SplayLinks.Parent = &entry->SplayLinks;
+    }
+    else
+    {
+        entry->SplayLinks.Parent = parent;
+        if (result == GenericLessThan)
+        {
+            parent->LeftChild = &entry->SplayLinks;
+        }
+        else
+        {
+            parent->RightChild = &entry->SplayLinks;
+        }
+    }
+
+    InsertTailList(&Table->InsertOrderList, &entry->ListEntry);
+    Table->NumberGenericTableElements++;
+
+    RtlCopyMemory(&entry->UserData, Buffer, BufferSize);
+    Table->TableRoot = RtlSplay(&entry->SplayLinks);
+
+    if (NewElement != NULL)
+    {
+        *NewElement = TRUE;
+    }
+
+    return &entry->UserData;
+}
+
+BOOLEAN RtlDeleteElementGenericTable(PRTL_GENERIC_TABLE Table,
+                                     PVOID Buffer)
+{
+    RTL_GENERIC_COMPARE_RESULTS result = GenericEqual;
+    PRTL_SPLAY_LINKS            node;
+    PRTL_SPLAY_LINKS            left;
+    PRTL_SPLAY_LINKS            right;
+    PTABLE_ENTRY_HEADER         entry;
+
+    node = RtlFindNode(Table, Buffer, &result);
+    if ((node == NULL) || (result != GenericEqual))
+    {
+        if (node != NULL)
+        {
+            Table->TableRoot = RtlSplay(node);
+        }
+        return FALSE;
+    }
+
+    RtlSplay(node);
+    left = node->LeftChild;
+    right = node->RightChild;
+
+    if (left == NULL)
+    {
+        Table->TableRoot = right;
+        if (right != NULL)
+        {
+            right->Parent = right;
+        }
+    }
+    else
+    {
+        /* Join subtrees below the largest node of the left one */
+        PRTL_SPLAY_LINKS largest = left;
+
+        left->Parent = left;
+        while (largest->RightChild != NULL)
+        {
+            largest = largest->RightChild;
+        }
+        largest = RtlSplay(largest);
+        largest->RightChild = right;
+        if (right != NULL)
+        {
+            right->Parent = largest;
+        }
+        Table->TableRoot = largest;
+    }
+
+    entry = CONTAINING_RECORD(node, TABLE_ENTRY_HEADER, SplayLinks);
+    RemoveEntryList(&entry->ListEntry);
+    Table->NumberGenericTableElements--;
+    Table->OrderedPointer = &Table->InsertOrderList;
+    Table->WhichOrderedElement = 0;
+
+    Table->FreeRoutine(Table, entry);
+    return TRUE;
+}
+
+PVOID RtlLookupElementGenericTable(PRTL_GENERIC_TABLE Table,
+                                   PVOID Buffer)
+{
+    RTL_GENERIC_COMPARE_RESULTS result = GenericEqual;
+    PRTL_SPLAY_LINKS            node;
+
+    node = RtlFindNode(Table, Buffer, &result);
+    if (node == NULL)
+    {
+        return NULL;
+    }
+
+    Table->TableRoot = RtlSplay(node);
+    return (result == GenericEqual) ? TABLE_ENTRY_USER_DATA(node) : NULL;
+}
+
+/*
+ * Returns I-th element in insertion order. Walks from the last returned
+ * element so sequential access is cheap.
+ */
+PVOID RtlGetElementGenericTable(PRTL_GENERIC_TABLE Table, ULONG I)
+{
+    PLIST_ENTRY entry;
+    ULONG       current;
+    ULONG       wanted;
+
+    if (I >= Table->NumberGenericTableElements)
+    {
+        return NULL;
+    }
+
+    /* WhichOrderedElement is 1 based, 0 means OrderedPointer is list head */
+    wanted = I + 1;
+    entry = Table->OrderedPointer;
+    current = Table->WhichOrderedElement;
+
+    while (current < wanted)
+    {
+        entry = entry->Flink;
+        current++;
+    }
+    while (current > wanted)
+    {
+        entry = entry->Blink;
+        current--;
+    }
+
+    Table->OrderedPointer = entry;
+    Table->WhichOrderedElement = wanted;
+
+    return &CONTAINING_RECORD(entry, TABLE_ENTRY_HEADER, ListEntry)->UserData;
+}
+
+ULONG RtlNumberGenericTableElements(PRTL_GENERIC_TABLE Table)
+{
+    return Table->NumberGenericTableElements;
+}
+
+BOOLEAN RtlIsGenericTableEmpty(PRTL_GENERIC_TABLE Table)
+{
+    return (Table->TableRoot == NULL) ? TRUE : FALSE;
+}
+
+PVOID RtlEnumerateGenericTableWithoutSplaying(PRTL_GENERIC_TABLE Table,
+                                              PVOID *RestartKey)
+{
+    PRTL_SPLAY_LINKS node;
+
+    if (*RestartKey == NULL)
+    {
+        /* Smallest element */
+        node = Table->TableRoot;
+        if (node == NULL)
+        {
+            return NULL;
+        }
+        while (node->LeftChild != NULL)
+        {
+            node = node->LeftChild;
+        }
+    }
+    else
+    {
+        /* In order successor */
+        node = (PRTL_SPLAY_LINKS)*RestartKey;
+        if (node->RightChild != NULL)
+        {
+            node = node->RightChild;
+            while (node->LeftChild != NULL)
+            {
+                node = node->LeftChild;
+            }
+        }
+        else
+        {
+            while (!RtlIsRoot(node) && (node->Parent->RightChild == node))
+            {
+                node = node->Parent;
+            }
+            if (RtlIsRoot(node))
+            {
+                return NULL;
+            }
+            node = node->Parent;
+        }
+    }
+
+    *RestartKey = node;
+    return TABLE_ENTRY_USER_DATA(node);
+}
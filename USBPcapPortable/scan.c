@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * usbpcap-scan - filters DLT_USBPCAP capture without index using the
+ * column scanner. Prints offsets of matching records, counts them or
+ * copies them to new pcap file.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pcapscan.h"
+
+#define NSEC_PER_SEC  1000000000ULL
+
+static const char *transfer_names[] =
+{
+    "isochronous", "interrupt", "control", "bulk"
+};
+
+static int parse_transfer(const char *name)
+{
+    int transfer;
+
+    for (transfer = 0; transfer < 4; transfer++)
+    {
+        if (strcmp(transfer_names[transfer], name) == 0)
+        {
+            return transfer;
+        }
+    }
+    if (strcmp(name, "marker") == 0)
+    {
+        return USBPCAP_TRANSFER_FILTER_MARKER;
+    }
+    if (strcmp(name, "irp-info") == 0)
+    {
+        return USBPCAP_TRANSFER_IRP_INFO;
+    }
+    if (strcmp(name, "unknown") == 0)
+    {
+        return USBPCAP_TRANSFER_UNKNOWN;
+    }
+    return -1;
+}
+
+static UINT64 parse_seconds(const char *text)
+{
+    return (UINT64)(strtod(text, NULL) * NSEC_PER_SEC + 0.5);
+}
+
+static double elapsed(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <capture.pcap>\n"
+            "      --bus <n>           root hub number\n"
+            "  -d, --device <n>        device address\n"
+            "  -e, --endpoint <n>      endpoint address with direction bit\n"
+            "  -t, --transfer <type>   isochronous, interrupt, control, bulk,\n"
+            "                          marker, irp-info or unknown\n"
+            "  -E, --errors            records with USBD error status\n"
+            "  -I, --irp <id>          records of single IRP\n"
+            "  -f, --from <s>          seconds since the first record\n"
+            "  -T, --to <s>            seconds since the first record\n"
+            "  -c, --count             print number of matching records only\n"
+            "  -w, --write <file>      write matching records to pcap file\n"
+            "  -v, --verbose           print scan rate to stderr\n"
+            "\n"
+            "Without -c and -w offsets of matching records are printed.\n",
+            name);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] =
+    {
+        {"bus",      required_argument, NULL, 'b'},
+        {"device",   required_argument, NULL, 'd'},
+        {"endpoint", required_argument, NULL, 'e'},
+        {"transfer", required_argument, NULL, 't'},
+        {"errors",   no_argument,       NULL, 'E'},
+        {"irp",      required_argument, NULL, 'I'},
+        {"from",     required_argument, NULL, 'f'},
+        {"to",       required_argument, NULL, 'T'},
+        {"count",    no_argument,       NULL, 'c'},
+        {"write",    required_argument, NULL, 'w'},
+        {"verbose",  no_argument,       NULL, 'v'},
+        {"help",     no_argument,       NULL, 'h'},
+        {NULL,       0,                 NULL, 0}
+    };
+    PCAP_FILE        file;
+    PCAP_RECORD      record;
+    SCANNER          scanner;
+    SCAN_FILTER      filter;
+    SCAN_BATCH      *batch;
+    UINT64           mask[SCAN_BATCH_RECORDS / 64];
+    UINT64           from = 0;
+    UINT64           to = ~0ULL;
+    UINT64           records = 0;
+    UINT64           matches = 0;
+    struct timespec  start;
+    const char      *outputName = NULL;
+    FILE            *output = NULL;
+    BOOLEAN          count = FALSE;
+    BOOLEAN          verbose = FALSE;
+    char             error[256];
+    double           seconds;
+    int              opt;
+
+    scan_filter_init(&filter);
+
+    while ((opt = getopt_long(argc, argv, "d:e:t:EI:f:T:cw:vh",
+                              options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'b':
+                filter.bus = (int)strtol(optarg, NULL, 0);
+                break;
+            case 'd':
+                filter.device = (int)strtol(optarg, NULL, 0);
+                break;
+            case 'e':
+                filter.endpoint = (int)strtol(optarg, NULL, 0) & 0xFF;
+                break;
+            case 't':
+                filter.transfer = parse_transfer(optarg);
+                if (filter.transfer < 0)
+                {
+                    fprintf(stderr, "Unknown transfer type %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'E':
+                filter.errors = TRUE;
+                break;
+            case 'I':
+                filter.hasIrp = TRUE;
+                filter.irpId = strtoull(optarg, NULL, 0);
+                break;
+            case 'f':
+                from = parse_seconds(optarg);
+                break;
+            case 'T':
+                to = parse_seconds(optarg);
+                break;
+            case 'c':
+                count = TRUE;
+                break;
+            case 'w':
+                outputName = optarg;
+                break;
+            case 'v':
+                verbose = TRUE;
+                break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (pcap_open(&file, argv[optind], error, sizeof(error)) != 0)
+    {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+    }
+    if (file.network != DLT_USBPCAP)
+    {
+        fprintf(stderr, "%s: link type %u is not DLT_USBPCAP\n",
+                argv[optind], file.network);
+        pcap_close(&file);
+        return 1;
+    }
+
+    /* Time range is relative to the first record */
+    if (pcap_read_record(&file, PCAP_FIRST_RECORD, &record) == 1)
+    {
+        filter.from = (from == 0) ? 0 : record.timestamp + from;
+        filter.to = (to == ~0ULL) ? ~0ULL : record.timestamp + to;
+    }
+
+    if (outputName != NULL)
+    {
+        output = fopen(outputName, "wb");
+        if (output == NULL)
+        {
+            fprintf(stderr, "%s: %s\n", outputName, strerror(errno));
+            pcap_close(&file);
+            return 1;
+        }
+        fwrite(file.data, 1, sizeof(pcap_hdr_t), output);
+    }
+
+    batch = (SCAN_BATCH *)malloc(sizeof(SCAN_BATCH));
+    if (batch == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    scan_init(&scanner, &file, PCAP_FIRST_RECORD, file.size);
+    while (scan_next(&scanner, batch) > 0)
+    {
+        UINT32 word;
+
+        records += batch->count;
+        matches += scan_filter(batch, &filter, mask);
+        if (count)
+        {
+            continue;
+        }
+
+        for (word = 0; word < SCAN_BATCH_RECORDS / 64; word++)
+        {
+            UINT64 bits = mask[word];
+
+            while (bits != 0)
+            {
+                UINT32 i = word * 64 + (UINT32)__builtin_ctzll(bits);
+
+                bits &= bits - 1;
+                if (output != NULL)
+                {
+                    fwrite(&file.data[batch->offset[i]], 1,
+                           sizeof(pcaprec_hdr_t) + batch->inclLen[i], output);
+                }
+                else
+                {
+                    printf("%llu\n", (unsigned long long)batch->offset[i]);
+                }
+            }
+        }
+    }
+    seconds = elapsed(&start);
+
+    if (scanner.corrupted)
+    {
+        fprintf(stderr, "%s: invalid record at offset %llu, "
+                "records after it are not scanned\n", argv[optind],
+                (unsigned long long)scanner.offset);
+    }
+    if (count)
+    {
+        printf("%llu\n", (unsigned long long)matches);
+    }
+    if (verbose)
+    {
+        fprintf(stderr, "%llu records, %llu matching, %.3f s, "
+                "%.1f Mrecords/s, %.1f MiB/s\n",
+                (unsigned long long)records, (unsigned long long)matches,
+                seconds, records / seconds / 1e6,
+                scanner.offset / seconds / (1024.0 * 1024.0));
+    }
+
+    free(batch);
+    if ((output != NULL) && (fclose(output) != 0))
+    {
+        fprintf(stderr, "%s: %s\n", outputName, strerror(errno));
+        pcap_close(&file);
+        return 1;
+    }
+    pcap_close(&file);
+    return scanner.corrupted ? 1 : 0;
+}
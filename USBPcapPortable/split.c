@@ -0,0 +1,453 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * usbpcap-split - writes records of every device of DLT_USBPCAP capture
+ * to separate pcap file, so capture can be shared without the other
+ * devices connected to the same root hub.
+ *
+ * First pass over record headers finds devices and the amount of data
+ * each of them has. Devices are then assigned to worker threads so that
+ * every thread writes about the same amount of data. Each thread walks
+ * the whole mapped capture and copies records of its devices through
+ * per device buffered writers, so memory use is bounded by the writer
+ * buffers regardless of capture size.
+ */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pcapscan.h"
+
+#define MAX_THREADS          64
+#define MAX_DEVICES          1024
+#define DEVICE_SLOTS         (2 * MAX_DEVICES)
+#define DEFAULT_BUFFER_SIZE  (256 * 1024)
+
+typedef struct _DEVICE
+{
+    USHORT       bus;
+    USHORT       device;
+    BOOLEAN      selected;
+    int          owner;      /* worker thread */
+    UINT64       records;
+    UINT64       bytes;
+    char         name[4096 + 32];  /* prefix-bus-device.pcap */
+    PCAP_WRITER  writer;
+} DEVICE;
+
+typedef struct _DEVICE_TABLE
+{
+    DEVICE  *devices;
+    UINT32   count;
+    INT16    slots[DEVICE_SLOTS];  /* device index + 1, 0 if empty */
+} DEVICE_TABLE;
+
+typedef struct _WORKER
+{
+    pthread_t          thread;
+    int                index;
+    const PCAP_FILE   *file;
+    DEVICE_TABLE      *table;
+    UINT64             bytes;       /* assigned */
+    BOOLEAN            corrupted;
+} WORKER;
+
+static UINT32 device_slot(USHORT bus, USHORT device)
+{
+    UINT32 key = ((UINT32)bus << 16) | device;
+
+    return (UINT32)((key * 0x9E3779B97F4A7C15ULL) >> 40) & (DEVICE_SLOTS - 1);
+}
+
+/* Returns device index, or -1 if the device is not in the table */
+static int device_find(const DEVICE_TABLE *table, USHORT bus, USHORT device)
+{
+    UINT32 slot = device_slot(bus, device);
+
+    while (table->slots[slot] != 0)
+    {
+        const DEVICE *entry = &table->devices[table->slots[slot] - 1];
+
+        if ((entry->bus == bus) && (entry->device == device))
+        {
+            return table->slots[slot] - 1;
+        }
+        slot = (slot + 1) & (DEVICE_SLOTS - 1);
+    }
+    return -1;
+}
+
+static int device_add(DEVICE_TABLE *table, USHORT bus, USHORT device)
+{
+    UINT32  slot = device_slot(bus, device);
+    DEVICE *entry;
+
+    if (table->count == MAX_DEVICES)
+    {
+        return -1;
+    }
+    while (table->slots[slot] != 0)
+    {
+        slot = (slot + 1) & (DEVICE_SLOTS - 1);
+    }
+
+    entry = &table->devices[table->count];
+    memset(entry, 0, sizeof(DEVICE));
+    entry->bus = bus;
+    entry->device = device;
+    table->slots[slot] = (INT16)(++table->count);
+
+    return (int)table->count - 1;
+}
+
+static int compare_bytes(const void *a, const void *b)
+{
+    const DEVICE *x = *(const DEVICE * const *)a;
+    const DEVICE *y = *(const DEVICE * const *)b;
+
+    if (x->bytes != y->bytes)
+    {
+        return (x->bytes > y->bytes) ? -1 : 1;
+    }
+    return (x < y) ? -1 : 1;
+}
+
+/* Largest devices first, each to the least loaded thread */
+static void assign_devices(DEVICE_TABLE *table, WORKER *workers,
+                           int numberOfWorkers)
+{
+    DEVICE  *sorted[MAX_DEVICES];
+    UINT32   count = 0;
+    UINT32   i;
+    int      k;
+
+    for (i = 0; i < table->count; i++)
+    {
+        if (table->devices[i].selected)
+        {
+            sorted[count++] = &table->devices[i];
+        }
+    }
+    qsort(sorted, count, sizeof(DEVICE *), compare_bytes);
+
+    for (i = 0; i < count; i++)
+    {
+        int best = 0;
+
+        for (k = 1; k < numberOfWorkers; k++)
+        {
+            if (workers[k].bytes < workers[best].bytes)
+            {
+                best = k;
+            }
+        }
+        sorted[i]->owner = best;
+        workers[best].bytes += sorted[i]->bytes;
+    }
+}
+
+static void *worker_thread(void *arg)
+{
+    WORKER       *worker = (WORKER *)arg;
+    const PCAP_FILE *file = worker->file;
+    SCANNER       scanner;
+    SCAN_BATCH   *batch;
+    UINT32        i;
+
+    batch = (SCAN_BATCH *)malloc(sizeof(SCAN_BATCH));
+    if (batch == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    scan_init(&scanner, file, PCAP_FIRST_RECORD, file->size);
+    while (scan_next(&scanner, batch) > 0)
+    {
+        for (i = 0; i < batch->count; i++)
+        {
+            DEVICE *device;
+            int     index;
+
+            if ((batch->headerLen[i] == 0) ||
+                (batch->transfer[i] == USBPCAP_TRANSFER_FILTER_MARKER))
+            {
+                continue;
+            }
+            index = device_find(worker->table, batch->bus[i], batch->device[i]);
+            if (index < 0)
+            {
+                continue;
+            }
+            device = &worker->table->devices[index];
+            if (!device->selected || (device->owner != worker->index))
+            {
+                continue;
+            }
+
+            pcap_writer_record(&device->writer, batch->timestamp[i],
+                               batch->inclLen[i], batch->origLen[i]);
+            pcap_writer_write(&device->writer,
+                              &file->data[batch->offset[i] + sizeof(pcaprec_hdr_t)],
+                              batch->inclLen[i]);
+        }
+    }
+    worker->corrupted = scanner.corrupted;
+
+    free(batch);
+    return NULL;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <capture.pcap>\n"
+            "  -o, --prefix <prefix>   output files are <prefix>-<bus>-<device>.pcap,\n"
+            "                          default is the capture name without .pcap\n"
+            "  -d, --device <bus:dev>  write only this device, can be repeated\n"
+            "  -j, --threads <n>       worker threads, default: all cores\n"
+            "  -B, --buffer <KiB>      write buffer per device (default %u)\n"
+            "  -v, --verbose           print written files\n",
+            name, DEFAULT_BUFFER_SIZE / 1024);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] =
+    {
+        {"prefix",  required_argument, NULL, 'o'},
+        {"device",  required_argument, NULL, 'd'},
+        {"threads", required_argument, NULL, 'j'},
+        {"buffer",  required_argument, NULL, 'B'},
+        {"verbose", no_argument,       NULL, 'v'},
+        {"help",    no_argument,       NULL, 'h'},
+        {NULL,      0,                 NULL, 0}
+    };
+    PCAP_FILE      file;
+    SCANNER        scanner;
+    SCAN_BATCH    *batch;
+    DEVICE_TABLE   table;
+    WORKER         workers[MAX_THREADS];
+    UINT32         selected[MAX_DEVICES];
+    UINT32         numberOfSelected = 0;
+    const char    *prefixArg = NULL;
+    char           prefix[4096];
+    char           error[256];
+    size_t         bufferSize = DEFAULT_BUFFER_SIZE;
+    BOOLEAN        verbose = FALSE;
+    BOOLEAN        failed = FALSE;
+    long           threads;
+    int            numberOfWorkers;
+    UINT32         i;
+    int            opt;
+    int            k;
+
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((opt = getopt_long(argc, argv, "o:d:j:B:vh", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'o':
+                prefixArg = optarg;
+                break;
+            case 'd':
+            {
+                unsigned bus;
+                unsigned device;
+
+                if ((sscanf(optarg, "%u:%u", &bus, &device) != 2) ||
+                    (bus > 0xFFFF) || (device > 0xFFFF) ||
+                    (numberOfSelected == MAX_DEVICES))
+                {
+                    fprintf(stderr, "Invalid device %s, use bus:device\n", optarg);
+                    return 1;
+                }
+                selected[numberOfSelected++] = (bus << 16) | device;
+                break;
+            }
+            case 'j':
+                threads = strtol(optarg, NULL, 0);
+                break;
+            case 'B':
+                bufferSize = strtoul(optarg, NULL, 0) * 1024;
+                break;
+            case 'v':
+                verbose = TRUE;
+                break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    /* Record headers and USBPcap headers must fit in the buffer */
+    bufferSize = max(bufferSize, (size_t)(64 * 1024));
+
+    if (prefixArg == NULL)
+    {
+        size_t length = strlen(argv[optind]);
+
+        if ((length > 5) && (strcmp(&argv[optind][length - 5], ".pcap") == 0))
+        {
+            length -= 5;
+        }
+        snprintf(prefix, sizeof(prefix), "%.*s", (int)length, argv[optind]);
+    }
+    else
+    {
+        snprintf(prefix, sizeof(prefix), "%s", prefixArg);
+    }
+
+    if (pcap_open(&file, argv[optind], error, sizeof(error)) != 0)
+    {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+    }
+    if (file.network != DLT_USBPCAP)
+    {
+        fprintf(stderr, "%s: link type %u is not DLT_USBPCAP\n",
+                argv[optind], file.network);
+        pcap_close(&file);
+        return 1;
+    }
+
+    memset(&table, 0, sizeof(table));
+    table.devices = (DEVICE *)calloc(MAX_DEVICES, sizeof(DEVICE));
+    batch = (SCAN_BATCH *)malloc(sizeof(SCAN_BATCH));
+    if ((table.devices == NULL) || (batch == NULL))
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    /* Find devices and how much data each of them has */
+    scan_init(&scanner, &file, PCAP_FIRST_RECORD, file.size);
+    while (scan_next(&scanner, batch) > 0)
+    {
+        for (i = 0; i < batch->count; i++)
+        {
+            int index;
+
+            if ((batch->headerLen[i] == 0) ||
+                (batch->transfer[i] == USBPCAP_TRANSFER_FILTER_MARKER))
+            {
+                continue;
+            }
+            index = device_find(&table, batch->bus[i], batch->device[i]);
+            if (index < 0)
+            {
+                index = device_add(&table, batch->bus[i], batch->device[i]);
+                if (index < 0)
+                {
+                    fprintf(stderr, "%s: more than %u devices\n",
+                            argv[optind], MAX_DEVICES);
+                    return 1;
+                }
+            }
+            table.devices[index].records++;
+            table.devices[index].bytes += batch->inclLen[i];
+        }
+    }
+    free(batch);
+    if (scanner.corrupted)
+    {
+        fprintf(stderr, "%s: invalid record at offset %llu, "
+                "records after it are not written\n", argv[optind],
+                (unsigned long long)scanner.offset);
+    }
+
+    for (i = 0; i < table.count; i++)
+    {
+        DEVICE *device = &table.devices[i];
+        UINT32  j;
+
+        device->selected = (numberOfSelected == 0) ? TRUE : FALSE;
+        for (j = 0; j < numberOfSelected; j++)
+        {
+            if (selected[j] == (((UINT32)device->bus << 16) | device->device))
+            {
+                device->selected = TRUE;
+            }
+        }
+        if (!device->selected)
+        {
+            continue;
+        }
+
+        snprintf(device->name, sizeof(device->name), "%s-%u-%u.pcap",
+                 prefix, device->bus, device->device);
+        if (pcap_writer_open(&device->writer, device->name, bufferSize,
+                             error, sizeof(error)) != 0)
+        {
+            fprintf(stderr, "%s\n", error);
+            return 1;
+        }
+        pcap_writer_header(&device->writer, file.nanoseconds, file.snaplen,
+                           file.network);
+    }
+
+    numberOfWorkers = (int)min(max(threads, 1L), (long)MAX_THREADS);
+    numberOfWorkers = (int)min((UINT32)numberOfWorkers, max(table.count, 1U));
+    memset(workers, 0, sizeof(workers));
+    assign_devices(&table, workers, numberOfWorkers);
+
+    for (k = 0; k < numberOfWorkers; k++)
+    {
+        workers[k].index = k;
+        workers[k].file = &file;
+        workers[k].table = &table;
+        pthread_create(&workers[k].thread, NULL, worker_thread, &workers[k]);
+    }
+    for (k = 0; k < numberOfWorkers; k++)
+    {
+        pthread_join(workers[k].thread, NULL);
+    }
+
+    for (i = 0; i < table.count; i++)
+    {
+        DEVICE *device = &table.devices[i];
+
+        if (!device->selected)
+        {
+            continue;
+        }
+        if (pcap_writer_close(&device->writer) != 0)
+        {
+            fprintf(stderr, "%s: write failed\n", device->name);
+            failed = TRUE;
+        }
+        else if (verbose)
+        {
+            fprintf(stderr, "%s: %llu records, %llu bytes\n", device->name,
+                    (unsigned long long)device->records,
+                    (unsigned long long)device->bytes);
+        }
+    }
+    for (i = 0; i < numberOfSelected; i++)
+    {
+        if (device_find(&table, (USHORT)(selected[i] >> 16),
+                        (USHORT)selected[i]) < 0)
+        {
+            fprintf(stderr, "%s: no records of device %u:%u\n", argv[optind],
+                    selected[i] >> 16, selected[i] & 0xFFFF);
+        }
+    }
+
+    free(table.devices);
+    pcap_close(&file);
+    return (failed || scanner.corrupted) ? 1 : 0;
+}
@@ -0,0 +1,1020 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * usbpcap-storage - reassembles USB mass storage commands from bulk
+ * records of DLT_USBPCAP capture and reports per SCSI command latency,
+ * queue depth, throughput, gaps between commands and whether the host
+ * or the device keeps the other waiting.
+ *
+ * Bulk-Only Transport commands are CBW, optional data and CSW matched
+ * by the CBW tag. USB Attached SCSI commands are command IU on command
+ * pipe and sense (or response) IU on status pipe, matched by IU tag.
+ * UAS pipes are not known without the pipe usage descriptors, so the
+ * pipe carrying the first IU is taken as command or status pipe and
+ * other bulk endpoints of the device as data pipes.
+ *
+ * Capture is read in single pass, state is kept per device only.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pcapscan.h"
+
+#define MAX_DEVICES          64
+#define MAX_SELECTED         64
+#define URB_SLOTS            1024   /* bulk URBs pending per device */
+#define UAS_TAGS             65536
+
+#define NSEC_PER_SEC         1000000000ULL
+#define NSEC_PER_USEC        1000ULL
+
+/* Log-linear histogram with 32 buckets per power of two, the same as
+ * usbpcap-latency uses.
+ */
+#define LATENCY_SUB_BITS     5
+#define LATENCY_SUB          (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS      ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB)
+
+/* Bulk-Only Transport wrappers */
+#define BOT_CBW_SIGNATURE    0x43425355  /* USBC */
+#define BOT_CSW_SIGNATURE    0x53425355  /* USBS */
+#define BOT_CBW_LENGTH       31
+#define BOT_CSW_LENGTH       13
+
+/* USB Attached SCSI information units */
+#define UAS_COMMAND_IU       0x01
+#define UAS_SENSE_IU         0x03
+#define UAS_RESPONSE_IU      0x04
+#define UAS_TASK_MGMT_IU     0x05
+#define UAS_READ_READY_IU    0x06
+#define UAS_WRITE_READY_IU   0x07
+
+typedef enum _PROTOCOL
+{
+    PROTOCOL_UNKNOWN,
+    PROTOCOL_BOT,
+    PROTOCOL_UAS
+} PROTOCOL;
+
+typedef enum _PIPE
+{
+    PIPE_UNKNOWN,
+    PIPE_COMMAND,
+    PIPE_STATUS,
+    PIPE_DATA
+} PIPE;
+
+typedef struct _COMMAND
+{
+    UINT64   start;
+    UINT64   bytes;    /* BOT only, UAS data cannot be told apart */
+    UINT32   tag;      /* BOT only, UAS tag is the index */
+    UCHAR    opcode;
+    BOOLEAN  active;
+} COMMAND;
+
+typedef struct _PENDING_URB
+{
+    UINT64   irpId;
+    UINT32   length;   /* OUT data submitted */
+    BOOLEAN  used;
+} PENDING_URB;
+
+typedef struct _LATENCY
+{
+    UINT64   count;
+    UINT64   sum;
+    UINT64   max;
+    UINT64  *histogram;
+} LATENCY;
+
+typedef struct _OPCODE_STATS
+{
+    LATENCY  latency;
+    UINT64   failed;
+    UINT64   bytes;
+} OPCODE_STATS;
+
+/* Time of the device is spent in one of three states: no command
+ * outstanding (idle, host did not send the next command), command
+ * outstanding with bulk URB pending (device), and command outstanding
+ * without any URB pending (host did not submit the next transfer yet).
+ */
+typedef struct _TIMES
+{
+    UINT64   idle;
+    UINT64   device;
+    UINT64   host;
+    UINT64   depth;    /* queue depth integrated over time */
+    UINT32   maxDepth;
+    UINT64   commands;
+    UINT64   bytes;
+} TIMES;
+
+typedef struct _DEVICE
+{
+    USHORT        bus;
+    USHORT        device;
+    PROTOCOL      protocol;
+    UCHAR         pipes[32];     /* PIPE by endpoint number and direction */
+
+    COMMAND       bot;
+    COMMAND      *uas;           /* UAS_TAGS entries */
+    UINT32        depth;
+
+    PENDING_URB   urbs[URB_SLOTS];
+    UINT32        pending;
+    UINT64        untracked;     /* URBs not tracked, table full */
+
+    UINT64        first;
+    UINT64        last;          /* time accounted up to */
+    UINT64        idleSince;     /* valid when depth is 0 */
+    BOOLEAN       hadCommand;
+
+    TIMES         total;
+    TIMES         interval;
+    UINT64        intervalStart;
+
+    UINT64        bytesIn;
+    UINT64        bytesOut;
+    UINT64        failed;
+    UINT64        lost;          /* commands without status */
+    UINT64        stalls;        /* bulk URBs completed with USBD error */
+    UINT64        unmatched;     /* status without command */
+    LATENCY       gaps;
+    OPCODE_STATS  opcodes[256];
+} DEVICE;
+
+typedef struct _ANALYZER
+{
+    DEVICE   *devices[MAX_DEVICES];
+    UINT32    count;
+    UINT32    selected[MAX_SELECTED];
+    UINT32    numberOfSelected;
+    UINT64    origin;        /* timestamp of the first record */
+    UINT64    interval;
+    FILE     *timeline;
+} ANALYZER;
+
+static unsigned latency_bucket(UINT64 latency)
+{
+    unsigned exponent;
+
+    if (latency < LATENCY_SUB)
+    {
+        return (unsigned)latency;
+    }
+
+    exponent = 63 - __builtin_clzll(latency);
+    return (exponent - LATENCY_SUB_BITS + 1) * LATENCY_SUB +
+           (unsigned)((latency >> (exponent - LATENCY_SUB_BITS)) &
+                      (LATENCY_SUB - 1));
+}
+
+/* Returns value in the middle of the bucket */
+static UINT64 latency_bucket_value(unsigned bucket)
+{
+    unsigned exponent;
+    UINT64   low;
+
+    if (bucket < LATENCY_SUB)
+    {
+        return bucket;
+    }
+
+    exponent = bucket / LATENCY_SUB + LATENCY_SUB_BITS - 1;
+    low = (UINT64)(LATENCY_SUB + bucket % LATENCY_SUB) <<
+          (exponent - LATENCY_SUB_BITS);
+    return low + ((1ULL << (exponent - LATENCY_SUB_BITS)) >> 1);
+}
+
+static void latency_add(LATENCY *latency, UINT64 value)
+{
+    if (latency->histogram == NULL)
+    {
+        latency->histogram = (UINT64 *)calloc(LATENCY_BUCKETS, sizeof(UINT64));
+        if (latency->histogram == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    latency->count++;
+    latency->sum += value;
+    latency->max = max(latency->max, value);
+    latency->histogram[latency_bucket(value)]++;
+}
+
+static UINT64 latency_percentile(const LATENCY *latency, double percent)
+{
+    UINT64   rank = (UINT64)(latency->count * percent / 100.0 + 0.5);
+    UINT64   seen = 0;
+    unsigned i;
+
+    if (latency->count == 0)
+    {
+        return 0;
+    }
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += latency->histogram[i];
+        if (seen >= rank)
+        {
+            return min(latency_bucket_value(i), latency->max);
+        }
+    }
+    return latency->max;
+}
+
+static UINT32 urb_slot(UINT64 irpId)
+{
+    return (UINT32)((irpId * 0x9E3779B97F4A7C15ULL) >> 54) & (URB_SLOTS - 1);
+}
+
+static PENDING_URB *urb_find(DEVICE *device, UINT64 irpId)
+{
+    UINT32 slot = urb_slot(irpId);
+
+    while (device->urbs[slot].used)
+    {
+        if (device->urbs[slot].irpId == irpId)
+        {
+            return &device->urbs[slot];
+        }
+        slot = (slot + 1) & (URB_SLOTS - 1);
+    }
+    return NULL;
+}
+
+static void urb_insert(DEVICE *device, UINT64 irpId, UINT32 length)
+{
+    UINT32 slot = urb_slot(irpId);
+
+    if (device->pending >= URB_SLOTS / 8 * 7)
+    {
+        device->untracked++;
+        return;
+    }
+    while (device->urbs[slot].used)
+    {
+        if (device->urbs[slot].irpId == irpId)
+        {
+            /* Submit seen twice, completion was lost */
+            device->urbs[slot].length = length;
+            return;
+        }
+        slot = (slot + 1) & (URB_SLOTS - 1);
+    }
+    device->urbs[slot].irpId = irpId;
+    device->urbs[slot].length = length;
+    device->urbs[slot].used = TRUE;
+    device->pending++;
+}
+
+static void urb_remove(DEVICE *device, PENDING_URB *urb)
+{
+    UINT32 hole = (UINT32)(urb - device->urbs);
+    UINT32 slot = hole;
+
+    /* Move back entries of the probe sequence so no lookup ends early */
+    for (;;)
+    {
+        UINT32 home;
+
+        slot = (slot + 1) & (URB_SLOTS - 1);
+        if (!device->urbs[slot].used)
+        {
+            break;
+        }
+
+        home = urb_slot(device->urbs[slot].irpId);
+        if (((slot - home) & (URB_SLOTS - 1)) >= ((slot - hole) & (URB_SLOTS - 1)))
+        {
+            device->urbs[hole] = device->urbs[slot];
+            hole = slot;
+        }
+    }
+    device->urbs[hole].used = FALSE;
+    device->pending--;
+}
+
+static unsigned pipe_index(UCHAR endpoint)
+{
+    return (endpoint & 0x0F) | ((endpoint & 0x80) ? 0x10 : 0);
+}
+
+static const char *bottleneck(const TIMES *times)
+{
+    return (times->device >= times->host + times->idle) ? "device" : "host";
+}
+
+static void interval_flush(ANALYZER *analyzer, DEVICE *device)
+{
+    TIMES       *times = &device->interval;
+    const double seconds = (double)analyzer->interval / NSEC_PER_SEC;
+    const UINT64 span = times->idle + times->device + times->host;
+
+    if ((analyzer->timeline != NULL) &&
+        ((times->commands != 0) || (times->device != 0) || (times->host != 0)))
+    {
+        fprintf(analyzer->timeline, "%u,%u,%.6f,%llu,%.3f,%.2f,%u,%.1f,%.1f,%.1f,%s\n",
+                device->bus, device->device,
+                (double)(device->intervalStart - analyzer->origin) / NSEC_PER_SEC,
+                (unsigned long long)times->commands,
+                times->bytes / seconds / 1e6,
+                (span != 0) ? (double)times->depth / span : 0.0,
+                times->maxDepth,
+                (span != 0) ? 100.0 * times->device / span : 0.0,
+                (span != 0) ? 100.0 * times->host / span : 0.0,
+                (span != 0) ? 100.0 * times->idle / span : 0.0,
+                bottleneck(times));
+    }
+
+    memset(times, 0, sizeof(TIMES));
+    times->maxDepth = device->depth;
+}
+
+static void times_add(TIMES *times, const DEVICE *device, UINT64 elapsed)
+{
+    times->depth += device->depth * elapsed;
+    if (device->depth == 0)
+    {
+        times->idle += elapsed;
+    }
+    else if (device->pending != 0)
+    {
+        times->device += elapsed;
+    }
+    else
+    {
+        times->host += elapsed;
+    }
+}
+
+/* Accounts time from the last event up to timestamp to the state the
+ * device was in, closing timeline intervals on the way.
+ */
+static void device_advance(ANALYZER *analyzer, DEVICE *device, UINT64 timestamp)
+{
+    if (timestamp <= device->last)
+    {
+        return;
+    }
+
+    while (timestamp >= device->intervalStart + analyzer->interval)
+    {
+        UINT64 end = device->intervalStart + analyzer->interval;
+
+        times_add(&device->total, device, end - device->last);
+        times_add(&device->interval, device, end - device->last);
+        device->last = end;
+        interval_flush(analyzer, device);
+        device->intervalStart = end;
+
+        if (device->depth == 0)
+        {
+            /* Nothing to report until the next command, skip idle
+             * intervals at once.
+             */
+            end = analyzer->origin +
+                  (timestamp - analyzer->origin) / analyzer->interval *
+                  analyzer->interval;
+            times_add(&device->total, device, end - device->last);
+            device->last = end;
+            device->intervalStart = end;
+        }
+    }
+
+    times_add(&device->total, device, timestamp - device->last);
+    times_add(&device->interval, device, timestamp - device->last);
+    device->last = timestamp;
+}
+
+static DEVICE *device_find(ANALYZER *analyzer, USHORT bus, USHORT address)
+{
+    UINT32 i;
+
+    for (i = 0; i < analyzer->count; i++)
+    {
+        if ((analyzer->devices[i]->bus == bus) &&
+            (analyzer->devices[i]->device == address))
+        {
+            return analyzer->devices[i];
+        }
+    }
+    return NULL;
+}
+
+static DEVICE *device_add(ANALYZER *analyzer, USHORT bus, USHORT address,
+                          PROTOCOL protocol, UINT64 timestamp)
+{
+    DEVICE *device;
+    UINT32  i;
+
+    if (analyzer->numberOfSelected != 0)
+    {
+        for (i = 0; i < analyzer->numberOfSelected; i++)
+        {
+            if (analyzer->selected[i] == (((UINT32)bus << 16) | address))
+            {
+                break;
+            }
+        }
+        if (i == analyzer->numberOfSelected)
+        {
+            return NULL;
+        }
+    }
+    if (analyzer->count == MAX_DEVICES)
+    {
+        return NULL;
+    }
+
+    device = (DEVICE *)calloc(1, sizeof(DEVICE));
+    if ((device != NULL) && (protocol == PROTOCOL_UAS))
+    {
+        device->uas = (COMMAND *)calloc(UAS_TAGS, sizeof(COMMAND));
+    }
+    if ((device == NULL) || ((protocol == PROTOCOL_UAS) && (device->uas == NULL)))
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    device->bus = bus;
+    device->device = address;
+    device->protocol = protocol;
+    device->first = timestamp;
+    device->last = timestamp;
+    device->intervalStart = analyzer->origin +
+                            (timestamp - analyzer->origin) / analyzer->interval *
+                            analyzer->interval;
+    analyzer->devices[analyzer->count++] = device;
+    return device;
+}
+
+static void command_start(DEVICE *device, COMMAND *command, UCHAR opcode,
+                          UINT64 timestamp)
+{
+    if (command->active)
+    {
+        /* Host reused the tag, status of the previous command was lost */
+        device->lost++;
+        device->depth--;
+    }
+    else if (device->depth == 0 && device->hadCommand)
+    {
+        latency_add(&device->gaps, timestamp - device->idleSince);
+    }
+
+    command->start = timestamp;
+    command->bytes = 0;
+    command->opcode = opcode;
+    command->active = TRUE;
+    device->hadCommand = TRUE;
+    device->depth++;
+    device->total.maxDepth = max(device->total.maxDepth, device->depth);
+    device->interval.maxDepth = max(device->interval.maxDepth, device->depth);
+}
+
+static void command_end(DEVICE *device, COMMAND *command, BOOLEAN failed,
+                        UINT64 timestamp)
+{
+    OPCODE_STATS *stats = &device->opcodes[command->opcode];
+
+    latency_add(&stats->latency, timestamp - command->start);
+    stats->bytes += command->bytes;
+    if (failed)
+    {
+        stats->failed++;
+        device->failed++;
+    }
+    device->total.commands++;
+    device->interval.commands++;
+
+    command->active = FALSE;
+    device->depth--;
+    if (device->depth == 0)
+    {
+        device->idleSince = timestamp;
+    }
+}
+
+/* Returns TRUE if payload is an IU valid on UAS command pipe */
+static BOOLEAN uas_command_iu(const UCHAR *payload, UINT32 length)
+{
+    if ((length >= 32) && (payload[0] == UAS_COMMAND_IU) && (payload[1] == 0) &&
+        (length == 32 + (UINT32)(payload[6] & 0xFC)))
+    {
+        return TRUE;
+    }
+    return ((length == 16) && (payload[0] == UAS_TASK_MGMT_IU)) ? TRUE : FALSE;
+}
+
+/* Returns TRUE if payload is an IU valid on UAS status pipe for active
+ * command.
+ */
+static BOOLEAN uas_status_iu(const DEVICE *device, const UCHAR *payload,
+                             UINT32 length)
+{
+    USHORT tag;
+
+    if (length < 4)
+    {
+        return FALSE;
+    }
+    tag = (USHORT)((payload[2] << 8) | payload[3]);
+
+    switch (payload[0])
+    {
+        case UAS_SENSE_IU:
+            return ((length >= 16) && device->uas[tag].active &&
+                    (length == 16 + (UINT32)((payload[14] << 8) | payload[15]))) ?
+                   TRUE : FALSE;
+        case UAS_RESPONSE_IU:
+            return (length == 8) ? TRUE : FALSE;
+        case UAS_READ_READY_IU:
+        case UAS_WRITE_READY_IU:
+            return ((length == 4) && device->uas[tag].active) ? TRUE : FALSE;
+        default:
+            return FALSE;
+    }
+}
+
+/* Handles CBW/CSW or command/status IU. Returns TRUE if the record was
+ * one of them, so its bytes are not counted as data.
+ */
+static BOOLEAN wrapper_record(DEVICE *device, UCHAR endpoint, BOOLEAN in,
+                              const UCHAR *payload, UINT32 captured,
+                              UINT64 timestamp)
+{
+    UCHAR *pipe;
+    USHORT tag;
+
+    if (device->protocol == PROTOCOL_BOT)
+    {
+        if (!in && (captured == BOT_CBW_LENGTH) &&
+            (PCAP_LE32(payload) == BOT_CBW_SIGNATURE))
+        {
+            command_start(device, &device->bot, payload[15], timestamp);
+            device->bot.tag = PCAP_LE32(&payload[4]);
+            return TRUE;
+        }
+        if (in && (captured == BOT_CSW_LENGTH) &&
+            (PCAP_LE32(payload) == BOT_CSW_SIGNATURE))
+        {
+            if (device->bot.active && (device->bot.tag == PCAP_LE32(&payload[4])))
+            {
+                command_end(device, &device->bot, (payload[12] != 0), timestamp);
+            }
+            else
+            {
+                device->unmatched++;
+            }
+            return TRUE;
+        }
+        return FALSE;
+    }
+
+    pipe = &device->pipes[pipe_index(endpoint)];
+    if (*pipe == PIPE_DATA)
+    {
+        return FALSE;
+    }
+
+    if (!in && uas_command_iu(payload, captured))
+    {
+        *pipe = PIPE_COMMAND;
+        if (payload[0] == UAS_COMMAND_IU)
+        {
+            tag = (USHORT)((payload[2] << 8) | payload[3]);
+            command_start(device, &device->uas[tag], payload[16], timestamp);
+        }
+        return TRUE;
+    }
+    if (in && uas_status_iu(device, payload, captured))
+    {
+        *pipe = PIPE_STATUS;
+        if (payload[0] == UAS_SENSE_IU)
+        {
+            tag = (USHORT)((payload[2] << 8) | payload[3]);
+            command_end(device, &device->uas[tag], (payload[6] != 0), timestamp);
+        }
+        return TRUE;
+    }
+
+    if (*pipe == PIPE_UNKNOWN)
+    {
+        *pipe = PIPE_DATA;
+    }
+    else if (in && (captured >= 4) && (payload[0] == UAS_SENSE_IU))
+    {
+        device->unmatched++;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static void bulk_record(ANALYZER *analyzer, const SCAN_BATCH *batch, UINT32 i,
+                        const UCHAR *payload, UINT32 captured)
+{
+    const BOOLEAN  completion = (batch->info[i] & 0x01) ? TRUE : FALSE;
+    const BOOLEAN  in = (batch->endpoint[i] & 0x80) ? TRUE : FALSE;
+    const UINT64   timestamp = batch->timestamp[i];
+    BOOLEAN        wrapper = FALSE;
+    DEVICE        *device;
+
+    device = device_find(analyzer, batch->bus[i], batch->device[i]);
+    if (device == NULL)
+    {
+        PROTOCOL protocol = PROTOCOL_UNKNOWN;
+
+        if (in || completion)
+        {
+            return;
+        }
+        if ((captured == BOT_CBW_LENGTH) &&
+            (PCAP_LE32(payload) == BOT_CBW_SIGNATURE))
+        {
+            protocol = PROTOCOL_BOT;
+        }
+        else if (uas_command_iu(payload, captured) &&
+                 (payload[0] == UAS_COMMAND_IU))
+        {
+            protocol = PROTOCOL_UAS;
+        }
+        else
+        {
+            return;
+        }
+        device = device_add(analyzer, batch->bus[i], batch->device[i],
+                            protocol, timestamp);
+        if (device == NULL)
+        {
+            return;
+        }
+    }
+
+    device_advance(analyzer, device, timestamp);
+
+    /* OUT data is in submit, IN data is in completion */
+    if (in == completion)
+    {
+        wrapper = wrapper_record(device, batch->endpoint[i], in, payload,
+                                 captured, timestamp);
+    }
+
+    if (!completion)
+    {
+        urb_insert(device, batch->irpId[i],
+                   (in || wrapper) ? 0 : batch->dataLength[i]);
+    }
+    else
+    {
+        PENDING_URB *urb = urb_find(device, batch->irpId[i]);
+        UINT64       bytes = 0;
+
+        if (in)
+        {
+            bytes = wrapper ? 0 : batch->dataLength[i];
+        }
+        else if (urb != NULL)
+        {
+            bytes = urb->length;
+        }
+        if (urb != NULL)
+        {
+            urb_remove(device, urb);
+        }
+        if (USBD_ERROR(batch->status[i]))
+        {
+            device->stalls++;
+        }
+
+        if (in)
+        {
+            device->bytesIn += bytes;
+        }
+        else
+        {
+            device->bytesOut += bytes;
+        }
+        device->total.bytes += bytes;
+        device->interval.bytes += bytes;
+        if ((device->protocol == PROTOCOL_BOT) && device->bot.active)
+        {
+            device->bot.bytes += bytes;
+        }
+    }
+}
+
+static const char *opcode_name(UCHAR opcode)
+{
+    switch (opcode)
+    {
+        case 0x00: return "TEST UNIT READY";
+        case 0x03: return "REQUEST SENSE";
+        case 0x12: return "INQUIRY";
+        case 0x1A: return "MODE SENSE(6)";
+        case 0x1B: return "START STOP UNIT";
+        case 0x1E: return "PREVENT ALLOW REMOVAL";
+        case 0x23: return "READ FORMAT CAPACITIES";
+        case 0x25: return "READ CAPACITY(10)";
+        case 0x28: return "READ(10)";
+        case 0x2A: return "WRITE(10)";
+        case 0x2F: return "VERIFY(10)";
+        case 0x35: return "SYNCHRONIZE CACHE(10)";
+        case 0x42: return "UNMAP";
+        case 0x5A: return "MODE SENSE(10)";
+        case 0x85: return "ATA PASS-THROUGH(16)";
+        case 0x88: return "READ(16)";
+        case 0x8A: return "WRITE(16)";
+        case 0x91: return "SYNCHRONIZE CACHE(16)";
+        case 0x9E: return "SERVICE ACTION IN(16)";
+        case 0xA0: return "REPORT LUNS";
+        case 0xA1: return "ATA PASS-THROUGH(12)";
+        case 0xA8: return "READ(12)";
+        case 0xAA: return "WRITE(12)";
+        default:   return NULL;
+    }
+}
+
+static double usec(UINT64 nanoseconds)
+{
+    return (double)nanoseconds / NSEC_PER_USEC;
+}
+
+static void print_device(const DEVICE *device)
+{
+    const TIMES *times = &device->total;
+    const UINT64 span = times->idle + times->device + times->host;
+    const double seconds = (double)span / NSEC_PER_SEC;
+    unsigned     opcode;
+
+    printf("Device %u:%u, %s\n", device->bus, device->device,
+           (device->protocol == PROTOCOL_BOT) ?
+           "Bulk-Only Transport" : "USB Attached SCSI");
+    printf("  %llu commands, %llu failed, %llu without status, "
+           "%u outstanding at the end, %llu status without command\n",
+           (unsigned long long)times->commands,
+           (unsigned long long)device->failed,
+           (unsigned long long)device->lost, device->depth,
+           (unsigned long long)device->unmatched);
+    printf("  %.3f s from the first command, read %.3f MB, written %.3f MB, "
+           "%.3f MB/s\n", seconds, device->bytesIn / 1e6, device->bytesOut / 1e6,
+           (seconds > 0) ? (device->bytesIn + device->bytesOut) / seconds / 1e6 : 0.0);
+    printf("  queue depth average %.2f, max %u\n",
+           (span != 0) ? (double)times->depth / span : 0.0, times->maxDepth);
+    printf("  waiting for device %.1f%%, for host %.1f%%, idle %.1f%%: %s bound\n",
+           (span != 0) ? 100.0 * times->device / span : 0.0,
+           (span != 0) ? 100.0 * times->host / span : 0.0,
+           (span != 0) ? 100.0 * times->idle / span : 0.0,
+           bottleneck(times));
+    if (device->gaps.count != 0)
+    {
+        printf("  gaps between commands: %llu, average %.1f us, p50 %.1f us, "
+               "p99 %.1f us, max %.1f us\n",
+               (unsigned long long)device->gaps.count,
+               usec(device->gaps.sum) / device->gaps.count,
+               usec(latency_percentile(&device->gaps, 50.0)),
+               usec(latency_percentile(&device->gaps, 99.0)),
+               usec(device->gaps.max));
+    }
+    if ((device->stalls != 0) || (device->untracked != 0))
+    {
+        printf("  %llu bulk URBs failed, %llu URBs not tracked\n",
+               (unsigned long long)device->stalls,
+               (unsigned long long)device->untracked);
+    }
+
+    printf("  %-24s %10s %8s %12s %12s %12s %12s %12s\n", "command", "count",
+           "failed", (device->protocol == PROTOCOL_BOT) ? "MB" : "",
+           "avg_us", "p50_us", "p99_us", "max_us");
+    for (opcode = 0; opcode < 256; opcode++)
+    {
+        const OPCODE_STATS *stats = &device->opcodes[opcode];
+        const char         *name = opcode_name((UCHAR)opcode);
+        char                unknown[16];
+        char                megabytes[32] = "";
+
+        if (stats->latency.count == 0)
+        {
+            continue;
+        }
+        if (name == NULL)
+        {
+            snprintf(unknown, sizeof(unknown), "0x%02X", opcode);
+            name = unknown;
+        }
+        if (device->protocol == PROTOCOL_BOT)
+        {
+            snprintf(megabytes, sizeof(megabytes), "%.3f", stats->bytes / 1e6);
+        }
+        printf("  %-24s %10llu %8llu %12s %12.1f %12.1f %12.1f %12.1f\n", name,
+               (unsigned long long)stats->latency.count,
+               (unsigned long long)stats->failed, megabytes,
+               usec(stats->latency.sum) / stats->latency.count,
+               usec(latency_percentile(&stats->latency, 50.0)),
+               usec(latency_percentile(&stats->latency, 99.0)),
+               usec(stats->latency.max));
+    }
+}
+
+static void device_free(DEVICE *device)
+{
+    unsigned opcode;
+
+    for (opcode = 0; opcode < 256; opcode++)
+    {
+        free(device->opcodes[opcode].latency.histogram);
+    }
+    free(device->gaps.histogram);
+    free(device->uas);
+    free(device);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <capture.pcap>\n"
+            "  -d, --device <bus:dev>  analyze only this device, can be repeated\n"
+            "  -t, --timeline <file>   write per interval CSV timeline\n"
+            "  -i, --interval <s>      timeline interval (default 1)\n",
+            name);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] =
+    {
+        {"device",   required_argument, NULL, 'd'},
+        {"timeline", required_argument, NULL, 't'},
+        {"interval", required_argument, NULL, 'i'},
+        {"help",     no_argument,       NULL, 'h'},
+        {NULL,       0,                 NULL, 0}
+    };
+    ANALYZER      analyzer;
+    PCAP_FILE     file;
+    PCAP_RECORD   record;
+    SCANNER       scanner;
+    SCAN_FILTER   filter;
+    SCAN_BATCH   *batch;
+    UINT64        mask[SCAN_BATCH_RECORDS / 64];
+    const char   *timelineName = NULL;
+    char          error[256];
+    BOOLEAN       failed = FALSE;
+    UINT32        i;
+    int           opt;
+
+    memset(&analyzer, 0, sizeof(analyzer));
+    analyzer.interval = NSEC_PER_SEC;
+
+    while ((opt = getopt_long(argc, argv, "d:t:i:h", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'd':
+            {
+                unsigned bus;
+                unsigned device;
+
+                if ((sscanf(optarg, "%u:%u", &bus, &device) != 2) ||
+                    (bus > 0xFFFF) || (device > 0xFFFF) ||
+                    (analyzer.numberOfSelected == MAX_SELECTED))
+                {
+                    fprintf(stderr, "Invalid device %s, use bus:device\n", optarg);
+                    return 1;
+                }
+                analyzer.selected[analyzer.numberOfSelected++] = (bus << 16) | device;
+                break;
+            }
+            case 't':
+                timelineName = optarg;
+                break;
+            case 'i':
+                analyzer.interval = (UINT64)(strtod(optarg, NULL) * NSEC_PER_SEC + 0.5);
+                if (analyzer.interval == 0)
+                {
+                    fprintf(stderr, "Invalid interval %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (pcap_open(&file, argv[optind], error, sizeof(error)) != 0)
+    {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+    }
+    if (file.network != DLT_USBPCAP)
+    {
+        fprintf(stderr, "%s: link type %u is not DLT_USBPCAP\n",
+                argv[optind], file.network);
+        pcap_close(&file);
+        return 1;
+    }
+    if (pcap_read_record(&file, PCAP_FIRST_RECORD, &record) == 1)
+    {
+        analyzer.origin = record.timestamp;
+    }
+
+    if (timelineName != NULL)
+    {
+        analyzer.timeline = fopen(timelineName, "w");
+        if (analyzer.timeline == NULL)
+        {
+            perror(timelineName);
+            pcap_close(&file);
+            return 1;
+        }
+        fprintf(analyzer.timeline, "bus,device,start_s,commands,mb_per_s,"
+                "queue_depth_avg,queue_depth_max,device_pct,host_pct,idle_pct,"
+                "bottleneck\n");
+    }
+
+    batch = (SCAN_BATCH *)malloc(sizeof(SCAN_BATCH));
+    if (batch == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    scan_filter_init(&filter);
+    filter.transfer = USBPCAP_TRANSFER_BULK;
+
+    scan_init(&scanner, &file, PCAP_FIRST_RECORD, file.size);
+    while (scan_next(&scanner, batch) > 0)
+    {
+        UINT32 word;
+
+        if (scan_filter(batch, &filter, mask) == 0)
+        {
+            continue;
+        }
+        for (word = 0; word < SCAN_BATCH_RECORDS / 64; word++)
+        {
+            UINT64 bits = mask[word];
+
+            while (bits != 0)
+            {
+                UINT32 j = word * 64 + (UINT32)__builtin_ctzll(bits);
+
+                bits &= bits - 1;
+                bulk_record(&analyzer, batch, j,
+                            &file.data[batch->offset[j] + sizeof(pcaprec_hdr_t) +
+                                       batch->headerLen[j]],
+                            batch->inclLen[j] - batch->headerLen[j]);
+            }
+        }
+    }
+    free(batch);
+
+    if (scanner.corrupted)
+    {
+        fprintf(stderr, "%s: invalid record at offset %llu, "
+                "records after it are not analyzed\n", argv[optind],
+                (unsigned long long)scanner.offset);
+    }
+
+    if (analyzer.count == 0)
+    {
+        printf("No Bulk-Only Transport or USB Attached SCSI commands found\n");
+    }
+    for (i = 0; i < analyzer.count; i++)
+    {
+        DEVICE *device = analyzer.devices[i];
+
+        interval_flush(&analyzer, device);
+        print_device(device);
+        device_free(device);
+    }
+
+    if ((analyzer.timeline != NULL) && (fclose(analyzer.timeline) != 0))
+    {
+        perror(timelineName);
+        failed = TRUE;
+    }
+    pcap_close(&file);
+    return (failed || scanner.corrupted) ? 1 : 0;
+}
@@ -0,0 +1,595 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Random BPF programs through USBPcapBPFValidate() and, if accepted,
+ * USBPcapBPFRun() over random records. Payload is split in random
+ * entries, the lists are truncated (less payload than dataLength), empty
+ * and end with NULL buffer. Every payload entry ends right before
+ * inaccessible page so any read past it crashes the test.
+ *
+ * Results are compared with straightforward interpreter working on the
+ * record copied to flat buffer. The interpreter also fails the test if a
+ * validated program executes an instruction the validator should have
+ * rejected.
+ *
+ * Usage: bpffuzz [<directory> [<iterations> [<seed>]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "USBPcapBPF.h"
+
+#define FUZZ_ITERATIONS     200000
+#define FUZZ_MAX_PROGRAM    48
+#define FUZZ_RECORDS        4
+#define FUZZ_MAX_HEADER     64
+#define FUZZ_MAX_ENTRIES    6
+#define FUZZ_MAX_ENTRY      256
+
+/* Reference interpreter result for instruction validator must reject */
+#define REFERENCE_INVALID   0xFFFFFFFFFFFFFFFFULL
+
+static UINT32 g_random = 0x9E3779B9;
+static int    g_failures;
+
+/* Entry buffers, each FUZZ_MAX_ENTRY bytes followed by guard page */
+static PUCHAR g_entry[FUZZ_MAX_ENTRIES];
+
+#define CHECK(condition, ...) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__); \
+            fprintf(stderr, "\n"); \
+            g_failures++; \
+        } \
+    } \
+    while (0)
+
+/* Instructions USBPcapBPFValidate() accepts, picked most of the time */
+static const UINT16 g_codes[] =
+{
+    BPF_RET | BPF_K, BPF_RET | BPF_A,
+    BPF_LD | BPF_W | BPF_ABS, BPF_LD | BPF_H | BPF_ABS, BPF_LD | BPF_B | BPF_ABS,
+    BPF_LD | BPF_W | BPF_IND, BPF_LD | BPF_H | BPF_IND, BPF_LD | BPF_B | BPF_IND,
+    BPF_LD | BPF_W | BPF_LEN, BPF_LDX | BPF_W | BPF_LEN,
+    BPF_LDX | BPF_B | BPF_MSH, BPF_LD | BPF_IMM, BPF_LDX | BPF_IMM,
+    BPF_LD | BPF_MEM, BPF_LDX | BPF_MEM, BPF_ST, BPF_STX,
+    BPF_JMP | BPF_JA,
+    BPF_JMP | BPF_JGT | BPF_K, BPF_JMP | BPF_JGE | BPF_K,
+    BPF_JMP | BPF_JEQ | BPF_K, BPF_JMP | BPF_JSET | BPF_K,
+    BPF_JMP | BPF_JGT | BPF_X, BPF_JMP | BPF_JGE | BPF_X,
+    BPF_JMP | BPF_JEQ | BPF_X, BPF_JMP | BPF_JSET | BPF_X,
+    BPF_ALU | BPF_ADD | BPF_X, BPF_ALU | BPF_SUB | BPF_X,
+    BPF_ALU | BPF_MUL | BPF_X, BPF_ALU | BPF_DIV | BPF_X,
+    BPF_ALU | BPF_MOD | BPF_X, BPF_ALU | BPF_AND | BPF_X,
+    BPF_ALU | BPF_OR | BPF_X, BPF_ALU | BPF_XOR | BPF_X,
+    BPF_ALU | BPF_LSH | BPF_X, BPF_ALU | BPF_RSH | BPF_X,
+    BPF_ALU | BPF_ADD | BPF_K, BPF_ALU | BPF_SUB | BPF_K,
+    BPF_ALU | BPF_MUL | BPF_K, BPF_ALU | BPF_DIV | BPF_K,
+    BPF_ALU | BPF_MOD | BPF_K, BPF_ALU | BPF_AND | BPF_K,
+    BPF_ALU | BPF_OR | BPF_K, BPF_ALU | BPF_XOR | BPF_K,
+    BPF_ALU | BPF_LSH | BPF_K, BPF_ALU | BPF_RSH | BPF_K,
+    BPF_ALU | BPF_NEG, BPF_MISC | BPF_TAX, BPF_MISC | BPF_TXA,
+};
+
+static UINT32 fuzz_random(void)
+{
+    g_random ^= g_random << 13;
+    g_random ^= g_random >> 17;
+    g_random ^= g_random << 5;
+    return g_random;
+}
+
+static void fuzz_program(USBPCAP_BPF_INSN *insn, UINT32 count)
+{
+    UINT32 pc;
+
+    for (pc = 0; pc < count; pc++)
+    {
+        UINT32 left = count - pc - 1;
+
+        if (fuzz_random() % 16 == 0)
+        {
+            insn[pc].code = (UINT16)fuzz_random();
+        }
+        else
+        {
+            insn[pc].code = g_codes[fuzz_random() % (sizeof(g_codes) / sizeof(g_codes[0]))];
+        }
+
+        /* Mostly in range, sometimes just outside of it */
+        insn[pc].jt = (UCHAR)(fuzz_random() % (left + 2));
+        insn[pc].jf = (UCHAR)(fuzz_random() % (left + 2));
+        switch (fuzz_random() % 4)
+        {
+            case 0:
+                insn[pc].k = fuzz_random();
+                break;
+            case 1:
+                /* Scratch memory index or shift amount */
+                insn[pc].k = fuzz_random() % (USBPCAP_BPF_MEMWORDS + 18);
+                break;
+            default:
+                /* Offset close to the record end */
+                insn[pc].k = fuzz_random() % (FUZZ_MAX_HEADER + 2 * FUZZ_MAX_ENTRY);
+                break;
+        }
+        if (BPF_CLASS(insn[pc].code) == BPF_JMP)
+        {
+            insn[pc].k = (BPF_OP(insn[pc].code) == BPF_JA) ?
+                         fuzz_random() % (left + 2) : insn[pc].k;
+        }
+    }
+
+    /* Most programs end with return */
+    if (fuzz_random() % 8 != 0)
+    {
+        insn[count - 1].code = (fuzz_random() & 1) ? (BPF_RET | BPF_A) :
+                                                     (BPF_RET | BPF_K);
+    }
+}
+
+static BOOLEAN reference_load(const UCHAR *packet, UINT32 length,
+                              UINT64 offset, UINT32 size, UINT32 *value)
+{
+    UINT32 i;
+
+    if (offset + size > length)
+    {
+        return FALSE;
+    }
+    *value = 0;
+    for (i = 0; i < size; i++)
+    {
+        *value = (*value << 8) | packet[offset + i];
+    }
+    return TRUE;
+}
+
+/* Runs program over flat packet. Does not trust the validator. */
+static UINT64 reference_run(const USBPCAP_BPF_INSN *insn, UINT32 count,
+                            const UCHAR *packet, UINT32 length)
+{
+    UINT32 A = 0;
+    UINT32 X = 0;
+    UINT32 mem[USBPCAP_BPF_MEMWORDS] = {0};
+    UINT32 value;
+    UINT32 pc;
+
+    for (pc = 0; pc < count; pc++)
+    {
+        const USBPCAP_BPF_INSN *p = &insn[pc];
+        UINT32                  size = 0;
+
+        switch (BPF_CLASS(p->code))
+        {
+            case BPF_RET:
+                if ((p->code != (BPF_RET | BPF_K)) && (p->code != (BPF_RET | BPF_A)))
+                {
+                    /* USBPcapBPFRun() rejects, validator accepts */
+                    return 0;
+                }
+                return (p->code == (BPF_RET | BPF_K)) ? p->k : A;
+
+            case BPF_LD:
+            case BPF_LDX:
+                switch (p->code)
+                {
+                    case BPF_LD | BPF_W | BPF_ABS:
+                    case BPF_LD | BPF_W | BPF_IND:
+                        size = 4;
+                        break;
+                    case BPF_LD | BPF_H | BPF_ABS:
+                    case BPF_LD | BPF_H | BPF_IND:
+                        size = 2;
+                        break;
+                    case BPF_LD | BPF_B | BPF_ABS:
+                    case BPF_LD | BPF_B | BPF_IND:
+                        size = 1;
+                        break;
+                    case BPF_LD | BPF_W | BPF_LEN:
+                        A = length;
+                        break;
+                    case BPF_LDX | BPF_W | BPF_LEN:
+                        X = length;
+                        break;
+                    case BPF_LDX | BPF_B | BPF_MSH:
+                        if (!reference_load(packet, length, p->k, 1, &value))
+                        {
+                            return 0;
+                        }
+                        X = (value & 0x0F) << 2;
+                        break;
+                    case BPF_LD | BPF_IMM:
+                        A = p->k;
+                        break;
+                    case BPF_LDX | BPF_W | BPF_IMM:
+                        X = p->k;
+                        break;
+                    case BPF_LD | BPF_MEM:
+                    case BPF_LDX | BPF_W | BPF_MEM:
+                        if (p->k >= USBPCAP_BPF_MEMWORDS)
+                        {
+                            return REFERENCE_INVALID;
+                        }
+                        *((BPF_CLASS(p->code) == BPF_LD) ? &A : &X) = mem[p->k];
+                        break;
+                    default:
+                        /* Other sizes of valid modes are accepted by the
+                         * validator and rejected at runtime.
+                         */
+                        if ((BPF_MODE(p->code) == BPF_MEM) &&
+                            (p->k >= USBPCAP_BPF_MEMWORDS))
+                        {
+                            return REFERENCE_INVALID;
+                        }
+                        if ((BPF_CLASS(p->code) == BPF_LDX) ||
+                            (BPF_MODE(p->code) > BPF_LEN))
+                        {
+                            return REFERENCE_INVALID;
+                        }
+                        return 0;
+                }
+                if (size > 0)
+                {
+                    UINT64 offset = p->k;
+
+                    if (BPF_MODE(p->code) == BPF_IND)
+                    {
+                        offset += X;
+                    }
+                    if ((offset > 0xFFFFFFFFULL) ||
+                        !reference_load(packet, length, offset, size, &A))
+                    {
+                        return 0;
+                    }
+                }
+                break;
+
+            case BPF_ST:
+            case BPF_STX:
+                if (p->k >= USBPCAP_BPF_MEMWORDS)
+                {
+                    return REFERENCE_INVALID;
+                }
+                if ((p->code != BPF_ST) && (p->code != BPF_STX))
+                {
+                    return 0;
+                }
+                mem[p->k] = (p->code == BPF_ST) ? A : X;
+                break;
+
+            case BPF_ALU:
+            {
+                UINT32 operand = (BPF_SRC(p->code) == BPF_X) ? X : p->k;
+
+                if (BPF_OP(p->code) > BPF_XOR)
+                {
+                    return REFERENCE_INVALID;
+                }
+                if (((BPF_OP(p->code) == BPF_DIV) || (BPF_OP(p->code) == BPF_MOD)) &&
+                    (BPF_SRC(p->code) == BPF_K) && (p->k == 0))
+                {
+                    return REFERENCE_INVALID;
+                }
+                if ((p->code > 0xFF) || (p->code == (BPF_ALU | BPF_NEG | BPF_X)))
+                {
+                    return 0;
+                }
+                switch (BPF_OP(p->code))
+                {
+                    case BPF_ADD: A += operand; break;
+                    case BPF_SUB: A -= operand; break;
+                    case BPF_MUL: A *= operand; break;
+                    case BPF_DIV:
+                    case BPF_MOD:
+                        if (operand == 0)
+                        {
+                            return 0;
+                        }
+                        A = (BPF_OP(p->code) == BPF_DIV) ? A / operand : A % operand;
+                        break;
+                    case BPF_OR:  A |= operand; break;
+                    case BPF_AND: A &= operand; break;
+                    case BPF_XOR: A ^= operand; break;
+                    case BPF_LSH: A = (operand < 32) ? (A << operand) : 0; break;
+                    case BPF_RSH: A = (operand < 32) ? (A >> operand) : 0; break;
+                    default:
+                        A = (UINT32)(-(INT32)A);
+                        break;
+                }
+                break;
+            }
+
+            case BPF_JMP:
+            {
+                UINT32  operand = (BPF_SRC(p->code) == BPF_X) ? X : p->k;
+                BOOLEAN taken;
+
+                if (BPF_OP(p->code) == BPF_JA)
+                {
+                    if ((UINT64)pc + 1 + p->k >= count)
+                    {
+                        return REFERENCE_INVALID;
+                    }
+                    if (p->code != (BPF_JMP | BPF_JA))
+                    {
+                        return 0;
+                    }
+                    pc += p->k;
+                    break;
+                }
+                switch (BPF_OP(p->code))
+                {
+                    case BPF_JEQ:  taken = (A == operand); break;
+                    case BPF_JGT:  taken = (A > operand); break;
+                    case BPF_JGE:  taken = (A >= operand); break;
+                    case BPF_JSET: taken = ((A & operand) != 0); break;
+                    default:
+                        return REFERENCE_INVALID;
+                }
+                if ((pc + 1 + p->jt >= count) || (pc + 1 + p->jf >= count))
+                {
+                    return REFERENCE_INVALID;
+                }
+                if ((p->code & 0xFF07) != BPF_JMP)
+                {
+                    return 0;
+                }
+                pc += taken ? p->jt : p->jf;
+                break;
+            }
+
+            case BPF_MISC:
+                if (p->code == (BPF_MISC | BPF_TAX))
+                {
+                    X = A;
+                }
+                else if (p->code == (BPF_MISC | BPF_TXA))
+                {
+                    A = X;
+                }
+                else if ((BPF_MISCOP(p->code) == BPF_TAX) ||
+                         (BPF_MISCOP(p->code) == BPF_TXA))
+                {
+                    return 0;
+                }
+                else
+                {
+                    return REFERENCE_INVALID;
+                }
+                break;
+
+            default:
+                return REFERENCE_INVALID;
+        }
+    }
+
+    /* Fell off the end */
+    return REFERENCE_INVALID;
+}
+
+/* Builds random record. Returns length of the packet the program sees,
+ * copied to flat.
+ */
+static UINT32 fuzz_record(PUCHAR header, UINT32 *headerLen,
+                          PUSBPCAP_PAYLOAD_ENTRY payload, UINT32 *dataLength,
+                          PUCHAR flat)
+{
+    UINT32 entries = fuzz_random() % (FUZZ_MAX_ENTRIES + 1);
+    UINT32 available = 0;
+    UINT32 length;
+    UINT32 i;
+    UINT32 j;
+
+    *headerLen = fuzz_random() % (FUZZ_MAX_HEADER + 1);
+    for (i = 0; i < *headerLen; i++)
+    {
+        header[i] = (UCHAR)fuzz_random();
+    }
+    memcpy(flat, header, *headerLen);
+
+    for (i = 0; i < entries; i++)
+    {
+        UINT32 size = fuzz_random() % (FUZZ_MAX_ENTRY + 1);
+        PUCHAR buffer;
+
+        /* Empty entries that are not the terminator */
+        if (fuzz_random() % 8 == 0)
+        {
+            size = 0;
+        }
+
+        /* Entry data ends right at the guard page */
+        buffer = &g_entry[i][FUZZ_MAX_ENTRY - size];
+        for (j = 0; j < size; j++)
+        {
+            buffer[j] = (UCHAR)fuzz_random();
+        }
+        payload[i].size = size;
+        payload[i].buffer = buffer;
+        memcpy(&flat[*headerLen + available], buffer, size);
+        available += size;
+    }
+    payload[i].size = fuzz_random() % 64;
+    payload[i].buffer = NULL;
+
+    switch (fuzz_random() % 3)
+    {
+        case 0:
+            /* Payload truncated, fewer bytes present than announced */
+            *dataLength = available + fuzz_random() % 512;
+            break;
+        case 1:
+            /* Only part of the payload is captured */
+            *dataLength = (available > 0) ? fuzz_random() % available : 0;
+            break;
+        default:
+            *dataLength = available;
+            break;
+    }
+
+    length = (available < *dataLength) ? available : *dataLength;
+    return *headerLen + length;
+}
+
+static void fuzz_iteration(void)
+{
+    USBPCAP_BPF_INSN       insn[FUZZ_MAX_PROGRAM];
+    USBPCAP_PAYLOAD_ENTRY  payload[FUZZ_MAX_ENTRIES + 1];
+    UCHAR                  header[FUZZ_MAX_HEADER];
+    UCHAR                  flat[FUZZ_MAX_HEADER + FUZZ_MAX_ENTRIES * FUZZ_MAX_ENTRY];
+    UINT32                 count = 1 + fuzz_random() % FUZZ_MAX_PROGRAM;
+    UINT32                 headerLen;
+    UINT32                 dataLength;
+    UINT32                 length;
+    UINT32                 result;
+    UINT64                 expected;
+    int                    i;
+
+    fuzz_program(insn, count);
+    if (USBPcapBPFValidate(insn, count) == FALSE)
+    {
+        return;
+    }
+
+    for (i = 0; i < FUZZ_RECORDS; i++)
+    {
+        length = fuzz_record(header, &headerLen, payload, &dataLength, flat);
+        expected = reference_run(insn, count, flat, length);
+        CHECK(expected != REFERENCE_INVALID,
+              "validated program of %u instructions is not valid", count);
+        if (expected == REFERENCE_INVALID)
+        {
+            return;
+        }
+
+        result = USBPcapBPFRun(insn, header, headerLen, payload, dataLength);
+        CHECK(result == expected,
+              "program of %u instructions returned %u instead of %u "
+              "(header %u, data %u, packet %u)", count, result,
+              (UINT32)expected, headerLen, dataLength, length);
+    }
+}
+
+/* Programs the validator must reject whatever the random generator does */
+static void fuzz_fixed(void)
+{
+    static const USBPCAP_BPF_INSN noReturn[] =
+    {
+        {BPF_LD | BPF_IMM, 0, 0, 1},
+    };
+    static const USBPCAP_BPF_INSN jumpOut[] =
+    {
+        {BPF_JMP | BPF_JEQ | BPF_K, 1, 0, 0},
+        {BPF_RET | BPF_K, 0, 0, 0},
+    };
+    static const USBPCAP_BPF_INSN divZero[] =
+    {
+        {BPF_ALU | BPF_DIV | BPF_K, 0, 0, 0},
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    static const USBPCAP_BPF_INSN memOut[] =
+    {
+        {BPF_ST, 0, 0, USBPCAP_BPF_MEMWORDS},
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    /* Whole record, header and payload split over empty entries */
+    static const USBPCAP_BPF_INSN lastByte[] =
+    {
+        {BPF_LD | BPF_W | BPF_LEN, 0, 0, 0},
+        {BPF_ALU | BPF_SUB | BPF_K, 0, 0, 1},
+        {BPF_MISC | BPF_TAX, 0, 0, 0},
+        {BPF_LD | BPF_B | BPF_IND, 0, 0, 0},
+        {BPF_ALU | BPF_OR | BPF_K, 0, 0, 0x100},
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    USBPCAP_PAYLOAD_ENTRY  payload[4];
+    UCHAR                  header[2] = {0x11, 0x22};
+
+    CHECK(USBPcapBPFValidate(noReturn, 1) == FALSE, "program without return");
+    CHECK(USBPcapBPFValidate(jumpOut, 2) == FALSE, "jump past the end");
+    CHECK(USBPcapBPFValidate(divZero, 2) == FALSE, "division by zero");
+    CHECK(USBPcapBPFValidate(memOut, 2) == FALSE, "scratch memory index");
+    CHECK(USBPcapBPFValidate(lastByte, 0) == FALSE, "empty program");
+    CHECK(USBPcapBPFValidate(lastByte, 6) == TRUE, "valid program rejected");
+
+    /* No payload at all */
+    payload[0].size = 0;
+    payload[0].buffer = NULL;
+    CHECK(USBPcapBPFRun(lastByte, header, 2, payload, 0) == 0x122,
+          "last header byte without payload");
+    CHECK(USBPcapBPFRun(lastByte, header, 2, payload, 100) == 0x122,
+          "last header byte with missing payload");
+    CHECK(USBPcapBPFRun(lastByte, header, 0, payload, 100) == 0,
+          "load from empty record");
+
+    /* Empty entry before the data */
+    memset(&g_entry[0][FUZZ_MAX_ENTRY - 1], 0x33, 1);
+    payload[0].size = 0;
+    payload[0].buffer = &g_entry[1][FUZZ_MAX_ENTRY];
+    payload[1].size = 1;
+    payload[1].buffer = &g_entry[0][FUZZ_MAX_ENTRY - 1];
+    payload[2].size = 0;
+    payload[2].buffer = NULL;
+    CHECK(USBPcapBPFRun(lastByte, header, 2, payload, 1) == 0x133,
+          "last payload byte after empty entry");
+    CHECK(USBPcapBPFRun(lastByte, header, 2, payload, 50) == 0x133,
+          "last payload byte of truncated payload");
+}
+
+int main(int argc, char *argv[])
+{
+    long   page = sysconf(_SC_PAGESIZE);
+    size_t span = ((FUZZ_MAX_ENTRY + page - 1) / page + 1) * page;
+    UINT32 iterations = FUZZ_ITERATIONS;
+    UINT32 i;
+
+    if (argc > 2)
+    {
+        iterations = (UINT32)strtoul(argv[2], NULL, 0);
+    }
+    if (argc > 3)
+    {
+        g_random = (UINT32)strtoul(argv[3], NULL, 0) | 1;
+    }
+
+    for (i = 0; i < FUZZ_MAX_ENTRIES; i++)
+    {
+        PUCHAR region = mmap(NULL, span, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if ((region == MAP_FAILED) ||
+            (mprotect(region + span - page, page, PROT_NONE) != 0))
+        {
+            fprintf(stderr, "Failed to map entry buffers\n");
+            return 1;
+        }
+        g_entry[i] = region + span - page - FUZZ_MAX_ENTRY;
+    }
+
+    fuzz_fixed();
+    for (i = 0; (i < iterations) && (g_failures < 20); i++)
+    {
+        fuzz_iteration();
+    }
+
+    if (g_failures > 0)
+    {
+        fprintf(stderr, "bpffuzz: %d checks failed\n", g_failures);
+        return 1;
+    }
+    printf("bpffuzz: passed\n");
+    return 0;
+}
@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * USBPcapCMD filter compiler (USBPcapCMD/bpf.c) against USBPcapBPFRun():
+ * expressions are compiled with bpf_compile_filter(), checked with
+ * USBPcapBPFValidate() and run over bulk, interrupt and control records
+ * with full, short, truncated, split and empty payload. usb.capdata tests
+ * on too short payload do not match, so they must give the same result
+ * as any other false test under &&, || and !.
+ *
+ * Usage: bpftest
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "USBPcapBPF.h"
+#include "../USBPcapCMD/bpf.h"
+
+static int g_failures;
+
+#define CHECK(condition, ...) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__); \
+            fprintf(stderr, "\n"); \
+            g_failures++; \
+        } \
+    } \
+    while (0)
+
+/* Records the expressions are run over */
+enum
+{
+    RECORD_BULK_CBW,        /* Bulk OUT with 31 byte USBC command block */
+    RECORD_BULK_SHORT,      /* Bulk OUT with 2 bytes, 55:53 */
+    RECORD_BULK_EMPTY,      /* Bulk OUT without payload */
+    RECORD_BULK_TRUNCATED,  /* Bulk OUT, dataLength 31 but only 2 bytes */
+    RECORD_BULK_SPLIT,      /* Bulk OUT, USBC split in 1 and 30 bytes */
+    RECORD_INTERRUPT_EMPTY, /* Interrupt IN without payload */
+    RECORD_SETUP_ONLY,      /* Control SETUP, 8 byte packet and no data */
+    RECORD_SETUP_DATA,      /* Control SETUP followed by 4 bytes 55:53:42:43 */
+    RECORD_COUNT
+};
+
+struct test_record
+{
+    USBPCAP_BUFFER_CONTROL_HEADER header;
+    UINT32                        headerLen;
+    USBPCAP_PAYLOAD_ENTRY         payload[3];
+    UINT32                        dataLength;
+};
+
+static UCHAR g_cbw[31] = {0x55, 0x53, 0x42, 0x43, 0x01, 0x00, 0x00, 0x00};
+static UCHAR g_setup[12] = {0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 0x12, 0x00,
+                            0x55, 0x53, 0x42, 0x43};
+
+static struct test_record g_records[RECORD_COUNT];
+
+static void test_record(int index, UCHAR transfer, UCHAR endpoint,
+                        UCHAR stage, UINT32 dataLength,
+                        PVOID first, UINT32 firstSize,
+                        PVOID second, UINT32 secondSize)
+{
+    struct test_record *record = &g_records[index];
+
+    memset(record, 0, sizeof(*record));
+    record->headerLen = (transfer == USBPCAP_TRANSFER_CONTROL) ?
+                        sizeof(USBPCAP_BUFFER_CONTROL_HEADER) :
+                        sizeof(USBPCAP_BUFFER_PACKET_HEADER);
+    record->header.header.headerLen = (USHORT)record->headerLen;
+    record->header.header.irpId = 0xFFFF800000001000ULL;
+    record->header.header.function =
+        (transfer == USBPCAP_TRANSFER_CONTROL) ?
+        URB_FUNCTION_CONTROL_TRANSFER : URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER;
+    record->header.header.bus = 1;
+    record->header.header.device = 5;
+    record->header.header.endpoint = endpoint;
+    record->header.header.transfer = transfer;
+    record->header.header.dataLength = dataLength;
+    record->header.stage = stage;
+    record->dataLength = dataLength;
+
+    /* Entry list ends with NULL buffer as in the driver */
+    if (first != NULL)
+    {
+        record->payload[0].size = firstSize;
+        record->payload[0].buffer = first;
+        if (second != NULL)
+        {
+            record->payload[1].size = secondSize;
+            record->payload[1].buffer = second;
+        }
+    }
+}
+
+static void test_setup_records(void)
+{
+    test_record(RECORD_BULK_CBW, USBPCAP_TRANSFER_BULK, 0x02, 0,
+                sizeof(g_cbw), g_cbw, sizeof(g_cbw), NULL, 0);
+    test_record(RECORD_BULK_SHORT, USBPCAP_TRANSFER_BULK, 0x02, 0,
+                2, g_cbw, 2, NULL, 0);
+    test_record(RECORD_BULK_EMPTY, USBPCAP_TRANSFER_BULK, 0x02, 0,
+                0, NULL, 0, NULL, 0);
+    test_record(RECORD_BULK_TRUNCATED, USBPCAP_TRANSFER_BULK, 0x02, 0,
+                sizeof(g_cbw), g_cbw, 2, NULL, 0);
+    test_record(RECORD_BULK_SPLIT, USBPCAP_TRANSFER_BULK, 0x02, 0,
+                sizeof(g_cbw), g_cbw, 1, &g_cbw[1], sizeof(g_cbw) - 1);
+    test_record(RECORD_INTERRUPT_EMPTY, USBPCAP_TRANSFER_INTERRUPT, 0x81, 0,
+                0, NULL, 0, NULL, 0);
+    test_record(RECORD_SETUP_ONLY, USBPCAP_TRANSFER_CONTROL, 0x80,
+                USBPCAP_CONTROL_STAGE_SETUP, 8, g_setup, 8, NULL, 0);
+    test_record(RECORD_SETUP_DATA, USBPCAP_TRANSFER_CONTROL, 0x80,
+                USBPCAP_CONTROL_STAGE_SETUP, sizeof(g_setup),
+                g_setup, sizeof(g_setup), NULL, 0);
+}
+
+/* Expression and the records it must match, as bit mask of RECORD_* */
+struct test_filter
+{
+    const char *expression;
+    UINT32      matches;
+};
+
+#define R(record)  (1UL << (record))
+#define R_ALL      ((1UL << RECORD_COUNT) - 1)
+
+/* Records with at least 4 payload bytes 55:53:42:43 */
+#define R_USBC     (R(RECORD_BULK_CBW) | R(RECORD_BULK_SPLIT) | \
+                    R(RECORD_SETUP_DATA))
+#define R_BULK     (R(RECORD_BULK_CBW) | R(RECORD_BULK_SHORT) | \
+                    R(RECORD_BULK_EMPTY) | R(RECORD_BULK_TRUNCATED) | \
+                    R(RECORD_BULK_SPLIT))
+/* Records with at least 1 payload byte, all of them start with 0x55 */
+#define R_DATA     (R_USBC | R(RECORD_BULK_SHORT) | R(RECORD_BULK_TRUNCATED))
+
+static const struct test_filter g_filters[] =
+{
+    {"usb.capdata",                                        R_DATA},
+    {"!usb.capdata",                                       R_ALL & ~R_DATA},
+    {"usb.capdata[3]",                                     R_USBC},
+    {"usb.capdata[0:4] == 55:53:42:43",                    R_USBC},
+    {"usb.capdata[0:4] != 55:53:42:43",                    0},
+    {"usb.capdata[0:4] != 55:53:42:44",                    R_USBC},
+    {"!(usb.capdata[0:4] == 55:53:42:43)",                 R_ALL & ~R_USBC},
+    {"usb.capdata[0:2] == 55:53",                          R_DATA},
+    {"usb.capdata[2:2] == 42:43",                          R_USBC},
+    {"usb.capdata[0] == 0x55",                             R_DATA},
+    {"!(usb.capdata[0] == 0x55)",                          R_ALL & ~R_DATA},
+    {"usb.capdata[30] == 0",                               R(RECORD_BULK_CBW) |
+                                                           R(RECORD_BULK_SPLIT)},
+    {"usb.capdata[31] == 0 || usb.capdata[0] == 0x55",     R_DATA},
+    {"usb.capdata[0:4] == 55:53:42:43 || usb.transfer_type == 1",
+                                                           R_USBC |
+                                                           R(RECORD_INTERRUPT_EMPTY)},
+    {"usb.transfer_type == 3 || usb.capdata[0:4] == 55:53:42:43",
+                                                           R_BULK | R_USBC},
+    {"usb.capdata[0:4] == 55:53:42:43 && usb.transfer_type == 3",
+                                                           R(RECORD_BULK_CBW) |
+                                                           R(RECORD_BULK_SPLIT)},
+    {"usb.transfer_type == 3 && !(usb.capdata[0:4] == 55:53:42:43)",
+                                                           R(RECORD_BULK_SHORT) |
+                                                           R(RECORD_BULK_EMPTY) |
+                                                           R(RECORD_BULK_TRUNCATED)},
+    {"!(usb.capdata[0:4] == 55:53:42:43 || usb.capdata[0] == 0x55)",
+                                                           R_ALL & ~R_DATA},
+    {"!(usb.capdata[0:4] == 55:53:42:43 && usb.device_address == 5)",
+                                                           R_ALL & ~R_USBC},
+    {"usb.bmRequestType == 0x80 && usb.capdata[0:4] == 55:53:42:43",
+                                                           R(RECORD_SETUP_DATA)},
+    {"usb.bmRequestType == 0x80 && !(usb.capdata[0] == 0x55)",
+                                                           R(RECORD_SETUP_ONLY)},
+};
+
+#define TEST_FILTERS  (sizeof(g_filters) / sizeof(g_filters[0]))
+
+static void test_filters(void)
+{
+    size_t i;
+    int    r;
+
+    for (i = 0; i < TEST_FILTERS; i++)
+    {
+        PUSBPCAP_BPF_PROGRAM program;
+
+        program = bpf_compile_filter(g_filters[i].expression);
+        CHECK(program != NULL, "\"%s\" not compiled", g_filters[i].expression);
+        if (program == NULL)
+        {
+            continue;
+        }
+        CHECK(USBPcapBPFValidate(program->insn, program->numberOfInstructions),
+              "\"%s\" rejected by validator", g_filters[i].expression);
+
+        for (r = 0; r < RECORD_COUNT; r++)
+        {
+            struct test_record *record = &g_records[r];
+            BOOLEAN             expected;
+            BOOLEAN             result;
+
+            expected = (g_filters[i].matches & R(r)) ? TRUE : FALSE;
+            result = USBPcapBPFRun(program->insn, &record->header,
+                                   record->headerLen, record->payload,
+                                   record->dataLength) ? TRUE : FALSE;
+            CHECK(result == expected, "\"%s\" on record %d: %s",
+                  g_filters[i].expression, r,
+                  result ? "matched" : "not matched");
+        }
+        free(program);
+    }
+}
+
+int main(void)
+{
+    test_setup_records();
+    test_filters();
+
+    if (g_failures > 0)
+    {
+        fprintf(stderr, "bpftest: %d checks failed\n", g_failures);
+        return 1;
+    }
+    printf("bpftest: passed\n");
+    return 0;
+}
@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * usbpcap-convert round trip. DLT_USBPCAP capture is converted to usbmon
+ * and back, and usbmon capture to DLT_USBPCAP and back, with microsecond
+ * and nanosecond timestamps. Timestamp resolution and every record must
+ * survive both conversions.
+ *
+ * Usage: converttest <directory with usbpcap-convert>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pcapfile.h"
+
+#define DLT_USB_LINUX_MMAPPED   220
+#define WRITER_BUFFER_SIZE      (64 * 1024)
+
+/* Nanosecond part that does not fit microseconds */
+#define BASE_TIMESTAMP          1700000000123456789ULL
+
+static const char *g_directory;
+static int         g_failures;
+
+#define CHECK(condition, ...) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__); \
+            fprintf(stderr, "\n"); \
+            g_failures++; \
+        } \
+    } \
+    while (0)
+
+typedef struct _TEST_RECORD
+{
+    UCHAR   info;
+    UCHAR   endpoint;
+    UCHAR   transfer;
+    UINT32  dataLength;
+} TEST_RECORD;
+
+/* Bulk and interrupt submissions and completions as the driver logs them:
+ * OUT data in submission, IN data in completion.
+ */
+static const TEST_RECORD g_records[] =
+{
+    {0,                       0x02, USBPCAP_TRANSFER_BULK,      512},
+    {USBPCAP_INFO_PDO_TO_FDO, 0x02, USBPCAP_TRANSFER_BULK,      0},
+    {0,                       0x81, USBPCAP_TRANSFER_BULK,      0},
+    {USBPCAP_INFO_PDO_TO_FDO, 0x81, USBPCAP_TRANSFER_BULK,      13},
+    {0,                       0x83, USBPCAP_TRANSFER_INTERRUPT, 0},
+    {USBPCAP_INFO_PDO_TO_FDO, 0x83, USBPCAP_TRANSFER_INTERRUPT, 8},
+};
+
+#define TEST_RECORDS  (sizeof(g_records) / sizeof(g_records[0]))
+
+static UINT64 test_timestamp(BOOLEAN nanoseconds, size_t i)
+{
+    UINT64 timestamp = BASE_TIMESTAMP + i * 1001;
+
+    return nanoseconds ? timestamp : timestamp - timestamp % 1000;
+}
+
+static int test_write_usbpcap(const char *filename, BOOLEAN nanoseconds)
+{
+    PCAP_WRITER  writer;
+    char         error[256];
+    size_t       i;
+    UINT32       j;
+
+    if (pcap_writer_open(&writer, filename, WRITER_BUFFER_SIZE,
+                         error, sizeof(error)) != 0)
+    {
+        fprintf(stderr, "%s\n", error);
+        return -1;
+    }
+
+    pcap_writer_header(&writer, nanoseconds, 65535, DLT_USBPCAP);
+    for (i = 0; i < TEST_RECORDS; i++)
+    {
+        USBPCAP_BUFFER_PACKET_HEADER  header;
+        UCHAR                        *data;
+
+        memset(&header, 0, sizeof(header));
+        header.headerLen = sizeof(header);
+        header.irpId = 0xFFFF800012340000ULL + (i / 2) * 0x40;
+        header.status = USBD_STATUS_SUCCESS;
+        header.function = URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER;
+        header.info = g_records[i].info;
+        header.bus = 1;
+        header.device = 5;
+        header.endpoint = g_records[i].endpoint;
+        header.transfer = g_records[i].transfer;
+        header.dataLength = g_records[i].dataLength;
+
+        pcap_writer_record(&writer, test_timestamp(nanoseconds, i),
+                           sizeof(header) + header.dataLength,
+                           sizeof(header) + header.dataLength);
+        pcap_writer_write(&writer, &header, sizeof(header));
+        data = pcap_writer_reserve(&writer, header.dataLength);
+        for (j = 0; j < header.dataLength; j++)
+        {
+            data[j] = (UCHAR)(i * 31 + j);
+        }
+    }
+
+    return pcap_writer_close(&writer);
+}
+
+static int test_convert(const char *input, const char *output)
+{
+    char command[1024];
+
+    snprintf(command, sizeof(command), "%s/usbpcap-convert %s %s",
+             g_directory, input, output);
+    return system(command);
+}
+
+/* Checks resolution and timestamps of converted file */
+static void test_check_file(const char *filename, BOOLEAN nanoseconds,
+                            UINT32 network, PPCAP_FILE file)
+{
+    PCAP_RECORD  record;
+    UINT64       offset = PCAP_FIRST_RECORD;
+    char         error[256];
+    size_t       i;
+
+    file->data = NULL;
+    if (pcap_open(file, filename, error, sizeof(error)) != 0)
+    {
+        CHECK(FALSE, "%s", error);
+        file->data = NULL;
+        return;
+    }
+
+    CHECK(file->network == network, "%s: link type %u", filename, file->network);
+    CHECK(file->nanoseconds == nanoseconds, "%s: %s timestamps", filename,
+          file->nanoseconds ? "nanosecond" : "microsecond");
+
+    for (i = 0; pcap_read_record(file, offset, &record) == 1; i++)
+    {
+        offset += sizeof(pcaprec_hdr_t) + record.inclLen;
+        CHECK((i >= TEST_RECORDS) ||
+              (record.timestamp == test_timestamp(nanoseconds, i)),
+              "%s: record %u timestamp %llu instead of %llu", filename,
+              (unsigned)i, (unsigned long long)record.timestamp,
+              (unsigned long long)test_timestamp(nanoseconds, i));
+    }
+    CHECK(i == TEST_RECORDS, "%s: %u records", filename, (unsigned)i);
+}
+
+/* Compares all records of two files with the same link type */
+static void test_compare(const PCAP_FILE *a, const PCAP_FILE *b,
+                         const char *name)
+{
+    PCAP_RECORD  ra;
+    PCAP_RECORD  rb;
+    UINT64       offsetA = PCAP_FIRST_RECORD;
+    UINT64       offsetB = PCAP_FIRST_RECORD;
+    size_t       i = 0;
+
+    while (pcap_read_record(a, offsetA, &ra) == 1)
+    {
+        if (pcap_read_record(b, offsetB, &rb) != 1)
+        {
+            CHECK(FALSE, "%s: record %u missing", name, (unsigned)i);
+            return;
+        }
+        CHECK((ra.timestamp == rb.timestamp) &&
+              (ra.inclLen == rb.inclLen) && (ra.origLen == rb.origLen) &&
+              (memcmp(ra.data, rb.data, ra.inclLen) == 0),
+              "%s: record %u differs", name, (unsigned)i);
+        offsetA += sizeof(pcaprec_hdr_t) + ra.inclLen;
+        offsetB += sizeof(pcaprec_hdr_t) + rb.inclLen;
+        i++;
+    }
+    CHECK(pcap_read_record(b, offsetB, &rb) == 0, "%s: extra records", name);
+}
+
+static void test_roundtrip(BOOLEAN nanoseconds)
+{
+    const char *resolution = nanoseconds ? "ns" : "us";
+    char        usbpcap[512];
+    char        usbmon[512];
+    char        usbpcap2[512];
+    char        usbmon2[512];
+    PCAP_FILE   original;
+    PCAP_FILE   converted;
+    PCAP_FILE   back;
+    PCAP_FILE   again;
+
+    snprintf(usbpcap, sizeof(usbpcap), "%s/tests/convert-%s.pcap",
+             g_directory, resolution);
+    snprintf(usbmon, sizeof(usbmon), "%s/tests/convert-%s-usbmon.pcap",
+             g_directory, resolution);
+    snprintf(usbpcap2, sizeof(usbpcap2), "%s/tests/convert-%s-back.pcap",
+             g_directory, resolution);
+    snprintf(usbmon2, sizeof(usbmon2), "%s/tests/convert-%s-usbmon-back.pcap",
+             g_directory, resolution);
+
+    if (test_write_usbpcap(usbpcap, nanoseconds) != 0)
+    {
+        CHECK(FALSE, "%s: write failed", usbpcap);
+        return;
+    }
+
+    /* DLT_USBPCAP -> usbmon -> DLT_USBPCAP */
+    CHECK(test_convert(usbpcap, usbmon) == 0, "%s: conversion failed", usbmon);
+    CHECK(test_convert(usbmon, usbpcap2) == 0, "%s: conversion failed", usbpcap2);
+    /* usbmon -> DLT_USBPCAP -> usbmon */
+    CHECK(test_convert(usbpcap2, usbmon2) == 0, "%s: conversion failed", usbmon2);
+
+    test_check_file(usbpcap, nanoseconds, DLT_USBPCAP, &original);
+    test_check_file(usbmon, nanoseconds, DLT_USB_LINUX_MMAPPED, &converted);
+    test_check_file(usbpcap2, nanoseconds, DLT_USBPCAP, &back);
+    test_check_file(usbmon2, nanoseconds, DLT_USB_LINUX_MMAPPED, &again);
+
+    if ((original.data != NULL) && (back.data != NULL))
+    {
+        test_compare(&original, &back, usbpcap2);
+    }
+    if ((converted.data != NULL) && (again.data != NULL))
+    {
+        test_compare(&converted, &again, usbmon2);
+    }
+
+    pcap_close(&original);
+    pcap_close(&converted);
+    pcap_close(&back);
+    pcap_close(&again);
+    remove(usbpcap);
+    remove(usbmon);
+    remove(usbpcap2);
+    remove(usbmon2);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s <directory with usbpcap-convert>\n", argv[0]);
+        return 1;
+    }
+    g_directory = argv[1];
+
+    test_roundtrip(FALSE);
+    test_roundtrip(TRUE);
+
+    if (g_failures > 0)
+    {
+        fprintf(stderr, "converttest: %d checks failed\n", g_failures);
+        return 1;
+    }
+    printf("converttest: passed\n");
+    return 0;
+}
@@ -0,0 +1,449 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * usbpcap-index against usbpcap-scan. Capture of control, interrupt, bulk
+ * and isochronous submissions and completions, large enough to be split
+ * in many chunks, is indexed with different number of threads:
+ *   * index file is the same for every thread count, also when bulk
+ *     payloads hold runs of valid looking records a chunk could resync to
+ *   * every query gives the same count and the same records as
+ *     usbpcap-scan with the same filter options
+ *
+ * Usage: indextest <directory with usbpcap-index and usbpcap-scan>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pcapfile.h"
+
+#define TEST_TRANSFERS      20000
+#define WRITER_BUFFER_SIZE  (1024 * 1024)
+
+/* Microseconds, pcap_writer_record() takes nanoseconds */
+#define BASE_TIMESTAMP      1700000000000000ULL
+
+/* Bulk payload with records inside it every this many transfers. These
+ * payloads take most of the capture, so most chunk boundaries fall
+ * inside them.
+ */
+#define FAKE_INTERVAL       20
+#define FAKE_LENGTH         32768
+#define FAKE_RECORDS        12
+
+static const int g_threads[] = {1, 2, 3, 4, 7, 16};
+
+#define TEST_THREADS  (sizeof(g_threads) / sizeof(g_threads[0]))
+
+/* Filter options accepted by both usbpcap-index query and usbpcap-scan */
+static const char *g_queries[] =
+{
+    "-d 5",
+    "-d 5 -e 0x81",
+    "--bus 2 -d 3",
+    "-t bulk",
+    "-t isochronous",
+    "-t control -E",
+    "-E",
+    "-I 0xFFFF800000001040",
+    "-f 1 -T 2.5",
+    "-d 7 -t interrupt -f 0.5",
+    "-d 100",
+};
+
+#define TEST_QUERIES  (sizeof(g_queries) / sizeof(g_queries[0]))
+
+static const char *g_directory;
+static UINT32      g_random = 0x2545F491;
+static int         g_failures;
+
+#define CHECK(condition, ...) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__); \
+            fprintf(stderr, "\n"); \
+            g_failures++; \
+        } \
+    } \
+    while (0)
+
+static UINT32 test_random(void)
+{
+    g_random ^= g_random << 13;
+    g_random ^= g_random >> 17;
+    g_random ^= g_random << 5;
+    return g_random;
+}
+
+/* Fills USBPcap header of record with headerLen bytes of header and
+ * dataLength bytes of payload.
+ */
+static void test_header(UCHAR *buffer, USHORT headerLen, UINT64 irpId,
+                        USBD_STATUS status, UCHAR info, USHORT bus,
+                        USHORT device, UCHAR endpoint, UCHAR transfer,
+                        UINT32 dataLength)
+{
+    USBPCAP_BUFFER_PACKET_HEADER header;
+
+    memset(buffer, 0, headerLen);
+    header.headerLen = headerLen;
+    header.irpId = irpId;
+    header.status = status;
+    header.function = (transfer == USBPCAP_TRANSFER_CONTROL) ?
+                      URB_FUNCTION_CONTROL_TRANSFER :
+                      ((transfer == USBPCAP_TRANSFER_ISOCHRONOUS) ?
+                       URB_FUNCTION_ISOCH_TRANSFER :
+                       URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER);
+    header.info = info;
+    header.bus = bus;
+    header.device = device;
+    header.endpoint = endpoint;
+    header.transfer = transfer;
+    header.dataLength = dataLength;
+    memcpy(buffer, &header, sizeof(header));
+
+    if (transfer == USBPCAP_TRANSFER_CONTROL)
+    {
+        ((PUSBPCAP_BUFFER_CONTROL_HEADER)buffer)->stage =
+            (info & USBPCAP_INFO_PDO_TO_FDO) ? USBPCAP_CONTROL_STAGE_COMPLETE :
+                                               USBPCAP_CONTROL_STAGE_SETUP;
+    }
+    else if (transfer == USBPCAP_TRANSFER_ISOCHRONOUS)
+    {
+        PUSBPCAP_BUFFER_ISOCH_HEADER isoch = (PUSBPCAP_BUFFER_ISOCH_HEADER)buffer;
+        ULONG                        packets;
+        ULONG                        i;
+
+        packets = (headerLen - sizeof(USBPCAP_BUFFER_ISOCH_HEADER)) /
+                  sizeof(USBPCAP_BUFFER_ISO_PACKET) + 1;
+        isoch->numberOfPackets = packets;
+        for (i = 0; i < packets; i++)
+        {
+            isoch->packet[i].offset = dataLength / packets * i;
+            isoch->packet[i].length = dataLength / packets;
+        }
+    }
+}
+
+/* Writes FAKE_RECORDS bulk records, with pcap record headers, filling
+ * exactly length bytes. Returns FALSE if they do not fit.
+ */
+static BOOLEAN test_fake_records(UCHAR *buffer, UINT32 length,
+                                 UINT64 timestamp)
+{
+    UINT32 overhead = sizeof(pcaprec_hdr_t) + sizeof(USBPCAP_BUFFER_PACKET_HEADER);
+    UINT32 dataLength;
+    int    i;
+
+    if (length < FAKE_RECORDS * overhead)
+    {
+        return FALSE;
+    }
+    dataLength = (length - FAKE_RECORDS * overhead) / FAKE_RECORDS;
+
+    for (i = 0; i < FAKE_RECORDS; i++)
+    {
+        pcaprec_hdr_t  record;
+        UINT32         size = dataLength;
+
+        if (i == FAKE_RECORDS - 1)
+        {
+            /* Last one ends where the real payload ends */
+            size = length - overhead;
+        }
+
+        record.ts_sec = (UINT32)((timestamp + i) / 1000000);
+        record.ts_usec = (UINT32)((timestamp + i) % 1000000);
+        record.incl_len = sizeof(USBPCAP_BUFFER_PACKET_HEADER) + size;
+        record.orig_len = record.incl_len;
+        memcpy(buffer, &record, sizeof(record));
+        buffer += sizeof(record);
+
+        test_header(buffer, sizeof(USBPCAP_BUFFER_PACKET_HEADER),
+                    0xDEAD0000 + i, USBD_STATUS_SUCCESS, 0, 9, 99, 0x0F,
+                    USBPCAP_TRANSFER_BULK, size);
+        buffer += sizeof(USBPCAP_BUFFER_PACKET_HEADER);
+        memset(buffer, 0x5A, size);
+        buffer += size;
+        length -= overhead + size;
+    }
+
+    return TRUE;
+}
+
+static int test_write_capture(const char *filename)
+{
+    static UCHAR  record[sizeof(USBPCAP_BUFFER_CONTROL_HEADER) + 65536];
+    PCAP_WRITER   writer;
+    char          error[256];
+    UINT64        timestamp = BASE_TIMESTAMP;
+    UINT32        i;
+    int           stage;
+
+    if (pcap_writer_open(&writer, filename, WRITER_BUFFER_SIZE,
+                         error, sizeof(error)) != 0)
+    {
+        fprintf(stderr, "%s\n", error);
+        return -1;
+    }
+    pcap_writer_header(&writer, FALSE, 65535, DLT_USBPCAP);
+
+    for (i = 0; i < TEST_TRANSFERS; i++)
+    {
+        UINT32  dice = test_random() % 100;
+        UCHAR   transfer;
+        UCHAR   endpoint;
+        USHORT  headerLen;
+        UINT32  length;
+        USHORT  bus = (USHORT)(test_random() % 3 + 1);
+        USHORT  device = (USHORT)(test_random() % 12 + 1);
+        /* IRPs are reused */
+        UINT64  irpId = 0xFFFF800000000000ULL + (test_random() % 4096) * 0x40;
+        BOOLEAN in = (test_random() & 1) ? TRUE : FALSE;
+
+        if ((dice < 50) || ((i % FAKE_INTERVAL) == 0))
+        {
+            transfer = USBPCAP_TRANSFER_BULK;
+            endpoint = (UCHAR)(in ? 0x81 : 0x02);
+            headerLen = sizeof(USBPCAP_BUFFER_PACKET_HEADER);
+            length = test_random() % 400;
+            if ((i % FAKE_INTERVAL) == 0)
+            {
+                length = FAKE_LENGTH;
+                in = FALSE;
+                endpoint = 0x02;
+            }
+        }
+        else if (dice < 70)
+        {
+            transfer = USBPCAP_TRANSFER_INTERRUPT;
+            endpoint = 0x83;
+            in = TRUE;
+            headerLen = sizeof(USBPCAP_BUFFER_PACKET_HEADER);
+            length = test_random() % 64;
+        }
+        else if (dice < 90)
+        {
+            transfer = USBPCAP_TRANSFER_CONTROL;
+            endpoint = 0x00;
+            headerLen = sizeof(USBPCAP_BUFFER_CONTROL_HEADER);
+            length = test_random() % 64;
+        }
+        else
+        {
+            transfer = USBPCAP_TRANSFER_ISOCHRONOUS;
+            endpoint = (UCHAR)(in ? 0x84 : 0x04);
+            headerLen = (USHORT)(sizeof(USBPCAP_BUFFER_ISOCH_HEADER) +
+                                 (test_random() % 8) *
+                                 sizeof(USBPCAP_BUFFER_ISO_PACKET));
+            length = 192 * (test_random() % 8 + 1);
+        }
+
+        /* Submission carries OUT data (and Setup packet), completion IN
+         * data.
+         */
+        for (stage = 0; stage < 2; stage++)
+        {
+            UCHAR       info = (stage == 1) ? USBPCAP_INFO_PDO_TO_FDO : 0;
+            UINT32      dataLength = 0;
+            USBD_STATUS status = USBD_STATUS_SUCCESS;
+
+            if (transfer == USBPCAP_TRANSFER_CONTROL)
+            {
+                dataLength = (stage == 0) ? 8 + (in ? 0 : length) :
+                                            (in ? length : 0);
+            }
+            else if ((stage == 1) == in)
+            {
+                dataLength = length;
+            }
+            if ((stage == 1) && (test_random() % 100 < 3))
+            {
+                status = USBD_STATUS_STALL_PID;
+            }
+
+            test_header(record, headerLen, irpId, status, info, bus, device,
+                        endpoint, transfer, dataLength);
+            if (((i % FAKE_INTERVAL) != 0) ||
+                !test_fake_records(&record[headerLen], dataLength,
+                                   timestamp + 1))
+            {
+                memset(&record[headerLen], (int)(i & 0xFF), dataLength);
+            }
+
+            timestamp += 1 + test_random() % 100;
+            pcap_writer_record(&writer, timestamp * 1000,
+                               headerLen + dataLength, headerLen + dataLength);
+            pcap_writer_write(&writer, record, headerLen + dataLength);
+        }
+    }
+
+    return pcap_writer_close(&writer);
+}
+
+/* Runs command, returns its exit status */
+static int test_run(const char *command)
+{
+    int status = system(command);
+
+    CHECK(status == 0, "%s: exit status %d", command, status);
+    return status;
+}
+
+/* Reads whole file, returns NULL on failure */
+static UCHAR *test_read_file(const char *filename, size_t *length)
+{
+    FILE  *file;
+    UCHAR *data;
+    long   size;
+
+    file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    data = (UCHAR *)malloc(size + 1);
+    if ((data != NULL) && (fread(data, 1, size, file) != (size_t)size))
+    {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    *length = (size_t)size;
+    return data;
+}
+
+static BOOLEAN test_same_files(const char *a, const char *b)
+{
+    UCHAR   *dataA;
+    UCHAR   *dataB;
+    size_t   lengthA = 0;
+    size_t   lengthB = 0;
+    BOOLEAN  same;
+
+    dataA = test_read_file(a, &lengthA);
+    dataB = test_read_file(b, &lengthB);
+    same = ((dataA != NULL) && (dataB != NULL) && (lengthA == lengthB) &&
+            (memcmp(dataA, dataB, lengthA) == 0)) ? TRUE : FALSE;
+    free(dataA);
+    free(dataB);
+    return same;
+}
+
+/* Compares query with index built by threads with usbpcap-scan */
+static void test_query(const char *capture, int threads, const char *query)
+{
+    char command[2048];
+    char indexCount[512];
+    char scanCount[512];
+    char indexRecords[512];
+    char scanRecords[512];
+
+    snprintf(indexCount, sizeof(indexCount), "%s/tests/index-query.txt", g_directory);
+    snprintf(scanCount, sizeof(scanCount), "%s/tests/index-scan.txt", g_directory);
+    snprintf(indexRecords, sizeof(indexRecords), "%s/tests/index-query.pcap", g_directory);
+    snprintf(scanRecords, sizeof(scanRecords), "%s/tests/index-scan.pcap", g_directory);
+
+    snprintf(command, sizeof(command),
+             "%s/usbpcap-index query -i %s/tests/index-%d.idx -c %s %s > %s",
+             g_directory, g_directory, threads, query, capture, indexCount);
+    test_run(command);
+    snprintf(command, sizeof(command), "%s/usbpcap-scan -c %s %s > %s",
+             g_directory, query, capture, scanCount);
+    test_run(command);
+    CHECK(test_same_files(indexCount, scanCount),
+          "-j %d query %s: count differs from scan", threads, query);
+
+    snprintf(command, sizeof(command),
+             "%s/usbpcap-index query -i %s/tests/index-%d.idx -w %s %s %s",
+             g_directory, g_directory, threads, indexRecords, query, capture);
+    test_run(command);
+    snprintf(command, sizeof(command), "%s/usbpcap-scan -w %s %s %s",
+             g_directory, scanRecords, query, capture);
+    test_run(command);
+    CHECK(test_same_files(indexRecords, scanRecords),
+          "-j %d query %s: records differ from scan", threads, query);
+
+    remove(indexCount);
+    remove(scanCount);
+    remove(indexRecords);
+    remove(scanRecords);
+}
+
+int main(int argc, char *argv[])
+{
+    char    capture[512];
+    char    index[512];
+    char    first[512];
+    char    command[2048];
+    size_t  i;
+    size_t  j;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <directory with usbpcap-index and "
+                "usbpcap-scan>\n", argv[0]);
+        return 1;
+    }
+    g_directory = argv[1];
+
+    snprintf(capture, sizeof(capture), "%s/tests/index.pcap", g_directory);
+    if (test_write_capture(capture) != 0)
+    {
+        fprintf(stderr, "%s: write failed\n", capture);
+        return 1;
+    }
+
+    snprintf(first, sizeof(first), "%s/tests/index-%d.idx", g_directory,
+             g_threads[0]);
+    for (i = 0; i < TEST_THREADS; i++)
+    {
+        snprintf(index, sizeof(index), "%s/tests/index-%d.idx", g_directory,
+                 g_threads[i]);
+        snprintf(command, sizeof(command),
+                 "%s/usbpcap-index build -j %d -i %s %s > /dev/null",
+                 g_directory, g_threads[i], index, capture);
+        if (test_run(command) != 0)
+        {
+            continue;
+        }
+        CHECK(test_same_files(first, index),
+              "index built with -j %d differs from -j %d",
+              g_threads[i], g_threads[0]);
+    }
+
+    for (i = 0; i < TEST_THREADS; i += TEST_THREADS - 1)
+    {
+        for (j = 0; j < TEST_QUERIES; j++)
+        {
+            test_query(capture, g_threads[i], g_queries[j]);
+        }
+    }
+
+    for (i = 0; i < TEST_THREADS; i++)
+    {
+        snprintf(index, sizeof(index), "%s/tests/index-%d.idx", g_directory,
+                 g_threads[i]);
+        remove(index);
+    }
+    remove(capture);
+
+    if (g_failures > 0)
+    {
+        fprintf(stderr, "indextest: %d checks failed\n", g_failures);
+        return 1;
+    }
+    printf("indextest: passed\n");
+    return 0;
+}
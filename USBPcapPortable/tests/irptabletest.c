@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * URB IRP table soak. Millions of IRPs go through USBPcapAddURBIRPInfo()
+ * and USBPcapObtainURBIRPInfo() as they do in USBPcapAnalyzeURB(), most
+ * of them coming back after short time, some late and some never:
+ *   * the table never holds more than USBPCAP_URB_IRP_TABLE_MAX_ENTRIES
+ *   * IRP that comes back within USBPCAP_URB_IRP_MAX_AGE generations is
+ *     found with the data it was added with
+ *   * IRP that comes back after more than USBPCAP_URB_IRP_MAX_AGE + 1
+ *     generations, and IRP that never comes back, was evicted
+ *   * when IRPs stop coming back, the oldest ones are evicted first
+ *   * every IRP was either obtained, evicted or is still in the table
+ *
+ * Usage: irptabletest [<directory> [<IRPs> [<seed>]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "USBPcapMain.h"
+#include "USBPcapTables.h"
+
+#define SOAK_IRPS           4000000
+
+/* IRP latencies in insertions */
+#define GENERATION          USBPCAP_URB_IRP_GENERATION_LENGTH
+#define LATENCY_KEPT        (USBPCAP_URB_IRP_MAX_AGE * GENERATION)
+#define LATENCY_EVICTED     ((USBPCAP_URB_IRP_MAX_AGE + 2) * GENERATION)
+
+/* Completion schedule, larger than any latency */
+#define SCHEDULE            4096
+#define NO_IRP              0xFFFFFFFFU
+
+static UINT32 g_random = 0x6C078965;
+static int    g_failures;
+
+#define CHECK(condition, ...) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__); \
+            fprintf(stderr, "\n"); \
+            g_failures++; \
+        } \
+    } \
+    while (0)
+
+typedef struct _SOAK
+{
+    USBPCAP_DEVICE_DATA  device;
+    UINT32               added;
+    UINT64               evicted;
+    UINT64               obtained;
+    UINT32               maxEntries;
+    /* IRPs to obtain at every insertion, linked through next[] */
+    UINT32               head[SCHEDULE];
+    UINT32               next[SCHEDULE];
+    UINT32               latency[SCHEDULE];
+} SOAK;
+
+static UINT32 soak_random(void)
+{
+    g_random ^= g_random << 13;
+    g_random ^= g_random >> 17;
+    g_random ^= g_random << 5;
+    return g_random;
+}
+
+/* IRP pointers are only compared, never dereferenced */
+static PIRP soak_irp(UINT32 seq)
+{
+    return (PIRP)(ULONG_PTR)(0x10000 + (UINT64)seq * 0x40);
+}
+
+static void soak_add(SOAK *soak)
+{
+    USBPCAP_URB_IRP_INFO  info;
+    KIRQL                 irql;
+    UINT32                seq = soak->added++;
+    ULONG                 before;
+    ULONG                 after;
+    ULONG                 evicted;
+
+    memset(&info, 0, sizeof(info));
+    info.irp = soak_irp(seq);
+    info.timestamp.QuadPart = seq;
+    info.status = USBD_STATUS_PENDING;
+    info.function = (USHORT)(seq & 0x3F);
+    info.bus = 1;
+    info.device = (USHORT)(seq % 127 + 1);
+
+    KeAcquireSpinLock(&soak->device.tablesSpinLock, &irql);
+    before = RtlNumberGenericTableElements(soak->device.URBIrpTable);
+    evicted = USBPcapAddURBIRPInfo(soak->device.URBIrpTable, &info);
+    after = RtlNumberGenericTableElements(soak->device.URBIrpTable);
+    KeReleaseSpinLock(&soak->device.tablesSpinLock, irql);
+
+    CHECK(after <= USBPCAP_URB_IRP_TABLE_MAX_ENTRIES,
+          "%u entries after IRP %u", (unsigned)after, seq);
+    CHECK(after == before + 1 - evicted,
+          "IRP %u: %u entries, %u before, %u evicted", seq,
+          (unsigned)after, (unsigned)before, (unsigned)evicted);
+    soak->evicted += evicted;
+    if (after > soak->maxEntries)
+    {
+        soak->maxEntries = after;
+    }
+}
+
+/* Returns TRUE if IRP was in the table */
+static BOOLEAN soak_obtain(SOAK *soak, UINT32 seq)
+{
+    USBPCAP_URB_IRP_INFO  info;
+
+    if (USBPcapObtainURBIRPInfo(&soak->device, soak_irp(seq), &info) == FALSE)
+    {
+        return FALSE;
+    }
+
+    CHECK((info.irp == soak_irp(seq)) &&
+          (info.timestamp.QuadPart == seq) &&
+          (info.function == (seq & 0x3F)) &&
+          (info.device == seq % 127 + 1),
+          "IRP %u obtained with data of other IRP", seq);
+    soak->obtained++;
+    return TRUE;
+}
+
+/* IRPs coming back at random times, IRPs in flight stay well below the
+ * table size so only aging evicts.
+ */
+static void soak_steady(SOAK *soak, UINT32 irps)
+{
+    UINT32 found = 0;
+    UINT32 missing = 0;
+    UINT32 maxEntries = 0;
+    UINT32 i;
+
+    for (i = 0; i < SCHEDULE; i++)
+    {
+        soak->head[i] = NO_IRP;
+    }
+
+    for (i = 0; i < irps + LATENCY_EVICTED + 1; i++)
+    {
+        UINT32 seq;
+        UINT32 slot;
+
+        if (i < irps)
+        {
+            UINT32 dice = soak_random() % 1000;
+            UINT32 latency;
+
+            if (dice < 900)
+            {
+                /* Short transfers */
+                latency = soak_random() % 64;
+            }
+            else if (dice < 980)
+            {
+                /* Long transfers, up to the age limit */
+                latency = soak_random() % LATENCY_KEPT;
+            }
+            else if (dice < 995)
+            {
+                /* Stale, checked to be gone */
+                latency = LATENCY_EVICTED + soak_random() % GENERATION;
+            }
+            else
+            {
+                /* In between, may or may not be found */
+                latency = LATENCY_KEPT + soak_random() % (LATENCY_EVICTED - LATENCY_KEPT);
+            }
+
+            seq = soak->added;
+            soak_add(soak);
+
+            slot = seq % SCHEDULE;
+            soak->latency[slot] = latency;
+            soak->next[slot] = soak->head[(seq + latency) % SCHEDULE];
+            soak->head[(seq + latency) % SCHEDULE] = seq;
+        }
+
+        /* Everything scheduled for now comes back */
+        slot = i % SCHEDULE;
+        for (seq = soak->head[slot]; seq != NO_IRP; seq = soak->next[seq % SCHEDULE])
+        {
+            UINT32  latency = soak->latency[seq % SCHEDULE];
+            BOOLEAN inTable = soak_obtain(soak, seq);
+
+            if (latency < LATENCY_KEPT)
+            {
+                CHECK(inTable == TRUE, "IRP %u back after %u insertions not found",
+                      seq, latency);
+            }
+            else if (latency >= LATENCY_EVICTED)
+            {
+                CHECK(inTable == FALSE, "IRP %u back after %u insertions still "
+                      "in table", seq, latency);
+            }
+            found += inTable ? 1 : 0;
+            missing += inTable ? 0 : 1;
+        }
+        soak->head[slot] = NO_IRP;
+
+        /* Keep inserting IRPs that do not come back while the last
+         * scheduled ones do.
+         */
+        if (i == irps)
+        {
+            maxEntries = soak->maxEntries;
+        }
+        if (i >= irps)
+        {
+            soak_add(soak);
+        }
+    }
+
+    CHECK(maxEntries < USBPCAP_URB_IRP_TABLE_MAX_ENTRIES,
+          "steady: table filled up to %u entries", maxEntries);
+    printf("steady: %u IRPs, %u found, %u evicted, at most %u entries\n",
+           irps, found, missing, maxEntries);
+}
+
+/* No IRP comes back, the table stays capped and keeps the newest ones */
+static void soak_flood(SOAK *soak)
+{
+    UINT32 first = soak->added;
+    UINT32 count = 16 * USBPCAP_URB_IRP_TABLE_MAX_ENTRIES;
+    UINT32 seq;
+
+    for (seq = 0; seq < count; seq++)
+    {
+        soak_add(soak);
+    }
+
+    CHECK(soak->maxEntries == USBPCAP_URB_IRP_TABLE_MAX_ENTRIES,
+          "flood: at most %u entries", soak->maxEntries);
+
+    /* Newest IRPs are there, the older than table size are not */
+    for (seq = first + count - 1; seq >= first + count - (LATENCY_KEPT - GENERATION); seq--)
+    {
+        CHECK(soak_obtain(soak, seq) == TRUE, "flood: newest IRP %u evicted", seq);
+    }
+    for (seq = first; seq < first + count - USBPCAP_URB_IRP_TABLE_MAX_ENTRIES; seq++)
+    {
+        CHECK(soak_obtain(soak, seq) == FALSE, "flood: old IRP %u kept", seq);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    SOAK   *soak;
+    UINT32  irps = SOAK_IRPS;
+
+    if (argc > 2)
+    {
+        irps = (UINT32)strtoul(argv[2], NULL, 0);
+    }
+    if (argc > 3)
+    {
+        g_random = (UINT32)strtoul(argv[3], NULL, 0) | 1;
+    }
+
+    soak = calloc(1, sizeof(SOAK));
+    if (soak == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    KeInitializeSpinLock(&soak->device.tablesSpinLock);
+    soak->device.URBIrpTable = USBPcapInitializeURBIRPInfoTable(NULL);
+    if (soak->device.URBIrpTable == NULL)
+    {
+        fprintf(stderr, "Failed to create URB IRP table\n");
+        return 1;
+    }
+
+    soak_steady(soak, irps);
+    soak_flood(soak);
+
+    /* Every IRP was obtained, evicted or is left in the table */
+    CHECK(soak->added == soak->obtained + soak->evicted +
+          RtlNumberGenericTableElements(soak->device.URBIrpTable),
+          "%u IRPs added, %llu obtained, %llu evicted, %u left",
+          soak->added, (unsigned long long)soak->obtained,
+          (unsigned long long)soak->evicted,
+          (unsigned)RtlNumberGenericTableElements(soak->device.URBIrpTable));
+
+    USBPcapFreeURBIRPInfoTable(soak->device.URBIrpTable);
+    free(soak);
+
+    if (g_failures > 0)
+    {
+        fprintf(stderr, "irptabletest: %d checks failed\n", g_failures);
+        return 1;
+    }
+    printf("irptabletest: passed\n");
+    return 0;
+}
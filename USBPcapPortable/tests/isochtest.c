@@ -0,0 +1,501 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Isochronous split and reassembly round trip. URBs with up to several
+ * thousand packets go through USBPcapAnalyzeURB(), the captured records
+ * are joined by isoch_reassembler_add() and compared with the URB.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+#include "isoch.h"
+#include "USBPcapBuffer.h"
+#include "USBPcapURB.h"
+
+#define CAPTURE_BUFFER_LEN  (32*1024*1024)
+#define MAX_PACKET_SIZE     24
+
+static PORTABLE_CAPTURE      g_capture;
+static PUSBPCAP_DEVICE_DATA  g_device;
+static UCHAR                *g_captured;
+static UINT32                g_capturedLength;
+static UINT32                g_random = 0x2545F491;
+static int                   g_failures;
+
+#define CHECK(condition, ...) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__); \
+            fprintf(stderr, "\n"); \
+            g_failures++; \
+        } \
+    } \
+    while (0)
+
+static UINT32 test_random(void)
+{
+    g_random ^= g_random << 13;
+    g_random ^= g_random >> 17;
+    g_random ^= g_random << 5;
+    return g_random;
+}
+
+/* Reads everything captured since the last call. The first call reads
+ * the pcap global header, later calls only records.
+ */
+static void test_read_all(void)
+{
+    UINT32 bytes;
+
+    g_capturedLength = 0;
+    do
+    {
+        bytes = capture_read(&g_capture, &g_captured[g_capturedLength],
+                             CAPTURE_BUFFER_LEN - g_capturedLength);
+        g_capturedLength += bytes;
+    }
+    while (bytes > 0);
+}
+
+/* URB with count packets. OUT packets have random sizes and follow each
+ * other in the transfer buffer, IN packets are MAX_PACKET_SIZE apart.
+ */
+static PURB test_build_urb(UINT32 count, BOOLEAN in, PUCHAR *buffer)
+{
+    struct _URB_ISOCH_TRANSFER *transfer;
+    UINT32                      length = 0;
+    UINT32                      i;
+
+    transfer = calloc(1, FIELD_OFFSET(struct _URB_ISOCH_TRANSFER, IsoPacket) +
+                         (count + 1) * sizeof(USBD_ISO_PACKET_DESCRIPTOR));
+    *buffer = malloc(count * MAX_PACKET_SIZE + 1);
+    if ((transfer == NULL) || (*buffer == NULL))
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    transfer->Hdr.Function = URB_FUNCTION_ISOCH_TRANSFER;
+    transfer->Hdr.Status = USBD_STATUS_PENDING;
+    transfer->TransferFlags = in ? USBD_TRANSFER_DIRECTION_IN :
+                                   USBD_TRANSFER_DIRECTION_OUT;
+    transfer->StartFrame = test_random();
+    transfer->NumberOfPackets = count;
+    for (i = 0; i < count; i++)
+    {
+        transfer->IsoPacket[i].Offset = in ? i * MAX_PACKET_SIZE : length;
+        transfer->IsoPacket[i].Length = 0;
+        transfer->IsoPacket[i].Status = USBD_STATUS_PENDING;
+        length += in ? MAX_PACKET_SIZE : test_random() % (MAX_PACKET_SIZE + 1);
+    }
+    for (i = 0; i < length; i++)
+    {
+        (*buffer)[i] = (UCHAR)test_random();
+    }
+    transfer->TransferBuffer = *buffer;
+    transfer->TransferBufferLength = length;
+
+    return (PURB)transfer;
+}
+
+/* Fills IN packets with data as the host controller would */
+static void test_complete_urb(PURB urb)
+{
+    struct _URB_ISOCH_TRANSFER *transfer = &urb->UrbIsochronousTransfer;
+    UINT32                      i;
+
+    transfer->Hdr.Status = USBD_STATUS_SUCCESS;
+    for (i = 0; i < transfer->NumberOfPackets; i++)
+    {
+        transfer->IsoPacket[i].Length = test_random() % (MAX_PACKET_SIZE + 1);
+        transfer->IsoPacket[i].Status = (i % 7 == 3) ? USBD_STATUS_ISO_NOT_ACCESSED_BY_HW :
+                                                       USBD_STATUS_SUCCESS;
+    }
+}
+
+/* Joins isochronous records of captured data. Returns number of
+ * reassembled transfers, the last one is left in reassembler.
+ */
+static int test_reassemble(PISOCH_REASSEMBLER reassembler, UINT32 *records)
+{
+    UINT32 offset = 0;
+    int    transfers = 0;
+
+    *records = 0;
+    while (offset + sizeof(pcaprec_hdr_t) <= g_capturedLength)
+    {
+        pcaprec_hdr_t *pcap = (pcaprec_hdr_t *)&g_captured[offset];
+        const UCHAR   *data = &g_captured[offset + sizeof(pcaprec_hdr_t)];
+        int            result;
+
+        offset += sizeof(pcaprec_hdr_t) + pcap->incl_len;
+        CHECK(offset <= g_capturedLength, "record exceeds captured data");
+        if (offset > g_capturedLength)
+        {
+            break;
+        }
+
+        if (data[offsetof(USBPCAP_BUFFER_PACKET_HEADER, transfer)] !=
+            USBPCAP_TRANSFER_ISOCHRONOUS)
+        {
+            continue;
+        }
+
+        (*records)++;
+        result = isoch_reassembler_add(reassembler, data, pcap->incl_len);
+        CHECK(result != ISOCH_ERROR, "record not accepted by reassembler");
+        if (result == ISOCH_COMPLETE)
+        {
+            transfers++;
+        }
+    }
+
+    return transfers;
+}
+
+/* Submits (post FALSE) or completes URB and checks that the captured
+ * records join into the transfer the URB describes.
+ */
+static void test_roundtrip(PURB urb, PIRP irp, BOOLEAN post, BOOLEAN in)
+{
+    struct _URB_ISOCH_TRANSFER *transfer = &urb->UrbIsochronousTransfer;
+    ISOCH_REASSEMBLER           reassembler;
+    PUCHAR                      buffer = (PUCHAR)transfer->TransferBuffer;
+    UINT32                      count = transfer->NumberOfPackets;
+    UINT32                      records;
+    UINT32                      offset;
+    UINT32                      i;
+
+    USBPcapAnalyzeURB(irp, urb, post, TRUE, g_device);
+    test_read_all();
+
+    isoch_reassembler_init(&reassembler);
+    CHECK(test_reassemble(&reassembler, &records) == 1,
+          "%u packets %s: transfer not reassembled", count,
+          post ? "completion" : "submission");
+    CHECK(records == ((count == 0) ? 1 : (count + 1023) / 1024),
+          "%u packets: %u records", count, records);
+    CHECK(reassembler.header.numberOfPackets == count,
+          "%u packets: reassembled %u", count, reassembler.header.numberOfPackets);
+    CHECK(reassembler.header.startFrame == transfer->StartFrame,
+          "%u packets: startFrame differs", count);
+    CHECK(!(reassembler.header.header.info & USBPCAP_INFO_CONTINUED),
+          "%u packets: last record continued", count);
+    CHECK(reassembler.truncated == FALSE, "%u packets: data truncated", count);
+    if (reassembler.header.numberOfPackets != count)
+    {
+        isoch_reassembler_free(&reassembler);
+        return;
+    }
+
+    if (!in && !post)
+    {
+        /* OUT submission carries the whole transfer buffer */
+        CHECK(reassembler.header.header.dataLength == transfer->TransferBufferLength,
+              "%u packets: %u data bytes instead of %u", count,
+              reassembler.header.header.dataLength, transfer->TransferBufferLength);
+        CHECK(memcmp(reassembler.data, buffer,
+                     min(reassembler.header.header.dataLength,
+                         transfer->TransferBufferLength)) == 0,
+              "%u packets: data differs", count);
+        for (i = 0; i < count; i++)
+        {
+            CHECK(reassembler.packet[i].offset == transfer->IsoPacket[i].Offset,
+                  "%u packets: packet %u offset %u instead of %u", count, i,
+                  reassembler.packet[i].offset, transfer->IsoPacket[i].Offset);
+        }
+    }
+    else if (in && post)
+    {
+        /* IN completion carries the data of every packet back to back */
+        offset = 0;
+        for (i = 0; i < count; i++)
+        {
+            CHECK((reassembler.packet[i].offset == offset) &&
+                  (reassembler.packet[i].length == transfer->IsoPacket[i].Length) &&
+                  (reassembler.packet[i].status == transfer->IsoPacket[i].Status),
+                  "%u packets: packet %u differs", count, i);
+            CHECK(memcmp(&reassembler.data[offset],
+                         &buffer[transfer->IsoPacket[i].Offset],
+                         transfer->IsoPacket[i].Length) == 0,
+                  "%u packets: packet %u data differs", count, i);
+            offset += transfer->IsoPacket[i].Length;
+        }
+        CHECK(reassembler.header.header.dataLength == offset,
+              "%u packets: %u data bytes instead of %u", count,
+              reassembler.header.header.dataLength, offset);
+    }
+    else
+    {
+        CHECK(reassembler.header.header.dataLength == 0,
+              "%u packets: unexpected data", count);
+    }
+
+    isoch_reassembler_free(&reassembler);
+}
+
+static void test_split(UINT32 count)
+{
+    PUCHAR  buffer;
+    PURB    urb;
+    IRP     irp;
+
+    memset(&irp, 0, sizeof(irp));
+    urb = test_build_urb(count, FALSE, &buffer);
+    test_roundtrip(urb, &irp, FALSE, FALSE);
+    urb->UrbHeader.Status = USBD_STATUS_SUCCESS;
+    test_roundtrip(urb, &irp, TRUE, FALSE);
+    free(urb);
+    free(buffer);
+
+    memset(&irp, 0, sizeof(irp));
+    urb = test_build_urb(count, TRUE, &buffer);
+    test_roundtrip(urb, &irp, FALSE, TRUE);
+    test_complete_urb(urb);
+    test_roundtrip(urb, &irp, TRUE, TRUE);
+    free(urb);
+    free(buffer);
+}
+
+/* Packet offset before the start of its record data must not be written
+ * as partial transfer nor underflow.
+ */
+static void test_invalid_offsets(void)
+{
+    ISOCH_REASSEMBLER  reassembler;
+    PUCHAR             buffer;
+    PURB               urb;
+    IRP                irp;
+    UINT32             records;
+
+    memset(&irp, 0, sizeof(irp));
+    urb = test_build_urb(3000, FALSE, &buffer);
+    urb->UrbIsochronousTransfer.IsoPacket[2500].Offset =
+        urb->UrbIsochronousTransfer.IsoPacket[2048].Offset - 1;
+
+    USBPcapAnalyzeURB(&irp, urb, FALSE, TRUE, g_device);
+    test_read_all();
+
+    isoch_reassembler_init(&reassembler);
+    test_reassemble(&reassembler, &records);
+    CHECK(records == 0, "invalid offsets: %u records written", records);
+    isoch_reassembler_free(&reassembler);
+
+    free(urb);
+    free(buffer);
+}
+
+/* Transfer that does not fit the free space is not written at all */
+static void test_buffer_full(void)
+{
+    ISOCH_REASSEMBLER    reassembler;
+    USBPCAP_STATISTICS   before;
+    USBPCAP_STATISTICS   after;
+    PUCHAR               buffer;
+    PURB                 urb;
+    IRP                  irp;
+    UINT32               records;
+    UINT32               used;
+
+    /* Leave space for about one and half record of the transfer */
+    memset(&irp, 0, sizeof(irp));
+    urb = test_build_urb(3000, TRUE, &buffer);
+    used = CAPTURE_BUFFER_LEN - 2 * (sizeof(pcaprec_hdr_t) +
+                                     sizeof(USBPCAP_BUFFER_ISOCH_HEADER) +
+                                     1024 * sizeof(USBPCAP_BUFFER_ISO_PACKET));
+    g_capture.root.readOffset = 0;
+    g_capture.root.writeOffset = used;
+
+    capture_get_statistics(&g_capture, &before);
+    USBPcapAnalyzeURB(&irp, urb, FALSE, TRUE, g_device);
+    capture_get_statistics(&g_capture, &after);
+    CHECK(g_capture.root.writeOffset == used,
+          "buffer full: %u bytes of partial transfer written",
+          g_capture.root.writeOffset - used);
+    CHECK(after.bufferFull == before.bufferFull + 1,
+          "buffer full: counted %u times", after.bufferFull - before.bufferFull);
+
+    /* With the buffer read there is space again */
+    g_capture.root.readOffset = g_capture.root.writeOffset = 0;
+    test_complete_urb(urb);
+    USBPcapAnalyzeURB(&irp, urb, TRUE, TRUE, g_device);
+    test_read_all();
+
+    isoch_reassembler_init(&reassembler);
+    CHECK(test_reassemble(&reassembler, &records) == 1,
+          "buffer full: completion not reassembled");
+    CHECK(records == 3, "buffer full: %u records", records);
+    isoch_reassembler_free(&reassembler);
+
+    free(urb);
+    free(buffer);
+}
+
+/* Payload match found only in the second record keeps the whole transfer,
+ * no match drops all records.
+ */
+static void test_payload_match(void)
+{
+    USBPCAP_PAYLOAD_MATCH  match;
+    ISOCH_REASSEMBLER      reassembler;
+    PUCHAR                 buffer;
+    PURB                   urb;
+    IRP                    irp;
+    UINT32                 records;
+    UINT32                 offset;
+
+    memset(&irp, 0, sizeof(irp));
+    urb = test_build_urb(3000, FALSE, &buffer);
+    offset = urb->UrbIsochronousTransfer.IsoPacket[1500].Offset;
+    memcpy(&buffer[offset], "\xDE\xAD\xBE\xEF\x55\xAA", 6);
+
+    memset(&match, 0, sizeof(match));
+    match.numberOfPatterns = 1;
+    match.pattern[0].transfers = USBPCAP_FILTER_TRANSFER(USBPCAP_TRANSFER_ISOCHRONOUS);
+    match.pattern[0].length = 6;
+    match.pattern[0].minOffset = 0;
+    match.pattern[0].maxOffset = 0xFFFFFFFF;
+    memcpy(match.pattern[0].bytes, "\xDE\xAD\xBE\xEF\x55\xAA", 6);
+    CHECK(NT_SUCCESS(USBPcapBufferSetPayloadMatch(&g_capture.root, &match)),
+          "payload match not set");
+
+    USBPcapAnalyzeURB(&irp, urb, FALSE, TRUE, g_device);
+    test_read_all();
+    isoch_reassembler_init(&reassembler);
+    CHECK(test_reassemble(&reassembler, &records) == 1,
+          "payload match: transfer not reassembled");
+    CHECK(records == 3, "payload match: %u records", records);
+    isoch_reassembler_free(&reassembler);
+
+    /* Pattern gone, nothing matches */
+    memset(&buffer[offset], 0, 6);
+    USBPcapAnalyzeURB(&irp, urb, FALSE, TRUE, g_device);
+    test_read_all();
+    isoch_reassembler_init(&reassembler);
+    test_reassemble(&reassembler, &records);
+    CHECK(records == 0, "payload match: %u records without match", records);
+    isoch_reassembler_free(&reassembler);
+
+    match.numberOfPatterns = 0;
+    USBPcapBufferSetPayloadMatch(&g_capture.root, &match);
+
+    free(urb);
+    free(buffer);
+}
+
+/* Header only capture keeps the data length of every record, with the
+ * OUT packet offsets relative to the record as with the data attached.
+ */
+static void test_header_only(void)
+{
+    struct _URB_ISOCH_TRANSFER *transfer;
+    ISOCH_REASSEMBLER           reassembler;
+    PUCHAR                      buffer;
+    PURB                        urb;
+    IRP                         irp;
+    UINT32                      records;
+    UINT32                      length;
+    UINT32                      i;
+
+    g_capture.root.captureFlags = USBPCAP_CAPTURE_HEADER_ONLY;
+
+    memset(&irp, 0, sizeof(irp));
+    urb = test_build_urb(3000, FALSE, &buffer);
+    transfer = &urb->UrbIsochronousTransfer;
+    USBPcapAnalyzeURB(&irp, urb, FALSE, TRUE, g_device);
+    test_read_all();
+
+    isoch_reassembler_init(&reassembler);
+    CHECK(test_reassemble(&reassembler, &records) == 1,
+          "header only: OUT transfer not reassembled");
+    CHECK(records == 3, "header only: %u OUT records", records);
+    CHECK(reassembler.header.header.dataLength == transfer->TransferBufferLength,
+          "header only: %u OUT data bytes instead of %u",
+          reassembler.header.header.dataLength, transfer->TransferBufferLength);
+    CHECK(reassembler.truncated == TRUE, "header only: OUT data captured");
+    for (i = 0; i < reassembler.header.numberOfPackets; i++)
+    {
+        CHECK(reassembler.packet[i].offset == transfer->IsoPacket[i].Offset,
+              "header only: packet %u offset %u instead of %u", i,
+              reassembler.packet[i].offset, transfer->IsoPacket[i].Offset);
+    }
+    isoch_reassembler_free(&reassembler);
+    free(urb);
+    free(buffer);
+
+    urb = test_build_urb(3000, TRUE, &buffer);
+    transfer = &urb->UrbIsochronousTransfer;
+    test_complete_urb(urb);
+    USBPcapAnalyzeURB(&irp, urb, TRUE, TRUE, g_device);
+    test_read_all();
+
+    length = 0;
+    for (i = 0; i < transfer->NumberOfPackets; i++)
+    {
+        length += transfer->IsoPacket[i].Length;
+    }
+    isoch_reassembler_init(&reassembler);
+    CHECK(test_reassemble(&reassembler, &records) == 1,
+          "header only: IN transfer not reassembled");
+    CHECK(reassembler.header.header.dataLength == length,
+          "header only: %u IN data bytes instead of %u",
+          reassembler.header.header.dataLength, length);
+    CHECK(reassembler.truncated == TRUE, "header only: IN data captured");
+    isoch_reassembler_free(&reassembler);
+    free(urb);
+    free(buffer);
+
+    g_capture.root.captureFlags = 0;
+}
+
+int main(void)
+{
+    static const UINT32 counts[] = {0, 1, 8, 1023, 1024, 1025, 2048, 3000, 5000};
+    size_t              i;
+
+    g_captured = malloc(CAPTURE_BUFFER_LEN);
+    if ((g_captured == NULL) ||
+        (capture_open(&g_capture, CAPTURE_BUFFER_LEN, 1) != 0))
+    {
+        fprintf(stderr, "Failed to set up capture\n");
+        return 1;
+    }
+    g_device = capture_add_device(&g_capture, 1);
+    if (g_device == NULL)
+    {
+        fprintf(stderr, "Failed to add device\n");
+        return 1;
+    }
+    test_read_all();
+
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+    {
+        test_split(counts[i]);
+    }
+    test_invalid_offsets();
+    test_payload_match();
+    test_buffer_full();
+    test_header_only();
+
+    capture_remove_device(g_device);
+    capture_close(&g_capture);
+    free(g_captured);
+
+    if (g_failures > 0)
+    {
+        fprintf(stderr, "isochtest: %d checks failed\n", g_failures);
+        return 1;
+    }
+    printf("isochtest: passed\n");
+    return 0;
+}
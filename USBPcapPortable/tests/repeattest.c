@@ -0,0 +1,547 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * Compaction of repeated interrupt records (USBPcapCMD/repeat.c) round
+ * trip. Captures of polled interrupt endpoints, with single IRP and with
+ * two IRPs ping-ponging per endpoint, microsecond and nanosecond
+ * timestamps, are compacted and expanded back:
+ *   * with the compactor and expander fed in pieces of random size, the
+ *     way USBPcapCMD --compact feeds the driver reads
+ *   * with usbpcap-compact and usbpcap-compact -x, outputs compared with
+ *     cmp
+ *   * cut at random offsets, also inside global and record headers
+ *   * already compacted capture compacted again
+ * Expanded capture must be the original byte for byte.
+ *
+ * Usage: repeattest <directory with usbpcap-compact>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pcapfile.h"
+#include "../USBPcapCMD/repeat.h"
+
+#define TEST_RECORDS        60000
+#define TEST_DEVICES        6
+#define TEST_TRUNCATIONS    40
+#define TEST_FEEDS          8
+#define WRITER_BUFFER_SIZE  (1024 * 1024)
+
+/* Nanoseconds, pcap_writer_record() takes nanoseconds */
+#define BASE_TIMESTAMP      1700000000000000000ULL
+
+static const char *g_directory;
+static UINT32      g_random = 0x6C078965;
+static int         g_failures;
+
+#define CHECK(condition, ...) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__); \
+            fprintf(stderr, "\n"); \
+            g_failures++; \
+        } \
+    } \
+    while (0)
+
+static UINT32 test_random(void)
+{
+    g_random ^= g_random << 13;
+    g_random ^= g_random >> 17;
+    g_random ^= g_random << 5;
+    return g_random;
+}
+
+/* Output of compactor or expander collected in memory */
+typedef struct _TEST_OUTPUT
+{
+    UCHAR  *data;
+    size_t  length;
+    size_t  size;
+} TEST_OUTPUT;
+
+static void test_output_write(void *context, const void *data, size_t length)
+{
+    TEST_OUTPUT *output = (TEST_OUTPUT *)context;
+
+    if (output->length + length > output->size)
+    {
+        size_t size = (output->size == 0) ? 65536 : output->size;
+
+        while (size < output->length + length)
+        {
+            size *= 2;
+        }
+        output->data = (UCHAR *)realloc(output->data, size);
+        if (output->data == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        output->size = size;
+    }
+    memcpy(&output->data[output->length], data, length);
+    output->length += length;
+}
+
+/* Interrupt endpoint polled by one or two IRPs */
+typedef struct _TEST_DEVICE
+{
+    USHORT  address;
+    UCHAR   endpoint;
+    UINT32  length;         /* of the report */
+    UCHAR   report;         /* report content, changes now and then */
+    UINT64  irpId[2];
+    int     next;           /* IRP completed next */
+} TEST_DEVICE;
+
+static void test_record(PCAP_WRITER *writer, UINT64 timestamp, UINT64 irpId,
+                        USBD_STATUS status, UCHAR info, USHORT device,
+                        UCHAR endpoint, UCHAR transfer, UINT32 dataLength,
+                        UCHAR fill)
+{
+    static UCHAR                  data[4096];
+    USBPCAP_BUFFER_PACKET_HEADER  header;
+
+    memset(&header, 0, sizeof(header));
+    header.headerLen = sizeof(header);
+    header.irpId = irpId;
+    header.status = status;
+    header.function = URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER;
+    header.info = info;
+    header.bus = 1;
+    header.device = device;
+    header.endpoint = endpoint;
+    header.transfer = transfer;
+    header.dataLength = dataLength;
+
+    memset(data, fill, dataLength);
+    pcap_writer_record(writer, timestamp, sizeof(header) + dataLength,
+                       sizeof(header) + dataLength);
+    pcap_writer_write(writer, &header, sizeof(header));
+    pcap_writer_write(writer, data, dataLength);
+}
+
+/* Writes capture of interrupt endpoints polled all the time with bulk
+ * traffic in between. pingpong gives every endpoint two IRPs completed
+ * in turns. Timestamps now and then go back or jump over idle time.
+ */
+static int test_write_capture(const char *filename, BOOLEAN nanoseconds,
+                              BOOLEAN pingpong)
+{
+    TEST_DEVICE  devices[TEST_DEVICES];
+    PCAP_WRITER  writer;
+    char         error[256];
+    UINT64       timestamp = BASE_TIMESTAMP;
+    UINT32       records = 0;
+    int          i;
+
+    if (pcap_writer_open(&writer, filename, WRITER_BUFFER_SIZE,
+                         error, sizeof(error)) != 0)
+    {
+        fprintf(stderr, "%s\n", error);
+        return -1;
+    }
+    pcap_writer_header(&writer, nanoseconds, 65535, DLT_USBPCAP);
+
+    for (i = 0; i < TEST_DEVICES; i++)
+    {
+        devices[i].address = (USHORT)(i + 2);
+        devices[i].endpoint = (UCHAR)(0x81 + i % 3);
+        devices[i].length = (i == 0) ? 1100 : 1U << (i + 1);
+        devices[i].report = 0;
+        devices[i].irpId[0] = 0xFFFF800000010000ULL + 0x1000 * i;
+        devices[i].irpId[1] = devices[i].irpId[0] + 0x800;
+        devices[i].next = 0;
+    }
+
+    while (records < TEST_RECORDS)
+    {
+        TEST_DEVICE *device = &devices[test_random() % TEST_DEVICES];
+        UINT32       dice = test_random() % 1000;
+        UINT64       irpId = device->irpId[device->next];
+        USBD_STATUS  status = USBD_STATUS_SUCCESS;
+
+        if (dice < 100)
+        {
+            /* Bulk transfer in between */
+            test_record(&writer, timestamp, 0xFFFF800000F00000ULL, status,
+                        USBPCAP_INFO_PDO_TO_FDO, 1, 0x82,
+                        USBPCAP_TRANSFER_BULK, test_random() % 512,
+                        (UCHAR)test_random());
+            records++;
+        }
+        else if (dice < 120)
+        {
+            device->report++;
+        }
+        else if (dice < 125)
+        {
+            status = USBD_STATUS_STALL_PID;
+        }
+        else if (dice < 130)
+        {
+            /* Clock adjusted back */
+            timestamp -= test_random() % 5000000;
+        }
+        else if (dice == 999)
+        {
+            /* Idle for minutes */
+            timestamp += (UINT64)(test_random() % 300) * 1000000000ULL;
+        }
+
+        /* Completion, then the IRP is submitted again */
+        test_record(&writer, timestamp, irpId, status,
+                    USBPCAP_INFO_PDO_TO_FDO, device->address,
+                    device->endpoint, USBPCAP_TRANSFER_INTERRUPT,
+                    (status == USBD_STATUS_SUCCESS) ? device->length : 0,
+                    device->report);
+        timestamp += test_random() % 20000;
+        test_record(&writer, timestamp, irpId, USBD_STATUS_SUCCESS, 0,
+                    device->address, device->endpoint,
+                    USBPCAP_TRANSFER_INTERRUPT, 0, 0);
+        records += 2;
+
+        if (pingpong)
+        {
+            device->next ^= 1;
+        }
+        timestamp += 100000 + test_random() % 1000000;
+    }
+
+    return pcap_writer_close(&writer);
+}
+
+/* Reads whole file, returns NULL on failure */
+static UCHAR *test_read_file(const char *filename, size_t *length)
+{
+    FILE  *file;
+    UCHAR *data;
+    long   size;
+
+    file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    data = (UCHAR *)malloc(size + 1);
+    if ((data != NULL) && (fread(data, 1, size, file) != (size_t)size))
+    {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    *length = (size_t)size;
+    return data;
+}
+
+static int test_write_file(const char *filename, const UCHAR *data,
+                           size_t length)
+{
+    FILE *file = fopen(filename, "wb");
+    int   result = 0;
+
+    if (file == NULL)
+    {
+        return -1;
+    }
+    if (fwrite(data, 1, length, file) != length)
+    {
+        result = -1;
+    }
+    if (fclose(file) != 0)
+    {
+        result = -1;
+    }
+    return result;
+}
+
+/* Runs command, returns its exit status */
+static int test_run(const char *command)
+{
+    int status = system(command);
+
+    CHECK(status == 0, "%s: exit status %d", command, status);
+    return status;
+}
+
+/* Compares files with cmp */
+static void test_cmp(const char *a, const char *b)
+{
+    char command[1200];
+
+    snprintf(command, sizeof(command), "cmp %s %s", a, b);
+    test_run(command);
+}
+
+/* Returns length of next piece fed to compactor or expander. Mostly
+ * small reads, sometimes single bytes and sometimes large ones.
+ */
+static size_t test_feed_length(size_t left)
+{
+    UINT32 dice = test_random() % 10;
+    size_t length;
+
+    if (dice == 0)
+    {
+        length = 1;
+    }
+    else if (dice < 8)
+    {
+        length = test_random() % 4096 + 1;
+    }
+    else
+    {
+        length = test_random() % (1024 * 1024) + 1;
+    }
+    return (length < left) ? length : left;
+}
+
+static void test_compact(const UCHAR *data, size_t length, UINT32 delay,
+                         size_t queue, TEST_OUTPUT *output,
+                         struct repeat_stats *stats)
+{
+    struct repeat_compactor *compactor;
+    size_t                   offset;
+
+    compactor = repeat_compactor_create(test_output_write, output, delay,
+                                        queue);
+    if (compactor == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (offset = 0; offset < length; )
+    {
+        size_t n = test_feed_length(length - offset);
+
+        repeat_compactor_feed(compactor, &data[offset], n);
+        offset += n;
+    }
+    repeat_compactor_finish(compactor);
+    repeat_compactor_stats(compactor, stats);
+    repeat_compactor_free(compactor);
+}
+
+static BOOLEAN test_expand(const UCHAR *data, size_t length,
+                           TEST_OUTPUT *output)
+{
+    struct repeat_expander *expander;
+    BOOLEAN                 valid = TRUE;
+    size_t                  offset;
+
+    expander = repeat_expander_create(test_output_write, output);
+    if (expander == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (offset = 0; (offset < length) && valid; )
+    {
+        size_t n = test_feed_length(length - offset);
+
+        valid = repeat_expander_feed(expander, &data[offset], n);
+        offset += n;
+    }
+    if (!repeat_expander_finish(expander))
+    {
+        valid = FALSE;
+    }
+    repeat_expander_free(expander);
+    return valid;
+}
+
+/* Compacts and expands data in random pieces, returns compacted size */
+static size_t test_round_trip(const char *name, const UCHAR *data,
+                              size_t length, UINT32 delay, size_t queue,
+                              BOOLEAN expectRepeats)
+{
+    TEST_OUTPUT          compacted = {NULL, 0, 0};
+    TEST_OUTPUT          expanded = {NULL, 0, 0};
+    struct repeat_stats  stats;
+    size_t               result;
+
+    test_compact(data, length, delay, queue, &compacted, &stats);
+    if (expectRepeats)
+    {
+        CHECK((stats.repeats > 0) && (compacted.length < length),
+              "%s: %llu repetitions, %zu -> %zu bytes", name,
+              (unsigned long long)stats.repeats, length, compacted.length);
+    }
+    CHECK(test_expand(compacted.data, compacted.length, &expanded),
+          "%s: compacted capture rejected by expander", name);
+    CHECK((expanded.length == length) &&
+          (memcmp(expanded.data, data, length) == 0),
+          "%s: expanded capture differs from original (%zu and %zu bytes)",
+          name, expanded.length, length);
+
+    result = compacted.length;
+    free(compacted.data);
+    free(expanded.data);
+    return result;
+}
+
+/* Compacts and expands file with usbpcap-compact and cmp the result
+ * with the original.
+ */
+static void test_tool(const char *original, const char *options)
+{
+    char command[2048];
+    char compacted[512];
+    char expanded[512];
+
+    snprintf(compacted, sizeof(compacted), "%s/tests/repeat-compact.pcap",
+             g_directory);
+    snprintf(expanded, sizeof(expanded), "%s/tests/repeat-expand.pcap",
+             g_directory);
+
+    snprintf(command, sizeof(command), "%s/usbpcap-compact %s %s %s",
+             g_directory, options, original, compacted);
+    test_run(command);
+    snprintf(command, sizeof(command), "%s/usbpcap-compact -x %s %s",
+             g_directory, compacted, expanded);
+    test_run(command);
+    test_cmp(original, expanded);
+
+    remove(compacted);
+    remove(expanded);
+}
+
+static void test_capture(BOOLEAN nanoseconds, BOOLEAN pingpong)
+{
+    char    name[64];
+    char    original[512];
+    char    truncated[512];
+    char    compacted[512];
+    char    again[512];
+    char    expanded[512];
+    char    command[2048];
+    UCHAR  *data;
+    size_t  length = 0;
+    size_t  size = 0;
+    int     i;
+
+    snprintf(name, sizeof(name), "%s%s",
+             nanoseconds ? "nanoseconds" : "microseconds",
+             pingpong ? ", ping-pong" : "");
+    snprintf(original, sizeof(original), "%s/tests/repeat.pcap", g_directory);
+    snprintf(truncated, sizeof(truncated), "%s/tests/repeat-cut.pcap",
+             g_directory);
+    snprintf(compacted, sizeof(compacted), "%s/tests/repeat-1.pcap",
+             g_directory);
+    snprintf(again, sizeof(again), "%s/tests/repeat-2.pcap", g_directory);
+    snprintf(expanded, sizeof(expanded), "%s/tests/repeat-x.pcap",
+             g_directory);
+
+    if (test_write_capture(original, nanoseconds, pingpong) != 0)
+    {
+        CHECK(0, "%s: write failed", original);
+        return;
+    }
+    data = test_read_file(original, &length);
+    if (data == NULL)
+    {
+        CHECK(0, "%s: read failed", original);
+        return;
+    }
+
+    /* Random feed sizes, default limits and runs closed early */
+    for (i = 0; i < TEST_FEEDS; i++)
+    {
+        size = test_round_trip(name, data, length, REPEAT_DEFAULT_DELAY,
+                               REPEAT_DEFAULT_QUEUE, TRUE);
+    }
+    test_round_trip(name, data, length, 1, 4096, TRUE);
+    test_round_trip(name, data, length, 1, 0, FALSE);
+    printf("%s: %zu -> %zu bytes\n", name, length, size);
+
+    test_tool(original, "");
+    test_tool(original, "-d 1 -q 0");
+
+    /* Truncated capture is written back truncated at the same place */
+    for (i = 0; i < TEST_TRUNCATIONS; i++)
+    {
+        size_t cut;
+
+        if (i < 4)
+        {
+            cut = (size_t)(i * 11);
+        }
+        else if (i == 8)
+        {
+            cut = sizeof(pcap_hdr_t);
+        }
+        else
+        {
+            cut = test_random() % length;
+        }
+        test_round_trip(name, data, cut, REPEAT_DEFAULT_DELAY,
+                        REPEAT_DEFAULT_QUEUE, FALSE);
+        /* usbpcap-compact needs the whole global header */
+        if (((i % 8) == 0) && (cut >= sizeof(pcap_hdr_t)))
+        {
+            if (test_write_file(truncated, data, cut) != 0)
+            {
+                CHECK(0, "%s: write failed", truncated);
+                continue;
+            }
+            test_tool(truncated, "");
+        }
+    }
+    remove(truncated);
+
+    /* Already compacted capture is copied */
+    snprintf(command, sizeof(command), "%s/usbpcap-compact %s %s",
+             g_directory, original, compacted);
+    test_run(command);
+    snprintf(command, sizeof(command), "%s/usbpcap-compact %s %s 2> /dev/null",
+             g_directory, compacted, again);
+    test_run(command);
+    test_cmp(compacted, again);
+    snprintf(command, sizeof(command), "%s/usbpcap-compact -x %s %s",
+             g_directory, again, expanded);
+    test_run(command);
+    test_cmp(original, expanded);
+
+    remove(compacted);
+    remove(again);
+    remove(expanded);
+    remove(original);
+    free(data);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <directory with usbpcap-compact>\n",
+                argv[0]);
+        return 1;
+    }
+    g_directory = argv[1];
+
+    test_capture(FALSE, FALSE);
+    test_capture(FALSE, TRUE);
+    test_capture(TRUE, FALSE);
+    test_capture(TRUE, TRUE);
+
+    if (g_failures > 0)
+    {
+        fprintf(stderr, "repeattest: %d checks failed\n", g_failures);
+        return 1;
+    }
+    printf("repeattest: passed\n");
+    return 0;
+}
@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * URB sampling and device rate limit: USBPcapSampleTake() over whole
+ * sequence number range, USBPcapTokenBucketTake() long term rate, burst
+ * and refill limits, and sampling snapshots read while being replaced.
+ *
+ * Usage: samplingtest
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "USBPcapMain.h"
+#include "USBPcapCapture.h"
+
+/* 100 ns units */
+#define TICKS_PER_SECOND    10000000ULL
+
+#define SNAPSHOT_READERS    3
+#define SNAPSHOT_UPDATES    200000
+
+static int g_failures;
+
+#define CHECK(condition, ...) \
+    do \
+    { \
+        if (!(condition)) \
+        { \
+            fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__); \
+            fprintf(stderr, "\n"); \
+            __sync_fetch_and_add(&g_failures, 1); \
+        } \
+    } \
+    while (0)
+
+static void test_validate(void)
+{
+    USBPCAP_SAMPLING sampling;
+    UINT32           interval;
+    UINT32           exponent;
+
+    memset(&sampling, 0, sizeof(sampling));
+    CHECK(USBPcapSamplingValidate(&sampling) == FALSE, "interval 0 accepted");
+
+    for (exponent = 0; (1UL << exponent) <= USBPCAP_SAMPLING_MAX_INTERVAL; exponent++)
+    {
+        sampling.samplingInterval = 1UL << exponent;
+        CHECK(USBPcapSamplingValidate(&sampling) == TRUE,
+              "interval %u rejected", sampling.samplingInterval);
+        CHECK(((USBPcapSamplingInfo(&sampling) & USBPCAP_INFO_SAMPLING_MASK) >>
+               USBPCAP_INFO_SAMPLING_SHIFT) == exponent,
+              "interval %u info %02x", sampling.samplingInterval,
+              USBPcapSamplingInfo(&sampling));
+        CHECK(!(USBPcapSamplingInfo(&sampling) & ~USBPCAP_INFO_SAMPLING_MASK),
+              "interval %u info outside of sampling bits", sampling.samplingInterval);
+    }
+
+    for (interval = 3; interval < 100; interval += 2)
+    {
+        sampling.samplingInterval = interval;
+        CHECK(USBPcapSamplingValidate(&sampling) == FALSE,
+              "interval %u accepted", interval);
+    }
+    sampling.samplingInterval = USBPCAP_SAMPLING_MAX_INTERVAL * 2;
+    CHECK(USBPcapSamplingValidate(&sampling) == FALSE, "too large interval accepted");
+
+    sampling.samplingInterval = 1;
+    sampling.deviceByteRate = 1000;
+    sampling.deviceBurst = 0;
+    CHECK(USBPcapSamplingValidate(&sampling) == FALSE, "rate without burst accepted");
+    sampling.deviceBurst = 1;
+    CHECK(USBPcapSamplingValidate(&sampling) == TRUE, "rate with burst rejected");
+}
+
+/* Every interval-th URB is taken starting with the first one, also when
+ * the sequence number wraps around.
+ */
+static void test_sample_take(void)
+{
+    USBPCAP_SAMPLING sampling;
+    UINT32           exponent;
+
+    memset(&sampling, 0, sizeof(sampling));
+    for (exponent = 0; (1UL << exponent) <= USBPCAP_SAMPLING_MAX_INTERVAL; exponent++)
+    {
+        UINT32 interval = 1UL << exponent;
+        UINT32 taken = 0;
+        UINT32 last = 0;
+        UINT32 gaps = 0;
+        UINT32 sequence;
+        UINT32 i;
+
+        sampling.samplingInterval = interval;
+        CHECK(USBPcapSampleTake(&sampling, 1) == TRUE,
+              "interval %u: first URB not taken", interval);
+
+        for (i = 1; i <= 4 * USBPCAP_SAMPLING_MAX_INTERVAL; i++)
+        {
+            if (USBPcapSampleTake(&sampling, i))
+            {
+                taken++;
+            }
+        }
+        CHECK(taken == 4 * USBPCAP_SAMPLING_MAX_INTERVAL / interval,
+              "interval %u: %u of %u taken", interval, taken,
+              4 * USBPCAP_SAMPLING_MAX_INTERVAL);
+
+        /* InterlockedIncrement() wraps around to zero */
+        sequence = 0xFFFFFFFFU - 3 * interval;
+        for (i = 0; i < 8 * interval; i++, sequence++)
+        {
+            if (USBPcapSampleTake(&sampling, sequence))
+            {
+                CHECK((last == 0) || (sequence - last == interval),
+                      "interval %u: %u taken after %u", interval, sequence, last);
+                last = sequence;
+                gaps++;
+            }
+        }
+        CHECK(gaps == 8, "interval %u: %u taken around wrap", interval, gaps);
+    }
+}
+
+/* Offers records of size bytes every step ticks, as many as are taken,
+ * for duration ticks. Returns bytes taken.
+ */
+static UINT64 test_offer(PUSBPCAP_TOKEN_BUCKET bucket,
+                         const USBPCAP_SAMPLING *sampling,
+                         UINT64 *now, UINT64 duration, UINT64 step,
+                         UINT32 size)
+{
+    UINT64 end = *now + duration;
+    UINT64 bytes = 0;
+
+    for (; *now < end; *now += step)
+    {
+        while (USBPcapTokenBucketTake(bucket, sampling, *now, size))
+        {
+            bytes += size;
+        }
+    }
+    return bytes;
+}
+
+static void test_token_bucket(void)
+{
+    static const UINT32 sizes[] = {1, 64, 512, 4096, 65536};
+    USBPCAP_SAMPLING    sampling;
+    USBPCAP_TOKEN_BUCKET bucket;
+    UINT64              now;
+    UINT64              bytes;
+    size_t              i;
+
+    memset(&sampling, 0, sizeof(sampling));
+    sampling.samplingInterval = 1;
+
+    /* No limit */
+    memset(&bucket, 0, sizeof(bucket));
+    CHECK(USBPcapTokenBucketTake(&bucket, &sampling, 1, 0xFFFFFFFFU) == TRUE,
+          "unlimited rate refused");
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        UINT32 size = sizes[i];
+
+        sampling.deviceByteRate = 1000000;
+        sampling.deviceBurst = 2 * 65536;
+
+        /* Full bucket on first use, nothing more without refill */
+        memset(&bucket, 0, sizeof(bucket));
+        now = TICKS_PER_SECOND;
+        bytes = 0;
+        while (USBPcapTokenBucketTake(&bucket, &sampling, now, size))
+        {
+            bytes += size;
+        }
+        CHECK(bytes == sampling.deviceBurst / size * size,
+              "size %u: burst of %llu bytes", size, (unsigned long long)bytes);
+        CHECK(USBPcapTokenBucketTake(&bucket, &sampling, now, 1) ==
+              ((bytes < sampling.deviceBurst) ? TRUE : FALSE),
+              "size %u: refused record consumed credit", size);
+
+        /* Ten seconds of overload stays on the rate */
+        bytes = test_offer(&bucket, &sampling, &now, 10 * TICKS_PER_SECOND,
+                           100, size);
+        CHECK((bytes <= 10ULL * sampling.deviceByteRate + sampling.deviceBurst) &&
+              (bytes + size >= 10ULL * sampling.deviceByteRate - sampling.deviceBurst),
+              "size %u: %llu bytes in 10 s at %u bytes/s", size,
+              (unsigned long long)bytes, sampling.deviceByteRate);
+
+        /* Long idle refills no more than the burst */
+        now += 1000 * TICKS_PER_SECOND;
+        bytes = test_offer(&bucket, &sampling, &now, 1, 1, size);
+        CHECK(bytes == sampling.deviceBurst / size * size,
+              "size %u: %llu bytes after idle", size, (unsigned long long)bytes);
+    }
+
+    /* Largest values do not overflow */
+    sampling.deviceByteRate = 0xFFFFFFFFU;
+    sampling.deviceBurst = 0xFFFFFFFFU;
+    memset(&bucket, 0, sizeof(bucket));
+    now = 1;
+    CHECK(USBPcapTokenBucketTake(&bucket, &sampling, now, 0xFFFFFFFFU) == TRUE,
+          "maximum burst refused");
+    CHECK(USBPcapTokenBucketTake(&bucket, &sampling, now, 1) == FALSE,
+          "empty bucket accepted");
+    now += 10000 * TICKS_PER_SECOND;
+    CHECK(USBPcapTokenBucketTake(&bucket, &sampling, now, 0xFFFFFFFFU) == TRUE,
+          "maximum burst refused after idle");
+    CHECK(USBPcapTokenBucketTake(&bucket, &sampling, now, 1) == FALSE,
+          "idle refilled more than burst");
+
+    /* Time not moving forward does not refill */
+    sampling.deviceByteRate = 1000;
+    sampling.deviceBurst = 1000;
+    memset(&bucket, 0, sizeof(bucket));
+    now = 5 * TICKS_PER_SECOND;
+    CHECK(USBPcapTokenBucketTake(&bucket, &sampling, now, 1000) == TRUE,
+          "burst refused");
+    CHECK(USBPcapTokenBucketTake(&bucket, &sampling, now - TICKS_PER_SECOND, 1) == FALSE,
+          "time going back refilled");
+}
+
+typedef struct _SNAPSHOT_TEST
+{
+    USBPCAP_ROOTHUB_DATA  root;
+    USBPCAP_SAMPLING      config[2];
+    volatile LONG         done;
+} SNAPSHOT_TEST;
+
+static BOOLEAN test_snapshot_valid(const SNAPSHOT_TEST *test,
+                                   const USBPCAP_SAMPLING_SNAPSHOT *snapshot)
+{
+    int i;
+
+    for (i = 0; i < 2; i++)
+    {
+        if ((memcmp(&snapshot->sampling, &test->config[i],
+                    sizeof(USBPCAP_SAMPLING)) == 0) &&
+            (snapshot->info == USBPcapSamplingInfo(&test->config[i])))
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static void *test_snapshot_reader(void *context)
+{
+    SNAPSHOT_TEST *test = (SNAPSHOT_TEST *)context;
+
+    while (InterlockedCompareExchange(&test->done, 0, 0) == 0)
+    {
+        USBPCAP_SAMPLING_SNAPSHOT snapshot;
+        UCHAR                     info;
+
+        USBPcapGetSampling(&test->root, &snapshot);
+        CHECK(test_snapshot_valid(test, &snapshot),
+              "mixed snapshot: interval %u, rate %u, burst %u, info %02x",
+              snapshot.sampling.samplingInterval,
+              snapshot.sampling.deviceByteRate,
+              snapshot.sampling.deviceBurst, snapshot.info);
+
+        info = USBPcapGetSamplingInfo(&test->root);
+        CHECK((info == USBPcapSamplingInfo(&test->config[0])) ||
+              (info == USBPcapSamplingInfo(&test->config[1])),
+              "info %02x of no configuration", info);
+        if (g_failures > 10)
+        {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/* Sampling configuration replaced while being read */
+static void test_snapshot(void)
+{
+    SNAPSHOT_TEST *test;
+    pthread_t      readers[SNAPSHOT_READERS];
+    UINT32         i;
+
+    test = calloc(1, sizeof(SNAPSHOT_TEST));
+    if (test == NULL)
+    {
+        CHECK(FALSE, "out of memory");
+        return;
+    }
+
+    KeInitializeSpinLock(&test->root.samplingLock);
+    test->config[0].samplingInterval = 4;
+    test->config[0].deviceByteRate = 1000;
+    test->config[0].deviceBurst = 2000;
+    test->config[1].samplingInterval = 1024;
+    test->config[1].deviceByteRate = 0;
+    test->config[1].deviceBurst = 0;
+    USBPcapSetSampling(&test->root, &test->config[0]);
+
+    for (i = 0; i < SNAPSHOT_READERS; i++)
+    {
+        pthread_create(&readers[i], NULL, test_snapshot_reader, test);
+    }
+    for (i = 0; i < SNAPSHOT_UPDATES; i++)
+    {
+        USBPcapSetSampling(&test->root, &test->config[i & 1]);
+    }
+    InterlockedExchange(&test->done, 1);
+    for (i = 0; i < SNAPSHOT_READERS; i++)
+    {
+        pthread_join(readers[i], NULL);
+    }
+
+    /* NULL captures every URB */
+    USBPcapSetSampling(&test->root, NULL);
+    {
+        USBPCAP_SAMPLING_SNAPSHOT snapshot;
+
+        USBPcapGetSampling(&test->root, &snapshot);
+        CHECK((snapshot.sampling.samplingInterval == 1) &&
+              (snapshot.sampling.deviceByteRate == 0) && (snapshot.info == 0),
+              "sampling not cleared");
+    }
+    free(test);
+}
+
+int main(void)
+{
+    test_validate();
+    test_sample_take();
+    test_token_bucket();
+    test_snapshot();
+
+    if (g_failures > 0)
+    {
+        fprintf(stderr, "samplingtest: %d checks failed\n", g_failures);
+        return 1;
+    }
+    printf("samplingtest: passed\n");
+    return 0;
+}
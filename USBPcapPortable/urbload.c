@@ -0,0 +1,404 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+/*
+ * Synthetic URB workload generator. Drives the driver capture path from
+ * multiple threads while single consumer reads the captured data, then
+ * reports throughput, drops and CPU cost per URB.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "capture.h"
+#include "workload.h"
+
+#define NSEC_PER_SEC        1000000000ULL
+#define DEFAULT_BUFFER_LEN  (1024*1024)
+#define DEFAULT_READ_LEN    65536
+#define MAX_DEVICES         127
+
+typedef struct _DEVICE_STATE
+{
+    WORKLOAD_DEVICE  workload;
+    UINT64           interval; /* ns between transactions, 0 no limit */
+    UINT64           due;      /* CLOCK_MONOTONIC ns */
+} DEVICE_STATE;
+
+typedef struct _PRODUCER
+{
+    pthread_t        thread;
+    DEVICE_STATE   **devices;
+    int              numberOfDevices;
+    UINT64           cpu;      /* thread CPU time ns */
+} PRODUCER;
+
+typedef struct _CONSUMER
+{
+    pthread_t        thread;
+    UINT32           readLength;
+    UINT64           rate;     /* bytes per second, 0 no limit */
+    UINT64           bytes;
+    RECORD_COUNTER   counter;
+} CONSUMER;
+
+static PORTABLE_CAPTURE g_capture;
+static volatile LONG    g_stopProducers;
+static volatile LONG    g_stopConsumer;
+static UINT64           g_end;
+
+static UINT64 clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (UINT64)ts.tv_sec * NSEC_PER_SEC + (UINT64)ts.tv_nsec;
+}
+
+static void sleep_until(UINT64 ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)(ns / NSEC_PER_SEC);
+    ts.tv_nsec = (long)(ns % NSEC_PER_SEC);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+    }
+}
+
+static void *producer_thread(void *arg)
+{
+    PRODUCER *producer = (PRODUCER *)arg;
+    UINT64    start = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    UINT64    now = clock_ns(CLOCK_MONOTONIC);
+    int       i;
+
+    for (i = 0; i < producer->numberOfDevices; i++)
+    {
+        producer->devices[i]->due = now;
+    }
+
+    while (now < g_end)
+    {
+        UINT64 next = g_end;
+
+        for (i = 0; i < producer->numberOfDevices; i++)
+        {
+            DEVICE_STATE *device = producer->devices[i];
+
+            if (device->due <= now)
+            {
+                workload_run(&device->workload);
+
+                /* Do not try to catch up after falling behind a lot */
+                if (now - device->due > NSEC_PER_SEC)
+                {
+                    device->due = now;
+                }
+                device->due += device->interval;
+            }
+
+            if (device->due < next)
+            {
+                next = device->due;
+            }
+        }
+
+        now = clock_ns(CLOCK_MONOTONIC);
+        if (next > now)
+        {
+            sleep_until(next);
+            now = clock_ns(CLOCK_MONOTONIC);
+        }
+    }
+
+    producer->cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID) - start;
+    return NULL;
+}
+
+static void *consumer_thread(void *arg)
+{
+    CONSUMER *consumer = (CONSUMER *)arg;
+    UCHAR    *buffer;
+    UINT64    start = clock_ns(CLOCK_MONOTONIC);
+
+    buffer = (UCHAR *)malloc(consumer->readLength);
+    if (buffer == NULL)
+    {
+        return NULL;
+    }
+
+    for (;;)
+    {
+        UINT32 bytes = capture_read(&g_capture, buffer, consumer->readLength);
+
+        if (bytes == 0)
+        {
+            /* Producers are done and the buffer is drained */
+            if (InterlockedCompareExchange(&g_stopConsumer, 0, 0) != 0)
+            {
+                break;
+            }
+            sleep_until(clock_ns(CLOCK_MONOTONIC) + 100000);
+            continue;
+        }
+
+        record_counter_update(&consumer->counter, buffer, bytes);
+        consumer->bytes += bytes;
+
+        if (consumer->rate != 0)
+        {
+            sleep_until(start + consumer->bytes * NSEC_PER_SEC / consumer->rate);
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] class[:rate[:size[:count]]]...\n"
+            "\n"
+            "Each class argument adds one device. Classes:\n"
+            "  bot      mass storage READ/WRITE(10), size is data length\n"
+            "           (default 500 commands/s, 65536 bytes)\n"
+            "  hid      interrupt IN reports (default 1000/s, 8 bytes)\n"
+            "  uac      isochronous OUT URBs of count packets of size bytes\n"
+            "           (default 100/s, 192 bytes, 10 packets)\n"
+            "  cdc      bulk IN or OUT of 1 to size bytes\n"
+            "           (default 1000/s, 512 bytes)\n"
+            "  control  bursts of count GET_DESCRIPTOR requests\n"
+            "           (default 10 bursts/s, 8 requests)\n"
+            "Rate 0 submits as fast as possible.\n"
+            "\n"
+            "Options:\n"
+            "  -t, --threads <n>     producer threads (default: one per device)\n"
+            "  -d, --duration <s>    run time in seconds (default: 5)\n"
+            "  -b, --bufferlen <n>   driver buffer length (default: %d)\n"
+            "  -r, --read-rate <n>   consumer bytes per second (default: no limit)\n"
+            "  -l, --read-length <n> consumer read length (default: %d)\n"
+            "  -s, --snaplen <n>     snapshot length (default: %d)\n"
+            "      --seed <n>        random seed (default: 1)\n",
+            name, DEFAULT_BUFFER_LEN, DEFAULT_READ_LEN,
+            USBPCAP_DEFAULT_SNAP_LEN);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option options[] =
+    {
+        {"threads",     required_argument, NULL, 't'},
+        {"duration",    required_argument, NULL, 'd'},
+        {"bufferlen",   required_argument, NULL, 'b'},
+        {"read-rate",   required_argument, NULL, 'r'},
+        {"read-length", required_argument, NULL, 'l'},
+        {"snaplen",     required_argument, NULL, 's'},
+        {"seed",        required_argument, NULL, 'S'},
+        {"help",        no_argument,       NULL, 'h'},
+        {NULL,          0,                 NULL, 0}
+    };
+    DEVICE_STATE         *devices;
+    PRODUCER             *producers;
+    CONSUMER              consumer;
+    USBPCAP_STATISTICS    statistics;
+    int                   numberOfDevices;
+    int                   threads = 0;
+    double                duration = 5.0;
+    UINT32                bufferLength = DEFAULT_BUFFER_LEN;
+    UINT32                snaplen = USBPCAP_DEFAULT_SNAP_LEN;
+    UINT32                seed = 1;
+    UINT64                start;
+    UINT64                elapsed;
+    UINT64                urbs = 0;
+    UINT64                bytes = 0;
+    UINT64                cpu = 0;
+    double                seconds;
+    int                   opt;
+    int                   i;
+
+    memset(&consumer, 0, sizeof(consumer));
+    consumer.readLength = DEFAULT_READ_LEN;
+
+    while ((opt = getopt_long(argc, argv, "t:d:b:r:l:s:h", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'd':
+                duration = atof(optarg);
+                break;
+            case 'b':
+                bufferLength = (UINT32)strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                consumer.rate = strtoull(optarg, NULL, 0);
+                break;
+            case 'l':
+                consumer.readLength = (UINT32)strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                snaplen = (UINT32)strtoul(optarg, NULL, 0);
+                break;
+            case 'S':
+                seed = (UINT32)strtoul(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    numberOfDevices = argc - optind;
+    if ((numberOfDevices <= 0) || (numberOfDevices > MAX_DEVICES) ||
+        (duration <= 0.0) || (consumer.readLength == 0) || (snaplen == 0))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if ((threads <= 0) || (threads > numberOfDevices))
+    {
+        threads = numberOfDevices;
+    }
+
+    if (capture_open(&g_capture, bufferLength, 1) != 0)
+    {
+        fprintf(stderr, "Failed to set up %u bytes buffer\n", bufferLength);
+        return 1;
+    }
+    g_capture.root.snaplen = snaplen;
+
+    devices = (DEVICE_STATE *)calloc(numberOfDevices, sizeof(DEVICE_STATE));
+    producers = (PRODUCER *)calloc(threads, sizeof(PRODUCER));
+    if ((devices == NULL) || (producers == NULL))
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    for (i = 0; i < threads; i++)
+    {
+        producers[i].devices = (DEVICE_STATE **)
+            calloc(numberOfDevices / threads + 1, sizeof(DEVICE_STATE *));
+        if (producers[i].devices == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+    }
+
+    /* Configuration requests are captured too, start reading first */
+    if (pthread_create(&consumer.thread, NULL, consumer_thread, &consumer) != 0)
+    {
+        fprintf(stderr, "Failed to start consumer thread\n");
+        return 1;
+    }
+
+    for (i = 0; i < numberOfDevices; i++)
+    {
+        WORKLOAD_PROFILE      profile;
+        PUSBPCAP_DEVICE_DATA  device;
+        PRODUCER             *producer = &producers[i % threads];
+
+        if (workload_parse(argv[optind + i], &profile) != 0)
+        {
+            fprintf(stderr, "Invalid workload: %s\n", argv[optind + i]);
+            return 1;
+        }
+
+        device = capture_add_device(&g_capture, (USHORT)(i + 1));
+        if ((device == NULL) ||
+            (workload_init(&devices[i].workload, &profile, device,
+                           seed + (UINT32)i) != 0))
+        {
+            fprintf(stderr, "Failed to set up device %d\n", i + 1);
+            return 1;
+        }
+        devices[i].interval = (profile.rate == 0) ? 0 :
+                              NSEC_PER_SEC / profile.rate;
+
+        producer->devices[producer->numberOfDevices++] = &devices[i];
+    }
+
+    start = clock_ns(CLOCK_MONOTONIC);
+    g_end = start + (UINT64)(duration * NSEC_PER_SEC);
+    for (i = 0; i < threads; i++)
+    {
+        if (pthread_create(&producers[i].thread, NULL, producer_thread,
+                           &producers[i]) != 0)
+        {
+            fprintf(stderr, "Failed to start producer thread\n");
+            return 1;
+        }
+    }
+
+    for (i = 0; i < threads; i++)
+    {
+        pthread_join(producers[i].thread, NULL);
+        cpu += producers[i].cpu;
+    }
+    elapsed = clock_ns(CLOCK_MONOTONIC) - start;
+
+    /* Complete URBs still in flight before draining the buffer */
+    for (i = 0; i < numberOfDevices; i++)
+    {
+        workload_free(&devices[i].workload);
+        urbs += devices[i].workload.urbs;
+        bytes += devices[i].workload.bytes;
+    }
+
+    InterlockedExchange(&g_stopConsumer, 1);
+    pthread_join(consumer.thread, NULL);
+
+    capture_get_statistics(&g_capture, &statistics);
+    seconds = (double)elapsed / NSEC_PER_SEC;
+
+    printf("duration        %.2f s, %d producer threads\n", seconds, threads);
+    printf("urbs            %llu (%.0f/s)\n",
+           (unsigned long long)urbs, urbs / seconds);
+    printf("payload         %llu bytes (%.2f MiB/s)\n",
+           (unsigned long long)bytes, bytes / seconds / (1024 * 1024));
+    printf("records         %llu (%.0f/s)\n",
+           (unsigned long long)consumer.counter.records,
+           consumer.counter.records / seconds);
+    printf("captured        %llu bytes (%.2f MiB/s)\n",
+           (unsigned long long)consumer.bytes,
+           consumer.bytes / seconds / (1024 * 1024));
+    printf("dropped         %u records (%.2f%%)\n", statistics.bufferFull,
+           (statistics.bufferFull == 0) ? 0.0 :
+           100.0 * statistics.bufferFull /
+           (consumer.counter.records + statistics.bufferFull));
+    printf("cpu per urb     %.0f ns\n", (urbs == 0) ? 0.0 : (double)cpu / urbs);
+
+    for (i = 0; i < numberOfDevices; i++)
+    {
+        PWORKLOAD_DEVICE workload = &devices[i].workload;
+
+        printf("device %-3d %-8s %llu urbs, %llu bytes\n", i + 1,
+               workload_class_name(workload->profile.type),
+               (unsigned long long)workload->urbs,
+               (unsigned long long)workload->bytes);
+        capture_remove_device(workload->device);
+    }
+
+    capture_close(&g_capture);
+
+    for (i = 0; i < threads; i++)
+    {
+        free(producers[i].devices);
+    }
+    free(producers);
+    free(devices);
+
+    return 0;
+}
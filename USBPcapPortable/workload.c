@@ -0,0 +1,678 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "workload.h"
+#include "USBPcapURB.h"
+
+#define CBW_LENGTH          31
+#define CSW_LENGTH          13
+#define BOT_BLOCK_SIZE      512
+
+#define CONTROL_MAX_LENGTH  255
+
+typedef struct _WORKLOAD_PIPE
+{
+    UCHAR           address;
+    USBD_PIPE_TYPE  type;
+    UCHAR           interval;
+} WORKLOAD_PIPE;
+
+typedef struct _WORKLOAD_CLASS_INFO
+{
+    const char     *name;
+    UINT32          rate;
+    UINT32          size;
+    UINT32          count;
+
+    /* bInterfaceClass, bInterfaceSubClass, bInterfaceProtocol */
+    UCHAR           interfaceClass[3];
+    ULONG           numberOfPipes;
+    WORKLOAD_PIPE   pipes[WORKLOAD_MAX_PIPES];
+} WORKLOAD_CLASS_INFO;
+
+static const WORKLOAD_CLASS_INFO g_classes[WORKLOAD_CLASSES] =
+{
+    /* SCSI transparent command set, Bulk-Only Transport */
+    {"bot", 500, 65536, 0, {0x08, 0x06, 0x50}, 2,
+     {{0x81, UsbdPipeTypeBulk, 0}, {0x02, UsbdPipeTypeBulk, 0}}},
+    /* Boot keyboard */
+    {"hid", 1000, 8, 0, {0x03, 0x01, 0x01}, 1,
+     {{0x81, UsbdPipeTypeInterrupt, 1}}},
+    /* Audio streaming, 48 kHz 16-bit stereo at full speed */
+    {"uac", 100, 192, 10, {0x01, 0x02, 0x00}, 1,
+     {{0x01, UsbdPipeTypeIsochronous, 1}}},
+    /* CDC data interface */
+    {"cdc", 1000, 512, 0, {0x0A, 0x00, 0x00}, 2,
+     {{0x81, UsbdPipeTypeBulk, 0}, {0x02, UsbdPipeTypeBulk, 0}}},
+    /* Vendor specific interface without endpoints */
+    {"control", 10, 0, 8, {0xFF, 0x00, 0x00}, 0, {{0}}},
+};
+
+static const UCHAR g_deviceDescriptor[18] =
+{
+    18, USB_DEVICE_DESCRIPTOR_TYPE, 0x00, 0x02, 0x00, 0x00, 0x00, 64,
+    0x09, 0x12, 0x01, 0x00, 0x00, 0x01, 0x00, 0x02, 0x00, 0x01
+};
+
+static const UCHAR g_languageDescriptor[4] =
+{
+    4, USB_STRING_DESCRIPTOR_TYPE, 0x09, 0x04
+};
+
+static const char g_productString[] = "USBPcap workload";
+
+static UINT32 workload_random(PWORKLOAD_DEVICE workload)
+{
+    UINT32 x = workload->random;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    workload->random = x;
+
+    return x;
+}
+
+static void put_le32(PUCHAR p, UINT32 value)
+{
+    p[0] = (UCHAR)value;
+    p[1] = (UCHAR)(value >> 8);
+    p[2] = (UCHAR)(value >> 16);
+    p[3] = (UCHAR)(value >> 24);
+}
+
+static void put_be32(PUCHAR p, UINT32 value)
+{
+    p[0] = (UCHAR)(value >> 24);
+    p[1] = (UCHAR)(value >> 16);
+    p[2] = (UCHAR)(value >> 8);
+    p[3] = (UCHAR)value;
+}
+
+const char *workload_class_name(WORKLOAD_CLASS type)
+{
+    if (type >= WORKLOAD_CLASSES)
+    {
+        return "unknown";
+    }
+    return g_classes[type].name;
+}
+
+/* Parses decimal field up to ':' or end of string. Empty field leaves
+ * value unchanged. Returns pointer past the field or NULL on error.
+ */
+static const char *parse_field(const char *p, UINT32 *value)
+{
+    char          *end;
+    unsigned long  tmp;
+
+    if ((*p == ':') || (*p == '\0'))
+    {
+        return p;
+    }
+
+    tmp = strtoul(p, &end, 10);
+    if ((end == p) || ((*end != ':') && (*end != '\0')) || (tmp > 0xFFFFFFFFUL))
+    {
+        return NULL;
+    }
+
+    *value = (UINT32)tmp;
+    return end;
+}
+
+int workload_parse(const char *spec, PWORKLOAD_PROFILE profile)
+{
+    const char *p;
+    size_t      length;
+    int         type;
+    UINT32     *fields[3];
+    int         i;
+
+    length = strcspn(spec, ":");
+    p = &spec[length];
+
+    for (type = 0; type < WORKLOAD_CLASSES; type++)
+    {
+        if ((strlen(g_classes[type].name) == length) &&
+            (strncmp(g_classes[type].name, spec, length) == 0))
+        {
+            break;
+        }
+    }
+    if (type == WORKLOAD_CLASSES)
+    {
+        return -1;
+    }
+
+    profile->type = (WORKLOAD_CLASS)type;
+    profile->rate = g_classes[type].rate;
+    profile->size = g_classes[type].size;
+    profile->count = g_classes[type].count;
+
+    fields[0] = &profile->rate;
+    fields[1] = &profile->size;
+    fields[2] = &profile->count;
+
+    for (i = 0; *p == ':'; i++)
+    {
+        if (i == 3)
+        {
+            return -1;
+        }
+        p = parse_field(p + 1, fields[i]);
+        if (p == NULL)
+        {
+            return -1;
+        }
+    }
+
+    switch (profile->type)
+    {
+        case WORKLOAD_BOT:
+            /* Data must be whole number of blocks, at least one */
+            if ((profile->size == 0) ||
+                (profile->size % BOT_BLOCK_SIZE != 0) ||
+                (profile->size / BOT_BLOCK_SIZE > 0xFFFF))
+            {
+                return -1;
+            }
+            break;
+        case WORKLOAD_HID:
+            if ((profile->size == 0) || (profile->size > 1024))
+            {
+                return -1;
+            }
+            break;
+        case WORKLOAD_UAC:
+            if ((profile->size == 0) || (profile->size > 1023) ||
+                (profile->count == 0) || (profile->count > 1024))
+            {
+                return -1;
+            }
+            break;
+        case WORKLOAD_CDC:
+            if ((profile->size == 0) || (profile->size > 0x1000000))
+            {
+                return -1;
+            }
+            break;
+        case WORKLOAD_CONTROL:
+            if (profile->count == 0)
+            {
+                return -1;
+            }
+            break;
+        default:
+            return -1;
+    }
+
+    return 0;
+}
+
+static USHORT workload_max_packet(PWORKLOAD_DEVICE workload,
+                                  const WORKLOAD_PIPE *pipe)
+{
+    switch (pipe->type)
+    {
+        case UsbdPipeTypeIsochronous:
+            return (USHORT)workload->profile.size;
+        case UsbdPipeTypeInterrupt:
+            return (USHORT)min(workload->profile.size, 64);
+        default:
+            return 512;
+    }
+}
+
+/* Builds configuration descriptor with single interface */
+static PUSB_CONFIGURATION_DESCRIPTOR
+workload_build_configuration(PWORKLOAD_DEVICE workload)
+{
+    const WORKLOAD_CLASS_INFO    *info = &g_classes[workload->profile.type];
+    PUSB_CONFIGURATION_DESCRIPTOR configuration;
+    PUSB_INTERFACE_DESCRIPTOR     interface;
+    PUSB_ENDPOINT_DESCRIPTOR      endpoint;
+    USHORT                        length;
+    ULONG                         i;
+
+    length = sizeof(USB_CONFIGURATION_DESCRIPTOR) +
+             sizeof(USB_INTERFACE_DESCRIPTOR) +
+             (USHORT)(info->numberOfPipes * sizeof(USB_ENDPOINT_DESCRIPTOR));
+
+    configuration = (PUSB_CONFIGURATION_DESCRIPTOR)calloc(1, length);
+    if (configuration == NULL)
+    {
+        return NULL;
+    }
+
+    configuration->bLength = sizeof(USB_CONFIGURATION_DESCRIPTOR);
+    configuration->bDescriptorType = USB_CONFIGURATION_DESCRIPTOR_TYPE;
+    configuration->wTotalLength = length;
+    configuration->bNumInterfaces = 1;
+    configuration->bConfigurationValue = 1;
+    configuration->bmAttributes = 0x80;
+    configuration->MaxPower = 50;
+
+    interface = (PUSB_INTERFACE_DESCRIPTOR)&configuration[1];
+    interface->bLength = sizeof(USB_INTERFACE_DESCRIPTOR);
+    interface->bDescriptorType = USB_INTERFACE_DESCRIPTOR_TYPE;
+    interface->bNumEndpoints = (UCHAR)info->numberOfPipes;
+    interface->bInterfaceClass = info->interfaceClass[0];
+    interface->bInterfaceSubClass = info->interfaceClass[1];
+    interface->bInterfaceProtocol = info->interfaceClass[2];
+
+    endpoint = (PUSB_ENDPOINT_DESCRIPTOR)&interface[1];
+    for (i = 0; i < info->numberOfPipes; i++)
+    {
+        endpoint[i].bLength = sizeof(USB_ENDPOINT_DESCRIPTOR);
+        endpoint[i].bDescriptorType = USB_ENDPOINT_DESCRIPTOR_TYPE;
+        endpoint[i].bEndpointAddress = info->pipes[i].address;
+        /* USBD_PIPE_TYPE values match bmAttributes transfer type */
+        endpoint[i].bmAttributes = (UCHAR)info->pipes[i].type;
+        endpoint[i].wMaxPacketSize = workload_max_packet(workload,
+                                                         &info->pipes[i]);
+        endpoint[i].bInterval = info->pipes[i].interval;
+    }
+
+    return configuration;
+}
+
+static void workload_submit(PWORKLOAD_DEVICE workload, int index)
+{
+    workload->urb[index]->UrbHeader.Status = USBD_STATUS_PENDING;
+    workload->captured[index] = USBPcapAnalyzeURB(&workload->irp[index],
+                                                  workload->urb[index],
+                                                  FALSE, TRUE,
+                                                  workload->device);
+}
+
+static void workload_complete(PWORKLOAD_DEVICE workload, int index,
+                              UINT32 bytes)
+{
+    workload->urb[index]->UrbHeader.Status = USBD_STATUS_SUCCESS;
+    USBPcapAnalyzeURB(&workload->irp[index], workload->urb[index],
+                      TRUE, workload->captured[index], workload->device);
+    workload->urbs++;
+    workload->bytes += bytes;
+}
+
+/* Sends SELECT_CONFIGURATION so the pipes are registered by the driver */
+static int workload_configure(PWORKLOAD_DEVICE workload)
+{
+    const WORKLOAD_CLASS_INFO    *info = &g_classes[workload->profile.type];
+    struct _URB_SELECT_CONFIGURATION *select;
+    PUSBD_INTERFACE_INFORMATION   interface;
+    USHORT                        interfaceLength;
+    USHORT                        length;
+    PURB                          urb;
+    BOOLEAN                       captured;
+    ULONG                         i;
+
+    interfaceLength = sizeof(USBD_INTERFACE_INFORMATION);
+    if (info->numberOfPipes > 1)
+    {
+        interfaceLength += (USHORT)((info->numberOfPipes - 1) *
+                                    sizeof(USBD_PIPE_INFORMATION));
+    }
+    length = (USHORT)(FIELD_OFFSET(struct _URB_SELECT_CONFIGURATION,
+                                   Interface) + interfaceLength);
+
+    urb = (PURB)calloc(1, max(length, sizeof(URB)));
+    if (urb == NULL)
+    {
+        return -1;
+    }
+
+    select = &urb->UrbSelectConfiguration;
+    select->Hdr.Length = length;
+    select->Hdr.Function = URB_FUNCTION_SELECT_CONFIGURATION;
+    select->ConfigurationDescriptor = workload->configuration;
+
+    interface = &select->Interface;
+    interface->Length = interfaceLength;
+    interface->NumberOfPipes = info->numberOfPipes;
+
+    urb->UrbHeader.Status = USBD_STATUS_PENDING;
+    captured = USBPcapAnalyzeURB(&workload->irp[0], urb, FALSE, TRUE,
+                                 workload->device);
+
+    /* Filled by host controller driver */
+    select->ConfigurationHandle = workload->configuration;
+    interface->Class = info->interfaceClass[0];
+    interface->SubClass = info->interfaceClass[1];
+    interface->Protocol = info->interfaceClass[2];
+    interface->InterfaceHandle = interface;
+    for (i = 0; i < info->numberOfPipes; i++)
+    {
+        interface->Pipes[i].MaximumPacketSize =
+            workload_max_packet(workload, &info->pipes[i]);
+        interface->Pipes[i].EndpointAddress = info->pipes[i].address;
+        interface->Pipes[i].Interval = info->pipes[i].interval;
+        interface->Pipes[i].PipeType = info->pipes[i].type;
+        interface->Pipes[i].PipeHandle = &workload->pipes[i];
+        interface->Pipes[i].MaximumTransferSize = 0x400000;
+    }
+
+    urb->UrbHeader.Status = USBD_STATUS_SUCCESS;
+    USBPcapAnalyzeURB(&workload->irp[0], urb, TRUE, captured,
+                      workload->device);
+    free(urb);
+
+    return 0;
+}
+
+int workload_init(PWORKLOAD_DEVICE workload,
+                  const WORKLOAD_PROFILE *profile,
+                  PUSBPCAP_DEVICE_DATA device,
+                  UINT32 seed)
+{
+    UINT32 urbLength;
+    UINT32 i;
+
+    memset(workload, 0, sizeof(WORKLOAD_DEVICE));
+    workload->profile = *profile;
+    workload->device = device;
+    workload->random = (seed != 0) ? seed : 0x2545F491;
+    workload->pending = -1;
+
+    switch (profile->type)
+    {
+        case WORKLOAD_UAC:
+            /* Separate buffer for each URB in flight */
+            workload->dataLength = 2 * profile->size * profile->count;
+            urbLength = FIELD_OFFSET(struct _URB_ISOCH_TRANSFER, IsoPacket) +
+                        profile->count * sizeof(USBD_ISO_PACKET_DESCRIPTOR);
+            break;
+        case WORKLOAD_CONTROL:
+            workload->dataLength = CONTROL_MAX_LENGTH;
+            urbLength = sizeof(URB);
+            break;
+        default:
+            workload->dataLength = profile->size;
+            urbLength = sizeof(URB);
+            break;
+    }
+
+    workload->configuration = workload_build_configuration(workload);
+    workload->data = (PUCHAR)malloc(workload->dataLength);
+    workload->urb[0] = (PURB)calloc(1, urbLength);
+    workload->urb[1] = (PURB)calloc(1, urbLength);
+    if ((workload->configuration == NULL) || (workload->data == NULL) ||
+        (workload->urb[0] == NULL) || (workload->urb[1] == NULL))
+    {
+        workload_free(workload);
+        return -1;
+    }
+
+    for (i = 0; i < workload->dataLength; i++)
+    {
+        workload->data[i] = (UCHAR)workload_random(workload);
+    }
+
+    if (workload_configure(workload) != 0)
+    {
+        workload_free(workload);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void workload_bulk(PWORKLOAD_DEVICE workload, ULONG pipe,
+                          PVOID buffer, UINT32 length, UINT32 actual)
+{
+    const WORKLOAD_CLASS_INFO              *info;
+    struct _URB_BULK_OR_INTERRUPT_TRANSFER *transfer;
+
+    info = &g_classes[workload->profile.type];
+    transfer = &workload->urb[0]->UrbBulkOrInterruptTransfer;
+
+    memset(transfer, 0, sizeof(struct _URB_BULK_OR_INTERRUPT_TRANSFER));
+    transfer->Hdr.Length = sizeof(struct _URB_BULK_OR_INTERRUPT_TRANSFER);
+    transfer->Hdr.Function = URB_FUNCTION_BULK_OR_INTERRUPT_TRANSFER;
+    transfer->PipeHandle = &workload->pipes[pipe];
+    if (info->pipes[pipe].address & 0x80)
+    {
+        transfer->TransferFlags = USBD_TRANSFER_DIRECTION_IN |
+                                  USBD_SHORT_TRANSFER_OK;
+    }
+    else
+    {
+        transfer->TransferFlags = USBD_TRANSFER_DIRECTION_OUT;
+    }
+    transfer->TransferBufferLength = length;
+    transfer->TransferBuffer = buffer;
+
+    workload_submit(workload, 0);
+    transfer->TransferBufferLength = actual;
+    workload_complete(workload, 0, actual);
+}
+
+static void workload_run_bot(PWORKLOAD_DEVICE workload)
+{
+    UCHAR   cbw[CBW_LENGTH];
+    UCHAR   csw[CSW_LENGTH];
+    UINT32  size = workload->profile.size;
+    UINT32  tag = ++workload->sequence;
+    BOOLEAN read;
+
+    /* Roughly two reads for every write */
+    read = ((workload_random(workload) % 3) != 0) ? TRUE : FALSE;
+
+    memset(cbw, 0, sizeof(cbw));
+    put_le32(&cbw[0], 0x43425355); /* USBC */
+    put_le32(&cbw[4], tag);
+    put_le32(&cbw[8], size);
+    cbw[12] = read ? 0x80 : 0x00;
+    cbw[14] = 10;
+    cbw[15] = read ? 0x28 : 0x2A; /* READ(10), WRITE(10) */
+    put_be32(&cbw[17], workload_random(workload) & 0x00FFFFFF);
+    cbw[22] = (UCHAR)((size / BOT_BLOCK_SIZE) >> 8);
+    cbw[23] = (UCHAR)(size / BOT_BLOCK_SIZE);
+
+    workload_bulk(workload, 1, cbw, CBW_LENGTH, CBW_LENGTH);
+    workload_bulk(workload, read ? 0 : 1, workload->data, size, size);
+
+    memset(csw, 0, sizeof(csw));
+    put_le32(&csw[0], 0x53425355); /* USBS */
+    put_le32(&csw[4], tag);
+
+    workload_bulk(workload, 0, csw, CSW_LENGTH, CSW_LENGTH);
+}
+
+static void workload_run_cdc(PWORKLOAD_DEVICE workload)
+{
+    UINT32 length = 1 + workload_random(workload) % workload->profile.size;
+
+    workload_bulk(workload, workload_random(workload) & 1,
+                  workload->data, length, length);
+}
+
+static void workload_complete_isoch(PWORKLOAD_DEVICE workload)
+{
+    struct _URB_ISOCH_TRANSFER *transfer;
+    UINT32                      bytes = 0;
+    UINT32                      i;
+
+    transfer = &workload->urb[workload->pending]->UrbIsochronousTransfer;
+    for (i = 0; i < transfer->NumberOfPackets; i++)
+    {
+        transfer->IsoPacket[i].Length = workload->profile.size;
+        transfer->IsoPacket[i].Status = USBD_STATUS_SUCCESS;
+        bytes += workload->profile.size;
+    }
+
+    workload_complete(workload, workload->pending, bytes);
+    workload->pending = -1;
+}
+
+/* Keeps two URBs in flight like audio drivers do. Completes the older
+ * URB after the newer one is submitted.
+ */
+static void workload_run_uac(PWORKLOAD_DEVICE workload)
+{
+    struct _URB_ISOCH_TRANSFER *transfer;
+    UINT32                      count = workload->profile.count;
+    UINT32                      size = workload->profile.size;
+    int                         index;
+    UINT32                      i;
+
+    index = (workload->pending == 0) ? 1 : 0;
+    transfer = &workload->urb[index]->UrbIsochronousTransfer;
+
+    memset(transfer, 0, FIELD_OFFSET(struct _URB_ISOCH_TRANSFER, IsoPacket));
+    transfer->Hdr.Length = (USHORT)(FIELD_OFFSET(struct _URB_ISOCH_TRANSFER,
+                                                 IsoPacket) +
+                                    count * sizeof(USBD_ISO_PACKET_DESCRIPTOR));
+    transfer->Hdr.Function = URB_FUNCTION_ISOCH_TRANSFER;
+    transfer->PipeHandle = &workload->pipes[0];
+    transfer->TransferFlags = USBD_TRANSFER_DIRECTION_OUT;
+    transfer->TransferBufferLength = size * count;
+    transfer->TransferBuffer = &workload->data[index * size * count];
+    transfer->StartFrame = workload->sequence;
+    transfer->NumberOfPackets = count;
+    for (i = 0; i < count; i++)
+    {
+        transfer->IsoPacket[i].Offset = i * size;
+        transfer->IsoPacket[i].Length = 0;
+        transfer->IsoPacket[i].Status = USBD_STATUS_PENDING;
+    }
+    workload->sequence += count;
+
+    workload_submit(workload, index);
+
+    if (workload->pending != -1)
+    {
+        workload_complete_isoch(workload);
+    }
+
+    workload->pending = index;
+}
+
+/* Enumeration style burst: device, configuration header, whole
+ * configuration, language IDs and product string.
+ */
+static void workload_run_control(PWORKLOAD_DEVICE workload)
+{
+    struct _URB_CONTROL_DESCRIPTOR_REQUEST *request;
+    UINT32                                  i;
+
+    request = &workload->urb[0]->UrbControlDescriptorRequest;
+
+    for (i = 0; i < workload->profile.count; i++)
+    {
+        const UCHAR *descriptor;
+        UCHAR        string[2 + 2 * (sizeof(g_productString) - 1)];
+        UINT32       length;
+        UINT32       actual;
+        UCHAR        type;
+        UCHAR        index = 0;
+        USHORT       language = 0;
+        UINT32       j;
+
+        switch (workload->sequence++ % 5)
+        {
+            case 0:
+                type = USB_DEVICE_DESCRIPTOR_TYPE;
+                descriptor = g_deviceDescriptor;
+                length = sizeof(g_deviceDescriptor);
+                actual = length;
+                break;
+            case 1:
+                type = USB_CONFIGURATION_DESCRIPTOR_TYPE;
+                descriptor = (const UCHAR *)workload->configuration;
+                length = sizeof(USB_CONFIGURATION_DESCRIPTOR);
+                actual = length;
+                break;
+            case 2:
+                type = USB_CONFIGURATION_DESCRIPTOR_TYPE;
+                descriptor = (const UCHAR *)workload->configuration;
+                length = workload->configuration->wTotalLength;
+                actual = length;
+                break;
+            case 3:
+                type = USB_STRING_DESCRIPTOR_TYPE;
+                descriptor = g_languageDescriptor;
+                length = CONTROL_MAX_LENGTH;
+                actual = sizeof(g_languageDescriptor);
+                break;
+            default:
+                type = USB_STRING_DESCRIPTOR_TYPE;
+                index = 2;
+                language = 0x0409;
+                string[0] = sizeof(string);
+                string[1] = USB_STRING_DESCRIPTOR_TYPE;
+                for (j = 0; j < sizeof(g_productString) - 1; j++)
+                {
+                    string[2 + 2 * j] = (UCHAR)g_productString[j];
+                    string[3 + 2 * j] = 0;
+                }
+                descriptor = string;
+                length = CONTROL_MAX_LENGTH;
+                actual = sizeof(string);
+                break;
+        }
+
+        memset(request, 0, sizeof(struct _URB_CONTROL_DESCRIPTOR_REQUEST));
+        request->Hdr.Length = sizeof(struct _URB_CONTROL_DESCRIPTOR_REQUEST);
+        request->Hdr.Function = URB_FUNCTION_GET_DESCRIPTOR_FROM_DEVICE;
+        request->TransferBufferLength = length;
+        request->TransferBuffer = workload->data;
+        request->Index = index;
+        request->DescriptorType = type;
+        request->LanguageId = language;
+
+        workload_submit(workload, 0);
+        memcpy(workload->data, descriptor, actual);
+        request->TransferBufferLength = actual;
+        workload_complete(workload, 0, actual);
+    }
+}
+
+void workload_run(PWORKLOAD_DEVICE workload)
+{
+    switch (workload->profile.type)
+    {
+        case WORKLOAD_BOT:
+            workload_run_bot(workload);
+            break;
+        case WORKLOAD_HID:
+            workload_bulk(workload, 0, workload->data,
+                          workload->profile.size, workload->profile.size);
+            break;
+        case WORKLOAD_UAC:
+            workload_run_uac(workload);
+            break;
+        case WORKLOAD_CDC:
+            workload_run_cdc(workload);
+            break;
+        case WORKLOAD_CONTROL:
+            workload_run_control(workload);
+            break;
+        default:
+            break;
+    }
+}
+
+void workload_free(PWORKLOAD_DEVICE workload)
+{
+    if (workload->pending != -1)
+    {
+        workload_complete_isoch(workload);
+    }
+
+    free(workload->urb[0]);
+    free(workload->urb[1]);
+    free(workload->data);
+    free(workload->configuration);
+    workload->urb[0] = NULL;
+    workload->urb[1] = NULL;
+    workload->data = NULL;
+    workload->configuration = NULL;
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2013-2019 Tomasz Moń <desowin@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-2.0
+ */
+
+#ifndef USBPCAP_PORTABLE_WORKLOAD_H
+#define USBPCAP_PORTABLE_WORKLOAD_H
+
+#include "USBPcapMain.h"
+
+typedef enum _WORKLOAD_CLASS
+{
+    WORKLOAD_BOT,     /* Mass storage Bulk-Only Transport READ/WRITE(10) */
+    WORKLOAD_HID,     /* HID interrupt IN reports */
+    WORKLOAD_UAC,     /* USB Audio isochronous OUT stream */
+    WORKLOAD_CDC,     /* CDC ACM bulk data in both directions */
+    WORKLOAD_CONTROL, /* Bursts of GET_DESCRIPTOR requests */
+    WORKLOAD_CLASSES
+} WORKLOAD_CLASS;
+
+typedef struct _WORKLOAD_PROFILE
+{
+    WORKLOAD_CLASS  type;
+
+    /* Transactions per second, 0 for as fast as possible. Transaction is
+     * BOT command (CBW, data and CSW), HID report, UAC URB, CDC transfer
+     * or control request burst.
+     */
+    UINT32          rate;
+
+    /* BOT data length, HID report length, UAC bytes per isochronous
+     * packet, maximum CDC transfer length. Unused for control.
+     */
+    UINT32          size;
+
+    /* UAC packets per URB, control requests per burst */
+    UINT32          count;
+} WORKLOAD_PROFILE, *PWORKLOAD_PROFILE;
+
+#define WORKLOAD_MAX_PIPES  2
+
+typedef struct _WORKLOAD_DEVICE
+{
+    WORKLOAD_PROFILE      profile;
+    PUSBPCAP_DEVICE_DATA  device;
+
+    UINT32                random;   /* xorshift32 state */
+    UINT32                sequence; /* CBW tag, isoch frame, descriptor */
+
+    /* Pipe handles point to these */
+    UCHAR                 pipes[WORKLOAD_MAX_PIPES];
+
+    /* Two IRPs so UAC can have two URBs in flight */
+    IRP                   irp[2];
+    PURB                  urb[2];
+    BOOLEAN               captured[2];
+    int                   pending;  /* index of URB in flight or -1 */
+
+    PUCHAR                data;
+    UINT32                dataLength;
+    PUSB_CONFIGURATION_DESCRIPTOR configuration;
+
+    /* Completed URBs and payload bytes they transferred */
+    UINT64                urbs;
+    UINT64                bytes;
+} WORKLOAD_DEVICE, *PWORKLOAD_DEVICE;
+
+const char *workload_class_name(WORKLOAD_CLASS type);
+
+/* Parses "class[:rate[:size[:count]]]" where class is bot, hid, uac, cdc
+ * or control. Omitted or empty fields get class defaults.
+ *
+ * Returns 0 on success.
+ */
+int workload_parse(const char *spec, PWORKLOAD_PROFILE profile);
+
+/* Configures the device (SELECT_CONFIGURATION travels through the
+ * capture path like on real device enumeration). Returns 0 on success.
+ */
+int workload_init(PWORKLOAD_DEVICE workload,
+                  const WORKLOAD_PROFILE *profile,
+                  PUSBPCAP_DEVICE_DATA device,
+                  UINT32 seed);
+
+/* Completes URBs still in flight and frees resources */
+void workload_free(PWORKLOAD_DEVICE workload);
+
+/* Submits and completes URBs of single transaction. Every URB is seen
+ * by USBPcapAnalyzeURB() on submission and completion.
+ */
+void workload_run(PWORKLOAD_DEVICE workload);
+
+#endif /* USBPCAP_PORTABLE_WORKLOAD_H */